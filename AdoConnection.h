@@ -74,6 +74,7 @@
 #include "AdoStoredProcedure.h"
 #include "EventTrace.h"
 #include "ErrorMessage.h"
+#include "Metrics.h"
 
 // _CrtMemState memstate;
 
@@ -373,6 +374,8 @@ public:
          * types.)                                                                                                    *
          **************************************************************************************************************/
         bool bReturnValue = false;                                                                  // in case it fails
+        LARGE_INTEGER Started;                                                 // when Execute was called, for CMetrics
+        Started.QuadPart = 0;
         // Request ownership of the critical section.
         //WaitCount++;
         //printf ( "%d\t>> ExecuteNonQuery ( CAdoStoredProcedure& adoStoredProcedure )\n", WaitCount );
@@ -393,10 +396,11 @@ public:
                 prop->PutValue ( _variant_t ( VARIANT_TRUE, VT_BOOL )) ;
             }
             _variant_t recordsAffected (( long ) 0 );
+            QueryPerformanceCounter ( &Started );
             adoStoredProcedure.m_pCommand->Execute (       // do it! Note: this is ADO Command (vs. Connection) Execute
                 &recordsAffected,                                                                              // [out]
                 0,                                                                                 // parameters - none
-                ADODB::adCmdStoredProc );                            // options - evaluate source as a stored procedure
+                adoStoredProcedure.m_pCommand->CommandType );          // options - as constructed, usually a procedure
             if ( OracleBlob == true )
             {
                 ADODB::PropertyPtr prop = adoStoredProcedure.m_pCommand->Properties->GetItem ( "SPPrmsLOB" );
@@ -415,6 +419,10 @@ public:
                 StoredProcedureTrace ( adoStoredProcedure );
             }
         }
+        if ( Started.QuadPart != 0 )
+        {
+            CMetrics::Instance().ObserveProcedure ( adoStoredProcedure.m_nMetric, Started, bReturnValue );
+        }
         // Release ownership of the critical section.
         //LeaveCriticalSection ( &m_criticalSection );
         //WaitCount--;
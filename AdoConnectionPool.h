@@ -0,0 +1,476 @@
+/**********************************************************************************************************************
+ *                     This file contains the CAdoConnectionPool and CAdoConnectionLease classes.                     *
+ *                                                                                                                    *
+ * Opening a connection to Oracle (logging on) takes much longer than most of the procedure calls made on it, and     *
+ * when many master auditors call at once the logons themselves queue up at the database. Rather than each call (and  *
+ * CMonitor, CApplication and CFrameLogWriter) opening its own connection and closing it again when done, connections *
+ * are borrowed from the single CAdoConnectionPool with Acquire and handed back with Release, which keeps them open   *
+ * for the next borrower. A function that only needs a connection while it runs can use a CAdoConnectionLease, which  *
+ * does this in its constructor and destructor.                                                                       *
+ *                                                                                                                    *
+ * The pool holds at most "Connection Pool Size" connections, opening them as they are needed ("Connection Pool Warm" *
+ * of them are opened at startup). When all are in use, Acquire waits up to "Connection Pool Wait" milliseconds for   *
+ * one to be released. A connection that has been idle for "Connection Check Seconds" is checked (by executing an     *
+ * empty PL/SQL block) before it is lent and is reopened if that fails. If opening a connection fails, no more are    *
+ * attempted for a second, doubling up to 30 seconds while it keeps failing, so that every connection thread doesn't  *
+ * keep logging on while the database is down. The wait is varied a little so several servers don't retry together.   *
+ *                                                                                                                    *
+ * A call doesn't keep a connection while it waits for the master auditor: ProtelHost and ProtelDevice borrow one for *
+ * each stored procedure they execute and hand it straight back, so each thread making database calls holds at most   *
+ * one at a time. "Connection Pool Size" should allow for all of them at once - the "Database Workers" (16 by         *
+ * default, or the reactor loops when that is 0), the "DEX Writers" (4) and "Device Prefetchers" (2), and one each    *
+ * for CFrameLogWriter, CMonitor and the polling thread: 25 of the default 32. If it is smaller, busy periods wait in *
+ * Acquire, and an operation that still gets none (after "Connection Pool Wait") fails cleanly.                       *
+ *                                                                                                                    *
+ * A connection held for more than "Connection Lease Seconds" is reported (it can't be taken back, since its holder   *
+ * may still be using it). The number of connections lent, the time spent waiting for them and the number in use are  *
+ * recorded when the pool is stopped. With "Connection Pool Size" set to 0, Acquire opens a new connection each time  *
+ * and Release closes it, as before.                                                                                  *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+#include "AdoConnection.h"
+#include "AdoStoredProcedure.h"
+#include "EventTrace.h"
+#include "ProfileValues.h"
+
+#define ADOCONNECTIONPOOL_MAXSIZE       256                                             // most connections ever pooled
+#define ADOCONNECTIONPOOL_BACKOFFMS     1000                                         // first wait after a failed logon
+#define ADOCONNECTIONPOOL_MAXBACKOFFMS  30000                                       // longest wait after failed logons
+#define ADOCONNECTIONPOOL_POLLMS        100                    // a waiting Acquire checks the pool at least this often
+
+class CAdoConnectionPool
+ {
+public:
+    static CAdoConnectionPool& Instance ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the single pool shared by every thread. CApplication::Start calls it (to Warm the pool)       *
+         * before any connection threads are started, so it is constructed then.                                      *
+         **************************************************************************************************************/
+        static CAdoConnectionPool adoConnectionPool;
+        return adoConnectionPool;
+    }
+
+    void Warm ( void )
+    {
+        /**************************************************************************************************************
+         * This opens up to "Connection Pool Warm" connections, so that the first calls don't have to wait for them.  *
+         **************************************************************************************************************/
+        CProfileValues profileValues;
+        int nWarm = profileValues.GetConnectionPoolWarm();
+        CAdoConnection* pConnections [ ADOCONNECTIONPOOL_MAXSIZE ];
+        int nOpened = 0;
+        while ( nOpened < nWarm && nOpened < m_nSize )
+        {
+            pConnections [ nOpened ] = Acquire();
+            if ( pConnections [ nOpened ] == NULL )
+            {
+                break;
+            }
+            nOpened++;
+        }
+        while ( nOpened > 0 )
+        {
+            Release ( pConnections [ --nOpened ] );
+        }
+    }
+
+    void Stop ( void )
+    {
+        /**************************************************************************************************************
+         * This is used once everything using the database has stopped. It closes the idle connections (any still     *
+         * lent are closed when they are released) and records the totals as an event.                                *
+         **************************************************************************************************************/
+        EnterCriticalSection ( &m_criticalSection );
+        m_bStopped = true;
+        for ( int nLoop = m_nCount - 1; nLoop >= 0; nLoop-- )
+        {
+            if ( m_Pooled [ nLoop ].bLeased == false )
+            {
+                delete m_Pooled [ nLoop ].pConnection;
+                Remove ( nLoop );
+            }
+        }
+        LeaveCriticalSection ( &m_criticalSection );
+
+        m_EventTrace.Event ( CEventTrace::Information,
+            "CAdoConnectionPool::Stop - %I64d connections lent (waited %I64d ms in total, %d ms at most), %d in use"
+            " (%d at most), %d opened, %d logons failed, %d checks failed, %d waits timed out, %d leases overran",
+            m_nAcquired, m_nWaitMilliseconds, m_nMaxWaitMilliseconds, m_nInUse, m_nPeakInUse, m_nOpened,
+            m_nOpenFailures, m_nCheckFailures, m_nTimeouts, m_nLeaseOverruns );
+    }
+
+    CAdoConnection* Acquire ( void )
+    {
+        /**************************************************************************************************************
+         * This lends an open connection, opening a new one if none is free and the pool isn't full. If it can't,     *
+         * it waits up to "Connection Pool Wait" milliseconds for one to be released (or for the next logon attempt)  *
+         * and returns NULL if there still isn't one. The connection must be handed back with Release.                *
+         **************************************************************************************************************/
+        DWORD dwStarted = GetTickCount();
+        for ( ;; )
+        {
+            DWORD dwNow = GetTickCount();
+            CAdoConnection* pConnection = NULL;
+            bool bCheck = false;
+            bool bOpen = false;
+
+            EnterCriticalSection ( &m_criticalSection );
+            CheckLeases ( dwNow );
+            for ( int nLoop = m_nCount - 1; nLoop >= 0; nLoop-- )                           // most recently used first
+            {
+                if ( m_Pooled [ nLoop ].bLeased == false )
+                {
+                    pConnection = m_Pooled [ nLoop ].pConnection;
+                    bCheck = dwNow - m_Pooled [ nLoop ].dwSince >= ( DWORD ) m_nCheckSeconds * 1000;
+                    Lend ( nLoop, dwNow );
+                    break;
+                }
+            }
+            if ( pConnection == NULL && ( m_nCount < m_nSize || m_nSize <= 0 )
+                && ( long )( dwNow - m_dwRetryDue ) >= 0 )
+            {
+                pConnection = new CAdoConnection;
+                bOpen = true;
+                if ( m_nSize > 0 )
+                {
+                    m_Pooled [ m_nCount ].pConnection = pConnection;                     // reserved while it is opened
+                    Lend ( m_nCount++, dwNow );
+                }
+                else if ( ++m_nInUse > m_nPeakInUse )                              // not pooled - counted here instead
+                {
+                    m_nPeakInUse = m_nInUse;
+                }
+            }
+            LeaveCriticalSection ( &m_criticalSection );
+
+            if ( pConnection != NULL )
+            {
+                if ( bCheck == true && Check ( pConnection ) == false )
+                {
+                    InterlockedIncrement ( &m_nCheckFailures );
+                    bOpen = true;                                                  // reopen it - it may have been lost
+                }
+                if ( bOpen == false || Open ( pConnection ) == true )
+                {
+                    Acquired ( GetTickCount() - dwStarted );
+                    return pConnection;
+                }
+                Release ( pConnection, true );
+            }
+
+            DWORD dwWaited = GetTickCount() - dwStarted;
+            if ( dwWaited >= ( DWORD ) m_nWait )
+            {
+                InterlockedIncrement ( &m_nTimeouts );
+                return NULL;
+            }
+            DWORD dwWait = ( DWORD ) m_nWait - dwWaited;
+            WaitForSingleObject ( m_hReleased, dwWait < ADOCONNECTIONPOOL_POLLMS ? dwWait : ADOCONNECTIONPOOL_POLLMS );
+        }
+    }
+
+    void Release ( CAdoConnection* pConnection, bool Broken = false )
+    {
+        /**************************************************************************************************************
+         * This hands back a connection lent by Acquire, so it can be lent again. It is closed instead if the pool    *
+         * isn't used ("Connection Pool Size" is 0) or has stopped, or if the holder found it Broken (e.g. it         *
+         * couldn't be reopened after a procedure failed), so that it isn't lent again.                               *
+         **************************************************************************************************************/
+        if ( pConnection == NULL )
+        {
+            return;
+        }
+        bool bPooled = false;
+        EnterCriticalSection ( &m_criticalSection );
+        for ( int nLoop = 0; nLoop < m_nCount; nLoop++ )
+        {
+            if ( m_Pooled [ nLoop ].pConnection == pConnection )
+            {
+                if ( m_bStopped == true || Broken == true )
+                {
+                    Remove ( nLoop );
+                    break;
+                }
+                m_Pooled [ nLoop ].bLeased = false;
+                m_Pooled [ nLoop ].dwSince = GetTickCount();
+                bPooled = true;
+                break;
+            }
+        }
+        m_nInUse--;
+        LeaveCriticalSection ( &m_criticalSection );
+        if ( bPooled == true )
+        {
+            SetEvent ( m_hReleased );                                                 // wake a waiting Acquire, if any
+            return;
+        }
+        delete pConnection;
+    }
+
+    int GetInUse ( void )
+    {
+        return m_nInUse;
+    }
+    __declspec(property(get = GetInUse)) int InUse;
+
+    int GetPeakInUse ( void )
+    {
+        return m_nPeakInUse;
+    }
+    __declspec(property(get = GetPeakInUse)) int PeakInUse;
+
+    int GetSize ( void )
+    {
+        return m_nSize;
+    }
+    __declspec(property(get = GetSize)) int Size;
+
+    void GetTotals ( __int64& Acquired, __int64& WaitMilliseconds, int& MaxWaitMilliseconds, int& Opened,
+        int& OpenFailures, int& CheckFailures, int& Timeouts, int& LeaseOverruns )
+    {
+        /**************************************************************************************************************
+         * This returns the totals since startup.                                                                     *
+         **************************************************************************************************************/
+        EnterCriticalSection ( &m_criticalSection );
+        Acquired = m_nAcquired;
+        WaitMilliseconds = m_nWaitMilliseconds;
+        MaxWaitMilliseconds = m_nMaxWaitMilliseconds;
+        Opened = m_nOpened;
+        OpenFailures = m_nOpenFailures;
+        CheckFailures = m_nCheckFailures;
+        Timeouts = m_nTimeouts;
+        LeaseOverruns = m_nLeaseOverruns;
+        LeaveCriticalSection ( &m_criticalSection );
+    }
+
+private:
+    struct SPooled
+    {
+        CAdoConnection* pConnection;
+        bool bLeased;                                                                  // lent by Acquire, not released
+        bool bOverrun;                                                          // lent for longer than m_nLeaseSeconds
+        DWORD dwSince;                                                         // when it was lent, or released if idle
+    };
+
+    CAdoConnectionPool(void) :
+        m_nCount ( 0 ),
+        m_bStopped ( false ),
+        m_dwRetryDue ( GetTickCount()),
+        m_nBackoff ( 0 ),
+        m_nInUse ( 0 ),
+        m_nPeakInUse ( 0 ),
+        m_nAcquired ( 0 ),
+        m_nWaitMilliseconds ( 0 ),
+        m_nMaxWaitMilliseconds ( 0 ),
+        m_nOpened ( 0 ),
+        m_nOpenFailures ( 0 ),
+        m_nCheckFailures ( 0 ),
+        m_nTimeouts ( 0 ),
+        m_nLeaseOverruns ( 0 )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+        InitializeCriticalSection ( &m_criticalSection );
+        m_hReleased = CreateEvent(
+            NULL,                                                            // lpEventAttributes [in] - NULL = default
+            FALSE,                                                                    // bManualReset [in] - auto reset
+            FALSE,                                                                // bInitialState [in] - not signalled
+            NULL );                                                                     // lpName [in] - NULL = unnamed
+
+        CProfileValues profileValues;
+        m_nSize = profileValues.GetConnectionPoolSize();
+        m_nWaitMilliseconds = 0;
+        m_nWait = profileValues.GetConnectionPoolWait();
+        m_nCheckSeconds = profileValues.GetConnectionCheckSeconds();
+        m_nLeaseSeconds = profileValues.GetConnectionLeaseSeconds();
+        if ( m_nSize > ADOCONNECTIONPOOL_MAXSIZE )
+        {
+            m_nSize = ADOCONNECTIONPOOL_MAXSIZE;
+        }
+        if ( m_nWait < 0 )
+        {
+            m_nWait = 0;
+        }
+    }
+
+    virtual ~CAdoConnectionPool(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR. The connections are closed by Stop, while the COM library is still initialised.                *
+         **************************************************************************************************************/
+        CloseHandle ( m_hReleased );
+        DeleteCriticalSection ( &m_criticalSection );
+    }
+
+    void Lend ( int Index, DWORD Now )
+    {
+        /**************************************************************************************************************
+         * This marks the connection at Index as lent. The caller holds m_criticalSection.                            *
+         **************************************************************************************************************/
+        m_Pooled [ Index ].bLeased = true;
+        m_Pooled [ Index ].bOverrun = false;
+        m_Pooled [ Index ].dwSince = Now;
+        if ( ++m_nInUse > m_nPeakInUse )
+        {
+            m_nPeakInUse = m_nInUse;
+        }
+    }
+
+    void Remove ( int Index )
+    {
+        /**************************************************************************************************************
+         * This removes the connection at Index from the pool (without closing it), moving the last one into its      *
+         * place. The caller holds m_criticalSection.                                                                 *
+         **************************************************************************************************************/
+        m_Pooled [ Index ] = m_Pooled [ --m_nCount ];
+    }
+
+    bool Open ( CAdoConnection* pConnection )
+    {
+        /**************************************************************************************************************
+         * This opens (or reopens) pConnection using the connection string in the profile and returns TRUE on         *
+         * success. On failure the next logon is put off for the backoff time, which doubles each time (up to         *
+         * ADOCONNECTIONPOOL_MAXBACKOFFMS) until a logon succeeds, varied by up to a half to spread retries. It       *
+         * returns FALSE at once, without trying, while the backoff hasn't passed.                                    *
+         **************************************************************************************************************/
+        EnterCriticalSection ( &m_criticalSection );
+        bool bDue = ( long )( GetTickCount() - m_dwRetryDue ) >= 0;
+        LeaveCriticalSection ( &m_criticalSection );
+        if ( bDue == false )
+        {
+            return false;                                                      // e.g. a check failed while backing off
+        }
+        CProfileValues profileValues;
+        bool bOpened = pConnection->ConnectionStringOpen ( profileValues.GetConnectionString());
+        EnterCriticalSection ( &m_criticalSection );
+        if ( bOpened == true )
+        {
+            m_nOpened++;
+            m_nBackoff = 0;
+        }
+        else
+        {
+            m_nOpenFailures++;
+            m_nBackoff = m_nBackoff == 0 ? ADOCONNECTIONPOOL_BACKOFFMS : m_nBackoff * 2;
+            if ( m_nBackoff > ADOCONNECTIONPOOL_MAXBACKOFFMS )
+            {
+                m_nBackoff = ADOCONNECTIONPOOL_MAXBACKOFFMS;
+            }
+            DWORD dwJitter = ( GetTickCount() * 2654435761 ) % ( m_nBackoff / 2 + 1 );     // Knuth multiplicative hash
+            m_dwRetryDue = GetTickCount() + m_nBackoff / 2 + dwJitter;
+            m_EventTrace.Event ( CEventTrace::Information,
+                "CAdoConnectionPool::Open <--> ERROR: logon failed, next attempt in %d ms",
+                m_nBackoff / 2 + dwJitter );
+        }
+        LeaveCriticalSection ( &m_criticalSection );
+        return bOpened;
+    }
+
+    bool Check ( CAdoConnection* pConnection )
+    {
+        /**************************************************************************************************************
+         * This returns TRUE if pConnection still works, by executing an empty PL/SQL block on it.                    *
+         **************************************************************************************************************/
+        CAdoStoredProcedure adoStoredProcedure ( "BEGIN NULL; END;", ADODB::CommandTypeEnum::adCmdText );
+        return pConnection->ExecuteNonQuery ( adoStoredProcedure, true );
+    }
+
+    void Acquired ( DWORD Waited )
+    {
+        /**************************************************************************************************************
+         * This adds a connection lent after Waited milliseconds to the totals.                                       *
+         **************************************************************************************************************/
+        EnterCriticalSection ( &m_criticalSection );
+        m_nAcquired++;
+        m_nWaitMilliseconds += Waited;
+        if (( int ) Waited > m_nMaxWaitMilliseconds )
+        {
+            m_nMaxWaitMilliseconds = Waited;
+        }
+        LeaveCriticalSection ( &m_criticalSection );
+    }
+
+    void CheckLeases ( DWORD Now )
+    {
+        /**************************************************************************************************************
+         * This reports each connection that has been lent for longer than "Connection Lease Seconds" (once per       *
+         * lease). The caller holds m_criticalSection.                                                                *
+         **************************************************************************************************************/
+        for ( int nLoop = 0; nLoop < m_nCount; nLoop++ )
+        {
+            SPooled* pPooled = &m_Pooled [ nLoop ];
+            if ( pPooled->bLeased == true && pPooled->bOverrun == false
+                && Now - pPooled->dwSince >= ( DWORD ) m_nLeaseSeconds * 1000 )
+            {
+                pPooled->bOverrun = true;
+                m_nLeaseOverruns++;
+                m_EventTrace.Event ( CEventTrace::Details,
+                    "CAdoConnectionPool::CheckLeases - a connection has been lent for %d seconds",
+                    ( Now - pPooled->dwSince ) / 1000 );
+            }
+        }
+    }
+
+    CRITICAL_SECTION m_criticalSection;                                                    // protects everything below
+    HANDLE m_hReleased;                                                            // set when a connection is released
+    SPooled m_Pooled [ ADOCONNECTIONPOOL_MAXSIZE ];                                        // idle and lent connections
+    int m_nCount;                                                                            // connections in m_Pooled
+    bool m_bStopped;                                                               // Release closes connections if set
+    int m_nSize;                                                                              // "Connection Pool Size"
+    int m_nWait;                                                                         // "Connection Pool Wait" (ms)
+    int m_nCheckSeconds;                                                                  // "Connection Check Seconds"
+    int m_nLeaseSeconds;                                                                  // "Connection Lease Seconds"
+    DWORD m_dwRetryDue;                                                            // no logon is attempted before this
+    int m_nBackoff;                                                         // current backoff after failed logons (ms)
+    int m_nInUse;                                                                               // connections lent now
+    int m_nPeakInUse;                                                                  // most connections lent at once
+    __int64 m_nAcquired;                                                              // connections lent since startup
+    __int64 m_nWaitMilliseconds;                                              // time Acquire waited for them, in total
+    int m_nMaxWaitMilliseconds;                                                          // longest time Acquire waited
+    volatile LONG m_nOpened;                                                                       // successful logons
+    volatile LONG m_nOpenFailures;                                                                     // failed logons
+    volatile LONG m_nCheckFailures;                                                    // idle connections found broken
+    volatile LONG m_nTimeouts;                                               // Acquire gave up waiting (returned NULL)
+    volatile LONG m_nLeaseOverruns;                                                    // connections lent for too long
+    CEventTrace m_EventTrace;                                                      // records events - see EventTrace.h
+ };
+
+class CAdoConnectionLease
+ {
+public:
+    CAdoConnectionLease(void)
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR. This borrows a connection from the pool (NULL if none could be had - see Acquire).            *
+         **************************************************************************************************************/
+        m_pConnection = CAdoConnectionPool::Instance().Acquire();
+    }
+
+    virtual ~CAdoConnectionLease(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR. This hands the connection back.                                                                *
+         **************************************************************************************************************/
+        CAdoConnectionPool::Instance().Release ( m_pConnection );
+    }
+
+    CAdoConnection* operator-> ( void )
+    {
+        return m_pConnection;
+    }
+
+    CAdoConnection* GetConnection ( void )
+    {
+        return m_pConnection;
+    }
+    __declspec(property(get = GetConnection)) CAdoConnection* Connection;
+
+private:
+    CAdoConnection* m_pConnection;
+ };
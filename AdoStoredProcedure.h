@@ -10,6 +10,13 @@
  * The procedure can then be executed using the ExecuteNonQuery method of the CAdoConnection to the database, passing *
  * it this class. Returned values can be obtained afterwards using the GetParameter method of this object.            *
  *                                                                                                                    *
+ * It can also be constructed with the text of an anonymous PL/SQL block (CommandType adCmdText) whose parameters are *
+ * given as '?' and added, in order, with AddParameter (e.g. CFrameLogWriter calls PKG_COMM_SERVER.LOG for a batch of *
+ * frames in one round trip this way).                                                                                *
+ *                                                                                                                    *
+ * Each stored procedure is looked up by name in CMetrics when constructed, so ExecuteNonQuery can record how long it *
+ * took without looking it up again. Anonymous blocks are all recorded together.                                      *
+ *                                                                                                                    *
  *                                         Copyright (c) Protel Inc. 2009-2010                                        *
  **********************************************************************************************************************/
 
@@ -17,17 +24,21 @@
 
 #include "AdoConnection.h"
 #include "ErrorMessage.h"
+#include "Metrics.h"
 
 class CAdoStoredProcedure
  {
     friend class CAdoConnection;
 //    friend class CAdoRecordset; // doesn't seem to do anything!!!!
 public:
-    CAdoStoredProcedure ( LPCTSTR pszCommandText )
+    CAdoStoredProcedure ( LPCTSTR pszCommandText,
+        ADODB::CommandTypeEnum CommandType = ADODB::CommandTypeEnum::adCmdStoredProc )
     {
         /**************************************************************************************************************
          * CONSTRUCTOR.                                                                                               *
          **************************************************************************************************************/
+        m_nMetric = CMetrics::Instance().GetProcedure (
+            CommandType == ADODB::CommandTypeEnum::adCmdStoredProc ? pszCommandText : "anonymous block" );
         try
         {
             HRESULT hResult = m_pCommand.CreateInstance ( __uuidof  ( ADODB::Command ));
@@ -38,7 +49,7 @@ public:
 
             _bstr_t bstrCommand ( pszCommandText );
             m_pCommand->CommandText = bstrCommand;
-            m_pCommand->CommandType = ADODB::CommandTypeEnum::adCmdStoredProc;
+            m_pCommand->CommandType = CommandType;
         }
         catch (_com_error &comError)
         {
@@ -108,4 +119,5 @@ public:
 
 protected:
     ADODB::_CommandPtr m_pCommand;  // the command. (It has member ActiveConnection which must be set before executing)
+    int m_nMetric;                               // its number in CMetrics (see CMetrics::GetProcedure), -1 = not timed
  };
@@ -6,8 +6,10 @@
 #include "SocketListener.h"
 #include "ProtelSerial.h"
 #include "ProtelSocket.h"
+#include "ManualPolls.h"
 #include "ProfileValues.h"
 #include "EventTrace.h"
+#include "FileWatcher.h"
 #include <time.h>
 
 // I am *HARD*CODING* this connection string - BECAUSE
@@ -31,6 +33,11 @@ protected:
 	bool UseModems;
 	bool UseSockets;
 	CMonitor* m_pMonitor;
+	CSerialReactor m_SerialReactor;		// one thread handles every modem (see SerialReactor.h)
+	CDialScheduler m_DialScheduler;		// places manual polls on every free modem (see DialScheduler.h)
+	CManualPolls m_ManualPolls;			// claims manual polls in batches for it (see ManualPolls.h)
+	HANDLE m_hPollingThread;
+	HANDLE m_hListenThread;				// ends every connection it accepted before it exits (see SocketListener.h)
 	bool m_bThreadRunning;
 	CEventTrace m_EventTrace;
 
@@ -42,6 +49,8 @@ public:
 		m_protelList = NULL;
 		m_hShutDown = NULL;
 		m_hProfileChanged = NULL;
+		m_hPollingThread = NULL;
+		m_hListenThread = NULL;
 
 		m_bThreadRunning = false;
 		CProfileValues profileValues;
@@ -67,14 +76,32 @@ public:
 		// This function makes a call into the Oracle database and waits to return until
 		// the oracle DLLs are loaded and the oracle procedure complete!!!
 		m_pMonitor = new CMonitor();
+		CAdoConnectionPool::Instance().Warm();	// open the first database connections before any calls arrive
+		CEventSink::Instance().Start();			// events are written by its thread unless "Event Flush Milliseconds" is 0
+		CMetrics::Instance().Start();			// metrics are served on 127.0.0.1 unless "Metrics Port" is 0
 
 		m_hShutDown = CreateEvent( NULL, TRUE, FALSE, NULL );
 		m_hProfileChanged = CreateEvent( NULL, TRUE, FALSE, NULL );
+		{
+			CProfileValues profileValues;
+			CFileWatcher::InitializeWatcher( m_hShutDown, m_hProfileChanged, profileValues.GetIniFileName());	// sets m_hProfileChanged when the .INI file is edited
+		}
 		m_protelList = new CProtelList();
+		CRttHistory::Instance();				// construct the shared response time history before any connections start
+		CCallTracer::Instance();				// construct the list of call timelines before any connections start
+		CFrameLogWriter::Instance().Start();	// frames are logged by its thread unless "Frame Log Batch" is 0
+		CDexWriter::Instance().Start();		// DEX records are saved by its threads unless "DEX Writers" is 0
+		CImageCache::Instance().Start();		// firmware and configurations are shared unless "Image Cache Kilobytes" is 0
+		CDevicePrefetcher::Instance().Start();	// devices are looked up during the call unless "Device Prefetchers" is 0
+		CDatabaseWorkers::Instance().Start();	// the reactors' database calls are made by its threads unless "Database Workers" is 0
 
 		if ( UseModems == true )
 		{
 			CEventTrace eventTrace;
+			if ( m_SerialReactor.Start() == false )
+			{
+				eventTrace.Event( CEventTrace::SevereError, "Error (%ld) starting serial reactor.", GetLastError());
+			}
 
 			CModemNames ModemNames;
 			int Offset = 0;
@@ -92,15 +119,17 @@ public:
 
 				CProtelSerial* protelSerial = new CProtelSerial ( m_hShutDown, ModemNames.Names[Offset], szPortName, CommandTermination::CRLF );
 				m_protelList->Add( protelSerial );
+				m_DialScheduler.AddPort( protelSerial );	// before attaching, so it hears when the modem is first ready
+				m_SerialReactor.Attach( protelSerial );	// the reactor's thread sets the modem up (CProtelSerial::OnStart)
 			}
 		}
 
 		if ( UseSockets == true )
 		{
-			CSocketListener::InitializeListener( m_protelList, &m_hShutDown );
+			m_hListenThread = CSocketListener::InitializeListener( m_protelList, &m_hShutDown );
 		}
 
-		HANDLE hMonitorThread = CreateThread( NULL, 0, InitializePolling, this, 0, NULL );
+		m_hPollingThread = CreateThread( NULL, 0, InitializePolling, this, 0, NULL );
 
 #if _DEBUG
 		//Sleep( 15000 );
@@ -120,18 +149,10 @@ public:
 #ifdef _DEBUG
 		OutputDebugString ( "CApplication::Stop()\n" );
 #endif
-		if( m_protelList != NULL )
-		{
-			CProtelHost* protelHost = m_protelList->MoveFirst();
-			while ( protelHost != NULL )
-			{
-#ifdef _DEBUG
-				OutputDebugString ( "CApplication::Stop() -->Shutting down CProtelHost\n" );
-#endif
-				protelHost->Shutdown();
-				protelHost = m_protelList->Next();
-			}
-		}
+		// Each connection is ended on the thread that runs it, never from here: the serial reactor's
+		// thread resets every modem, and the listener's socket reactor ends each connection on its
+		// own loop once m_hShutDown is set below.
+		m_SerialReactor.Stop();					// resets every modem, then lets go of them (see CProtelSerial::OnStop)
 
 		if ( m_pMonitor != NULL )
 		{
@@ -146,6 +167,19 @@ public:
 		Sleep ( 250 );
 		SetEvent( m_hShutDown );
 		Sleep ( 250 );
+		if ( m_hPollingThread != NULL )
+		{
+			WaitForSingleObject( m_hPollingThread, INFINITE );	// it finishes the polls still queued, then uses no modem
+			CloseHandle( m_hPollingThread );
+			m_hPollingThread = NULL;
+		}
+		if ( m_hListenThread != NULL )
+		{
+			WaitForSingleObject( m_hListenThread, INFINITE );	// its reactor has closed every connection and it has destroyed them
+			CloseHandle( m_hListenThread );
+			m_hListenThread = NULL;
+		}
+		CDatabaseWorkers::Instance().Stop();	// the reactors have stopped, so no work is left queued
 
 		if( m_protelList != NULL )
 		{
@@ -157,6 +191,14 @@ public:
 			m_protelList = NULL;
 		}
 
+		CDevicePrefetcher::Instance().Stop();	// settles the device plans still queued
+		CDexWriter::Instance().Stop();			// saves the DEX records still queued
+		CFrameLogWriter::Instance().Stop();		// writes the frames still queued
+		CImageCache::Instance().Stop();			// records how often images were shared
+		CAdoConnectionPool::Instance().Stop();	// closes the idle database connections
+		CMetrics::Instance().Stop();			// stops serving the metrics
+		CEventSink::Instance().Stop();			// writes the events still recorded, then writes each as it comes
+
 		CloseHandle( m_hShutDown );
 		m_hShutDown = NULL;
 
@@ -212,266 +254,67 @@ protected:
 			CProfileValues profileValues;
 			dwSeconds = profileValues.GetManualPolling();
 		}
-		DWORD WaitTime = dwSeconds * 1000;
-		//DWORD Seconds = 1000;
-		//DWORD Minutes = Seconds * 60;
-		//DWORD WaitTime = Minutes * 5;
+		DWORD Period = dwSeconds * 1000;
 		//m_EventTrace.Event( CEventTrace::Details, "START -- void CApplication::ThreadProc(void)" );
+		m_ManualPolls.Recover();		// any polls still held when the server last stopped
+
+		// Besides every Period, polls are placed whenever a modem is ready again after a call
+		// (m_DialScheduler's idle event), so a free modem doesn't wait for the period to end.
+		HANDLE hWaitObjects [ 3 ];
+		hWaitObjects [ 0 ] = m_hShutDown;
+		hWaitObjects [ 1 ] = m_hProfileChanged;
+		hWaitObjects [ 2 ] = m_DialScheduler.GetIdleEvent();
+		DWORD dwNextPeriod = GetTickCount() + Period;
 		while ( true )
 		{
-			DWORD dwResult = WaitForSingleObject( m_hShutDown, WaitTime );
-			if ( dwResult == WAIT_OBJECT_0 )
+			DWORD WaitTime = dwNextPeriod - GetTickCount();
+			if (( long ) WaitTime < 0 )
 			{
-				break;
+				WaitTime = 0;
 			}
-			GetManualPoll();
-		}
-	}
-
-	void GetManualPoll (void)
-	{
-		// First--See if *any* Modems are capable of making an outbound call!
-		// If there aren't any available, there is no use to dequeue a request
-		// and go through the rest of the procedure.
-
-		time_t TargetTime;
-		time ( &TargetTime );
-		TargetTime -= 60;
-
-		CProtelHost* protelHost = m_protelList->MoveFirst();
-#if FALSE
-		while ( protelHost != NULL )
-		{
-			CProtelSerial* protelSerial = dynamic_cast<CProtelSerial*>(protelHost);
-			if ( protelSerial != NULL )
+			DWORD dwResult = WaitForMultipleObjects( sizeof ( hWaitObjects ) / sizeof ( hWaitObjects [ 0 ] ), hWaitObjects, FALSE, WaitTime );
+			if ( dwResult == WAIT_OBJECT_0 )
 			{
-				if ( protelSerial->AvailableToDial() == false )
-				{
-					if ( protelSerial->LastActivity < TargetTime )
-					{
-						protelSerial->StopThisCall();
-					}
-				}
+				break;
 			}
-			protelHost = m_protelList->Next();
-		}
-#endif
-
-		bool AvailableToDial = false;
-		protelHost = m_protelList->MoveFirst();
-		while ( protelHost != NULL )
-		{
-			CProtelSerial* protelSerial = dynamic_cast<CProtelSerial*>(protelHost);
-			if ( protelSerial != NULL )
+			if ( dwResult == WAIT_OBJECT_0 + 1 )
 			{
-				if ( protelSerial->AvailableToDial() == true )
-				{
-					AvailableToDial = true;
-					break;
-				}
+				// The .INI file was edited (see CFileWatcher). CProfileValues constructed from now on
+				// return its new values, including the period between polling calls.
+				ResetEvent( m_hProfileChanged );
+				CProfileValues::Reload();
+				CProfileValues profileValues;
+				Period = profileValues.GetManualPolling() * 1000;
+				dwNextPeriod = GetTickCount() + Period;
+				m_EventTrace.Event( CEventTrace::Information, "CApplication::ThreadProc - %s reloaded", profileValues.GetIniFileName());
+				continue;
 			}
-			protelHost = m_protelList->Next();
-		}
-		if ( AvailableToDial == false )
-		{
-			return;
-		}
-#if 0
-		static bool bFirstPass = true;
-		if ( bFirstPass == true )
-		{
-			bFirstPass = false;
-			CProtelHost* protelHost = m_protelList->MoveFirst();
-			while ( protelHost != NULL )
+			if ( dwResult == WAIT_TIMEOUT )
 			{
-				CProtelSerial* protelSerial = dynamic_cast<CProtelSerial*>(protelHost);
-				if ( protelSerial != NULL )
-				{
-					if ( protelSerial->Dial( "6073509", 0, ( double ) 0 ) == true )
-					{
-						break;
-					}
-				}
-				protelHost = m_protelList->Next();
+				dwNextPeriod = GetTickCount() + Period;
 			}
+			SchedulePolls();
 		}
-		return;
-#endif
-		//procedure getManualPoll (
-		//   po_call_number out integer, 
-		//   pi_modems    in     smallint,
-		//   pi_sockets   in     smallint,
-		//   po_auditor      out varchar2,
-		//--                   po_esn          out varchar2, --Removed per email with David p
-		//   po_call_start_time   in     timestamp default null,
-		//   po_central_auditor in varchar2  default null,                   
-		//   po_phone_nr out varchar2
-		//   , pi_call_type integer default 1 --Land line
-		//   , pi_wait  in integer default dbms_aq.no_wait
-		//    );
-		char szAuditor [ 1024 ];
-		long EIN;
-		double callStartTime;
-		char szCentralAuditor [ 1024 ];
-		long CallNumber;
-		char szPhoneNumber [ 1024 ];
-
-		char szCallStartTime [ 64 ];
-		char szCallStartTimeMS [ 64 ];
-		char szCallNumber [ 64 ];
-
-		ZeroMemory ( szAuditor, sizeof ( szAuditor ));
-		EIN = 0;
-		callStartTime = ( double ) 0;
-		ZeroMemory ( szCentralAuditor, sizeof ( szCentralAuditor ));
-		CallNumber = 0;
-		ZeroMemory ( szPhoneNumber, sizeof ( szPhoneNumber ));
 
-		CProfileValues profileValues;
-		CAdoConnection adoConnection;
-		adoConnection.ConnectionStringOpen( profileValues.GetConnectionString());
-		CAdoStoredProcedure adoStoredProcedure ( "PKG_COMM_SERVER.getManualPoll" );
-
-		_variant_t vtCallNumber (( long ) 0, VT_I4 );
-		adoStoredProcedure.AddParameter( "po_call_number", vtCallNumber, ADODB::DataTypeEnum::adInteger, ADODB::ParameterDirectionEnum::adParamOutput, sizeof ( long ));
-
-		_variant_t vtModems (( short ) 1, VT_I2 );
-		adoStoredProcedure.AddParameter("pi_modems", vtModems, ADODB::adInteger, ADODB::adParamInput, sizeof ( short ));
-
-		_variant_t vtSockets (( short ) 0, VT_I2 );
-		adoStoredProcedure.AddParameter("pi_sockets", vtSockets, ADODB::adInteger, ADODB::adParamInput, sizeof ( short ));
-
-		_variant_t vtAuditor ( _bstr_t ( "" ));
-		adoStoredProcedure.AddParameter("po_auditor", vtAuditor, ADODB::adBSTR, ADODB::adParamOutput, 64 );
-
-// Added to force getmanual poll to work.... via bug 3016 7/7/2011   adParamInputOutput
-		double TdCallStartTime;
-        SYSTEMTIME TCallStartTime;
-        GetSystemTime ( &TCallStartTime );
-        SystemTimeToVariantTime ( &TCallStartTime, &TdCallStartTime );
-// end added code
-            _variant_t vtCallStartTime ( TdCallStartTime, VT_DATE );     // Note: time was set by ProtelHost::Initialize
-            adoStoredProcedure.AddParameter( "pio_CALL_START_TIME", vtCallStartTime, ADODB::DataTypeEnum::adDate, ADODB::ParameterDirectionEnum::adParamInputOutput, sizeof ( double ));
-// this code works and will replace the 2 commented out lines below. WJS 7/7/2011
-
-		//_variant_t vtCallStartTime (( double ) VT_NULL, VT_DATE );
-		//adoStoredProcedure.AddParameter( "po_call_start_time", vtCallStartTime, ADODB::DataTypeEnum::adDBTimeStamp, ADODB::ParameterDirectionEnum::adParamOutput, sizeof ( double ));
-
-		_variant_t vtCentralAuditor ( _bstr_t ( "" ));
-		adoStoredProcedure.AddParameter("po_central_auditor", vtCentralAuditor, ADODB::adBSTR, ADODB::adParamOutput, 64 );
-
-		_variant_t vtPhoneNumber ( _bstr_t ( "" ));
-		adoStoredProcedure.AddParameter("po_phone_nr", vtPhoneNumber, ADODB::adBSTR, ADODB::adParamOutput, 64 );
-
-		_variant_t vtCallType (( short ) 1, VT_I2 );
-		adoStoredProcedure.AddParameter("pi_call_type", vtCallType, ADODB::adInteger, ADODB::adParamInput, sizeof ( short ));
-
-
-#if _DEBUG
-		//adoConnection.StoredProcedureTrace ( &adoStoredProcedure );
-#endif
-
-		bool bExecutedSuccessfully = adoConnection.ExecuteNonQuery( adoStoredProcedure, false );
-		if ( bExecutedSuccessfully == false )
-		{
-			//OutputDebugString ( "TIMEOUT OCCURRED!\n" );
-			return;
-		}
-
-		vtAuditor = adoStoredProcedure.GetParameter("po_auditor");
-		_bstr_t bstrAuditor (( _bstr_t ) vtAuditor );
-		StringCbCopy ( szAuditor, sizeof ( szAuditor ), ( const char* ) bstrAuditor );
-
-		vtCallStartTime = adoStoredProcedure.GetParameter("pio_call_start_time");
-		callStartTime = ( double ) vtCallStartTime;
+		m_ManualPolls.Release( m_DialScheduler );		// not dialed before the system shut down
+	}
 
-		vtCentralAuditor = adoStoredProcedure.GetParameter("po_central_auditor");
-		_bstr_t bstrCentralAuditor = bstrAuditor;
-		if ( vtCentralAuditor.vt != VT_NULL && vtCentralAuditor.vt != VT_EMPTY )
+	void SchedulePolls (void)
+	{
+		// Every free modem is given a queued poll (see CDialScheduler::Dispatch). While some are
+		// still free, more are claimed (no more than there are free modems) a batch per round trip,
+		// until the database has no more.
+		// Polls whose lease ran out before a modem was free are handed back first.
+		m_ManualPolls.Expire( m_DialScheduler );
+		int nFree = m_DialScheduler.Dispatch();
+		while ( nFree > 0 && m_ManualPolls.Claim( m_DialScheduler, nFree ) > 0 )
 		{
-			bstrCentralAuditor = ( _bstr_t ) vtCentralAuditor;
+			nFree = m_DialScheduler.Dispatch();
 		}
-		StringCbCopy ( szCentralAuditor, sizeof ( szCentralAuditor ), ( const char* ) bstrCentralAuditor );
-
-		vtCallNumber = adoStoredProcedure.GetParameter("po_call_number");
-		CallNumber = ( long ) vtCallNumber;
-
-		vtPhoneNumber = adoStoredProcedure.GetParameter("po_phone_nr");
-		_bstr_t bstrPhoneNumber (( _bstr_t ) vtPhoneNumber );
-		StringCbCopy ( szPhoneNumber, sizeof ( szPhoneNumber ), ( const char* ) bstrPhoneNumber );
-
-		_bstr_t bstrCallStartTime (( _bstr_t ) vtCallStartTime );
-
-		StringCchPrintf ( szCallNumber, sizeof ( szCallNumber ), "%d", CallNumber );
-		StringCchPrintf ( szCallStartTime, sizeof ( szCallStartTime ), "%f", callStartTime );
+		m_ManualPolls.Journal( m_DialScheduler );
 
-
-		SYSTEMTIME SystemTimeMS;
-		VariantTimeToSystemTime( callStartTime, &SystemTimeMS );
-		StringCchPrintf ( szCallStartTimeMS, sizeof ( szCallStartTimeMS ), "%02d/%02d/%04d %02d:%02d:%02d.%03d", SystemTimeMS.wMonth, SystemTimeMS.wDay, SystemTimeMS.wYear, SystemTimeMS.wHour, SystemTimeMS.wMinute, SystemTimeMS.wSecond, SystemTimeMS.wMilliseconds );
-
-		//m_EventTrace.BeginXML ( CEventTrace::Information );
-		//m_EventTrace.XML ( CEventTrace::Information, "GetManualPoll", "Found Record" );
-		//m_EventTrace.XML ( CEventTrace::Information, "CallNumber", szCallNumber );
-		//m_EventTrace.XML ( CEventTrace::Information, "PhoneNumber", szPhoneNumber );
-		//m_EventTrace.XML ( CEventTrace::Information, "Auditor", ( char* )(( LPCTSTR ) bstrAuditor ));
-		//m_EventTrace.XML ( CEventTrace::Information, "CallStartTime", szCallStartTimeMS );
-		//m_EventTrace.BeginXML ( CEventTrace::Information );
-
-		protelHost = m_protelList->MoveFirst();
-		while ( protelHost != NULL )
-		{
-			CProtelSerial* protelSerial = dynamic_cast<CProtelSerial*>(protelHost);
-			if ( protelSerial != NULL )
-			{
-				if ( protelSerial->Dial( szPhoneNumber, CallNumber ) == true )
-				{
-					return;
-				}
-			}
-			protelHost = m_protelList->Next();
-		}
-		try
-		{
-			CAdoStoredProcedure adoStoredProcedure2 ( "PKG_COMM_SERVER.FINISH" );
-			//procedure finish ( 
-			//    pi_callnumber in integer
-			//    , pi_centralAuditor in varchar2 default null
-			//    , pi_callstarttime in timestamp default null
-			//    , pi_callstoptime in timestamp
-			//    , pi_success in integer 
-			//    , pi_errormsg in varchar2 default null
-			//);
-			adoStoredProcedure2.AddParameter( "po_call_number", vtCallNumber, ADODB::DataTypeEnum::adInteger, ADODB::ParameterDirectionEnum::adParamInput, sizeof ( long ));
-			adoStoredProcedure2.AddParameter( "pi_centralAuditor", vtCentralAuditor, ADODB::DataTypeEnum::adBSTR, ADODB::ParameterDirectionEnum::adParamInput, bstrCentralAuditor.length());
-			adoStoredProcedure2.AddParameter( "pi_callstarttime", vtCallStartTime, ADODB::DataTypeEnum::adDBTimeStamp, ADODB::ParameterDirectionEnum::adParamInput, sizeof ( double ));
-			adoStoredProcedure2.AddParameter( "pi_callstoptime", vtCallStartTime, ADODB::DataTypeEnum::adDBTimeStamp, ADODB::ParameterDirectionEnum::adParamInput, sizeof ( double ));
-
-			_variant_t vtSuccess (( short ) 0, VT_I2 );
-			adoStoredProcedure2.AddParameter( "pi_success", vtSuccess, ADODB::DataTypeEnum::adInteger, ADODB::ParameterDirectionEnum::adParamInput, sizeof ( short ));
-
-			_bstr_t bstrMessage( "No available modems for outbound dial");
-			_variant_t vtMessage ( bstrMessage );
-			adoStoredProcedure2.AddParameter( "pi_errormsg", vtMessage, ADODB::DataTypeEnum::adBSTR, ADODB::ParameterDirectionEnum::adParamInput, bstrMessage.length());
-
-			//m_EventTrace.BeginXML ( CEventTrace::Information );
-			//m_EventTrace.XML ( CEventTrace::Information, "GetManualPoll", "Failure" );
-			//m_EventTrace.XML ( CEventTrace::Information, "CentralAuditor", ( char* )(( LPCTSTR ) bstrCentralAuditor ));
-			//m_EventTrace.XML ( CEventTrace::Information, "ErrorMessage", ( char* )(( LPCTSTR ) bstrMessage ));
-			//m_EventTrace.XML ( CEventTrace::Information, "CallStartTime", ( char* )(( LPCTSTR ) bstrCallStartTime ));
-			//m_EventTrace.XML ( CEventTrace::Information, "callStartTime", szCallStartTime );
-			//m_EventTrace.XML ( CEventTrace::Information, "CallNumber", szCallNumber );
-			//m_EventTrace.EndXML ( CEventTrace::Information );
-			adoConnection.ExecuteNonQuery( adoStoredProcedure2, false );
-		}
-		catch ( _com_error &comError )
-		{
-			m_EventTrace.Event ( CEventTrace::Information, "CApplication::GetManualPoll <--> ERROR: %s", CErrorMessage::ReturnComErrorMessage ( comError ));
-            CAdoStoredProcedure szOracleProcedureName (  "PKG_COMM_SERVER.addSysLogRecAutonomous" );
-            _bstr_t bstrOutText( "CApplication::GetManualPoll <--> ERROR: %s" );
-            _variant_t vtszOutput ( bstrOutText );
-           szOracleProcedureName.AddParameter( "pi_TEXT", vtszOutput, ADODB::DataTypeEnum::adBSTR, ADODB::ParameterDirectionEnum::adParamInput, bstrOutText.length());
-		}
+		CProfileValues profileValues;
+		m_DialScheduler.Report( profileValues.GetDialReportMinutes());
 	}
 
 #if 0
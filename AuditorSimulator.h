@@ -0,0 +1,1162 @@
+/**********************************************************************************************************************
+ *     This file contains CAuditorModel, CSimulatorResults, CSimulatedCall, CSimulatedModem and CAuditorSimulator.    *
+ *                                                                                                                    *
+ * This stands in for any number of master auditors so the server can be load tested without real ones. It is built   *
+ * as the auditorsim tool (AuditorSimulator\AuditorSimulator.vcxproj), whose main simply returns                      *
+ * CAuditorSimulator::Main ( argc, argv ), and run as:                                                                *
+ *                                                                                                                    *
+ * auditorsim <server>:<port> | COM<n>[,COM<n>...] [-calls n] [-concurrent n] [-auditors n] [-slaves n] [-dex n]      *
+ * [-dexsize bytes] [-firmware accept | busy | battery] [-latency ms] [-jitter ms] [-loss %] [-ferror %]              *
+ * [-eerror %] [-timeout seconds]                                                                                     *
+ *                                                                                                                    *
+ * Each simulated call plays the auditor side of the conversation described in ProtelHost.h. CAuditorModel answers I  *
+ * with a serial number (one of -auditors), SIM ID and card reader details, S with status bytes saying whether it has *
+ * DEX data, N with the master and -slaves slaves, U with -dex records of -dexsize bytes, D, O (accepting firmware,   *
+ * or refusing it with an E response as an auditor with DEX data or on battery does), C, V, Z (task complete), R, T,  *
+ * X and A. An unknown command is answered with E 00 and a command with a bad checksum with F 00, as an auditor does. *
+ *                                                                                                                    *
+ * Faults are injected into the responses: each one is delayed by -latency plus up to -jitter milliseconds, and is    *
+ * dropped (-loss percent, so the server times out and retransmits), or replaced by F (-ferror percent, so the server *
+ * retransmits at once) or E (-eerror percent, so the server aborts the call). The A response is never lost or        *
+ * replaced, so the outcome of every call is known.                                                                   *
+ *                                                                                                                    *
+ * Given <server>:<port>, each call connects to the port CSocketListener listens on. Calls are run on a CSocketReactor*
+ * (see SocketReactor.h), so 10,000 calls in progress at once need only a handful of threads. -concurrent calls are   *
+ * kept in progress until -calls have been made.                                                                      *
+ *                                                                                                                    *
+ * Given COM ports instead, each port is the far end of a null-modem pair (e.g. a virtual pair) from a port the       *
+ * server uses, and CSimulatedModem plays the modem and auditor there: it answers AT commands with OK, rings until the*
+ * server answers with ATA, raises DTR (the server's carrier detect) for the call and drops it once the call ends.    *
+ * Calls on a port are made one after another. (Windows has no pseudo-terminals - the null-modem pair plays that      *
+ * part.)                                                                                                             *
+ *                                                                                                                    *
+ * A call has completed when the server ends it with A as a normal shutdown; it was aborted if the A said otherwise,  *
+ * dropped if the server hung up without an A, or timed out after -timeout seconds. The report written at the end     *
+ * gives the calls per second, the 50th and 99th percentile call durations, each outcome and the faults injected.     *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+#include <windows.h>
+#include <ws2tcpip.h>
+#include <Shlwapi.h>
+#include <strsafe.h>
+#include "AuditDevice.h"
+#include "Checksum.h"
+#include "FrameDecoder.h"
+#include "Metrics.h"
+#include "SocketReactor.h"
+
+#define AUDITORSIMULATOR_MAXSLAVES      31                          // devices besides the master (ProtelHost keeps 32)
+#define AUDITORSIMULATOR_MAXDEXSIZE     ( FRAMEDECODER_MAXFRAME - 6 )              // DEX bytes after a U record number
+#define AUDITORSIMULATOR_NDEVICES       (( FRAMEDECODER_MAXFRAME - 6 ) / sizeof ( AuditDevice ))      // per N response
+#define AUDITORSIMULATOR_MAXAUDITORS    100000                                   // serial numbers have 5 digits for it
+#define AUDITORSIMULATOR_MAXPORTS       64                                           // COM ports run at once (threads)
+#define AUDITORSIMULATOR_RINGSECONDS    3                                                              // between RINGs
+#define AUDITORSIMULATOR_MAXRINGS       20                                         // RINGs unanswered before giving up
+
+struct SSimulatorSettings                                                          // from the command line (see above)
+{
+    int nCalls;                                                                                        // calls to make
+    int nConcurrent;                                                                // socket calls in progress at once
+    int nAuditors;                                                       // serial numbers the calls are shared between
+    int nSlaves;                                                                           // slaves besides the master
+    int nDexRecords;                                                                            // DEX records per call
+    int nDexSize;                                                                               // bytes per DEX record
+    int nFirmware;                                                                   // a CAuditorModel::FirmwareAnswer
+    int nLatency;                                                                     // milliseconds before a response
+    int nJitter;                                                                         // extra milliseconds, at most
+    int nLoss;                                                                             // percent of responses lost
+    int nFErrors;                                                                    // percent replaced by F responses
+    int nEErrors;                                                                    // percent replaced by E responses
+    int nTimeoutSeconds;                                                                        // longest call allowed
+};
+
+class CAuditorModel
+ {
+public:
+    enum FirmwareAnswer
+    {
+        AcceptFirmware,                                                                     // O packets are answered O
+        RefuseBusy,                                                      // E 02 - DEX must be uploaded before firmware
+        RefuseBattery,                                                                     // E 03 - auditor on battery
+    };
+
+    CAuditorModel ( const SSimulatorSettings* pSettings, int CallNumber ) :
+        m_nResponses ( 0 ),
+        m_nLost ( 0 ),
+        m_nFErrors ( 0 ),
+        m_nEErrors ( 0 ),
+        m_nBadFrames ( 0 ),
+        m_pSettings ( pSettings ),
+        m_nAuditor ( CallNumber % pSettings->nAuditors ),
+        m_nRandom (( DWORD ) CallNumber * 2654435761U + 1 ),
+        m_bFinished ( false ),
+        m_bNormalShutdown ( false )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR. This is the auditor making call number CallNumber, as pSettings describes.                    *
+         **************************************************************************************************************/
+    }
+
+    virtual ~CAuditorModel(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+    }
+
+    int Answer ( BYTE* pCommand, int CommandLength, BYTE* pResponse )
+    {
+        /**************************************************************************************************************
+         * This builds the response to the valid command frame in pCommand in pResponse (FRAMEDECODER_MAXFRAME bytes) *
+         * and returns its length, or 0 if the response is to be lost. A command repeated by a retransmit gets the    *
+         * same response again, since each response depends only on the command and its packet number.                *
+         **************************************************************************************************************/
+        BYTE Command = pCommand [ 2 ];
+        BYTE* pPayload = pCommand + 3;
+        int nPayloadLength = CommandLength - 4;
+        BYTE Data [ FRAMEDECODER_MAXFRAME ];
+        ZeroMemory ( Data, sizeof ( Data ));
+
+        if ( Command == 'A' )
+        {
+            m_bFinished = true;                                                      // the A response is never faulted
+            m_bNormalShutdown = nPayloadLength > 0 && pPayload [ 0 ] != 0;
+            return Frame ( 'A', pPayload, nPayloadLength, pResponse );
+        }
+
+        int nChance = ( int )( Random() % 100 );
+        if ( nChance < m_pSettings->nLoss )
+        {
+            m_nLost++;
+            return 0;
+        }
+        nChance -= m_pSettings->nLoss;
+        if ( nChance < m_pSettings->nFErrors )
+        {
+            m_nFErrors++;
+            Data [ 0 ] = 0x00;                                                                          // bad checksum
+            return Frame ( 'F', Data, 1, pResponse );
+        }
+        nChance -= m_pSettings->nFErrors;
+        if ( nChance < m_pSettings->nEErrors )
+        {
+            m_nEErrors++;
+            Data [ 0 ] = 0x01;                                                      // communication with remote failed
+            return Frame ( 'E', Data, 1, pResponse );
+        }
+
+        int nPacket = nPayloadLength >= 2 ? pPayload [ 0 ] * 256 + pPayload [ 1 ] : 0;
+        switch ( Command )
+        {
+            case 'I':
+                return Frame ( 'I', Data, GetIdentification (( char* ) Data, sizeof ( Data )), pResponse );
+
+            case 'S':
+                Data [ 0 ] = m_pSettings->nDexRecords > 0 ? 0x02 : 0x00;                               // has DEX files
+                Data [ 1 ] = 0x03;                                                                    // scheduled call
+                return Frame ( 'S', Data, 2, pResponse );
+
+            case 'N':
+                return Frame ( 'N', Data, GetDevices ( nPacket, Data ), pResponse );
+
+            case 'U':
+                return Frame ( 'U', Data, GetDexRecord ( nPacket, Data ), pResponse );
+
+            case 'O':
+                if ( m_pSettings->nFirmware != AcceptFirmware )
+                {
+                    Data [ 0 ] = m_pSettings->nFirmware == RefuseBusy ? 0x02 : 0x03;
+                    return Frame ( 'E', Data, 1, pResponse );
+                }
+                return Frame ( 'O', pPayload, min ( nPayloadLength, 2 ), pResponse );              // the packet number
+
+            case 'C':
+                return Frame ( 'C', pPayload, min ( nPayloadLength, 2 ), pResponse );              // the packet number
+
+            case 'Z':
+                Data [ 0 ] = 0x02;                                                                     // task complete
+                return Frame ( 'Z', Data, 1, pResponse );
+
+            case 'R':
+            case 'X':
+                return Frame ( Command, pPayload, min ( nPayloadLength, 1 ), pResponse );                // the address
+
+            case 'T':
+            {
+                SYSTEMTIME utc;
+                GetSystemTime ( &utc );
+                Data [ 0 ] = nPayloadLength > 0 ? pPayload [ 0 ] : 0;                                    // the address
+                StringCchPrintf (( LPTSTR )( Data + 1 ), sizeof ( Data ) - 1, "%02d%02d%02d%02d%02d",
+                    utc.wYear - 2000, utc.wMonth, utc.wDay, utc.wHour, utc.wMinute );
+                return Frame ( 'T', Data, 11, pResponse );
+            }
+
+            case 'D':
+            case 'V':
+                return Frame ( Command, NULL, 0, pResponse );
+        }
+        Data [ 0 ] = 0x00;                                                              // undefined or unknown command
+        return Frame ( 'E', Data, 1, pResponse );
+    }
+
+    int AnswerBadFrame ( BYTE* pResponse )
+    {
+        /**************************************************************************************************************
+         * This builds the F response to a command with a bad checksum in pResponse and returns its length.           *
+         **************************************************************************************************************/
+        m_nBadFrames++;
+        BYTE BadChecksum = 0x00;
+        return Frame ( 'F', &BadChecksum, 1, pResponse );
+    }
+
+    DWORD GetDelay ( void )
+    {
+        /**************************************************************************************************************
+         * This returns how many milliseconds to wait before sending the next response: -latency plus up to -jitter.  *
+         **************************************************************************************************************/
+        DWORD dwDelay = ( DWORD ) m_pSettings->nLatency;
+        if ( m_pSettings->nJitter > 0 )
+        {
+            dwDelay += Random() % ( DWORD )( m_pSettings->nJitter + 1 );
+        }
+        return dwDelay;
+    }
+
+    void CountResponse ( void )
+    {
+        m_nResponses++;                                                                           // sent to the server
+    }
+
+    bool GetFinished ( void )                                                                // TRUE once A is answered
+    {
+        return m_bFinished;
+    }
+    __declspec(property(get = GetFinished)) bool Finished;
+
+    bool GetNormalShutdown ( void )                                               // TRUE if the A said normal shutdown
+    {
+        return m_bNormalShutdown;
+    }
+    __declspec(property(get = GetNormalShutdown)) bool NormalShutdown;
+
+    int m_nResponses;                                                                         // sent, including faults
+    int m_nLost;                                                                                     // not sent at all
+    int m_nFErrors;                                                                          // replaced by F responses
+    int m_nEErrors;                                                                          // replaced by E responses
+    int m_nBadFrames;                                                                   // commands with a bad checksum
+
+private:
+    const SSimulatorSettings* m_pSettings;
+    int m_nAuditor;                                                      // which of the -auditors this call comes from
+    DWORD m_nRandom;                                                                         // xorshift state, never 0
+    bool m_bFinished;
+    bool m_bNormalShutdown;
+
+    DWORD Random ( void )
+    {
+        m_nRandom ^= m_nRandom << 13;
+        m_nRandom ^= m_nRandom >> 17;
+        m_nRandom ^= m_nRandom << 5;
+        return m_nRandom;
+    }
+
+    static int Frame ( BYTE Command, const BYTE* pPayload, int PayloadLength, BYTE* pResponse )
+    {
+        /**************************************************************************************************************
+         * This assembles a response frame (T, length, command, payload, checksum) in pResponse, returning its length.*
+         **************************************************************************************************************/
+        if ( PayloadLength > FRAMEDECODER_MAXFRAME - 4 )
+        {
+            PayloadLength = FRAMEDECODER_MAXFRAME - 4;
+        }
+        pResponse [ 0 ] = ( BYTE )'T';
+        pResponse [ 1 ] = ( BYTE )( PayloadLength + 1 );
+        pResponse [ 2 ] = Command;
+        if ( PayloadLength > 0 )
+        {
+            MoveMemory ( pResponse + 3, pPayload, PayloadLength );
+        }
+        pResponse [ PayloadLength + 3 ] = CChecksum::CalculateFrameChecksum ( pResponse, PayloadLength + 4 );
+        return PayloadLength + 4;
+    }
+
+    void GetSerialNumber ( int Device, char* pszSerialNumber )
+    {
+        /**************************************************************************************************************
+         * This writes the 8 character serial number of Device (0 = the master) of this auditor to pszSerialNumber    *
+         * (at least 9 bytes), e.g. S0312345 for slave 3 of auditor 12345.                                            *
+         **************************************************************************************************************/
+        StringCchPrintf ( pszSerialNumber, 9, "S%02d%05d", Device, m_nAuditor );
+    }
+
+    int GetIdentification ( char* pszIdentification, int Size )
+    {
+        /**************************************************************************************************************
+         * This writes the I response payload (serial number, SIM ID, card reader serial number, revision, firmware   *
+         * and configuration versions, separated by colons) to pszIdentification and returns its length.              *
+         **************************************************************************************************************/
+        char szSerialNumber [ 9 ];
+        GetSerialNumber ( 0, szSerialNumber );
+        StringCchPrintf ( pszIdentification, Size, "%s:8931038010%010d:RFX%05d::AC0000045A:1106", szSerialNumber,
+            m_nAuditor, m_nAuditor );
+        return lstrlen ( pszIdentification );
+    }
+
+    int GetDevices ( int Packet, BYTE* pData )
+    {
+        /**************************************************************************************************************
+         * This writes N response number Packet (from 1), holding up to AUDITORSIMULATOR_NDEVICES devices, to pData   *
+         * and returns its length. The master is device 0; the last packet is numbered ffff.                          *
+         **************************************************************************************************************/
+        int nDevices = 1 + m_pSettings->nSlaves;
+        int nPackets = ( nDevices + AUDITORSIMULATOR_NDEVICES - 1 ) / AUDITORSIMULATOR_NDEVICES;
+        int nNumber = Packet < nPackets ? Packet : 0xffff;
+        pData [ 0 ] = HIBYTE ( nNumber );
+        pData [ 1 ] = LOBYTE ( nNumber );
+        int nLength = 2;
+        for ( int nDevice = ( Packet - 1 ) * AUDITORSIMULATOR_NDEVICES;
+            nDevice >= 0 && nDevice < nDevices && nDevice < Packet * AUDITORSIMULATOR_NDEVICES; nDevice++ )
+        {
+            AuditDevice device;
+            char szSerialNumber [ 9 ];
+            GetSerialNumber ( nDevice, szSerialNumber );
+            CopyMemory ( device.szSerialNumber, szSerialNumber, sizeof ( device.szSerialNumber ));
+            device.Address = ( BYTE ) nDevice;
+            CopyMemory ( device.FirmwareVersionLevel, "010", sizeof ( device.FirmwareVersionLevel ));
+            device.FirmwareMonitorType = ( BYTE )'.';                                                // food & beverage
+            CopyMemory ( device.FirmwareVersionRev, "07", sizeof ( device.FirmwareVersionRev ));
+            device.ConfigFileVersion = ( BYTE )'1';
+            device.ConnectionType = nDevice == 0 ? 1 : 2;                                         // hard wire or radio
+            device.StatusByte = nDevice == 0 ? 0x00 : 0x01;                                        // central or remote
+            CopyMemory ( pData + nLength, &device, sizeof ( device ));
+            nLength += sizeof ( device );
+        }
+        return nLength;
+    }
+
+    int GetDexRecord ( int Packet, BYTE* pData )
+    {
+        /**************************************************************************************************************
+         * This writes U response number Packet (from 1) - DEX record Packet of -dex, each -dexsize bytes - to pData  *
+         * and returns its length. The last record is numbered ffff.                                                  *
+         **************************************************************************************************************/
+        int nNumber = Packet < m_pSettings->nDexRecords ? Packet : 0xffff;
+        pData [ 0 ] = HIBYTE ( nNumber );
+        pData [ 1 ] = LOBYTE ( nNumber );
+        if ( Packet < 1 || Packet > m_pSettings->nDexRecords )
+        {
+            return 2;                                                                             // there is no record
+        }
+        char* pszRecord = ( char* )( pData + 2 );
+        StringCchPrintf ( pszRecord, m_pSettings->nDexSize + 1, "DXS*S00%05d*VA*V0/6*1\r\nID1*%05d*%05d\r\n",
+            m_nAuditor, m_nAuditor, Packet );
+        for ( int nOffset = lstrlen ( pszRecord ); nOffset < m_pSettings->nDexSize; nOffset++ )
+        {
+            pszRecord [ nOffset ] = ( char )( 'A' + nOffset % 26 );                               // the rest is filler
+        }
+        return 2 + m_pSettings->nDexSize;
+    }
+ };
+
+class CSimulatorResults
+ {
+public:
+    enum CallOutcome
+    {
+        Completed,                                                                    // A command with normal shutdown
+        Aborted,                                                                               // A command, not normal
+        Dropped,                                                                        // the server hung up without A
+        TimedOut,                                                                          // -timeout seconds and no A
+        NotConnected,                                                                // the connection couldn't be made
+        Outcomes,                                                                               // (number of outcomes)
+    };
+
+    CSimulatorResults ( int Calls ) :
+        m_nCalls ( Calls ),
+        m_hSlots ( NULL ),
+        m_nSlots ( 0 ),
+        m_nNextCall ( 0 ),
+        m_nEnded ( 0 ),
+        m_nResponses ( 0 ),
+        m_nLost ( 0 ),
+        m_nFErrors ( 0 ),
+        m_nEErrors ( 0 ),
+        m_nBadFrames ( 0 ),
+        m_nStarted ( 0 ),
+        m_nFinished ( 0 )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR. Calls is the number of calls to be made.                                                      *
+         **************************************************************************************************************/
+        ZeroMemory (( void* ) m_nOutcomes, sizeof ( m_nOutcomes ));
+    }
+
+    virtual ~CSimulatorResults(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+        if ( m_hSlots != NULL )
+        {
+            CloseHandle ( m_hSlots );
+        }
+    }
+
+    void Begin ( int Concurrent )
+    {
+        /**************************************************************************************************************
+         * This is used as the first call is about to begin. With Concurrent more than 0, at most Concurrent calls    *
+         * may be in progress at once: each must be preceded by AwaitSlot, and the slot is freed when it ends.        *
+         **************************************************************************************************************/
+        if ( Concurrent > 0 )
+        {
+            m_hSlots = CreateSemaphore ( NULL, Concurrent, Concurrent, NULL );
+            m_nSlots = Concurrent;
+        }
+        m_nStarted = Now();
+    }
+
+    void AwaitSlot ( void )
+    {
+        WaitForSingleObject ( m_hSlots, INFINITE );                                      // until fewer are in progress
+    }
+
+    void End ( void )
+    {
+        /**************************************************************************************************************
+         * This is used once every call has been started. It returns once they have all ended.                        *
+         **************************************************************************************************************/
+        for ( int nSlot = 0; nSlot < m_nSlots; nSlot++ )
+        {
+            WaitForSingleObject ( m_hSlots, INFINITE );                       // every call has ended once all are ours
+        }
+        m_nFinished = Now();
+    }
+
+    int NextCall ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the number of the next call to make (from 0), or -1 once they have all been made. It may be   *
+         * called by any number of threads at once.                                                                   *
+         **************************************************************************************************************/
+        LONG nCall = InterlockedIncrement ( &m_nNextCall ) - 1;
+        return nCall < m_nCalls ? ( int ) nCall : -1;
+    }
+
+    void CallEnded ( CallOutcome Outcome, __int64 Started, CAuditorModel* pModel )
+    {
+        /**************************************************************************************************************
+         * This counts a call that began at Started (see Now) and has ended with Outcome, and the faults pModel (NULL *
+         * if the call never connected) injected into it, then frees its slot. It may be called by any number of      *
+         * threads at once.                                                                                           *
+         **************************************************************************************************************/
+        InterlockedIncrement ( &m_nOutcomes [ Outcome ] );
+        InterlockedIncrement ( &m_nEnded );
+        m_CallMilliseconds.Observe (( DWORD )(( Now() - Started ) / 1000 ));
+        if ( pModel != NULL )
+        {
+            InterlockedExchangeAdd ( &m_nResponses, pModel->m_nResponses );
+            InterlockedExchangeAdd ( &m_nLost, pModel->m_nLost );
+            InterlockedExchangeAdd ( &m_nFErrors, pModel->m_nFErrors );
+            InterlockedExchangeAdd ( &m_nEErrors, pModel->m_nEErrors );
+            InterlockedExchangeAdd ( &m_nBadFrames, pModel->m_nBadFrames );
+        }
+        if ( m_hSlots != NULL )
+        {
+            ReleaseSemaphore ( m_hSlots, 1, NULL );
+        }
+    }
+
+    void Report ( HANDLE hOutput )
+    {
+        /**************************************************************************************************************
+         * This writes how the calls went to hOutput. Durations are the upper limits of the CMetricHistogram buckets  *
+         * they fall in, so they are within 12.5% of the true value.                                                  *
+         **************************************************************************************************************/
+        double dSeconds = ( double )( m_nFinished - m_nStarted ) / 1000000.0;
+        double dPerSecond = dSeconds > 0 ? m_nEnded / dSeconds : 0;
+        LONG nErrors = m_nEnded - m_nOutcomes [ Completed ];
+        Print ( hOutput, "auditorsim: %ld calls in %.1f s (%.1f calls/s)\r\n", m_nEnded, dSeconds, dPerSecond );
+        Print ( hOutput, "  completed %ld, aborted %ld, dropped %ld, timed out %ld, not connected %ld "
+            "(%.2f%% errors)\r\n", m_nOutcomes [ Completed ], m_nOutcomes [ Aborted ], m_nOutcomes [ Dropped ],
+            m_nOutcomes [ TimedOut ], m_nOutcomes [ NotConnected ], m_nEnded > 0 ? 100.0 * nErrors / m_nEnded : 0 );
+        Print ( hOutput, "  call duration p50 %lu ms, p99 %lu ms, max %lu ms\r\n", GetPercentile ( 50 ),
+            GetPercentile ( 99 ), GetPercentile ( 100 ));
+        Print ( hOutput, "  responses sent %ld, lost %ld, F %ld, E %ld; bad commands received %ld\r\n",
+            m_nResponses, m_nLost, m_nFErrors, m_nEErrors, m_nBadFrames );
+    }
+
+    static __int64 Now ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the time in microseconds (from the performance counter).                                      *
+         **************************************************************************************************************/
+        LARGE_INTEGER Counter;
+        LARGE_INTEGER Frequency;
+        QueryPerformanceCounter ( &Counter );
+        QueryPerformanceFrequency ( &Frequency );
+        return Counter.QuadPart / Frequency.QuadPart * 1000000
+            + Counter.QuadPart % Frequency.QuadPart * 1000000 / Frequency.QuadPart;
+    }
+
+    static void Print ( HANDLE hOutput, const char* pszFormat, ... )
+    {
+        char szBuffer [ 1024 ];
+        va_list args;
+        va_start ( args, pszFormat );
+        StringCbVPrintf ( szBuffer, sizeof ( szBuffer ), pszFormat, args );
+        va_end ( args );
+        DWORD dwWritten = 0;
+        WriteFile ( hOutput, szBuffer, lstrlen ( szBuffer ), &dwWritten, NULL );
+    }
+
+private:
+    int m_nCalls;                                                                                      // calls to make
+    HANDLE m_hSlots;                                                           // semaphore - calls that may be started
+    int m_nSlots;                                                                          // calls in progress at most
+    volatile LONG m_nNextCall;                                                             // calls claimed by NextCall
+    volatile LONG m_nEnded;                                                           // calls ended, however they went
+    volatile LONG m_nOutcomes [ Outcomes ];                                                     // calls ended each way
+    volatile LONG m_nResponses;                                                              // totals of CAuditorModel
+    volatile LONG m_nLost;                                                                                   // (ditto)
+    volatile LONG m_nFErrors;
+    volatile LONG m_nEErrors;
+    volatile LONG m_nBadFrames;
+    CMetricHistogram m_CallMilliseconds;                                              // call durations (see Metrics.h)
+    __int64 m_nStarted;                                                              // when the first call began (Now)
+    __int64 m_nFinished;                                                              // when the last call ended (Now)
+
+    DWORD GetPercentile ( int Percent )
+    {
+        /**************************************************************************************************************
+         * This returns the call duration in milliseconds that Percent percent of calls took no longer than.          *
+         **************************************************************************************************************/
+        __int64 nCount = m_CallMilliseconds.Count;
+        __int64 nWanted = ( nCount * Percent + 99 ) / 100;
+        __int64 nSeen = 0;
+        for ( int nBucket = 0; nBucket < METRICS_BUCKETS; nBucket++ )
+        {
+            nSeen += m_CallMilliseconds.GetBucketCount ( nBucket );
+            if ( nSeen >= nWanted && nSeen > 0 )
+            {
+                return CMetricHistogram::GetBucketLimit ( nBucket );
+            }
+        }
+        return 0;
+    }
+ };
+
+class CSimulatedCall :
+    public CReactorSession
+ {
+public:
+    CSimulatedCall ( const SSimulatorSettings* pSettings, CSimulatorResults* pResults, SOCKET hSocket,
+        int CallNumber, __int64 Started ) :
+        CReactorSession ( hSocket ),
+        m_pSettings ( pSettings ),
+        m_pResults ( pResults ),
+        m_Model ( pSettings, CallNumber ),
+        m_nResponseLength ( 0 ),
+        m_nStarted ( Started ),
+        m_bTimedOut ( false )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR. This is call number CallNumber, connected on hSocket, which began at Started (see Now).       *
+         **************************************************************************************************************/
+    }
+
+    virtual ~CSimulatedCall(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+    }
+
+protected:
+    enum CallTimer
+    {
+        ReplyTimer,                                                           // the delayed response is due to be sent
+        TimeoutTimer,                                                                    // the call has taken too long
+    };
+
+    virtual void OnStart ( void )
+    {
+        /**************************************************************************************************************
+         * The server sends the I command once connected, so there is nothing to do but limit how long the call       *
+         * takes.                                                                                                     *
+         **************************************************************************************************************/
+        SetSessionTimer ( TimeoutTimer, ( DWORD ) m_pSettings->nTimeoutSeconds * 1000 );
+    }
+
+    virtual void OnReceive ( BYTE* pBuffer, int BufferLength )
+    {
+        /**************************************************************************************************************
+         * This answers each command received. A response due later replaces any still waiting, since the server has  *
+         * moved on (e.g. retransmitted) if it sent another command meanwhile.                                        *
+         **************************************************************************************************************/
+        int nWritten = 0;
+        while ( nWritten < BufferLength )
+        {
+            nWritten += m_FrameDecoder.Write ( pBuffer + nWritten, BufferLength - nWritten );
+            int nFrameLength = 0;
+            CFrameDecoder::FrameStatus frameStatus;
+            while (( frameStatus = m_FrameDecoder.NextFrame ( m_Frame, nFrameLength )) != CFrameDecoder::NeedMoreData )
+            {
+                m_nResponseLength = frameStatus == CFrameDecoder::ValidFrame ?
+                    m_Model.Answer ( m_Frame, nFrameLength, m_Response ) : m_Model.AnswerBadFrame ( m_Response );
+                if ( m_nResponseLength == 0 )
+                {
+                    CancelSessionTimer ( ReplyTimer );                                                          // lost
+                    continue;
+                }
+                DWORD dwDelay = m_Model.GetDelay();
+                if ( dwDelay == 0 )
+                {
+                    SendResponse();
+                }
+                else
+                {
+                    SetSessionTimer ( ReplyTimer, dwDelay );
+                }
+            }
+        }
+    }
+
+    virtual void OnTimer ( int Timer )
+    {
+        if ( Timer == ReplyTimer )
+        {
+            SendResponse();
+        }
+        else
+        {
+            m_bTimedOut = true;
+            EndSession();
+        }
+    }
+
+    virtual void OnClosed ( void )
+    {
+        /**************************************************************************************************************
+         * The call has ended: it is counted and deleted. The reactor doesn't touch the session after this.           *
+         **************************************************************************************************************/
+        CSimulatorResults::CallOutcome Outcome = CSimulatorResults::Dropped;
+        if ( m_Model.Finished == true )
+        {
+            Outcome = m_Model.NormalShutdown == true ? CSimulatorResults::Completed : CSimulatorResults::Aborted;
+        }
+        else if ( m_bTimedOut == true )
+        {
+            Outcome = CSimulatorResults::TimedOut;
+        }
+        closesocket ( m_hReactorSocket );
+        m_pResults->CallEnded ( Outcome, m_nStarted, &m_Model );
+        delete this;
+    }
+
+private:
+    const SSimulatorSettings* m_pSettings;
+    CSimulatorResults* m_pResults;
+    CAuditorModel m_Model;
+    CFrameDecoder m_FrameDecoder;                                                           // commands from the server
+    BYTE m_Frame [ FRAMEDECODER_MAXFRAME ];                                               // the command being answered
+    BYTE m_Response [ FRAMEDECODER_MAXFRAME ];                                         // waiting for ReplyTimer if set
+    int m_nResponseLength;                                                                       // 0 = nothing to send
+    __int64 m_nStarted;                                                           // when the call began (microseconds)
+    bool m_bTimedOut;
+
+    void SendResponse ( void )
+    {
+        /**************************************************************************************************************
+         * This sends the response waiting in m_Response. Once A has been answered the auditor hangs up.              *
+         **************************************************************************************************************/
+        if ( m_nResponseLength == 0 )
+        {
+            return;
+        }
+        send ( m_hReactorSocket, ( const char* ) m_Response, m_nResponseLength, 0 );
+        m_Model.CountResponse();
+        m_nResponseLength = 0;
+        if ( m_Model.Finished == true )
+        {
+            EndSession();
+        }
+    }
+ };
+
+class CSimulatedModem
+ {
+public:
+    CSimulatedModem ( const SSimulatorSettings* pSettings, CSimulatorResults* pResults, const char* pszPort ) :
+        m_pSettings ( pSettings ),
+        m_pResults ( pResults ),
+        m_hPort ( INVALID_HANDLE_VALUE ),
+        m_hThread ( NULL ),
+        m_nLine ( 0 )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR. This is the modem and auditor at the far end of the null-modem pair from pszPort (e.g. COM4). *
+         **************************************************************************************************************/
+        StringCbCopy ( m_szPort, sizeof ( m_szPort ), pszPort );
+        ZeroMemory ( m_szLine, sizeof ( m_szLine ));
+    }
+
+    virtual ~CSimulatedModem(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+        if ( m_hThread != NULL )
+        {
+            WaitForSingleObject ( m_hThread, INFINITE );
+            CloseHandle ( m_hThread );
+        }
+        if ( m_hPort != INVALID_HANDLE_VALUE )
+        {
+            CloseHandle ( m_hPort );
+        }
+    }
+
+    bool Start ( void )
+    {
+        /**************************************************************************************************************
+         * This opens the port and starts the thread making calls on it. It returns FALSE if the port can't be opened.*
+         **************************************************************************************************************/
+        char szPath [ 128 ];
+        StringCbPrintf ( szPath, sizeof ( szPath ), "\\\\.\\%s", m_szPort );
+        m_hPort = CreateFile ( szPath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL );
+        if ( m_hPort == INVALID_HANDLE_VALUE )
+        {
+            return false;
+        }
+        DCB dcb;
+        ZeroMemory ( &dcb, sizeof ( dcb ));
+        dcb.DCBlength = sizeof ( dcb );
+        GetCommState ( m_hPort, &dcb );
+        BuildCommDCB ( "baud=9600 parity=N data=8 stop=1", &dcb );
+        SetCommState ( m_hPort, &dcb );
+        COMMTIMEOUTS commTimeouts;
+        commTimeouts.ReadIntervalTimeout = MAXDWORD;                  // a read returns as soon as anything has arrived
+        commTimeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+        commTimeouts.ReadTotalTimeoutConstant = 100;                                    // or after 100 ms with nothing
+        commTimeouts.WriteTotalTimeoutMultiplier = 0;
+        commTimeouts.WriteTotalTimeoutConstant = 5000;
+        SetCommTimeouts ( m_hPort, &commTimeouts );
+        EscapeCommFunction ( m_hPort, CLRDTR );                                            // no carrier until answered
+        m_hThread = CreateThread ( NULL, 0, ModemThreadProc, this, 0, NULL );
+        return m_hThread != NULL;
+    }
+
+    HANDLE GetThread ( void )
+    {
+        return m_hThread;
+    }
+    __declspec(property(get = GetThread)) HANDLE Thread;
+
+private:
+    const SSimulatorSettings* m_pSettings;
+    CSimulatorResults* m_pResults;
+    char m_szPort [ 64 ];
+    HANDLE m_hPort;
+    HANDLE m_hThread;
+    char m_szLine [ 256 ];                                                 // AT command being received from the server
+    int m_nLine;                                                                              // characters in m_szLine
+
+    static DWORD WINAPI ModemThreadProc ( LPVOID lpParam )
+    {
+        /**************************************************************************************************************
+         * This is the thread making calls on the port, one after another, until every call has been made.            *
+         **************************************************************************************************************/
+        CSimulatedModem* pModem = ( CSimulatedModem* ) lpParam;
+        for ( int nCall = pModem->m_pResults->NextCall(); nCall >= 0; nCall = pModem->m_pResults->NextCall())
+        {
+            pModem->RunCall ( nCall );
+        }
+        return 0;
+    }
+
+    void RunCall ( int CallNumber )
+    {
+        /**************************************************************************************************************
+         * This makes call number CallNumber: it rings (answering any AT commands with OK) until the server answers,  *
+         * raises DTR, answers commands until A or -timeout seconds, then drops DTR again.                            *
+         **************************************************************************************************************/
+        __int64 nStarted = CSimulatorResults::Now();
+        bool bAnswered = false;
+        for ( int nRing = 0; bAnswered == false && nRing < AUDITORSIMULATOR_MAXRINGS; nRing++ )
+        {
+            Write ( "\r\nRING\r\n", 8 );
+            DWORD dwRang = GetTickCount();
+            while ( bAnswered == false && GetTickCount() - dwRang < AUDITORSIMULATOR_RINGSECONDS * 1000 )
+            {
+                ReadCommands ( bAnswered );
+            }
+        }
+        if ( bAnswered == false )
+        {
+            m_pResults->CallEnded ( CSimulatorResults::NotConnected, nStarted, NULL );
+            return;
+        }
+
+        Write ( "\r\nCONNECT 9600\r\n", 16 );
+        EscapeCommFunction ( m_hPort, SETDTR );                                          // the server's carrier detect
+        CAuditorModel model ( m_pSettings, CallNumber );
+        CFrameDecoder frameDecoder;
+        DWORD dwConnected = GetTickCount();
+        DWORD dwTimeout = ( DWORD ) m_pSettings->nTimeoutSeconds * 1000;
+        while ( model.Finished == false && GetTickCount() - dwConnected < dwTimeout )
+        {
+            BYTE Buffer [ 1024 ];
+            int nRead = Read ( Buffer, sizeof ( Buffer ));
+            int nWritten = 0;
+            while ( nWritten < nRead )
+            {
+                nWritten += frameDecoder.Write ( Buffer + nWritten, nRead - nWritten );
+                BYTE Frame [ FRAMEDECODER_MAXFRAME ];
+                BYTE Response [ FRAMEDECODER_MAXFRAME ];
+                int nFrameLength = 0;
+                CFrameDecoder::FrameStatus frameStatus;
+                while (( frameStatus = frameDecoder.NextFrame ( Frame, nFrameLength )) != CFrameDecoder::NeedMoreData )
+                {
+                    int nResponseLength = frameStatus == CFrameDecoder::ValidFrame ?
+                        model.Answer ( Frame, nFrameLength, Response ) : model.AnswerBadFrame ( Response );
+                    if ( nResponseLength > 0 )
+                    {
+                        Sleep ( model.GetDelay());
+                        Write ( Response, nResponseLength );
+                        model.CountResponse();
+                    }
+                }
+            }
+        }
+
+        CSimulatorResults::CallOutcome Outcome = CSimulatorResults::TimedOut;
+        if ( model.Finished == true )
+        {
+            Outcome = model.NormalShutdown == true ? CSimulatorResults::Completed : CSimulatorResults::Aborted;
+        }
+        Sleep ( 500 );                                                                    // let the A response be read
+        EscapeCommFunction ( m_hPort, CLRDTR );                                                              // hang up
+        m_pResults->CallEnded ( Outcome, nStarted, &model );
+    }
+
+    bool ReadCommands ( bool& Answered )
+    {
+        /**************************************************************************************************************
+         * This reads what the server has sent the modem while no call is connected, answering each AT command with   *
+         * OK. Answered is set TRUE if ATA arrives. It returns TRUE if anything was read.                             *
+         **************************************************************************************************************/
+        char Buffer [ 256 ];
+        int nRead = Read (( BYTE* ) Buffer, sizeof ( Buffer ));
+        for ( int nOffset = 0; nOffset < nRead; nOffset++ )
+        {
+            char c = Buffer [ nOffset ];
+            if ( c != '\r' && c != '\n' )
+            {
+                if ( m_nLine < ( int ) sizeof ( m_szLine ) - 1 )
+                {
+                    m_szLine [ m_nLine++ ] = c;
+                }
+                continue;
+            }
+            m_szLine [ m_nLine ] = '\0';
+            m_nLine = 0;
+            if ( StrCmpNI ( m_szLine, "ATA", 3 ) == 0 )
+            {
+                Answered = true;
+            }
+            else if ( StrCmpNI ( m_szLine, "AT", 2 ) == 0 )
+            {
+                Write ( "\r\nOK\r\n", 6 );
+            }
+        }
+        return nRead > 0;
+    }
+
+    int Read ( BYTE* pBuffer, int BufferSize )
+    {
+        /**************************************************************************************************************
+         * This returns the number of bytes read into pBuffer: whatever has arrived, waiting up to 100 ms for         *
+         * something.                                                                                                 *
+         **************************************************************************************************************/
+        DWORD dwRead = 0;
+        if ( ReadFile ( m_hPort, pBuffer, ( DWORD ) BufferSize, &dwRead, NULL ) == FALSE )
+        {
+            Sleep ( 100 );                                                         // e.g. the other end isn't open yet
+            return 0;
+        }
+        return ( int ) dwRead;
+    }
+
+    void Write ( const void* pData, int DataLength )
+    {
+        DWORD dwWritten = 0;
+        WriteFile ( m_hPort, pData, ( DWORD ) DataLength, &dwWritten, NULL );
+    }
+ };
+
+class CAuditorSimulator
+ {
+public:
+    CAuditorSimulator ( const SSimulatorSettings& Settings ) :
+        m_Settings ( Settings ),
+        m_Results ( Settings.nCalls )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+    }
+
+    virtual ~CAuditorSimulator(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+    }
+
+    bool RunSockets ( const char* pszServer )
+    {
+        /**************************************************************************************************************
+         * This makes the calls to pszServer (host:port), keeping -concurrent of them in progress at once, and returns*
+         * once every call has ended. It returns FALSE if pszServer can't be found.                                   *
+         **************************************************************************************************************/
+        char szHost [ 256 ];
+        StringCbCopy ( szHost, sizeof ( szHost ), pszServer );
+        char* pszPort = StrRChr ( szHost, NULL, ':' );
+        if ( pszPort == NULL )
+        {
+            return false;
+        }
+        *( pszPort++ ) = '\0';
+
+        addrinfo hints;
+        ZeroMemory ( &hints, sizeof ( hints ));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        addrinfo* pAddress = NULL;
+        if ( getaddrinfo ( szHost, pszPort, &hints, &pAddress ) != 0 )
+        {
+            return false;
+        }
+
+        CSocketReactor socketReactor;
+        if ( socketReactor.Start ( 0 ) == false )
+        {
+            freeaddrinfo ( pAddress );
+            return false;
+        }
+        m_Results.Begin ( m_Settings.nConcurrent );
+        for ( int nCall = m_Results.NextCall(); nCall >= 0; nCall = m_Results.NextCall())
+        {
+            m_Results.AwaitSlot();
+            __int64 nStarted = CSimulatorResults::Now();
+            SOCKET hSocket = socket ( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+            if ( hSocket == INVALID_SOCKET )
+            {
+                m_Results.CallEnded ( CSimulatorResults::NotConnected, nStarted, NULL );
+                continue;
+            }
+            if ( connect ( hSocket, pAddress->ai_addr, ( int ) pAddress->ai_addrlen ) == SOCKET_ERROR )
+            {
+                closesocket ( hSocket );
+                m_Results.CallEnded ( CSimulatorResults::NotConnected, nStarted, NULL );
+                continue;
+            }
+            CSimulatedCall* pCall = new CSimulatedCall ( &m_Settings, &m_Results, hSocket, nCall, nStarted );
+            if ( socketReactor.Attach ( pCall ) == false )
+            {
+                delete pCall;
+                closesocket ( hSocket );
+                m_Results.CallEnded ( CSimulatorResults::NotConnected, nStarted, NULL );
+            }
+        }
+        m_Results.End();
+        socketReactor.Stop();
+        freeaddrinfo ( pAddress );
+        return true;
+    }
+
+    bool RunSerial ( const char* pszPorts )
+    {
+        /**************************************************************************************************************
+         * This makes the calls over the COM ports listed in pszPorts (separated by commas), one call at a time on    *
+         * each, and returns once every call has ended. It returns FALSE if none of the ports can be opened.          *
+         **************************************************************************************************************/
+        char szPorts [ 1024 ];
+        StringCbCopy ( szPorts, sizeof ( szPorts ), pszPorts );
+        CSimulatedModem* pModems [ AUDITORSIMULATOR_MAXPORTS ];
+        HANDLE hThreads [ AUDITORSIMULATOR_MAXPORTS ];
+        int nModems = 0;
+        m_Results.Begin ( 0 );
+        char* pszContext = NULL;
+        for ( char* pszPort = strtok_s ( szPorts, ",", &pszContext );
+            pszPort != NULL && nModems < AUDITORSIMULATOR_MAXPORTS; pszPort = strtok_s ( NULL, ",", &pszContext ))
+        {
+            CSimulatedModem* pModem = new CSimulatedModem ( &m_Settings, &m_Results, pszPort );
+            if ( pModem->Start() == false )
+            {
+                delete pModem;
+                continue;
+            }
+            hThreads [ nModems ] = pModem->Thread;
+            pModems [ nModems++ ] = pModem;
+        }
+        if ( nModems == 0 )
+        {
+            return false;
+        }
+        WaitForMultipleObjects ( nModems, hThreads, TRUE, INFINITE );
+        m_Results.End();
+        for ( int nModem = 0; nModem < nModems; nModem++ )
+        {
+            delete pModems [ nModem ];
+        }
+        return true;
+    }
+
+    void Report ( HANDLE hOutput )
+    {
+        m_Results.Report ( hOutput );
+    }
+
+    static int Main ( int argc, char* argv[] )
+    {
+        /**************************************************************************************************************
+         * This is the simulator's command line (see above). It returns 0 once the calls have been made and reported, *
+         * 1 if the server or ports can't be reached and 2 if the command line is wrong.                              *
+         **************************************************************************************************************/
+        SSimulatorSettings settings;
+        settings.nCalls = 1000;
+        settings.nConcurrent = 100;
+        settings.nAuditors = 1000;
+        settings.nSlaves = 4;
+        settings.nDexRecords = 8;
+        settings.nDexSize = 200;
+        settings.nFirmware = CAuditorModel::AcceptFirmware;
+        settings.nLatency = 0;
+        settings.nJitter = 0;
+        settings.nLoss = 0;
+        settings.nFErrors = 0;
+        settings.nEErrors = 0;
+        settings.nTimeoutSeconds = 300;
+
+        bool bValid = argc >= 2 && ( argc % 2 ) == 0;                                          // options come in pairs
+        for ( int nArg = 2; bValid == true && nArg + 1 < argc; nArg += 2 )
+        {
+            char* pszOption = argv [ nArg ];
+            char* pszValue = argv [ nArg + 1 ];
+            int nValue = atoi ( pszValue );
+            if ( lstrcmpi ( pszOption, "-firmware" ) == 0 )
+            {
+                if ( lstrcmpi ( pszValue, "accept" ) == 0 )
+                {
+                    settings.nFirmware = CAuditorModel::AcceptFirmware;
+                }
+                else if ( lstrcmpi ( pszValue, "busy" ) == 0 )
+                {
+                    settings.nFirmware = CAuditorModel::RefuseBusy;
+                }
+                else if ( lstrcmpi ( pszValue, "battery" ) == 0 )
+                {
+                    settings.nFirmware = CAuditorModel::RefuseBattery;
+                }
+                else
+                {
+                    bValid = false;
+                }
+            }
+            else if ( lstrcmpi ( pszOption, "-calls" ) == 0 )
+            {
+                settings.nCalls = nValue;
+            }
+            else if ( lstrcmpi ( pszOption, "-concurrent" ) == 0 )
+            {
+                settings.nConcurrent = nValue;
+            }
+            else if ( lstrcmpi ( pszOption, "-auditors" ) == 0 )
+            {
+                settings.nAuditors = nValue;
+            }
+            else if ( lstrcmpi ( pszOption, "-slaves" ) == 0 )
+            {
+                settings.nSlaves = nValue;
+            }
+            else if ( lstrcmpi ( pszOption, "-dex" ) == 0 )
+            {
+                settings.nDexRecords = nValue;
+            }
+            else if ( lstrcmpi ( pszOption, "-dexsize" ) == 0 )
+            {
+                settings.nDexSize = nValue;
+            }
+            else if ( lstrcmpi ( pszOption, "-latency" ) == 0 )
+            {
+                settings.nLatency = nValue;
+            }
+            else if ( lstrcmpi ( pszOption, "-jitter" ) == 0 )
+            {
+                settings.nJitter = nValue;
+            }
+            else if ( lstrcmpi ( pszOption, "-loss" ) == 0 )
+            {
+                settings.nLoss = nValue;
+            }
+            else if ( lstrcmpi ( pszOption, "-ferror" ) == 0 )
+            {
+                settings.nFErrors = nValue;
+            }
+            else if ( lstrcmpi ( pszOption, "-eerror" ) == 0 )
+            {
+                settings.nEErrors = nValue;
+            }
+            else if ( lstrcmpi ( pszOption, "-timeout" ) == 0 )
+            {
+                settings.nTimeoutSeconds = nValue;
+            }
+            else
+            {
+                bValid = false;
+            }
+        }
+        if ( bValid == false || settings.nCalls < 1 || settings.nConcurrent < 1
+            || settings.nAuditors < 1 || settings.nAuditors > AUDITORSIMULATOR_MAXAUDITORS
+            || settings.nSlaves < 0 || settings.nSlaves > AUDITORSIMULATOR_MAXSLAVES
+            || settings.nDexRecords < 0 || settings.nDexRecords > 0xfffe
+            || settings.nDexSize < 1 || settings.nDexSize > AUDITORSIMULATOR_MAXDEXSIZE
+            || settings.nLatency < 0 || settings.nJitter < 0 || settings.nTimeoutSeconds < 1
+            || settings.nLoss < 0 || settings.nFErrors < 0 || settings.nEErrors < 0
+            || settings.nLoss + settings.nFErrors + settings.nEErrors > 100 )
+        {
+            HANDLE hError = GetStdHandle ( STD_ERROR_HANDLE );
+            CSimulatorResults::Print ( hError,
+                "usage: auditorsim <server>:<port> | COM<n>[,COM<n>...] [-calls n] [-concurrent n]\r\n"
+                "    [-auditors n] [-slaves n] [-dex n] [-dexsize bytes] [-firmware accept | busy | battery]\r\n"
+                "    [-latency ms] [-jitter ms] [-loss %%] [-ferror %%] [-eerror %%] [-timeout seconds]\r\n" );
+            return 2;
+        }
+
+        WSADATA wsaData;
+        WSAStartup ( MAKEWORD ( 2, 2 ), &wsaData );
+        CAuditorSimulator simulator ( settings );
+        bool bRan = StrCmpNI ( argv [ 1 ], "COM", 3 ) == 0 ?
+            simulator.RunSerial ( argv [ 1 ] ) : simulator.RunSockets ( argv [ 1 ] );
+        WSACleanup();
+        if ( bRan == false )
+        {
+            CSimulatorResults::Print (
+                GetStdHandle ( STD_ERROR_HANDLE ), "auditorsim: can't reach %s\r\n", argv [ 1 ] );
+            return 1;
+        }
+        simulator.Report ( GetStdHandle ( STD_OUTPUT_HANDLE ));
+        return 0;
+    }
+
+private:
+    SSimulatorSettings m_Settings;
+    CSimulatorResults m_Results;
+ };
@@ -0,0 +1,10 @@
+// AuditorSimulator.cpp : the auditorsim load test tool
+// Everything it does is in CAuditorSimulator (see AuditorSimulator.h)
+
+#include "stdafx.h"
+#include "AuditorSimulator.h"
+
+int main ( int argc, char* argv[] )
+{
+    return CAuditorSimulator::Main ( argc, argv );
+}
@@ -0,0 +1,945 @@
+/**********************************************************************************************************************
+ *      This file contains the CBenchmark class, the benchmark suites derived from it and the CBenchmarks class.      *
+ *                                                                                                                    *
+ * These time the server's hot paths against the code they replaced, so the figures quoted for them can be            *
+ * reproduced. They are built as the benchmarks tool (Benchmarks\Benchmarks.vcxproj), whose main simply returns       *
+ * CBenchmarks::Main ( argc, argv ), and run as:                                                                      *
+ *                                                                                                                    *
+ * benchmarks [checksum | timerwheel | hexdump | deviceplan SERIAL...]                                                *
+ *                                                                                                                    *
+ * With no argument every suite is run except deviceplan, which needs the database and so is only run when named.     *
+ * Each suite first checks that the new code gives the same results as the old for the cases it times (a benchmark of *
+ * wrong code is no use) and then writes the time each takes per operation. The exit code is 0 if every check passed, *
+ * 1 if any failed and 2 if the command line is wrong.                                                                *
+ *                                                                                                                    *
+ * CChecksumBenchmark compares CChecksum (see Checksum.h) with the byte-at-a-time loops of the old                    *
+ * CProtelHost::CalculateChecksum and CProtelDevice::GetFirmwareChecksum, for a 258-byte frame and a 256KB firmware   *
+ * image, and times CFrameDecoder decoding frames which arrive in pieces of various sizes.                            *
+ *                                                                                                                    *
+ * CTimerWheelBenchmark arms BENCHMARK_TIMERS timers in a CTimerWheel (see TimerWheel.h) with deadlines spread over   *
+ * 10 minutes and checks each expires on time, and that cancelled ones don't. It times arming, cancelling and         *
+ * expiring with that many pending, and compares arming and cancelling a response timeout with the SetWaitableTimer   *
+ * and CancelWaitableTimer calls each CProtelHost used to make.                                                       *
+ *                                                                                                                    *
+ * CHexDumpBenchmark checks that CHexDump (see HexDump.h) gives the same output as the methods it replaced, which     *
+ * formatted each byte with StringCchPrintf into a static buffer, for every length up to BENCHMARK_DUMPLENGTH bytes   *
+ * (past the 1365 bytes their buffer held in hex). For each length it also checks that a buffer one char too short,   *
+ * or of a random size, gets as many whole bytes or lines as fit and nothing is written past it. It times dumping a   *
+ * line, a frame and a 1KB read both ways.                                                                            *
+ *                                                                                                                    *
+ * CDevicePlanBenchmark sets up a CProtelDevice for each serial number given (up to DEVICEPREFETCH_MAXDEVICES), as    *
+ * the N response does, using the database in the server's profile. It checks that looking them up in one round trip  *
+ * (see CDevicePlan) gives every device the same downloads as the GetConfiguration, GetFirmware and GetFreeBee calls  *
+ * CProtelHost used to make for each device, and times both ways for the first 1, 2, 4... devices and for all of      *
+ * them. Point the profile at a test database: the procedures record the devices and their downloads as they would    *
+ * during a call.                                                                                                     *
+ *                                                                                                                    *
+ * Build the Release configuration to benchmark: Debug disables optimisation. The tool is built with /clr, as the     *
+ * server is, since the database code writes its events through CEventTrace. Timings are the best of BENCHMARK_RUNS   *
+ * runs, to leave out the runs another process interrupted.                                                           *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+#include <windows.h>
+#include <strsafe.h>
+#include "Checksum.h"
+#include "DevicePrefetch.h"
+#include "FrameDecoder.h"
+#include "HexDump.h"
+#include "TimerWheel.h"
+
+#define BENCHMARK_RUNS          5                                               // each timing is the best of this many
+#define BENCHMARK_IMAGESIZE     ( 256 * 1024 )                               // a large firmware or configuration image
+#define BENCHMARK_TIMERS        100000                                             // timers pending in the timer wheel
+#define BENCHMARK_TIMERSPAN     600000                                     // their deadlines are up to 10 minutes away
+#define BENCHMARK_DUMPLENGTH    1400                                  // longer than the old CHexDump could show in hex
+#define BENCHMARK_OLDDUMPSIZE   4096                                     // the static buffer the old CHexDump returned
+#define BENCHMARK_DUMPGUARD     16                             // chars after a CHexDump buffer checked to be untouched
+
+class CBenchmark
+ {
+public:
+    CBenchmark ( HANDLE hOutput ) :
+        m_hOutput ( hOutput ),
+        m_nFailures ( 0 ),
+        m_nRandom ( 0x2545F491 )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR. The results are written to hOutput.                                                           *
+         **************************************************************************************************************/
+        LARGE_INTEGER Frequency;
+        QueryPerformanceFrequency ( &Frequency );
+        m_dFrequency = ( double ) Frequency.QuadPart;
+        m_nSink = 0;
+    }
+
+    int GetFailures ( void )
+    {
+        return m_nFailures;
+    }
+    __declspec(property(get = GetFailures)) int Failures;
+
+    void Print ( const char* pszFormat, ... )
+    {
+        char szBuffer [ 1024 ];
+        va_list args;
+        va_start ( args, pszFormat );
+        StringCbVPrintf ( szBuffer, sizeof ( szBuffer ), pszFormat, args );
+        va_end ( args );
+        DWORD dwWritten = 0;
+        WriteFile ( m_hOutput, szBuffer, lstrlen ( szBuffer ), &dwWritten, NULL );
+    }
+
+protected:
+    void Check ( bool Passed, const char* pszWhat, int Value )
+    {
+        /**************************************************************************************************************
+         * This records a check, writing pszWhat (a format taking Value, e.g. a length) if it failed.                 *
+         **************************************************************************************************************/
+        if ( Passed == false )
+        {
+            m_nFailures++;
+            Print ( "  FAILED: " );
+            Print ( pszWhat, Value );
+            Print ( "\r\n" );
+        }
+    }
+
+    void StartTiming ( void )
+    {
+        QueryPerformanceCounter ( &m_Started );
+    }
+
+    void StopTiming ( int Operations, double& Best )
+    {
+        /**************************************************************************************************************
+         * This works out the time since StartTiming in nanoseconds per operation, Operations having been done, and   *
+         * sets Best to it if it is less.                                                                             *
+         **************************************************************************************************************/
+        LARGE_INTEGER Stopped;
+        QueryPerformanceCounter ( &Stopped );
+        double dNanoseconds =
+            ( double )( Stopped.QuadPart - m_Started.QuadPart ) * 1000000000.0 / m_dFrequency / Operations;
+        if ( dNanoseconds < Best )
+        {
+            Best = dNanoseconds;
+        }
+    }
+
+    void Report ( const char* pszName, double OldTime, double NewTime, const char* pszUnit = "ns" )
+    {
+        /**************************************************************************************************************
+         * This writes the time per operation of the old and new code for pszName, in pszUnit, and how many times     *
+         * faster the new is. An OldTime of 0 means there is no old code to compare with.                             *
+         **************************************************************************************************************/
+        if ( OldTime > 0 )
+        {
+            Print ( "  %-44s old %12.1f %s  new %12.1f %s  x%.1f\r\n", pszName, OldTime, pszUnit, NewTime, pszUnit,
+                NewTime > 0 ? OldTime / NewTime : 0 );
+        }
+        else
+        {
+            Print ( "  %-44s %33.1f %s\r\n", pszName, NewTime, pszUnit );
+        }
+    }
+
+    DWORD Random ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the next number from a fixed sequence (xorshift), so every run uses the same data.            *
+         **************************************************************************************************************/
+        m_nRandom ^= m_nRandom << 13;
+        m_nRandom ^= m_nRandom >> 17;
+        m_nRandom ^= m_nRandom << 5;
+        return m_nRandom;
+    }
+
+    void Fill ( BYTE* pData, int DataLength )
+    {
+        for ( int nOffset = 0; nOffset < DataLength; nOffset++ )
+        {
+            pData [ nOffset ] = ( BYTE ) Random();
+        }
+    }
+
+    volatile __int64 m_nSink;                                 // results are added here so they can't be optimised away
+
+private:
+    HANDLE m_hOutput;
+    int m_nFailures;                                                                // checks failed since construction
+    DWORD m_nRandom;                                                                    // state of the Random sequence
+    double m_dFrequency;                                                          // QueryPerformanceCounter per second
+    LARGE_INTEGER m_Started;                                                                      // set by StartTiming
+ };
+
+class CChecksumBenchmark : public CBenchmark
+ {
+public:
+    CChecksumBenchmark ( HANDLE hOutput ) :
+        CBenchmark ( hOutput )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+    }
+
+    void Run ( void )
+    {
+        /**************************************************************************************************************
+         * This checks CChecksum::Sum against the old loop for every length up to 1024 bytes at every alignment, and  *
+         * CFrameDecoder against CalculateFrameChecksum, then times them (see above).                                 *
+         **************************************************************************************************************/
+        Print ( "checksum\r\n" );
+        BYTE* pImage = new BYTE [ BENCHMARK_IMAGESIZE ];
+        Fill ( pImage, BENCHMARK_IMAGESIZE );
+
+        for ( int nAlign = 0; nAlign < 16; nAlign++ )
+        {
+            for ( int nLength = 0; nLength <= 1024; nLength++ )
+            {
+                Check ( CChecksum::Sum ( pImage + nAlign, nLength ) == OldImageChecksum ( pImage + nAlign, nLength ),
+                    "CChecksum::Sum differs for %d bytes", nLength );
+            }
+        }
+        Check ( CChecksum::Sum ( pImage, BENCHMARK_IMAGESIZE ) == OldImageChecksum ( pImage, BENCHMARK_IMAGESIZE ),
+            "CChecksum::Sum differs for %d bytes", BENCHMARK_IMAGESIZE );
+
+        BYTE Frame [ FRAMEDECODER_MAXFRAME ];
+        MakeFrame ( Frame );
+        Check ( CChecksum::CalculateFrameChecksum ( Frame, FRAMEDECODER_MAXFRAME )
+            == OldCalculateChecksum ( Frame, FRAMEDECODER_MAXFRAME ), "frame checksum differs for %d bytes",
+            FRAMEDECODER_MAXFRAME );
+        for ( int nPiece = 1; nPiece <= FRAMEDECODER_MAXFRAME; nPiece++ )
+        {
+            Check ( DecodeFrames ( Frame, nPiece, 4 ) == 4, "CFrameDecoder lost frames read %d bytes at a time",
+                nPiece );
+        }
+
+        double dOld = 1e300;
+        double dNew = 1e300;
+        for ( int nRun = 0; nRun < BENCHMARK_RUNS; nRun++ )
+        {
+            StartTiming();
+            for ( int nLoop = 0; nLoop < 100000; nLoop++ )
+            {
+                m_nSink += OldCalculateChecksum ( Frame, FRAMEDECODER_MAXFRAME );
+            }
+            StopTiming ( 100000, dOld );
+            StartTiming();
+            for ( int nLoop = 0; nLoop < 100000; nLoop++ )
+            {
+                m_nSink += CChecksum::CalculateFrameChecksum ( Frame, FRAMEDECODER_MAXFRAME );
+            }
+            StopTiming ( 100000, dNew );
+        }
+        Report ( "frame checksum (258 bytes)", dOld, dNew );
+
+        dOld = 1e300;
+        dNew = 1e300;
+        for ( int nRun = 0; nRun < BENCHMARK_RUNS; nRun++ )
+        {
+            StartTiming();
+            for ( int nLoop = 0; nLoop < 100; nLoop++ )
+            {
+                m_nSink += OldImageChecksum ( pImage, BENCHMARK_IMAGESIZE );
+            }
+            StopTiming ( 100, dOld );
+            StartTiming();
+            for ( int nLoop = 0; nLoop < 100; nLoop++ )
+            {
+                m_nSink += CChecksum::Sum ( pImage, BENCHMARK_IMAGESIZE );
+            }
+            StopTiming ( 100, dNew );
+        }
+        Report ( "image checksum (256KB)", dOld, dNew );
+
+        static const int Pieces[] = { 1, 16, 64, FRAMEDECODER_MAXFRAME };
+        for ( int nPiece = 0; nPiece < sizeof ( Pieces ) / sizeof ( Pieces [ 0 ] ); nPiece++ )
+        {
+            dNew = 1e300;
+            for ( int nRun = 0; nRun < BENCHMARK_RUNS; nRun++ )
+            {
+                StartTiming();
+                m_nSink += DecodeFrames ( Frame, Pieces [ nPiece ], 10000 );
+                StopTiming ( 10000, dNew );
+            }
+            char szName [ 64 ];
+            StringCbPrintf ( szName, sizeof ( szName ), "decode a 258-byte frame in %d-byte reads",
+                Pieces [ nPiece ] );
+            Report ( szName, 0, dNew );
+        }
+        delete [] pImage;
+    }
+
+protected:
+    static BYTE OldCalculateChecksum ( BYTE* Buffer, int Length )
+    {
+        /**************************************************************************************************************
+         * This is CProtelHost::CalculateChecksum as it was before CChecksum, which summed every frame sent and       *
+         * received a byte at a time.                                                                                 *
+         **************************************************************************************************************/
+        long BufferSum = 0;
+        for ( int nOffset = 0; nOffset < ( Length - 1 ); nOffset++ )
+        {
+            BufferSum += *( Buffer + nOffset );
+        }
+        long bitwiseNOT = ~BufferSum;
+        return (( unsigned char )( bitwiseNOT & 0x000000ff ));
+    }
+
+    static __int64 OldImageChecksum ( BYTE* pImage, long ImageLength )
+    {
+        /**************************************************************************************************************
+         * This is CProtelDevice::GetFirmwareChecksum (and GetConfigurationChecksum) as it was before CChecksum.      *
+         **************************************************************************************************************/
+        __int64 Total = 0;
+        for ( long Offset = 0; Offset < ImageLength; Offset++ )
+        {
+            Total += ( BYTE )*( pImage + Offset );
+        }
+        return Total;
+    }
+
+    void MakeFrame ( BYTE* pFrame )
+    {
+        /**************************************************************************************************************
+         * This fills pFrame with a valid frame of the largest size (e.g. a full U response) whose payload has no T   *
+         * in it, so that CFrameDecoder never has to look behind a T in the payload.                                  *
+         **************************************************************************************************************/
+        pFrame [ 0 ] = 'T';
+        pFrame [ 1 ] = FRAMEDECODER_MAXFRAME - 3;
+        pFrame [ 2 ] = 'U';
+        for ( int nOffset = 3; nOffset < FRAMEDECODER_MAXFRAME - 1; nOffset++ )
+        {
+            BYTE Value = ( BYTE ) Random();
+            pFrame [ nOffset ] = Value == 'T' ? 'U' : Value;
+        }
+        pFrame [ FRAMEDECODER_MAXFRAME - 1 ] = CChecksum::CalculateFrameChecksum ( pFrame, FRAMEDECODER_MAXFRAME );
+    }
+
+    int DecodeFrames ( BYTE* pFrame, int Piece, int Frames )
+    {
+        /**************************************************************************************************************
+         * This writes Frames copies of the frame in pFrame to a CFrameDecoder Piece bytes at a time, decoding what   *
+         * it can after each write as CProtelEngine does, and returns the number of valid frames decoded.             *
+         **************************************************************************************************************/
+        CFrameDecoder decoder;
+        BYTE Decoded [ FRAMEDECODER_MAXFRAME ];
+        int nDecoded = 0;
+        for ( int nFrame = 0; nFrame < Frames; nFrame++ )
+        {
+            for ( int nOffset = 0; nOffset < FRAMEDECODER_MAXFRAME; nOffset += Piece )
+            {
+                decoder.Write ( pFrame + nOffset, min ( Piece, FRAMEDECODER_MAXFRAME - nOffset ));
+                int nFrameLength = 0;
+                while ( decoder.NextFrame ( Decoded, nFrameLength ) != CFrameDecoder::NeedMoreData )
+                {
+                    nDecoded += nFrameLength == FRAMEDECODER_MAXFRAME && Decoded [ 2 ] == 'U' ? 1 : 0;
+                }
+            }
+        }
+        return nDecoded;
+    }
+ };
+
+class CTimerWheelBenchmark : public CBenchmark
+ {
+public:
+    CTimerWheelBenchmark ( HANDLE hOutput ) :
+        CBenchmark ( hOutput )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+        m_pTimers = new CWheelTimer [ BENCHMARK_TIMERS ];
+        m_pDeadlines = new DWORD [ BENCHMARK_TIMERS ];
+        for ( int nTimer = 0; nTimer < BENCHMARK_TIMERS; nTimer++ )
+        {
+            m_pTimers [ nTimer ].Id = nTimer;
+            m_pDeadlines [ nTimer ] = 1 + Random() % BENCHMARK_TIMERSPAN;
+        }
+    }
+
+    virtual ~CTimerWheelBenchmark(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+        delete [] m_pTimers;
+        delete [] m_pDeadlines;
+    }
+
+    void Run ( void )
+    {
+        /**************************************************************************************************************
+         * This checks that every timer expires on time (within a tick of its deadline, the wheel being advanced      *
+         * every tick) and that the cancelled half don't expire at all, then times the wheel (see above).             *
+         **************************************************************************************************************/
+        Print ( "timerwheel\r\n" );
+        CTimerWheel wheel;
+        wheel.Reset ( 0 );
+        ArmAll ( wheel );
+        for ( int nTimer = 1; nTimer < BENCHMARK_TIMERS; nTimer += 2 )
+        {
+            wheel.Cancel ( &m_pTimers [ nTimer ] );
+        }
+        int nExpired = 0;
+        for ( DWORD dwNow = 0; dwNow <= BENCHMARK_TIMERSPAN + TIMERWHEEL_TICKMS; dwNow += TIMERWHEEL_TICKMS )
+        {
+            wheel.Advance ( dwNow );
+            CWheelTimer* pTimer = NULL;
+            while (( pTimer = wheel.NextExpired()) != NULL )
+            {
+                nExpired++;
+                Check (( pTimer->Id & 1 ) == 0, "cancelled timer %d expired", pTimer->Id );
+                Check ( dwNow >= m_pDeadlines [ pTimer->Id ]
+                    && dwNow < m_pDeadlines [ pTimer->Id ] + TIMERWHEEL_TICKMS, "timer %d expired late", pTimer->Id );
+            }
+        }
+        Check ( nExpired == BENCHMARK_TIMERS / 2, "%d timers expired instead of half", nExpired );
+        Check ( wheel.Count == 0, "%d timers are still armed", wheel.Count );
+
+        double dArm = 1e300;
+        double dRearm = 1e300;
+        double dCancel = 1e300;
+        double dExpire = 1e300;
+        for ( int nRun = 0; nRun < BENCHMARK_RUNS; nRun++ )
+        {
+            wheel.Reset ( 0 );
+            StartTiming();
+            ArmAll ( wheel );
+            StopTiming ( BENCHMARK_TIMERS, dArm );
+
+            StartTiming();
+            for ( int nTimer = 0; nTimer < BENCHMARK_TIMERS; nTimer++ )
+            {
+                wheel.Cancel ( &m_pTimers [ nTimer ] );                           // as a response stops the timeout...
+                wheel.Arm ( &m_pTimers [ nTimer ], m_pDeadlines [ nTimer ] );      // ...and the next command starts it
+            }
+            StopTiming ( BENCHMARK_TIMERS, dRearm );
+
+            StartTiming();
+            for ( int nTimer = 0; nTimer < BENCHMARK_TIMERS; nTimer++ )
+            {
+                wheel.Cancel ( &m_pTimers [ nTimer ] );
+            }
+            StopTiming ( BENCHMARK_TIMERS, dCancel );
+
+            wheel.Reset ( 0 );
+            ArmAll ( wheel );
+            StartTiming();
+            for ( DWORD dwNow = 0; dwNow <= BENCHMARK_TIMERSPAN + TIMERWHEEL_TICKMS; dwNow += TIMERWHEEL_TICKMS )
+            {
+                wheel.Advance ( dwNow );
+                while ( wheel.NextExpired() != NULL )
+                {
+                    m_nSink++;
+                }
+            }
+            StopTiming ( BENCHMARK_TIMERS, dExpire );
+        }
+
+        double dWaitable = 1e300;
+        HANDLE hTimer = CreateWaitableTimer ( NULL, TRUE, NULL );
+        for ( int nRun = 0; nRun < BENCHMARK_RUNS && hTimer != NULL; nRun++ )
+        {
+            StartTiming();
+            for ( int nLoop = 0; nLoop < 10000; nLoop++ )
+            {
+                LARGE_INTEGER liDueTime;
+                liDueTime.QuadPart = -( __int64 ) m_pDeadlines [ nLoop ] * 10000;          // relative, in 100 ns units
+                CancelWaitableTimer ( hTimer );
+                SetWaitableTimer ( hTimer, &liDueTime, 0, NULL, NULL, TRUE );
+            }
+            StopTiming ( 10000, dWaitable );
+        }
+        if ( hTimer != NULL )
+        {
+            CloseHandle ( hTimer );
+        }
+
+        Report ( "cancel + arm a response timeout", dWaitable, dRearm );
+        Report ( "arm, 100000 pending", 0, dArm );
+        Report ( "cancel, 100000 pending", 0, dCancel );
+        Report ( "expire, per timer, advancing every tick", 0, dExpire );
+    }
+
+protected:
+    void ArmAll ( CTimerWheel& wheel )
+    {
+        for ( int nTimer = 0; nTimer < BENCHMARK_TIMERS; nTimer++ )
+        {
+            wheel.Arm ( &m_pTimers [ nTimer ], m_pDeadlines [ nTimer ] );
+        }
+    }
+
+    CWheelTimer* m_pTimers;                                                                  // BENCHMARK_TIMERS timers
+    DWORD* m_pDeadlines;                                                       // and when each is due, in milliseconds
+ };
+
+class CHexDumpBenchmark : public CBenchmark
+ {
+public:
+    CHexDumpBenchmark ( HANDLE hOutput ) :
+        CBenchmark ( hOutput )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+    }
+
+    void Run ( void )
+    {
+        /**************************************************************************************************************
+         * This checks each CHexDump method against the old one it replaced, and how it truncates its output, for     *
+         * every length up to BENCHMARK_DUMPLENGTH bytes, then times them (see above).                                *
+         **************************************************************************************************************/
+        Print ( "hexdump\r\n" );
+        BYTE Data [ BENCHMARK_DUMPLENGTH ];
+        Fill ( Data, BENCHMARK_DUMPLENGTH );
+        for ( int nValue = 0; nValue < 256; nValue++ )
+        {
+            Data [ nValue ] = ( BYTE ) nValue;                                             // so every value is encoded
+        }
+        char* pszOutput = new char [ CHEXDUMP_OUTPUTLENGTH ( BENCHMARK_DUMPLENGTH ) + BENCHMARK_DUMPGUARD ];
+        char* pszWhole = new char [ CHEXDUMP_OUTPUTLENGTH ( BENCHMARK_DUMPLENGTH ) ];
+        int nLine = CHEXDUMP_OUTPUTLENGTH ( 16 ) - 1;                                      // chars in a line of Output
+
+        for ( int nLength = 0; nLength <= BENCHMARK_DUMPLENGTH; nLength++ )
+        {
+            Check ( CHexDump::GetHexLength ( nLength ) == CHEXDUMP_HEXLENGTH ( nLength )
+                && CHexDump::GetAsciiLength ( nLength ) == CHEXDUMP_ASCIILENGTH ( nLength )
+                && CHexDump::GetOutputLength ( nLength ) == CHEXDUMP_OUTPUTLENGTH ( nLength ),
+                "a length method differs from its macro for %d bytes", nLength );
+
+            int nNew = CHexDump::EncodeHex ( Data, nLength, pszOutput,
+                min ( CHexDump::GetHexLength ( nLength ), BENCHMARK_OLDDUMPSIZE ));
+            char* pszOld = OldGetHexString ( Data, nLength );
+            Check ( nNew == lstrlen ( pszOld ) && memcmp ( pszOutput, pszOld, nNew + 1 ) == 0,
+                "EncodeHex differs from GetHexString for %d bytes", nLength );
+
+            nNew = CHexDump::EncodeAscii ( Data, nLength, pszOutput, CHexDump::GetAsciiLength ( nLength ));
+            pszOld = OldGetAsciiString ( Data, nLength );
+            Check ( nNew == lstrlen ( pszOld ) && memcmp ( pszOutput, pszOld, nNew + 1 ) == 0,
+                "EncodeAscii differs from GetAsciiString for %d bytes", nLength );
+
+            nNew = CHexDump::EncodeOutput ( Data, nLength, pszOutput,
+                min ( CHexDump::GetOutputLength ( nLength ), BENCHMARK_OLDDUMPSIZE ));
+            pszOld = OldOutput ( Data, nLength );
+            if ( CHexDump::GetOutputLength ( nLength ) <= BENCHMARK_OLDDUMPSIZE )
+            {
+                Check ( nNew == lstrlen ( pszOld ) && memcmp ( pszOutput, pszOld, nNew + 1 ) == 0,
+                    "EncodeOutput differs from Output for %d bytes", nLength );
+            }
+            else
+            {                                                  // Output cut its last line short; EncodeOutput drops it
+                Check ( nNew == lstrlen ( pszOld ) / nLine * nLine && memcmp ( pszOutput, pszOld, nNew ) == 0,
+                    "EncodeOutput doesn't end with Output's last whole line for %d bytes", nLength );
+            }
+
+            int nWhole = CHexDump::EncodeHex ( Data, nLength, pszWhole, CHexDump::GetHexLength ( nLength ));
+            CheckTruncation ( CHexDump::EncodeHex, "EncodeHex", Data, nLength, pszWhole, nWhole, 3, pszOutput );
+            nWhole = CHexDump::EncodeAscii ( Data, nLength, pszWhole, CHexDump::GetAsciiLength ( nLength ));
+            CheckTruncation ( CHexDump::EncodeAscii, "EncodeAscii", Data, nLength, pszWhole, nWhole, 1, pszOutput );
+            nWhole = CHexDump::EncodeOutput ( Data, nLength, pszWhole, CHexDump::GetOutputLength ( nLength ));
+            CheckTruncation ( CHexDump::EncodeOutput, "EncodeOutput", Data, nLength, pszWhole, nWhole, nLine,
+                pszOutput );
+        }
+
+        static const int Lengths[] = { 16, FRAMEDECODER_MAXFRAME, 1024 };
+        for ( int nLength = 0; nLength < sizeof ( Lengths ) / sizeof ( Lengths [ 0 ] ); nLength++ )
+        {
+            int nBytes = Lengths [ nLength ];
+            double dOldOutput = 1e300;
+            double dNewOutput = 1e300;
+            double dOldHex = 1e300;
+            double dNewHex = 1e300;
+            for ( int nRun = 0; nRun < BENCHMARK_RUNS; nRun++ )
+            {
+                StartTiming();
+                for ( int nLoop = 0; nLoop < 1000; nLoop++ )
+                {
+                    m_nSink += OldOutput ( Data, nBytes ) [ 0 ];
+                }
+                StopTiming ( 1000, dOldOutput );
+                StartTiming();
+                for ( int nLoop = 0; nLoop < 1000; nLoop++ )
+                {
+                    m_nSink += CHexDump::EncodeOutput ( Data, nBytes, pszOutput, CHEXDUMP_OUTPUTLENGTH ( nBytes ));
+                }
+                StopTiming ( 1000, dNewOutput );
+
+                StartTiming();
+                for ( int nLoop = 0; nLoop < 1000; nLoop++ )
+                {
+                    m_nSink += OldGetHexString ( Data, nBytes ) [ 0 ];
+                }
+                StopTiming ( 1000, dOldHex );
+                StartTiming();
+                for ( int nLoop = 0; nLoop < 1000; nLoop++ )
+                {
+                    m_nSink += CHexDump::EncodeHex ( Data, nBytes, pszOutput, CHEXDUMP_HEXLENGTH ( nBytes ));
+                }
+                StopTiming ( 1000, dNewHex );
+            }
+            char szName [ 64 ];
+            StringCbPrintf ( szName, sizeof ( szName ), "Output / EncodeOutput, %d bytes", nBytes );
+            Report ( szName, dOldOutput, dNewOutput );
+            StringCbPrintf ( szName, sizeof ( szName ), "GetHexString / EncodeHex, %d bytes", nBytes );
+            Report ( szName, dOldHex, dNewHex );
+        }
+        delete [] pszOutput;
+        delete [] pszWhole;
+    }
+
+protected:
+    typedef int ( *Encoder ) ( const BYTE* pData, int DataLength, char* pszOutput, int nOutputSize );
+
+    void CheckTruncation ( Encoder encoder, const char* pszName, const BYTE* pData, int DataLength,
+        const char* pszWhole, int WholeLength, int Unit, char* pszOutput )
+    {
+        /**************************************************************************************************************
+         * This checks that encoder, given pData and buffers of various sizes up to one more than it needs, writes    *
+         * nothing past the buffer and writes as many whole Units (a byte's chars, or a line) of pszWhole (its output *
+         * given all the room it needs, WholeLength chars) as fit. pszOutput must have BENCHMARK_DUMPGUARD chars more *
+         * than encoder needs.                                                                                        *
+         **************************************************************************************************************/
+        char szWhat [ 128 ];
+        StringCbPrintf ( szWhat, sizeof ( szWhat ), "%s truncates %%d bytes wrongly", pszName );
+        for ( int nTry = 0; nTry < 12; nTry++ )
+        {
+            int nOutputSize = nTry < 4 ? WholeLength - 1 + nTry : ( int ) ( Random() % ( WholeLength + 3 ));
+            if ( nOutputSize < 0 )
+            {
+                continue;                                                                           // WholeLength is 0
+            }
+            FillMemory ( pszOutput, nOutputSize + BENCHMARK_DUMPGUARD, 0x5a );
+            int nWritten = encoder ( pData, DataLength, pszOutput, nOutputSize );
+            bool bPassed = true;
+            for ( int nGuard = nOutputSize; nGuard < nOutputSize + BENCHMARK_DUMPGUARD; nGuard++ )
+            {
+                bPassed = bPassed && pszOutput [ nGuard ] == 0x5a;                   // nothing written past the buffer
+            }
+            if ( nOutputSize == 0 )
+            {
+                bPassed = bPassed && nWritten == 0;
+            }
+            else
+            {
+                int nNext = min ( Unit, WholeLength - nWritten );                          // chars the next Unit needs
+                bPassed = bPassed && nWritten < nOutputSize && pszOutput [ nWritten ] == '\0'
+                    && memcmp ( pszOutput, pszWhole, nWritten ) == 0
+                    && ( nWritten % Unit == 0 || nWritten == WholeLength )
+                    && ( nWritten == WholeLength || nWritten + nNext + 1 > nOutputSize );
+            }
+            Check ( bPassed, szWhat, DataLength );
+        }
+    }
+
+    static char* OldOutput ( BYTE* pData, int DataLength )
+    {
+        /**************************************************************************************************************
+         * This is CHexDump::Output as it was before EncodeOutput, which formatted each byte with StringCchPrintf and *
+         * appended each piece with StringCbCat, into a static buffer of BENCHMARK_OLDDUMPSIZE chars.                 *
+         **************************************************************************************************************/
+        static char szReturnBuffer [ BENCHMARK_OLDDUMPSIZE ];                           // concatenated formatted lines
+        char szDebugBuffer [ 256 ];                                                                   // formatted line
+        char szDebug0 [ 16 ];                                                                      // each value in hex
+        char szDebug1 [ 64 ];                                                    // hex values (e.g. 00 01 41 42 43 ff)
+        char szDebug2 [ 17 ];                                                    // printable chars or .s (e.g. ..ABC.)
+
+        ZeroMemory ( szReturnBuffer, sizeof ( szReturnBuffer ));
+        for ( int nLoop = 0; nLoop < DataLength; nLoop += 16 )
+        {
+            ZeroMemory ( szDebugBuffer, sizeof ( szDebugBuffer ));
+            ZeroMemory ( szDebug1, sizeof ( szDebug1 ));
+            ZeroMemory ( szDebug2, sizeof ( szDebug2 ));
+            for ( int nLoop2 = 0; nLoop2 < 16; nLoop2++ )
+            {
+                if (( nLoop + nLoop2 ) < DataLength )
+                {
+                    szDebug2 [ nLoop2 ] = '.';
+                    if ( isprint ( *( pData + nLoop + nLoop2 )))
+                    {
+                        szDebug2 [ nLoop2 ] = *( pData + nLoop + nLoop2 );
+                    }
+                    StringCchPrintf ( szDebug0, sizeof ( szDebug0 ), "%02x ", *( pData + nLoop + nLoop2 ));
+                    StringCbCat ( szDebug1, sizeof ( szDebug1 ), szDebug0 );
+                }
+            }
+            size_t nLength = 0;
+            StringCchLength( szDebug1, sizeof ( szDebug1 ), &nLength );
+            while ( nLength < 48 )
+            {
+                *( szDebug1 + nLength ) = ' ';
+                nLength++;
+            }
+            StringCbCat ( szDebugBuffer, sizeof ( szDebugBuffer ), szDebug1 );
+            StringCbCat ( szDebugBuffer, sizeof ( szDebugBuffer ), szDebug2 );
+            StringCbCat ( szDebugBuffer, sizeof ( szDebugBuffer ), "\r\n" );
+            StringCbCat ( szReturnBuffer, sizeof ( szReturnBuffer ), szDebugBuffer );
+        }
+        szReturnBuffer[sizeof szReturnBuffer - 1] = '\0';
+        return szReturnBuffer;
+    }
+
+    static char* OldGetHexString ( BYTE* pData, int DataLength )
+    {
+        /**************************************************************************************************************
+         * This is CHexDump::GetHexString as it was before EncodeHex.                                                 *
+         **************************************************************************************************************/
+        static char szReturnBuffer [ BENCHMARK_OLDDUMPSIZE ];
+        ZeroMemory ( szReturnBuffer, sizeof ( szReturnBuffer ));
+        char szDebugBuffer [ 256 ];
+
+        for ( int nLoop = 0; nLoop < DataLength; nLoop++ )
+        {
+            StringCchPrintf ( szDebugBuffer, sizeof ( szDebugBuffer ), "%02x ", *( pData + nLoop ));
+            StringCbCat ( szReturnBuffer, sizeof ( szReturnBuffer ), szDebugBuffer );
+        }
+        return szReturnBuffer;
+    }
+
+    static char* OldGetAsciiString ( BYTE* pData, int DataLength )
+    {
+        /**************************************************************************************************************
+         * This is CHexDump::GetAsciiString as it was before EncodeAscii. DataLength must be less than                *
+         * BENCHMARK_OLDDUMPSIZE.                                                                                     *
+         **************************************************************************************************************/
+        static char szReturnBuffer [ BENCHMARK_OLDDUMPSIZE ];
+        ZeroMemory ( szReturnBuffer, sizeof ( szReturnBuffer ));
+        CopyMemory( szReturnBuffer, pData, DataLength );
+
+        for ( int nLoop = 0; nLoop < DataLength; nLoop++ )
+        {
+            if ( *( szReturnBuffer + nLoop ) < 0x20 || *( szReturnBuffer + nLoop ) > 0x7e )
+            {
+                *( szReturnBuffer + nLoop ) = '.';
+            }
+        }
+        return szReturnBuffer;
+    }
+ };
+
+class CDevicePlanBenchmark : public CBenchmark
+ {
+public:
+    CDevicePlanBenchmark ( HANDLE hOutput ) :
+        CBenchmark ( hOutput ),
+        m_nDevices ( 0 )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+    }
+
+    virtual ~CDevicePlanBenchmark(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+        for ( int nDevice = 0; nDevice < m_nDevices; nDevice++ )
+        {
+            delete m_pDevices [ nDevice ];
+        }
+    }
+
+    void Run ( char* SerialNumbers [], int Count )
+    {
+        /**************************************************************************************************************
+         * This sets up a device for each of the Count serial numbers and checks that one round trip plans them as    *
+         * asking device by device does, then times both ways (see above).                                            *
+         **************************************************************************************************************/
+        Print ( "deviceplan\r\n" );
+        CoInitialize(NULL);
+        AddDevices ( SerialNumbers, Count );
+
+        Planned planned [ DEVICEPREFETCH_MAXDEVICES ];
+        LookUpEach ( m_nDevices );
+        for ( int nDevice = 0; nDevice < m_nDevices; nDevice++ )
+        {
+            GetPlanned ( nDevice, planned [ nDevice ] );
+        }
+        Check ( LookUpAll ( m_nDevices ) == true, "the plan for %d devices failed", m_nDevices );
+        for ( int nDevice = 0; nDevice < m_nDevices; nDevice++ )
+        {
+            Planned plannedAll;
+            GetPlanned ( nDevice, plannedAll );
+            Check ( memcmp ( &plannedAll, &planned [ nDevice ], sizeof ( Planned )) == 0,
+                "device %d was planned differently", nDevice );
+        }
+
+        int nCount = 1;
+        while ( nCount > 0 )
+        {
+            double dEach = 1e300;
+            double dAll = 1e300;
+            for ( int nRun = 0; nRun < BENCHMARK_RUNS; nRun++ )
+            {
+                StartTiming();
+                LookUpEach ( nCount );
+                StopTiming ( 1, dEach );
+
+                StartTiming();
+                LookUpAll ( nCount );
+                StopTiming ( 1, dAll );
+            }
+            char szName [ 64 ];
+            StringCbPrintf ( szName, sizeof ( szName ), "plan %d device(s)", nCount );
+            Report ( szName, dEach / 1000000.0, dAll / 1000000.0, "ms" );
+            nCount = nCount == m_nDevices ? 0 : min ( nCount * 2, m_nDevices );
+        }
+
+        CAdoConnectionPool::Instance().Stop();                                    // closes the connections it borrowed
+        CoUninitialize();
+    }
+
+protected:
+    struct Planned                                                                   // what a device's plan has set up
+    {
+        bool NeedsConfiguration;
+        bool NeedsFirmware;
+        long ConfigurationLength;
+        long FirmwareLength;
+        __int64 ConfigurationChecksum;
+        __int64 FirmwareChecksum;
+        int FreeBeeController;
+        char FreeBeeSerialNumber [ 32 ];
+    };
+
+    void AddDevices ( char* SerialNumbers [], int Count )
+    {
+        /**************************************************************************************************************
+         * This sets up a device for each serial number, as CProtelHost does for each device named in the N response. *
+         * SetAuditDevice records it in COMM_SERVER_AUDITORS, where the plan's procedures look it up.                 *
+         **************************************************************************************************************/
+        for ( int nDevice = 0; nDevice < Count && m_nDevices < DEVICEPREFETCH_MAXDEVICES; nDevice++ )
+        {
+            AuditDevice auditDevice;
+            ZeroMemory ( &auditDevice, sizeof ( auditDevice ));
+            CopyMemory ( auditDevice.szSerialNumber, SerialNumbers [ nDevice ],
+                min ( lstrlen ( SerialNumbers [ nDevice ] ), ( int ) sizeof ( auditDevice.szSerialNumber )));
+            auditDevice.Address = ( BYTE ) nDevice;
+
+            CProtelDevice* pDevice = new CProtelDevice();
+            pDevice->CentralAuditor = SerialNumbers [ 0 ];                           // the first is the master auditor
+            pDevice->CallStartTime = ( double ) 0;
+            pDevice->CallNumber = 0;
+            pDevice->AuditDevice = ( BYTE* ) &auditDevice;
+            m_pDevices [ m_nDevices++ ] = pDevice;
+        }
+    }
+
+    void LookUpEach ( int Count )
+    {
+        /**************************************************************************************************************
+         * This looks up the first Count devices one call at a time, as CProtelHost::PlanDevices does when "Device    *
+         * Plan Batch" is 0.                                                                                          *
+         **************************************************************************************************************/
+        for ( int nDevice = 0; nDevice < Count; nDevice++ )
+        {
+            m_pDevices [ nDevice ]->GetConfiguration();
+            m_pDevices [ nDevice ]->GetFirmware();
+            if ( m_pDevices [ nDevice ]->GetFreeBee() >= 0 )
+            {
+                m_pDevices [ nDevice ]->FreeBeeAuditDeviceidx = nDevice;
+            }
+        }
+    }
+
+    bool LookUpAll ( int Count )
+    {
+        /**************************************************************************************************************
+         * This looks up the first Count devices in one round trip, as CProtelHost::Database_DevicePlan does, and     *
+         * returns TRUE on success.                                                                                   *
+         **************************************************************************************************************/
+        CAdoConnectionLease adoConnection;                                          // borrowed from CAdoConnectionPool
+        if ( adoConnection.Connection == NULL )
+        {
+            return false;
+        }
+        CDevicePlan* pPlan = new CDevicePlan ( m_pDevices, 0, Count );
+        bool bPlanned = pPlan->Execute ( *adoConnection.Connection );
+        pPlan->Release();
+        return bPlanned;
+    }
+
+    void GetPlanned ( int Device, Planned& planned )
+    {
+        ZeroMemory ( &planned, sizeof ( planned ));                                       // so memcmp can compare them
+        planned.NeedsConfiguration = m_pDevices [ Device ]->NeedsConfiguration;
+        planned.NeedsFirmware = m_pDevices [ Device ]->NeedsFirmware;
+        planned.ConfigurationLength = m_pDevices [ Device ]->ConfigurationLength;
+        planned.FirmwareLength = m_pDevices [ Device ]->FirmwareLength;
+        planned.ConfigurationChecksum = m_pDevices [ Device ]->ConfigurationChecksum;
+        planned.FirmwareChecksum = m_pDevices [ Device ]->FirmwareChecksum;
+        planned.FreeBeeController = m_pDevices [ Device ]->FreeBeeControllerflag;
+        StringCbCopy ( planned.FreeBeeSerialNumber, sizeof ( planned.FreeBeeSerialNumber ),
+            m_pDevices [ Device ]->FreeBeeSerialNumber );
+    }
+
+    CProtelDevice* m_pDevices [ DEVICEPREFETCH_MAXDEVICES ];                           // the first m_nDevices are used
+    int m_nDevices;
+ };
+
+class CBenchmarks
+ {
+public:
+    static int Main ( int argc, char* argv[] )
+    {
+        /**************************************************************************************************************
+         * This is the tool's command line (see above). It returns 0 if every check passed, 1 if any failed and 2 if  *
+         * the command line is wrong.                                                                                 *
+         **************************************************************************************************************/
+        HANDLE hOutput = GetStdHandle ( STD_OUTPUT_HANDLE );
+        const char* pszSuite = argc >= 2 ? argv [ 1 ] : "";
+        bool bAll = argc < 2;
+        int nFailures = 0;
+        bool bRan = false;
+        bool bSerialNumbers = false;                                            // only deviceplan takes more arguments
+
+        if ( bAll == true || lstrcmpi ( pszSuite, "checksum" ) == 0 )
+        {
+            CChecksumBenchmark benchmark ( hOutput );
+            benchmark.Run();
+            nFailures += benchmark.Failures;
+            bRan = true;
+        }
+
+        if ( bAll == true || lstrcmpi ( pszSuite, "timerwheel" ) == 0 )
+        {
+            CTimerWheelBenchmark benchmark ( hOutput );
+            benchmark.Run();
+            nFailures += benchmark.Failures;
+            bRan = true;
+        }
+
+        if ( bAll == true || lstrcmpi ( pszSuite, "hexdump" ) == 0 )
+        {
+            CHexDumpBenchmark benchmark ( hOutput );
+            benchmark.Run();
+            nFailures += benchmark.Failures;
+            bRan = true;
+        }
+
+        if ( lstrcmpi ( pszSuite, "deviceplan" ) == 0 && argc > 2 && argc - 2 <= DEVICEPREFETCH_MAXDEVICES )
+        {
+            CDevicePlanBenchmark benchmark ( hOutput );                       // not run by bAll: it needs the database
+            benchmark.Run ( argv + 2, argc - 2 );
+            nFailures += benchmark.Failures;
+            bRan = true;
+            bSerialNumbers = true;
+        }
+
+        if ( bRan == false || ( argc > 2 && bSerialNumbers == false ))
+        {
+            CBenchmark ( GetStdHandle ( STD_ERROR_HANDLE )).Print (
+                "usage: benchmarks [checksum | timerwheel | hexdump | deviceplan SERIAL...]\r\n" );
+            return 2;
+        }
+        return nFailures > 0 ? 1 : 0;
+    }
+ };
@@ -0,0 +1,10 @@
+// Benchmarks.cpp : the benchmarks tool
+// Everything it does is in CBenchmarks (see Benchmarks.h)
+
+#include "stdafx.h"
+#include "Benchmarks.h"
+
+int main ( int argc, char* argv[] )
+{
+    return CBenchmarks::Main ( argc, argv );
+}
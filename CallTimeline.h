@@ -0,0 +1,573 @@
+/**********************************************************************************************************************
+ *                    This file contains the CCallTimeline, CTimelineSpan and CCallTracer classes.                    *
+ *                                                                                                                    *
+ * When a call takes 14 minutes instead of 3, the event log shows that it was slow but not where the time went. Each  *
+ * CProtelHost keeps a CCallTimeline: a span (start and duration, in microseconds) is recorded for each command and   *
+ * its response (named by the command letter, with the retransmits it needed), for each Database_* method, for each   *
+ * device's firmware and configuration lookup (CProtelDevice::GetFirmwareOrConfiguration) and for each wait on        *
+ * CDevicePrefetcher, CDexWriter or a Z ping pause. Every span is tagged with the call number and the central         *
+ * auditor's serial number. So a slow call can be put down to the link (long or retransmitted exchanges, many Z       *
+ * pings), the database or waiting.                                                                                   *
+ *                                                                                                                    *
+ * The spans go into a ring of "Call Trace Spans" entries allocated once per host, so a long call keeps its latest    *
+ * spans, while the total time in each category counts every span. Recording takes a QueryPerformanceCounter and      *
+ * an uncontended critical section; nothing is allocated. With the setting 0, nothing is recorded.                    *
+ *                                                                                                                    *
+ * The spans are written as Chrome trace JSON (load the file in chrome://tracing or https://ui.perfetto.dev), one     *
+ * track per call:                                                                                                    *
+ *  - when a call lasting "Call Trace Seconds" or longer ends, to a file beside the log (e.g. PROTEL.call1234.json),  *
+ *    and its totals are recorded as an event                                                                         *
+ *  - on demand, for the latest call of every connection, at http://127.0.0.1:<Metrics Port>/calls (see Metrics.h)    *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+#include <Shlwapi.h>
+#pragma comment(lib, "Shlwapi.lib")
+#include "EventTrace.h"
+#include "ProfileValues.h"
+
+#define CALLTIMELINE_EVENTSIZE      1024                                          // most chars one rendered span takes
+#define CALLTIMELINE_NAMESIZE       64                                          // serial number and port (as received)
+
+class CCallTimeline
+ {
+    friend class CCallTracer;                                            // renders the timeline and links it in a list
+
+public:
+    enum Category : BYTE
+    {
+        Link,                                                            // a command and its response (or retransmits)
+        Database,                                                                  // a Database_* method or CDexWriter
+        Devices,                                                            // a device's firmware/configuration lookup
+        Waiting,                                                        // CDevicePrefetcher or a pause between Z pings
+        Categories
+    };
+
+    CCallTimeline(void) :
+        m_pSpans ( NULL ),
+        m_nCapacity ( 0 ),
+        m_nRecorded ( 0 ),
+        m_nStarted ( 0 ),
+        m_nFinished ( 0 ),
+        m_pszExchange ( NULL ),
+        m_pszAwait ( NULL ),
+        m_nLane ( 0 ),
+        m_pPrevious ( NULL ),
+        m_pNext ( NULL )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+        InitializeCriticalSection ( &m_csSpans );
+        LARGE_INTEGER Frequency;
+        QueryPerformanceFrequency ( &Frequency );
+        m_nFrequency = Frequency.QuadPart > 0 ? Frequency.QuadPart : 1;
+        ZeroMemory ( m_nTotals, sizeof ( m_nTotals ));
+        Identify ( 0, "", "" );
+    }
+
+    virtual ~CCallTimeline(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+        delete [] m_pSpans;
+        DeleteCriticalSection ( &m_csSpans );
+    }
+
+    void Begin ( void )
+    {
+        /**************************************************************************************************************
+         * This is used (by CProtelHost::Initialize) as a call starts. It forgets the spans of the last call and, if  *
+         * "Call Trace Spans" has changed, reallocates the ring.                                                      *
+         **************************************************************************************************************/
+        CProfileValues profileValues;
+        int nCapacity = profileValues.GetCallTraceSpans();
+        EnterCriticalSection ( &m_csSpans );
+        if ( nCapacity != m_nCapacity )
+        {
+            delete [] m_pSpans;
+            m_pSpans = nCapacity > 0 ? new SSpan [ nCapacity ] : NULL;
+            m_nCapacity = m_pSpans != NULL ? nCapacity : 0;
+        }
+        m_nRecorded = 0;
+        ZeroMemory ( m_nTotals, sizeof ( m_nTotals ));
+        m_nStarted = Now();
+        m_nFinished = 0;
+        m_pszExchange = NULL;
+        m_pszAwait = NULL;
+        LeaveCriticalSection ( &m_csSpans );
+        Identify ( 0, "", "" );
+    }
+
+    void Identify ( int CallNumber, const char* pszSerialNumber, const char* pszPort )
+    {
+        /**************************************************************************************************************
+         * This sets the call number, central auditor serial number and port every span of this call is tagged with.  *
+         * It is used once each is known (after Database_AddNewCall and the I response).                              *
+         **************************************************************************************************************/
+        EnterCriticalSection ( &m_csSpans );
+        m_nCallNumber = CallNumber;
+        Escape ( m_szSerialNumber, sizeof ( m_szSerialNumber ), pszSerialNumber );
+        Escape ( m_szPort, sizeof ( m_szPort ), pszPort );
+        LeaveCriticalSection ( &m_csSpans );
+    }
+
+    void Add ( Category Kind, const char* pszName, __int64 Started )
+    {
+        /**************************************************************************************************************
+         * This records a span of Kind named pszName (which must be a string literal) from Started (see Now) until    *
+         * now.                                                                                                       *
+         **************************************************************************************************************/
+        Record ( Kind, pszName, Started, Now(), 0, 0 );
+    }
+
+    void Transmitted ( char Command )
+    {
+        /**************************************************************************************************************
+         * This is used as a new command (not a retransmit) is sent: it starts the exchange ended by Answered. An     *
+         * earlier exchange still without a response, or an Await, ends here.                                         *
+         **************************************************************************************************************/
+        if ( m_pSpans == NULL )
+        {
+            return;
+        }
+        __int64 nNow = Now();
+        EndPending ( nNow );
+        EnterCriticalSection ( &m_csSpans );                                         // CCallTracer may be rendering it
+        m_pszExchange = GetCommandName ( Command );
+        m_nExchangeStarted = nNow;
+        m_nExchangeRetransmits = 0;
+        LeaveCriticalSection ( &m_csSpans );
+    }
+
+    void Retransmitted ( void )                                                // the exchange's command was sent again
+    {
+        if ( m_pszExchange != NULL && m_nExchangeRetransmits < 255 )
+        {
+            m_nExchangeRetransmits++;
+        }
+    }
+
+    void Answered ( BYTE Response )                                      // a response (other than F) ends the exchange
+    {
+        if ( m_pszExchange != NULL )
+        {
+            EndExchange ( Now(), Response );
+        }
+    }
+
+    void Await ( Category Kind, const char* pszName )
+    {
+        /**************************************************************************************************************
+         * This starts a wait of Kind, named pszName (a string literal), which lasts until the next command is        *
+         * transmitted. It is used where the next command is sent by a timer (e.g. after a Z ping pause).             *
+         **************************************************************************************************************/
+        if ( m_pSpans == NULL )
+        {
+            return;
+        }
+        m_pszAwait = pszName;
+        m_nAwaitKind = Kind;
+        m_nAwaitStarted = Now();
+    }
+
+    __int64 Now ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the time in microseconds (since the computer started) that spans are measured in.             *
+         **************************************************************************************************************/
+        LARGE_INTEGER Counter;
+        QueryPerformanceCounter ( &Counter );
+        return ( Counter.QuadPart / m_nFrequency ) * 1000000                                     // without overflowing
+            + ( Counter.QuadPart % m_nFrequency ) * 1000000 / m_nFrequency;
+    }
+
+    DWORD GetMilliseconds ( Category Kind )                             // time spent in spans of Kind during this call
+    {
+        return ( DWORD )( m_nTotals [ Kind ] / 1000 );
+    }
+
+private:
+    struct SSpan
+    {
+        const char* pszName;                                                                        // a string literal
+        __int64 nStarted;                                                                               // microseconds
+        DWORD dwDuration;                                                                               // microseconds
+        BYTE Kind;                                                                                          // Category
+        BYTE Retransmits;                                                                             // for Link spans
+        BYTE Response;                                                                // for Link spans, 0 = unanswered
+    };
+
+    void Record ( Category Kind, const char* pszName, __int64 Started, __int64 Finished, BYTE Retransmits,
+        BYTE Response )
+    {
+        if ( m_pSpans == NULL )
+        {
+            return;                                                                             // "Call Trace Spans" 0
+        }
+        __int64 nDuration = Finished > Started ? Finished - Started : 0;
+        EnterCriticalSection ( &m_csSpans );
+        SSpan& span = m_pSpans [ m_nRecorded % m_nCapacity ];                                  // overwrites the oldest
+        span.pszName = pszName;
+        span.nStarted = Started;
+        span.dwDuration = ( DWORD )( nDuration < MAXDWORD ? nDuration : MAXDWORD );
+        span.Kind = Kind;
+        span.Retransmits = Retransmits;
+        span.Response = Response;
+        m_nRecorded++;
+        m_nTotals [ Kind ] += nDuration;
+        LeaveCriticalSection ( &m_csSpans );
+    }
+
+    void EndExchange ( __int64 Finished, BYTE Response )
+    {
+        EnterCriticalSection ( &m_csSpans );
+        Record ( Link, m_pszExchange, m_nExchangeStarted, Finished, m_nExchangeRetransmits, Response );
+        m_pszExchange = NULL;
+        LeaveCriticalSection ( &m_csSpans );
+    }
+
+    void EndPending ( __int64 Finished )
+    {
+        if ( m_pszExchange != NULL )
+        {
+            EndExchange ( Finished, 0 );
+        }
+        if ( m_pszAwait != NULL )
+        {
+            Record (( Category ) m_nAwaitKind, m_pszAwait, m_nAwaitStarted, Finished, 0, 0 );
+            m_pszAwait = NULL;
+        }
+    }
+
+    void End ( void )
+    {
+        /**************************************************************************************************************
+         * This is used (by CCallTracer::Finish) as the call ends, ending the exchange or wait still open.            *
+         **************************************************************************************************************/
+        __int64 nNow = Now();
+        EndPending ( nNow );
+        EnterCriticalSection ( &m_csSpans );
+        m_nFinished = nNow;
+        LeaveCriticalSection ( &m_csSpans );
+    }
+
+    bool Render ( STRSAFE_LPSTR& pszEnd, size_t& nRemaining, size_t nReserve, bool& First )
+    {
+        /**************************************************************************************************************
+         * This appends this call's events (a track name, a span for the whole call carrying the totals, then each    *
+         * span, oldest first) to the traceEvents being rendered, leaving nReserve chars unused. An event that doesn't*
+         * fit is left off. It returns FALSE if there is no call to render. The host is held up while it runs.        *
+         **************************************************************************************************************/
+        EnterCriticalSection ( &m_csSpans );
+        if ( m_nRecorded == 0 && m_pszExchange == NULL )
+        {
+            LeaveCriticalSection ( &m_csSpans );
+            return false;                                                        // no call yet (or spans not recorded)
+        }
+        __int64 nNow = m_nFinished != 0 ? m_nFinished : Now();
+        __int64 nDropped = m_nRecorded > m_nCapacity ? m_nRecorded - m_nCapacity : 0;
+        char szEvent [ CALLTIMELINE_EVENTSIZE ];
+        StringCbPrintf ( szEvent, sizeof ( szEvent ),
+            "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"call %d %s %s\"}}",
+            m_nLane, m_nCallNumber, m_szSerialNumber, m_szPort );
+        AppendEvent ( pszEnd, nRemaining, nReserve, First, szEvent );
+        StringCbPrintf ( szEvent, sizeof ( szEvent ),
+            "{\"name\":\"call\",\"cat\":\"call\",\"ph\":\"X\",\"ts\":%I64d,\"dur\":%I64d,\"pid\":1,\"tid\":%d,"
+            "\"args\":{\"call\":%d,\"serial\":\"%s\",\"port\":\"%s\",\"finished\":%s,\"link_ms\":%I64d,"
+            "\"database_ms\":%I64d,\"devices_ms\":%I64d,\"waiting_ms\":%I64d,\"spans\":%I64d,\"dropped\":%I64d}}",
+            m_nStarted, nNow - m_nStarted, m_nLane, m_nCallNumber, m_szSerialNumber, m_szPort,
+            m_nFinished != 0 ? "true" : "false", m_nTotals [ Link ] / 1000, m_nTotals [ Database ] / 1000,
+            m_nTotals [ Devices ] / 1000, m_nTotals [ Waiting ] / 1000, m_nRecorded, nDropped );
+        AppendEvent ( pszEnd, nRemaining, nReserve, First, szEvent );
+        for ( __int64 nSpan = nDropped; nSpan < m_nRecorded; nSpan++ )
+        {
+            SSpan& span = m_pSpans [ nSpan % m_nCapacity ];
+            RenderSpan ( szEvent, sizeof ( szEvent ), span.pszName, span.Kind, span.nStarted, span.dwDuration,
+                span.Retransmits, span.Response );
+            AppendEvent ( pszEnd, nRemaining, nReserve, First, szEvent );
+        }
+        if ( m_pszExchange != NULL && m_nFinished == 0 )                                // still waiting for a response
+        {
+            RenderSpan ( szEvent, sizeof ( szEvent ), m_pszExchange, Link, m_nExchangeStarted,
+                ( DWORD )( nNow - m_nExchangeStarted ), m_nExchangeRetransmits, 0 );
+            AppendEvent ( pszEnd, nRemaining, nReserve, First, szEvent );
+        }
+        LeaveCriticalSection ( &m_csSpans );
+        return true;
+    }
+
+    void RenderSpan ( char* pszEvent, size_t nEventSize, const char* pszName, BYTE Kind, __int64 Started,
+        DWORD Duration, BYTE Retransmits, BYTE Response )
+    {
+        static const char* pszCategories [ Categories ] = { "link", "database", "devices", "waiting" };
+        char szResponse [ 64 ] = "";
+        if ( Kind == Link )
+        {
+            StringCbPrintf ( szResponse, sizeof ( szResponse ), Response != 0 ?
+                ",\"retransmits\":%d,\"response\":\"%c\"" : ",\"retransmits\":%d,\"unanswered\":true",
+                Retransmits, Response );
+        }
+        StringCbPrintf ( pszEvent, nEventSize,
+            "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%I64d,\"dur\":%lu,\"pid\":1,\"tid\":%d,"
+            "\"args\":{\"call\":%d,\"serial\":\"%s\"%s}}", pszName, pszCategories [ Kind ], Started, Duration, m_nLane,
+            m_nCallNumber, m_szSerialNumber, szResponse );
+    }
+
+    static void AppendEvent ( STRSAFE_LPSTR& pszEnd, size_t& nRemaining, size_t nReserve, bool& First,
+        const char* pszEvent )
+    {
+        /**************************************************************************************************************
+         * This appends pszEvent (preceded by a comma unless First) to the traceEvents being rendered, provided that  *
+         * nReserve chars are left unused, and clears First. Otherwise it is left off.                                *
+         **************************************************************************************************************/
+        size_t nLength = lstrlen ( pszEvent ) + 2;
+        if ( nLength + nReserve < nRemaining )
+        {
+            StringCchCopyEx ( pszEnd, nRemaining, First == true ? "\n" : ",\n", &pszEnd, &nRemaining, 0 );
+            StringCchCopyEx ( pszEnd, nRemaining, pszEvent, &pszEnd, &nRemaining, 0 );
+            First = false;
+        }
+    }
+
+    static void Escape ( char* pszOutput, size_t nOutputSize, const char* pszInput )
+    {
+        /**************************************************************************************************************
+         * This copies pszInput (received from the auditor, so it may hold anything) to pszOutput as the inside of a  *
+         * JSON string. Whatever doesn't fit is left off.                                                             *
+         **************************************************************************************************************/
+        size_t nLength = 0;
+        for ( const BYTE* pScan = ( const BYTE* ) pszInput; *pScan != '\0' && nLength + 7 < nOutputSize; pScan++ )
+        {
+            if ( *pScan < 0x20 || *pScan >= 0x7f )
+            {
+                StringCchPrintf ( pszOutput + nLength, nOutputSize - nLength, "\\u%04x", *pScan );
+                nLength += 6;
+            }
+            else
+            {
+                if ( *pScan == '"' || *pScan == '\\' )
+                {
+                    pszOutput [ nLength++ ] = '\\';
+                }
+                pszOutput [ nLength++ ] = ( char ) *pScan;
+            }
+        }
+        pszOutput [ nLength ] = '\0';
+    }
+
+    static const char* GetCommandName ( char Command )                                   // e.g. "U" - a string literal
+    {
+        static const char* pszNames =
+            "A\0B\0C\0D\0E\0F\0G\0H\0I\0J\0K\0L\0M\0N\0O\0P\0Q\0R\0S\0T\0U\0V\0W\0X\0Y\0Z";
+        return Command >= 'A' && Command <= 'Z' ? pszNames + ( Command - 'A' ) * 2 : "?";
+    }
+
+    CRITICAL_SECTION m_csSpans;                                       // taken to record a span and to render the spans
+    SSpan* m_pSpans;                                                      // ring of m_nCapacity, NULL if not recording
+    int m_nCapacity;
+    __int64 m_nRecorded;                                                                 // spans recorded in this call
+    __int64 m_nTotals [ Categories ];                                             // microseconds in spans of each kind
+    __int64 m_nFrequency;                                                         // QueryPerformanceCounter per second
+    __int64 m_nStarted;                                                                        // when the call started
+    __int64 m_nFinished;                                                            // when the call ended, 0 = not yet
+    int m_nCallNumber;
+    char m_szSerialNumber [ CALLTIMELINE_NAMESIZE * 6 ];                               // escaped for JSON (see Escape)
+    char m_szPort [ CALLTIMELINE_NAMESIZE * 6 ];                                       // escaped for JSON (see Escape)
+    const char* m_pszExchange;                                             // command awaiting a response, NULL if none
+    __int64 m_nExchangeStarted;
+    BYTE m_nExchangeRetransmits;
+    const char* m_pszAwait;                                       // what is being waited for (see Await), NULL if none
+    BYTE m_nAwaitKind;                                                                                      // Category
+    __int64 m_nAwaitStarted;
+    int m_nLane;                                                                 // the trace "tid", set by CCallTracer
+    CCallTimeline* m_pPrevious;                                                                       // in CCallTracer
+    CCallTimeline* m_pNext;
+ };
+
+class CTimelineSpan
+ {
+public:
+    CTimelineSpan ( CCallTimeline& Timeline, CCallTimeline::Category Kind, const char* pszName ) :
+        m_Timeline ( Timeline ),
+        m_Kind ( Kind ),
+        m_pszName ( pszName ),
+        m_nStarted ( Timeline.Now())
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR. This records a span of Kind named pszName (a string literal) from now until it is destroyed,  *
+         * e.g. at the end of the method it was declared in.                                                          *
+         **************************************************************************************************************/
+    }
+
+    virtual ~CTimelineSpan(void)
+    {
+        m_Timeline.Add ( m_Kind, m_pszName, m_nStarted );
+    }
+
+private:
+    CCallTimeline& m_Timeline;
+    CCallTimeline::Category m_Kind;
+    const char* m_pszName;
+    __int64 m_nStarted;
+ };
+
+class CCallTracer
+ {
+public:
+    static CCallTracer& Instance ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the single list of every host's timeline. CApplication::Start calls it before any connections *
+         * start, so it is constructed then.                                                                          *
+         **************************************************************************************************************/
+        static CCallTracer callTracer;
+        return callTracer;
+    }
+
+    void Add ( CCallTimeline& Timeline )                                           // used by CProtelHost's constructor
+    {
+        EnterCriticalSection ( &m_csTimelines );
+        Timeline.m_nLane = ++m_nLanes;
+        Timeline.m_pPrevious = NULL;
+        Timeline.m_pNext = m_pFirst;
+        if ( m_pFirst != NULL )
+        {
+            m_pFirst->m_pPrevious = &Timeline;
+        }
+        m_pFirst = &Timeline;
+        LeaveCriticalSection ( &m_csTimelines );
+    }
+
+    void Remove ( CCallTimeline& Timeline )                                         // used by CProtelHost's destructor
+    {
+        EnterCriticalSection ( &m_csTimelines );
+        if ( Timeline.m_pPrevious != NULL )
+        {
+            Timeline.m_pPrevious->m_pNext = Timeline.m_pNext;
+        }
+        else if ( m_pFirst == &Timeline )
+        {
+            m_pFirst = Timeline.m_pNext;
+        }
+        if ( Timeline.m_pNext != NULL )
+        {
+            Timeline.m_pNext->m_pPrevious = Timeline.m_pPrevious;
+        }
+        Timeline.m_pPrevious = NULL;
+        Timeline.m_pNext = NULL;
+        LeaveCriticalSection ( &m_csTimelines );
+    }
+
+    void Finish ( CCallTimeline& Timeline )
+    {
+        /**************************************************************************************************************
+         * This is used (by CProtelHost::CloseDevice) as a call ends, doing nothing if it has already been used for   *
+         * this call. If the call lasted "Call Trace Seconds" or longer, its spans are written to a file beside the   *
+         * log and its totals are recorded as an event.                                                               *
+         **************************************************************************************************************/
+        if ( Timeline.m_pSpans == NULL || Timeline.m_nFinished != 0 || Timeline.m_nRecorded == 0 )
+        {
+            return;
+        }
+        Timeline.End();
+        CProfileValues profileValues;
+        int nSeconds = profileValues.GetCallTraceSeconds();
+        __int64 nDuration = Timeline.m_nFinished - Timeline.m_nStarted;
+        if ( nSeconds <= 0 || nDuration < ( __int64 ) nSeconds * 1000000 )
+        {
+            return;
+        }
+
+        char szFileName [ MAX_PATH ];
+        StringCbCopy ( szFileName, sizeof ( szFileName ), profileValues.GetLogFile());
+        PathRemoveExtension ( szFileName );
+        size_t nNameLength = lstrlen ( szFileName );
+        if ( Timeline.m_nCallNumber > 0 )
+        {
+            StringCbPrintf ( szFileName + nNameLength, sizeof ( szFileName ) - nNameLength, ".call%d.json",
+                Timeline.m_nCallNumber );
+        }
+        else
+        {
+            StringCbPrintf ( szFileName + nNameLength, sizeof ( szFileName ) - nNameLength, ".call0-%lu.json",
+                GetTickCount());
+        }
+        int nOutputSize = ( Timeline.m_nCapacity + 3 ) * CALLTIMELINE_EVENTSIZE;
+        char* pszOutput = new char [ nOutputSize ];
+        int nLength = Render ( pszOutput, nOutputSize, &Timeline );
+        HANDLE hFile = CreateFile ( szFileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+        if ( hFile != INVALID_HANDLE_VALUE )
+        {
+            DWORD dwWritten = 0;
+            WriteFile ( hFile, pszOutput, nLength, &dwWritten, NULL );
+            CloseHandle ( hFile );
+        }
+        delete [] pszOutput;
+        m_EventTrace.Event ( CEventTrace::Warning,
+            "CCallTracer::Finish - call %d took %I64d s: link %lu ms, database %lu ms, devices %lu ms, waiting %lu ms"
+            " - spans in %s", Timeline.m_nCallNumber, nDuration / 1000000,
+            Timeline.GetMilliseconds ( CCallTimeline::Link ), Timeline.GetMilliseconds ( CCallTimeline::Database ),
+            Timeline.GetMilliseconds ( CCallTimeline::Devices ), Timeline.GetMilliseconds ( CCallTimeline::Waiting ),
+            hFile != INVALID_HANDLE_VALUE ? szFileName : "(not written)" );
+    }
+
+    int Render ( char* pszOutput, int nOutputSize, CCallTimeline* pTimeline = NULL )
+    {
+        /**************************************************************************************************************
+         * This places the spans of pTimeline, or if it is NULL of every host's latest call, in pszOutput (which holds*
+         * nOutputSize chars) as Chrome trace JSON and returns the number of chars written. Spans that don't fit are  *
+         * left off; the output is always complete JSON.                                                              *
+         **************************************************************************************************************/
+        STRSAFE_LPSTR pszEnd = pszOutput;
+        size_t nRemaining = nOutputSize;
+        const char* pszClose = "\n]}\n";
+        size_t nReserve = lstrlen ( pszClose );
+        StringCchCopyEx ( pszEnd, nRemaining, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[",
+            &pszEnd, &nRemaining, 0 );
+        bool bFirst = true;
+        if ( pTimeline != NULL )
+        {
+            pTimeline->Render ( pszEnd, nRemaining, nReserve, bFirst );
+        }
+        else
+        {
+            EnterCriticalSection ( &m_csTimelines );
+            for ( CCallTimeline* pScan = m_pFirst; pScan != NULL; pScan = pScan->m_pNext )
+            {
+                pScan->Render ( pszEnd, nRemaining, nReserve, bFirst );
+            }
+            LeaveCriticalSection ( &m_csTimelines );
+        }
+        StringCchCopyEx ( pszEnd, nRemaining, pszClose, &pszEnd, &nRemaining, 0 );
+        return ( int )( pszEnd - pszOutput );
+    }
+
+private:
+    CCallTracer(void) :
+        m_pFirst ( NULL ),
+        m_nLanes ( 0 )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+        InitializeCriticalSection ( &m_csTimelines );
+    }
+
+    virtual ~CCallTracer(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+        DeleteCriticalSection ( &m_csTimelines );
+    }
+
+    CRITICAL_SECTION m_csTimelines;                                                          // protects the list below
+    CCallTimeline* m_pFirst;                                                                   // every host's timeline
+    int m_nLanes;                                                                            // trace "tid"s handed out
+    CEventTrace m_EventTrace;                                                      // records events - see EventTrace.h
+ };
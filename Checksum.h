@@ -0,0 +1,124 @@
+/**********************************************************************************************************************
+ *                                       This file contains the CChecksum class.                                      *
+ *                                                                                                                    *
+ * This provides the byte sums used throughout communication with a master auditor. A frame's checksum is the low     *
+ * byte of the bitwise NOT of the sum of all the bytes preceding it (T, length, command and payload); the checksum of *
+ * a firmware or configuration image (used by ProtelHost to find devices due to receive identical data) is simply the *
+ * sum of all its bytes.                                                                                              *
+ *                                                                                                                    *
+ * An instance keeps a running sum, so a frame's checksum can be built up as its bytes arrive or as a packet is       *
+ * assembled without rescanning data that has already been summed. The static Sum method adds up a whole buffer: on   *
+ * x86/x64 it uses SSE2 to sum 16 bytes per instruction, so summing a complete (e.g. 256KB) image is cheap.           *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+#if defined ( _M_IX86 ) || defined ( _M_X64 )
+#include <emmintrin.h>                                                                               // SSE2 intrinsics
+#define __CHECKSUM_SSE2__
+#endif
+
+class CChecksum
+ {
+public:
+    CChecksum(void) :
+        m_nSum ( 0 )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+    }
+
+    void Reset ( void )
+    {
+        /**************************************************************************************************************
+         * This clears the running sum, e.g. before a new frame is started.                                           *
+         **************************************************************************************************************/
+        m_nSum = 0;
+    }
+
+    void Add ( BYTE Value )
+    {
+        m_nSum += Value;                                                        // add a single byte to the running sum
+    }
+
+    void Add ( BYTE* pData, long DataLength )
+    {
+        m_nSum += Sum ( pData, DataLength );                                         // add a buffer to the running sum
+    }
+
+    void AddSum ( __int64 PartialSum )
+    {
+        m_nSum += PartialSum;                                 // add the sum of some bytes already calculated elsewhere
+    }
+
+    __int64 GetSum ( void )
+    {
+        return m_nSum;
+    }
+
+    BYTE GetFrameChecksum ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the frame checksum corresponding to the running sum, i.e. the byte that must follow the       *
+         * bytes summed so far for the frame to be valid.                                                             *
+         **************************************************************************************************************/
+        return ( BYTE )( ~m_nSum & 0xff );
+    }
+    __declspec(property(get = GetFrameChecksum)) BYTE FrameChecksum;
+
+    static BYTE CalculateFrameChecksum ( BYTE* pFrame, int FrameLength )
+    {
+        /**************************************************************************************************************
+         * This returns the valid/expected checksum for a frame in pFrame of FrameLength bytes, including the sync    *
+         * character and checksum position.                                                                           *
+         **************************************************************************************************************/
+        return ( BYTE )( ~Sum ( pFrame, FrameLength - 1 ) & 0xff );
+    }
+
+    static bool IsValidFrameChecksum ( BYTE* pFrame, int FrameLength )
+    {
+        /**************************************************************************************************************
+         * This returns true if the checksum (last byte) of the FrameLength byte frame in pFrame is valid.            *
+         **************************************************************************************************************/
+        return CalculateFrameChecksum ( pFrame, FrameLength ) == pFrame [ FrameLength - 1 ];
+    }
+
+    static __int64 Sum ( BYTE* pData, long DataLength )
+    {
+        /**************************************************************************************************************
+         * This returns the sum of the DataLength bytes in pData. With SSE2, each 16 bytes are summed by a single     *
+         * PSADBW (sum of absolute differences against zero) into two 64 bit lanes; any remaining bytes are added     *
+         * one at a time.                                                                                             *
+         **************************************************************************************************************/
+        __int64 Total = 0;
+        long Offset = 0;
+
+#if defined ( __CHECKSUM_SSE2__ )
+        if ( DataLength >= 16 )
+        {
+            __m128i Zero = _mm_setzero_si128();
+            __m128i Accumulator = _mm_setzero_si128();
+            for ( ; Offset + 16 <= DataLength; Offset += 16 )
+            {
+                __m128i Bytes = _mm_loadu_si128 (( __m128i* )( pData + Offset ));              // no alignment required
+                Accumulator = _mm_add_epi64 ( Accumulator, _mm_sad_epu8 ( Bytes, Zero ));
+            }
+            __int64 Lanes [ 2 ];
+            _mm_storeu_si128 (( __m128i* ) Lanes, Accumulator );
+            Total = Lanes [ 0 ] + Lanes [ 1 ];
+        }
+#endif
+
+        for ( ; Offset < DataLength; Offset++ )
+        {
+            Total += *( pData + Offset );
+        }
+        return Total;
+    }
+
+protected:
+    __int64 m_nSum;                                                                                      // running sum
+ };
@@ -0,0 +1,224 @@
+/**********************************************************************************************************************
+ *                         This file contains the CDatabaseWorkers and CDatabaseWork classes.                         *
+ *                                                                                                                    *
+ * A call makes database round trips all the way through: the new COMM_SERVER_CALL row when it connects, each frame   *
+ * sent and received, the central auditor and device lookups, and the finished call. These used to be made on the     *
+ * reactor loop thread that runs the connection (see SocketReactor.h and SerialReactor.h), so a slow round trip held  *
+ * up every other connection on that loop - their responses, timeouts and retransmits waited behind it.               *
+ *                                                                                                                    *
+ * Instead, a loop hands each piece of a session's work that may reach the database (a CDatabaseWork) to the single   *
+ * CDatabaseWorkers. It has "Database Workers" threads waiting on one I/O completion port, so the work is picked up   *
+ * by whichever is free, and the loop carries on with its other sessions meanwhile. Once the work is done, the        *
+ * session posts its completion back to its own loop's port, and the loop carries out what the work asked of it (its  *
+ * timers, ending the session). The loop never gives a session more work while some is outstanding, so a session's    *
+ * work is still done one piece at a time, in order.                                                                  *
+ *                                                                                                                    *
+ * The workers only run the work. Each database call borrows its connection from CAdoConnectionPool for just that     *
+ * call, so a worker holds at most one at a time: "Connection Pool Size" allows for every worker holding one (see     *
+ * AdoConnectionPool.h).                                                                                              *
+ *                                                                                                                    *
+ * With "Database Workers" set to 0 the workers aren't started and Queue returns FALSE, so each loop does the work    *
+ * itself, as before.                                                                                                 *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+#include <windows.h>
+#include "EventTrace.h"
+#include "ProfileValues.h"
+
+#define DATABASEWORKERS_MAXTHREADS  64                                          // most "Database Workers" threads used
+
+class CDatabaseWork
+ {
+public:
+    virtual void DoDatabaseWork ( void ) = 0;                      // called on a worker thread once Queue has taken it
+ };
+
+class CDatabaseWorkers
+ {
+public:
+    static CDatabaseWorkers& Instance ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the single pool of workers shared by every reactor loop. CApplication::Start calls it (to     *
+         * Start the workers) before any reactor is started, so it is constructed then.                               *
+         **************************************************************************************************************/
+        static CDatabaseWorkers databaseWorkers;
+        return databaseWorkers;
+    }
+
+    bool Start ( void )
+    {
+        /**************************************************************************************************************
+         * This reads "Database Workers" and, unless it is 0, starts that many worker threads (at most                *
+         * DATABASEWORKERS_MAXTHREADS) on a new completion port. It returns TRUE if the workers are running.          *
+         **************************************************************************************************************/
+        if ( m_nWorkers > 0 )
+        {
+            return true;
+        }
+        CProfileValues profileValues;
+        int nWorkers = profileValues.GetDatabaseWorkers();
+        if ( nWorkers <= 0 )
+        {
+            return false;                                                    // each loop does its database work itself
+        }
+        if ( nWorkers > DATABASEWORKERS_MAXTHREADS )
+        {
+            nWorkers = DATABASEWORKERS_MAXTHREADS;
+        }
+
+        m_hPort = CreateIoCompletionPort(
+            INVALID_HANDLE_VALUE,                         // FileHandle [in] - INVALID_HANDLE_VALUE = create a new port
+            NULL,                                                          // ExistingCompletionPort [in] - NULL = none
+            0,                                                           // CompletionKey [in] - not used when creating
+            0 );                                // NumberOfConcurrentThreads [in] - 0 = as many as there are processors
+        if ( m_hPort == NULL )
+        {
+            return false;
+        }
+        for ( int nLoop = 0; nLoop < nWorkers; nLoop++ )
+        {
+            m_hThreads [ m_nWorkers ] = CreateThread(
+                NULL,                                           // lpThreadAttributes [in] - NULL = cannot be inherited
+                0,                                           // dwStackSize [in] - initial stack size - 0 = use default
+                WorkerThreadProc,                                                 // lpStartAddress [in] - in this file
+                this,                                                                    // lpParameter [in] - the pool
+                0,                                                            // dwCreationFlags [in] - run immediately
+                NULL );                                                       // lpThreadId [out] - NULL = not returned
+            if ( m_hThreads [ m_nWorkers ] == NULL )
+            {
+                break;
+            }
+            m_nWorkers++;
+        }
+        if ( m_nWorkers == 0 )
+        {
+            CloseHandle ( m_hPort );
+            m_hPort = NULL;
+            return false;
+        }
+        m_bRunning = true;
+        return true;
+    }
+
+    void Stop ( void )
+    {
+        /**************************************************************************************************************
+         * This is used once the reactors have stopped: a loop doesn't exit while any of its work is outstanding, so  *
+         * there is nothing left to do. Each thread is asked to exit and waited for, and the total is recorded as an  *
+         * event.                                                                                                     *
+         **************************************************************************************************************/
+        if ( m_nWorkers == 0 )
+        {
+            return;
+        }
+        m_bRunning = false;
+        for ( int nLoop = 0; nLoop < m_nWorkers; nLoop++ )
+        {
+            PostQueuedCompletionStatus ( m_hPort, 0, 0, NULL );                                         // key 0 = exit
+        }
+        WaitForMultipleObjects (
+            m_nWorkers,                                                // nCount [in] - number of objects in *lpHandles
+            m_hThreads,                                                         // lpHandles [in] - objects to wait for
+            TRUE,                                         // bWaitAll [in] - TRUE - return when all threads have exited
+            INFINITE );                                                        // dwMilliseconds [in] - until they have
+        for ( int nLoop = 0; nLoop < m_nWorkers; nLoop++ )
+        {
+            CloseHandle ( m_hThreads [ nLoop ] );
+            m_hThreads [ nLoop ] = NULL;
+        }
+        CloseHandle ( m_hPort );
+        m_hPort = NULL;
+
+        m_EventTrace.Event ( CEventTrace::Information, "CDatabaseWorkers::Stop - %d workers did %ld pieces of work",
+            m_nWorkers, m_nDone );
+        m_nWorkers = 0;
+    }
+
+    bool Queue ( CDatabaseWork* pWork )
+    {
+        /**************************************************************************************************************
+         * This queues pWork for the next free worker, which calls its DoDatabaseWork. It returns FALSE, having done  *
+         * nothing, if the workers aren't running, in which case the caller does the work itself.                     *
+         **************************************************************************************************************/
+        if ( m_bRunning == false )
+        {
+            return false;
+        }
+        return PostQueuedCompletionStatus ( m_hPort, 0, ( ULONG_PTR ) pWork, NULL ) != FALSE;
+    }
+
+    bool GetRunning ( void )
+    {
+        return m_bRunning;
+    }
+    __declspec(property(get = GetRunning)) bool Running;
+
+private:
+    CDatabaseWorkers(void) :
+        m_hPort ( NULL ),
+        m_nWorkers ( 0 ),
+        m_bRunning ( false ),
+        m_nDone ( 0 )
+    {
+        /**************************************************************************************************************
+         *                                                CONSTRUCTOR.                                                *
+         **************************************************************************************************************/
+        ZeroMemory ( m_hThreads, sizeof ( m_hThreads ));
+    }
+
+    virtual ~CDatabaseWorkers(void)
+    {
+        /**************************************************************************************************************
+         *                                                 DESTRUCTOR.                                                *
+         **************************************************************************************************************/
+        Stop();
+    }
+
+    static DWORD WINAPI WorkerThreadProc ( LPVOID lpParam )
+    {
+        /**************************************************************************************************************
+         * This is a worker thread. The work makes database calls, so the COM library is initialised for it.          *
+         **************************************************************************************************************/
+        CoInitialize(NULL);                                               // initialise the COM library for this thread
+        (( CDatabaseWorkers* ) lpParam )->Run();
+        CoUninitialize();                                        // close the COM library and clean up thread resources
+        return 0;
+    }
+
+    void Run ( void )
+    {
+        /**************************************************************************************************************
+         * This does each piece of work queued on the port, in the order queued, until asked to exit.                 *
+         **************************************************************************************************************/
+        while ( true )
+        {
+            DWORD dwBytes = 0;
+            ULONG_PTR ulKey = 0;
+            OVERLAPPED* pOverlapped = NULL;
+            GetQueuedCompletionStatus (
+                m_hPort,                                                       // CompletionPort [in] - the pool's port
+                &dwBytes,                                                           // lpNumberOfBytes [out] - not used
+                &ulKey,                                                  // lpCompletionKey [out] - the work (0 = exit)
+                &pOverlapped,                                                          // lpOverlapped [out] - not used
+                INFINITE );                                       // dwMilliseconds [in] - INFINITE = wait indefinitely
+            if ( ulKey == 0 )
+            {
+                break;
+            }
+            (( CDatabaseWork* ) ulKey )->DoDatabaseWork();
+            InterlockedIncrement ( &m_nDone );
+        }
+    }
+
+    HANDLE m_hPort;                                                           // the work queued for the worker threads
+    HANDLE m_hThreads [ DATABASEWORKERS_MAXTHREADS ];
+    int m_nWorkers;                                                                        // number of threads running
+    volatile bool m_bRunning;                                                            // TRUE while Queue takes work
+    volatile LONG m_nDone;                                                             // pieces of work done, in total
+    CEventTrace m_EventTrace;                                                      // records events - see EventTrace.h
+ };
@@ -0,0 +1,540 @@
+/**********************************************************************************************************************
+ *                          This file contains the CDevicePlan and CDevicePrefetcher classes.                         *
+ *                                                                                                                    *
+ * Once the last N response of a call has arrived, CProtelHost has to know which of the master auditor's devices need *
+ * configuration, firmware or a freebee download (the "device plan", see CProtelDevice::AddPlan). It used to look     *
+ * this up only then, before sending the first U command, so every call with DEX data waited for the database before  *
+ * its upload could start. Nothing in the plan is needed until the first O command, after the upload.                 *
+ *                                                                                                                    *
+ * Instead, as each N response is parsed, CProtelHost hands the devices it named to the single CDevicePrefetcher      *
+ * as a CDevicePlan. One of the prefetcher's "Device Prefetchers" threads looks them up (in one round trip, with a    *
+ * database connection borrowed from CAdoConnectionPool) while the call carries on with the next N command and the    *
+ * DEX upload. The host waits for its plans only when it is about to send the first O command (see                    *
+ * CProtelHost::DevicePlanBarrier). Devices whose plan couldn't be prefetched are looked up then, as before.          *
+ *                                                                                                                    *
+ * While a plan is outstanding its devices belong to the prefetcher thread, which sets up their downloads; the host   *
+ * doesn't touch them until the plan is settled or cancelled (see CDevicePlan::Cancel). With "Device Prefetchers"     *
+ * set to 0, or "Device Plan Batch" set to 0, the prefetcher isn't started.                                           *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+#include "AdoConnection.h"
+#include "AdoConnectionPool.h"
+#include "EventTrace.h"
+#include "ProfileValues.h"
+#include "ProtelDevice.h"
+
+#define DEVICEPREFETCH_MAXTHREADS   16                                        // most "Device Prefetchers" threads used
+#define DEVICEPREFETCH_MAXDEVICES   32                                       // most devices in a plan (as CProtelHost)
+#define DEVICEPREFETCH_WAITSECONDS  30                       // the host looks devices up itself if a plan takes longer
+
+class CDevicePlan
+ {
+public:
+    CDevicePlan ( CProtelDevice** Devices, int First, int Count ) :
+        m_nRefs ( 1 ),
+        m_nFirst ( First ),
+        m_nCount ( 0 ),
+        m_bSettled ( false ),
+        m_bSucceeded ( false ),
+        m_bCancelled ( false )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR. The plan is for Count devices starting at Devices [ First ] (their index is what              *
+         * FreeBeeAuditDeviceidx is set to). The host that creates a CDevicePlan holds the first reference to it;     *
+         * CDevicePrefetcher holds another while it is queued or being looked up.                                     *
+         **************************************************************************************************************/
+        InitializeCriticalSection ( &m_csDevices );
+        for ( int nLoop = 0; nLoop < Count && m_nCount < DEVICEPREFETCH_MAXDEVICES; nLoop++ )
+        {
+            m_pDevices [ m_nCount++ ] = Devices [ First + nLoop ];
+        }
+        m_hChanged = CreateEvent(
+            NULL,                                                            // lpEventAttributes [in] - NULL = default
+            TRUE,                                                         // bManualReset [in] - stays set once settled
+            FALSE,                                                                // bInitialState [in] - not signalled
+            NULL );                                                                     // lpName [in] - NULL = unnamed
+        m_dwCreated = GetTickCount();
+    }
+
+    void AddRef ( void )
+    {
+        InterlockedIncrement ( &m_nRefs );
+    }
+
+    void Release ( void )
+    {
+        /**************************************************************************************************************
+         * This drops a reference, deleting the CDevicePlan once the host and the prefetcher have both finished with  *
+         * it.                                                                                                        *
+         **************************************************************************************************************/
+        if ( InterlockedDecrement ( &m_nRefs ) == 0 )
+        {
+            delete this;
+        }
+    }
+
+    bool Execute ( CAdoConnection& adoConnection )
+    {
+        /**************************************************************************************************************
+         * This looks the plan's devices up in a single round trip, by executing an anonymous PL/SQL block that       *
+         * makes each device's calls in turn (see CProtelDevice::AddPlan), and sets up their downloads. The           *
+         * parameters returned for each device are told apart by a prefix. It returns TRUE on success, and settles    *
+         * the plan either way. Once the plan has been cancelled its devices are left alone.                          *
+         **************************************************************************************************************/
+        char szBlock [ 64 + DEVICEPREFETCH_MAXDEVICES * 256 ];
+        StringCbCopy ( szBlock, sizeof ( szBlock ), "BEGIN\n" );
+        for ( int nLoop = 0; nLoop < m_nCount; nLoop++ )
+        {
+            StringCbCat ( szBlock, sizeof ( szBlock ), CProtelDevice::GetPlanStatements() );
+        }
+        StringCbCat ( szBlock, sizeof ( szBlock ), "END;" );
+
+        bool bSucceeded = false;
+        bool bLocked = true;
+        EnterCriticalSection ( &m_csDevices );
+        if ( m_nCount > 0 && m_bCancelled == false )
+        {
+            try
+            {
+                char szPrefix [ 16 ];
+                CAdoStoredProcedure adoPlan ( szBlock, ADODB::CommandTypeEnum::adCmdText );
+                for ( int nLoop = 0; nLoop < m_nCount; nLoop++ )
+                {
+                    StringCbPrintf ( szPrefix, sizeof ( szPrefix ), "d%d_", m_nFirst + nLoop );
+                    m_pDevices [ nLoop ]->AddPlan ( adoPlan, szPrefix );
+                }
+                LeaveCriticalSection ( &m_csDevices );                                 // the host may cancel meanwhile
+                bLocked = false;
+
+                bool bExecuted = adoConnection.ExecuteNonQuery ( adoPlan, false, true );
+
+                EnterCriticalSection ( &m_csDevices );
+                bLocked = true;
+                if ( bExecuted == true && m_bCancelled == false )
+                {
+                    for ( int nLoop = 0; nLoop < m_nCount; nLoop++ )
+                    {
+                        StringCbPrintf ( szPrefix, sizeof ( szPrefix ), "d%d_", m_nFirst + nLoop );
+                        if ( m_pDevices [ nLoop ]->TakePlan ( adoPlan, szPrefix ) >= 0 )
+                        {                                          // get index of freebee/audit in proteldevices array
+                            m_pDevices [ nLoop ]->FreeBeeAuditDeviceidx = m_nFirst + nLoop;
+                        }
+                    }
+                    bSucceeded = true;
+                }
+            }
+            catch ( _com_error &comError )
+            {
+                m_EventTrace.Event ( CEventTrace::Information, "CDevicePlan::Execute <--> ERROR: %s",
+                    CErrorMessage::ReturnComErrorMessage ( comError ));
+            }
+        }
+        if ( bLocked == true )
+        {
+            LeaveCriticalSection ( &m_csDevices );
+        }
+        Settle ( bSucceeded );
+        return bSucceeded;
+    }
+
+    bool Wait ( DWORD Milliseconds )
+    {
+        /**************************************************************************************************************
+         * This waits up to Milliseconds for the plan to be settled, and returns TRUE if its devices were looked up.  *
+         **************************************************************************************************************/
+        if ( m_bSettled == false )
+        {
+            WaitForSingleObject ( m_hChanged, Milliseconds );
+        }
+        return Succeeded;
+    }
+
+    void Cancel ( void )
+    {
+        /**************************************************************************************************************
+         * This is used by the host once it has stopped waiting for the plan (or the call has ended). Once it         *
+         * returns, the prefetcher no longer touches the plan's devices: if it hasn't set up their downloads yet, it  *
+         * won't, and they must be looked up again if they are needed.                                                *
+         **************************************************************************************************************/
+        EnterCriticalSection ( &m_csDevices );
+        m_bCancelled = true;
+        LeaveCriticalSection ( &m_csDevices );
+    }
+
+    void Settle ( bool Succeeded )
+    {
+        /**************************************************************************************************************
+         * This is used by Execute, or by CDevicePrefetcher for a plan it can't look up, to wake the host if it is    *
+         * waiting.                                                                                                   *
+         **************************************************************************************************************/
+        m_bSucceeded = Succeeded;
+        m_dwSettled = GetTickCount();
+        m_bSettled = true;
+        SetEvent ( m_hChanged );
+    }
+
+    int GetFirst ( void )
+    {
+        return m_nFirst;
+    }
+    __declspec(property(get = GetFirst)) int First;
+
+    int GetCount ( void )
+    {
+        return m_nCount;
+    }
+    __declspec(property(get = GetCount)) int Count;
+
+    bool GetSettled ( void )                                                   // looked up, or it is clear it won't be
+    {
+        return m_bSettled;
+    }
+    __declspec(property(get = GetSettled)) bool Settled;
+
+    bool GetSucceeded ( void )                                                     // looked up and not cancelled first
+    {
+        return m_bSettled == true && m_bSucceeded == true && m_bCancelled == false;
+    }
+    __declspec(property(get = GetSucceeded)) bool Succeeded;
+
+    DWORD GetMilliseconds ( void )                                               // from being created to being settled
+    {
+        return m_bSettled == true ? m_dwSettled - m_dwCreated : GetTickCount() - m_dwCreated;
+    }
+    __declspec(property(get = GetMilliseconds)) DWORD Milliseconds;
+
+private:
+    virtual ~CDevicePlan(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+        if ( m_hChanged != NULL )
+        {
+            CloseHandle ( m_hChanged );
+        }
+        DeleteCriticalSection ( &m_csDevices );
+    }
+
+    volatile LONG m_nRefs;                                                   // the host plus the prefetcher, if queued
+    CRITICAL_SECTION m_csDevices;                                      // held while the prefetcher touches the devices
+    CProtelDevice* m_pDevices [ DEVICEPREFETCH_MAXDEVICES ];                             // the first m_nCount are used
+    int m_nFirst;                                                              // index of m_pDevices [ 0 ] in the host
+    int m_nCount;
+    volatile bool m_bSettled;                                            // set once, when Execute is done (or skipped)
+    volatile bool m_bSucceeded;                                                    // the devices' downloads are set up
+    volatile bool m_bCancelled;                                                 // the devices mustn't be touched again
+    DWORD m_dwCreated;                                                                           // GetTickCount values
+    DWORD m_dwSettled;
+    HANDLE m_hChanged;                                                                              // set once settled
+    CEventTrace m_EventTrace;                                                      // records events - see EventTrace.h
+ };
+
+class CDevicePrefetcher
+ {
+public:
+    static CDevicePrefetcher& Instance ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the single prefetcher shared by every connection. CApplication::Start calls it (to Start the  *
+         * prefetcher) before any connection threads are started, so it is constructed then.                          *
+         **************************************************************************************************************/
+        static CDevicePrefetcher devicePrefetcher;
+        return devicePrefetcher;
+    }
+
+    bool Start ( void )
+    {
+        /**************************************************************************************************************
+         * This reads "Device Prefetchers" and, unless it (or "Device Plan Batch") is 0, starts that many threads     *
+         * (at most DEVICEPREFETCH_MAXTHREADS). It returns TRUE if the prefetcher is running.                         *
+         **************************************************************************************************************/
+        if ( m_nThreads > 0 )
+        {
+            return m_bRunning;                                                    // FALSE if Stop left threads running
+        }
+        CProfileValues profileValues;
+        int nThreads = profileValues.GetDevicePrefetchers();
+        if ( nThreads <= 0 || profileValues.GetDevicePlanBatch() == false )
+        {
+            return false;                                            // devices are looked up after the last N response
+        }
+        if ( nThreads > DEVICEPREFETCH_MAXTHREADS )
+        {
+            nThreads = DEVICEPREFETCH_MAXTHREADS;
+        }
+
+        m_bStopping = false;
+        m_hWake = CreateSemaphore(
+            NULL,                                                        // lpSemaphoreAttributes [in] - NULL = default
+            0,                                                                             // lInitialCount [in] - none
+            MAXLONG,                                                                              // lMaximumCount [in]
+            NULL );                                                                     // lpName [in] - NULL = unnamed
+        if ( m_hWake == NULL )
+        {
+            return false;
+        }
+        for ( int nLoop = 0; nLoop < nThreads; nLoop++ )
+        {
+            m_hThreads [ nLoop ] = CreateThread(
+                NULL,                                           // lpThreadAttributes [in] - NULL = cannot be inherited
+                0,                                           // dwStackSize [in] - initial stack size - 0 = use default
+                PrefetchThreadProc,                                               // lpStartAddress [in] - in this file
+                this,                                                                          // lpParameter [in] - us
+                0,                                                            // dwCreationFlags [in] - run immediately
+                NULL );                                                       // lpThreadId [out] - NULL = not returned
+            if ( m_hThreads [ nLoop ] == NULL )
+            {
+                break;
+            }
+            m_nThreads++;
+        }
+        if ( m_nThreads == 0 )
+        {
+            CloseHandle ( m_hWake );
+            m_hWake = NULL;
+            return false;
+        }
+        m_bRunning = true;
+        return true;
+    }
+
+    void Stop ( void )
+    {
+        /**************************************************************************************************************
+         * This is used once the connections have shut down. New plans are no longer queued, the threads finish what  *
+         * they are looking up (all of them together waiting up to DEVICEPREFETCH_WAITSECONDS) and exit, any plans    *
+         * still queued are settled unlooked-up, and the totals are recorded as an event.                             *
+         *                                                                                                            *
+         * A thread that hasn't exited by then (e.g. it is stuck in the database) is reported and left running: its   *
+         * handle, the semaphore and the queue's lock are left for it rather than freed under it, here or by the      *
+         * destructor.                                                                                                *
+         **************************************************************************************************************/
+        if ( m_nThreads == 0 || m_bStopping == true )
+        {
+            return;                                                             // not started, or threads left running
+        }
+        m_bRunning = false;
+        m_bStopping = true;
+        ReleaseSemaphore ( m_hWake, m_nThreads, NULL );                                            // wake every thread
+        WaitForMultipleObjects ( m_nThreads, m_hThreads, TRUE, DEVICEPREFETCH_WAITSECONDS * 1000 );
+        int nRunning = 0;
+        for ( int nLoop = 0; nLoop < m_nThreads; nLoop++ )
+        {
+            HANDLE hThread = m_hThreads [ nLoop ];
+            m_hThreads [ nLoop ] = NULL;
+            if ( WaitForSingleObject ( hThread, 0 ) != WAIT_OBJECT_0 )
+            {
+                m_hThreads [ nRunning++ ] = hThread;                     // still looking up - left running (see above)
+                continue;
+            }
+            CloseHandle ( hThread );
+        }
+        m_nThreads = nRunning;
+        for ( CDevicePlan* pPlan = Dequeue(); pPlan != NULL; pPlan = Dequeue())
+        {
+            InterlockedIncrement ( &m_nFailed );
+            pPlan->Settle ( false );
+            pPlan->Release();
+        }
+        if ( nRunning > 0 )
+        {
+            m_EventTrace.Event ( CEventTrace::Warning,
+                "CDevicePrefetcher::Stop - %d threads still looking up after %d seconds are left running", nRunning,
+                DEVICEPREFETCH_WAITSECONDS );
+        }
+        else
+        {
+            CloseHandle ( m_hWake );
+            m_hWake = NULL;
+        }
+
+        m_EventTrace.Event ( CEventTrace::Information,
+            "CDevicePrefetcher::Stop - %ld device plans queued, %ld looked up, %ld failed",
+            m_nQueued, m_nPlanned, m_nFailed );
+    }
+
+    bool Prefetch ( CDevicePlan* pPlan )
+    {
+        /**************************************************************************************************************
+         * This queues pPlan to be looked up by the next free thread. It returns FALSE, having done nothing, if the   *
+         * prefetcher isn't running, in which case the host looks the devices up itself.                              *
+         **************************************************************************************************************/
+        if ( m_bRunning == false )
+        {
+            return false;
+        }
+        pPlan->AddRef();                                                                     // released once looked up
+        SPlanEntry* pEntry = new SPlanEntry;
+        pEntry->pNext = NULL;
+        pEntry->pPlan = pPlan;
+        EnterCriticalSection ( &m_csQueue );
+        if ( m_pTail == NULL )
+        {
+            m_pHead = pEntry;
+        }
+        else
+        {
+            m_pTail->pNext = pEntry;
+        }
+        m_pTail = pEntry;
+        LeaveCriticalSection ( &m_csQueue );
+        ReleaseSemaphore ( m_hWake, 1, NULL );
+
+        InterlockedIncrement ( &m_nQueued );
+        return true;
+    }
+
+    bool GetRunning ( void )
+    {
+        return m_bRunning;
+    }
+    __declspec(property(get = GetRunning)) bool Running;
+
+    long GetQueued ( void )
+    {
+        return m_nQueued;
+    }
+    __declspec(property(get = GetQueued)) long Queued;
+
+    long GetPlanned ( void )
+    {
+        return m_nPlanned;
+    }
+    __declspec(property(get = GetPlanned)) long Planned;
+
+    long GetFailed ( void )
+    {
+        return m_nFailed;
+    }
+    __declspec(property(get = GetFailed)) long Failed;
+
+private:
+    struct SPlanEntry                                                                                  // a queued plan
+    {
+        SPlanEntry* pNext;
+        CDevicePlan* pPlan;
+    };
+
+    CDevicePrefetcher(void) :
+        m_nThreads ( 0 ),
+        m_hWake ( NULL ),
+        m_pHead ( NULL ),
+        m_pTail ( NULL ),
+        m_bRunning ( false ),
+        m_bStopping ( false ),
+        m_nQueued ( 0 ),
+        m_nPlanned ( 0 ),
+        m_nFailed ( 0 )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+        InitializeCriticalSection ( &m_csQueue );
+        for ( int nLoop = 0; nLoop < DEVICEPREFETCH_MAXTHREADS; nLoop++ )
+        {
+            m_hThreads [ nLoop ] = NULL;
+        }
+    }
+
+    virtual ~CDevicePrefetcher(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+        Stop();
+        if ( m_nThreads == 0 )
+        {
+            DeleteCriticalSection ( &m_csQueue );                                  // threads Stop left running keep it
+        }
+    }
+
+    CDevicePlan* Dequeue ( void )
+    {
+        /**************************************************************************************************************
+         * This takes the oldest plan off the queue, returning NULL if there isn't one.                               *
+         **************************************************************************************************************/
+        EnterCriticalSection ( &m_csQueue );
+        SPlanEntry* pEntry = m_pHead;
+        if ( pEntry != NULL )
+        {
+            m_pHead = pEntry->pNext;
+            if ( m_pHead == NULL )
+            {
+                m_pTail = NULL;
+            }
+        }
+        LeaveCriticalSection ( &m_csQueue );
+        if ( pEntry == NULL )
+        {
+            return NULL;
+        }
+        CDevicePlan* pPlan = pEntry->pPlan;
+        delete pEntry;
+        return pPlan;
+    }
+
+    static DWORD WINAPI PrefetchThreadProc ( LPVOID lpParam )
+    {
+        /**************************************************************************************************************
+         * This is a prefetcher thread. It uses its own database connections, so the COM library is initialised for   *
+         * it.                                                                                                        *
+         **************************************************************************************************************/
+        CoInitialize(NULL);                                               // initialise the COM library for this thread
+        (( CDevicePrefetcher* ) lpParam )->Run();
+        CoUninitialize();                                        // close the COM library and clean up thread resources
+        return 0;
+    }
+
+    void Run ( void )
+    {
+        /**************************************************************************************************************
+         * This takes a plan off the queue each time the semaphore is released and looks it up, on a connection       *
+         * borrowed from CAdoConnectionPool and handed back straight after. A plan whose host has cancelled it        *
+         * while it was queued is settled without a round trip. Once stopping, it exits.                              *
+         **************************************************************************************************************/
+        for ( ;; )
+        {
+            WaitForSingleObject ( m_hWake, INFINITE );
+            if ( m_bStopping == true )
+            {
+                break;                                                               // Stop settles whatever is queued
+            }
+            CDevicePlan* pPlan = Dequeue();
+            if ( pPlan == NULL )
+            {
+                continue;
+            }
+            bool bPlanned = false;
+            CAdoConnection* pConnection = CAdoConnectionPool::Instance().Acquire();
+            if ( pConnection != NULL )
+            {
+                bPlanned = pPlan->Execute ( *pConnection );
+                CAdoConnectionPool::Instance().Release ( pConnection );
+            }
+            else
+            {
+                pPlan->Settle ( false );
+            }
+            InterlockedIncrement ( bPlanned == true ? &m_nPlanned : &m_nFailed );
+            pPlan->Release();
+        }
+    }
+
+    int m_nThreads;                               // threads started ("Device Prefetchers"), or those Stop left running
+    HANDLE m_hThreads [ DEVICEPREFETCH_MAXTHREADS ];                                   // the first m_nThreads are used
+    HANDLE m_hWake;                                              // semaphore released once per plan queued, or on Stop
+    CRITICAL_SECTION m_csQueue;                                                         // protects m_pHead and m_pTail
+    SPlanEntry* m_pHead;                                                                                 // oldest plan
+    SPlanEntry* m_pTail;                                                                                 // newest plan
+    volatile bool m_bRunning;                                                       // Prefetch queues plans while true
+    volatile bool m_bStopping;                                                                      // the threads exit
+    volatile LONG m_nQueued;                                                                // plans queued since Start
+    volatile LONG m_nPlanned;                                                           // plans looked up successfully
+    volatile LONG m_nFailed;                                               // plans that failed or were never looked up
+    CEventTrace m_EventTrace;                                                      // records events - see EventTrace.h
+ };
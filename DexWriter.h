@@ -0,0 +1,593 @@
+/**********************************************************************************************************************
+ *                               This file contains the CDexWriter and CDexCall classes.                              *
+ *                                                                                                                    *
+ * DEX data is uploaded from a master auditor a record at a time: the host sends a U command for each record and the  *
+ * auditor's response carries it. Each record used to be saved by PKG_COMM_SERVER.DEX2 before the U command for the   *
+ * next one was sent, so every record cost a database round trip on top of the round trip to the auditor. Instead,    *
+ * CProtelHost hands each record to the single CDexWriter, which queues it and returns at once, and the next U        *
+ * command is sent straight away; the database work overlaps with the conversation with the auditor.                  *
+ *                                                                                                                    *
+ * The writer has "DEX Writers" threads, each with a queue of its own and a database connection borrowed from         *
+ * CAdoConnectionPool while it has records to save. Every record of a call goes to the same thread (chosen by the     *
+ * call number), so a call's records are saved one at a time in the order they were received, as before, while        *
+ * different calls are saved in parallel.                                                                             *
+ *                                                                                                                    *
+ * The D command tells the auditor to dump (erase) the records it has just uploaded, so it must never be sent until   *
+ * every record is safely in the database. Each call has a CDexCall which counts its records queued and saved; once   *
+ * the last record (ffff) has been received, CProtelHost waits for the two to match (see CProtelHost::DexBarrier)     *
+ * before sending D. If a record can't be saved, the rest of the call's records are discarded and the call fails      *
+ * without a D command, so the auditor keeps the data for its next call. A failed record isn't tried again on another *
+ * connection: the failure doesn't show that it wasn't saved (the connection may have been lost after the commit),    *
+ * and saving it twice would leave a duplicate COMM_SERVER_DEX row.                                                   *
+ *                                                                                                                    *
+ * With "DEX Writers" set to 0 the writer isn't started and each record is saved before the next is requested.        *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+#include "AdoConnection.h"
+#include "AdoConnectionPool.h"
+#include "EventTrace.h"
+#include "FrameDecoder.h"
+#include "ProfileValues.h"
+#include "variantBlob.h"
+
+#define DEXWRITER_MAXTHREADS        16                                               // most "DEX Writers" threads used
+#define DEXWRITER_BARRIERSECONDS    60                    // D isn't sent unless every record is saved within this long
+#define DEXWRITER_STOPSECONDS       30                                  // Stop waits this long for the queues to empty
+
+class CDexCall
+ {
+public:
+    CDexCall(void) :
+        m_nRefs ( 1 ),
+        m_nQueued ( 0 ),
+        m_nWritten ( 0 ),
+        m_bFailed ( false )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR. The call that creates a CDexCall holds the first reference to it; CDexWriter holds another    *
+         * for each of its records still queued.                                                                      *
+         **************************************************************************************************************/
+        m_hChanged = CreateEvent(
+            NULL,                                                            // lpEventAttributes [in] - NULL = default
+            FALSE,                                                                    // bManualReset [in] - auto reset
+            FALSE,                                                                // bInitialState [in] - not signalled
+            NULL );                                                                     // lpName [in] - NULL = unnamed
+    }
+
+    void AddRef ( void )
+    {
+        InterlockedIncrement ( &m_nRefs );
+    }
+
+    void Release ( void )
+    {
+        /**************************************************************************************************************
+         * This drops a reference, deleting the CDexCall once the call and the writer have both finished with it.     *
+         **************************************************************************************************************/
+        if ( InterlockedDecrement ( &m_nRefs ) == 0 )
+        {
+            delete this;
+        }
+    }
+
+    bool Wait ( DWORD Milliseconds )
+    {
+        /**************************************************************************************************************
+         * This waits up to Milliseconds for every record queued to be saved, or for one to fail, and returns TRUE    *
+         * if every record was saved.                                                                                 *
+         **************************************************************************************************************/
+        DWORD dwStarted = GetTickCount();
+        while ( Settled == false )
+        {
+            DWORD dwElapsed = GetTickCount() - dwStarted;
+            if ( dwElapsed >= Milliseconds )
+            {
+                break;
+            }
+            WaitForSingleObject ( m_hChanged, Milliseconds - dwElapsed );
+        }
+        return Saved;
+    }
+
+    long GetQueued ( void )
+    {
+        return m_nQueued;
+    }
+    __declspec(property(get = GetQueued)) long Queued;
+
+    long GetWritten ( void )
+    {
+        return m_nWritten;
+    }
+    __declspec(property(get = GetWritten)) long Written;
+
+    bool GetFailed ( void )
+    {
+        return m_bFailed;
+    }
+    __declspec(property(get = GetFailed)) bool Failed;
+
+    bool GetSettled ( void )                                               // every record saved, or one of them failed
+    {
+        return m_bFailed == true || m_nWritten == m_nQueued;
+    }
+    __declspec(property(get = GetSettled)) bool Settled;
+
+    bool GetSaved ( void )                                                                        // every record saved
+    {
+        return m_bFailed == false && m_nWritten == m_nQueued;
+    }
+    __declspec(property(get = GetSaved)) bool Saved;
+
+private:
+    friend class CDexWriter;
+
+    virtual ~CDexCall(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+        if ( m_hChanged != NULL )
+        {
+            CloseHandle ( m_hChanged );
+        }
+    }
+
+    void RecordWritten ( bool Written )
+    {
+        /**************************************************************************************************************
+         * This is used by a writer thread once one of the call's records has been saved (or has failed or been       *
+         * discarded), waking the connection if it is waiting.                                                        *
+         **************************************************************************************************************/
+        if ( Written == true )
+        {
+            InterlockedIncrement ( &m_nWritten );
+        }
+        else
+        {
+            m_bFailed = true;
+        }
+        SetEvent ( m_hChanged );
+    }
+
+    volatile LONG m_nRefs;                                                          // the call plus each queued record
+    volatile LONG m_nQueued;                                                       // records queued (by the call only)
+    volatile LONG m_nWritten;                                                     // records saved (by a writer thread)
+    volatile bool m_bFailed;                                                 // a record couldn't be saved - call fails
+    HANDLE m_hChanged;                                                      // set when a record is saved or has failed
+ };
+
+class CDexWriter
+ {
+public:
+    static CDexWriter& Instance ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the single writer shared by every connection. CApplication::Start calls it (to Start the      *
+         * writer) before any connection threads are started, so it is constructed then.                              *
+         **************************************************************************************************************/
+        static CDexWriter dexWriter;
+        return dexWriter;
+    }
+
+    bool Start ( void )
+    {
+        /**************************************************************************************************************
+         * This reads "DEX Writers" and, unless it is 0, starts that many writer threads (at most                     *
+         * DEXWRITER_MAXTHREADS). It returns TRUE if the writer is running.                                           *
+         **************************************************************************************************************/
+        if ( m_nWriters > 0 )
+        {
+            return true;
+        }
+        CProfileValues profileValues;
+        int nWriters = profileValues.GetDexWriters();
+        if ( nWriters <= 0 )
+        {
+            return false;                                                           // records are saved as they arrive
+        }
+        if ( nWriters > DEXWRITER_MAXTHREADS )
+        {
+            nWriters = DEXWRITER_MAXTHREADS;
+        }
+
+        m_bStopping = false;
+        for ( int nLoop = 0; nLoop < nWriters; nLoop++ )
+        {
+            SWriter& writer = m_Writers [ nLoop ];
+            writer.pOwner = this;
+            writer.pHead = NULL;
+            writer.pTail = NULL;
+            writer.hWake = CreateEvent(
+                NULL,                                                        // lpEventAttributes [in] - NULL = default
+                FALSE,                                                                // bManualReset [in] - auto reset
+                FALSE,                                                            // bInitialState [in] - not signalled
+                NULL );                                                                 // lpName [in] - NULL = unnamed
+            if ( writer.hWake == NULL )
+            {
+                break;
+            }
+            writer.hThread = CreateThread(
+                NULL,                                           // lpThreadAttributes [in] - NULL = cannot be inherited
+                0,                                           // dwStackSize [in] - initial stack size - 0 = use default
+                WriterThreadProc,                                                 // lpStartAddress [in] - in this file
+                &writer,                                                            // lpParameter [in] - its own queue
+                0,                                                            // dwCreationFlags [in] - run immediately
+                NULL );                                                       // lpThreadId [out] - NULL = not returned
+            if ( writer.hThread == NULL )
+            {
+                CloseHandle ( writer.hWake );
+                writer.hWake = NULL;
+                break;
+            }
+            m_nWriters++;
+        }
+        if ( m_nWriters == 0 )
+        {
+            return false;
+        }
+        m_bRunning = true;
+        return true;
+    }
+
+    void Stop ( void )
+    {
+        /**************************************************************************************************************
+         * This is used once the connections have shut down. New records are no longer queued, each thread saves what *
+         * is left in its queue (all of them together waiting up to DEXWRITER_STOPSECONDS) and exits, and the totals  *
+         * are recorded as an event.                                                                                  *
+         *                                                                                                            *
+         * A thread that hasn't exited by then (e.g. stuck in the database) is reported and left running: its         *
+         * handles, queue and lock are left for it rather than freed under it, here or by the destructor.             *
+         **************************************************************************************************************/
+        if ( m_nWriters == 0 )
+        {
+            return;
+        }
+        m_bRunning = false;
+        m_bStopping = true;
+        DWORD dwStarted = GetTickCount();
+        for ( int nLoop = 0; nLoop < m_nWriters; nLoop++ )
+        {
+            SetEvent ( m_Writers [ nLoop ].hWake );
+        }
+        int nRunning = 0;
+        for ( int nLoop = 0; nLoop < m_nWriters; nLoop++ )
+        {
+            SWriter& writer = m_Writers [ nLoop ];
+            DWORD dwElapsed = GetTickCount() - dwStarted;
+            DWORD dwWait = dwElapsed < DEXWRITER_STOPSECONDS * 1000 ? DEXWRITER_STOPSECONDS * 1000 - dwElapsed : 0;
+            if ( WaitForSingleObject ( writer.hThread, dwWait ) != WAIT_OBJECT_0 )
+            {
+                nRunning++;                                                  // still saving - left running (see above)
+                continue;
+            }
+            CloseHandle ( writer.hThread );
+            writer.hThread = NULL;
+            CloseHandle ( writer.hWake );
+            writer.hWake = NULL;
+        }
+        m_nWriters = 0;
+        if ( nRunning > 0 )
+        {
+            m_EventTrace.Event ( CEventTrace::Warning,
+                "CDexWriter::Stop - %d writer threads still saving after %d seconds are left running", nRunning,
+                DEXWRITER_STOPSECONDS );
+        }
+
+        m_EventTrace.Event ( CEventTrace::Information,
+            "CDexWriter::Stop - %ld DEX records queued, %ld saved, %ld failed or discarded",
+            m_nQueued, m_nWritten, m_nFailed );
+    }
+
+    bool Write ( CDexCall* pCall, int CallNumber, double CallStartTime, const char* CentralAuditor,
+        const char* SerialNumber, int Sequence, BYTE* Data, int DataLength )
+    {
+        /**************************************************************************************************************
+         * This queues a DEX record (DataLength bytes in Data) to be saved by PKG_COMM_SERVER.DEX2, with the details  *
+         * it is saved under, and counts it in pCall. It returns FALSE, having done nothing, if the writer isn't      *
+         * running, in which case the caller saves the record itself.                                                 *
+         **************************************************************************************************************/
+        if ( m_bRunning == false )
+        {
+            return false;
+        }
+        if ( DataLength > FRAMEDECODER_MAXFRAME )
+        {
+            DataLength = FRAMEDECODER_MAXFRAME;
+        }
+        if ( DataLength < 0 )
+        {
+            DataLength = 0;
+        }
+
+        SDexRecord* pRecord = new SDexRecord;
+        pRecord->pNext = NULL;
+        pRecord->pCall = pCall;
+        pRecord->CallNumber = CallNumber;
+        pRecord->CallStartTime = CallStartTime;
+        StringCbCopy ( pRecord->CentralAuditor, sizeof ( pRecord->CentralAuditor ),
+            CentralAuditor != NULL ? CentralAuditor : "" );
+        StringCbCopy ( pRecord->SerialNumber, sizeof ( pRecord->SerialNumber ),
+            SerialNumber != NULL ? SerialNumber : "" );
+        pRecord->Sequence = Sequence;
+        pRecord->Length = DataLength;
+        CopyMemory ( pRecord->Data, Data, DataLength );
+        pCall->AddRef();                                                                   // released once it is saved
+        InterlockedIncrement ( &pCall->m_nQueued );
+
+        SWriter& writer = m_Writers [ ( DWORD ) CallNumber % ( DWORD ) m_nWriters ];        // same thread for the call
+        EnterCriticalSection ( &writer.csQueue );
+        if ( writer.pTail == NULL )
+        {
+            writer.pHead = pRecord;
+        }
+        else
+        {
+            writer.pTail->pNext = pRecord;
+        }
+        writer.pTail = pRecord;
+        LeaveCriticalSection ( &writer.csQueue );
+        SetEvent ( writer.hWake );
+
+        InterlockedIncrement ( &m_nQueued );
+        return true;
+    }
+
+    bool GetRunning ( void )
+    {
+        return m_bRunning;
+    }
+    __declspec(property(get = GetRunning)) bool Running;
+
+    long GetQueued ( void )
+    {
+        return m_nQueued;
+    }
+    __declspec(property(get = GetQueued)) long Queued;
+
+    long GetWritten ( void )
+    {
+        return m_nWritten;
+    }
+    __declspec(property(get = GetWritten)) long Written;
+
+    long GetFailed ( void )
+    {
+        return m_nFailed;
+    }
+    __declspec(property(get = GetFailed)) long Failed;
+
+private:
+    struct SDexRecord                                                                                // a queued record
+    {
+        SDexRecord* pNext;                                                                // next in the writer's queue
+        CDexCall* pCall;                                                                         // the call it is from
+        int CallNumber;
+        double CallStartTime;
+        char CentralAuditor [ 64 ];
+        char SerialNumber [ 64 ];
+        int Sequence;                                                                        // U command packet number
+        int Length;
+        BYTE Data [ FRAMEDECODER_MAXFRAME ];
+    };
+
+    struct SWriter                                                                     // a writer thread and its queue
+    {
+        CDexWriter* pOwner;
+        CRITICAL_SECTION csQueue;                                                           // protects pHead and pTail
+        SDexRecord* pHead;                                                                             // oldest record
+        SDexRecord* pTail;                                                                             // newest record
+        HANDLE hWake;                                                         // set when a record is queued or on Stop
+        HANDLE hThread;
+    };
+
+    CDexWriter(void) :
+        m_nWriters ( 0 ),
+        m_bRunning ( false ),
+        m_bStopping ( false ),
+        m_nQueued ( 0 ),
+        m_nWritten ( 0 ),
+        m_nFailed ( 0 )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+        for ( int nLoop = 0; nLoop < DEXWRITER_MAXTHREADS; nLoop++ )
+        {
+            InitializeCriticalSection ( &m_Writers [ nLoop ].csQueue );
+            m_Writers [ nLoop ].pOwner = this;
+            m_Writers [ nLoop ].pHead = NULL;
+            m_Writers [ nLoop ].pTail = NULL;
+            m_Writers [ nLoop ].hWake = NULL;
+            m_Writers [ nLoop ].hThread = NULL;
+        }
+    }
+
+    virtual ~CDexWriter(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+        Stop();
+        for ( int nLoop = 0; nLoop < DEXWRITER_MAXTHREADS; nLoop++ )
+        {
+            if ( m_Writers [ nLoop ].hThread == NULL )                           // a thread Stop left running keeps it
+            {
+                DeleteCriticalSection ( &m_Writers [ nLoop ].csQueue );
+            }
+        }
+    }
+
+    static DWORD WINAPI WriterThreadProc ( LPVOID lpParam )
+    {
+        /**************************************************************************************************************
+         * This is a writer thread. It uses its own database connection, so the COM library is initialised for it.    *
+         **************************************************************************************************************/
+        CoInitialize(NULL);                                               // initialise the COM library for this thread
+        SWriter* pWriter = ( SWriter* ) lpParam;
+        pWriter->pOwner->Run ( *pWriter );
+        CoUninitialize();                                        // close the COM library and clean up thread resources
+        return 0;
+    }
+
+    void Run ( SWriter& Writer )
+    {
+        /**************************************************************************************************************
+         * This waits for records to be queued for this thread, then saves them in turn until its queue is empty.     *
+         * A connection is borrowed from CAdoConnectionPool while there are records to save and handed back once the  *
+         * queue is empty. If saving a record fails, the call is marked as failed and its remaining records are       *
+         * discarded rather than saved out of sequence; the record isn't tried again (see above). If the procedure    *
+         * couldn't be executed, the connection is also handed back as broken and another borrowed for the next       *
+         * record. Once stopping, it saves what is left and exits.                                                    *
+         **************************************************************************************************************/
+        CAdoConnection* pConnection = NULL;
+        for ( ;; )
+        {
+            WaitForSingleObject ( Writer.hWake, INFINITE );
+            bool bStopping = m_bStopping;
+            for ( ;; )
+            {
+                EnterCriticalSection ( &Writer.csQueue );
+                SDexRecord* pRecord = Writer.pHead;
+                if ( pRecord != NULL )
+                {
+                    Writer.pHead = pRecord->pNext;
+                    if ( Writer.pHead == NULL )
+                    {
+                        Writer.pTail = NULL;
+                    }
+                }
+                LeaveCriticalSection ( &Writer.csQueue );
+                if ( pRecord == NULL )
+                {
+                    break;                                                                       // nothing more queued
+                }
+
+                bool bWritten = false;
+                if ( pRecord->pCall->Failed == false )                       // discarded once an earlier record failed
+                {
+                    bool bConnectionFailed = true;
+                    if ( pConnection == NULL )
+                    {
+                        pConnection = CAdoConnectionPool::Instance().Acquire();
+                    }
+                    if ( pConnection != NULL )
+                    {
+                        bWritten = WriteRecord ( *pConnection, *pRecord, bConnectionFailed );
+                    }
+                    if ( bWritten == false && bConnectionFailed == true && pConnection != NULL )
+                    {
+                        CAdoConnectionPool::Instance().Release ( pConnection, true );          // it may have been lost
+                        pConnection = NULL;
+                    }
+                    if ( bWritten == false )
+                    {
+                        m_EventTrace.Event ( CEventTrace::Information,
+                            "CDexWriter::Run <--> ERROR: DEX record %04x of call %d not saved",
+                            pRecord->Sequence, pRecord->CallNumber );
+                    }
+                }
+                InterlockedIncrement ( bWritten == true ? &m_nWritten : &m_nFailed );
+                pRecord->pCall->RecordWritten ( bWritten );
+                pRecord->pCall->Release();
+                delete pRecord;
+            }
+            CAdoConnectionPool::Instance().Release ( pConnection );
+            pConnection = NULL;
+            if ( bStopping == true )
+            {
+                break;
+            }
+        }
+    }
+
+    bool WriteRecord ( CAdoConnection& adoConnection, SDexRecord& Record, bool& ConnectionFailed )
+    {
+        /**************************************************************************************************************
+         * This saves a record as a new row in the COMM_SERVER_DEX database table, exactly as                         *
+         * CProtelHost::Database_DexData does, and returns TRUE on success. ConnectionFailed is set TRUE if the       *
+         * procedure couldn't be executed (rather than reporting an error itself), in which case the connection may   *
+         * have been lost. Either way the record may or may not have been saved, so it isn't tried again.             *
+         **************************************************************************************************************/
+        ConnectionFailed = true;
+        try
+        {
+            CAdoStoredProcedure adoStoredProcedure ( "PKG_COMM_SERVER.DEX2" );
+
+            //pi_callnumber        in number,
+            //pi_call_start_time   in timestamp,
+            //pi_centralauditor    in varchar2 default null,
+            //pi_serial_number     in varchar2 default null,
+            //pi_sequence          in integer,
+            //pi_dex_data          in blob,
+            //pi_lastdexrecord     in smallint,
+            //po_err_code          out integer, - = 0 data saved, -n ora error
+            //po_err_txt           out varchar(200)); ora error verbage
+
+            _variant_t vtCallNumber (( long ) Record.CallNumber, VT_I4 );
+            adoStoredProcedure.AddParameter( "pi_CALLNUMBER", vtCallNumber, ADODB::DataTypeEnum::adInteger, ADODB::ParameterDirectionEnum::adParamInput, sizeof ( long ));
+
+            _variant_t vtCallStartTime ( Record.CallStartTime, VT_DATE );
+            adoStoredProcedure.AddParameter( "pi_call_start_time", vtCallStartTime, ADODB::DataTypeEnum::adDate, ADODB::ParameterDirectionEnum::adParamInput, sizeof ( double ));
+
+            _bstr_t bstrCentralAuditor( Record.CentralAuditor );
+            _variant_t vtCentralAuditor ( bstrCentralAuditor );
+            adoStoredProcedure.AddParameter( "pi_centralauditor", vtCentralAuditor, ADODB::DataTypeEnum::adBSTR, ADODB::ParameterDirectionEnum::adParamInput, bstrCentralAuditor.length());
+
+            _bstr_t bstrSerialNumber( Record.SerialNumber );
+            _variant_t vtSerialNumber ( bstrSerialNumber );
+            adoStoredProcedure.AddParameter( "pi_serial_number", vtSerialNumber, ADODB::DataTypeEnum::adBSTR, ADODB::ParameterDirectionEnum::adParamInput, bstrSerialNumber.length());
+
+            _variant_t vtSequence (( long ) Record.Sequence, VT_I4 );
+            adoStoredProcedure.AddParameter( "pi_sequence", vtSequence, ADODB::DataTypeEnum::adInteger, ADODB::ParameterDirectionEnum::adParamInput, sizeof ( short ));
+
+            variantBlob vtPayload ( Record.Data, Record.Length );
+            adoStoredProcedure.AddParameter( "pi_dex_data", vtPayload, ADODB::DataTypeEnum::adVarBinary, ADODB::ParameterDirectionEnum::adParamInput, Record.Length );
+
+            _variant_t vterrorcode (( long ) 0, VT_I4 );
+            adoStoredProcedure.AddParameter( "po_err_code", vterrorcode, ADODB::adInteger, ADODB::adParamOutput, sizeof ( long ));
+
+            _variant_t vtErrorText ( _bstr_t ( "" ));
+            adoStoredProcedure.AddParameter("po_err_txt", vtErrorText, ADODB::adBSTR, ADODB::adParamOutput, 200 );
+
+            char chLastDexRecord = Record.Sequence == 0xffff ? 1 : 0;
+            _variant_t vtLastDexRecord ( chLastDexRecord );
+            adoStoredProcedure.AddParameter( "pi_lastdexrecord", vtLastDexRecord, ADODB::DataTypeEnum::adTinyInt, ADODB::ParameterDirectionEnum::adParamInput, sizeof ( chLastDexRecord ));
+
+            if ( adoConnection.ExecuteNonQuery ( adoStoredProcedure, false ) == false )
+            {
+                return false;
+            }
+            ConnectionFailed = false;
+            _variant_t vtReturnedOraError = adoStoredProcedure.GetParameter("po_err_code");
+            if (( long ) vtReturnedOraError != 0 )
+            {
+                _bstr_t bstrReturnedOraErrorText ( adoStoredProcedure.GetParameter("po_err_txt"));
+                m_EventTrace.Event ( CEventTrace::Information, "CDexWriter::WriteRecord <--> ERROR: %ld %s",
+                    ( long ) vtReturnedOraError, ( char* ) bstrReturnedOraErrorText );
+                return false;
+            }
+            return true;
+        }
+        catch ( _com_error &comError )
+        {
+            m_EventTrace.Event ( CEventTrace::Information, "CDexWriter::WriteRecord <--> ERROR: %s",
+                CErrorMessage::ReturnComErrorMessage ( comError ));
+        }
+        return false;
+    }
+
+    SWriter m_Writers [ DEXWRITER_MAXTHREADS ];                                        // the first m_nWriters are used
+    int m_nWriters;                                                                  // threads started ("DEX Writers")
+    volatile bool m_bRunning;                                                        // Write queues records while true
+    volatile bool m_bStopping;                                                   // the threads exit once they're empty
+    volatile LONG m_nQueued;                                                              // records queued since Start
+    volatile LONG m_nWritten;                                                              // records saved to database
+    volatile LONG m_nFailed;                                                   // records that failed or were discarded
+    CEventTrace m_EventTrace;                                                      // records events - see EventTrace.h
+ };
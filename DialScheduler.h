@@ -0,0 +1,379 @@
+/**********************************************************************************************************************
+ *                                    This file contains the CDialScheduler class.                                    *
+ *                                                                                                                    *
+ * CApplication's polling thread uses this to place the manual polls dequeued from PKG_COMM_SERVER.getManualPoll on   *
+ * the modems. The thread used to wake every "seconds" (in the [manualpoll] section of the .INI file), look for the   *
+ * first modem available to dial and dequeue one poll, so however many modems were idle, at most one call was placed  *
+ * per period.                                                                                                        *
+ *                                                                                                                    *
+ * Polls now wait here in a binary heap ordered by priority and then by the order they were queued, so the oldest     *
+ * goes first and one which a modem refused at the last moment (e.g. because it began ringing) goes back ahead of the *
+ * rest. Each modem added with AddPort sets the scheduler's idle event when it is ready again after a call (see       *
+ * CProtelSerial::NotifyWhenIdle), which wakes the polling thread. Dispatch then dials a queued poll on every free    *
+ * modem and returns how many are still free, so the thread claims more from the database (see ManualPolls.h). A      *
+ * modem is given its next poll as soon as it has reset after a call instead of at the next period. Each poll holds a *
+ * lease; TakeExpired gives up those not dialed before it runs out so they can be handed back.                        *
+ *                                                                                                                    *
+ * Each port counts the polls placed on it, how many succeeded and how long they kept it busy (from Dial until its    *
+ * modem was ready again). Every "Dial Report Minutes" Report writes these to the event log with the number of polls  *
+ * completed per hour since the last report and how long the polls still queued would take to drain at that rate.     *
+ * CMetrics counts the polls and the queue length too.                                                                *
+ *                                                                                                                    *
+ * Only the polling thread uses a CDialScheduler, so nothing in it is locked.                                         *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+#include "Metrics.h"
+#include "ProtelSerial.h"
+
+#define DIALSCHEDULER_MAXPOLLS      256                                                               // queued at once
+#define DIALSCHEDULER_MAXPORTS      256                                                                // modems dialed
+
+struct SManualPoll                                                                         // a poll from getManualPoll
+{
+    long CallNumber;
+    char szPhoneNumber [ 64 ];
+    char szCentralAuditor [ 64 ];
+    double callStartTime;                                                                             // a VARIANT date
+    int Priority;                                                        // lower goes first - see CDialScheduler below
+    DWORD dwLeaseExpires;                                        // GetTickCount after which it is handed back undialed
+    DWORD dwSequence;                                                     // order queued, so equal priorities are FIFO
+};
+
+class CDialScheduler
+ {
+public:
+    enum                                                                                       // SManualPoll::Priority
+    {
+        RetryPriority,                                        // refused by a modem which seemed free - goes back first
+        NormalPriority,                                              // as dequeued (the queue's default priority is 1)
+    };
+
+    CDialScheduler(void)
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+        m_hIdleEvent = CreateEvent(
+            NULL,                                         // lpEventAttributes [in] - NULL = handle cannot be inherited
+            FALSE,                                             // bManualReset [in] - FALSE = reset when a wait returns
+            FALSE,                                                // bInitialState [in] - FALSE = initially unsignalled
+            NULL );                                                           // lpName [in] - NULL = object is unnamed
+        m_nPolls = 0;
+        m_dwSequence = 0;
+        m_dwChanges = 0;
+        m_nPorts = 0;
+        m_nNextPort = 0;
+        m_nCompleted = 0;
+        m_nReportCompleted = 0;
+        m_dwReported = GetTickCount();
+    }
+
+    virtual ~CDialScheduler(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+        CloseHandle ( m_hIdleEvent );
+    }
+
+    HANDLE GetIdleEvent ( void )                                                     // set when a modem is ready again
+    {
+        return m_hIdleEvent;
+    }
+
+    int GetBacklog ( void )                                                            // polls queued for a free modem
+    {
+        return m_nPolls;
+    }
+
+    bool AddPort ( CProtelSerial* pSerial )
+    {
+        /**************************************************************************************************************
+         * This adds the modem of pSerial to those polls are placed on. pSerial must remain valid while the scheduler *
+         * is used. It returns false if DIALSCHEDULER_MAXPORTS modems have been added already.                        *
+         **************************************************************************************************************/
+        if ( m_nPorts == DIALSCHEDULER_MAXPORTS )
+        {
+            return false;
+        }
+        SDialPort& port = m_Ports [ m_nPorts++ ];
+        ZeroMemory ( &port, sizeof ( port ));
+        port.pSerial = pSerial;
+        pSerial->NotifyWhenIdle ( m_hIdleEvent );
+        return true;
+    }
+
+    bool Enqueue ( SManualPoll& poll )
+    {
+        /**************************************************************************************************************
+         * This queues poll (with its Priority set) to be placed by Dispatch. It returns false if                     *
+         * DIALSCHEDULER_MAXPOLLS polls are queued already, in which case the caller must finish it.                  *
+         **************************************************************************************************************/
+        if ( m_nPolls == DIALSCHEDULER_MAXPOLLS )
+        {
+            return false;
+        }
+        poll.dwSequence = m_dwSequence++;
+        Push ( poll );
+        return true;
+    }
+
+    DWORD GetChanges ( void )                                            // changes each time a poll is queued or taken
+    {
+        return m_dwChanges;
+    }
+
+    const SManualPoll& GetQueued ( int Index )                             // queued poll Index (0 to GetBacklog() - 1)
+    {
+        return m_Polls [ Index ];
+    }
+
+    bool TakeExpired ( SManualPoll& poll )
+    {
+        /**************************************************************************************************************
+         * This takes a queued poll whose lease has run out into poll, so the caller can hand it back. It returns     *
+         * false if there is none.                                                                                    *
+         **************************************************************************************************************/
+        DWORD dwNow = GetTickCount();
+        for ( int nPoll = 0; nPoll < m_nPolls; nPoll++ )
+        {
+            if (( long )( dwNow - m_Polls [ nPoll ].dwLeaseExpires ) >= 0 )
+            {
+                Remove ( nPoll, poll );
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool Dequeue ( SManualPoll& poll )
+    {
+        /**************************************************************************************************************
+         * This takes the first queued poll into poll without placing it (CApplication finishes those still queued    *
+         * when the system shuts down). It returns false if none is queued.                                           *
+         **************************************************************************************************************/
+        if ( m_nPolls == 0 )
+        {
+            return false;
+        }
+        Remove ( 0, poll );
+        return true;
+    }
+
+    int Dispatch ( void )
+    {
+        /**************************************************************************************************************
+         * This notes the end of the poll on each port whose modem is ready again, then dials the first queued poll   *
+         * on each free modem in turn. The port tried first moves on by one each time, so no modem always gets the    *
+         * first poll. It returns the number of modems still free once nothing is queued.                             *
+         *                                                                                                            *
+         * A modem which refuses the poll (it began ringing or was reset since AvailableToDial said it was free) is   *
+         * skipped and the poll is queued again at RetryPriority for the next modem.                                  *
+         **************************************************************************************************************/
+        DWORD dwNow = GetTickCount();
+        int nFree = 0;
+        for ( int nTried = 0; nTried < m_nPorts; nTried++ )
+        {
+            SDialPort& port = m_Ports [ ( m_nNextPort + nTried ) % m_nPorts ];
+            if ( port.pSerial->AvailableToDial() == false )
+            {
+                continue;                                                     // placing a poll, answering or resetting
+            }
+            if ( port.CallNumber != 0 )
+            {
+                Finish ( port, dwNow );
+            }
+            if ( m_nPolls == 0 )
+            {
+                nFree++;
+                continue;
+            }
+
+            SManualPoll poll;
+            Remove ( 0, poll );
+            if ( port.pSerial->Dial ( poll.szPhoneNumber, poll.CallNumber ) == false )
+            {
+                poll.Priority = RetryPriority;
+                Push ( poll );
+                continue;
+            }
+            port.CallNumber = poll.CallNumber;
+            port.dwDialed = dwNow;
+        }
+        if ( m_nPorts > 0 )
+        {
+            m_nNextPort = ( m_nNextPort + 1 ) % m_nPorts;
+        }
+        return nFree;
+    }
+
+    void Report ( int Minutes )
+    {
+        /**************************************************************************************************************
+         * If Minutes (more than 0) have passed since the last report, this writes the polls completed per hour since *
+         * then, the time the polls queued would take to drain at that rate, and the throughput of each port so far,  *
+         * to the event log.                                                                                          *
+         **************************************************************************************************************/
+        DWORD dwElapsed = GetTickCount() - m_dwReported;
+        if ( Minutes <= 0 || dwElapsed < ( DWORD ) Minutes * 60000 )
+        {
+            return;
+        }
+        long nCompleted = m_nCompleted - m_nReportCompleted;
+        m_nReportCompleted = m_nCompleted;
+        m_dwReported += dwElapsed;
+
+        char szDrain [ 64 ];
+        if ( m_nPolls == 0 )
+        {
+            StringCbCopy ( szDrain, sizeof ( szDrain ), "0 seconds" );
+        }
+        else if ( nCompleted == 0 )
+        {
+            StringCbCopy ( szDrain, sizeof ( szDrain ), "unknown - none completed" );
+        }
+        else
+        {
+            StringCbPrintf ( szDrain, sizeof ( szDrain ), "%I64d seconds",
+                ( __int64 ) m_nPolls * dwElapsed / nCompleted / 1000 );
+        }
+        int nDialing = 0;
+        for ( int nPort = 0; nPort < m_nPorts; nPort++ )
+        {
+            nDialing += m_Ports [ nPort ].CallNumber != 0 ? 1 : 0;
+        }
+        m_EventTrace.Event ( CEventTrace::Information,
+            "CDialScheduler::Report - %I64d polls per hour, %d queued (drain %s), %d of %d modems placing polls",
+            ( __int64 ) nCompleted * 3600000 / dwElapsed, m_nPolls, szDrain, nDialing, m_nPorts );
+
+        for ( int nPort = 0; nPort < m_nPorts; nPort++ )
+        {
+            SDialPort& port = m_Ports [ nPort ];
+            if ( port.nPolls == 0 )
+            {
+                continue;
+            }
+            m_EventTrace.Event ( CEventTrace::Information,
+                "CDialScheduler::Report - %s\t%ld polls, %ld succeeded, %I64d seconds each, %I64d per busy hour",
+                port.pSerial->GetPort(), port.nPolls, port.nSucceeded, port.nBusyMilliseconds / port.nPolls / 1000,
+                port.nBusyMilliseconds > 0 ? ( __int64 ) port.nPolls * 3600000 / port.nBusyMilliseconds : 0 );
+        }
+    }
+
+private:
+    struct SDialPort                                                                               // a modem polls use
+    {
+        CProtelSerial* pSerial;
+        long CallNumber;                                                                 // poll being placed, 0 = none
+        DWORD dwDialed;                                                              // GetTickCount when it was dialed
+        long nPolls;                                                                           // completed on the port
+        long nSucceeded;
+        __int64 nBusyMilliseconds;                                                  // from Dial until ready, all polls
+    };
+
+    void Finish ( SDialPort& port, DWORD dwNow )
+    {
+        /**************************************************************************************************************
+         * This records that the poll placed on port has ended, now its modem is ready again.                         *
+         **************************************************************************************************************/
+        bool bSucceeded = port.pSerial->PollSucceeded ( port.CallNumber );
+        DWORD dwBusy = dwNow - port.dwDialed;
+        port.nPolls++;
+        port.nSucceeded += bSucceeded == true ? 1 : 0;
+        port.nBusyMilliseconds += dwBusy;
+        port.CallNumber = 0;
+        m_nCompleted++;
+        CMetrics::Instance().ObservePoll ( bSucceeded, ( int ) dwBusy );
+    }
+
+    static bool Before ( const SManualPoll& First, const SManualPoll& Second )
+    {
+        /**************************************************************************************************************
+         * This returns true if poll First is to be placed before poll Second.                                        *
+         **************************************************************************************************************/
+        if ( First.Priority != Second.Priority )
+        {
+            return First.Priority < Second.Priority;
+        }
+        return ( long )( First.dwSequence - Second.dwSequence ) < 0;                          // allows for wrap around
+    }
+
+    void Push ( const SManualPoll& poll )
+    {
+        /**************************************************************************************************************
+         * This adds poll to the heap (which has room for it), moving it up past every poll it goes before.           *
+         **************************************************************************************************************/
+        int nChild = m_nPolls++;
+        while ( nChild > 0 )
+        {
+            int nParent = ( nChild - 1 ) / 2;
+            if ( Before ( poll, m_Polls [ nParent ] ) == false )
+            {
+                break;
+            }
+            m_Polls [ nChild ] = m_Polls [ nParent ];
+            nChild = nParent;
+        }
+        m_Polls [ nChild ] = poll;
+        m_dwChanges++;
+        CMetrics::Instance().AddPollBacklog ( 1 );
+    }
+
+    void Remove ( int Index, SManualPoll& poll )
+    {
+        /**************************************************************************************************************
+         * This takes poll Index (0 is the first) from the heap into poll and puts the last poll in its place, moving *
+         * that up past every poll it goes before or down past every poll which goes before it.                       *
+         **************************************************************************************************************/
+        poll = m_Polls [ Index ];
+        SManualPoll last = m_Polls [ --m_nPolls ];
+        m_dwChanges++;
+        CMetrics::Instance().AddPollBacklog ( -1 );
+        if ( Index == m_nPolls )
+        {
+            return;                                                                             // it was the last poll
+        }
+        int nParent = Index;
+        while ( nParent > 0 && Before ( last, m_Polls [ ( nParent - 1 ) / 2 ] ) == true )
+        {
+            m_Polls [ nParent ] = m_Polls [ ( nParent - 1 ) / 2 ];
+            nParent = ( nParent - 1 ) / 2;
+        }
+        for ( ;; )
+        {
+            int nChild = nParent * 2 + 1;
+            if ( nChild >= m_nPolls )
+            {
+                break;
+            }
+            if ( nChild + 1 < m_nPolls && Before ( m_Polls [ nChild + 1 ], m_Polls [ nChild ] ) == true )
+            {
+                nChild++;
+            }
+            if ( Before ( m_Polls [ nChild ], last ) == false )
+            {
+                break;
+            }
+            m_Polls [ nParent ] = m_Polls [ nChild ];
+            nParent = nChild;
+        }
+        m_Polls [ nParent ] = last;
+    }
+
+    HANDLE m_hIdleEvent;                                                    // auto reset, set by NotifyWhenIdle modems
+    SManualPoll m_Polls [ DIALSCHEDULER_MAXPOLLS ];                                    // binary heap, first at the top
+    int m_nPolls;                                                                                         // in m_Polls
+    DWORD m_dwSequence;                                                                // given to the next poll queued
+    DWORD m_dwChanges;                                                                        // polls queued and taken
+    SDialPort m_Ports [ DIALSCHEDULER_MAXPORTS ];
+    int m_nPorts;                                                                                         // in m_Ports
+    int m_nNextPort;                                                                // tried first by the next Dispatch
+    long m_nCompleted;                                                                           // polls on every port
+    long m_nReportCompleted;                                                             // m_nCompleted at last Report
+    DWORD m_dwReported;                                                                  // GetTickCount at last Report
+    CEventTrace m_EventTrace;                                                      // records events - see EventTrace.h
+};
@@ -0,0 +1,18 @@
+/**********************************************************************************************************************
+ *                                     This file contains the CEngineClock class.                                     *
+ *                                                                                                                    *
+ * CProtelEngine and CModemEngine (see ProtelEngine.h and ModemEngine.h) time responses, recoveries, dials and the    *
+ * escape guard time, but neither reads the system clock itself. The owner passes a CEngineClock to each engine's     *
+ * constructor instead: ProtelHost (and ProtelSerial, for its modem) passes a CTickClock, which uses GetTickCount,    *
+ * and a test harness can pass one it advances by hand.                                                               *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+class CEngineClock
+ {
+public:
+    virtual DWORD GetMilliseconds ( void ) = 0;                                 // a free-running count of milliseconds
+ };
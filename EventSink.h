@@ -0,0 +1,516 @@
+/**********************************************************************************************************************
+ *                                      This file contains the CEventSink class.                                      *
+ *                                                                                                                    *
+ * Every CEventTrace used to read the profile and open the log file when it was constructed, and recorded each event  *
+ * by taking a process-wide mutex, moving to the end of the file and writing the event there and then. Traces are     *
+ * constructed as locals on busy paths (e.g. CProtelDevice::GetNextDownload), so every connection thread paid for     *
+ * that file work and then queued behind every other thread's writes.                                                 *
+ *                                                                                                                    *
+ * Instead, the single CEventSink reads the [debug] settings once and owns the log file. Each thread that records     *
+ * events gets a ring buffer of its own, which only it writes and only the sink's flusher thread reads, so an event   *
+ * is recorded by copying it into the ring without taking a lock or making a system call. Every "Event Flush          *
+ * Milliseconds", or sooner once a ring is half full, the flusher gathers what the rings hold and appends it to the   *
+ * log file in large writes. What a thread records in one call is written whole, and a thread's events stay in the    *
+ * order it recorded them; events from different threads may be up to one flush apart from the order in which they    *
+ * were recorded.                                                                                                     *
+ *                                                                                                                    *
+ * A ring whose thread has exited is reused by the next new thread once it is empty. If a thread fills its ring       *
+ * faster than it can be flushed, it waits for the flusher rather than lose events. Until the sink is started (and    *
+ * once it is stopped), or with "Event Flush Milliseconds" set to 0, each event is written as it is recorded, as      *
+ * before.                                                                                                            *
+ *                                                                                                                    *
+ * With "Binary Trace" set, ".bin" is added to the log file's name and each run of the application starts it with a   *
+ * RunRecord (see TraceFormat.h).                                                                                     *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+#include <windows.h>
+#include "ProfileValues.h"
+#include "TraceFormat.h"
+
+#define EVENTSINK_RINGBYTES     65536                               // each thread's ring buffer (must be a power of 2)
+#define EVENTSINK_BATCHBYTES    262144                                          // most written to the log file at once
+#define EVENTSINK_RECLAIMMS     1000                              // how often the flusher looks for rings to be reused
+
+class CEventSink
+ {
+public:
+    static CEventSink& Instance ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the single sink shared by every CEventTrace. CApplication::Start calls it (to Start the       *
+         * sink) before any connection threads are started, so it is constructed then if not before.                  *
+         **************************************************************************************************************/
+        static CEventSink eventSink;
+        return eventSink;
+    }
+
+    bool Start ( void )
+    {
+        /**************************************************************************************************************
+         * This reads "Event Flush Milliseconds" and, unless it is 0, starts the flusher thread. It returns TRUE if   *
+         * events are being recorded in the rings.                                                                    *
+         **************************************************************************************************************/
+        if ( m_hThread != NULL )
+        {
+            return true;
+        }
+        CProfileValues profileValues;
+        m_nFlushMilliseconds = profileValues.GetEventFlushMilliseconds();
+        if ( m_nFlushMilliseconds <= 0 )
+        {
+            return false;                                                          // events are written as they arrive
+        }
+        m_bStopping = false;
+        m_hWake = CreateEvent(
+            NULL,                                                            // lpEventAttributes [in] - NULL = default
+            FALSE,                                                                    // bManualReset [in] - auto reset
+            FALSE,                                                                // bInitialState [in] - not signalled
+            NULL );                                                                     // lpName [in] - NULL = unnamed
+        if ( m_hWake == NULL )
+        {
+            return false;
+        }
+        m_hThread = CreateThread(
+            NULL,                                               // lpThreadAttributes [in] - NULL = cannot be inherited
+            0,                                               // dwStackSize [in] - initial stack size - 0 = use default
+            FlusherThreadProc,                                                    // lpStartAddress [in] - in this file
+            this,                                                                              // lpParameter [in] - us
+            0,                                                                // dwCreationFlags [in] - run immediately
+            NULL );                                                           // lpThreadId [out] - NULL = not returned
+        if ( m_hThread == NULL )
+        {
+            CloseHandle ( m_hWake );
+            m_hWake = NULL;
+            return false;
+        }
+        m_bRunning = true;
+        return true;
+    }
+
+    void Stop ( void )
+    {
+        /**************************************************************************************************************
+         * This is used once everything else has shut down. Events are written as they are recorded from now on,      *
+         * the flusher writes what the rings hold and exits, and anything recorded meanwhile is written after it.     *
+         **************************************************************************************************************/
+        if ( m_hThread == NULL )
+        {
+            return;
+        }
+        m_bRunning = false;
+        m_bStopping = true;
+        SetEvent ( m_hWake );
+        WaitForSingleObject ( m_hThread, INFINITE );
+        CloseHandle ( m_hThread );
+        m_hThread = NULL;
+        CloseHandle ( m_hWake );
+        m_hWake = NULL;
+        Flush();                                                                // anything recorded as it was stopping
+
+        char szStatistics [ 192 ];
+        StringCbPrintf ( szStatistics, sizeof ( szStatistics ),
+            "CEventSink::Stop - %ld events, %ld bytes in %ld writes, %ld waits for a full ring",
+            m_nEvents, m_nBytes, m_nWrites, m_nWaits );
+        if ( m_bBinary == true )
+        {
+            CTraceRecord traceRecord ( CTraceFormat::TextRecord, 2, 0, 0 );                  // CEventTrace::Information
+            traceRecord.AddString ( szStatistics );
+            Write ( traceRecord.Data, traceRecord.Length );
+            return;
+        }
+        char szOutput [ 256 ];
+        StringCbPrintf ( szOutput, sizeof ( szOutput ), "<event trace=\"%s\" />\r\n", szStatistics );
+        Write ( szOutput, lstrlen ( szOutput ));
+    }
+
+    void Write ( const char* pszOutput, int Length )
+    {
+        /**************************************************************************************************************
+         * This records Length bytes of pszOutput (a complete event, or part of one built with BeginXML) to be        *
+         * appended to the log file. While the sink is running they are copied into the calling thread's ring;        *
+         * otherwise they are written at once.                                                                        *
+         **************************************************************************************************************/
+        if ( Length <= 0 )
+        {
+            return;
+        }
+        SRing* pRing = m_bRunning == true && Length <= EVENTSINK_RINGBYTES / 2 ? GetRing() : NULL;
+        if ( pRing == NULL )
+        {
+            WriteNow ( pszOutput, Length );
+            return;
+        }
+
+        DWORD dwHead = pRing->nHead;                                                               // only we change it
+        DWORD dwUsed = dwHead - pRing->nTail;
+        while ( EVENTSINK_RINGBYTES - dwUsed < ( DWORD ) Length )
+        {
+            if ( m_bRunning == false )                                                     // stopping - it won't empty
+            {
+                WriteNow ( pszOutput, Length );
+                return;
+            }
+            InterlockedIncrement ( &m_nWaits );
+            SetEvent ( m_hWake );
+            Sleep ( 1 );
+            dwUsed = dwHead - pRing->nTail;
+        }
+        DWORD dwOffset = dwHead & ( EVENTSINK_RINGBYTES - 1 );
+        DWORD dwFirst = EVENTSINK_RINGBYTES - dwOffset;                                         // room before it wraps
+        if ( dwFirst >= ( DWORD ) Length )
+        {
+            CopyMemory ( pRing->Data + dwOffset, pszOutput, Length );
+        }
+        else
+        {
+            CopyMemory ( pRing->Data + dwOffset, pszOutput, dwFirst );
+            CopyMemory ( pRing->Data, pszOutput + dwFirst, Length - dwFirst );
+        }
+        MemoryBarrier();                                         // the bytes are in place before the flusher sees them
+        pRing->nHead = dwHead + Length;
+        InterlockedIncrement ( &m_nEvents );
+        if ( dwUsed + Length >= EVENTSINK_RINGBYTES / 2 )
+        {
+            SetEvent ( m_hWake );                                                      // don't wait for the next flush
+        }
+    }
+
+    void Broadcast ( const char* pszMessage )
+    {
+        /**************************************************************************************************************
+         * This sends pszMessage to the [debug] port in the profile at the broadcast address of the LAN, opening the  *
+         * socket the first time.                                                                                     *
+         **************************************************************************************************************/
+        EnterCriticalSection ( &m_csFile );
+        if ( m_socketBroadcast == INVALID_SOCKET )                                                 // socket isn't open
+        {
+            DWORD dwCmd = 0L;                                                              // socket (FIONBIO) blocking
+            BOOL bBroadcast = TRUE;              // socket (SOL_SOCKET) enable transmitting/receiving broadcast packets
+            m_socketBroadcast = socket (
+                AF_INET,                                                                              // af [in] - IPv4
+                SOCK_DGRAM,                                                // type [in] - connectionless (supports UDP)
+                IPPROTO_UDP );                                                                   // protocol [in] - UDP
+            ioctlsocket (
+                m_socketBroadcast,                                                               // s [in] - the socket
+                FIONBIO,                                                        // cmd [in] - set blocking/non-blocking
+                &dwCmd );                                                         // *argp [inout] - set blocking above
+            setsockopt (
+                m_socketBroadcast,                                                               // s [in] - the socket
+                SOL_SOCKET,                                                     // level [in] - protocol level affected
+                SO_BROADCAST,                 // optname [in] - disable/enable transmitting/receiving broadcast packets
+                (LPCSTR)&bBroadcast,                                               // *optval [in] - enable (set above)
+                sizeof( bBroadcast ));                                                                   // optlen [in]
+        }
+        LeaveCriticalSection ( &m_csFile );
+
+        SOCKADDR_IN sinOut;
+        sinOut.sin_family = AF_INET;
+        sinOut.sin_port = htons ( m_nPort );
+        sinOut.sin_addr.s_addr = INADDR_BROADCAST;               // 255.255.255.255 - translates to LAN broadcast addrs
+
+        sendto (
+            m_socketBroadcast,                                                            // s [in] - socket descriptor
+            pszMessage,                                                                 // *buf [in] - data to transmit
+            lstrlen ( pszMessage ),                                                        // len [in] - length of data
+            0,                                                                                    // flags [in] - flags
+            ( struct sockaddr* )&sinOut,                                // *to [in] - address of target (remote) socket
+            sizeof ( sinOut ));                                                         // tolen [in] - size of address
+    }
+
+    int GetLevel ( void )                                                               // [debug] level in the profile
+    {
+        return m_nLevel;
+    }
+    __declspec(property(get = GetLevel)) int Level;
+
+    bool GetBinary ( void )                                                       // "Binary Trace" in the profile
+    {
+        return m_bBinary;
+    }
+    __declspec(property(get = GetBinary)) bool Binary;
+
+    bool GetRunning ( void )
+    {
+        return m_bRunning;
+    }
+    __declspec(property(get = GetRunning)) bool Running;
+
+private:
+    struct SRing                                                                                 // one thread's events
+    {
+        SRing* pNext;                                                                       // every ring, newest first
+        volatile LONG nOwner;                                                       // thread ID of its owner, 0 = free
+        HANDLE hOwner;                                                       // the owner, to notice when it has exited
+        volatile DWORD nHead;                                                // bytes ever recorded (by the owner only)
+        volatile DWORD nTail;                                               // bytes ever flushed (by the flusher only)
+        char Data [ EVENTSINK_RINGBYTES ];
+    };
+
+    CEventSink(void) :
+        m_pRings ( NULL ),
+        m_hThread ( NULL ),
+        m_hWake ( NULL ),
+        m_hFile ( INVALID_HANDLE_VALUE ),
+        m_socketBroadcast ( INVALID_SOCKET ),
+        m_bRunning ( false ),
+        m_bStopping ( false ),
+        m_nFlushMilliseconds ( 0 ),
+        m_nEvents ( 0 ),
+        m_nBytes ( 0 ),
+        m_nWrites ( 0 ),
+        m_nWaits ( 0 )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR. This reads the [debug] settings for the whole process; the log file is opened when the first  *
+         * event is written.                                                                                          *
+         **************************************************************************************************************/
+        InitializeCriticalSection ( &m_csFile );
+        m_dwTls = TlsAlloc();
+        CProfileValues profileValues;
+        m_nLevel = profileValues.GetDebugLevel();
+        m_nPort = profileValues.GetDebugPort();
+        StringCbCopy ( m_szFileName, sizeof ( m_szFileName ), profileValues.GetLogFile());
+        m_bBinary = profileValues.GetBinaryTrace();
+        if ( m_bBinary == true )
+        {
+            StringCbCat ( m_szFileName, sizeof ( m_szFileName ), ".bin" );                  // not mixed with the XML
+        }
+    }
+
+    virtual ~CEventSink(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+        Stop();
+        while ( m_pRings != NULL )
+        {
+            SRing* pRing = m_pRings;
+            m_pRings = pRing->pNext;
+            if ( pRing->hOwner != NULL )
+            {
+                CloseHandle ( pRing->hOwner );
+            }
+            delete pRing;
+        }
+        if ( m_hFile != INVALID_HANDLE_VALUE )
+        {
+            CloseHandle ( m_hFile );
+        }
+        if ( m_dwTls != TLS_OUT_OF_INDEXES )
+        {
+            TlsFree ( m_dwTls );
+        }
+        DeleteCriticalSection ( &m_csFile );
+    }
+
+    SRing* GetRing ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the calling thread's ring, the first time taking one left by a thread that has exited or      *
+         * adding a new one. It returns NULL if there isn't one (the event is then written at once).                  *
+         **************************************************************************************************************/
+        if ( m_dwTls == TLS_OUT_OF_INDEXES )
+        {
+            return NULL;
+        }
+        SRing* pRing = ( SRing* ) TlsGetValue ( m_dwTls );
+        if ( pRing != NULL )
+        {
+            return pRing;
+        }
+        LONG nThread = ( LONG ) GetCurrentThreadId();
+        for ( pRing = m_pRings; pRing != NULL; pRing = pRing->pNext )
+        {
+            if ( pRing->nOwner == 0 && InterlockedCompareExchange ( &pRing->nOwner, nThread, 0 ) == 0 )
+            {
+                break;                                                                        // it is ours from now on
+            }
+        }
+        if ( pRing == NULL )
+        {
+            pRing = new SRing;
+            pRing->nOwner = nThread;
+            pRing->hOwner = NULL;
+            pRing->nHead = 0;
+            pRing->nTail = 0;
+            do
+            {
+                pRing->pNext = m_pRings;
+            }
+            while ( InterlockedCompareExchangePointer (( PVOID* ) &m_pRings, pRing, pRing->pNext ) != pRing->pNext );
+        }
+        pRing->hOwner = OpenThread ( SYNCHRONIZE, FALSE, ( DWORD ) nThread );
+        TlsSetValue ( m_dwTls, pRing );
+        return pRing;
+    }
+
+    static DWORD WINAPI FlusherThreadProc ( LPVOID lpParam )
+    {
+        (( CEventSink* ) lpParam )->Run();
+        return 0;
+    }
+
+    void Run ( void )
+    {
+        /**************************************************************************************************************
+         * This is the flusher thread. It flushes the rings every "Event Flush Milliseconds", or when a thread wakes  *
+         * it, and every EVENTSINK_RECLAIMMS frees the rings of threads that have exited. Once stopping, it flushes   *
+         * them a last time and exits.                                                                                *
+         **************************************************************************************************************/
+        DWORD dwReclaimed = GetTickCount();
+        for ( ;; )
+        {
+            WaitForSingleObject ( m_hWake, m_nFlushMilliseconds );
+            bool bStopping = m_bStopping;
+            Flush();
+            if ( GetTickCount() - dwReclaimed >= EVENTSINK_RECLAIMMS )
+            {
+                Reclaim();
+                dwReclaimed = GetTickCount();
+            }
+            if ( bStopping == true )
+            {
+                break;
+            }
+        }
+    }
+
+    void Flush ( void )
+    {
+        /**************************************************************************************************************
+         * This gathers what every ring holds into batches of up to EVENTSINK_BATCHBYTES and appends each to the log  *
+         * file in a single write. A ring's bytes are handed back to its thread once they have been copied.           *
+         **************************************************************************************************************/
+        for ( SRing* pRing = m_pRings; pRing != NULL; pRing = pRing->pNext )
+        {
+            DWORD dwHead = pRing->nHead;
+            MemoryBarrier();                                             // the owner's bytes are in place up to dwHead
+            DWORD dwTail = pRing->nTail;
+            while ( dwTail != dwHead )
+            {
+                if ( m_nBatch == EVENTSINK_BATCHBYTES )
+                {
+                    WriteBatch();
+                }
+                DWORD dwOffset = dwTail & ( EVENTSINK_RINGBYTES - 1 );
+                DWORD dwLength = dwHead - dwTail;
+                if ( dwLength > EVENTSINK_RINGBYTES - dwOffset )
+                {
+                    dwLength = EVENTSINK_RINGBYTES - dwOffset;                                        // up to the wrap
+                }
+                if ( dwLength > EVENTSINK_BATCHBYTES - m_nBatch )
+                {
+                    dwLength = EVENTSINK_BATCHBYTES - m_nBatch;
+                }
+                CopyMemory ( m_Batch + m_nBatch, pRing->Data + dwOffset, dwLength );
+                m_nBatch += dwLength;
+                dwTail += dwLength;
+                MemoryBarrier();                                              // copied before the owner may reuse them
+                pRing->nTail = dwTail;
+            }
+        }
+        WriteBatch();
+    }
+
+    void Reclaim ( void )
+    {
+        /**************************************************************************************************************
+         * This frees each flushed ring whose thread has exited, so that a new thread can take it.                    *
+         **************************************************************************************************************/
+        for ( SRing* pRing = m_pRings; pRing != NULL; pRing = pRing->pNext )
+        {
+            if ( pRing->nOwner != 0 && pRing->hOwner != NULL && pRing->nHead == pRing->nTail
+                && WaitForSingleObject ( pRing->hOwner, 0 ) == WAIT_OBJECT_0 )
+            {
+                CloseHandle ( pRing->hOwner );
+                pRing->hOwner = NULL;
+                MemoryBarrier();
+                pRing->nOwner = 0;
+            }
+        }
+    }
+
+    void WriteBatch ( void )
+    {
+        if ( m_nBatch > 0 )
+        {
+            WriteNow ( m_Batch, m_nBatch );
+            InterlockedIncrement ( &m_nWrites );
+            InterlockedExchangeAdd ( &m_nBytes, m_nBatch );
+            m_nBatch = 0;
+        }
+    }
+
+    void WriteNow ( const char* pszOutput, DWORD Length )
+    {
+        /**************************************************************************************************************
+         * This appends Length bytes of pszOutput to the log file, opening it the first time.                         *
+         **************************************************************************************************************/
+        EnterCriticalSection ( &m_csFile );
+        if ( m_hFile == INVALID_HANDLE_VALUE )
+        {
+            m_hFile = CreateFile(
+                m_szFileName,                                                 // lpFileName [in] - name of file to open
+                GENERIC_WRITE,                                                     // dwDesiredAccess [in] - write only
+                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,       // dwShareMode [in] - other processes can also read and write
+                NULL,                                         // lpSecurityAttributes [in] - NULL = cannot be inherited
+                OPEN_ALWAYS,                               // dwCreationDisposition [in] - create unless already exists
+                FILE_ATTRIBUTE_NORMAL,                         // dwFlagsAndAttributes [in] - no special attributes set
+                NULL );                                            // hTemplateFile [in] - sets attributes, NULL = none
+            if ( m_bBinary == true )
+            {
+                /*
+                 * We start this run of the binary trace, so that the numbers it uses (see TraceFormat.h) can be
+                 * told apart from those of earlier runs.
+                 */
+                DWORD dwMagic = TRACEFORMAT_MAGIC;
+                DWORD dwVersion = TRACEFORMAT_VERSION;
+                CTraceRecord traceRecord ( CTraceFormat::RunRecord, 0, 0, 0 );
+                traceRecord.AddBytes ( &dwMagic, sizeof ( dwMagic ));
+                traceRecord.AddBytes ( &dwVersion, sizeof ( dwVersion ));
+                DWORD dwBytesWritten = 0;
+                SetFilePointer ( m_hFile, 0, NULL, FILE_END );
+                WriteFile ( m_hFile, traceRecord.Data, traceRecord.Length, &dwBytesWritten, NULL );
+            }
+        }
+        SetFilePointer (
+            m_hFile,                                                                           // hFile [in] - the file
+            0,                                           // lDistanceToMove [in] - relative to specified starting point
+            NULL,                                                          // lpDistanceToMoveHigh [in, out] - not used
+            FILE_END );                                            // dwMoveMethod [in] - starting point is end of file
+        DWORD dwBytesWritten = 0;
+        WriteFile(
+            m_hFile,                                                                   // hFile [in] - file to write to
+            pszOutput,                                                                 // lpBuffer [in] - data to write
+            Length,                                                        // nNumberOfBytesToWrite [in] - size of data
+            &dwBytesWritten,                                   // lpNumberOfBytesWritten [out] - bytes actually written
+            NULL );                                                                // lpOverlapped [in, out] - not used
+        LeaveCriticalSection ( &m_csFile );
+    }
+
+    SRing* volatile m_pRings;                                                   // every ring, newest first (see SRing)
+    DWORD m_dwTls;                                                                  // TLS slot holding a thread's ring
+    HANDLE m_hThread;                                                                                    // the flusher
+    HANDLE m_hWake;                                                // set by a thread whose ring is filling, or by Stop
+    CRITICAL_SECTION m_csFile;                                                // protects m_hFile and m_socketBroadcast
+    HANDLE m_hFile;                                                                       // [database] file in profile
+    SOCKET m_socketBroadcast;                                                        // used to broadcast events to LAN
+    char m_szFileName [ MAX_PATH ];
+    int m_nLevel;                                                                           // [debug] level in profile
+    bool m_bBinary;                                                   // "Binary Trace" - records are written, not XML
+    int m_nPort;                                                                             // [debug] port in profile
+    volatile bool m_bRunning;                                                        // Write uses the rings while true
+    volatile bool m_bStopping;                                                                     // the flusher exits
+    int m_nFlushMilliseconds;                                                             // "Event Flush Milliseconds"
+    char m_Batch [ EVENTSINK_BATCHBYTES ];                                     // gathered by the flusher for one write
+    DWORD m_nBatch;                                                                            // bytes used in m_Batch
+    volatile LONG m_nEvents;                                                       // recorded in the rings since Start
+    volatile LONG m_nBytes;                                                       // written by the flusher since Start
+    volatile LONG m_nWrites;                                                                        // flusher's writes
+    volatile LONG m_nWaits;                                                       // times a thread waited for its ring
+ };
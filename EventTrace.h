@@ -3,13 +3,19 @@
  *                                                                                                                    *
  * Multiple threads can construct this class, set an identity with its Identifier method, then use the Event or       *
  * HexDump methods to record a complete event. Alternatively, the BeginXML, XML and EndXML methods can be used to     *
- * create a complete event. An event is recorded by generating XML, broadcasting it to the specified [debug] port and *
- * appending it to the [database] file specified in the profile (.INI file).                                          *
+ * create a complete event. An event is recorded by generating XML and handing it to the CEventSink, which appends    *
+ * it to the [database] file specified in the profile (.INI file) in the background.                                  *
+ *                                                                                                                    *
+ * Constructing a trace does no file or socket work, so traces can be constructed freely as locals.                   *
+ *                                                                                                                    *
+ * With "Binary Trace" set in the profile, an event is recorded as a binary record instead (see TraceFormat.h): its   *
+ * format string is replaced by a number and its arguments and hex dumps are kept as they are, so no text is          *
+ * generated until CTraceDecoder renders the trace.                                                                   *
  *                                                                                                                    *
  * Events are only recorded if the level specified equals or exceeds [debug] level specified in the profile (.INI     *
  * file).                                                                                                             *
  *                                                                                                                    *
- *                                         Copyright (c) Protel Inc. 2009-2010                                        *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
  **********************************************************************************************************************/
 #pragma once
 #include <windows.h>
@@ -19,14 +25,13 @@
 #include <stdarg.h>
 #include "ProfileValues.h"
 #include "HexDump.h"
+#include "EventSink.h"
 #include <atlbase.h>
 #include <atlconv.h>
 #include <vcclr.h>
 
 
 //#include <msclr/marshal.h>
-static SOCKET socketEventTrace = INVALID_SOCKET;                                     // used to broadcast events to LAN
-static HANDLE ghMutex = NULL;                                    // ensures only one thread writes to logfile at a time
 
 class CEventTrace 
  {
@@ -43,13 +48,13 @@ public:
     };
 
 protected:
-    int _port;                                                          // set from [debug] port in profile (.INI file)
 //    char szUniqueID [ 256 ];             // set by constructor from hostname and time - doesn't appear to be used!!!!
-    HANDLE m_hFileHandle;                                 // opened on file from [database] file in profile (.INI file)
     TraceLevel m_TraceLevel;                                           // set from [debug] level in profile (.INI file)
     char* m_pszIdentity;                                     // set using this::Identifier(), included in generated XML
     char* m_pszPort;                                         // set using this::Identifier(), included in generated XML
     char* m_pszDevice;                                       // set using this::Identifier(), included in generated XML
+    bool m_bBinary;                                                  // "Binary Trace" - events are recorded as records
+    DWORD m_nContext;                                     // this::Identifier()'s ContextRecord, 0 = no identifiers yet
 
 
     // for future reference!
@@ -68,17 +73,8 @@ public:
     CEventTrace(void)
     {
         /**************************************************************************************************************
-         * CONSTRUCTOR. This creates the mutex, sets the trace level, creates or opens the log file and opens the     *
-         * debug socket.                                                                                              *
+         * CONSTRUCTOR. This sets the trace level from the CEventSink, which has read the profile.                    *
          **************************************************************************************************************/
-        if ( ghMutex == NULL )
-        {
-            ghMutex = CreateMutex(
-                NULL,                                                                    // default security attributes
-                FALSE,                                                                           // initially not owned
-                NULL );                                                                                // unnamed mutex
-        }
-
 #if 0
         DOUBLE dUniqueTime;
         SYSTEMTIME UniqueTime;
@@ -97,37 +93,9 @@ public:
         m_pszPort = NULL;
         m_pszDevice = NULL;
 
-        CProfileValues profileValues;
-        m_TraceLevel = ( TraceLevel ) profileValues.GetDebugLevel();
-
-        m_hFileHandle = CreateFile(
-            profileValues.GetLogFile(),                                       // lpFileName [in] - name of file to open
-            GENERIC_WRITE,                                                         // dwDesiredAccess [in] - write only
-            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,           // dwShareMode [in] - other processes can also read and write
-            NULL,                                             // lpSecurityAttributes [in] - NULL = cannot be inherited
-            OPEN_ALWAYS,                                   // dwCreationDisposition [in] - create unless already exists
-            FILE_ATTRIBUTE_NORMAL,                             // dwFlagsAndAttributes [in] - no special attributes set
-            NULL );                                                // hTemplateFile [in] - sets attributes, NULL = none
-        if ( socketEventTrace == INVALID_SOCKET )                                                  // socket isn't open
-        {
-            DWORD dwCmd = 0L;                                                              // socket (FIONBIO) blocking
-            BOOL bBroadcast = TRUE;              // socket (SOL_SOCKET) enable transmitting/receiving broadcast packets
-            socketEventTrace = socket (
-                AF_INET,                                                                              // af [in] - IPv4
-                SOCK_DGRAM,                                                // type [in] - connectionless (supports UDP)
-                IPPROTO_UDP );                                                                   // protocol [in] - UDP
-            ioctlsocket (
-                socketEventTrace,                                                                // s [in] - the socket
-                FIONBIO,                                                        // cmd [in] - set blocking/non-blocking
-                &dwCmd );                                                         // *argp [inout] - set blocking above
-            setsockopt (
-                socketEventTrace,                                                                // s [in] - the socket
-                SOL_SOCKET,                                                     // level [in] - protocol level affected
-                SO_BROADCAST,                 // optname [in] - disable/enable transmitting/receiving broadcast packets
-                (LPCSTR)&bBroadcast,                                               // *optval [in] - enable (set above)
-                sizeof( bBroadcast ));                                                                   // optlen [in]
-        }
-        _port = profileValues.GetDebugPort();                 // get the broadcast port ([debug] port) from the profile
+        m_TraceLevel = ( TraceLevel ) CEventSink::Instance().Level;
+        m_bBinary = CEventSink::Instance().Binary;
+        m_nContext = 0;
     }
 
     virtual ~CEventTrace(void)
@@ -135,11 +103,6 @@ public:
         /**************************************************************************************************************
          * DESTRUCTOR                                                                                                 *
          **************************************************************************************************************/
-        if ( m_hFileHandle != INVALID_HANDLE_VALUE )
-        {
-            CloseHandle ( m_hFileHandle );
-            m_hFileHandle = INVALID_HANDLE_VALUE;
-        }
         if ( m_pszIdentity != NULL )
         {
             delete [] m_pszIdentity;
@@ -191,6 +154,19 @@ public:
         m_pszPort = new char [ Length ];
         ZeroMemory ( m_pszPort, Length );
         StringCbCopy ( m_pszPort, Length, pszAddress );
+
+        if ( m_bBinary == true )
+        {
+            /*
+             * We record the identifiers once; the events that follow refer to them by number.
+             */
+            m_nContext = CTraceFormat::NewContext();
+            CTraceRecord traceRecord ( CTraceFormat::ContextRecord, InvalidLevel, m_nContext, 0 );
+            traceRecord.AddString ( m_pszIdentity );
+            traceRecord.AddString ( m_pszPort );
+            traceRecord.AddString ( m_pszDevice );
+            Output ( traceRecord );
+        }
     }
 
     void Broadcast ( char* pszMessage )
@@ -198,24 +174,7 @@ public:
         /**************************************************************************************************************
          * This sends pszMessage to the port specified in the profile at the broadcast address of the LAN.            *
          **************************************************************************************************************/
-//        SOCKADDR_IN     sinIn;                                                       // doesn't seem to do anything!!!!
-        SOCKADDR_IN     sinOut;
-
-//        sinIn.sin_family =   AF_INET;
-//        sinIn.sin_addr.s_addr = INADDR_ANY;
-//        sinIn.sin_port = htons ( _port );
-
-        sinOut.sin_family = AF_INET;
-        sinOut.sin_port = htons ( _port );
-        sinOut.sin_addr.s_addr = INADDR_BROADCAST;               // 255.255.255.255 - translates to LAN broadcast addrs
-
-        sendto (
-            socketEventTrace,                                                             // s [in] - socket descriptor
-            pszMessage,                                                                 // *buf [in] - data to transmit
-            lstrlen ( pszMessage ),                                                        // len [in] - length of data
-            0,                                                                                    // flags [in] - flags
-            ( struct sockaddr* )&sinOut,                                // *to [in] - address of target (remote) socket
-            sizeof ( sinOut ));                                                         // tolen [in] - size of address
+        CEventSink::Instance().Broadcast ( pszMessage );
     }
 
     void Event ( TraceLevel Level, char* pszFormat, ...)
@@ -226,7 +185,14 @@ public:
          * according to pszFormat, encapsulated as a complete event in XML, broadcast to the port set in [debug] port *
          * in the profile and appended to the file set in [database] file in the profile.                             *
          **************************************************************************************************************/
-        if ( Level >= m_TraceLevel )
+        if ( Level >= m_TraceLevel && m_bBinary == true )
+        {
+            va_list args;                                          // to access variable arguments to this method (...)
+            va_start ( args, pszFormat );
+            RecordEvent ( Level, pszFormat, args );
+            va_end ( args );
+        }
+        else if ( Level >= m_TraceLevel )
         {
             /*
              * The level is sufficient to record the event. We set up strings and start the XML (including
@@ -274,7 +240,12 @@ public:
          * start the event, broadcasts it to the port set in [debug] port in the profile and appends it to the file   *
          * set in [database] file in the profile.                                                                     *
          **************************************************************************************************************/
-        if ( Level >= m_TraceLevel )
+        if ( Level >= m_TraceLevel && m_bBinary == true )
+        {
+            CTraceRecord traceRecord ( CTraceFormat::BeginRecord, Level, m_nContext, 0 );
+            Output ( traceRecord );
+        }
+        else if ( Level >= m_TraceLevel )
         {
             char szOutput [ 4096 ];
             ZeroMemory ( szOutput, sizeof ( szOutput ));
@@ -291,7 +262,19 @@ public:
          * A thread uses this after using BeginXML above to add pszValue to the XML-encoded event with the name       *
          * pszName.                                                                                                   *
          **************************************************************************************************************/
-        if ( Level >= m_TraceLevel )
+        if ( Level >= m_TraceLevel && m_bBinary == true )
+        {
+            const CTraceFormat::SFormat* pName = Intern ( pszName );                     // names are kept like formats
+            WORD nName = pName != NULL ? pName->nFormat : 0;
+            CTraceRecord traceRecord ( CTraceFormat::XmlRecord, Level, m_nContext, nName );
+            if ( pName == NULL )
+            {
+                traceRecord.AddString ( pszName );                                    // no room for it in the table
+            }
+            traceRecord.AddString ( pszValue );
+            Output ( traceRecord );
+        }
+        else if ( Level >= m_TraceLevel )
         {
             char szOutput [ 4096 ];
             StringCbPrintf ( szOutput, sizeof ( szOutput ), "\t<%s>%s</%s>\r\n", pszName, pszValue, pszName );
@@ -309,7 +292,12 @@ public:
 		{
 			CEventTrace::ResetTheLogFile();
 		}else */
-		if ( Level >= m_TraceLevel )
+		if ( Level >= m_TraceLevel && m_bBinary == true )
+        {
+            CTraceRecord traceRecord ( CTraceFormat::EndRecord, Level, m_nContext, 0 );
+            Output ( traceRecord );
+        }
+        else if ( Level >= m_TraceLevel )
         {
             Output ( "</event>\r\n" );
         }
@@ -325,14 +313,24 @@ public:
          * generated XML is broadcast to the port set in [debug] port in the profile and appended to the file set in  *
          * [database] file in the profile.                                                                            *
          **************************************************************************************************************/
-        if ( Level >= m_TraceLevel )
+        if ( Level >= m_TraceLevel && m_bBinary == true )
+        {
+            CTraceRecord traceRecord ( CTraceFormat::HexDumpRecord, Level, m_nContext, 0 );
+            traceRecord.AddBytes ( pData, DataLength );
+            Output ( traceRecord );
+        }
+        else if ( Level >= m_TraceLevel )
         {
             char szOutput [ 4096 ];
+            char szHex [ 4096 ];                                                   // as much as fits in szOutput
+            char szAscii [ 4096 ];
+            CHexDump::EncodeHex ( pData, DataLength, szHex, sizeof ( szHex ));
+            CHexDump::EncodeAscii ( pData, DataLength, szAscii, sizeof ( szAscii ));
             BuildXmlStart ( szOutput, sizeof ( szOutput ));
             StringCbCat( szOutput, sizeof ( szOutput ), ">\r\n\t<hex>" );
-            StringCbCat( szOutput, sizeof ( szOutput ), CHexDump::GetHexString ( pData, DataLength ));
+            StringCbCat( szOutput, sizeof ( szOutput ), szHex );
             StringCbCat( szOutput, sizeof ( szOutput ), "</hex>\r\n\t<ascii>" );
-            StringCbCat( szOutput, sizeof ( szOutput ), CHexDump::GetAsciiString ( pData, DataLength ));
+            StringCbCat( szOutput, sizeof ( szOutput ), szAscii );
             StringCbCat( szOutput, sizeof ( szOutput ), "</ascii>\r\n</event>\r\n" );
             Output ( szOutput );
         }
@@ -380,23 +378,56 @@ protected:
     void Output ( char* pszOutput )
     {
         /**************************************************************************************************************
-         * This broadcasts pszOutput then appends it to the logfile.                                                  *
+         * This hands pszOutput to the CEventSink to be appended to the logfile.                                      *
          **************************************************************************************************************/
         //Broadcast ( pszOutput );
-        DWORD dwWaitResult = WaitForSingleObject( ghMutex, INFINITE );
-        SetFilePointer (
-            m_hFileHandle,                                                                     // hFile [in] - the file
-            0,                                           // lDistanceToMove [in] - relative to specified starting point
-            NULL,                                                          // lpDistanceToMoveHigh [in, out] - not used
-            FILE_END );                                            // dwMoveMethod [in] - starting point is end of file
-        DWORD dwBytesWritten = 0;
-        BOOL bOK = WriteFile(
-            m_hFileHandle,                                                             // hFile [in] - file to write to
-            pszOutput,                                                                 // lpBuffer [in] - data to write
-            lstrlen ( pszOutput ),                                         // nNumberOfBytesToWrite [in] - size of data
-            &dwBytesWritten,                                   // lpNumberOfBytesWritten [out] - bytes actually written
-            NULL );                                                                // lpOverlapped [in, out] - not used
-        ReleaseMutex ( ghMutex );
+        CEventSink::Instance().Write ( pszOutput, lstrlen ( pszOutput ));
+    }
+
+    void Output ( CTraceRecord& traceRecord )
+    {
+        /**************************************************************************************************************
+         * This hands a binary record to the CEventSink to be appended to the trace.                                  *
+         **************************************************************************************************************/
+        CEventSink::Instance().Write ( traceRecord.Data, traceRecord.Length );
+    }
+
+    const CTraceFormat::SFormat* Intern ( char* pszFormat )
+    {
+        /**************************************************************************************************************
+         * This returns the number standing for pszFormat (or an XML name) in the binary trace, recording its         *
+         * FormatRecord the first time it is used. It returns NULL if there are too many formats to number.           *
+         **************************************************************************************************************/
+        bool bNew = false;
+        const CTraceFormat::SFormat* pFormat = CTraceFormat::Instance().Intern ( pszFormat, bNew );
+        if ( bNew == true )
+        {
+            CTraceRecord traceRecord ( CTraceFormat::FormatRecord, InvalidLevel, 0, pFormat->nFormat );
+            traceRecord.AddBytes ( pszFormat, lstrlen ( pszFormat ));
+            Output ( traceRecord );
+        }
+        return pFormat;
+    }
+
+    void RecordEvent ( TraceLevel Level, char* pszFormat, va_list args )
+    {
+        /**************************************************************************************************************
+         * This records Event's arguments in binary: their raw values follow the number standing for pszFormat. If    *
+         * pszFormat can't be numbered or its arguments recorded, the formatted event is recorded instead.            *
+         **************************************************************************************************************/
+        const CTraceFormat::SFormat* pFormat = Intern ( pszFormat );
+        if ( pFormat != NULL && pFormat->bRecordable == true )
+        {
+            CTraceRecord traceRecord ( CTraceFormat::EventRecord, Level, m_nContext, pFormat->nFormat );
+            traceRecord.AddArguments ( pFormat->szSignature, args );
+            Output ( traceRecord );
+            return;
+        }
+        char szOutputPrint [ 4096 ];                                    // ... args as a string formatted per pszFormat
+        StringCchVPrintf ( szOutputPrint, sizeof ( szOutputPrint ), pszFormat, args );
+        CTraceRecord traceRecord ( CTraceFormat::TextRecord, Level, m_nContext, 0 );
+        traceRecord.AddString ( szOutputPrint );
+        Output ( traceRecord );
     }
 
     void XmlEncode ( char* pszInput, size_t nInputLength, char* pszOutput, size_t nOutputLength )
@@ -1,7 +1,12 @@
 /**********************************************************************************************************************
  *                                      This file contains the CFileWatcher class.                                    *
  *                                                                                                                    *
- * This class appears to be unused.                                                                                   *
+ * This class watches a file for changes. CApplication uses it to watch the profile (.INI) file, so that edits to it  *
+ * are read by CProfileValues without a restart.                                                                      *
+ *                                                                                                                    *
+ * InitializeWatcher starts a thread which waits for changes to the directory holding the file. Once the file has     *
+ * changed and no more changes have come for 250 milliseconds, the event passed as rhFileChanged is signalled. The    *
+ * thread ends when the event passed as rhShutdown is signalled.                                                      *
  *                                                                                                                    *
  *                                         Copyright (c) Protel Inc. 2009-2010                                        *
  **********************************************************************************************************************/
@@ -9,6 +14,7 @@
 #pragma once
 
 #include "ErrorMessage.h"
+#include "EventTrace.h"
 
 class CFileWatcher
  {
@@ -17,7 +23,7 @@ private:
     {
         HANDLE hShutdown;
         HANDLE hFileChanged;
-        char* pszFileToWatch;
+        char szFileToWatch [ 1024 ];                                           // copied, so the caller's need not last
     };
 
 public:
@@ -26,7 +32,7 @@ public:
         InitializeStructure* pInitializeStructure = new InitializeStructure;
         pInitializeStructure->hShutdown = rhShutdown;
         pInitializeStructure->hFileChanged = rhFileChanged;
-        pInitializeStructure->pszFileToWatch = pszFileToWatch;
+        StringCbCopy ( pInitializeStructure->szFileToWatch, sizeof ( pInitializeStructure->szFileToWatch ), pszFileToWatch );
 
         HANDLE hWatcherThread = CreateThread(
             NULL,                                               // lpThreadAttributes [in] - NULL = cannot be inherited
@@ -37,8 +43,10 @@ public:
             NULL );                                                           // lpThreadId [out] - NULL = not returned
         if ( hWatcherThread == NULL )
         {
+            delete pInitializeStructure;
             return false;
         }
+        CloseHandle ( hWatcherThread );
         return true;
     }
 
@@ -49,7 +57,7 @@ private:
 
         char szFullFileName [ 1024 ];
         ZeroMemory ( szFullFileName, sizeof ( szFullFileName ));
-        CopyMemory ( szFullFileName, pInitializeStructure->pszFileToWatch, sizeof ( szFullFileName ));
+        StringCbCopy ( szFullFileName, sizeof ( szFullFileName ), pInitializeStructure->szFileToWatch );
 
         CoInitialize(NULL);                                               // initialise the COM library for this thread
 
@@ -87,6 +95,7 @@ private:
         FILE_NOTIFY_INFORMATION* pszFileNotifyInformation;
         char szFileName [ 1024 ];
         char szAction [ 1024 ];
+        CEventTrace eventTrace;                                                    // records events - see EventTrace.h
 
         bool bShutDown = false;
         DWORD dwBytes = 0;
@@ -109,39 +118,70 @@ private:
             switch ( dwResult )
             {
                 case WAIT_FAILED:
-                    OutputDebugString ( "WAIT_FAILED\r\n" );
-                    OutputDebugString ( CErrorMessage::ErrorMessageFromSystem ( GetLastError()));
+                    eventTrace.Event ( CEventTrace::Warning, "CFileWatcher - no longer watching %s: %s",
+                        pInitializeStructure->szFileToWatch, CErrorMessage::ErrorMessageFromSystem ( GetLastError()));
                     return 9999;
 
                 case WAIT_TIMEOUT:
                     if ( bPostEvent == true )
                     {
-                        OutputDebugString ( "SetEvent ( pInitializeStructure->hFileChanged );\n" );
+                        eventTrace.Event ( CEventTrace::Details, "CFileWatcher - %s changed",
+                            pInitializeStructure->szFileToWatch );
                         SetEvent ( pInitializeStructure->hFileChanged );
                     }
                     bPostEvent = false;
                     break;
 
                 case WAIT_OBJECT_0:
-                    OutputDebugString ( "WAIT_OBJECT_0\r\n" );
                     bShutDown = true;
                     break;
 
                 case WAIT_OBJECT_0+1:
                     dwMilliseconds = 250;
                     pszFileNotifyInformation = ( FILE_NOTIFY_INFORMATION* )pszBuffer;
-                    ZeroMemory ( szFileName, sizeof ( szFileName ));
-                    WideCharToMultiByte(
-                        CP_ACP,                                                       // CodePage [in] - ANSI code page
-                        0,                                                                            // dwFlags [in] -
-                        pszFileNotifyInformation->FileName,              // lpWideCharStr [in] - string to be converted
-                        pszFileNotifyInformation->FileNameLength,          // cchWideChar [in] - chars in lpWideCharStr
-                        szFileName,                                 // lpMultiByteStr [out] - receives converted string
-                        sizeof ( szFileName ),                    // cbMultiByte [in] - size of lpMultiByteStr in bytes
-                        NULL,                   // lpDefaultChar [in] - NULL = use system default char for unknown ones
-                        NULL );                      // lpUsedDefaultChar [out] - NULL = don't indicate if default used
+                    while ( true )                                                // each file changed is in the buffer
+                    {
+                        ZeroMemory ( szFileName, sizeof ( szFileName ));
+                        WideCharToMultiByte(
+                            CP_ACP,                                                   // CodePage [in] - ANSI code page
+                            0,                                                                        // dwFlags [in] -
+                            pszFileNotifyInformation->FileName,          // lpWideCharStr [in] - string to be converted
+                            pszFileNotifyInformation->FileNameLength / sizeof ( WCHAR ),    // cchWideChar [in] - chars
+                            szFileName,                             // lpMultiByteStr [out] - receives converted string
+                            sizeof ( szFileName ) - 1,    // cbMultiByte [in] - size of lpMultiByteStr, less terminator
+                            NULL,               // lpDefaultChar [in] - NULL = use system default char for unknown ones
+                            NULL );                  // lpUsedDefaultChar [out] - NULL = don't indicate if default used
+                        if ( StrCmpI ( szFileName, pszFileNameToWatch ) == 0 )
+                        {
+                            switch ( pszFileNotifyInformation->Action )
+                            {
+                            case FILE_ACTION_ADDED:                             // The file was added to the directory.
+                                StringCbCopy ( szAction, sizeof ( szAction ), "FILE_ACTION_ADDED" );
+                                break;
+                            case FILE_ACTION_REMOVED:                       // The file was removed from the directory.
+                                StringCbCopy ( szAction, sizeof ( szAction ), "FILE_ACTION_REMOVED" );
+                                break;
+                            case FILE_ACTION_MODIFIED: // The file was modified. This can be a change in the time stamp or attributes.
+                                StringCbCopy ( szAction, sizeof ( szAction ), "FILE_ACTION_MODIFIED" );
+                                break;
+                            case FILE_ACTION_RENAMED_OLD_NAME:        // The file was renamed and this is the old name.
+                                StringCbCopy ( szAction, sizeof ( szAction ), "FILE_ACTION_RENAMED_OLD_NAME" );
+                                break;
+                            case FILE_ACTION_RENAMED_NEW_NAME:        // The file was renamed and this is the new name.
+                                StringCbCopy ( szAction, sizeof ( szAction ), "FILE_ACTION_RENAMED_NEW_NAME" );
+                                break;
+                            }
+                            eventTrace.Event ( CEventTrace::Details, "CFileWatcher - %s\t%s", szAction, szFileName );
+                            bPostEvent = true;
+                        }
+                        if ( pszFileNotifyInformation->NextEntryOffset == 0 )
+                        {
+                            break;
+                        }
+                        pszFileNotifyInformation = ( FILE_NOTIFY_INFORMATION* )(( BYTE* )pszFileNotifyInformation + pszFileNotifyInformation->NextEntryOffset );
+                    }
                     ResetEvent ( ov.hEvent );
-                    bOK = ReadDirectoryChangesW (
+                    bOK = ReadDirectoryChangesW (                       // the buffer is read above before it is reused
                         hDir,                                          // hDirectory [in] - file (directory) to monitor
                         pszBuffer,                                               // lpBuffer [out] - buffer for results
                         nBufferSize,                                  // nBufferLength [in] - size of lpBuffer in bytes
@@ -150,39 +190,14 @@ private:
                         &dwBytes,                 // lpBytesReturned [out] - bytes placed in buffer (should be ignored)
                         &ov,                                      // lpOverlapped [in, out] - for nonblocking operation
                         NULL );                                           // lpCompletionRoutine [in] - NULL = not used
-                    if ( StrCmpI ( szFileName, pszFileNameToWatch ) == 0 )
-                    {
-                        switch ( pszFileNotifyInformation->Action )
-                        {
-                        case FILE_ACTION_ADDED:                                 // The file was added to the directory.
-                            StringCbCopy ( szAction, sizeof ( szAction ), "FILE_ACTION_ADDED" );
-                            break;
-                        case FILE_ACTION_REMOVED:                           // The file was removed from the directory.
-                            StringCbCopy ( szAction, sizeof ( szAction ), "FILE_ACTION_REMOVED" );
-                            break;
-                        case FILE_ACTION_MODIFIED: // The file was modified. This can be a change in the time stamp or attributes.
-                            StringCbCopy ( szAction, sizeof ( szAction ), "FILE_ACTION_MODIFIED" );
-                            break;
-                        case FILE_ACTION_RENAMED_OLD_NAME:            // The file was renamed and this is the old name.
-                            StringCbCopy ( szAction, sizeof ( szAction ), "FILE_ACTION_RENAMED_OLD_NAME" );
-                            break;
-                        case FILE_ACTION_RENAMED_NEW_NAME:            // The file was renamed and this is the new name.
-                            StringCbCopy ( szAction, sizeof ( szAction ), "FILE_ACTION_RENAMED_NEW_NAME" );
-                            break;
-                    }
-                    OutputDebugString ( "WAIT_OBJECT_0+1\t[" );
-                    OutputDebugString ( szAction );
-                    OutputDebugString ( "]\t[" );
-                    OutputDebugString ( szFileName );
-                    OutputDebugString ( "]\r\n" );
-                    bPostEvent = true;
-                }
-                break;
+                    break;
             }
         }
 
         CloseHandle ( hDir );
         CloseHandle ( ov.hEvent );
+        delete [] pszBuffer;
+        delete pInitializeStructure;
         CoUninitialize();                                        // close the COM library and clean up thread resources
         return 0;
     }
@@ -0,0 +1,267 @@
+/**********************************************************************************************************************
+ *                                     This file contains the CFrameDecoder class.                                    *
+ *                                                                                                                    *
+ * This is used by ProtelHost to split the byte stream received from a master auditor into complete frames. Each      *
+ * frame has the form T | length | command | payload | checksum where length counts the command byte plus the         *
+ * payload, so a complete frame is always length + 3 bytes long and can never exceed 258 bytes.                       *
+ *                                                                                                                    *
+ * Received data is written into a ring buffer with Write. NextFrame is then called repeatedly until it returns       *
+ * NeedMoreData: each call either returns the next complete frame (valid or with a bad checksum) or reports that      *
+ * only a partial frame remains. The partial frame is kept for the next Write, so a frame split across several reads  *
+ * or several frames arriving in a single read are all handled.                                                       *
+ *                                                                                                                    *
+ * Bytes that can't start a frame (anything other than the sync character T) are discarded. When a candidate frame    *
+ * has a bad checksum only its sync character is discarded, so a valid frame that follows the noise is still found.   *
+ * An incomplete candidate is always waited for, since its payload (e.g. DEX data) is full of T's and some of them    *
+ * are bound to be followed by what looks like a valid frame. A stray T followed by a large length byte therefore     *
+ * holds up the frame behind it until the response times out; only then does CProtelEngine look behind it (see        *
+ * FindFrameBehind) for a frame that answers the command it sent.                                                     *
+ *                                                                                                                    *
+ * The checksum of the frame at the front of the ring buffer is kept as a running sum (see Checksum.h) which is       *
+ * extended as its bytes arrive, so bytes of a frame split across several reads are only summed once.                 *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+#include "Checksum.h"
+
+#define FRAMEDECODER_RINGSIZE   4096                                      // size of ring buffer - must be a power of 2
+#define FRAMEDECODER_MAXFRAME   ( 255 + 3 )                    // largest possible frame (T, length, command, checksum)
+
+class CFrameDecoder
+ {
+public:
+    enum FrameStatus
+    {
+        NeedMoreData,                                               // no complete frame yet, any partial frame is kept
+        ValidFrame,                                                           // a complete frame with a valid checksum
+        BadFrame,                                                          // a complete frame with an invalid checksum
+    };
+
+    CFrameDecoder(void)
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+        Reset();
+    }
+
+    virtual ~CFrameDecoder(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+    }
+
+    void Reset ( void )
+    {
+        /**************************************************************************************************************
+         * This discards all buffered data, e.g. when a new command is transmitted and a new response is expected.    *
+         **************************************************************************************************************/
+        m_nHead = 0;
+        m_nCount = 0;
+        m_nSummed = 0;
+        m_FrameSum.Reset();
+    }
+
+    int Write ( BYTE* pData, int DataLength )
+    {
+        /**************************************************************************************************************
+         * This appends up to DataLength bytes from pData to the ring buffer and returns the number of bytes actually *
+         * written. Fewer bytes are written if the ring buffer is full: the caller should then drain complete frames  *
+         * using NextFrame and write the remainder. (Once NextFrame has returned NeedMoreData at most one partial     *
+         * frame is left, so there is always room for more data.)                                                     *
+         **************************************************************************************************************/
+        int nFree = FRAMEDECODER_RINGSIZE - m_nCount;
+        if ( DataLength > nFree )
+        {
+            DataLength = nFree;
+        }
+
+        int nTail = ( m_nHead + m_nCount ) & ( FRAMEDECODER_RINGSIZE - 1 );
+        int nFirst = FRAMEDECODER_RINGSIZE - nTail;                                 // contiguous space before wrapping
+        if ( nFirst > DataLength )
+        {
+            nFirst = DataLength;
+        }
+        CopyMemory ( m_Ring + nTail, pData, nFirst );
+        CopyMemory ( m_Ring, pData + nFirst, DataLength - nFirst );             // the rest (if any) wraps to the start
+        m_nCount += DataLength;
+        return DataLength;
+    }
+
+    FrameStatus NextFrame ( BYTE* pFrame, int& FrameLength )
+    {
+        /**************************************************************************************************************
+         * This looks for the next complete frame in the ring buffer. If one is found, it is copied to pFrame (which  *
+         * must hold at least FRAMEDECODER_MAXFRAME bytes), its length is returned in FrameLength and ValidFrame or   *
+         * BadFrame is returned according to its checksum. A valid frame is removed from the ring buffer; for a bad   *
+         * frame only the sync character is removed so that the search resumes with the following byte.               *
+         *                                                                                                            *
+         * NeedMoreData is returned when no complete frame remains.                                                   *
+         **************************************************************************************************************/
+        FrameLength = 0;
+        while ( m_nCount > 0 )
+        {
+            if ( m_Ring [ m_nHead ] != 'T' )
+            {
+                SkipToSync();                                                // noise - discard everything up to next T
+                continue;
+            }
+
+            if ( m_nCount < 2 )
+            {
+                return NeedMoreData;                                               // we don't have the length byte yet
+            }
+
+            int nLength = m_Ring [ ( m_nHead + 1 ) & ( FRAMEDECODER_RINGSIZE - 1 ) ];
+            if ( nLength < 1 )
+            {
+                Discard ( 1 );                                   // a frame must at least contain the command character
+                continue;
+            }
+
+            int nFrameLength = nLength + 3;
+            SumFrame ( nFrameLength );
+            if ( m_nCount < nFrameLength )
+            {
+                return NeedMoreData;                                               // partial frame - wait for the rest
+            }
+
+            Peek ( pFrame, nFrameLength );
+            FrameLength = nFrameLength;
+            if ( m_FrameSum.FrameChecksum == pFrame [ nFrameLength - 1 ] )
+            {
+                Discard ( nFrameLength );
+                return ValidFrame;
+            }
+            Discard ( 1 );                                                           // resync on the byte after this T
+            return BadFrame;
+        }
+        return NeedMoreData;
+    }
+
+    int GetBufferedLength ( void )
+    {
+        return m_nCount;
+    }
+    __declspec(property(get = GetBufferedLength)) int BufferedLength;
+
+    int FindFrameBehind ( BYTE* pFrame, int& FrameLength, int After = 0 )
+    {
+        /**************************************************************************************************************
+         * This looks for the first T more than After bytes from the front of the ring buffer which starts a complete *
+         * frame with a valid checksum. If one is found, it is copied to pFrame (which must hold at least             *
+         * FRAMEDECODER_MAXFRAME bytes), its length is returned in FrameLength and its offset from the front is       *
+         * returned (so calling again with that offset finds the next one). Otherwise 0 is returned.                  *
+         *                                                                                                            *
+         * Nothing is removed: the caller decides whether the frame found is the one it is waiting for, and if so     *
+         * Discards the bytes before it. NextFrame doesn't do this itself, since the T's in the payload of a frame    *
+         * still arriving often start what looks like a valid frame (see above).                                      *
+         **************************************************************************************************************/
+        FrameLength = 0;
+        for ( int nOffset = After + 1; nOffset + 3 < m_nCount; nOffset++ )
+        {
+            if ( m_Ring [ ( m_nHead + nOffset ) & ( FRAMEDECODER_RINGSIZE - 1 ) ] != 'T' )
+            {
+                continue;
+            }
+            int nLength = m_Ring [ ( m_nHead + nOffset + 1 ) & ( FRAMEDECODER_RINGSIZE - 1 ) ];
+            int nFrameLength = nLength + 3;
+            if ( nLength < 1 || nOffset + nFrameLength > m_nCount )
+            {
+                continue;                                                        // not a frame, or not complete yet
+            }
+            Peek ( pFrame, nFrameLength, nOffset );
+            if ( CChecksum::IsValidFrameChecksum ( pFrame, nFrameLength ) == true )
+            {
+                FrameLength = nFrameLength;
+                return nOffset;
+            }
+        }
+        return 0;
+    }
+
+    void Discard ( int Length )
+    {
+        /**************************************************************************************************************
+         * This removes Length bytes from the front of the ring buffer.                                               *
+         **************************************************************************************************************/
+        m_nHead = ( m_nHead + Length ) & ( FRAMEDECODER_RINGSIZE - 1 );
+        m_nCount -= Length;
+        m_nSummed = 0;                                                   // the front frame (if any) is a new candidate
+        m_FrameSum.Reset();
+    }
+
+protected:
+    void Peek ( BYTE* pDestination, int Length, int Offset = 0 )
+    {
+        /**************************************************************************************************************
+         * This copies Length bytes, starting Offset bytes from the front of the ring buffer, to pDestination without *
+         * removing them.                                                                                             *
+         **************************************************************************************************************/
+        int nStart = ( m_nHead + Offset ) & ( FRAMEDECODER_RINGSIZE - 1 );
+        int nFirst = FRAMEDECODER_RINGSIZE - nStart;
+        if ( nFirst > Length )
+        {
+            nFirst = Length;
+        }
+        CopyMemory ( pDestination, m_Ring + nStart, nFirst );
+        CopyMemory ( pDestination + nFirst, m_Ring, Length - nFirst );
+    }
+
+    void SumFrame ( int FrameLength )
+    {
+        /**************************************************************************************************************
+         * This extends the running sum of the frame at the front of the ring buffer with any of its bytes (excluding *
+         * the checksum itself) that have arrived since it was last called.                                           *
+         **************************************************************************************************************/
+        int nEnd = FrameLength - 1;                                                        // the checksum isn't summed
+        if ( nEnd > m_nCount )
+        {
+            nEnd = m_nCount;
+        }
+        while ( m_nSummed < nEnd )
+        {
+            int nStart = ( m_nHead + m_nSummed ) & ( FRAMEDECODER_RINGSIZE - 1 );
+            int nContiguous = FRAMEDECODER_RINGSIZE - nStart;
+            if ( nContiguous > nEnd - m_nSummed )
+            {
+                nContiguous = nEnd - m_nSummed;
+            }
+            m_FrameSum.Add ( m_Ring + nStart, nContiguous );
+            m_nSummed += nContiguous;
+        }
+    }
+
+    void SkipToSync ( void )
+    {
+        /**************************************************************************************************************
+         * This discards bytes from the front of the ring buffer up to (but not including) the next sync character.   *
+         * Unlike StrChr, memchr doesn't stop at a NUL byte, so noise containing zeros is skipped correctly.          *
+         **************************************************************************************************************/
+        while ( m_nCount > 0 )
+        {
+            int nContiguous = FRAMEDECODER_RINGSIZE - m_nHead;
+            if ( nContiguous > m_nCount )
+            {
+                nContiguous = m_nCount;
+            }
+            BYTE* pSync = ( BYTE* ) memchr ( m_Ring + m_nHead, 'T', nContiguous );
+            if ( pSync != NULL )
+            {
+                Discard (( int )( pSync - ( m_Ring + m_nHead )));
+                return;
+            }
+            Discard ( nContiguous );
+        }
+    }
+
+    BYTE m_Ring [ FRAMEDECODER_RINGSIZE ];                                                            // received bytes
+    int m_nHead;                                                                      // offset in m_Ring of first byte
+    int m_nCount;                                                                          // number of bytes in m_Ring
+    CChecksum m_FrameSum;                                            // running sum of the frame at the front of m_Ring
+    int m_nSummed;                                              // number of bytes of that frame included in m_FrameSum
+ };
@@ -0,0 +1,517 @@
+/**********************************************************************************************************************
+ *                                    This file contains the CFrameLogWriter class.                                   *
+ *                                                                                                                    *
+ * Every frame sent to or received from a master auditor is recorded by PKG_COMM_SERVER.LOG (COMM_SERVER_DETAILS and  *
+ * COMM_SERVER_LOG). Calling the procedure from the connection thread as each frame goes by costs a database round    *
+ * trip per frame and holds up the conversation with the auditor while it waits. Instead, CProtelHost hands each      *
+ * frame to the single CFrameLogWriter, which copies it into a bounded queue and returns at once. A background        *
+ * thread, with a database connection of its own, takes the queued frames and writes up to "Frame Log Batch" of them  *
+ * in one round trip (an anonymous PL/SQL block calling PKG_COMM_SERVER.LOG once per frame). A batch is written as    *
+ * soon as it is full, or FRAMELOGWRITER_FLUSHMS after the first frame of it was queued, whichever comes first.       *
+ *                                                                                                                    *
+ * The queue has FRAMELOGWRITER_QUEUESIZE entries taken in turn by any number of connection threads without a lock    *
+ * (each entry carries a sequence number saying whether it is free or holds a frame). If the database can't keep up   *
+ * and the queue fills, a connection waits up to "Frame Log Overflow Wait" milliseconds for room and then drops the   *
+ * frame, counting it: the call itself is never held up for longer than that. If the database connection fails, it is *
+ * reopened and the batch is tried once more before its frames are dropped.                                           *
+ *                                                                                                                    *
+ * With "Frame Log Batch" set to 0 the writer isn't started and frames are written as they go by, as before. Note     *
+ * that frames are written a little after the call's other database updates, so the last of them may appear after the *
+ * call has finished.                                                                                                 *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+#include "AdoConnection.h"
+#include "AdoConnectionPool.h"
+#include "EventTrace.h"
+#include "FrameDecoder.h"
+#include "ProfileValues.h"
+#include "variantBlob.h"
+
+#define FRAMELOGWRITER_QUEUESIZE    4096                                        // frames queued at once (a power of 2)
+#define FRAMELOGWRITER_QUEUEMASK    ( FRAMELOGWRITER_QUEUESIZE - 1 )
+#define FRAMELOGWRITER_MAXBATCH     64                                         // most frames written in one round trip
+#define FRAMELOGWRITER_FLUSHMS      200                                 // a part batch is written after this long (ms)
+#define FRAMELOGWRITER_RETRYMS      5000                                   // wait before reopening a failed connection
+#define FRAMELOGWRITER_STOPSECONDS  30                                   // Stop waits this long for the queue to empty
+
+class CFrameLogWriter
+ {
+public:
+    static CFrameLogWriter& Instance ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the single writer shared by every connection. CApplication::Start calls it (to Start the      *
+         * writer) before any connection threads are started, so it is constructed then.                              *
+         **************************************************************************************************************/
+        static CFrameLogWriter frameLogWriter;
+        return frameLogWriter;
+    }
+
+    bool Start ( void )
+    {
+        /**************************************************************************************************************
+         * This reads "Frame Log Batch" and "Frame Log Overflow Wait" and, unless the batch size is 0, starts the     *
+         * writer thread. It returns TRUE if the writer is running.                                                   *
+         **************************************************************************************************************/
+        if ( m_hThread != NULL )
+        {
+            return m_bRunning;                                                 // FALSE if Stop left the thread running
+        }
+        CProfileValues profileValues;
+        m_nBatchSize = profileValues.GetFrameLogBatch();
+        m_nOverflowWait = profileValues.GetFrameLogOverflowWait();
+        if ( m_nBatchSize <= 0 )
+        {
+            return false;                                                           // frames are written as they go by
+        }
+        if ( m_nBatchSize > FRAMELOGWRITER_MAXBATCH )
+        {
+            m_nBatchSize = FRAMELOGWRITER_MAXBATCH;
+        }
+        if ( m_nOverflowWait < 0 )
+        {
+            m_nOverflowWait = 0;
+        }
+
+        for ( int nEntry = 0; nEntry < FRAMELOGWRITER_QUEUESIZE; nEntry++ )
+        {
+            m_pEntries [ nEntry ].nSequence = nEntry;                                       // free for position nEntry
+        }
+        m_nEnqueuePos = 0;
+        m_nDequeuePos = 0;
+        m_nPending = 0;
+        m_bStopping = false;
+        m_hWake = CreateEvent(
+            NULL,                                                            // lpEventAttributes [in] - NULL = default
+            FALSE,                                                                    // bManualReset [in] - auto reset
+            FALSE,                                                                // bInitialState [in] - not signalled
+            NULL );                                                                     // lpName [in] - NULL = unnamed
+        if ( m_hWake == NULL )
+        {
+            return false;
+        }
+        m_hThread = CreateThread(
+            NULL,                                               // lpThreadAttributes [in] - NULL = cannot be inherited
+            0,                                               // dwStackSize [in] - initial stack size - 0 = use default
+            WriterThreadProc,                                                     // lpStartAddress [in] - in this file
+            this,                                                                     // lpParameter [in] - this writer
+            0,                                                                // dwCreationFlags [in] - run immediately
+            NULL );                                                           // lpThreadId [out] - NULL = not returned
+        if ( m_hThread == NULL )
+        {
+            CloseHandle ( m_hWake );
+            m_hWake = NULL;
+            return false;
+        }
+        m_bRunning = true;
+        return true;
+    }
+
+    void Stop ( void )
+    {
+        /**************************************************************************************************************
+         * This is used once the connections have shut down. New frames are no longer queued, the thread writes       *
+         * what is left in the queue (waiting up to FRAMELOGWRITER_STOPSECONDS) and exits, and the totals are         *
+         * recorded as an event.                                                                                      *
+         *                                                                                                            *
+         * If the thread hasn't exited by then (e.g. it is stuck in the database) it is reported and left running:    *
+         * its handles and the queue it reads are left for it rather than freed under it, here or by the destructor.  *
+         **************************************************************************************************************/
+        if ( m_hThread == NULL || m_bStopping == true )
+        {
+            return;                                                             // not started, or already left running
+        }
+        m_bRunning = false;
+        m_bStopping = true;
+        SetEvent ( m_hWake );
+        if ( WaitForSingleObject ( m_hThread, FRAMELOGWRITER_STOPSECONDS * 1000 ) != WAIT_OBJECT_0 )
+        {
+            m_EventTrace.Event ( CEventTrace::Warning,
+                "CFrameLogWriter::Stop - the writer thread, still writing after %d seconds, is left running",
+                FRAMELOGWRITER_STOPSECONDS );
+        }
+        else
+        {
+            CloseHandle ( m_hThread );
+            m_hThread = NULL;
+            CloseHandle ( m_hWake );
+            m_hWake = NULL;
+        }
+
+        m_EventTrace.Event ( CEventTrace::Information,
+            "CFrameLogWriter::Stop - %ld frames queued, %ld written in %ld batches, %ld dropped (%ld failed batches)",
+            m_nQueued, m_nWritten, m_nBatches, m_nDropped, m_nFailedBatches );
+    }
+
+    bool Log ( int CallNumber, double CallStartTime, const char* CentralAuditor, const char* Command, bool ToHost,
+        bool Retransmit, BYTE* Data, int DataLength )
+    {
+        /**************************************************************************************************************
+         * This queues a frame (DataLength bytes in Data) to be written by PKG_COMM_SERVER.LOG, with the details it   *
+         * is recorded under. It returns FALSE, having done nothing, if the writer isn't running, in which case the   *
+         * caller writes the frame itself. Otherwise it returns TRUE, even if the queue stayed full and the frame     *
+         * was dropped.                                                                                               *
+         **************************************************************************************************************/
+        if ( m_bRunning == false )
+        {
+            return false;
+        }
+        if ( DataLength > FRAMEDECODER_MAXFRAME )
+        {
+            DataLength = FRAMEDECODER_MAXFRAME;
+        }
+        if ( DataLength < 0 )
+        {
+            DataLength = 0;
+        }
+
+        SFrameEntry* pEntry = Reserve();
+        if ( pEntry == NULL && m_nOverflowWait > 0 )
+        {
+            SetEvent ( m_hWake );                                                          // the writer may be waiting
+            DWORD dwStarted = GetTickCount();
+            while ( pEntry == NULL && GetTickCount() - dwStarted < ( DWORD ) m_nOverflowWait )
+            {
+                Sleep ( 10 );
+                pEntry = Reserve();
+            }
+        }
+        if ( pEntry == NULL )
+        {
+            InterlockedIncrement ( &m_nDropped );
+            return true;
+        }
+
+        pEntry->CallNumber = CallNumber;
+        pEntry->CallStartTime = CallStartTime;
+        StringCbCopy ( pEntry->CentralAuditor, sizeof ( pEntry->CentralAuditor ),
+            CentralAuditor != NULL ? CentralAuditor : "" );
+        StringCbCopy ( pEntry->Command, sizeof ( pEntry->Command ), Command != NULL ? Command : "" );
+        pEntry->ToHost = ToHost == true ? 1 : 0;
+        pEntry->Retransmit = Retransmit == true ? 1 : 0;
+        pEntry->Length = DataLength;
+        CopyMemory ( pEntry->Data, Data, DataLength );
+        InterlockedExchange ( &pEntry->nSequence, pEntry->nReserved + 1 );                     // hand it to the writer
+
+        InterlockedIncrement ( &m_nQueued );
+        if ( InterlockedIncrement ( &m_nPending ) == m_nBatchSize )
+        {
+            SetEvent ( m_hWake );                                                            // a full batch is waiting
+        }
+        return true;
+    }
+
+    long GetQueued ( void )
+    {
+        return m_nQueued;
+    }
+    __declspec(property(get = GetQueued)) long Queued;
+
+    long GetWritten ( void )
+    {
+        return m_nWritten;
+    }
+    __declspec(property(get = GetWritten)) long Written;
+
+    long GetDropped ( void )
+    {
+        return m_nDropped;
+    }
+    __declspec(property(get = GetDropped)) long Dropped;
+
+    long GetBatches ( void )
+    {
+        return m_nBatches;
+    }
+    __declspec(property(get = GetBatches)) long Batches;
+
+    long GetFailedBatches ( void )
+    {
+        return m_nFailedBatches;
+    }
+    __declspec(property(get = GetFailedBatches)) long FailedBatches;
+
+private:
+    struct SFrameEntry                                                                                // a queued frame
+    {
+        volatile LONG nSequence;                 // position it is free for, or that position + 1 once it holds a frame
+        LONG nReserved;                                                                 // position it was reserved for
+        int CallNumber;
+        double CallStartTime;
+        char CentralAuditor [ 64 ];
+        char Command [ 2 ];
+        char ToHost;
+        char Retransmit;
+        int Length;
+        BYTE Data [ FRAMEDECODER_MAXFRAME ];
+    };
+
+    CFrameLogWriter(void) :
+        m_hThread ( NULL ),
+        m_hWake ( NULL ),
+        m_bRunning ( false ),
+        m_bStopping ( false ),
+        m_nBatchSize ( 0 ),
+        m_nOverflowWait ( 0 ),
+        m_nEnqueuePos ( 0 ),
+        m_nDequeuePos ( 0 ),
+        m_nPending ( 0 ),
+        m_nQueued ( 0 ),
+        m_nWritten ( 0 ),
+        m_nDropped ( 0 ),
+        m_nBatches ( 0 ),
+        m_nFailedBatches ( 0 )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+        m_pEntries = new SFrameEntry [ FRAMELOGWRITER_QUEUESIZE ];                 // about 1.4 MB - kept off the stack
+    }
+
+    virtual ~CFrameLogWriter(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+        Stop();
+        if ( m_hThread == NULL )
+        {
+            delete [] m_pEntries;                                          // a thread Stop left running still reads it
+        }
+    }
+
+    SFrameEntry* Reserve ( void )
+    {
+        /**************************************************************************************************************
+         * This takes the next free queue entry for the calling connection, or returns NULL if the queue is full.     *
+         * Several connections may call it at once: each tries to advance m_nEnqueuePos past an entry that is free    *
+         * for that position, and whichever succeeds owns the entry.                                                  *
+         **************************************************************************************************************/
+        LONG nPos = m_nEnqueuePos;
+        for ( ;; )
+        {
+            SFrameEntry* pEntry = &m_pEntries [ nPos & FRAMELOGWRITER_QUEUEMASK ];
+            LONG nDifference = ( LONG )(( DWORD ) pEntry->nSequence - ( DWORD ) nPos );
+            if ( nDifference == 0 )
+            {
+                if ( InterlockedCompareExchange ( &m_nEnqueuePos, nPos + 1, nPos ) == nPos )
+                {
+                    pEntry->nReserved = nPos;
+                    return pEntry;
+                }
+            }
+            else if ( nDifference < 0 )
+            {
+                return NULL;                                             // the writer hasn't freed it yet - queue full
+            }
+            nPos = m_nEnqueuePos;                                                 // another connection took it - retry
+        }
+    }
+
+    SFrameEntry* Peek ( int Offset )
+    {
+        /**************************************************************************************************************
+         * This returns the frame Offset entries after the oldest in the queue, or NULL if no frame has been handed   *
+         * over there yet. It is only used by the writer thread.                                                      *
+         **************************************************************************************************************/
+        LONG nPos = m_nDequeuePos + Offset;
+        SFrameEntry* pEntry = &m_pEntries [ nPos & FRAMELOGWRITER_QUEUEMASK ];
+        if (( LONG )(( DWORD ) pEntry->nSequence - ( DWORD )( nPos + 1 )) < 0 )
+        {
+            return NULL;
+        }
+        return pEntry;
+    }
+
+    void Release ( int Count )
+    {
+        /**************************************************************************************************************
+         * This frees the Count oldest entries, once they have been written (or dropped), for reuse.                  *
+         **************************************************************************************************************/
+        for ( int nLoop = 0; nLoop < Count; nLoop++ )
+        {
+            SFrameEntry* pEntry = &m_pEntries [ m_nDequeuePos & FRAMELOGWRITER_QUEUEMASK ];
+            InterlockedExchange ( &pEntry->nSequence, m_nDequeuePos + FRAMELOGWRITER_QUEUESIZE );
+            m_nDequeuePos++;
+        }
+        InterlockedExchangeAdd ( &m_nPending, -Count );
+    }
+
+    static DWORD WINAPI WriterThreadProc ( LPVOID lpParam )
+    {
+        /**************************************************************************************************************
+         * This is the writer thread. It uses its own database connection, so the COM library is initialised for it.  *
+         **************************************************************************************************************/
+        CoInitialize(NULL);                                               // initialise the COM library for this thread
+        (( CFrameLogWriter* ) lpParam )->Run();
+        CoUninitialize();                                        // close the COM library and clean up thread resources
+        return 0;
+    }
+
+    void Run ( void )
+    {
+        /**************************************************************************************************************
+         * This waits until a full batch is queued or FRAMELOGWRITER_FLUSHMS has passed, then writes everything       *
+         * queued, a batch at a time. While the database can't be reached, frames stay queued (and new ones are       *
+         * dropped once it is full) and the connection is retried every FRAMELOGWRITER_RETRYMS. Once stopping, it     *
+         * writes what is left and exits, dropping it instead if the database still can't be reached.                 *
+         *                                                                                                            *
+         * A connection is borrowed from CAdoConnectionPool while there are frames to write and handed back once the  *
+         * queue is empty. If a batch fails, the connection is handed back as broken and another borrowed to try the  *
+         * batch again.                                                                                               *
+         **************************************************************************************************************/
+        CAdoConnection* pConnection = NULL;
+        DWORD dwRetryDue = GetTickCount();
+        for ( ;; )
+        {
+            WaitForSingleObject ( m_hWake, FRAMELOGWRITER_FLUSHMS );
+            bool bStopping = m_bStopping;
+            for ( ;; )
+            {
+                int nCount = 0;
+                while ( nCount < m_nBatchSize && Peek ( nCount ) != NULL )
+                {
+                    nCount++;
+                }
+                if ( nCount == 0 )
+                {
+                    break;                                                                       // nothing more queued
+                }
+                if ( pConnection == NULL && ( bStopping == true || ( long )( GetTickCount() - dwRetryDue ) >= 0 ))
+                {
+                    pConnection = CAdoConnectionPool::Instance().Acquire();
+                    dwRetryDue = GetTickCount() + FRAMELOGWRITER_RETRYMS;
+                }
+                if ( pConnection == NULL )
+                {
+                    if ( bStopping == false )
+                    {
+                        break;                                               // keep them queued until the retry is due
+                    }
+                    InterlockedExchangeAdd ( &m_nDropped, nCount );
+                    Release ( nCount );
+                    continue;
+                }
+                if ( WriteBatch ( *pConnection, nCount ) == false )
+                {
+                    CAdoConnectionPool::Instance().Release ( pConnection, true );  // the connection may have been lost
+                    pConnection = CAdoConnectionPool::Instance().Acquire();
+                    dwRetryDue = GetTickCount() + FRAMELOGWRITER_RETRYMS;
+                    if ( pConnection == NULL || WriteBatch ( *pConnection, nCount ) == false )
+                    {
+                        m_nFailedBatches++;
+                        InterlockedExchangeAdd ( &m_nDropped, nCount );
+                        m_EventTrace.Event ( CEventTrace::Information,
+                            "CFrameLogWriter::Run <--> ERROR: %d frames not written", nCount );
+                        Release ( nCount );
+                        continue;
+                    }
+                }
+                m_nBatches++;
+                InterlockedExchangeAdd ( &m_nWritten, nCount );
+                Release ( nCount );
+            }
+            CAdoConnectionPool::Instance().Release ( pConnection );
+            pConnection = NULL;
+            if ( bStopping == true )
+            {
+                break;
+            }
+        }
+    }
+
+    bool WriteBatch ( CAdoConnection& adoConnection, int Count )
+    {
+        /**************************************************************************************************************
+         * This writes the Count oldest queued frames in one round trip, by executing an anonymous PL/SQL block that  *
+         * calls PKG_COMM_SERVER.LOG once for each, and returns TRUE on success. The block runs as a single           *
+         * statement, so either every frame is written or none is. Each frame's parameter names are prefixed with its *
+         * position ("f0_pi_callnumber", ...), as they must be unique within the command.                             *
+         **************************************************************************************************************/
+        char szBlock [ 64 + FRAMELOGWRITER_MAXBATCH * 48 ];
+        StringCbCopy ( szBlock, sizeof ( szBlock ), "BEGIN\n" );
+        for ( int nLoop = 0; nLoop < Count; nLoop++ )
+        {
+            StringCbCat ( szBlock, sizeof ( szBlock ), "PKG_COMM_SERVER.LOG ( ?, ?, ?, ?, ?, ?, ? );\n" );
+        }
+        StringCbCat ( szBlock, sizeof ( szBlock ), "END;" );
+
+        try
+        {
+            char szPrefix [ 16 ];
+            char szName [ 64 ];
+            CAdoStoredProcedure adoStoredProcedure ( szBlock, ADODB::CommandTypeEnum::adCmdText );
+            for ( int nLoop = 0; nLoop < Count; nLoop++ )
+            {
+                SFrameEntry* pEntry = Peek ( nLoop );
+                StringCbPrintf ( szPrefix, sizeof ( szPrefix ), "f%d_", nLoop );
+                //PROCEDURE LOG (
+                //    pi_callnumber          in integer,
+                //    pi_call_start_time     in timestamp default null,
+                //    pi_centralauditor      in varchar2 default null,
+                //    pi_tohost              in smallint,
+                //    pi_retransmit          in smallint,
+                //    pi_command             in varchar2,
+                //    pi_transmission_data   in blob   );
+
+                _variant_t vtCallNumber (( long ) pEntry->CallNumber, VT_I4 );
+                StringCbPrintf ( szName, sizeof ( szName ), "%spi_callnumber", szPrefix );
+                adoStoredProcedure.AddParameter( szName, vtCallNumber, ADODB::DataTypeEnum::adInteger, ADODB::ParameterDirectionEnum::adParamInput, sizeof ( long ));
+
+                _variant_t vtCallStartTime ( pEntry->CallStartTime, VT_DATE );
+                StringCbPrintf ( szName, sizeof ( szName ), "%spi_call_start_time", szPrefix );
+                adoStoredProcedure.AddParameter( szName, vtCallStartTime, ADODB::DataTypeEnum::adDate, ADODB::ParameterDirectionEnum::adParamInput, sizeof ( double ));
+
+                _bstr_t bstrCentralAuditor( pEntry->CentralAuditor );
+                _variant_t vtCentralAuditor ( bstrCentralAuditor );
+                StringCbPrintf ( szName, sizeof ( szName ), "%spi_centralauditor", szPrefix );
+                adoStoredProcedure.AddParameter( szName, vtCentralAuditor, ADODB::DataTypeEnum::adBSTR, ADODB::ParameterDirectionEnum::adParamInput, bstrCentralAuditor.length());
+
+                _variant_t vtToHost ( pEntry->ToHost );
+                StringCbPrintf ( szName, sizeof ( szName ), "%spi_tohost", szPrefix );
+                adoStoredProcedure.AddParameter( szName, vtToHost, ADODB::DataTypeEnum::adTinyInt, ADODB::ParameterDirectionEnum::adParamInput, sizeof ( pEntry->ToHost ));
+
+                _variant_t vtRetransmit ( pEntry->Retransmit );
+                StringCbPrintf ( szName, sizeof ( szName ), "%spi_retransmit", szPrefix );
+                adoStoredProcedure.AddParameter( szName, vtRetransmit, ADODB::DataTypeEnum::adTinyInt, ADODB::ParameterDirectionEnum::adParamInput, sizeof ( pEntry->Retransmit ));
+
+                _bstr_t bstrCommand( pEntry->Command );
+                _variant_t vtCommand ( bstrCommand );
+                StringCbPrintf ( szName, sizeof ( szName ), "%spi_command", szPrefix );
+                adoStoredProcedure.AddParameter( szName, vtCommand, ADODB::DataTypeEnum::adBSTR, ADODB::ParameterDirectionEnum::adParamInput, bstrCommand.length());
+
+                variantBlob vtBuffer ( pEntry->Data, pEntry->Length );
+                StringCbPrintf ( szName, sizeof ( szName ), "%spi_transmission_data", szPrefix );
+                adoStoredProcedure.AddParameter( szName, vtBuffer, ADODB::DataTypeEnum::adVarBinary, ADODB::ParameterDirectionEnum::adParamInput, pEntry->Length );
+            }
+            return adoConnection.ExecuteNonQuery ( adoStoredProcedure, false );
+        }
+        catch ( _com_error &comError )
+        {
+            m_EventTrace.Event ( CEventTrace::Information, "CFrameLogWriter::WriteBatch <--> ERROR: %s",
+                CErrorMessage::ReturnComErrorMessage ( comError ));
+        }
+        return false;
+    }
+
+    HANDLE m_hThread;                                                                              // the writer thread
+    HANDLE m_hWake;                                                       // set when a full batch is queued or on Stop
+    volatile bool m_bRunning;                                                           // Log queues frames while true
+    volatile bool m_bStopping;                                                      // the thread exits once it's empty
+    int m_nBatchSize;                                                            // "Frame Log Batch", at most MAXBATCH
+    int m_nOverflowWait;                                                              // "Frame Log Overflow Wait" (ms)
+    SFrameEntry* m_pEntries;                                                    // the queue (FRAMELOGWRITER_QUEUESIZE)
+    volatile LONG m_nEnqueuePos;                                                 // position of the next entry reserved
+    LONG m_nDequeuePos;                                            // position of the oldest entry (writer thread only)
+    volatile LONG m_nPending;                                                        // frames handed over, not written
+    volatile LONG m_nQueued;                                                               // frames queued since Start
+    volatile LONG m_nWritten;                                                             // frames written to database
+    volatile LONG m_nDropped;                                         // frames dropped (queue full or database failed)
+    long m_nBatches;                                                                      // round trips that succeeded
+    long m_nFailedBatches;                                                       // batches dropped after failing twice
+    CEventTrace m_EventTrace;                                                      // records events - see EventTrace.h
+ };
@@ -3,119 +3,153 @@
  *                                                                                                                    *
  * This provides methods which produce ASCII representations of vectors of arbitrary bytes.                           *
  *                                                                                                                    *
- * WARNING: These methods don't look to be threadsafe.                                                                *
+ * Each method writes into a buffer supplied by the caller, so any number of threads can use them at once, and each   *
+ * has a matching length method (or macro, for buffers sized at compile time) giving the buffer size needed for a     *
+ * given number of bytes. If the buffer is smaller, as many whole bytes (or lines) as fit are written. The output is  *
+ * always terminated and the number of chars written before the terminator is returned.                               *
  *                                                                                                                    *
- *                                         Copyright (c) Protel Inc. 2009-2010                                        *
+ * Each byte is turned into its two hex digits by looking them up in a table, so the output takes time in proportion  *
+ * to the number of bytes.                                                                                            *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
  **********************************************************************************************************************/
 #pragma once
 
+#define CHEXDUMP_HEXLENGTH(n)       (( n ) * 3 + 1 )                              // buffer EncodeHex needs for n bytes
+#define CHEXDUMP_ASCIILENGTH(n)     (( n ) + 1 )                                // buffer EncodeAscii needs for n bytes
+#define CHEXDUMP_OUTPUTLENGTH(n)    ((( n ) + 15 ) / 16 * 66 + 1 )             // buffer EncodeOutput needs for n bytes
+
 class CHexDump
  {
 public:
-    static char* Output ( BYTE* pData, int DataLength )
+    static int GetHexLength ( int DataLength )
     {
-        /**************************************************************************************************************
-         * This returns an ASCII representation of DataLength bytes in pData formatted in lines representing 16 bytes *
-         * each, terminated with CRLF and concatenated together. Each line shows each of the 16 bytes (or less on the *
-         * last line) as 2 digit hex, then ASCII for each of the bytes using a dot (.) for nonprintable values.       *
-         **************************************************************************************************************/
+        return CHEXDUMP_HEXLENGTH ( DataLength );
+    }
 
-        static char szReturnBuffer [ 4096 ];                                            // concatenated formatted lines
-        char szDebugBuffer [ 256 ];                                                                   // formatted line
-        char szDebug0 [ 16 ];                                                                      // each value in hex
-        char szDebug1 [ 64 ];                                                    // hex values (e.g. 00 01 41 42 43 ff)
-        char szDebug2 [ 17 ];                                                    // printable chars or .s (e.g. ..ABC.)
+    static int GetAsciiLength ( int DataLength )
+    {
+        return CHEXDUMP_ASCIILENGTH ( DataLength );
+    }
 
-        ZeroMemory ( szReturnBuffer, sizeof ( szReturnBuffer ));
+    static int GetOutputLength ( int DataLength )
+    {
+        return CHEXDUMP_OUTPUTLENGTH ( DataLength );
+    }
 
-        for ( int nLoop = 0; nLoop < DataLength; nLoop += 16 )
+    static int EncodeHex ( const BYTE* pData, int DataLength, char* pszOutput, int nOutputSize )
+    {
+        /**************************************************************************************************************
+         * This places an ASCII representation of DataLength bytes in pData in pszOutput (which holds nOutputSize     *
+         * chars). Each byte is shown as a two digit hex value plus a space.                                          *
+         **************************************************************************************************************/
+        if ( nOutputSize <= 0 )
         {
-            /*
-             * We process up to 16 bytes from pData: these will produce one line in szDebugBuffer.
-             */
-            ZeroMemory ( szDebugBuffer, sizeof ( szDebugBuffer ));
-            ZeroMemory ( szDebug1, sizeof ( szDebug1 ));
-            ZeroMemory ( szDebug2, sizeof ( szDebug2 ));
-            for ( int nLoop2 = 0; nLoop2 < 16; nLoop2++ )
-            {
-                if (( nLoop + nLoop2 ) < DataLength )
-                {
-                    /*
-                     * We haven't passed the end of the data. We append a . to szDebug2, then change it to the ASCII
-                     * character corresponding to the byte if it is printable.
-                     */
-                    szDebug2 [ nLoop2 ] = '.';
-                    if ( isprint ( *( pData + nLoop + nLoop2 )))
-                    {
-                        szDebug2 [ nLoop2 ] = *( pData + nLoop + nLoop2 );
-                    }
-
-                    /*
-                     * We create a 2 byte ASCII hex representation of the byte plus a space and append to szDebug1.
-                     */
-                    StringCchPrintf ( szDebug0, sizeof ( szDebug0 ), "%02x ", *( pData + nLoop + nLoop2 ));
-                    StringCbCat ( szDebug1, sizeof ( szDebug1 ), szDebug0 );
-                }
-            }
-
-            /*
-             * We pad szDebug1 to 48 bytes (it could have been shorter if we passed the end of pData).
-             */
-            size_t nLength = 0;
-            StringCchLength( szDebug1, sizeof ( szDebug1 ), &nLength );
-            while ( nLength < 48 )
-            {
-                *( szDebug1 + nLength ) = ' ';
-                nLength++;
-            }
-
-            /*
-             * We append the ASCII hex and code strings plus an end-of-line to the return buffer.
-             */
-            StringCbCat ( szDebugBuffer, sizeof ( szDebugBuffer ), szDebug1 );
-            StringCbCat ( szDebugBuffer, sizeof ( szDebugBuffer ), szDebug2 );
-            StringCbCat ( szDebugBuffer, sizeof ( szDebugBuffer ), "\r\n" );
-            StringCbCat ( szReturnBuffer, sizeof ( szReturnBuffer ), szDebugBuffer );
+            return 0;
         }
-
-        szReturnBuffer[sizeof szReturnBuffer - 1] = '\0';                                           // added for safety
-        return szReturnBuffer;
+        int nBytes = ( nOutputSize - 1 ) / 3;                                                         // as many as fit
+        if ( nBytes > DataLength )
+        {
+            nBytes = DataLength;
+        }
+        const char* pszPairs = GetHexPairs();
+        char* pszScan = pszOutput;
+        for ( int nLoop = 0; nLoop < nBytes; nLoop++ )
+        {
+            const char* pszPair = pszPairs + pData [ nLoop ] * 2;
+            pszScan [ 0 ] = pszPair [ 0 ];
+            pszScan [ 1 ] = pszPair [ 1 ];
+            pszScan [ 2 ] = ' ';
+            pszScan += 3;
+        }
+        *pszScan = '\0';
+        return ( int ) ( pszScan - pszOutput );
     }
 
-    static char* GetHexString ( BYTE* pData, int DataLength )
+    static int EncodeAscii ( const BYTE* pData, int DataLength, char* pszOutput, int nOutputSize )
     {
         /**************************************************************************************************************
-         * This returns an ASCII representation of DataLength bytes in pData. Each byte is shown as a two digit hex   *
-         * value plus a space.                                                                                        *
+         * This places the DataLength bytes in pData in pszOutput (which holds nOutputSize chars) with non-printable  *
+         * values replaced by a dot (.).                                                                              *
          **************************************************************************************************************/
-        static char szReturnBuffer [ 4096 ];
-        ZeroMemory ( szReturnBuffer, sizeof ( szReturnBuffer ));
-        char szDebugBuffer [ 256 ];
-
-        for ( int nLoop = 0; nLoop < DataLength; nLoop++ )
+        if ( nOutputSize <= 0 )
+        {
+            return 0;
+        }
+        int nBytes = nOutputSize - 1;                                                                 // as many as fit
+        if ( nBytes > DataLength )
         {
-            StringCchPrintf ( szDebugBuffer, sizeof ( szDebugBuffer ), "%02x ", *( pData + nLoop ));
-            StringCbCat ( szReturnBuffer, sizeof ( szReturnBuffer ), szDebugBuffer );
+            nBytes = DataLength;
         }
-        return szReturnBuffer;
+        for ( int nLoop = 0; nLoop < nBytes; nLoop++ )
+        {
+            pszOutput [ nLoop ] = IsPrintable ( pData [ nLoop ] ) ? ( char ) pData [ nLoop ] : '.';
+        }
+        pszOutput [ nBytes ] = '\0';
+        return nBytes;
     }
 
-    static char* GetAsciiString ( BYTE* pData, int DataLength )
+    static int EncodeOutput ( const BYTE* pData, int DataLength, char* pszOutput, int nOutputSize )
     {
         /**************************************************************************************************************
-         * This returns the DataLength bytes in pData with non-printable values replaced by a dot (.).                *
+         * This places an ASCII representation of DataLength bytes in pData in pszOutput (which holds nOutputSize     *
+         * chars) formatted in lines representing 16 bytes each, terminated with CRLF and concatenated together. Each *
+         * line shows each of the 16 bytes (or less on the last line) as 2 digit hex padded to 48 chars, then ASCII   *
+         * for each of the bytes using a dot (.) for nonprintable values.                                             *
          **************************************************************************************************************/
-        static char szReturnBuffer [ 4096 ];
-        ZeroMemory ( szReturnBuffer, sizeof ( szReturnBuffer ));
-        CopyMemory( szReturnBuffer, pData, DataLength );
-
-        for ( int nLoop = 0; nLoop < DataLength; nLoop++ )
+        if ( nOutputSize <= 0 )
+        {
+            return 0;
+        }
+        char* pszScan = pszOutput;
+        for ( int nLoop = 0; nLoop < DataLength; nLoop += 16 )
         {
-            if ( *( szReturnBuffer + nLoop ) < 0x20 || *( szReturnBuffer + nLoop ) > 0x7e )
+            int nBytes = DataLength - nLoop < 16 ? DataLength - nLoop : 16;
+            if ( pszScan + 48 + nBytes + 2 >= pszOutput + nOutputSize )
+            {
+                break;                                                                              // only whole lines
+            }
+            char* pszLine = pszScan;
+            pszScan += EncodeHex ( pData + nLoop, nBytes, pszScan, 48 + 1 );
+            while ( pszScan < pszLine + 48 )
             {
-                *( szReturnBuffer + nLoop ) = '.';
+                *pszScan++ = ' ';                                                              // pad a short last line
             }
+            pszScan += EncodeAscii ( pData + nLoop, nBytes, pszScan, nBytes + 1 );
+            *pszScan++ = '\r';
+            *pszScan++ = '\n';
         }
-        return szReturnBuffer;
+        *pszScan = '\0';
+        return ( int ) ( pszScan - pszOutput );
+    }
+
+private:
+    static bool IsPrintable ( BYTE Value )
+    {
+        return Value >= 0x20 && Value <= 0x7e;
+    }
+
+    static const char* GetHexPairs ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the two hex digits of every byte value, in order.                                             *
+         **************************************************************************************************************/
+        return
+            "000102030405060708090a0b0c0d0e0f"
+            "101112131415161718191a1b1c1d1e1f"
+            "202122232425262728292a2b2c2d2e2f"
+            "303132333435363738393a3b3c3d3e3f"
+            "404142434445464748494a4b4c4d4e4f"
+            "505152535455565758595a5b5c5d5e5f"
+            "606162636465666768696a6b6c6d6e6f"
+            "707172737475767778797a7b7c7d7e7f"
+            "808182838485868788898a8b8c8d8e8f"
+            "909192939495969798999a9b9c9d9e9f"
+            "a0a1a2a3a4a5a6a7a8a9aaabacadaeaf"
+            "b0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+            "c0c1c2c3c4c5c6c7c8c9cacbcccdcecf"
+            "d0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+            "e0e1e2e3e4e5e6e7e8e9eaebecedeeef"
+            "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
     }
  };
@@ -0,0 +1,382 @@
+/**********************************************************************************************************************
+ *                           This file contains the CDownloadImage and CImageCache classes.                           *
+ *                                                                                                                    *
+ * When a device needs new firmware or a new configuration, CProtelDevice::GetFirmwareOrConfiguration gets the image  *
+ * from the database (up to 256KB) and used to copy it into a buffer of its own and sum its bytes. During a rollout   *
+ * the same image goes to thousands of devices, so many identical copies were made, summed and held at once.          *
+ * Instead, each image is handed to the single CImageCache, which returns a CDownloadImage holding it: a reference-   *
+ * counted buffer, never changed once made, with its length and checksum (see Checksum.h). If an identical image of   *
+ * the same kind is already held, that one is returned (and its reference count increased) rather than a new copy.    *
+ *                                                                                                                    *
+ * Images are found by their content: a 64 bit FNV-1a hash of their bytes, with the length, picks out the likely      *
+ * match and the bytes themselves are compared to make sure. The cache holds up to "Image Cache Kilobytes" of images  *
+ * and, once it is full, lets go of those used least recently. An image still being downloaded to a device isn't      *
+ * freed until the device releases it. The numbers of images found (hits), not found (misses) and let go are recorded *
+ * when the cache is stopped. With "Image Cache Kilobytes" set to 0, each image is copied as before.                  *
+ *                                                                                                                    *
+ * Note that the database still returns the whole image each time it is needed; the cache saves the memory and the    *
+ * work of holding it, not the transfer.                                                                              *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+#include "Checksum.h"
+#include "EventTrace.h"
+#include "ProfileValues.h"
+
+class CDownloadImage
+ {
+public:
+    void AddRef ( void )
+    {
+        InterlockedIncrement ( &m_nRefs );
+    }
+
+    void Release ( void )
+    {
+        /**************************************************************************************************************
+         * This drops a reference, deleting the image once neither the cache nor any device holds it.                 *
+         **************************************************************************************************************/
+        if ( InterlockedDecrement ( &m_nRefs ) == 0 )
+        {
+            delete this;
+        }
+    }
+
+    BYTE* GetData ( void )                                                           // the image - must not be changed
+    {
+        return m_pbData;
+    }
+    __declspec(property(get = GetData)) BYTE* Data;
+
+    long GetLength ( void )
+    {
+        return m_nLength;
+    }
+    __declspec(property(get = GetLength)) long Length;
+
+    __int64 GetChecksum ( void )                                                                // sum of all its bytes
+    {
+        return m_nChecksum;
+    }
+    __declspec(property(get = GetChecksum)) __int64 Checksum;
+
+private:
+    friend class CImageCache;
+
+    CDownloadImage( int Kind, unsigned __int64 Hash, BYTE* pHeader, long HeaderLength, BYTE* pData, long DataLength ) :
+        m_nRefs ( 1 ),
+        m_nKind ( Kind ),
+        m_nHash ( Hash ),
+        m_nLength ( HeaderLength + DataLength ),
+        m_pNewer ( NULL ),
+        m_pOlder ( NULL )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR. This copies the image (HeaderLength bytes in pHeader followed by DataLength in pData) and     *
+         * sums its bytes. The caller holds the first reference to it.                                                *
+         **************************************************************************************************************/
+        m_pbData = new BYTE [ m_nLength > 0 ? m_nLength : 1 ];
+        if ( HeaderLength > 0 )
+        {
+            CopyMemory ( m_pbData, pHeader, HeaderLength );
+        }
+        CopyMemory ( m_pbData + HeaderLength, pData, DataLength );
+        m_nChecksum = CChecksum::Sum ( m_pbData, m_nLength );
+    }
+
+    virtual ~CDownloadImage(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+        delete [] m_pbData;
+    }
+
+    volatile LONG m_nRefs;                                                       // the cache plus each device using it
+    int m_nKind;                                                 // CImageCache::Firmware or CImageCache::Configuration
+    unsigned __int64 m_nHash;                                                                // FNV-1a hash of m_pbData
+    BYTE* m_pbData;
+    long m_nLength;
+    __int64 m_nChecksum;
+    CDownloadImage* m_pNewer;                                             // more recently used image held by the cache
+    CDownloadImage* m_pOlder;                                             // less recently used image held by the cache
+ };
+
+class CImageCache
+ {
+public:
+    enum ImageKind
+    {
+        Firmware,
+        Configuration,                                                             // includes its 2 byte length prefix
+    };
+
+    static CImageCache& Instance ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the single cache shared by every connection. CApplication::Start calls it (to Start the       *
+         * cache) before any connection threads are started, so it is constructed then.                               *
+         **************************************************************************************************************/
+        static CImageCache imageCache;
+        return imageCache;
+    }
+
+    void Start ( void )
+    {
+        /**************************************************************************************************************
+         * This reads "Image Cache Kilobytes". Until it is used, or if the setting is 0, images aren't held.          *
+         **************************************************************************************************************/
+        CProfileValues profileValues;
+        int nKilobytes = profileValues.GetImageCacheKilobytes();
+        if ( nKilobytes < 0 )
+        {
+            nKilobytes = 0;
+        }
+        if ( nKilobytes > 1024 * 1024 )
+        {
+            nKilobytes = 1024 * 1024;                                                                   // 1 GB at most
+        }
+        EnterCriticalSection ( &m_criticalSection );
+        m_nBudget = nKilobytes * 1024;
+        LeaveCriticalSection ( &m_criticalSection );
+    }
+
+    CDownloadImage* Intern ( ImageKind Kind, BYTE* pHeader, long HeaderLength, BYTE* pData, long DataLength )
+    {
+        /**************************************************************************************************************
+         * This returns an image of Kind made of HeaderLength bytes in pHeader followed by DataLength bytes in pData  *
+         * (pHeader may be NULL if HeaderLength is 0). The image held by the cache is returned if there is one,       *
+         * otherwise a new one is made (and held unless the cache is off). The caller must Release it when done.      *
+         **************************************************************************************************************/
+        unsigned __int64 nHash = 14695981039346656037ui64;                                       // FNV-1a offset basis
+        nHash = Hash ( nHash, pHeader, HeaderLength );
+        nHash = Hash ( nHash, pData, DataLength );
+        long nLength = HeaderLength + DataLength;
+
+        EnterCriticalSection ( &m_criticalSection );
+        CDownloadImage* pFound = Find ( Kind, nHash, pHeader, HeaderLength, pData, DataLength );
+        LeaveCriticalSection ( &m_criticalSection );
+        if ( pFound != NULL )
+        {
+            return pFound;
+        }
+
+        /*
+         * We make the image without holding the critical section (copying and summing it takes a while). Another
+         * connection may have added the same image meanwhile, in which case we use that one instead.
+         */
+        CDownloadImage* pImage = new CDownloadImage ( Kind, nHash, pHeader, HeaderLength, pData, DataLength );
+        EnterCriticalSection ( &m_criticalSection );
+        if ( nLength > m_nBudget )
+        {
+            m_nMisses++;
+            LeaveCriticalSection ( &m_criticalSection );
+            return pImage;                                                   // the cache is off or the image too large
+        }
+        pFound = Find ( Kind, nHash, pHeader, HeaderLength, pData, DataLength );
+        if ( pFound != NULL )
+        {
+            LeaveCriticalSection ( &m_criticalSection );
+            pImage->Release();
+            return pFound;
+        }
+        m_nMisses++;
+        pImage->AddRef();                                                                          // held by the cache
+        Link ( pImage );
+        m_nImages++;
+        m_nBytes += nLength;
+        while ( m_nBytes > m_nBudget && m_pOldest != pImage )
+        {
+            CDownloadImage* pOldest = m_pOldest;
+            Unlink ( pOldest );
+            m_nImages--;
+            m_nBytes -= pOldest->m_nLength;
+            m_nEvictions++;
+            pOldest->Release();                                              // freed now unless a device still uses it
+        }
+        LeaveCriticalSection ( &m_criticalSection );
+        return pImage;
+    }
+
+    void Stop ( void )
+    {
+        /**************************************************************************************************************
+         * This is used once the connections have shut down. It lets go of every image held (and holds no more) and   *
+         * records the totals as an event.                                                                            *
+         **************************************************************************************************************/
+        EnterCriticalSection ( &m_criticalSection );
+        while ( m_pOldest != NULL )
+        {
+            CDownloadImage* pOldest = m_pOldest;
+            Unlink ( pOldest );
+            pOldest->Release();
+        }
+        m_nImages = 0;
+        m_nBytes = 0;
+        long nBudget = m_nBudget;
+        m_nBudget = 0;                                                                          // nothing more is held
+        LeaveCriticalSection ( &m_criticalSection );
+
+        m_EventTrace.Event ( CEventTrace::Information,
+            "CImageCache::Stop - %ld images found in the cache, %ld not found, %ld let go to stay within %ld KB",
+            m_nHits, m_nMisses, m_nEvictions, nBudget / 1024 );
+    }
+
+    long GetHits ( void )
+    {
+        return m_nHits;
+    }
+    __declspec(property(get = GetHits)) long Hits;
+
+    long GetMisses ( void )
+    {
+        return m_nMisses;
+    }
+    __declspec(property(get = GetMisses)) long Misses;
+
+    long GetEvictions ( void )
+    {
+        return m_nEvictions;
+    }
+    __declspec(property(get = GetEvictions)) long Evictions;
+
+    long GetImages ( void )
+    {
+        return m_nImages;
+    }
+    __declspec(property(get = GetImages)) long Images;
+
+    long GetBytes ( void )
+    {
+        return m_nBytes;
+    }
+    __declspec(property(get = GetBytes)) long Bytes;
+
+private:
+    CImageCache(void) :
+        m_pNewest ( NULL ),
+        m_pOldest ( NULL ),
+        m_nBudget ( 0 ),
+        m_nImages ( 0 ),
+        m_nBytes ( 0 ),
+        m_nHits ( 0 ),
+        m_nMisses ( 0 ),
+        m_nEvictions ( 0 )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+        InitializeCriticalSection ( &m_criticalSection );
+    }
+
+    virtual ~CImageCache(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+        EnterCriticalSection ( &m_criticalSection );
+        while ( m_pOldest != NULL )
+        {
+            CDownloadImage* pOldest = m_pOldest;
+            Unlink ( pOldest );
+            pOldest->Release();
+        }
+        LeaveCriticalSection ( &m_criticalSection );
+        DeleteCriticalSection ( &m_criticalSection );
+    }
+
+    static unsigned __int64 Hash ( unsigned __int64 Hash, BYTE* pData, long DataLength )
+    {
+        /**************************************************************************************************************
+         * This adds DataLength bytes in pData to a 64 bit FNV-1a hash.                                               *
+         **************************************************************************************************************/
+        for ( long nLoop = 0; nLoop < DataLength; nLoop++ )
+        {
+            Hash ^= pData [ nLoop ];
+            Hash *= 1099511628211ui64;                                                                  // FNV-1a prime
+        }
+        return Hash;
+    }
+
+    CDownloadImage* Find ( int Kind, unsigned __int64 Hash, BYTE* pHeader, long HeaderLength, BYTE* pData,
+        long DataLength )
+    {
+        /**************************************************************************************************************
+         * This returns the image held that is identical to the one described (see Intern), with a reference added    *
+         * for the caller and made the most recently used, or NULL if there isn't one. The critical section must be   *
+         * held.                                                                                                      *
+         **************************************************************************************************************/
+        for ( CDownloadImage* pImage = m_pNewest; pImage != NULL; pImage = pImage->m_pOlder )
+        {
+            if ( pImage->m_nKind == Kind && pImage->m_nHash == Hash &&
+                pImage->m_nLength == HeaderLength + DataLength &&
+                ( HeaderLength == 0 || memcmp ( pImage->m_pbData, pHeader, HeaderLength ) == 0 ) &&
+                memcmp ( pImage->m_pbData + HeaderLength, pData, DataLength ) == 0 )
+            {
+                Unlink ( pImage );
+                Link ( pImage );                                                                      // now the newest
+                pImage->AddRef();
+                m_nHits++;
+                return pImage;
+            }
+        }
+        return NULL;
+    }
+
+    void Link ( CDownloadImage* pImage )
+    {
+        /**************************************************************************************************************
+         * This makes pImage the most recently used image. The critical section must be held.                         *
+         **************************************************************************************************************/
+        pImage->m_pNewer = NULL;
+        pImage->m_pOlder = m_pNewest;
+        if ( m_pNewest != NULL )
+        {
+            m_pNewest->m_pNewer = pImage;
+        }
+        m_pNewest = pImage;
+        if ( m_pOldest == NULL )
+        {
+            m_pOldest = pImage;
+        }
+    }
+
+    void Unlink ( CDownloadImage* pImage )
+    {
+        /**************************************************************************************************************
+         * This takes pImage out of the list of images held. The critical section must be held.                       *
+         **************************************************************************************************************/
+        if ( pImage->m_pNewer != NULL )
+        {
+            pImage->m_pNewer->m_pOlder = pImage->m_pOlder;
+        }
+        else
+        {
+            m_pNewest = pImage->m_pOlder;
+        }
+        if ( pImage->m_pOlder != NULL )
+        {
+            pImage->m_pOlder->m_pNewer = pImage->m_pNewer;
+        }
+        else
+        {
+            m_pOldest = pImage->m_pNewer;
+        }
+        pImage->m_pNewer = NULL;
+        pImage->m_pOlder = NULL;
+    }
+
+    CRITICAL_SECTION m_criticalSection;                                             // protects the list and its totals
+    CDownloadImage* m_pNewest;                                                         // most recently used image held
+    CDownloadImage* m_pOldest;                                                        // least recently used image held
+    long m_nBudget;                                                                 // "Image Cache Kilobytes" in bytes
+    long m_nImages;                                                                                      // images held
+    long m_nBytes;                                                                       // total length of images held
+    long m_nHits;                                                                          // images found in the cache
+    long m_nMisses;                                                                          // images made (not found)
+    long m_nEvictions;                                                        // images let go to stay within m_nBudget
+    CEventTrace m_EventTrace;                                                      // records events - see EventTrace.h
+ };
@@ -0,0 +1,547 @@
+/**********************************************************************************************************************
+ *                                     This file contains the CManualPolls class.                                     *
+ *                                                                                                                    *
+ * CApplication's polling thread uses this to claim manual polls from PKG_COMM_SERVER.getManualPoll for its           *
+ * CDialScheduler (see DialScheduler.h), and to hand back those it can't dial. getManualPoll returns one poll per     *
+ * call without waiting, so a morning backlog of thousands of polls used to take one round trip per poll placed.      *
+ *                                                                                                                    *
+ * Claim now makes up to "Batch" calls (in the [manualpoll] section of the .INI file) in one round trip, by executing *
+ * an anonymous PL/SQL block which calls getManualPoll in turn until the queue is empty (ORA-25228, which the block   *
+ * catches; any other error fails the block). The parameters returned by each call are told apart by a prefix, as in  *
+ * CDevicePlan::Execute. If the block fails, or "Batch" is 0 or 1, one poll is claimed with a call of its own. No     *
+ * more polls are claimed than there are free modems, and the polling thread only claims more once none is left       *
+ * waiting, so a claimed poll is normally dialed at once.                                                             *
+ *                                                                                                                    *
+ * Each claimed poll holds a lease of "Lease Seconds". One which no modem has dialed when its lease runs out is       *
+ * handed back by Expire, and those still waiting when the system stops are handed back by Release. Handing a poll    *
+ * back returns it to the database's queue (PKG_COMM_SERVER.requeueManualPoll), so the next claim - by this server or *
+ * another - gets it again. Only if that fails is its call finished as unsuccessful (PKG_COMM_SERVER.FINISH with      *
+ * pi_success 0), as used to be done with every poll no modem could take, so it isn't left open. So that polls held   *
+ * when the server crashes are handed back too, Journal rewrites a .POLLS file beside the log file (written through   *
+ * to disk) whenever the polls held change, and Recover hands back any it lists when the polling thread next starts.  *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+#include "AdoConnectionPool.h"
+#include "AdoStoredProcedure.h"
+#include "DialScheduler.h"
+#include "ErrorMessage.h"
+#include "EventTrace.h"
+#include "ProfileValues.h"
+
+#define MANUALPOLLS_MAXBATCH        64                                                  // polls claimed per round trip
+#define MANUALPOLLS_LINESIZE        160                                                    // most a journal line holds
+
+class CManualPolls
+ {
+public:
+    CManualPolls(void)
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+        CProfileValues profileValues;
+        StringCbCopy ( m_szJournal, sizeof ( m_szJournal ), profileValues.GetLogFile());
+        PathRemoveExtension ( m_szJournal );
+        PathAddExtension ( m_szJournal, ".POLLS" );
+        m_dwJournalled = 0;
+        m_nJournalled = 0;
+    }
+
+    virtual ~CManualPolls(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+    }
+
+    int Claim ( CDialScheduler& scheduler, int Free )
+    {
+        /**************************************************************************************************************
+         * This claims up to "Batch" polls (fewer if only Free modems are free or the scheduler has less room) in one *
+         * round trip and queues them in scheduler, each leased for "Lease Seconds". It returns the number queued, 0  *
+         * if there were none.                                                                                        *
+         **************************************************************************************************************/
+        CProfileValues profileValues;
+        int nBatch = profileValues.GetManualPollBatch();
+        if ( nBatch > MANUALPOLLS_MAXBATCH )
+        {
+            nBatch = MANUALPOLLS_MAXBATCH;
+        }
+        if ( nBatch > Free )
+        {
+            nBatch = Free;                                                            // no more than can be dialed now
+        }
+        if ( nBatch > DIALSCHEDULER_MAXPOLLS - scheduler.GetBacklog())
+        {
+            nBatch = DIALSCHEDULER_MAXPOLLS - scheduler.GetBacklog();
+        }
+        if ( nBatch < 1 )
+        {
+            nBatch = 1;
+        }
+
+        SManualPoll polls [ MANUALPOLLS_MAXBATCH ];
+        DWORD dwStarted = GetTickCount();
+        int nClaimed = -1;
+        if ( nBatch > 1 )
+        {
+            nClaimed = ClaimBatch ( polls, nBatch );
+        }
+        if ( nClaimed < 0 )                                                              // one at a time, or it failed
+        {
+            nClaimed = ClaimOne ( polls [ 0 ] ) == true ? 1 : 0;
+        }
+        if ( nClaimed > 1 )
+        {
+            m_EventTrace.Event ( CEventTrace::Details, "CManualPolls::Claim - %d polls in one round trip (%lu ms)",
+                nClaimed, GetTickCount() - dwStarted );
+        }
+
+        DWORD dwLeaseExpires = GetTickCount() + ( DWORD ) profileValues.GetManualPollLeaseSeconds() * 1000;
+        int nQueued = 0;
+        for ( int nPoll = 0; nPoll < nClaimed; nPoll++ )
+        {
+            polls [ nPoll ].Priority = CDialScheduler::NormalPriority;
+            polls [ nPoll ].dwLeaseExpires = dwLeaseExpires;
+            if ( scheduler.Enqueue ( polls [ nPoll ] ) == true )
+            {
+                nQueued++;
+            }
+            else
+            {
+                HandBack ( polls [ nPoll ], "No available modems for outbound dial" );
+            }
+        }
+        return nQueued;
+    }
+
+    void Expire ( CDialScheduler& scheduler )
+    {
+        /**************************************************************************************************************
+         * This hands back every poll in scheduler whose lease has run out.                                           *
+         **************************************************************************************************************/
+        SManualPoll poll;
+        while ( scheduler.TakeExpired ( poll ) == true )
+        {
+            m_EventTrace.Event ( CEventTrace::Information, "CManualPolls::Expire - call %ld not dialed in time",
+                poll.CallNumber );
+            HandBack ( poll, "Lease expired before a modem was available" );
+        }
+    }
+
+    void Release ( CDialScheduler& scheduler )
+    {
+        /**************************************************************************************************************
+         * This hands back every poll in scheduler, as the system is shutting down, then removes the journal.         *
+         **************************************************************************************************************/
+        SManualPoll poll;
+        while ( scheduler.Dequeue ( poll ) == true )
+        {
+            HandBack ( poll, "Comm server stopped before dialing" );
+        }
+        Journal ( scheduler );
+    }
+
+    void Journal ( CDialScheduler& scheduler )
+    {
+        /**************************************************************************************************************
+         * If the polls waiting in scheduler have changed since the last call, this rewrites the journal to list them *
+         * (or deletes it if none is waiting). Each line holds a poll's call number, call start time and central      *
+         * auditor - what HandBack needs.                                                                             *
+         **************************************************************************************************************/
+        if ( scheduler.GetChanges() == m_dwJournalled )
+        {
+            return;
+        }
+        m_dwJournalled = scheduler.GetChanges();
+        m_nJournalled = scheduler.GetBacklog();
+        if ( m_nJournalled == 0 )
+        {
+            DeleteFile ( m_szJournal );
+            return;
+        }
+
+        STRSAFE_LPSTR pszEnd = m_szLines;
+        size_t nRemaining = sizeof ( m_szLines );
+        for ( int nPoll = 0; nPoll < m_nJournalled; nPoll++ )
+        {
+            const SManualPoll& poll = scheduler.GetQueued ( nPoll );
+            StringCchPrintfEx ( pszEnd, nRemaining, &pszEnd, &nRemaining, STRSAFE_IGNORE_NULLS, "%ld\t%.10f\t%s\r\n",
+                poll.CallNumber, poll.callStartTime, poll.szCentralAuditor );
+        }
+        HANDLE hFile = CreateFile (
+            m_szJournal,                                                     // lpFileName [in] - name of file to write
+            GENERIC_WRITE,                                                              // dwDesiredAccess [in] - write
+            0,                                                               // dwShareMode [in] - 0 = cannot be shared
+            NULL,                                             // lpSecurityAttributes [in] - NULL = cannot be inherited
+            CREATE_ALWAYS,                                  // dwCreationDisposition [in] - overwrite any existing file
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_WRITE_THROUGH,    // dwFlagsAndAttributes [in] - on disk before returning
+            NULL );                                                // hTemplateFile [in] - sets attributes, NULL = none
+        if ( hFile == INVALID_HANDLE_VALUE )
+        {
+            m_EventTrace.Event ( CEventTrace::Warning, "CManualPolls::Journal - can't write %s (error %lu)",
+                m_szJournal, GetLastError());
+            return;
+        }
+        DWORD dwWritten = 0;
+        WriteFile ( hFile, m_szLines, ( DWORD )( pszEnd - m_szLines ), &dwWritten, NULL );
+        CloseHandle ( hFile );
+    }
+
+    void Recover ( void )
+    {
+        /**************************************************************************************************************
+         * This hands back every poll listed in the journal, which were held undialed when the server last stopped    *
+         * without releasing them, then deletes it. It is called by the polling thread before it claims any polls.    *
+         **************************************************************************************************************/
+        HANDLE hFile = CreateFile ( m_szJournal, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+        if ( hFile == INVALID_HANDLE_VALUE )
+        {
+            return;                                                                            // none held - the usual
+        }
+        DWORD dwRead = 0;
+        ReadFile ( hFile, m_szLines, sizeof ( m_szLines ) - 1, &dwRead, NULL );
+        CloseHandle ( hFile );
+        m_szLines [ dwRead ] = '\0';
+
+        int nRecovered = 0;
+        char* pszLine = m_szLines;
+        while ( *pszLine != '\0' )
+        {
+            char* pszNext = pszLine;
+            while ( *pszNext != '\0' && *pszNext != '\n' )
+            {
+                pszNext++;
+            }
+            if ( *pszNext == '\n' )
+            {
+                *pszNext++ = '\0';
+            }
+
+            SManualPoll poll;
+            ZeroMemory ( &poll, sizeof ( poll ));
+            char* pszField = pszLine;
+            poll.CallNumber = strtol ( pszField, &pszField, 10 );
+            if ( *pszField == '\t' )
+            {
+                poll.callStartTime = strtod ( pszField + 1, &pszField );
+            }
+            if ( *pszField == '\t' )
+            {
+                StringCbCopy ( poll.szCentralAuditor, sizeof ( poll.szCentralAuditor ), pszField + 1 );
+                StrTrim ( poll.szCentralAuditor, "\r" );
+            }
+            if ( poll.CallNumber != 0 )
+            {
+                HandBack ( poll, "Comm server restarted before dialing" );
+                nRecovered++;
+            }
+            pszLine = pszNext;
+        }
+        DeleteFile ( m_szJournal );
+        m_EventTrace.Event ( CEventTrace::Warning, "CManualPolls::Recover - %d polls held when the server stopped"
+            " handed back", nRecovered );
+    }
+
+    void HandBack ( SManualPoll& poll, const char* pszMessage )
+    {
+        /**************************************************************************************************************
+         * This hands poll back without it being dialed: it is returned to the database's queue, or, if that fails,   *
+         * its call is finished as unsuccessful with pszMessage.                                                      *
+         **************************************************************************************************************/
+        if ( Requeue ( poll, pszMessage ) == false )
+        {
+            Finish ( poll, pszMessage );
+        }
+    }
+
+private:
+    bool Requeue ( SManualPoll& poll, const char* pszMessage )
+    {
+        /**************************************************************************************************************
+         * This returns poll to the manual poll queue with PKG_COMM_SERVER.requeueManualPoll, which puts the message  *
+         * getManualPoll dequeued back and leaves its call open, so it is claimed again. It returns false if that     *
+         * fails.                                                                                                     *
+         **************************************************************************************************************/
+        _variant_t vtCallNumber ( poll.CallNumber, VT_I4 );
+        CAdoConnectionLease adoConnection;                                          // borrowed from CAdoConnectionPool
+        if ( adoConnection.Connection == NULL )
+        {
+            return false;
+        }
+        try
+        {
+            CAdoStoredProcedure adoStoredProcedure ( "PKG_COMM_SERVER.requeueManualPoll" );
+            //procedure requeueManualPoll (
+            //    pi_callnumber in integer
+            //    , pi_errormsg in varchar2 default null
+            //);
+            adoStoredProcedure.AddParameter( "pi_callnumber", vtCallNumber, ADODB::DataTypeEnum::adInteger, ADODB::ParameterDirectionEnum::adParamInput, sizeof ( long ));
+
+            _bstr_t bstrMessage( pszMessage );
+            _variant_t vtMessage ( bstrMessage );
+            adoStoredProcedure.AddParameter( "pi_errormsg", vtMessage, ADODB::DataTypeEnum::adBSTR, ADODB::ParameterDirectionEnum::adParamInput, bstrMessage.length());
+            if ( adoConnection->ExecuteNonQuery( adoStoredProcedure, false ) == true )
+            {
+                return true;
+            }
+        }
+        catch ( _com_error &comError )
+        {
+            m_EventTrace.Event ( CEventTrace::Information, "CManualPolls::Requeue <--> ERROR: %s",
+                CErrorMessage::ReturnComErrorMessage ( comError ));
+        }
+        m_EventTrace.Event ( CEventTrace::Warning, "CManualPolls::Requeue - call %ld not requeued, finishing it",
+            poll.CallNumber );
+        return false;
+    }
+
+    void Finish ( SManualPoll& poll, const char* pszMessage )
+    {
+        /**************************************************************************************************************
+         * This finishes poll's call as unsuccessful with pszMessage, without it being dialed.                        *
+         **************************************************************************************************************/
+        _variant_t vtCallNumber ( poll.CallNumber, VT_I4 );
+        _bstr_t bstrCentralAuditor ( poll.szCentralAuditor );
+        _variant_t vtCentralAuditor ( bstrCentralAuditor );
+        _variant_t vtCallStartTime ( poll.callStartTime, VT_DATE );
+
+        CAdoConnectionLease adoConnection;                                          // borrowed from CAdoConnectionPool
+        if ( adoConnection.Connection == NULL )
+        {
+            m_EventTrace.Event ( CEventTrace::Warning, "CManualPolls::Finish - no connection for call %ld",
+                poll.CallNumber );
+            return;
+        }
+        try
+        {
+            CAdoStoredProcedure adoStoredProcedure ( "PKG_COMM_SERVER.FINISH" );
+            //procedure finish (
+            //    pi_callnumber in integer
+            //    , pi_centralAuditor in varchar2 default null
+            //    , pi_callstarttime in timestamp default null
+            //    , pi_callstoptime in timestamp
+            //    , pi_success in integer
+            //    , pi_errormsg in varchar2 default null
+            //);
+            adoStoredProcedure.AddParameter( "po_call_number", vtCallNumber, ADODB::DataTypeEnum::adInteger, ADODB::ParameterDirectionEnum::adParamInput, sizeof ( long ));
+            adoStoredProcedure.AddParameter( "pi_centralAuditor", vtCentralAuditor, ADODB::DataTypeEnum::adBSTR, ADODB::ParameterDirectionEnum::adParamInput, bstrCentralAuditor.length());
+            adoStoredProcedure.AddParameter( "pi_callstarttime", vtCallStartTime, ADODB::DataTypeEnum::adDBTimeStamp, ADODB::ParameterDirectionEnum::adParamInput, sizeof ( double ));
+            adoStoredProcedure.AddParameter( "pi_callstoptime", vtCallStartTime, ADODB::DataTypeEnum::adDBTimeStamp, ADODB::ParameterDirectionEnum::adParamInput, sizeof ( double ));
+
+            _variant_t vtSuccess (( short ) 0, VT_I2 );
+            adoStoredProcedure.AddParameter( "pi_success", vtSuccess, ADODB::DataTypeEnum::adInteger, ADODB::ParameterDirectionEnum::adParamInput, sizeof ( short ));
+
+            _bstr_t bstrMessage( pszMessage );
+            _variant_t vtMessage ( bstrMessage );
+            adoStoredProcedure.AddParameter( "pi_errormsg", vtMessage, ADODB::DataTypeEnum::adBSTR, ADODB::ParameterDirectionEnum::adParamInput, bstrMessage.length());
+            adoConnection->ExecuteNonQuery( adoStoredProcedure, false );
+        }
+        catch ( _com_error &comError )
+        {
+            m_EventTrace.Event ( CEventTrace::Information, "CManualPolls::Finish <--> ERROR: %s",
+                CErrorMessage::ReturnComErrorMessage ( comError ));
+        }
+    }
+
+    bool ClaimOne ( SManualPoll& poll )
+    {
+        /**************************************************************************************************************
+         * This claims one poll into poll with a call of its own. It returns false if there was none.                 *
+         **************************************************************************************************************/
+        //procedure getManualPoll (
+        //   po_call_number out integer,
+        //   pi_modems    in     smallint,
+        //   pi_sockets   in     smallint,
+        //   po_auditor      out varchar2,
+        //   po_call_start_time   in     timestamp default null,
+        //   po_central_auditor in varchar2  default null,
+        //   po_phone_nr out varchar2
+        //   , pi_call_type integer default 1 --Land line
+        //   , pi_wait  in integer default dbms_aq.no_wait
+        //    );
+        CAdoConnectionLease adoConnection;                                          // borrowed from CAdoConnectionPool
+        if ( adoConnection.Connection == NULL )
+        {
+            return false;
+        }
+        try
+        {
+            CAdoStoredProcedure adoStoredProcedure ( "PKG_COMM_SERVER.getManualPoll" );
+
+            _variant_t vtCallNumber (( long ) 0, VT_I4 );
+            adoStoredProcedure.AddParameter( "po_call_number", vtCallNumber, ADODB::DataTypeEnum::adInteger, ADODB::ParameterDirectionEnum::adParamOutput, sizeof ( long ));
+
+            _variant_t vtModems (( short ) 1, VT_I2 );
+            adoStoredProcedure.AddParameter("pi_modems", vtModems, ADODB::adInteger, ADODB::adParamInput, sizeof ( short ));
+
+            _variant_t vtSockets (( short ) 0, VT_I2 );
+            adoStoredProcedure.AddParameter("pi_sockets", vtSockets, ADODB::adInteger, ADODB::adParamInput, sizeof ( short ));
+
+            AddPollParameters ( adoStoredProcedure, "" );
+
+            _variant_t vtCallType (( short ) 1, VT_I2 );
+            adoStoredProcedure.AddParameter("pi_call_type", vtCallType, ADODB::adInteger, ADODB::adParamInput, sizeof ( short ));
+
+            if ( adoConnection->ExecuteNonQuery( adoStoredProcedure, false ) == false )
+            {
+                return false;                                                               // no_wait - nothing queued
+            }
+            return TakePoll ( adoStoredProcedure, "", poll );
+        }
+        catch ( _com_error &comError )
+        {
+            m_EventTrace.Event ( CEventTrace::Information, "CManualPolls::ClaimOne <--> ERROR: %s",
+                CErrorMessage::ReturnComErrorMessage ( comError ));
+        }
+        return false;
+    }
+
+    int ClaimBatch ( SManualPoll* pPolls, int Count )
+    {
+        /**************************************************************************************************************
+         * This claims up to Count polls into pPolls in one round trip, by executing an anonymous PL/SQL block that   *
+         * calls getManualPoll up to Count times, stopping at the first call which returns no poll or raises          *
+         * ORA-25228 (nothing queued - getManualPoll doesn't wait). Any other error fails the whole block, so it is   *
+         * reported by the usual error path rather than taken for an empty queue. It returns the number claimed, or   *
+         * -1 if the block failed.                                                                                    *
+         **************************************************************************************************************/
+        char szBlock [ 128 + MANUALPOLLS_MAXBATCH * 192 ];
+        StringCbCopy ( szBlock, sizeof ( szBlock ), "DECLARE\nn INTEGER;\ne BOOLEAN := FALSE;\n"
+            "e_empty EXCEPTION;\nPRAGMA EXCEPTION_INIT ( e_empty, -25228 );\nBEGIN\n" );
+        for ( int nLoop = 0; nLoop < Count; nLoop++ )
+        {
+            StringCbCat ( szBlock, sizeof ( szBlock ), "n := 0;\nIF NOT e THEN\n"
+                "BEGIN PKG_COMM_SERVER.getManualPoll ( n, 1, 0, ?, ?, ?, ?, 1 );"
+                " EXCEPTION WHEN e_empty THEN n := 0; END;\n"
+                "e := NVL ( n, 0 ) = 0;\nEND IF;\n? := NVL ( n, 0 );\n" );
+        }
+        StringCbCat ( szBlock, sizeof ( szBlock ), "END;" );
+
+        CAdoConnectionLease adoConnection;                                          // borrowed from CAdoConnectionPool
+        if ( adoConnection.Connection == NULL )
+        {
+            return -1;
+        }
+        try
+        {
+            char szPrefix [ 16 ];
+            char szName [ 64 ];
+            CAdoStoredProcedure adoStoredProcedure ( szBlock, ADODB::CommandTypeEnum::adCmdText );
+            for ( int nLoop = 0; nLoop < Count; nLoop++ )
+            {
+                StringCbPrintf ( szPrefix, sizeof ( szPrefix ), "p%d_", nLoop );
+                AddPollParameters ( adoStoredProcedure, szPrefix );
+
+                StringCbPrintf ( szName, sizeof ( szName ), "%spo_call_number", szPrefix );
+                _variant_t vtCallNumber (( long ) 0, VT_I4 );
+                adoStoredProcedure.AddParameter( szName, vtCallNumber, ADODB::DataTypeEnum::adInteger, ADODB::ParameterDirectionEnum::adParamOutput, sizeof ( long ));
+            }
+            if ( adoConnection->ExecuteNonQuery( adoStoredProcedure, false ) == false )
+            {
+                return -1;
+            }
+            int nClaimed = 0;
+            for ( int nLoop = 0; nLoop < Count; nLoop++ )
+            {
+                StringCbPrintf ( szPrefix, sizeof ( szPrefix ), "p%d_", nLoop );
+                if ( TakePoll ( adoStoredProcedure, szPrefix, pPolls [ nClaimed ] ) == false )
+                {
+                    break;                                                                         // the queue ran dry
+                }
+                nClaimed++;
+            }
+            return nClaimed;
+        }
+        catch ( _com_error &comError )
+        {
+            m_EventTrace.Event ( CEventTrace::Information, "CManualPolls::ClaimBatch <--> ERROR: %s",
+                CErrorMessage::ReturnComErrorMessage ( comError ));
+        }
+        return -1;
+    }
+
+    static void AddPollParameters ( CAdoStoredProcedure& adoStoredProcedure, LPCTSTR Prefix )
+    {
+        /**************************************************************************************************************
+         * This adds the parameters of getManualPoll from po_auditor to po_phone_nr to adoStoredProcedure, naming     *
+         * them with Prefix so that several calls' parameters can be added to one anonymous PL/SQL block.             *
+         **************************************************************************************************************/
+        char szName [ 64 ];
+        StringCbPrintf ( szName, sizeof ( szName ), "%spo_auditor", Prefix );
+        _variant_t vtAuditor ( _bstr_t ( "" ));
+        adoStoredProcedure.AddParameter( szName, vtAuditor, ADODB::adBSTR, ADODB::adParamOutput, 64 );
+
+// Added to force getmanual poll to work.... via bug 3016 7/7/2011   adParamInputOutput
+        double TdCallStartTime;
+        SYSTEMTIME TCallStartTime;
+        GetSystemTime ( &TCallStartTime );
+        SystemTimeToVariantTime ( &TCallStartTime, &TdCallStartTime );
+        StringCbPrintf ( szName, sizeof ( szName ), "%spio_CALL_START_TIME", Prefix );
+        _variant_t vtCallStartTime ( TdCallStartTime, VT_DATE );
+        adoStoredProcedure.AddParameter( szName, vtCallStartTime, ADODB::DataTypeEnum::adDate, ADODB::ParameterDirectionEnum::adParamInputOutput, sizeof ( double ));
+
+        StringCbPrintf ( szName, sizeof ( szName ), "%spo_central_auditor", Prefix );
+        _variant_t vtCentralAuditor ( _bstr_t ( "" ));
+        adoStoredProcedure.AddParameter( szName, vtCentralAuditor, ADODB::adBSTR, ADODB::adParamOutput, 64 );
+
+        StringCbPrintf ( szName, sizeof ( szName ), "%spo_phone_nr", Prefix );
+        _variant_t vtPhoneNumber ( _bstr_t ( "" ));
+        adoStoredProcedure.AddParameter( szName, vtPhoneNumber, ADODB::adBSTR, ADODB::adParamOutput, 64 );
+    }
+
+    static bool TakePoll ( CAdoStoredProcedure& adoStoredProcedure, LPCTSTR Prefix, SManualPoll& poll )
+    {
+        /**************************************************************************************************************
+         * Once adoStoredProcedure has been executed, this sets poll from the parameters named with Prefix. It        *
+         * returns false if they hold no poll. A poll without a central auditor uses its auditor instead.             *
+         **************************************************************************************************************/
+        char szName [ 64 ];
+        StringCbPrintf ( szName, sizeof ( szName ), "%spo_call_number", Prefix );
+        _variant_t vtCallNumber = adoStoredProcedure.GetParameter( szName );
+        if ( vtCallNumber.vt == VT_NULL || vtCallNumber.vt == VT_EMPTY || ( long ) vtCallNumber == 0 )
+        {
+            return false;
+        }
+        ZeroMemory ( &poll, sizeof ( poll ));
+        poll.CallNumber = ( long ) vtCallNumber;
+
+        StringCbPrintf ( szName, sizeof ( szName ), "%spio_call_start_time", Prefix );
+        _variant_t vtCallStartTime = adoStoredProcedure.GetParameter( szName );
+        poll.callStartTime = ( double ) vtCallStartTime;
+
+        StringCbPrintf ( szName, sizeof ( szName ), "%spo_auditor", Prefix );
+        _variant_t vtAuditor = adoStoredProcedure.GetParameter( szName );
+        _bstr_t bstrCentralAuditor ( "" );
+        if ( vtAuditor.vt != VT_NULL && vtAuditor.vt != VT_EMPTY )
+        {
+            bstrCentralAuditor = ( _bstr_t ) vtAuditor;
+        }
+        StringCbPrintf ( szName, sizeof ( szName ), "%spo_central_auditor", Prefix );
+        _variant_t vtCentralAuditor = adoStoredProcedure.GetParameter( szName );
+        if ( vtCentralAuditor.vt != VT_NULL && vtCentralAuditor.vt != VT_EMPTY )
+        {
+            bstrCentralAuditor = ( _bstr_t ) vtCentralAuditor;
+        }
+        StringCbCopy ( poll.szCentralAuditor, sizeof ( poll.szCentralAuditor ), ( const char* ) bstrCentralAuditor );
+
+        StringCbPrintf ( szName, sizeof ( szName ), "%spo_phone_nr", Prefix );
+        _variant_t vtPhoneNumber = adoStoredProcedure.GetParameter( szName );
+        if ( vtPhoneNumber.vt != VT_NULL && vtPhoneNumber.vt != VT_EMPTY )
+        {
+            _bstr_t bstrPhoneNumber (( _bstr_t ) vtPhoneNumber );
+            StringCbCopy ( poll.szPhoneNumber, sizeof ( poll.szPhoneNumber ), ( const char* ) bstrPhoneNumber );
+        }
+        return true;
+    }
+
+    char m_szJournal [ MAX_PATH ];                                                  // path and name of the .POLLS file
+    char m_szLines [ DIALSCHEDULER_MAXPOLLS * MANUALPOLLS_LINESIZE ];                             // the journal's text
+    DWORD m_dwJournalled;                                                    // CDialScheduler::GetChanges when written
+    int m_nJournalled;                                                                                // polls it lists
+    CEventTrace m_EventTrace;                                                      // records events - see EventTrace.h
+};
@@ -0,0 +1,719 @@
+/**********************************************************************************************************************
+ *                            This file contains the CMetricHistogram and CMetrics classes.                           *
+ *                                                                                                                    *
+ * CMetrics keeps the numbers describing what the server is doing - how many sessions are connected, how many calls   *
+ * reached each phase (the command letters I, S, N, U, D, O, C, V, A ...), the response time of each command, the     *
+ * retransmits, the recoveries (responses which only arrived after a retransmit) and the time each took from the      *
+ * first timeout, the F and E error responses, the time taken by each stored procedure and the bytes sent and         *
+ * received per call - so they can be watched without scraping the event log.                                         *
+ *                                                                                                                    *
+ * The time modems take to reset, dial and answer is kept too (see ModemEngine.h), as is the number of AT command     *
+ * steps which missed their deadline, the time each manual poll kept its modem busy and the number of polls waiting   *
+ * for a free modem (see DialScheduler.h).                                                                            *
+ *                                                                                                                    *
+ * Each count is updated with one interlocked instruction (a histogram value with two: its bucket and the sum) on a   *
+ * value of its own. No lock is taken and nothing is allocated, so counting costs a few nanoseconds on the thread     *
+ * doing the work. A CMetricHistogram counts values in log-linear buckets, as an HDR histogram does: 8 buckets per    *
+ * power of two, so any value is placed within 12.5% of itself from 1 up to 2^32 in 240 buckets. Stored procedures    *
+ * are looked up by name once, when a CAdoStoredProcedure is constructed, in a table searched without a lock.         *
+ *                                                                                                                    *
+ * With "Metrics Port" set, Start opens a listening socket on 127.0.0.1 at that port and a thread answers each HTTP   *
+ * request there with every number in the Prometheus text format. It can't be reached from other machines. With the   *
+ * setting 0, the numbers are still kept but not served.                                                              *
+ *                                                                                                                    *
+ * A request for /calls is answered instead with the spans of every connection's latest call as Chrome trace JSON     *
+ * (see CallTimeline.h).                                                                                              *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+#include <intrin.h>
+#include "CallTimeline.h"
+#include "EventTrace.h"
+#include "ProfileValues.h"
+
+#define METRICS_BUCKETS             240                                  // log-linear buckets for values 0 to 2^32 - 1
+#define METRICS_MAXPROCEDURES       256                                                 // stored procedures told apart
+#define METRICS_COMMANDS            26                                                        // command letters A to Z
+#define METRICS_OUTPUTSIZE          ( 1024 * 1024 )                                            // most one answer holds
+
+class CMetricHistogram
+ {
+public:
+    CMetricHistogram(void)
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+        ZeroMemory (( void* ) m_nBuckets, sizeof ( m_nBuckets ));
+        m_nSum = 0;
+    }
+
+    void Observe ( DWORD Value )
+    {
+        /**************************************************************************************************************
+         * This counts Value in its bucket. It may be called by any number of threads at once.                        *
+         **************************************************************************************************************/
+        Add ( m_nBuckets [ GetBucket ( Value ) ], 1 );
+        Add ( m_nSum, Value );
+    }
+
+    __int64 GetCount ( void )                                                      // values observed (in every bucket)
+    {
+        __int64 nCount = 0;
+        for ( int nBucket = 0; nBucket < METRICS_BUCKETS; nBucket++ )
+        {
+            nCount += Read ( m_nBuckets [ nBucket ] );
+        }
+        return nCount;
+    }
+    __declspec(property(get = GetCount)) __int64 Count;
+
+    __int64 GetSum ( void )
+    {
+        return Read ( m_nSum );
+    }
+    __declspec(property(get = GetSum)) __int64 Sum;
+
+    __int64 GetBucketCount ( int Bucket )
+    {
+        return Read ( m_nBuckets [ Bucket ] );
+    }
+
+    static void Add ( volatile __int64& Target, __int64 Value )
+    {
+        /**************************************************************************************************************
+         * This adds Value to Target with one interlocked instruction. 32 bit Windows has no 64 bit interlocked add,  *
+         * so there compare and exchange is used (and repeated only if another thread changed Target meanwhile).      *
+         **************************************************************************************************************/
+#if defined ( _M_X64 )
+        _InterlockedExchangeAdd64 ( &Target, Value );
+#else
+        __int64 nOld = Target;
+        for ( ;; )
+        {
+            __int64 nSeen = _InterlockedCompareExchange64 ( &Target, nOld + Value, nOld );
+            if ( nSeen == nOld )
+            {
+                return;
+            }
+            nOld = nSeen;
+        }
+#endif
+    }
+
+    static __int64 Read ( volatile __int64& Value )
+    {
+        return _InterlockedCompareExchange64 ( &Value, 0, 0 );                         // whole, even on 32 bit Windows
+    }
+
+    static int GetBucket ( DWORD Value )
+    {
+        /**************************************************************************************************************
+         * This returns the bucket holding Value. Values up to 15 have a bucket each; above that, each power of two   *
+         * is split into 8 buckets by the 3 bits following its highest set bit.                                       *
+         **************************************************************************************************************/
+        if ( Value < 16 )
+        {
+            return ( int ) Value;
+        }
+        unsigned long nHighest = 0;
+        _BitScanReverse ( &nHighest, Value );                                                                // 4 to 31
+        return 16 + ( int )( nHighest - 4 ) * 8 + ( int )(( Value >> ( nHighest - 3 )) & 7 );
+    }
+
+    static DWORD GetBucketLimit ( int Bucket )
+    {
+        /**************************************************************************************************************
+         * This returns the largest value counted in Bucket (the Prometheus "le" label).                              *
+         **************************************************************************************************************/
+        if ( Bucket < 16 )
+        {
+            return ( DWORD ) Bucket;
+        }
+        int nHighest = ( Bucket - 16 ) / 8 + 4;
+        unsigned __int64 nNext = ( unsigned __int64 )( 9 + ( Bucket - 16 ) % 8 ) << ( nHighest - 3 );
+        return ( DWORD )( nNext - 1 );
+    }
+
+private:
+    volatile __int64 m_nBuckets [ METRICS_BUCKETS ];
+    volatile __int64 m_nSum;                                                                         // of those values
+ };
+
+class CMetrics
+ {
+public:
+    enum ModemPhase                                                   // what a modem spent time on - see ModemEngine.h
+    {
+        ModemReset,                                                        // hanging up and sending the reset commands
+        ModemDial,                                                                             // dialing until CONNECT
+        ModemAnswer,                                                                   // answering (ATA) until CONNECT
+        ModemPhases
+    };
+
+    static CMetrics& Instance ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the single set of metrics shared by every connection. CApplication::Start calls it (to        *
+         * Start serving them) before any connection threads are started, so it is constructed then.                  *
+         **************************************************************************************************************/
+        static CMetrics metrics;
+        return metrics;
+    }
+
+    void Start ( void )
+    {
+        /**************************************************************************************************************
+         * This reads "Metrics Port" and, unless it is 0, starts answering requests on that port of 127.0.0.1.        *
+         **************************************************************************************************************/
+        CProfileValues profileValues;
+        int nPort = profileValues.GetMetricsPort();
+        if ( nPort <= 0 || m_hThread != NULL )
+        {
+            return;
+        }
+
+        WSADATA wsaData;
+        if ( WSAStartup ( MAKEWORD ( 2, 2 ), &wsaData ) != 0 )
+        {
+            return;
+        }
+        m_hListenSocket = socket ( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+        sockaddr_in address;
+        ZeroMemory ( &address, sizeof ( address ));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl ( INADDR_LOOPBACK );                                       // this machine only
+        address.sin_port = htons (( u_short ) nPort );
+        if ( m_hListenSocket == INVALID_SOCKET
+            || bind ( m_hListenSocket, ( sockaddr* ) &address, sizeof ( address )) == SOCKET_ERROR
+            || listen ( m_hListenSocket, SOMAXCONN ) == SOCKET_ERROR )
+        {
+            m_EventTrace.Event ( CEventTrace::Warning, "CMetrics::Start - can't listen on port %d (error %d)",
+                nPort, WSAGetLastError());
+            CloseListenSocket();
+            WSACleanup();
+            return;
+        }
+        m_hThread = CreateThread ( NULL, 0, ThreadProc, this, 0, NULL );
+        if ( m_hThread == NULL )
+        {
+            CloseListenSocket();
+            WSACleanup();
+            return;
+        }
+        m_EventTrace.Event ( CEventTrace::Information, "CMetrics::Start - serving metrics at http://127.0.0.1:%d/",
+            nPort );
+    }
+
+    void Stop ( void )
+    {
+        /**************************************************************************************************************
+         * This stops answering requests. Closing the listening socket makes the thread's accept fail, so it ends.    *
+         **************************************************************************************************************/
+        if ( m_hThread == NULL )
+        {
+            return;
+        }
+        CloseListenSocket();
+        WaitForSingleObject ( m_hThread, INFINITE );
+        CloseHandle ( m_hThread );
+        m_hThread = NULL;
+        WSACleanup();
+    }
+
+    /*
+     * The following are used to update the metrics. Each may be called by any number of threads at once.
+     */
+    void AddSessions ( int Delta )                                               // a session started (1) or ended (-1)
+    {
+        CMetricHistogram::Add ( m_nSessions, Delta );
+        if ( Delta > 0 )
+        {
+            CMetricHistogram::Add ( m_nSessionsStarted, Delta );
+        }
+    }
+
+    void CountPhase ( BYTE Command )                                             // a call reached the phase of Command
+    {
+        int nCommand = GetCommand ( Command );
+        if ( nCommand >= 0 )
+        {
+            CMetricHistogram::Add ( m_nPhases [ nCommand ], 1 );
+        }
+    }
+
+    void ObserveResponse ( BYTE Command, int Milliseconds )         // a response to Command arrived after Milliseconds
+    {
+        int nCommand = GetCommand ( Command );
+        if ( nCommand >= 0 && Milliseconds >= 0 )
+        {
+            m_ResponseTimes [ nCommand ].Observe (( DWORD ) Milliseconds );
+        }
+    }
+
+    void CountRetransmit ( void )                                                    // the last command was sent again
+    {
+        CMetricHistogram::Add ( m_nRetransmits, 1 );
+    }
+
+    void ObserveRecovery ( BYTE Command, int Milliseconds )       // Command was answered Milliseconds after timing out
+    {
+        int nCommand = GetCommand ( Command );
+        if ( nCommand >= 0 && Milliseconds >= 0 )
+        {
+            m_RecoveryTimes [ nCommand ].Observe (( DWORD ) Milliseconds );
+        }
+    }
+
+    void CountErrorResponse ( BYTE Command )                           // an F (link) or E (application) error response
+    {
+        int nCommand = GetCommand ( Command );
+        if ( nCommand >= 0 )
+        {
+            CMetricHistogram::Add ( m_nErrorResponses [ nCommand ], 1 );
+        }
+    }
+
+    void CountBytes ( int Up, int Down )                        // bytes received from (Up) and sent to (Down) auditors
+    {
+        if ( Up > 0 )
+        {
+            CMetricHistogram::Add ( m_nBytesUp, Up );
+        }
+        if ( Down > 0 )
+        {
+            CMetricHistogram::Add ( m_nBytesDown, Down );
+        }
+    }
+
+    void ObserveModem ( ModemPhase Phase, int Milliseconds )                                  // a modem finished Phase
+    {
+        if ( Phase >= 0 && Phase < ModemPhases && Milliseconds >= 0 )
+        {
+            m_ModemTimes [ Phase ].Observe (( DWORD ) Milliseconds );
+        }
+    }
+
+    void CountModemTimeout ( void )                                      // a modem didn't answer an AT command in time
+    {
+        CMetricHistogram::Add ( m_nModemTimeouts, 1 );
+    }
+
+    void ObservePoll ( bool Succeeded, int Milliseconds )         // a manual poll kept its modem busy for Milliseconds
+    {
+        if ( Milliseconds >= 0 )
+        {
+            m_PollTimes [ Succeeded == true ? 1 : 0 ].Observe (( DWORD ) Milliseconds );
+        }
+    }
+
+    void AddPollBacklog ( int Delta )                             // a manual poll was queued (1) or taken (-1) to dial
+    {
+        CMetricHistogram::Add ( m_nPollBacklog, Delta );
+    }
+
+    void ObserveCall ( int BytesUp, int BytesDown )                           // a call ended, having moved these bytes
+    {
+        m_CallBytesUp.Observe (( DWORD )( BytesUp > 0 ? BytesUp : 0 ));
+        m_CallBytesDown.Observe (( DWORD )( BytesDown > 0 ? BytesDown : 0 ));
+    }
+
+    int GetProcedure ( const char* pszName )
+    {
+        /**************************************************************************************************************
+         * This returns the number ObserveProcedure takes for stored procedure pszName, adding it to the table the    *
+         * first time. It returns -1 if the table is full. Names are looked up without a lock; only adding one takes  *
+         * it.                                                                                                        *
+         **************************************************************************************************************/
+        if ( pszName == NULL )
+        {
+            return -1;
+        }
+        DWORD dwHash = Hash ( pszName );
+        DWORD dwSlot = dwHash & ( METRICS_MAXPROCEDURES - 1 );
+        for ( ;; )
+        {
+            SProcedure* pProcedure = m_pSlots [ dwSlot ];
+            if ( pProcedure == NULL )
+            {
+                break;                                                                               // not added (yet)
+            }
+            if ( pProcedure->dwHash == dwHash && lstrcmp ( pProcedure->szName, pszName ) == 0 )
+            {
+                return ( int ) dwSlot;
+            }
+            dwSlot = ( dwSlot + 1 ) & ( METRICS_MAXPROCEDURES - 1 );
+        }
+
+        EnterCriticalSection ( &m_csProcedures );
+        int nProcedure = -1;
+        for ( ;; )                                                       // from where we stopped - it may be taken now
+        {
+            SProcedure* pProcedure = m_pSlots [ dwSlot ];
+            if ( pProcedure == NULL )
+            {
+                break;
+            }
+            if ( pProcedure->dwHash == dwHash && lstrcmp ( pProcedure->szName, pszName ) == 0 )
+            {
+                nProcedure = ( int ) dwSlot;
+                break;
+            }
+            dwSlot = ( dwSlot + 1 ) & ( METRICS_MAXPROCEDURES - 1 );
+        }
+        if ( nProcedure < 0 && m_nProcedures < METRICS_MAXPROCEDURES / 2 )                     // keep the probes short
+        {
+            SProcedure* pProcedure = new SProcedure;
+            pProcedure->dwHash = dwHash;
+            pProcedure->nFailures = 0;
+            StringCbCopy ( pProcedure->szName, sizeof ( pProcedure->szName ), pszName );
+            MemoryBarrier();                                               // complete before other threads can find it
+            m_pSlots [ dwSlot ] = pProcedure;
+            m_nProcedures++;
+            nProcedure = ( int ) dwSlot;
+        }
+        LeaveCriticalSection ( &m_csProcedures );
+        return nProcedure;
+    }
+
+    void ObserveProcedure ( int Procedure, LARGE_INTEGER& Started, bool Succeeded )
+    {
+        /**************************************************************************************************************
+         * This records that stored procedure number Procedure (from GetProcedure), begun when QueryPerformanceCounter*
+         * returned Started, has just finished.                                                                       *
+         **************************************************************************************************************/
+        if ( Procedure < 0 || m_pSlots [ Procedure ] == NULL )
+        {
+            return;
+        }
+        LARGE_INTEGER Finished;
+        QueryPerformanceCounter ( &Finished );
+        __int64 nMicroseconds = ( Finished.QuadPart - Started.QuadPart ) * 1000000 / m_nFrequency;
+        m_pSlots [ Procedure ]->Times.Observe (( DWORD )( nMicroseconds < MAXDWORD ? nMicroseconds : MAXDWORD ));
+        if ( Succeeded == false )
+        {
+            CMetricHistogram::Add ( m_pSlots [ Procedure ]->nFailures, 1 );
+        }
+    }
+
+    int Render ( char* pszOutput, int nOutputSize )
+    {
+        /**************************************************************************************************************
+         * This places every metric in pszOutput (which holds nOutputSize chars) in the Prometheus text format and    *
+         * returns the number of chars written. Only the buckets of a histogram which hold values are written (with   *
+         * the count so far, as Prometheus expects), followed by the +Inf bucket. Output that doesn't fit is left off.*
+         **************************************************************************************************************/
+        STRSAFE_LPSTR pszEnd = pszOutput;
+        size_t nRemaining = nOutputSize;
+        *pszOutput = '\0';
+
+        Append ( pszEnd, nRemaining,
+            "# HELP protel_sessions Auditor sessions connected now.\n"
+            "# TYPE protel_sessions gauge\n"
+            "protel_sessions %I64d\n"
+            "# HELP protel_sessions_total Auditor sessions started.\n"
+            "# TYPE protel_sessions_total counter\n"
+            "protel_sessions_total %I64d\n",
+            Read ( m_nSessions ), Read ( m_nSessionsStarted ));
+
+        Append ( pszEnd, nRemaining,
+            "# HELP protel_call_phases_total Calls which received a response to each command.\n"
+            "# TYPE protel_call_phases_total counter\n" );
+        for ( int nCommand = 0; nCommand < METRICS_COMMANDS; nCommand++ )
+        {
+            if ( Read ( m_nPhases [ nCommand ] ) != 0 )
+            {
+                Append ( pszEnd, nRemaining, "protel_call_phases_total{phase=\"%c\"} %I64d\n",
+                    'A' + nCommand, Read ( m_nPhases [ nCommand ] ));
+            }
+        }
+
+        Append ( pszEnd, nRemaining,
+            "# HELP protel_response_milliseconds Time from sending a command to its response (not retransmitted).\n"
+            "# TYPE protel_response_milliseconds histogram\n" );
+        for ( int nCommand = 0; nCommand < METRICS_COMMANDS; nCommand++ )
+        {
+            char szLabels [ 32 ];
+            StringCbPrintf ( szLabels, sizeof ( szLabels ), "command=\"%c\"", 'A' + nCommand );
+            RenderHistogram ( pszEnd, nRemaining, "protel_response_milliseconds", szLabels,
+                m_ResponseTimes [ nCommand ] );
+        }
+
+        Append ( pszEnd, nRemaining,
+            "# HELP protel_retransmits_total Commands sent again after a timeout or an F response.\n"
+            "# TYPE protel_retransmits_total counter\n"
+            "protel_retransmits_total %I64d\n"
+            "# HELP protel_error_responses_total F (link layer) and E (application layer) error responses.\n"
+            "# TYPE protel_error_responses_total counter\n"
+            "protel_error_responses_total{type=\"F\"} %I64d\n"
+            "protel_error_responses_total{type=\"E\"} %I64d\n",
+            Read ( m_nRetransmits ), Read ( m_nErrorResponses [ 'F' - 'A' ] ),
+            Read ( m_nErrorResponses [ 'E' - 'A' ] ));
+
+        Append ( pszEnd, nRemaining,
+            "# HELP protel_recovery_milliseconds Time from a command's first timeout to the response to a retransmit.\n"
+            "# TYPE protel_recovery_milliseconds histogram\n" );
+        for ( int nCommand = 0; nCommand < METRICS_COMMANDS; nCommand++ )
+        {
+            char szLabels [ 32 ];
+            StringCbPrintf ( szLabels, sizeof ( szLabels ), "command=\"%c\"", 'A' + nCommand );
+            RenderHistogram ( pszEnd, nRemaining, "protel_recovery_milliseconds", szLabels,
+                m_RecoveryTimes [ nCommand ] );
+        }
+
+        Append ( pszEnd, nRemaining,
+            "# HELP protel_bytes_total Bytes received from (up) and sent to (down) auditors.\n"
+            "# TYPE protel_bytes_total counter\n"
+            "protel_bytes_total{direction=\"up\"} %I64d\n"
+            "protel_bytes_total{direction=\"down\"} %I64d\n"
+            "# HELP protel_call_bytes Bytes received from (up) and sent to (down) the auditor in each call.\n"
+            "# TYPE protel_call_bytes histogram\n",
+            Read ( m_nBytesUp ), Read ( m_nBytesDown ));
+        RenderHistogram ( pszEnd, nRemaining, "protel_call_bytes", "direction=\"up\"", m_CallBytesUp );
+        RenderHistogram ( pszEnd, nRemaining, "protel_call_bytes", "direction=\"down\"", m_CallBytesDown );
+
+        Append ( pszEnd, nRemaining,
+            "# HELP protel_modem_milliseconds Time modems took to reset, dial or answer (until CONNECT).\n"
+            "# TYPE protel_modem_milliseconds histogram\n" );
+        for ( int nPhase = 0; nPhase < ModemPhases; nPhase++ )
+        {
+            static const char* pszPhases [ ModemPhases ] = { "phase=\"reset\"", "phase=\"dial\"", "phase=\"answer\"" };
+            RenderHistogram ( pszEnd, nRemaining, "protel_modem_milliseconds", pszPhases [ nPhase ],
+                m_ModemTimes [ nPhase ] );
+        }
+        Append ( pszEnd, nRemaining,
+            "# HELP protel_modem_timeouts_total AT command steps which missed their deadline.\n"
+            "# TYPE protel_modem_timeouts_total counter\n"
+            "protel_modem_timeouts_total %I64d\n",
+            Read ( m_nModemTimeouts ));
+
+        Append ( pszEnd, nRemaining,
+            "# HELP protel_poll_backlog Manual polls dequeued and waiting for a free modem.\n"
+            "# TYPE protel_poll_backlog gauge\n"
+            "protel_poll_backlog %I64d\n"
+            "# HELP protel_poll_milliseconds Time each manual poll kept its modem busy (dialing until ready again).\n"
+            "# TYPE protel_poll_milliseconds histogram\n",
+            Read ( m_nPollBacklog ));
+        RenderHistogram ( pszEnd, nRemaining, "protel_poll_milliseconds", "result=\"failed\"", m_PollTimes [ 0 ] );
+        RenderHistogram ( pszEnd, nRemaining, "protel_poll_milliseconds", "result=\"succeeded\"", m_PollTimes [ 1 ] );
+
+        Append ( pszEnd, nRemaining,
+            "# HELP protel_procedure_microseconds Time taken by each stored procedure.\n"
+            "# TYPE protel_procedure_microseconds histogram\n" );
+        for ( int nSlot = 0; nSlot < METRICS_MAXPROCEDURES; nSlot++ )
+        {
+            if ( m_pSlots [ nSlot ] != NULL )
+            {
+                char szLabels [ 160 ];
+                StringCbPrintf ( szLabels, sizeof ( szLabels ), "procedure=\"%s\"", m_pSlots [ nSlot ]->szName );
+                RenderHistogram ( pszEnd, nRemaining, "protel_procedure_microseconds", szLabels,
+                    m_pSlots [ nSlot ]->Times );
+            }
+        }
+        Append ( pszEnd, nRemaining,
+            "# HELP protel_procedure_failures_total Stored procedures which failed.\n"
+            "# TYPE protel_procedure_failures_total counter\n" );
+        for ( int nSlot = 0; nSlot < METRICS_MAXPROCEDURES; nSlot++ )
+        {
+            if ( m_pSlots [ nSlot ] != NULL )
+            {
+                Append ( pszEnd, nRemaining, "protel_procedure_failures_total{procedure=\"%s\"} %I64d\n",
+                    m_pSlots [ nSlot ]->szName, Read ( m_pSlots [ nSlot ]->nFailures ));
+            }
+        }
+        return ( int )( pszEnd - pszOutput );
+    }
+
+private:
+    struct SProcedure                                                                             // a stored procedure
+    {
+        DWORD dwHash;
+        char szName [ 128 ];                                                          // e.g. PKG_COMM_SERVER.HEARTBEAT
+        CMetricHistogram Times;                                                                         // microseconds
+        volatile __int64 nFailures;
+    };
+
+    CMetrics(void)
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+        m_nSessions = 0;
+        m_nSessionsStarted = 0;
+        ZeroMemory (( void* ) m_nPhases, sizeof ( m_nPhases ));
+        ZeroMemory (( void* ) m_nErrorResponses, sizeof ( m_nErrorResponses ));
+        m_nRetransmits = 0;
+        m_nModemTimeouts = 0;
+        m_nPollBacklog = 0;
+        m_nBytesUp = 0;
+        m_nBytesDown = 0;
+        ZeroMemory (( void* ) m_pSlots, sizeof ( m_pSlots ));
+        m_nProcedures = 0;
+        InitializeCriticalSection ( &m_csProcedures );
+        LARGE_INTEGER Frequency;
+        QueryPerformanceFrequency ( &Frequency );
+        m_nFrequency = Frequency.QuadPart > 0 ? Frequency.QuadPart : 1;
+        m_hListenSocket = INVALID_SOCKET;
+        m_hThread = NULL;
+    }
+
+    virtual ~CMetrics(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+        Stop();
+        for ( int nSlot = 0; nSlot < METRICS_MAXPROCEDURES; nSlot++ )
+        {
+            delete m_pSlots [ nSlot ];
+        }
+        DeleteCriticalSection ( &m_csProcedures );
+    }
+
+    static DWORD WINAPI ThreadProc ( LPVOID lpParameter )
+    {
+        /**************************************************************************************************************
+         * This is the thread started by Start. It answers each connection to the listening socket with the metrics   *
+         * (or, for GET /calls, the call timelines), then closes it. It ends when Stop closes the listening socket.   *
+         **************************************************************************************************************/
+        CMetrics* pMetrics = ( CMetrics* ) lpParameter;
+        char* pszOutput = new char [ METRICS_OUTPUTSIZE ];
+        while ( true )
+        {
+            SOCKET hSocket = accept ( pMetrics->m_hListenSocket, NULL, NULL );
+            if ( hSocket == INVALID_SOCKET )
+            {
+                break;                                                                               // Stop was called
+            }
+            DWORD dwTimeout = 1000;                                             // don't wait long for a client to send
+            setsockopt ( hSocket, SOL_SOCKET, SO_RCVTIMEO, ( char* ) &dwTimeout, sizeof ( dwTimeout ));
+            setsockopt ( hSocket, SOL_SOCKET, SO_SNDTIMEO, ( char* ) &dwTimeout, sizeof ( dwTimeout ));
+            char szRequest [ 1024 ];
+            int nReceived = recv ( hSocket, szRequest, sizeof ( szRequest ) - 1, 0 );
+            szRequest [ nReceived > 0 ? nReceived : 0 ] = '\0';
+
+            bool bCalls = strncmp ( szRequest, "GET /calls", 10 ) == 0;               // anything else gets the metrics
+            int nLength = bCalls == true ? CCallTracer::Instance().Render ( pszOutput, METRICS_OUTPUTSIZE )
+                : pMetrics->Render ( pszOutput, METRICS_OUTPUTSIZE );
+            char szHeader [ 256 ];
+            StringCbPrintf ( szHeader, sizeof ( szHeader ),
+                "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %d\r\nConnection: close\r\n\r\n",
+                bCalls == true ? "application/json" : "text/plain; version=0.0.4", nLength );
+            SendAll ( hSocket, szHeader, lstrlen ( szHeader ));
+            SendAll ( hSocket, pszOutput, nLength );
+            shutdown ( hSocket, SD_SEND );
+            closesocket ( hSocket );
+        }
+        delete [] pszOutput;
+        return 0;
+    }
+
+    static void SendAll ( SOCKET hSocket, const char* pData, int nLength )
+    {
+        while ( nLength > 0 )
+        {
+            int nSent = send ( hSocket, pData, nLength, 0 );
+            if ( nSent <= 0 )
+            {
+                return;                                                               // the client has gone or stalled
+            }
+            pData += nSent;
+            nLength -= nSent;
+        }
+    }
+
+    static void Append ( STRSAFE_LPSTR& pszEnd, size_t& nRemaining, const char* pszFormat, ... )
+    {
+        /**************************************************************************************************************
+         * This appends printf style output to the output being rendered, leaving pszEnd at its terminator. Output    *
+         * that doesn't fit is left off.                                                                              *
+         **************************************************************************************************************/
+        va_list args;
+        va_start ( args, pszFormat );
+        StringCchVPrintfEx ( pszEnd, nRemaining, &pszEnd, &nRemaining, STRSAFE_IGNORE_NULLS, pszFormat, args );
+        va_end ( args );
+    }
+
+    static void RenderHistogram ( STRSAFE_LPSTR& pszEnd, size_t& nRemaining, const char* pszName,
+        const char* pszLabels, CMetricHistogram& Histogram )
+    {
+        /**************************************************************************************************************
+         * This appends the buckets holding values, the +Inf bucket, the sum and the count of Histogram, giving each  *
+         * line the labels in pszLabels. Nothing is written for a histogram which has no values.                      *
+         **************************************************************************************************************/
+        __int64 nCount = Histogram.Count;
+        if ( nCount == 0 )
+        {
+            return;
+        }
+        __int64 nCumulative = 0;
+        for ( int nBucket = 0; nBucket < METRICS_BUCKETS; nBucket++ )
+        {
+            __int64 nBucketCount = Histogram.GetBucketCount ( nBucket );
+            if ( nBucketCount != 0 )
+            {
+                nCumulative += nBucketCount;
+                Append ( pszEnd, nRemaining, "%s_bucket{%s,le=\"%lu\"} %I64d\n",
+                    pszName, pszLabels, CMetricHistogram::GetBucketLimit ( nBucket ), nCumulative );
+            }
+        }
+        Append ( pszEnd, nRemaining, "%s_bucket{%s,le=\"+Inf\"} %I64d\n%s_sum{%s} %I64d\n%s_count{%s} %I64d\n",
+            pszName, pszLabels, nCumulative, pszName, pszLabels, Histogram.Sum, pszName, pszLabels, nCumulative );
+    }
+
+    static int GetCommand ( BYTE Command )
+    {
+        return Command >= 'A' && Command <= 'Z' ? Command - 'A' : -1;
+    }
+
+    static __int64 Read ( volatile __int64& Value )
+    {
+        return CMetricHistogram::Read ( Value );
+    }
+
+    static DWORD Hash ( const char* pszName )
+    {
+        DWORD dwHash = 2166136261;                                                                            // FNV-1a
+        for ( const char* pszScan = pszName; *pszScan != '\0'; pszScan++ )
+        {
+            dwHash = ( dwHash ^ ( BYTE ) *pszScan ) * 16777619;
+        }
+        return dwHash;
+    }
+
+    void CloseListenSocket ( void )
+    {
+        SOCKET hSocket = m_hListenSocket;
+        m_hListenSocket = INVALID_SOCKET;
+        if ( hSocket != INVALID_SOCKET )
+        {
+            closesocket ( hSocket );
+        }
+    }
+
+    volatile __int64 m_nSessions;                                                                      // connected now
+    volatile __int64 m_nSessionsStarted;
+    volatile __int64 m_nPhases [ METRICS_COMMANDS ];                      // calls which got a response to each command
+    volatile __int64 m_nErrorResponses [ METRICS_COMMANDS ];                                // only F and E are counted
+    volatile __int64 m_nRetransmits;
+    volatile __int64 m_nBytesUp;                                                              // received from auditors
+    volatile __int64 m_nBytesDown;                                                                  // sent to auditors
+    CMetricHistogram m_ResponseTimes [ METRICS_COMMANDS ];                             // milliseconds, by command sent
+    CMetricHistogram m_RecoveryTimes [ METRICS_COMMANDS ];                      // milliseconds, from the first timeout
+    CMetricHistogram m_CallBytesUp;
+    CMetricHistogram m_CallBytesDown;
+    volatile __int64 m_nModemTimeouts;
+    CMetricHistogram m_ModemTimes [ ModemPhases ];                                            // milliseconds, by phase
+    volatile __int64 m_nPollBacklog;                                                        // queued in CDialScheduler
+    CMetricHistogram m_PollTimes [ 2 ];                                    // milliseconds, failed (0) or succeeded (1)
+    SProcedure* volatile m_pSlots [ METRICS_MAXPROCEDURES ];                                         // open addressing
+    CRITICAL_SECTION m_csProcedures;                                                        // taken to add a procedure
+    int m_nProcedures;                                                                                  // added so far
+    __int64 m_nFrequency;                                                         // QueryPerformanceCounter per second
+    SOCKET m_hListenSocket;
+    HANDLE m_hThread;                                                                             // answering requests
+    CEventTrace m_EventTrace;                                                      // records events - see EventTrace.h
+ };
@@ -0,0 +1,528 @@
+/**********************************************************************************************************************
+ *                                     This file contains the CModemEngine class.                                     *
+ *                                                                                                                    *
+ * This drives the AT command side of a modem for ProtelSerial: resetting it between calls, dialing and answering.    *
+ * Like CProtelEngine (see ProtelEngine.h) it doesn't use threads, HANDLEs or the serial port itself. The owner feeds *
+ * in what the modem sends with Receive, changes of its DCD (carrier detect) line with CarrierChanged and the expiry  *
+ * of its timer with TimerExpired. Each thing the engine needs done - write to the modem, raise or drop DTR, start or *
+ * stop the timer, or tell the owner the modem is ready, connected or failed to connect - is queued as a request,     *
+ * which the owner carries out by calling NextRequest until there are none left.                                      *
+ *                                                                                                                    *
+ * Nothing waits for a fixed time. The modem's replies are split into lines and classified by a CModemTokenizer (see  *
+ * ModemTokenizer.h); echoed commands are ignored. Each command of the reset sequence is sent as soon as the modem    *
+ * answers the previous one with OK or ERROR. Every step has a deadline after which the engine carries on as if it    *
+ * had been answered, so a silent modem is still reset (just slowly). A dial or answer ends with its result code:     *
+ * CONNECT connects; BUSY, NO CARRIER and the rest end the attempt at once instead of when the 60 second timeout      *
+ * expires. While the modem is idle, each RING is passed on as a Ring request, with the caller's number if caller ID  *
+ * sent one.                                                                                                          *
+ *                                                                                                                    *
+ * Restart hangs the modem up before the reset sequence. A dial or answer still in progress is abandoned by sending a *
+ * character and waiting for its result code. If carrier is present, DTR is dropped for MODEMENGINE_DTRMS (the modem  *
+ * is set up with &D2, so this hangs up) and the engine waits for carrier to go. Only if it doesn't (e.g. &D0) is the *
+ * escape sequence used: "+++" is sent no sooner than MODEMENGINE_GUARDMS after anything was last sent to the modem   *
+ * (the guard time is S12, normally 1 second) and the modem is then given the guard time again to say OK.             *
+ *                                                                                                                    *
+ * Time is read from a clock the owner passes in (see EngineClock.h). The time each dial, answer and reset takes, and *
+ * each step which missed its deadline, is queued as a request too, for the owner to record (ProtelSerial keeps them  *
+ * in CMetrics).                                                                                                      *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+#include "EngineClock.h"
+#include "ModemTokenizer.h"
+
+#define MODEMENGINE_QUEUESIZE   16                                    // requests queued at once - must be a power of 2
+#define MODEMENGINE_MAXTEXT     128                                // longest command, result or number kept, with '\0'
+#define MODEMENGINE_COMMANDMS   3000                                        // deadline for OK or ERROR after a command
+#define MODEMENGINE_CONNECTMS   60000                                       // deadline for the result of a dial or ATA
+#define MODEMENGINE_ABORTMS     2000                                 // deadline for the result after abandoning a dial
+#define MODEMENGINE_DTRMS       250                                           // DTR held low to hang up (S25 is 50 ms)
+#define MODEMENGINE_DROPMS      2000                                  // deadline for carrier to go after DTR is raised
+#define MODEMENGINE_GUARDMS     1100                                     // escape guard time (S12 = 1 second) + margin
+#define MODEMENGINE_SETTLEMS    500                                // carrier came up - deadline for the CONNECT result
+
+class CModemEngine
+ {
+public:
+    enum RequestType
+    {
+        WriteModem,                                                                // send Text (Length chars) to modem
+        SetDtr,                                                                                            // raise DTR
+        ClearDtr,                                                                                           // drop DTR
+        StartTimer,                                                       // (re)start the modem timer for Milliseconds
+        StopTimer,                                                                            // cancel the modem timer
+        Ready,                                                              // the modem has been reset and is now idle
+        Connected,                                        // a dial or answer connected - Text holds the CONNECT result
+        NotConnected,                           // a dial or answer failed - Text holds its result, "" after a deadline
+        Ring,                                    // the idle modem is ringing - Text holds the caller's number, if sent
+        ResetTimed,                                                      // Ready was queued Milliseconds after Restart
+        DialTimed,                                                   // a dial connected Milliseconds after it was sent
+        AnswerTimed,                                             // an answer connected Milliseconds after ATA was sent
+        DeadlineMissed,                                // a step wasn't answered in time - the engine carried on anyway
+    };
+
+    struct Request
+    {
+        RequestType Type;
+        int Milliseconds;                                          // StartTimer: timeout period, ResetTimed etc.: time
+        int Length;                                                                          // number of chars in Text
+        char Text [ MODEMENGINE_MAXTEXT ];                                       // WriteModem, Connected, NotConnected
+    };
+
+    CModemEngine ( CEngineClock& Clock ) :
+        m_Clock ( Clock )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR. Clock is used to time the steps (see EngineClock.h) and must outlive the engine.              *
+         **************************************************************************************************************/
+        SetTerminator ( "\r" );
+        Reset();
+    }
+
+    virtual ~CModemEngine(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+    }
+
+    void Reset ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the engine to its initial state: idle, nothing queued or partly received and no carrier.      *
+         **************************************************************************************************************/
+        m_ePhase = Idle;
+        m_nQueueHead = 0;
+        m_nQueueCount = 0;
+        m_Tokenizer.Reset();
+        m_szCallerNumber[0] = '\0';
+        m_bCarrier = false;
+        m_bOffHook = false;
+        m_bAnswering = false;
+        m_ppszCommands = NULL;
+        m_nCommands = 0;
+        m_nCommand = 0;
+        m_dwStarted = 0;
+        m_dwLastSent = m_Clock.GetMilliseconds() - MODEMENGINE_GUARDMS;
+    }
+
+    void SetTerminator ( LPCTSTR pszTerminator )
+    {
+        /**************************************************************************************************************
+         * This sets the end-of-line appended to each command (e.g. "\r\n").                                          *
+         **************************************************************************************************************/
+        StringCbCopy ( m_szTerminator, sizeof ( m_szTerminator ), pszTerminator );
+    }
+
+    bool Restart ( bool Carrier, const char* const* ppszCommands, int Commands )
+    {
+        /**************************************************************************************************************
+         * This hangs the modem up (see above) and then sends each of the Commands commands in ppszCommands (which    *
+         * must stay valid meanwhile), queueing Ready once the last is answered. Carrier is the current state of DCD. *
+         * It returns false, doing nothing, if a reset is already in progress.                                        *
+         **************************************************************************************************************/
+        if ( IsResetting() == true )
+        {
+            return false;
+        }
+        m_bCarrier = Carrier;
+        m_ppszCommands = ppszCommands;
+        m_nCommands = Commands;
+        m_nCommand = 0;
+        m_Tokenizer.Reset();
+        m_dwStarted = m_Clock.GetMilliseconds();
+        if ( m_bOffHook == true && m_bCarrier == false )
+        {
+            m_ePhase = Aborting;                                             // any character abandons a dial or answer
+            Write ( " ", false );
+            QueueTimer ( StartTimer, MODEMENGINE_ABORTMS );
+        }
+        else
+        {
+            HangUp();
+        }
+        return true;
+    }
+
+    bool Connect ( LPCTSTR pszCommand, bool Answering )
+    {
+        /**************************************************************************************************************
+         * This sends pszCommand, which dials (ATD...) or answers (ATA, Answering true), and waits for its result.    *
+         * Connected or NotConnected is queued when it arrives. It returns false, doing nothing, unless the modem is  *
+         * idle.                                                                                                      *
+         **************************************************************************************************************/
+        if ( m_ePhase != Idle )
+        {
+            return false;
+        }
+        m_bAnswering = Answering;
+        m_bOffHook = true;
+        m_szCallerNumber[0] = '\0';
+        m_dwStarted = m_Clock.GetMilliseconds();
+        m_ePhase = Connecting;
+        Write ( pszCommand, true );
+        QueueTimer ( StartTimer, MODEMENGINE_CONNECTMS );
+        return true;
+    }
+
+    void CarrierChanged ( bool Carrier )
+    {
+        /**************************************************************************************************************
+         * This is given the state of the modem's DCD line. It may be called as often as convenient: only changes     *
+         * matter.                                                                                                    *
+         **************************************************************************************************************/
+        if ( Carrier == m_bCarrier )
+        {
+            return;
+        }
+        m_bCarrier = Carrier;
+        if ( Carrier == true )
+        {
+            if ( m_ePhase == Connecting )
+            {
+                m_ePhase = Settling;                                     // the CONNECT result normally follows at once
+                QueueTimer ( StartTimer, MODEMENGINE_SETTLEMS );
+            }
+            return;
+        }
+
+        switch ( m_ePhase )
+        {
+            case AwaitingDrop:
+                NextCommand();                                                                 // DTR hung the modem up
+                break;
+
+            case Settling:                                                               // lost before CONNECT arrived
+                m_bOffHook = false;
+                m_ePhase = Idle;
+                QueueTimer ( StopTimer, 0 );
+                QueueText ( NotConnected, "NO CARRIER", 10 );
+                break;
+
+            case Online:                                                   // the owner ends the call and calls Restart
+                m_bOffHook = false;
+                m_ePhase = Idle;
+                break;
+        }
+    }
+
+    void Receive ( const char* pData, int DataLength )
+    {
+        /**************************************************************************************************************
+         * This accepts DataLength chars the modem sent while it wasn't online. Once a CONNECT result is found, the   *
+         * rest is ignored: the owner purges it and starts the conversation.                                          *
+         **************************************************************************************************************/
+        CModemTokenizer::Token token;
+        m_Tokenizer.Write ( pData, DataLength );
+        while ( m_ePhase != Online && m_Tokenizer.Next ( token ))
+        {
+            TokenReceived ( token );
+        }
+        if ( m_ePhase == Online )
+        {
+            m_Tokenizer.Reset();
+        }
+    }
+
+    void TimerExpired ( void )
+    {
+        /**************************************************************************************************************
+         * This is called when the timer started by the last StartTimer request expires.                              *
+         **************************************************************************************************************/
+        switch ( m_ePhase )
+        {
+            case Aborting:
+                QueueRequest ( DeadlineMissed );
+                m_bOffHook = false;
+                HangUp();
+                break;
+
+            case DroppingDtr:
+                QueueRequest ( SetDtr );
+                if ( m_bCarrier == false )
+                {
+                    NextCommand();
+                }
+                else
+                {
+                    m_ePhase = AwaitingDrop;
+                    QueueTimer ( StartTimer, MODEMENGINE_DROPMS );
+                }
+                break;
+
+            case AwaitingDrop:                                                          // DTR didn't hang up - use +++
+                Escape();
+                break;
+
+            case Guarding:
+                m_ePhase = Escaping;
+                Write ( "+++", false );
+                QueueTimer ( StartTimer, MODEMENGINE_GUARDMS + MODEMENGINE_COMMANDMS );
+                break;
+
+            case Escaping:
+            case Command:
+                QueueRequest ( DeadlineMissed );
+                NextCommand();
+                break;
+
+            case Connecting:                                                     // still dialing - Restart abandons it
+                QueueRequest ( DeadlineMissed );
+                m_ePhase = Idle;
+                QueueText ( NotConnected, "", 0 );
+                break;
+
+            case Settling:                                                      // no CONNECT result, but carrier is up
+                GoOnline ( "", 0 );
+                break;
+        }
+    }
+
+    void Sent ( void )
+    {
+        /**************************************************************************************************************
+         * The owner calls this when it sends anything to the modem itself (i.e. data while online), so the escape    *
+         * sequence can keep its guard time.                                                                          *
+         **************************************************************************************************************/
+        m_dwLastSent = m_Clock.GetMilliseconds();
+    }
+
+    bool NextRequest ( Request& request )
+    {
+        /**************************************************************************************************************
+         * This returns false if there is nothing more to do. Otherwise, it copies the oldest queued request to       *
+         * request and returns true.                                                                                  *
+         **************************************************************************************************************/
+        if ( m_nQueueCount == 0 )
+        {
+            return false;
+        }
+        CopyMemory ( &request, &m_Queue [ m_nQueueHead ], sizeof ( request ));
+        m_nQueueHead = ( m_nQueueHead + 1 ) & ( MODEMENGINE_QUEUESIZE - 1 );
+        m_nQueueCount--;
+        return true;
+    }
+
+    bool IsResetting ( void )
+    {
+        /**************************************************************************************************************
+         * This returns true from Restart until Ready is queued.                                                      *
+         **************************************************************************************************************/
+        return m_ePhase >= Aborting && m_ePhase <= Command;
+    }
+
+protected:
+    void TokenReceived ( CModemTokenizer::Token& token )
+    {
+        /**************************************************************************************************************
+         * This acts on a line received from the modem according to what we are waiting for. Anything not awaited     *
+         * (e.g. RING while dialing) is ignored.                                                                      *
+         **************************************************************************************************************/
+        CModemTokenizer::TokenType Result = token.Type;
+        if ( Result == CModemTokenizer::CallerNumber )
+        {
+            Copy ( m_szCallerNumber, token.pValue, token.ValueLength );
+            return;
+        }
+        if ( Result == CModemTokenizer::RingResult && m_ePhase == Idle )
+        {
+            QueueText ( Ring, m_szCallerNumber, lstrlen ( m_szCallerNumber ));
+            return;
+        }
+        if ( Result == CModemTokenizer::NoResult || Result > CModemTokenizer::NoAnswerResult ||
+            Result == CModemTokenizer::RingResult )
+        {
+            return;                                                                    // not a result code we wait for
+        }
+        switch ( m_ePhase )
+        {
+            case Aborting:                                                              // the dial or answer has ended
+                m_bOffHook = false;
+                HangUp();
+                break;
+
+            case Escaping:
+            case Command:
+                if ( Result == CModemTokenizer::OkResult || Result == CModemTokenizer::ErrorResult ) // ERROR: carry on
+                {
+                    NextCommand();
+                }
+                break;
+
+            case Connecting:
+                if ( Result == CModemTokenizer::ConnectResult )
+                {
+                    GoOnline ( token.pText, token.Length );
+                }
+                else                                                                 // BUSY, NO CARRIER, NO ANSWER ...
+                {
+                    m_bOffHook = false;
+                    m_ePhase = Idle;
+                    QueueTimer ( StopTimer, 0 );
+                    QueueText ( NotConnected, token.pText, token.Length );
+                }
+                break;
+
+            case Settling:
+                if ( Result == CModemTokenizer::ConnectResult )
+                {
+                    GoOnline ( token.pText, token.Length );
+                }
+                break;
+        }
+    }
+
+    void HangUp ( void )
+    {
+        /**************************************************************************************************************
+         * This drops DTR if there is carrier, otherwise it starts the reset commands.                                *
+         **************************************************************************************************************/
+        if ( m_bCarrier == true )
+        {
+            m_ePhase = DroppingDtr;
+            QueueRequest ( ClearDtr );
+            QueueTimer ( StartTimer, MODEMENGINE_DTRMS );
+        }
+        else
+        {
+            NextCommand();
+        }
+    }
+
+    void Escape ( void )
+    {
+        /**************************************************************************************************************
+         * This waits out what is left of the guard time since anything was last sent, then sends "+++".              *
+         **************************************************************************************************************/
+        int nQuiet = ( int )( m_Clock.GetMilliseconds() - m_dwLastSent );
+        m_ePhase = Guarding;
+        QueueTimer ( StartTimer, nQuiet < MODEMENGINE_GUARDMS ? MODEMENGINE_GUARDMS - nQuiet : 1 );
+    }
+
+    void NextCommand ( void )
+    {
+        /**************************************************************************************************************
+         * This sends the next reset command or, after the last, queues Ready and ResetTimed with how long it all     *
+         * took.                                                                                                      *
+         **************************************************************************************************************/
+        m_bOffHook = false;
+        if ( m_nCommand < m_nCommands )
+        {
+            m_ePhase = Command;
+            Write ( m_ppszCommands [ m_nCommand++ ], true );
+            QueueTimer ( StartTimer, MODEMENGINE_COMMANDMS );
+            return;
+        }
+        m_ePhase = Idle;
+        QueueTimer ( StopTimer, 0 );
+        QueueRequest ( Ready );
+        QueueTimer ( ResetTimed, ( int )( m_Clock.GetMilliseconds() - m_dwStarted ));
+    }
+
+    void GoOnline ( const char* pResult, int Length )
+    {
+        /**************************************************************************************************************
+         * This queues Connected with the CONNECT result (Length chars at pResult), then DialTimed or AnswerTimed     *
+         * with how long the dial or answer took.                                                                     *
+         **************************************************************************************************************/
+        m_ePhase = Online;
+        QueueTimer ( StopTimer, 0 );
+        QueueText ( Connected, pResult, Length );
+        QueueTimer ( m_bAnswering == true ? AnswerTimed : DialTimed,
+            ( int )( m_Clock.GetMilliseconds() - m_dwStarted ));
+    }
+
+    void Write ( const char* pszText, bool Terminate )
+    {
+        /**************************************************************************************************************
+         * This queues pszText to be sent to the modem, followed by the end-of-line if Terminate is true.             *
+         **************************************************************************************************************/
+        Request* pRequest = QueueText ( WriteModem, pszText, lstrlen ( pszText ));
+        if ( Terminate == true )
+        {
+            StringCbCat ( pRequest->Text, sizeof ( pRequest->Text ), m_szTerminator );
+            pRequest->Length = lstrlen ( pRequest->Text );
+        }
+        m_dwLastSent = m_Clock.GetMilliseconds();
+    }
+
+    Request* QueueRequest ( RequestType Type )
+    {
+        /**************************************************************************************************************
+         * This appends a request of the specified type to the queue and returns it for the caller to fill in. The    *
+         * owner drains the queue after every call, so only a few requests are ever queued at once.                   *
+         **************************************************************************************************************/
+        if ( m_nQueueCount == MODEMENGINE_QUEUESIZE )
+        {
+            m_nQueueHead = ( m_nQueueHead + 1 ) & ( MODEMENGINE_QUEUESIZE - 1 );   // should never happen - drop oldest
+            m_nQueueCount--;
+        }
+        Request* pRequest = &m_Queue [ ( m_nQueueHead + m_nQueueCount ) & ( MODEMENGINE_QUEUESIZE - 1 ) ];
+        m_nQueueCount++;
+        pRequest->Type = Type;
+        pRequest->Milliseconds = 0;
+        pRequest->Length = 0;
+        pRequest->Text[0] = '\0';
+        return pRequest;
+    }
+
+    Request* QueueText ( RequestType Type, const char* pText, int Length )
+    {
+        Request* pRequest = QueueRequest ( Type );
+        pRequest->Length = Copy ( pRequest->Text, pText, Length );
+        return pRequest;
+    }
+
+    static int Copy ( char* pszTo, const char* pFrom, int Length )
+    {
+        /**************************************************************************************************************
+         * This copies Length chars at pFrom (which needn't be '\0' terminated) to pszTo, which holds                 *
+         * MODEMENGINE_MAXTEXT chars, cutting it short to fit, and returns the number copied.                         *
+         **************************************************************************************************************/
+        if ( Length > MODEMENGINE_MAXTEXT - 1 )
+        {
+            Length = MODEMENGINE_MAXTEXT - 1;
+        }
+        CopyMemory ( pszTo, pFrom, Length );
+        pszTo [ Length ] = '\0';
+        return Length;
+    }
+
+    void QueueTimer ( RequestType Type, int Milliseconds )
+    {
+        QueueRequest ( Type )->Milliseconds = Milliseconds;
+    }
+
+    enum Phase                                                            // what the engine is doing - see IsResetting
+    {
+        Idle,                                                                 // nothing: the modem is ready or hung up
+        Aborting,                                                   // abandoning a dial or answer, awaiting its result
+        DroppingDtr,                                                                    // DTR low, waiting to raise it
+        AwaitingDrop,                                                    // DTR raised again, waiting for carrier to go
+        Guarding,                                                            // waiting out the guard time before "+++"
+        Escaping,                                                      // "+++" sent, waiting for the guard time and OK
+        Command,                                                                  // reset command sent, waiting for OK
+        Connecting,                                                    // dial or ATA sent, waiting for the result code
+        Settling,                                                         // carrier up, waiting for the CONNECT result
+        Online,                                                                       // connected - data, not commands
+    } m_ePhase;
+
+    Request m_Queue [ MODEMENGINE_QUEUESIZE ];                                        // requests waiting for the owner
+    int m_nQueueHead;                                                                     // index in m_Queue of oldest
+    int m_nQueueCount;                                                                     // number of requests queued
+    CModemTokenizer m_Tokenizer;                                              // splits what the modem sends into lines
+    char m_szCallerNumber [ MODEMENGINE_MAXTEXT ];                              // caller ID NMBR since the last answer
+    char m_szTerminator [ 4 ];                                                              // end-of-line for commands
+    bool m_bCarrier;                                                                        // DCD was last seen active
+    bool m_bOffHook;                                                  // a dial or answer was sent and hasn't ended yet
+    bool m_bAnswering;                                                          // the last Connect was an answer (ATA)
+    const char* const* m_ppszCommands;                                              // reset commands passed to Restart
+    int m_nCommands;                                                                        // number in m_ppszCommands
+    int m_nCommand;                                                                        // index of the next to send
+    CEngineClock& m_Clock;                                                    // times the guard time and the dial etc.
+    DWORD m_dwStarted;                                                           // when the reset or dial/answer began
+    DWORD m_dwLastSent;                                                                  // when anything was last sent
+};
@@ -0,0 +1,304 @@
+/**********************************************************************************************************************
+ *                                    This file contains the CModemTokenizer class.                                   *
+ *                                                                                                                    *
+ * This is used by CModemEngine (see ModemEngine.h) to split what a modem sends in command mode into lines and say    *
+ * what each one is: a result code (OK, CONNECT and its rate, RING, NO CARRIER, ERROR, NO DIALTONE, BUSY or NO        *
+ * ANSWER, in words or V0 digits), a line of caller ID (DATE, TIME, NMBR or NAME, as sent between the first two RINGs *
+ * when caller ID is on) or something else, such as the echo of a command.                                            *
+ *                                                                                                                    *
+ * Data is passed to Write as it is read, then Next is called repeatedly until it returns false, each call returning  *
+ * the next complete line as a token. Nothing is copied: a token points into the data passed to Write, which must     *
+ * stay valid until Next returns false. Only the start of a line which is split across reads is kept (in m_szCarry)   *
+ * until the rest arrives, so a RING split across two reads, or arriving in one read with other result codes, is      *
+ * still found. Lines longer than MODEMTOKENIZER_MAXLINE are cut short. Empty lines (a verbose result code is sent as *
+ * CR LF code CR LF) are skipped.                                                                                     *
+ *                                                                                                                    *
+ * Each line is classified by its first character and then at most one comparison, so the cost per byte is a compare  *
+ * against CR and LF.                                                                                                 *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+#define MODEMTOKENIZER_MAXLINE  128                                        // longest line kept when split across reads
+
+class CModemTokenizer
+ {
+public:
+    enum TokenType
+    {
+        NoResult,                                                         // an echoed command or anything unrecognised
+        OkResult,
+        ConnectResult,
+        RingResult,
+        NoCarrierResult,
+        ErrorResult,
+        NoDialtoneResult,
+        BusyResult,
+        NoAnswerResult,
+        CallerDate,                                                                             // caller ID: e.g. 0321
+        CallerTime,                                                                             // caller ID: e.g. 1405
+        CallerNumber,                                                  // caller ID: e.g. 6073509, O (out of area) or P
+        CallerName,                                                                       // caller ID: e.g. PROTEL INC
+    };
+
+    struct Token
+    {
+        TokenType Type;
+        const char* pText;                                                      // the whole line - not '\0' terminated
+        int Length;                                                                         // number of chars in pText
+        int Rate;                                                        // ConnectResult: bps after CONNECT, 0 if none
+        const char* pValue;                                            // CallerDate ... CallerName: the text after '='
+        int ValueLength;                                                                   // number of chars in pValue
+    };
+
+    CModemTokenizer(void)
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+        Reset();
+    }
+
+    virtual ~CModemTokenizer(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+    }
+
+    void Reset ( void )
+    {
+        /**************************************************************************************************************
+         * This discards any partial line and any data not yet tokenized.                                             *
+         **************************************************************************************************************/
+        m_pData = NULL;
+        m_nDataLength = 0;
+        m_nOffset = 0;
+        m_nCarry = 0;
+    }
+
+    void Write ( const char* pData, int DataLength )
+    {
+        /**************************************************************************************************************
+         * This accepts DataLength chars from the modem. Any not yet returned from the last Write are discarded.      *
+         **************************************************************************************************************/
+        m_pData = pData;
+        m_nDataLength = DataLength;
+        m_nOffset = 0;
+    }
+
+    bool Next ( Token& token )
+    {
+        /**************************************************************************************************************
+         * This returns false if the data written holds no further complete line (any partial line is kept for the    *
+         * next Write). Otherwise, it describes the next line in token and returns true.                              *
+         **************************************************************************************************************/
+        while ( m_nOffset < m_nDataLength )
+        {
+            const char* pStart = m_pData + m_nOffset;
+            const char* pEnd = m_pData + m_nDataLength;
+            const char* pScan = pStart;
+            while ( pScan < pEnd && *pScan != '\r' && *pScan != '\n' )
+            {
+                pScan++;
+            }
+            int nLength = ( int )( pScan - pStart );
+
+            if ( pScan == pEnd )                                         // no end of line - keep it for the next Write
+            {
+                Carry ( pStart, nLength );
+                m_nOffset = m_nDataLength;
+                return false;
+            }
+            m_nOffset += nLength + 1;                                                      // the line and its CR or LF
+
+            if ( m_nCarry > 0 )                                       // the line began in the data of an earlier Write
+            {
+                Carry ( pStart, nLength );
+                pStart = m_szCarry;
+                nLength = m_nCarry;
+                m_nCarry = 0;
+            }
+            if ( nLength > MODEMTOKENIZER_MAXLINE )
+            {
+                nLength = MODEMTOKENIZER_MAXLINE;                                   // cut short, as if it were carried
+            }
+            if ( nLength > 0 )
+            {
+                Classify ( pStart, nLength, token );
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static void Classify ( const char* pText, int Length, Token& token )
+    {
+        /**************************************************************************************************************
+         * This describes the line of Length chars at pText in token. Verbose result codes may have more after them   *
+         * (e.g. "CONNECT 9600/ARQ"); V0 codes, which are digits, may not. Leading spaces are ignored.                *
+         **************************************************************************************************************/
+        static const TokenType Numeric [] =                                      // V0 codes 0 to 8 (5 is CONNECT 1200)
+        {
+            OkResult, ConnectResult, RingResult, NoCarrierResult, ErrorResult, ConnectResult, NoDialtoneResult,
+            BusyResult, NoAnswerResult
+        };
+
+        token.Type = NoResult;
+        token.pText = pText;
+        token.Length = Length;
+        token.Rate = 0;
+        token.pValue = NULL;
+        token.ValueLength = 0;
+
+        const char* pEnd = pText + Length;
+        while ( pText < pEnd && *pText == ' ' )
+        {
+            pText++;
+        }
+        if ( pText == pEnd )
+        {
+            return;
+        }
+
+        switch ( *pText )
+        {
+            case 'O':
+                token.Type = Word ( pText, pEnd, "OK" ) ? OkResult : NoResult;
+                break;
+
+            case 'C':
+                if ( Word ( pText, pEnd, "CONNECT" ))
+                {
+                    token.Type = ConnectResult;
+                    for ( const char* p = pText + 7; p < pEnd && token.Rate < 100000000; p++ )
+                    {
+                        if ( *p >= '0' && *p <= '9' )
+                        {
+                            token.Rate = token.Rate * 10 + ( *p - '0' );
+                        }
+                        else if ( *p != ' ' || token.Rate != 0 )
+                        {
+                            break;                                                            // e.g. the / of 9600/ARQ
+                        }
+                    }
+                }
+                break;
+
+            case 'R':
+                token.Type = Word ( pText, pEnd, "RING" ) ? RingResult : NoResult;
+                break;
+
+            case 'E':
+                token.Type = Word ( pText, pEnd, "ERROR" ) ? ErrorResult : NoResult;
+                break;
+
+            case 'B':
+                token.Type = Word ( pText, pEnd, "BUSY" ) ? BusyResult : NoResult;
+                break;
+
+            case 'N':
+                if ( Word ( pText, pEnd, "NO CARRIER" ))
+                {
+                    token.Type = NoCarrierResult;
+                }
+                else if ( Word ( pText, pEnd, "NO DIALTONE" ) || Word ( pText, pEnd, "NO DIAL TONE" ))
+                {
+                    token.Type = NoDialtoneResult;
+                }
+                else if ( Word ( pText, pEnd, "NO ANSWER" ))
+                {
+                    token.Type = NoAnswerResult;
+                }
+                else
+                {
+                    Caller ( pText, pEnd, "NMBR", CallerNumber, token );
+                    Caller ( pText, pEnd, "NAME", CallerName, token );
+                }
+                break;
+
+            case 'D':
+                Caller ( pText, pEnd, "DATE", CallerDate, token );
+                break;
+
+            case 'T':
+                Caller ( pText, pEnd, "TIME", CallerTime, token );
+                break;
+
+            default:
+                if ( *pText >= '0' && *pText <= '8' && pEnd - pText == 1 )
+                {
+                    token.Type = Numeric [ *pText - '0' ];
+                }
+                break;
+        }
+    }
+
+protected:
+    static bool Word ( const char* pText, const char* pEnd, const char* pszWord )
+    {
+        /**************************************************************************************************************
+         * This returns true if the text from pText to pEnd is pszWord, optionally followed by a space and more.      *
+         **************************************************************************************************************/
+        while ( *pszWord != '\0' )
+        {
+            if ( pText == pEnd || *pText++ != *pszWord++ )
+            {
+                return false;
+            }
+        }
+        return pText == pEnd || *pText == ' ';
+    }
+
+    static void Caller ( const char* pText, const char* pEnd, const char* pszName, TokenType Type, Token& token )
+    {
+        /**************************************************************************************************************
+         * If the text from pText to pEnd is caller ID item pszName (e.g. "NMBR = 6073509"), this sets token to Type  *
+         * with the value after the '='.                                                                              *
+         **************************************************************************************************************/
+        const char* p = pText;
+        while ( *pszName != '\0' )
+        {
+            if ( p == pEnd || *p++ != *pszName++ )
+            {
+                return;
+            }
+        }
+        while ( p < pEnd && *p == ' ' )
+        {
+            p++;
+        }
+        if ( p == pEnd || *p++ != '=' )
+        {
+            return;
+        }
+        while ( p < pEnd && *p == ' ' )
+        {
+            p++;
+        }
+        token.Type = Type;
+        token.pValue = p;
+        token.ValueLength = ( int )( pEnd - p );
+    }
+
+    void Carry ( const char* pText, int Length )
+    {
+        /**************************************************************************************************************
+         * This appends Length chars at pText to the partial line in m_szCarry, dropping any that don't fit.          *
+         **************************************************************************************************************/
+        if ( Length > MODEMTOKENIZER_MAXLINE - m_nCarry )
+        {
+            Length = MODEMTOKENIZER_MAXLINE - m_nCarry;
+        }
+        CopyMemory ( m_szCarry + m_nCarry, pText, Length );
+        m_nCarry += Length;
+    }
+
+    const char* m_pData;                                                               // data passed to the last Write
+    int m_nDataLength;                                                                    // number of chars in m_pData
+    int m_nOffset;                                                                 // index in m_pData of the next line
+    char m_szCarry [ MODEMTOKENIZER_MAXLINE ];                          // start of a line split across reads (no '\0')
+    int m_nCarry;                                                                       // number of chars in m_szCarry
+};
@@ -12,6 +12,7 @@
 #pragma once
 
 #include "AdoConnection.h"
+#include "AdoConnectionPool.h"
 #include "ProfileValues.h"
 
 class CMonitor
@@ -113,8 +114,7 @@ private:
         //OutputDebugString ( "CMonitor:RecordHeartbeat()\n" );
         //m_EventTrace.Event( CEventTrace::Details, "CMonitor::RecordHeartbeat( %s )", Initial == true ? "true" : "false" );
         CProfileValues profileValues;
-        CAdoConnection adoConnection;
-        adoConnection.ConnectionStringOpen( profileValues.GetConnectionString() );
+        CAdoConnectionLease adoConnection;                                          // borrowed from CAdoConnectionPool
         CAdoStoredProcedure adoStoredProcedure ( "PKG_COMM_SERVER.HEARTBEAT" );
 
         int InitialCall = 0;
@@ -129,6 +129,6 @@ private:
          _variant_t vtCommServerVer ( bstrCommServerVer );
          adoStoredProcedure.AddParameter( "pi_app_version", vtCommServerVer, ADODB::DataTypeEnum::adBSTR, ADODB::ParameterDirectionEnum::adParamInput, bstrCommServerVer.length());
 
-        adoConnection.ExecuteNonQuery( adoStoredProcedure, false );
+        adoConnection->ExecuteNonQuery( adoStoredProcedure, false );
     }
  };
@@ -4,6 +4,12 @@
  * This class gets profile (option) values from a .INI file associated with the executable file of the current        *
  * process.                                                                                                           *
  *                                                                                                                    *
+ * The file is read once into a snapshot holding every value as a string and an integer, and each CProfileValues      *
+ * returns the values of the snapshot current when it was constructed, so a getter is only an array lookup. When the  *
+ * file is edited, CApplication calls Reload(), which reads it into a new snapshot and publishes it with one          *
+ * interlocked exchange. Readers never lock, and never see a snapshot change under them, because a snapshot is never  *
+ * changed once published and the one replaced is kept (in a chain from the new one) for the life of the process.     *
+ *                                                                                                                    *
  *                                         Copyright (c) Protel Inc. 2009-2010                                        *
  **********************************************************************************************************************/
 #pragma once
@@ -27,31 +33,78 @@ private:
         heartbeat_minutes,                                                                                         // 9
         manualpoll_seconds,                                                                                       // 10
 		commserver_version,																						   // 11
+        socket_reactor_threads,                                                                                   // 12
+        framelog_batch,                                                                                           // 13
+        framelog_overflow_wait,                                                                                   // 14
+        connection_pool_size,                                                                                     // 15
+        connection_pool_warm,                                                                                     // 16
+        connection_pool_wait,                                                                                     // 17
+        connection_check_seconds,                                                                                 // 18
+        connection_lease_seconds,                                                                                 // 19
+        dex_writers,                                                                                              // 20
+        image_cache_kilobytes,                                                                                    // 21
+        device_plan_batch,                                                                                        // 22
+        device_prefetchers,                                                                                       // 23
+        event_flush_milliseconds,                                                                                 // 24
+        binary_trace,                                                                                             // 25
+        metrics_port,                                                                                             // 26
+        call_trace_spans,                                                                                         // 27
+        call_trace_seconds,                                                                                       // 28
+        dial_report_minutes,                                                                                      // 29
+        manual_poll_batch,                                                                                        // 30
+        manual_poll_lease_seconds,                                                                                // 31
+        database_workers,                                                                                         // 32
+        key_count,                                                                              // number of keys above
+    };
+
+    struct SSnapshot                                                                             // every profile value
+    {
+        SSnapshot* pPrevious;                                             // snapshot this replaced, NULL for the first
+        char szFileName [ 1024 ];                                               // path and name of profile (.INI) file
+        int nValue [ key_count ];                                                       // each value converted by atoi
+        char* pszValue [ key_count ];                                                             // each value as read
     };
-    char szFileName [ 1024 ];                                                   // path and name of profile (.INI) file
-    char szValue [ 4096 ];                                                                           // returned string
+    SSnapshot* m_pSnapshot;                                               // snapshot current when this was constructed
 
     int GetIntegerValue ( int WhichOne )
     {
         /**************************************************************************************************************
-1>ProtelCommunications.obj : error LNK2020: unresolved token (0A00025E) "protected: static int CProtelHost::maxretranAcmd" (?maxretranAcmd@CProtelHost@@1HA)
-         * This gets  profile string value, converts it to an integer and returns it.                                *
+         * This returns the profile string value converted to an integer when the snapshot was read.                  *
          **************************************************************************************************************/
-        return atoi ( GetStringValue ( WhichOne ));
+        return m_pSnapshot->nValue [ WhichOne ];
     }
 
     char* GetStringValue ( int WhichOne )
     {
         /**************************************************************************************************************
-         * This uses the standard MS GetPrivateprofileString function to return a named string from a named section   *
-         * in a .INI file associated with the executable file of the current process. SectionKey enumeration WhichOne *
-         * selects the section and string names from hard coded lists below.                                          *
+         * This returns a named string from a named section of the profile file, as it was when the snapshot was      *
+         * read. SectionKey enumeration WhichOne selects the section and string names from hard coded lists in        *
+         * Load().                                                                                                    *
+         **************************************************************************************************************/
+        return m_pSnapshot->pszValue [ WhichOne ];
+    }
+
+    static SSnapshot* volatile& Current ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the pointer to the snapshot CProfileValues objects constructed now use. It is NULL until      *
+         * the first one is constructed.                                                                              *
+         **************************************************************************************************************/
+        static SSnapshot* volatile pCurrent = NULL;
+        return pCurrent;
+    }
+
+    static SSnapshot* Load ( void )
+    {
+        /**************************************************************************************************************
+         * This uses the standard MS GetPrivateprofileString function to read every named string from its named       *
+         * section in a .INI file associated with the executable file of the current process into a new snapshot.     *
          *                                                                                                            *
          * If the file, section or string is not found in the profile file, a default value hard coded below is       *
-         * returned and is also written to the file (which is created if it doesn't exist).                           *
+         * used and is also written to the file (which is created if it doesn't exist).                               *
          *                                                                                                            *
-         * If WhichOne is database_file, the default value is a .LOG file associated with the executable file of the  *
-         * current process.                                                                                           *
+         * If the string is database_file, the default value is a .LOG file associated with the executable file of    *
+         * the current process.                                                                                       *
          **************************************************************************************************************/
         //HANDLE hIOMutex = CreateMutex ( NULL, FALSE, "CProfileValues.WaitMutex" );
         //WaitForSingleObject( hIOMutex, INFINITE );
@@ -69,7 +122,28 @@ private:
             "database",                                                                           //database_connection
             "heartbeat",                                                                            //heartbeat_minutes
             "manualpoll",                                                                          //manualpoll_seconds
-			"commserver"																		   // comm server version #
+			"commserver",																		   // comm server version #
+            "Socket",                                                                          //socket_reactor_threads
+            "database",                                                                                //framelog_batch
+            "database",                                                                        //framelog_overflow_wait
+            "database",                                                                          //connection_pool_size
+            "database",                                                                          //connection_pool_warm
+            "database",                                                                          //connection_pool_wait
+            "database",                                                                      //connection_check_seconds
+            "database",                                                                      //connection_lease_seconds
+            "database",                                                                                   //dex_writers
+            "database",                                                                         //image_cache_kilobytes
+            "database",                                                                             //device_plan_batch
+            "database",                                                                            //device_prefetchers
+            "debug",                                                                         //event_flush_milliseconds
+            "debug",                                                                                     //binary_trace
+            "debug",                                                                                     //metrics_port
+            "debug",                                                                                 //call_trace_spans
+            "debug",                                                                               //call_trace_seconds
+            "manualpoll",                                                                         //dial_report_minutes
+            "manualpoll",                                                                           //manual_poll_batch
+            "manualpoll",                                                                   //manual_poll_lease_seconds
+            "database",                                                                              //database_workers
         };
         char* pszKeyName[] =                                                           // hard-coded key (string) names
         {
@@ -85,7 +159,28 @@ private:
             "maxsize",                                                                         //database_connection
             "minutes",                                                                              //heartbeat_minutes
             "seconds",                                                                             //manualpoll_seconds
-			"version"
+			"version",
+            "Reactor Threads",                                                                 //socket_reactor_threads
+            "Frame Log Batch",                                                                         //framelog_batch
+            "Frame Log Overflow Wait",                                                         //framelog_overflow_wait
+            "Connection Pool Size",                                                              //connection_pool_size
+            "Connection Pool Warm",                                                              //connection_pool_warm
+            "Connection Pool Wait",                                                              //connection_pool_wait
+            "Connection Check Seconds",                                                      //connection_check_seconds
+            "Connection Lease Seconds",                                                      //connection_lease_seconds
+            "DEX Writers",                                                                                //dex_writers
+            "Image Cache Kilobytes",                                                            //image_cache_kilobytes
+            "Device Plan Batch",                                                                    //device_plan_batch
+            "Device Prefetchers",                                                                  //device_prefetchers
+            "Event Flush Milliseconds",                                                      //event_flush_milliseconds
+            "Binary Trace",                                                                              //binary_trace
+            "Metrics Port",                                                                              //metrics_port
+            "Call Trace Spans",                                                                      //call_trace_spans
+            "Call Trace Seconds",                                                                  //call_trace_seconds
+            "Dial Report Minutes",                                                                //dial_report_minutes
+            "Batch",                                                                                //manual_poll_batch
+            "Lease Seconds",                                                                //manual_poll_lease_seconds
+            "Database Workers",                                                                      //database_workers
         };
         char* pszDefaultValue[] =                                                          // hard-coded default values
         {
@@ -102,48 +197,115 @@ private:
 			"100000",						                       //max log file size                                                                  //database_connection
             "5",                                                                                    //heartbeat_minutes
             "60",                                           // changed to 60 (1 min) from 300 (5 min) manualpoll_seconds
-			"2.0.0.100"									// default value
+			"2.0.0.100",									// default value
+            "0",                                                      // socket_reactor_threads - 0 = one per processor
+            "32",                                       // framelog_batch - 0 = write each frame as it is sent/received
+            "0",                                // framelog_overflow_wait - milliseconds, 0 = drop frames if queue full
+            "32",                         // connection_pool_size - most connections open at once, 0 = open one per use
+            "2",                                                            // connection_pool_warm - opened at startup
+            "10000",                                    // connection_pool_wait - milliseconds to wait for a connection
+            "60",                                 // connection_check_seconds - idle connections are checked after this
+            "3900",                                  // connection_lease_seconds - a connection held longer is reported
+            "4",                                   // dex_writers - 0 = save each DEX record before requesting the next
+            "16384",                                       // image_cache_kilobytes - 0 = each device gets its own copy
+            "1",                                     // device_plan_batch - 0 = one round trip per procedure per device
+            "2",                            // device_prefetchers - 0 = devices are looked up after the last N response
+            "100",                            // event_flush_milliseconds - 0 = each event is written as it is recorded
+            "1",                                                        // binary_trace - 0 = events are written as XML
+            "9180",                                   // metrics_port - 127.0.0.1 port serving CMetrics, 0 = not served
+            "2048",                   // call_trace_spans - kept per connection (see CallTimeline.h), 0 = none recorded
+            "600",                       // call_trace_seconds - a call lasting longer has its spans written, 0 = never
+            "15",                             // dial_report_minutes - CDialScheduler reports polls per hour, 0 = never
+            "16",                                 // manual_poll_batch - claimed per round trip, 0 or 1 = one at a time
+            "600",                                // manual_poll_lease_seconds - handed back if not dialed in this time
+            "16",                              // database_workers - 0 = each reactor loop makes its own database calls
         };
-        ZeroMemory ( szValue, sizeof ( szValue ));
-        int ReturnedLength = GetPrivateProfileString(
-            pszSectionName[ WhichOne ],                              // lpAppName [in] - section name to search for key
-            pszKeyName[ WhichOne ],                                // lpKeyName [in] - key whose data is to be returned
-            NULL,                                       // lpDefault [in] - NULL = return empty string if key not found
-            szValue,                                                       // lpReturnedString [out] - retrieved string
-            sizeof ( szValue ),                                 // nsize [in] -- size of lpReturnedString in characters
-            GetIniFileName());                                              // lpFileName [in] - name of file to search
-
-        if ( ReturnedLength < 1 )                                                                    // no string found
+        SSnapshot* pSnapshot = new SSnapshot;
+        ZeroMemory ( pSnapshot, sizeof ( SSnapshot ));
+        GetIniFileName ( pSnapshot->szFileName, sizeof ( pSnapshot->szFileName ));
+
+        char szValue [ 4096 ];
+        for ( int WhichOne = 0; WhichOne < key_count; WhichOne++ )
         {
-            StringCbCopy ( szValue, sizeof ( szValue ), pszDefaultValue[ WhichOne ] );
-            if ( WhichOne == database_file )
+            ZeroMemory ( szValue, sizeof ( szValue ));
+            int ReturnedLength = GetPrivateProfileString(
+                pszSectionName[ WhichOne ],                          // lpAppName [in] - section name to search for key
+                pszKeyName[ WhichOne ],                            // lpKeyName [in] - key whose data is to be returned
+                NULL,                                   // lpDefault [in] - NULL = return empty string if key not found
+                szValue,                                                   // lpReturnedString [out] - retrieved string
+                sizeof ( szValue ),                             // nsize [in] -- size of lpReturnedString in characters
+                pSnapshot->szFileName );                                    // lpFileName [in] - name of file to search
+
+            if ( ReturnedLength < 1 )                                                                // no string found
             {
-                ZeroMemory ( szValue, sizeof ( szValue ));
-                GetModuleFileName( NULL, szValue, sizeof ( szValue ));               // executable file of this process
-                PathRemoveExtension ( szValue );
-                PathAddExtension ( szValue, ".LOG" );
+                StringCbCopy ( szValue, sizeof ( szValue ), pszDefaultValue[ WhichOne ] );
+                if ( WhichOne == database_file )
+                {
+                    ZeroMemory ( szValue, sizeof ( szValue ));
+                    GetModuleFileName( NULL, szValue, sizeof ( szValue ));           // executable file of this process
+                    PathRemoveExtension ( szValue );
+                    PathAddExtension ( szValue, ".LOG" );
+                }
+                WritePrivateProfileString( pszSectionName[ WhichOne ], pszKeyName[ WhichOne ], szValue, pSnapshot->szFileName );
             }
-            WritePrivateProfileString( pszSectionName[ WhichOne ], pszKeyName[ WhichOne ], szValue, GetIniFileName());
+            int nLength = lstrlen ( szValue ) + 1;
+            pSnapshot->pszValue [ WhichOne ] = new char [ nLength ];
+            StringCchCopy ( pSnapshot->pszValue [ WhichOne ], nLength, szValue );
+            pSnapshot->nValue [ WhichOne ] = atoi ( szValue );
         }
         //ReleaseMutex( hIOMutex);
-        return szValue;
+        return pSnapshot;
+    }
+
+    static void Free ( SSnapshot* pSnapshot )
+    {
+        /**************************************************************************************************************
+         * This deletes a snapshot which was never published.                                                         *
+         **************************************************************************************************************/
+        for ( int WhichOne = 0; WhichOne < key_count; WhichOne++ )
+        {
+            delete [] pSnapshot->pszValue [ WhichOne ];
+        }
+        delete pSnapshot;
+    }
+
+    static void GetIniFileName ( char* pszFileName, int nFileNameSize )
+    {
+        /**************************************************************************************************************
+         * This is used by Load() above. It gets the name of the file containing the executable of this process,      *
+         * changes its extension to .INI and places it in pszFileName.                                                *
+         **************************************************************************************************************/
+        ZeroMemory ( pszFileName, nFileNameSize );
+        GetModuleFileName( NULL, pszFileName, nFileNameSize );
+        PathRemoveExtension ( pszFileName );
+        PathAddExtension ( pszFileName, ".INI" );
     }
 
 public:
     char* GetIniFileName(void)
     {
         /**************************************************************************************************************
-         * This is used by GetStringValue() above. It gets the name of the file containing the executable of this     *
-         * process, changes its extension to .INI and returns it.                                                     *
+         * This returns the name of the profile (.INI) file: the name of the file containing the executable of this   *
+         * process with its extension changed to .INI.                                                                *
          **************************************************************************************************************/
-        ZeroMemory ( szFileName, sizeof ( szFileName ));
-        GetModuleFileName( NULL, szFileName, sizeof ( szFileName ));
-        PathRemoveExtension ( szFileName );
-        PathAddExtension ( szFileName, ".INI" );
-        if ( PathFileExists ( szFileName ) == FALSE )
+        return m_pSnapshot->szFileName;
+    }
+
+    static void Reload ( void )
+    {
+        /**************************************************************************************************************
+         * This is called by CApplication when the profile file has been edited. It reads the file into a new         *
+         * snapshot and makes it current, so CProfileValues constructed from now on return the new values. Values     *
+         * other classes read once when they start keep their old ones until the process is restarted.                *
+         **************************************************************************************************************/
+        SSnapshot* pSnapshot = Load();
+        SSnapshot* pPrevious = NULL;
+        do
         {
+            pPrevious = Current();
+            pSnapshot->pPrevious = pPrevious;                               // kept for readers which may still hold it
         }
-        return szFileName;
+        while ( InterlockedCompareExchangePointer (( PVOID volatile* ) &Current(), pSnapshot, pPrevious ) != pPrevious );
     }
     //__declspec(property(get = GetIniFileName)) char* IniFileName;
 
@@ -216,6 +378,121 @@ public:
         return GetIntegerValue ( heartbeat_minutes );
     }
 
+    int GetReactorThreads ( void )                      // CSocketListener runs this many event loops (0 = one per CPU)
+    {
+        return GetIntegerValue ( socket_reactor_threads );
+    }
+
+    int GetFrameLogBatch ( void )             // CFrameLogWriter writes up to this many frames per round trip (0 = off)
+    {
+        return GetIntegerValue ( framelog_batch );
+    }
+
+    int GetFrameLogOverflowWait ( void )          // milliseconds CFrameLogWriter waits for queue space before dropping
+    {
+        return GetIntegerValue ( framelog_overflow_wait );
+    }
+
+    int GetConnectionPoolSize ( void )            // CAdoConnectionPool keeps up to this many connections (0 = no pool)
+    {
+        return GetIntegerValue ( connection_pool_size );
+    }
+
+    int GetConnectionPoolWarm ( void )                                 // CAdoConnectionPool opens this many at startup
+    {
+        return GetIntegerValue ( connection_pool_warm );
+    }
+
+    int GetConnectionPoolWait ( void )                     // milliseconds CAdoConnectionPool waits to open or free one
+    {
+        return GetIntegerValue ( connection_pool_wait );
+    }
+
+    int GetConnectionCheckSeconds ( void )               // CAdoConnectionPool checks connections idle longer than this
+    {
+        return GetIntegerValue ( connection_check_seconds );
+    }
+
+    int GetConnectionLeaseSeconds ( void )              // CAdoConnectionPool reports connections held longer than this
+    {
+        return GetIntegerValue ( connection_lease_seconds );
+    }
+
+    int GetDexWriters ( void )                         // CDexWriter threads saving DEX records (0 = saved as received)
+    {
+        return GetIntegerValue ( dex_writers );
+    }
+
+    int GetImageCacheKilobytes ( void )          // CImageCache holds up to this many KB of firmware and configurations
+    {
+        return GetIntegerValue ( image_cache_kilobytes );
+    }
+
+    bool GetDevicePlanBatch ( void )           // ProtelHost asks for all devices' downloads in one database round trip
+    {
+        int Value = GetIntegerValue ( device_plan_batch );
+        if ( Value <= 0 )
+        {
+            return false;
+        }
+        return true;
+    }
+
+    int GetDevicePrefetchers ( void )                   // CDevicePrefetcher threads looking devices up during the call
+    {
+        return GetIntegerValue ( device_prefetchers );
+    }
+
+    int GetEventFlushMilliseconds ( void )             // CEventSink writes the events threads have recorded this often
+    {
+        return GetIntegerValue ( event_flush_milliseconds );
+    }
+
+    bool GetBinaryTrace ( void )                            // CEventTrace records events in binary (see TraceFormat.h)
+    {
+        int Value = GetIntegerValue ( binary_trace );
+        if ( Value <= 0 )
+        {
+            return false;
+        }
+        return true;
+    }
+
+    int GetMetricsPort ( void )                      // CMetrics serves its metrics on this port of 127.0.0.1 (0 = off)
+    {
+        return GetIntegerValue ( metrics_port );
+    }
+
+    int GetCallTraceSpans ( void )                             // spans kept per connection by CCallTimeline (0 = none)
+    {
+        return GetIntegerValue ( call_trace_spans );
+    }
+
+    int GetCallTraceSeconds ( void )                      // a call lasting this long has its spans written (0 = never)
+    {
+        return GetIntegerValue ( call_trace_seconds );
+    }
+
+    int GetDialReportMinutes ( void )                   // CDialScheduler reports its throughput this often (0 = never)
+    {
+        return GetIntegerValue ( dial_report_minutes );
+    }
+
+    int GetManualPollBatch ( void )                             // CManualPolls claims at most this many per round trip
+    {
+        return GetIntegerValue ( manual_poll_batch );
+    }
+
+    int GetManualPollLeaseSeconds ( void )                // a poll claimed but not dialed for this long is handed back
+    {
+        return GetIntegerValue ( manual_poll_lease_seconds );
+    }
+
+    int GetDatabaseWorkers ( void )                     // CDatabaseWorkers threads making the reactors' database calls
+    {
+        return GetIntegerValue ( database_workers );
+    }
+
     int GetManualPolling ( void )                          // Application tries a polling call when this period elapses
     {
         return GetIntegerValue ( manualpoll_seconds );
@@ -231,5 +508,19 @@ public:
         /**************************************************************************************************************
          * CONSTRUCTOR                                                                                                *
          **************************************************************************************************************/
+        m_pSnapshot = Current();
+        if ( m_pSnapshot == NULL )                                          // the first one constructed reads the file
+        {
+            SSnapshot* pSnapshot = Load();
+            m_pSnapshot = ( SSnapshot* ) InterlockedCompareExchangePointer (( PVOID volatile* ) &Current(), pSnapshot, NULL );
+            if ( m_pSnapshot == NULL )
+            {
+                m_pSnapshot = pSnapshot;
+            }
+            else
+            {
+                Free ( pSnapshot );                                      // another thread read it first, so use theirs
+            }
+        }
     }
  };
@@ -7,7 +7,10 @@
  **********************************************************************************************************************/
 #pragma once
 #include "ProtelHost.h"
+#include "AdoConnectionPool.h"
 #include "AuditDevice.h"
+#include "Checksum.h"
+#include "ImageCache.h"
 #include "AdoStoredProcedure.h"
 #include "AdoRecordset.h"
 #include "ProfileValues.h"
@@ -22,10 +25,14 @@ protected:
     double m_dCallStartTime;                                          // start time of connection to the master auditor
     int m_nCallNumber;                                               // call number of connection to the master auditor
     char m_szSerialNumber [ 32 ];                                                       // serial number of this device
-    BYTE* m_pbFirmware;                              // points to entire firmware image (binary) obtained from database
+    CDownloadImage* m_pFirmwareImage;              // firmware image (binary) obtained from database - see ImageCache.h
+    BYTE* m_pbFirmware;                                     // points to entire firmware image (shared - never changed)
     long m_nFirmwareLength;                                                                 // length of firmware image
-    BYTE* m_pbConfiguration;                    // points to entire configuration image (binary) obtained from database
+    CDownloadImage* m_pConfigurationImage;                       // configuration image (binary) obtained from database
+    BYTE* m_pbConfiguration;                           // points to entire configuration image (shared - never changed)
     long m_nConfigurationLength;                                                       // length of configuration image
+    __int64 m_nFirmwareChecksum;                              // sum of bytes in m_pbFirmware, set when image is stored
+    __int64 m_nConfigurationChecksum;                    // sum of bytes in m_pbConfiguration, set when image is stored
 	long new_m_nConfigurationLength;										// m_nConfigurationLength set to zero and I know not where
     bool m_bTransmitFirmware;                // set TRUE by GetFirmwareOrConfiguration if a firmware download is needed
     bool m_bTransmitConfiguration;      // set TRUE by GetFirmwareOrConfiguration if a configuration download is needed
@@ -36,11 +43,11 @@ protected:
     AuditDevice m_AuditDevice;                         // the device's status as read by the master using the N command
 	char m_freeBeeAuditDeviceSN	[ 8 ];				// wjs sn of audit device with freebee to activate
 	int	m_indxOfFBAuditDevice;					//wjs index of audit device needing free bee in cproteldevice array
-    CAdoConnection* m_padoConnection;                                                            // database connection
     BYTE m_bTransmitBuffer [ FIVEHUNDREDTWELVE ];                  // holds chunk returned by GetNextFirmware or GetNextConfiguration
     long m_nCurrentConfigurationOffset;                                   // current position in configuration download
     long m_nCurrentFirmwareOffset;                                       // current position in firmware image download
     int m_nPacketNumber;                                        // number of last configuration or firmware packet sent
+    __int64 m_nPacketSum;                                    // sum of bytes in last packet returned by GetNextDownload
     bool m_bFirmwareDuplicate;           // TRUE if an earlier device controlled by the same host has the same firmware
     bool m_bConfigurationDuplicate;        // TRUE if an earlier device controlled by the same host has the same config
     BYTE m_bFirmwareDuplicates [ 256 ];                  // later devices controlled by the host with the same firmware
@@ -51,17 +58,21 @@ protected:
 
 
 public:
-    CProtelDevice(CAdoConnection* padoConnection) :  m_padoConnection(padoConnection)
+    CProtelDevice(void)
     {
         /**************************************************************************************************************
          * CONSTRUCTOR. This initialises the class members.                                                           *
          **************************************************************************************************************/
         m_bFirmwareHasBeenDownloaded = false;
         ZeroMemory ( m_szSerialNumber, sizeof ( m_szSerialNumber ));
+        m_pFirmwareImage = NULL;
         m_pbFirmware = NULL;                // pointer to firmware to be downloaded - set by GetFirmwareOrConfiguration
         m_nFirmwareLength = 0;                                                              // length of firmware image
+        m_pConfigurationImage = NULL;
         m_pbConfiguration = NULL;      // pointer to configuration to be downloaded - set by GetFirmwareOrConfiguration
         m_nConfigurationLength = 0;                                                     // length of configuration data
+        m_nFirmwareChecksum = 0;
+        m_nConfigurationChecksum = 0;
         m_bTransmitFirmware = false;
         m_bTransmitConfiguration = false;
         m_nFreeBeeeControllerflag = -1;					// default is no freebee download
@@ -71,6 +82,7 @@ public:
         m_nCurrentConfigurationOffset = 0;
         m_nCurrentFirmwareOffset = 0;
         m_nPacketNumber = 0;
+        m_nPacketSum = 0;
         m_bFirmwareDuplicate = false;
         m_bConfigurationDuplicate = false;
 		ZeroMemory ( m_freeBeeAuditDeviceSN, sizeof ( m_freeBeeAuditDeviceSN ));		// wjs holds sn of audit device assigned to free bee 
@@ -81,18 +93,10 @@ public:
 	virtual ~CProtelDevice(void)
     {
         /**************************************************************************************************************
-         * DESTRUCTOR. This deletes any firmware or configuration data that may exist.                                *
+         * DESTRUCTOR. This releases any firmware or configuration image that may exist.                              *
          **************************************************************************************************************/
-        if ( m_pbFirmware != NULL )
-        {
-            delete [] m_pbFirmware;
-            m_pbFirmware = NULL;
-        }
-        if ( m_pbConfiguration != NULL )
-        {
-            delete [] m_pbConfiguration;
-            m_pbConfiguration = NULL;
-        }
+        ReleaseImage ( m_pFirmwareImage, m_pbFirmware );
+        ReleaseImage ( m_pConfigurationImage, m_pbConfiguration );
 //    _CrtDumpMemoryLeaks();
     }
 
@@ -267,7 +271,7 @@ public:
             //eventTrace.Event ( CEventTrace::Details, "CProtelHost::SetAuditDevice -->g_pAdoConnection->ExecuteNonQuery" );
 			int checkit = -1;
 
-            checkit = m_padoConnection->ExecuteNonQuery( adoStoredProcedure, false );                                    // do it
+            checkit = ExecuteNonQuery( adoStoredProcedure, false );                                            // do it
 			if (checkit <= 0 )
 			{
 //		PKG_COMM_SERVER.addSysLogRecAutonomous ( pi_text varchar2 )
@@ -347,13 +351,7 @@ public:
          * This returns the checksum of firmware waiting to be downloaded to the device. (ProtelHost uses this when   *
          * looking for devices controlled by the same master auditor which are due to receive identical firmware.)    *
          **************************************************************************************************************/
-        __int64 Total = 0;
-
-        for ( long Offset = 0; Offset < m_nFirmwareLength; Offset++ )
-        {
-            Total += (BYTE)*( m_pbFirmware + Offset );
-        }
-        return Total;
+        return m_nFirmwareChecksum;                                    // calculated once by GetFirmwareOrConfiguration
     }
 
     __int64 GetConfigurationChecksum ( void )
@@ -363,13 +361,16 @@ public:
          * when looking for devices controlled by the same master auditor which are due to receive an identical       *
          * configuration.)                                                                                            *
          **************************************************************************************************************/
-        __int64 Total = 0;
+        return m_nConfigurationChecksum;                               // calculated once by GetFirmwareOrConfiguration
+    }
 
-        for ( long Offset = 0; Offset < m_nConfigurationLength; Offset++ )
-        {
-            Total += (BYTE)*( m_pbConfiguration + Offset );
-        }
-        return Total;
+    __int64 GetPacketSum ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the sum of the bytes in the packet last returned by GetNextFirmware or GetNextConfiguration.  *
+         * ProtelHost passes it to Transmit so the packet doesn't have to be summed again to build its checksum.      *
+         **************************************************************************************************************/
+        return m_nPacketSum;
     }
 
     long GetFirmwareLength ( void )
@@ -480,11 +481,8 @@ public:
          **************************************************************************************************************/
         m_bTransmitFirmware = false;
         m_nFirmwareLength = 0;
-        if ( m_pbFirmware != NULL )
-        {
-            delete [] m_pbFirmware;
-            m_pbFirmware = NULL;
-        }
+        m_nFirmwareChecksum = 0;
+        ReleaseImage ( m_pFirmwareImage, m_pbFirmware );
     }
 
     // This allows the class to be used like a C# class that has properties
@@ -502,6 +500,7 @@ public:
     __declspec(property(get = GetCallNumber, put = SetCallNumber)) int CallNumber;
     __declspec(property(get = GetFirmwareChecksum)) __int64 FirmwareChecksum;
     __declspec(property(get = GetConfigurationChecksum)) __int64 ConfigurationChecksum;
+    __declspec(property(get = GetPacketSum)) __int64 PacketSum;
     __declspec(property(get = GetIndexFreeBeeAuditDeviceidx,put = SetIndexFreeBeeAuditDeviceidx)) int FreeBeeAuditDeviceidx;
     __declspec(property(get = GetFirmwareLength)) long FirmwareLength;
     __declspec(property(get = GetConfigurationLength)) long ConfigurationLength;
@@ -559,6 +558,30 @@ public:
          * number.                                                                                                    *
          **************************************************************************************************************/
         CAdoStoredProcedure getFreeBeeAssignment ( "PKG_COMM_SERVER.getFreeBeeAssignment2" );
+        AddFreeBee ( getFreeBeeAssignment, "" );
+
+		// try catch goes here
+        if ( ExecuteNonQuery( getFreeBeeAssignment, false ) == false )                                      // do query
+        {
+            m_nFreeBeeeControllerflag = -1;                                         // no freebee download (not known)
+            return m_nFreeBeeeControllerflag;
+        }
+
+        return TakeFreeBee ( getFreeBeeAssignment, "" );
+    }
+
+    void AddFreeBee ( CAdoStoredProcedure& getFreeBeeAssignment, LPCTSTR Prefix )
+    {
+        /**************************************************************************************************************
+         * This adds the parameters of PKG_COMM_SERVER.getFreeBeeAssignment2 to getFreeBeeAssignment. The names of    *
+         * those returned start with Prefix (see AddFirmwareOrConfiguration).                                         *
+         **************************************************************************************************************/
+        char szControllerName [ 64 ];
+        char szFreeBeeIDName [ 64 ];
+        char szIsAssignedName [ 64 ];
+        StringCbPrintf ( szControllerName, sizeof ( szControllerName ), "%spo_ctrl_number", Prefix );
+        StringCbPrintf ( szFreeBeeIDName, sizeof ( szFreeBeeIDName ), "%spo_freebeeid", Prefix );
+        StringCbPrintf ( szIsAssignedName, sizeof ( szIsAssignedName ), "%spo_perform_cmd", Prefix );
         //procedure getFreeBeeAssignment (							getFreeBeeAssignment
                     //pi_callnumber in integer
                     //, pi_centralAuditor in varchar2 default null	CentralAuditor
@@ -586,27 +609,38 @@ public:
         getFreeBeeAssignment.AddParameter( "pi_auditor", vtAuditor, ADODB::DataTypeEnum::adBSTR, ADODB::ParameterDirectionEnum::adParamInput, bstrSerialNumber.length());
 
         _variant_t vtControllerNumber (( long ) 0 );
-        getFreeBeeAssignment.AddParameter( "po_ctrl_number", vtControllerNumber, ADODB::adInteger, ADODB::adParamInputOutput, sizeof ( long ));
+        getFreeBeeAssignment.AddParameter( szControllerName, vtControllerNumber, ADODB::adInteger, ADODB::adParamInputOutput, sizeof ( long ));
 
         _variant_t vtFreeBeeID ( _bstr_t ( "" ));
-        getFreeBeeAssignment.AddParameter("po_freebeeid", vtFreeBeeID, ADODB::adBSTR, ADODB::adParamOutput, 64 );
+        getFreeBeeAssignment.AddParameter( szFreeBeeIDName, vtFreeBeeID, ADODB::adBSTR, ADODB::adParamOutput, 64 );
 
         _variant_t vtIsAssigned (( long ) 0 );
-        getFreeBeeAssignment.AddParameter( "po_perform_cmd", vtIsAssigned, ADODB::adInteger, ADODB::adParamInputOutput, sizeof ( long ));
+        getFreeBeeAssignment.AddParameter( szIsAssignedName, vtIsAssigned, ADODB::adInteger, ADODB::adParamInputOutput, sizeof ( long ));
+    }
 
-		// try catch goes here
-        m_padoConnection->ExecuteNonQuery( getFreeBeeAssignment, false );         // do query
+    int TakeFreeBee ( CAdoStoredProcedure& getFreeBeeAssignment, LPCTSTR Prefix )
+    {
+        /**************************************************************************************************************
+         * This is used once getFreeBeeAssignment (with parameters added by AddFreeBee using the same Prefix) has     *
+         * been executed. It sets up the freebee assignment as described for GetFreeBee and returns the controller.   *
+         **************************************************************************************************************/
+        char szControllerName [ 64 ];
+        char szFreeBeeIDName [ 64 ];
+        char szIsAssignedName [ 64 ];
+        StringCbPrintf ( szControllerName, sizeof ( szControllerName ), "%spo_ctrl_number", Prefix );
+        StringCbPrintf ( szFreeBeeIDName, sizeof ( szFreeBeeIDName ), "%spo_freebeeid", Prefix );
+        StringCbPrintf ( szIsAssignedName, sizeof ( szIsAssignedName ), "%spo_perform_cmd", Prefix );
 
         ZeroMemory ( m_szFreeBeeSerialNumber, sizeof ( m_szFreeBeeSerialNumber ));
-        vtIsAssigned = getFreeBeeAssignment.GetParameter("po_perform_cmd");
+        _variant_t vtIsAssigned = getFreeBeeAssignment.GetParameter( szIsAssignedName );
         if (( long ) vtIsAssigned == 0 )
         {
             m_nFreeBeeeControllerflag  = -1;	// no freebee download
         }
         else
         {
-            vtControllerNumber = getFreeBeeAssignment.GetParameter("po_ctrl_number");
-            vtFreeBeeID = getFreeBeeAssignment.GetParameter("po_freebeeid");
+            _variant_t vtControllerNumber = getFreeBeeAssignment.GetParameter( szControllerName );
+            _variant_t vtFreeBeeID = getFreeBeeAssignment.GetParameter( szFreeBeeIDName );
             m_nFreeBeeeControllerflag = ( long ) vtControllerNumber;
             _bstr_t bstrFreeBeeID (( _bstr_t ) vtFreeBeeID );
             StringCbCopy ( m_szFreeBeeSerialNumber, sizeof ( m_szFreeBeeSerialNumber ), ( const char* ) bstrFreeBeeID );
@@ -614,6 +648,39 @@ public:
 		return m_nFreeBeeeControllerflag;
     }
 
+    static LPCTSTR GetPlanStatements ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the PL/SQL statements, with positional parameters, that AddPlan provides for. ProtelHost      *
+         * repeats them once for each device within an anonymous block.                                               *
+         **************************************************************************************************************/
+        return  "PKG_COMM_SERVER.getDownloadConfig ( ?, ?, ?, ?, ?, ? );\n"
+                "PKG_COMM_SERVER.getDownloadFirmware ( ?, ?, ?, ?, ?, ? );\n"
+                "PKG_COMM_SERVER.getFreeBeeAssignment2 ( ?, ?, ?, ?, ?, ?, ? );\n";
+    }
+
+    void AddPlan ( CAdoStoredProcedure& adoPlan, LPCTSTR Prefix )
+    {
+        /**************************************************************************************************************
+         * This adds the parameters of GetPlanStatements to adoPlan, in order, naming those returned with Prefix.     *
+         * Once adoPlan has been executed, TakePlan does what GetConfiguration, GetFirmware and GetFreeBee would      *
+         * have done had they been called in turn.                                                                    *
+         **************************************************************************************************************/
+        AddFirmwareOrConfiguration ( adoPlan, true, Prefix );
+        AddFirmwareOrConfiguration ( adoPlan, false, Prefix );
+        AddFreeBee ( adoPlan, Prefix );
+    }
+
+    int TakePlan ( CAdoStoredProcedure& adoPlan, LPCTSTR Prefix )
+    {
+        /**************************************************************************************************************
+         * See AddPlan. This returns the freebee controller as for GetFreeBee.                                        *
+         **************************************************************************************************************/
+        TakeFirmwareOrConfiguration ( adoPlan, true, Prefix );
+        TakeFirmwareOrConfiguration ( adoPlan, false, Prefix );
+        return TakeFreeBee ( adoPlan, Prefix );
+    }
+
     BYTE* GetNextFirmware ( long& FirmwareLength )
     {
         /**************************************************************************************************************
@@ -777,7 +844,7 @@ private:
 					//m_EventTrace.Event( CEventTrace::Information, "void CProtelDevice::0GetNextDownload sizeof ( m_bTransmitBuffer ) [%d](%d)",sizeof ( m_bTransmitBuffer ),1);
      //               eventTrace.XML ( CEventTrace::Details, "Transmit", "Completed" );
      //               eventTrace.EndXML ( CEventTrace::Details );
-                    m_padoConnection->ExecuteNonQuery( adoStoredProcedure, false, true );
+                    ExecuteNonQuery( adoStoredProcedure, false, true );
                     eventTrace.BeginXML ( CEventTrace::Details );
                     eventTrace.XML ( CEventTrace::Details, "CProtelDevice::3GetNextDownload", pszStoredProcedure );
                     eventTrace.XML ( CEventTrace::Details, "Transmit", "Completed" );
@@ -790,6 +857,7 @@ private:
                 }
             }
             ConfigurationLength = 0;
+            m_nPacketSum = 0;
             return NULL;
         }
 #if 0
@@ -840,6 +908,8 @@ private:
          * We copy the data chunk to the buffer, advance our position and determine the length of the packet.
          */
         CopyMemory ( m_bTransmitBuffer + nTransmitBufferOffset, pBuffer + nCurrentOffset, CopyLength );
+        CChecksum packetSum;
+        packetSum.Add ( m_bTransmitBuffer + 2, nTransmitBufferOffset - 2 + CopyLength ); // address list (if any) and data
         nCurrentOffset += CopyLength;
         ConfigurationLength = nTransmitBufferOffset + CopyLength;                                   // this is returned
         /*
@@ -856,6 +926,9 @@ private:
             m_bTransmitBuffer [ 0 ] = 0xff;
             m_bTransmitBuffer [ 1 ] = 0xff;
         }
+        packetSum.Add ( m_bTransmitBuffer [ 0 ] );
+        packetSum.Add ( m_bTransmitBuffer [ 1 ] );
+        m_nPacketSum = packetSum.GetSum();                                  // used by ProtelHost to build the checksum
 //printf ( "%d\t%d\t%d\t%d\n", ConfigurationLength, m_nPacketNumber, nCurrentOffset, CopyLength );
         return m_bTransmitBuffer;
     }
@@ -872,27 +945,92 @@ private:
          *                                                                                                            *
          * NOTE: When a configuration is fetched from the database, this method prepends it with its length (2 bytes, *
          * MS first). It doesn't do this with firmware. !!!!Is this right?                                            *
+         *                                                                                                            *
+         * The work is done by AddFirmwareOrConfiguration and TakeFirmwareOrConfiguration, which ProtelHost also uses *
+         * to get every device's configuration, firmware and freebee assignment in one round trip (see                *
+         * CProtelHost::Database_DevicePlan).                                                                         *
+         **************************************************************************************************************/
+        CAdoStoredProcedure adoDownload ( GetDownloadProcedure ( bConfiguration ));
+        AddFirmwareOrConfiguration ( adoDownload, bConfiguration, "" );
+
+        /*
+         * We do the query, allowing messages and blob operations. The stored procedure gets the record relating to
+         * this device and call from the COMM_SERVER_AUDITORS table (inserted during the call according to the N
+         * command response).
+         *
+         * FOR CONFIGURATION:
+         *
+         * If the device is a card reader (ADDRESS from COMM_SERVER_AUDITORS is 200 or more), PENDING_CR and
+         * CR_CFG_NUM where CARDREADERID matches in the MACHINES_PENDING_DWNLD_TAB table are obtained. Otherwise,
+         * PENDING_CFG where MONITOR ID matches in the same table is obtained. If pio_doDownload, PENDING_CR or
+         * PENDING_CFG is non-zero, configuration download is required.
+         *
+         * Otherwise in the case of a card reader, its current configuration version is built from the
+         * COMM_SERVER_AUDITORS table entry as a concatenation of the third digit of FIRMWARE_VERSION plus
+         * FIRMWARE_MONITOR, FIRMWARE_VERSION_REV and CONFIG_FILE_VERSION. Unless this matches CR_CFG_NUM,
+         * configuration download is required.
+         *
+         * If configuration download is required, the configuration is obtained from the MACHINES_IMAGE_CS_TAB and
+         * pio_do_Download is returned non-zero. Note: for a card reader, IMAGETEMPLATEID is always 99.
+         *
+         * FOR FIRMWARE:
+         *
+         * PENDING_FW and PENDING_FIRMWAREID where MONITORID matches in the MACHINES_PENDING_DWNLD_TAB table are
+         * obtained. If PENDING_FW is zero (or there is no match), pioDoDownload is returned as zero. Otherwise, the
+         * firmware is obtained from the FIRMWARE_LIBRARY_TAB where FIRMWAREID matches PENDING_FIRMWAREID and
+         * pioDoDownload is returned non-zero. (See comments for GetNextFirmware regarding how PENDING_FW is
+         * cleared.)
+         */
+		int ret_dwnload;
+		try
+		{
+			ret_dwnload = ExecuteNonQuery( adoDownload, false, true );
+		} 
+		catch (_com_error &comError)
+		{
+            CEventTrace eventTrace;                                                // records events - see EventTrace.h
+            eventTrace.Event ( CEventTrace::Information, "CProtelDevice::GetFirmwareOrConfiguration <--> ERROR: [%s]", CErrorMessage::ReturnComErrorMessage ( comError ));
+			return;
+		}
+        if ( ret_dwnload == 0 )
+        {
+            return;                                                        // not executed - nothing is known to be due
+        }
+        TakeFirmwareOrConfiguration ( adoDownload, bConfiguration, "" );
+    }
+
+    static LPCTSTR GetDownloadProcedure ( bool bConfiguration )
+    {
+        /**************************************************************************************************************
+         * This returns the name of the database stored procedure that checks/gets a configuration (bConfiguration    *
+         * TRUE) or firmware for a device.                                                                            *
+         **************************************************************************************************************/
+        return bConfiguration == true ? "PKG_COMM_SERVER.getDownloadConfig" : "PKG_COMM_SERVER.getDownloadFirmware";
+    }
+
+    void AddFirmwareOrConfiguration ( CAdoStoredProcedure& adoDownload, bool bConfiguration, LPCTSTR Prefix )
+    {
+        /**************************************************************************************************************
+         * This releases any existing configuration or firmware image (as selected by bConfiguration) and adds the    *
+         * parameters of the procedure named by GetDownloadProcedure to adoDownload. The names of those returned      *
+         * start with Prefix, so that several devices' parameters can be added to one anonymous PL/SQL block.         *
          **************************************************************************************************************/
         char szBlobFieldName [ 64 ];
-        char szOracleProcedureName [ 128 ];
+        char szDoDownloadName [ 64 ];
         ZeroMemory ( szBlobFieldName, sizeof ( szBlobFieldName ));
-        ZeroMemory ( szOracleProcedureName, sizeof ( szOracleProcedureName ));
+        StringCbPrintf ( szDoDownloadName, sizeof ( szDoDownloadName ), "%spio_doDownload", Prefix );
         if ( bConfiguration == true )
         {
             /*
-             * Request for configuration. We delete any existing configuration image and prepare to check/get the
-             * configuration using the applicable database stored procedure.
+             * Request for configuration. We release any existing configuration image and prepare to check/get the
+             * configuration using the applicable database stored procedure (see GetDownloadProcedure).
              */
-            if ( m_pbConfiguration != NULL )
-            {
-                delete [] m_pbConfiguration;
-                m_pbConfiguration = NULL;
-            }
+            ReleaseImage ( m_pConfigurationImage, m_pbConfiguration );
             m_bTransmitConfiguration = false;
             m_nConfigurationLength = 0;
+            m_nConfigurationChecksum = 0;
             m_nCurrentConfigurationOffset = 0;
-            StringCbCopy ( szBlobFieldName, sizeof ( szBlobFieldName ), "po_image" );
-            StringCbCopy ( szOracleProcedureName, sizeof ( szOracleProcedureName ), "PKG_COMM_SERVER.getDownloadConfig" );
+            StringCbPrintf ( szBlobFieldName, sizeof ( szBlobFieldName ), "%spo_image", Prefix );
             //procedure getDownloadConfig (
             //                    pi_callnumber in integer
             //                    , pi_centralAuditor in varchar2 default null
@@ -905,19 +1043,15 @@ private:
         else
         {
             /*
-             * Request for firmware. We delete any existing firmware image and prepare to check/get the firmware
-             * using the applicable database stored procedure.
+             * Request for firmware. We release any existing firmware image and prepare to check/get the firmware
+             * using the applicable database stored procedure (see GetDownloadProcedure).
              */
-            if ( m_pbFirmware != NULL )
-            {
-                delete [] m_pbFirmware;
-                m_pbFirmware = NULL;
-            }
+            ReleaseImage ( m_pFirmwareImage, m_pbFirmware );
             m_bTransmitFirmware = false;
             m_nFirmwareLength = 0;
+            m_nFirmwareChecksum = 0;
             m_nCurrentFirmwareOffset = 0;
-            StringCbCopy ( szBlobFieldName, sizeof ( szBlobFieldName ), "po_firmware" );
-            StringCbCopy ( szOracleProcedureName, sizeof ( szOracleProcedureName ), "PKG_COMM_SERVER.getDownloadFirmware" );
+            StringCbPrintf ( szBlobFieldName, sizeof ( szBlobFieldName ), "%spo_firmware", Prefix );
             //procedure getDownloadFirmware (
             //                    pi_callnumber in integer
             //                    , pi_centralAuditor in varchar2 default null
@@ -932,8 +1066,6 @@ private:
          * We prepare the database query, providing details of the call, central auditor and connected device. We
          * also provide a blob parameter with the appropriate name for any returned configuration or firmware.
          */
-        CAdoStoredProcedure adoDownload ( szOracleProcedureName );
-
         _variant_t vtCallNumber (( long ) m_nCallNumber, VT_I4 );
         adoDownload.AddParameter( "pi_callnumber", vtCallNumber, ADODB::DataTypeEnum::adInteger, ADODB::ParameterDirectionEnum::adParamInput, sizeof ( long ));
 
@@ -972,48 +1104,24 @@ private:
             NeedsDownload = 1;                                // we got the configuration and have updated the firmware
         }
         _variant_t vtdoDownload (( long ) NeedsDownload );
-        adoDownload.AddParameter( "pio_doDownload", vtdoDownload, ADODB::adInteger, ADODB::adParamInputOutput, sizeof ( long ));
+        adoDownload.AddParameter( szDoDownloadName, vtdoDownload, ADODB::adInteger, ADODB::adParamInputOutput, sizeof ( long ));
 
-        /*
-         * We do the query, allowing messages and blob operations. The stored procedure gets the record relating to
-         * this device and call from the COMM_SERVER_AUDITORS table (inserted during the call according to the N
-         * command response).
-         *
-         * FOR CONFIGURATION:
-         *
-         * If the device is a card reader (ADDRESS from COMM_SERVER_AUDITORS is 200 or more), PENDING_CR and
-         * CR_CFG_NUM where CARDREADERID matches in the MACHINES_PENDING_DWNLD_TAB table are obtained. Otherwise,
-         * PENDING_CFG where MONITOR ID matches in the same table is obtained. If pio_doDownload, PENDING_CR or
-         * PENDING_CFG is non-zero, configuration download is required.
-         *
-         * Otherwise in the case of a card reader, its current configuration version is built from the
-         * COMM_SERVER_AUDITORS table entry as a concatenation of the third digit of FIRMWARE_VERSION plus
-         * FIRMWARE_MONITOR, FIRMWARE_VERSION_REV and CONFIG_FILE_VERSION. Unless this matches CR_CFG_NUM,
-         * configuration download is required.
-         *
-         * If configuration download is required, the configuration is obtained from the MACHINES_IMAGE_CS_TAB and
-         * pio_do_Download is returned non-zero. Note: for a card reader, IMAGETEMPLATEID is always 99.
-         *
-         * FOR FIRMWARE:
-         *
-         * PENDING_FW and PENDING_FIRMWAREID where MONITORID matches in the MACHINES_PENDING_DWNLD_TAB table are
-         * obtained. If PENDING_FW is zero (or there is no match), pioDoDownload is returned as zero. Otherwise, the
-         * firmware is obtained from the FIRMWARE_LIBRARY_TAB where FIRMWAREID matches PENDING_FIRMWAREID and
-         * pioDoDownload is returned non-zero. (See comments for GetNextFirmware regarding how PENDING_FW is
-         * cleared.)
-         */
-		int ret_dwnload;
-		try
-		{
-			ret_dwnload = m_padoConnection->ExecuteNonQuery( adoDownload, false, true );
-		} 
-		catch (_com_error &comError)
-		{
-            CEventTrace eventTrace;                                                // records events - see EventTrace.h
-            eventTrace.Event ( CEventTrace::Information, "CProtelDevice::GetFirmwareOrConfiguration <--> ERROR: [%s]", CErrorMessage::ReturnComErrorMessage ( comError ));
-			return;
-		}
-        _variant_t vtDoDownload = adoDownload.GetParameter("pio_doDownload");
+    }
+
+    void TakeFirmwareOrConfiguration ( CAdoStoredProcedure& adoDownload, bool bConfiguration, LPCTSTR Prefix )
+    {
+        /**************************************************************************************************************
+         * This is used once adoDownload (with parameters added by AddFirmwareOrConfiguration using the same          *
+         * bConfiguration and Prefix) has been executed. If a download is required, it sets up m_pbConfiguration or   *
+         * m_pbFirmware and sets m_bTransmitConfiguration or m_bTransmitFirmware TRUE.                                *
+         **************************************************************************************************************/
+        char szBlobFieldName [ 64 ];
+        char szDoDownloadName [ 64 ];
+        StringCbPrintf ( szBlobFieldName, sizeof ( szBlobFieldName ), "%s%s", Prefix,
+            bConfiguration == true ? "po_image" : "po_firmware" );
+        StringCbPrintf ( szDoDownloadName, sizeof ( szDoDownloadName ), "%spio_doDownload", Prefix );
+
+        _variant_t vtDoDownload = adoDownload.GetParameter( szDoDownloadName );
         if (( long ) vtDoDownload == 0 )                                                        // no download required
         {
 #ifdef  _DEBUG
@@ -1036,28 +1144,35 @@ private:
                     if ( bConfiguration == true )
                     {
                         /*
-                         * Configuration download is required and we have the image. We set it up and store it, set
-                         * its length and mark to send it.
+                         * Configuration download is required and we have the image. We get it (prefixed with its
+                         * length) from the image cache, which shares it with any other device receiving the same
+                         * configuration, set its length and mark to send it.
                          */
                         m_bTransmitConfiguration = true;
-                        m_nConfigurationLength = nBlobLength + 2;
 						//SetNewConfigurationLength( m_nConfigurationLength );	// bug fixing
-                        m_pbConfiguration = new unsigned char [ m_nConfigurationLength ];
-                        memcpy ( m_pbConfiguration + 2, pBlobPointer, nBlobLength );
                         short shortConfigurationLength = ( short ) nBlobLength;
-                        *( m_pbConfiguration + 0 ) = HIBYTE ( shortConfigurationLength );
-                        *( m_pbConfiguration + 1 ) = LOBYTE ( shortConfigurationLength );
+                        BYTE bLengthPrefix [ 2 ];
+                        bLengthPrefix [ 0 ] = HIBYTE ( shortConfigurationLength );
+                        bLengthPrefix [ 1 ] = LOBYTE ( shortConfigurationLength );
+                        m_pConfigurationImage = CImageCache::Instance().Intern ( CImageCache::Configuration,
+                            bLengthPrefix, sizeof ( bLengthPrefix ), ( BYTE* ) pBlobPointer, nBlobLength );
+                        m_pbConfiguration = m_pConfigurationImage->Data;
+                        m_nConfigurationLength = m_pConfigurationImage->Length;
+                        m_nConfigurationChecksum = m_pConfigurationImage->Checksum;
                     }
                     else
                     {
                         /*
-                         * Firmware download is required and we have the image. We store it, set its length and mark
-                         * to send it.
+                         * Firmware download is required and we have the image. We get it from the image cache,
+                         * which shares it with any other device receiving the same firmware, set its length and
+                         * mark to send it.
                          */
                         m_bTransmitFirmware = true;
-                        m_nFirmwareLength = nBlobLength;
-                        m_pbFirmware = new unsigned char [ m_nFirmwareLength ];
-                        memcpy ( m_pbFirmware, pBlobPointer, nBlobLength );
+                        m_pFirmwareImage = CImageCache::Instance().Intern (
+                            CImageCache::Firmware, NULL, 0, ( BYTE* ) pBlobPointer, nBlobLength );
+                        m_pbFirmware = m_pFirmwareImage->Data;
+                        m_nFirmwareLength = m_pFirmwareImage->Length;
+                        m_nFirmwareChecksum = m_pFirmwareImage->Checksum;
                     }
                 }
                 hr = SafeArrayUnaccessData ( vtReturnedBlob.parray );
@@ -1090,8 +1205,11 @@ private:
                 eventTrace.XML ( CEventTrace::Details, "Length", szLength );
                 if ( bConfiguration == true )
                 {
-                    eventTrace.XML ( CEventTrace::Details, "ASCII", CHexDump::GetAsciiString( pszBlob, nBlobLen ));
-                    eventTrace.XML ( CEventTrace::Details, "HEX", CHexDump::GetHexString( pszBlob, nBlobLen ));
+                    char szDump [ 4096 ];                                       // as much as an event can hold
+                    CHexDump::EncodeAscii ( pszBlob, nBlobLen, szDump, sizeof ( szDump ));
+                    eventTrace.XML ( CEventTrace::Details, "ASCII", szDump );
+                    CHexDump::EncodeHex ( pszBlob, nBlobLen, szDump, sizeof ( szDump ));
+                    eventTrace.XML ( CEventTrace::Details, "HEX", szDump );
                 }
                 eventTrace.EndXML ( CEventTrace::Details );
 
@@ -1099,6 +1217,20 @@ private:
         }
     }
 
+    static void ReleaseImage ( CDownloadImage*& pImage, BYTE*& pbImage )
+    {
+        /**************************************************************************************************************
+         * This releases a firmware or configuration image obtained from CImageCache (see ImageCache.h), if there is  *
+         * one, and clears the pointers to it.                                                                        *
+         **************************************************************************************************************/
+        if ( pImage != NULL )
+        {
+            pImage->Release();
+            pImage = NULL;
+        }
+        pbImage = NULL;
+    }
+
 public:
     void UpdateDatabaseForFirmware ( void )
     {
@@ -1133,7 +1265,7 @@ public:
 
             variantBlob vtPayload ( m_pbFirmware, m_nFirmwareLength ); // save downloaded firmware back to the database - ridiculous!!!!
             adoStoredProcedure.AddParameter( "pi_DOWNLOAD_DATA", vtPayload, ADODB::DataTypeEnum::adVarBinary, ADODB::ParameterDirectionEnum::adParamInput, m_nFirmwareLength );
-            m_padoConnection->ExecuteNonQuery( adoStoredProcedure, false, true );
+            ExecuteNonQuery( adoStoredProcedure, false, true );
         }
         catch ( _com_error &comError )
         {
@@ -1173,7 +1305,7 @@ public:
 
             variantBlob vtPayload ( m_pbConfiguration, m_nConfigurationLength ); // save downloaded config back to the database - ridiculous!!!!
             adoStoredProcedure.AddParameter( "pi_DOWNLOAD_DATA", vtPayload, ADODB::DataTypeEnum::adVarBinary, ADODB::ParameterDirectionEnum::adParamInput, m_nConfigurationLength );
-            m_padoConnection->ExecuteNonQuery( adoStoredProcedure, false, true );                              // do it
+            ExecuteNonQuery( adoStoredProcedure, false, true );                                                // do it
         }
         catch ( _com_error &comError )
         {
@@ -1182,4 +1314,23 @@ public:
             eventTrace.Event ( CEventTrace::Information, "CProtelDevice::UpdateDatabaseForConfig <--> ERROR: [%s]", CErrorMessage::ReturnComErrorMessage ( comError ));
         }
     }
+
+private:
+    bool ExecuteNonQuery ( CAdoStoredProcedure& adoStoredProcedure, bool bSupressMessages, bool OracleBlob = false )
+    {
+        /**************************************************************************************************************
+         * This executes adoStoredProcedure (see CAdoConnection::ExecuteNonQuery) on a connection borrowed from       *
+         * CAdoConnectionPool for just this call. It returns FALSE, having done nothing, if the pool couldn't provide *
+         * one.                                                                                                       *
+         **************************************************************************************************************/
+        CAdoConnectionLease adoConnection;                                          // borrowed from CAdoConnectionPool
+        if ( adoConnection.Connection == NULL )
+        {
+            CEventTrace eventTrace;                                                // records events - see EventTrace.h
+            eventTrace.Event ( CEventTrace::Warning, "CProtelDevice - no database connection for device %s",
+                m_szSerialNumber );
+            return false;
+        }
+        return adoConnection->ExecuteNonQuery ( adoStoredProcedure, bSupressMessages, OracleBlob );
+    }
  };
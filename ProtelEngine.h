@@ -0,0 +1,494 @@
+/**********************************************************************************************************************
+ *                                     This file contains the CProtelEngine class.                                    *
+ *                                                                                                                    *
+ * This is the link layer of a conversation with a master auditor, separated from ProtelHost so that it doesn't use   *
+ * threads, HANDLEs, COM or the database. It frames and checksums commands, splits the received byte stream into      *
+ * responses (see FrameDecoder.h), matches responses to the command that was sent and applies the retransmit and      *
+ * error count policies. It also times each response, by a clock the owner passes in (see EngineClock.h), to choose   *
+ * the next response timeout (see RttEstimator.h).                                                                    *
+ *                                                                                                                    *
+ * The engine never performs any I/O itself. Instead, each thing it needs done is queued as a request: send a frame,  *
+ * record a frame, start or stop the response timeout, process a matching response, report how long it took or abort  *
+ * the call. Data and events are fed in with Write, Transmit, Retransmit and ContinueComms, then the owner repeatedly *
+ * calls NextRequest and carries out each request it returns until there are none left. ProtelHost does this with     *
+ * real sockets, serial ports, waitable timers and stored procedures; anything else (e.g. a test harness) can do it   *
+ * with plain memory.                                                                                                 *
+ *                                                                                                                    *
+ * Requests are returned in the order the original synchronous code performed them, e.g. a command is recorded,       *
+ * then sent, then its timeout is started.                                                                            *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+#include "Checksum.h"
+#include "EngineClock.h"
+#include "FrameDecoder.h"
+#include "RttEstimator.h"
+
+#define MAXFAILCOUNTPERCALL     4                                              // Max fail responses per call b4 hangup
+#define MAXFAILCOUNTPERCMD      3                                               // Max fail responses per cmd b4 hangup
+#define PROTELENGINE_QUEUESIZE  16                                    // requests queued at once - must be a power of 2
+
+class CProtelEngine
+ {
+public:
+    enum RequestType
+    {
+        SendFrame,                                                                  // send Frame to the master auditor
+        LogFrame,                                                // record Frame (sent or received) in the database log
+        StartTimer,                                     // (re)start the response timeout for Milliseconds milliseconds
+        StopTimer,                                                                       // cancel the response timeout
+        ResponseReceived,                                   // Frame is a valid response matching the last command sent
+        AbortCall,                                     // too many retransmits - the call should be aborted (A command)
+        ResponseTimed,                                // the response to Command arrived Milliseconds after it was sent
+        RecoveryTimed,                  // the retransmitted Command was answered Milliseconds after it first timed out
+    };
+
+    struct Request
+    {
+        RequestType Type;
+        bool Transmit;                                                        // LogFrame: true if Frame was sent by us
+        bool Retransmit;                                                     // LogFrame: true if Frame is a retransmit
+        BYTE Command;                                                   // ResponseTimed, RecoveryTimed: command letter
+        int Milliseconds;                                       // StartTimer: timeout period, ResponseTimed etc.: time
+        int FrameLength;                                                                    // number of bytes in Frame
+        BYTE Frame [ FRAMEDECODER_MAXFRAME ];                           // SendFrame, LogFrame, ResponseReceived: frame
+    };
+
+    CProtelEngine ( CEngineClock& Clock ) :
+        m_Clock ( Clock )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR. Clock is used to time the responses (see EngineClock.h) and must outlive the engine.          *
+         **************************************************************************************************************/
+        Reset();
+    }
+
+    virtual ~CProtelEngine(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+    }
+
+    void Reset ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the engine to its initial state at the start of a new connection: nothing buffered, queued or *
+         * transmitted, all error and retransmit counts cleared and no response times measured.                       *
+         **************************************************************************************************************/
+        m_FrameDecoder.Reset();
+        m_nQueueHead = 0;
+        m_nQueueCount = 0;
+        ClearLastTransmission();
+        ResetCommsErrs();
+        m_nReXmitFailCountPercall = 0;
+        m_nReXmitFailCountPercmd = 0;
+        m_nLastCmd = 0;
+        m_RttEstimator.Reset();
+        m_bTiming = false;
+        m_dwTransmitted = 0;
+        m_dwFirstTimeout = 0;
+        m_bRetransmitted = false;
+        m_nRetransmits = 0;
+        m_nRecoveries = 0;
+        m_nRecoverMilliseconds = 0;
+    }
+
+    void ResetCommsErrs ( void )
+    {
+        m_nCommsErrs = 0;
+    }
+
+    void ClearLastTransmission ( void )
+    {
+        /**************************************************************************************************************
+         * This forgets the last command transmitted, so Retransmit does nothing and no response will match until     *
+         * another command is transmitted.                                                                            *
+         **************************************************************************************************************/
+        m_nLastTransmission = 0;
+        ZeroMemory ( m_LastTransmission, sizeof ( m_LastTransmission ));
+    }
+
+    int Write ( BYTE* pData, int DataLength )
+    {
+        /**************************************************************************************************************
+         * This accepts up to DataLength bytes received from the master auditor and returns the number actually       *
+         * accepted. The owner should then drain the requests with NextRequest before writing the remainder.          *
+         **************************************************************************************************************/
+        return m_FrameDecoder.Write ( pData, DataLength );
+    }
+
+    bool NextRequest ( Request& request )
+    {
+        /**************************************************************************************************************
+         * This returns false if there is nothing more to do. Otherwise, it copies the oldest queued request to       *
+         * request and returns true. When the queue is empty, the next received frame (if any) is decoded first and   *
+         * the requests it produces are returned instead.                                                             *
+         *                                                                                                            *
+         * Frames are decoded one at a time so that a command transmitted while a response is being processed resets  *
+         * the decoder before any further (now stale) data is looked at, just as when ProtelHost decoded them itself. *
+         **************************************************************************************************************/
+        while ( m_nQueueCount == 0 )
+        {
+            if ( DecodeFrame() == false )
+            {
+                return false;                                                   // nothing queued and no complete frame
+            }
+        }
+
+        CopyMemory ( &request, &m_Queue [ m_nQueueHead ], sizeof ( request ));
+        m_nQueueHead = ( m_nQueueHead + 1 ) & ( PROTELENGINE_QUEUESIZE - 1 );
+        m_nQueueCount--;
+        return true;
+    }
+
+    void Transmit ( char command, BYTE* Payload, int PayloadLength, __int64 PayloadSum, int MaxMilliseconds )
+    {
+        /**************************************************************************************************************
+         * This assembles the specified command (e.g. command == 'I') including the sync character (T), length,       *
+         * payload and checksum, then queues requests to record it, send it and start a response timeout chosen by    *
+         * m_RttEstimator (at most MaxMilliseconds). Anything received before now is discarded since it can't be the  *
+         * response.                                                                                                  *
+         *                                                                                                            *
+         * PayloadSum is the sum of the PayloadLength bytes in Payload, so the checksum is built from it and the      *
+         * three header bytes without summing the payload again.                                                      *
+         *                                                                                                            *
+         * The assembled command is saved in m_LastTransmission for Retransmit and to match the response against.     *
+         **************************************************************************************************************/
+        if ( PayloadLength > FRAMEDECODER_MAXFRAME - 4 )
+        {
+            PayloadLength = FRAMEDECODER_MAXFRAME - 4;                       // the length byte can't describe any more
+        }
+
+        m_FrameDecoder.Reset();                                                             // prepare for new response
+        ZeroMemory ( m_LastTransmission, sizeof ( m_LastTransmission ));
+        if ( Payload != NULL && PayloadLength > 0 )
+        {
+            MoveMemory ( m_LastTransmission + 3, Payload, PayloadLength );
+        }
+        else
+        {
+            PayloadLength = 0;
+        }
+
+        m_LastTransmission [ 0 ] = ( BYTE )'T';                                                       // sync character
+        m_LastTransmission [ 1 ] = ( BYTE )( PayloadLength + 1 );
+        m_LastTransmission [ 2 ] = ( BYTE )command;
+
+        CChecksum checksum;
+        checksum.Add ( m_LastTransmission, 3 );                                                // T, length and command
+        checksum.AddSum ( PayloadSum );
+        m_LastTransmission [ PayloadLength + 3 ] = checksum.FrameChecksum;
+        m_nLastTransmission = PayloadLength + 4;
+
+        m_bTiming = true;                                                            // the response is timed from here
+        m_dwTransmitted = m_Clock.GetMilliseconds();
+        m_bRetransmitted = false;
+        QueueFrame ( LogFrame, m_LastTransmission, m_nLastTransmission, true, false );
+        QueueFrame ( SendFrame, m_LastTransmission, m_nLastTransmission, false, false );
+        QueueTimer ( StartTimer, m_RttEstimator.GetTimeout ( m_LastTransmission [ 2 ], m_nLastTransmission,
+            MaxMilliseconds ));
+    }
+
+    void Retransmit ( int MaxMilliseconds )
+    {
+        /**************************************************************************************************************
+         * This is used if a valid response to the last command transmitted is not received before timeout. It queues *
+         * requests to record and send the command again and restart the timeout (doubled each time, up to            *
+         * MaxMilliseconds) unless the command (or the call as a whole) has already been retransmitted too many       *
+         * times, in which case AbortCall is queued instead.                                                          *
+         **************************************************************************************************************/
+        if ( m_nLastTransmission <= 0 )
+        {
+            return;                                                                        // nothing has been sent yet
+        }
+
+        if ( m_nLastCmd != m_LastTransmission [ 2 ] )
+        {
+            m_nReXmitFailCountPercmd = 1;                                                // first retransmit of command
+            m_nReXmitFailCountPercall++;
+            m_nLastCmd = m_LastTransmission [ 2 ];
+        }
+        else if (( m_nReXmitFailCountPercmd < MAXFAILCOUNTPERCMD - 1 )
+            && ( m_nReXmitFailCountPercall < MAXFAILCOUNTPERCALL - 1 ))
+        {
+            m_nReXmitFailCountPercmd++;
+            m_nReXmitFailCountPercall++;
+        }
+        else
+        {
+            m_nReXmitFailCountPercmd = 0;                                                             // one has failed
+            m_nReXmitFailCountPercall = 0;
+            m_nLastCmd = 0;
+            QueueRequest ( AbortCall );
+            return;
+        }
+
+        if ( m_bRetransmitted == false )
+        {
+            m_bRetransmitted = true;                                 // a response now can't be timed, but recovery can
+            m_dwFirstTimeout = m_Clock.GetMilliseconds();
+        }
+        m_nRetransmits++;
+        m_RttEstimator.Backoff();
+
+        m_FrameDecoder.Reset();                                                             // prepare for new response
+        QueueFrame ( LogFrame, m_LastTransmission, m_nLastTransmission, true, true );
+        QueueFrame ( SendFrame, m_LastTransmission, m_nLastTransmission, false, false );
+        QueueTimer ( StartTimer, m_RttEstimator.GetTimeout ( m_LastTransmission [ 2 ], m_nLastTransmission,
+            MaxMilliseconds ));
+    }
+
+    bool Resync ( void )
+    {
+        /**************************************************************************************************************
+         * This is used when the response timeout expires, before retransmitting. A stray T (with a large length      *
+         * byte) at the front of the decoder holds up a response behind it until now (see FrameDecoder.h), so we look *
+         * behind it for a complete, valid frame that answers the last command transmitted: the same command with the *
+         * same address or packet number. An E or F isn't taken, since it would be accepted whatever was sent. If     *
+         * such a frame is found, the bytes before it are discarded so that it is decoded by NextRequest as usual,    *
+         * and true is returned: the owner should drain the requests rather than retransmit.                          *
+         *                                                                                                            *
+         * If none is found, false is returned and nothing is discarded - the command is retransmitted as before.     *
+         **************************************************************************************************************/
+        if ( m_nLastTransmission <= 0 )
+        {
+            return false;                                                                  // nothing has been sent yet
+        }
+        int nOffset = 0;
+        int nFrameLength = 0;
+        while (( nOffset = m_FrameDecoder.FindFrameBehind ( m_DecodedFrame, nFrameLength, nOffset )) != 0 )
+        {
+            if ( m_DecodedFrame [ 2 ] != 'E' && m_DecodedFrame [ 2 ] != 'F'
+                && IsMatchingResponse ( m_DecodedFrame, m_LastTransmission ))
+            {
+                m_FrameDecoder.Discard ( nOffset );                                    // the bytes before it are noise
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void SeedRtt ( int Smoothed, int Variance )
+    {
+        /**************************************************************************************************************
+         * This starts the response time estimate from the values recorded for the master auditor at the end of its   *
+         * last call (see CRttHistory).                                                                               *
+         **************************************************************************************************************/
+        m_RttEstimator.Seed ( Smoothed, Variance );
+    }
+
+    bool ContinueComms ( bool r, int CommsErrsLimit )
+    {
+        /**************************************************************************************************************
+         * This is called with r false when a communication error (timeout) occurs. Provided there haven't been too   *
+         * many such errors (CommsErrsLimit), it returns true and a retransmit can occur. Once the error threshold is *
+         * reached, it returns false and the connection should be aborted.                                            *
+         *                                                                                                            *
+         * It is called with r true (by DecodeFrame) to adjust the error count when a response is received.           *
+         **************************************************************************************************************/
+        if ( r == true )
+        {
+            if ( m_nCommsErrs >= 1 )
+            {
+                m_nCommsErrs -= 1;                                        // response received and error count non-zero
+            }
+            return true;
+        }
+
+        m_nCommsErrs += 3;                                                                           // error (timeout)
+        return ( m_nCommsErrs < CommsErrsLimit );                                           // false if too many errors
+    }
+
+    static bool IsMatchingResponse ( BYTE* Response, BYTE* Command )
+    {
+        /**************************************************************************************************************
+         * This returns true if Response, including any address or packet number, matches the command in Command.     *
+         **************************************************************************************************************/
+        unsigned char Cmd = Response[2];                                       // the command character in the response
+
+        if ( Cmd == 'E' || Cmd == 'F' )
+        {
+            return true;                                                  // it was an error response - always accepted
+        }
+
+        if ( Cmd != Command[2] )
+        {
+            return false;                                                     // the command doesn't match what we sent
+        }
+
+        if ( Cmd == 'R' || Cmd == 'T' )
+        {
+            return Response[3] == Command[3];      // DEX or Time from specific slave: OK if the 1 byte address matches
+        }
+
+        else if ((Cmd == 'N' || Cmd == 'U') && Response[3] == 0xff && Response[4] == 0xff )
+        {
+            return true;                                                 // Slave list or DEX: Packet ffff is always OK
+        }
+
+        else if ( Cmd == 'C' || Cmd == 'N' || Cmd == 'O' || Cmd == 'U' )
+        {
+            return Response[3] == Command[3] && Response[4] == Command[4];
+                                  // Configuration, slave list, firmware or DEX: OK if the 2 byte packet number matches
+        }
+
+        return true;                              // Other commands: OK - command doesn't have address or packet number
+    }
+
+    int GetLastTransmissionLength ( void )
+    {
+        return m_nLastTransmission;
+    }
+    __declspec(property(get = GetLastTransmissionLength)) int LastTransmissionLength;
+
+    CRttEstimator& GetRttEstimator ( void )
+    {
+        return m_RttEstimator;
+    }
+    __declspec(property(get = GetRttEstimator)) CRttEstimator& RttEstimator;
+
+    int GetRetransmits ( void )
+    {
+        return m_nRetransmits;
+    }
+    __declspec(property(get = GetRetransmits)) int Retransmits;
+
+    int GetRecoveries ( void )
+    {
+        return m_nRecoveries;
+    }
+    __declspec(property(get = GetRecoveries)) int Recoveries;
+
+    int GetRecoverMilliseconds ( void )
+    {
+        return m_nRecoverMilliseconds;
+    }
+    __declspec(property(get = GetRecoverMilliseconds)) int RecoverMilliseconds;
+
+protected:
+    bool DecodeFrame ( void )
+    {
+        /**************************************************************************************************************
+         * This takes the next complete frame (if any) from the decoder and queues the requests it produces: every    *
+         * frame is recorded, and a valid frame matching the last command also stops the timeout and is passed on     *
+         * for processing. A frame with a bad checksum or not matching the command is otherwise ignored - if no       *
+         * valid response arrives, timeout occurs and the command is retransmitted. It returns false if no complete   *
+         * frame remains.                                                                                             *
+         **************************************************************************************************************/
+        int nFrameLength = 0;
+        CFrameDecoder::FrameStatus frameStatus = m_FrameDecoder.NextFrame ( m_DecodedFrame, nFrameLength );
+        if ( frameStatus == CFrameDecoder::NeedMoreData )
+        {
+            return false;
+        }
+
+        QueueFrame ( LogFrame, m_DecodedFrame, nFrameLength, false, false );
+        if ( frameStatus == CFrameDecoder::ValidFrame                                                 // checksum is OK
+            && IsMatchingResponse ( m_DecodedFrame, m_LastTransmission ))                   // response matches command
+        {
+            QueueTimer ( StopTimer, 0 );
+            ContinueComms ( true, 0 );                                                    // count response received OK
+            TimeResponse();
+            QueueFrame ( ResponseReceived, m_DecodedFrame, nFrameLength, false, false );
+        }
+        return true;
+    }
+
+    void TimeResponse ( void )
+    {
+        /**************************************************************************************************************
+         * This is used when a valid response arrives. A response to a command sent once is timed for m_RttEstimator; *
+         * one to a retransmitted command counts as a recovery, timed from the first timeout. Either way, further     *
+         * responses to the same command (duplicates) aren't counted.                                                 *
+         *                                                                                                            *
+         * The time is also queued (as ResponseTimed or RecoveryTimed) for the owner to record, e.g. in CMetrics.     *
+         **************************************************************************************************************/
+        if ( m_bTiming == false )
+        {
+            return;                                                                  // already timed (or nothing sent)
+        }
+        DWORD dwNow = m_Clock.GetMilliseconds();
+        Request* pRequest = NULL;
+        if ( m_bRetransmitted == true )
+        {
+            m_nRecoveries++;
+            m_nRecoverMilliseconds += ( int )( dwNow - m_dwFirstTimeout );
+            pRequest = QueueRequest ( RecoveryTimed );
+            pRequest->Milliseconds = ( int )( dwNow - m_dwFirstTimeout );
+        }
+        else
+        {
+            m_RttEstimator.AddSample ( m_LastTransmission [ 2 ], ( int )( dwNow - m_dwTransmitted ),
+                m_nLastTransmission );
+            pRequest = QueueRequest ( ResponseTimed );
+            pRequest->Milliseconds = ( int )( dwNow - m_dwTransmitted );
+        }
+        pRequest->Command = m_LastTransmission [ 2 ];
+        m_bTiming = false;
+        m_bRetransmitted = false;
+    }
+
+    Request* QueueRequest ( RequestType Type )
+    {
+        /**************************************************************************************************************
+         * This appends a request of the specified type to the queue and returns it for the caller to fill in. The    *
+         * owner drains the queue after every call, so at most a handful of requests are ever queued at once.         *
+         **************************************************************************************************************/
+        if ( m_nQueueCount == PROTELENGINE_QUEUESIZE )
+        {
+            m_nQueueHead = ( m_nQueueHead + 1 ) & ( PROTELENGINE_QUEUESIZE - 1 );  // should never happen - drop oldest
+            m_nQueueCount--;
+        }
+        Request* pRequest = &m_Queue [ ( m_nQueueHead + m_nQueueCount ) & ( PROTELENGINE_QUEUESIZE - 1 ) ];
+        m_nQueueCount++;
+        pRequest->Type = Type;
+        pRequest->Transmit = false;
+        pRequest->Retransmit = false;
+        pRequest->Command = 0;
+        pRequest->Milliseconds = 0;
+        pRequest->FrameLength = 0;
+        return pRequest;
+    }
+
+    void QueueFrame ( RequestType Type, BYTE* pFrame, int FrameLength, bool Transmit, bool Retransmit )
+    {
+        Request* pRequest = QueueRequest ( Type );
+        pRequest->Transmit = Transmit;
+        pRequest->Retransmit = Retransmit;
+        pRequest->FrameLength = FrameLength;
+        CopyMemory ( pRequest->Frame, pFrame, FrameLength );
+    }
+
+    void QueueTimer ( RequestType Type, int Milliseconds )
+    {
+        QueueRequest ( Type )->Milliseconds = Milliseconds;
+    }
+
+    CFrameDecoder m_FrameDecoder;                              // splits received data into frames - see FrameDecoder.h
+    BYTE m_DecodedFrame [ FRAMEDECODER_MAXFRAME ];                                       // frame most recently decoded
+
+    Request m_Queue [ PROTELENGINE_QUEUESIZE ];                                       // requests waiting for the owner
+    int m_nQueueHead;                                                                     // index in m_Queue of oldest
+    int m_nQueueCount;                                                                 // number of requests in m_Queue
+
+    int m_nLastTransmission;                                                            // length of m_LastTransmission
+    BYTE m_LastTransmission [ FRAMEDECODER_MAXFRAME ];                     // last command transmitted (for Retransmit)
+    int m_nCommsErrs;                                                    // errors count, maintained by ContinueComms()
+    int m_nReXmitFailCountPercall;                                                // number of retransmits in this call
+    int m_nReXmitFailCountPercmd;                                              // number of retransmits of this command
+    BYTE m_nLastCmd;                                                               // last command retransmitted (or 0)
+
+    CEngineClock& m_Clock;                                                       // times responses - see EngineClock.h
+    CRttEstimator m_RttEstimator;                                     // chooses response timeouts - see RttEstimator.h
+    bool m_bTiming;                                               // TRUE until the last command's first valid response
+    DWORD m_dwTransmitted;                                                  // m_Clock when last command was first sent
+    DWORD m_dwFirstTimeout;                                                  // m_Clock when it was first retransmitted
+    bool m_bRetransmitted;                                           // TRUE if the last command has been retransmitted
+    int m_nRetransmits;                                                                      // retransmits since Reset
+    int m_nRecoveries;                                                  // responses received to retransmitted commands
+    int m_nRecoverMilliseconds;                                     // total time from first timeout to those responses
+ };
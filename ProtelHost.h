@@ -8,8 +8,12 @@
  * Overview of command/response process:                                                                              *
  *                                                                                                                    *
  * The derived class establishes a connection with the auditor, then calls ProtelHost::Transmit_I_Command. This       *
- * prepares the I command, sets up a response timeout according to the derived class GetWaitSeconds, then sends it to *
- * the auditor using the derived class Send method.                                                                   *
+ * prepares the I command, sets up a response timeout (adapted to the auditor's response times, up to the derived      *
+ * class GetWaitSeconds), then sends it to the auditor using the derived class Send method.                           *
+ *                                                                                                                    *
+ * The framing, response matching and retransmit rules are in CProtelEngine (see ProtelEngine.h), which doesn't do    *
+ * any I/O itself but returns requests (send, log, start or stop the timeout, etc.). DispatchRequests carries these   *
+ * out using the derived class Send, the database and m_hTimer.                                                       *
  *                                                                                                                    *
  * The derived class is responsible for getting the response data while monitoring for timeout or disconnection. Data *
  * received is passed to ProtelHost::MessageReceived. Once a valid response is completed, MessageReceived calls a     *
@@ -20,6 +24,12 @@
  * MessageReceived ignores a response without a valid checksum. If/when timeout occurs, the derived class can use     *
  * ProtelHost::Retransmit to send the previous command again.                                                         *
  *                                                                                                                    *
+ * The derived class calls CountSession when a call connects and CloseDevice counts it ended. Along the way, the      *
+ * phases reached, F and E responses, retransmits and bytes moved are counted in CMetrics (see Metrics.h).            *
+ *                                                                                                                    *
+ * Each command/response exchange, Database_* method, device lookup and wait is recorded as a span in m_Timeline, so  *
+ * the time a slow call took can be put down to the link, the database or waiting (see CallTimeline.h).               *
+ *                                                                                                                    *
  * Commands are:                                                                                                      *
  *  A - abort communications                                                                                          *
  *  C - configuration packet for auditor/slaves                                                                       *
@@ -46,15 +56,31 @@
 #pragma once
 
 #include "AdoConnection.h"
+#include "AdoConnectionPool.h"
+#include "CallTimeline.h"
+#include "Checksum.h"
+#include "DevicePrefetch.h"
+#include "DexWriter.h"
 #include "EventTrace.h"
+#include "FrameLogWriter.h"
+#include "Metrics.h"
 #include "ProtelDevice.h"
+#include "ProtelEngine.h"
 #include "variantBlob.h"
 
 #define _SECOND 10000000                                                           // multiplier for SetWaitableTimer
-#define	MAXFAILCOUNTPERCALL  4				// Max fail responses per call b4 hangup
-#define MAXFAILCOUNTPERCMD  3				// Max fail responses per cmd b4 hangup
+#define _MILLISECOND 10000                                                                                   // (ditto)
 //#define __WAIT_TIME__ 4
 
+class CTickClock : public CEngineClock
+ {
+public:
+    virtual DWORD GetMilliseconds ( void )                                    // the engines' clock (see EngineClock.h)
+    {
+        return GetTickCount();
+    }
+ };
+
 class CProtelHost
  {
 protected:
@@ -121,18 +147,24 @@ protected:
 
     HANDLE m_hShutDown;                                                      // inherited, used by derived classes only
     HANDLE m_hTimer;                       // response timeout, set by ProtelHost, created and checked by derived class
-    int m_nMessageBufferOffset;                                           // position in szMessageBuffer for next chunk
-    BYTE m_szMessageBuffer [ 4096 ];                                                  // holds entire received response
+    CTickClock m_TickClock;                                                         // times m_ProtelEngine's responses
+    CProtelEngine m_ProtelEngine;                      // framing, matching responses, retransmits - see ProtelEngine.h
+    bool m_bDispatching;                                                   // TRUE while DispatchRequests is running
+    bool m_bSessionCounted;                                 // TRUE while this call is counted as a session in CMetrics
+    DWORD m_dwPhases;                               // bit per command (A = bit 0) whose response this call has counted
+    int m_nBytesUp;                                                           // received from the auditor in this call
+    int m_nBytesDown;                                                               // sent to the auditor in this call
+    CCallTimeline m_Timeline;                                                // spans of this call - see CallTimeline.h
+    BYTE m_szMessageBuffer [ FRAMEDECODER_MAXFRAME ];                     // holds entire received response (one frame)
     BYTE m_szPayload [ 4096 ];                                // command or response data (without command or checksum)
-    BYTE m_transmitBuffer [ 4096 ];                                              // could this be local to Transmit????
-    CAdoConnection* m_padoConnection;
-
-    int m_nLastTransmission;                                                            // length of m_LastTransmission
-    BYTE m_LastTransmission [ 4096 ];            // last command transmitted (used by Retransmit, also by ProtelSerial)
-    int m_nCommsErrs;                                                    // errors count, maintained by ContinueComms()
-	int m_nReXmitFailCountPercall;			// number of "F" received per call b4 hanging up call (max = 5)
-	int m_nReXmitFailCountPercmd;			// number of "F" received per command b4 hanging up call (max = 3)
-	BYTE m_nLastCmd;						// last transmitted command
+    CDexCall* m_pDexCall;                          // DEX records of this call queued with CDexWriter (see DexWriter.h)
+    int m_nDexRecords;                              // DEX records received since the upload started (first U response)
+    DWORD m_dwDexStarted;                                                     // when the upload started (GetTickCount)
+    DWORD m_dwDexLastRecord;                                 // when the last record (ffff) was received (GetTickCount)
+    CDevicePlan* m_pDevicePlans [ 32 ];                 // devices queued with CDevicePrefetcher (see DevicePrefetch.h)
+    int m_nDevicePlans;                                                        // number used in m_pDevicePlans (above)
+    bool m_bDevicePlanKnown;                      // TRUE once every device's downloads are known (see AwaitDevicePlan)
+    DWORD m_dwDevicePlanRequested;                              // when the last N response was received (GetTickCount)
 
     CEventTrace m_EventTrace;                                                      // records events - see EventTrace.h
 
@@ -171,23 +203,24 @@ protected:
 public:
     CProtelHost(HANDLE hShutDown) :
         Closed ( false ),                      // this is an initialization list which sets members to specified values
+        SessionId ( 0 ),
         m_hShutDown ( hShutDown ),
-        m_nLastTransmission ( 0 ),
-        m_nMessageBufferOffset ( 0 ),
+        m_ProtelEngine ( m_TickClock ),
+        m_bDispatching ( false ),
+        m_bSessionCounted ( false ),
         m_NormalShutdown ( true ),
         Download2ndConfiguration ( false ),
         CallNumber ( 0 ),
         dCallStartTime (( double ) 0 ),
         m_nReasonPinging ( ReasonPinging::NotPinging ),
-        m_padoConnection ( NULL )
+        m_pDexCall ( NULL ),
+        m_nDevicePlans ( 0 )
     {
         /**************************************************************************************************************
          * CONSTRUCTOR.                                                                                               *
          **************************************************************************************************************/
         ZeroMemory ( m_szMessageBuffer, sizeof ( m_szMessageBuffer ));
         ZeroMemory ( m_szPayload, sizeof ( m_szPayload ));
-        ZeroMemory ( m_transmitBuffer, sizeof ( m_transmitBuffer ));
-        ZeroMemory ( m_LastTransmission, sizeof ( m_LastTransmission ));
         ZeroMemory ( m_szCurrentCommand, sizeof ( m_szCurrentCommand ));
         for ( int nLoop = 0; nLoop < ( sizeof ( m_pProtelDevices ) / sizeof ( m_pProtelDevices[ 0 ] )); nLoop++ )
         {
@@ -197,6 +230,7 @@ public:
         m_hTimer = NULL;
 
         //m_EventTrace.Event( CEventTrace::Details, "CProtelHost::CProtelHost(void)" );
+        CCallTracer::Instance().Add ( m_Timeline );
         Initialize();
     }
 
@@ -205,17 +239,20 @@ public:
         /**************************************************************************************************************
          * DESTRUCTOR.                                                                                                *
          **************************************************************************************************************/
+        CountSession ( false );
         if ( m_hTimer != NULL )
         {
             CloseHandle ( m_hTimer );
             m_hTimer = NULL;
         }
+        CancelDevicePlans();                                  // CDevicePrefetcher mustn't touch the devices after this
         CleanupProtelDevices();                                                                       // delete devices
-        if ( m_padoConnection != NULL )
+        if ( m_pDexCall != NULL )
         {
-            delete m_padoConnection;
-            m_padoConnection = NULL;
+            m_pDexCall->Release();                                           // deleted once CDexWriter is done with it
+            m_pDexCall = NULL;
         }
+        CCallTracer::Instance().Remove ( m_Timeline );
     }
 
     virtual void Send(LPBYTE pszBuffer, int BufferLength)                   // overridden by ProtelSerial or ProtelHost
@@ -229,6 +266,7 @@ public:
     }
 
     bool Closed;                                                    // set by CProtelSocket::SocketThreadProc when done
+    LONG SessionId;                                                       // set by CProtelList::Add (see ProtelList.h)
 
 protected:
     void MessageReceived ( BYTE* pBuffer, int bytesRead )
@@ -241,232 +279,188 @@ protected:
          * the derived class (e.g. CProtelSocket::Send).                                                              *
          **************************************************************************************************************/
         m_EventTrace.HexDump( CEventTrace::Details, pBuffer, bytesRead );
+        m_nBytesUp += bytesRead;
+        CMetrics::Instance().CountBytes ( bytesRead, 0 );
 
-        if ( m_nMessageBufferOffset == 0 && pBuffer[0] != 'T' )
+        while ( bytesRead > 0 )
         {
             /*
-             * This was the first response data received. It doesn't start with 'T' - perhaps there was line noise.
-             * We look for a 'T' later on.
+             * We pass as much of the received data as the engine will accept, then carry out everything it asks for
+             * as a result (recording each frame, processing a matching response, etc.). Any partial frame left over
+             * is kept by the engine until more data arrives.
              */
-            BYTE* Tpos = ( BYTE* ) StrChr(( LPCTSTR ) pBuffer, 'T' );
-            if ( Tpos == NULL )
-                return;                                                             // T not found, ignore all the data
-
-            /*
-             * We found the T. We ignore all data preceding it (i.e. noise).
-             */
-            bytesRead -= Tpos - pBuffer;
-            pBuffer = Tpos;
+            int nWritten = m_ProtelEngine.Write ( pBuffer, bytesRead );
+            pBuffer += nWritten;
+            bytesRead -= nWritten;
+            DispatchRequests();
         }
+    }
 
-        if ( m_nMessageBufferOffset + bytesRead > sizeof(m_szMessageBuffer) )
+    void DispatchRequests ( void )
+    {
+        /**************************************************************************************************************
+         * This carries out each request queued by m_ProtelEngine until there are none left. It is called whenever    *
+         * something has been passed to the engine.                                                                   *
+         *                                                                                                            *
+         * Processing a response normally transmits the next command, which queues more requests while we are still   *
+         * in the loop below. The nested call just returns and the loop carries them out in turn, so the commands     *
+         * are sent in the order they were transmitted.                                                               *
+         **************************************************************************************************************/
+        if ( m_bDispatching == true )
         {
-            /*
-             * The received data would overflow the buffer. We limit it to what will fit.
-             */
-            bytesRead = sizeof m_szMessageBuffer - m_nMessageBufferOffset;
+            return;                                                      // an outer call is already draining the queue
         }
+        m_bDispatching = true;
 
-        /*
-         * We append the received bytes to this class' message buffer and add them to the count.
-         */
-        MoveMemory ( m_szMessageBuffer + m_nMessageBufferOffset, pBuffer, bytesRead );
-        m_nMessageBufferOffset += bytesRead;
-        if ( m_nMessageBufferOffset >= 3
-            && m_szMessageBuffer[1] <= ( m_nMessageBufferOffset - 3 ) ) // full message (incl T, length, csum) received
-        {
-            Database_CommunicationsData ( false, false, m_szMessageBuffer, m_nMessageBufferOffset );
-                                                                                     // record in COMM_SERVER_LOG, etc.
-            if (m_nMessageBufferOffset >= 4                         // message long enough to include command character
-                && IsValidChecksum( m_szMessageBuffer, m_szMessageBuffer[ 1 ] + 3 )                   // checksum is OK
-                && IsMatchingResponse( m_szMessageBuffer, m_LastTransmission))              // response matches command
+        CProtelEngine::Request request;
+        while ( m_ProtelEngine.NextRequest ( request ))
+        {
+            switch ( request.Type )
             {
-                /*
-                 * We got a valid response.
-                 */
-                CancelTimer( m_hTimer );                                                            // stop the timeout
-                ContinueComms( true );                                                    // count response received OK
-                //Database_Dialog ( false, m_szMessageBuffer, m_szMessageBuffer[1]+3 );  // doesn't appear to do anything
-                int nPayloadLength = m_szMessageBuffer[1] - 1;                         // payload excludes command byte
-                ZeroMemory ( m_szPayload, sizeof ( m_szPayload ));
-                MoveMemory ( m_szPayload, m_szMessageBuffer + 3, nPayloadLength );
-
-                switch ( m_szMessageBuffer[2] )                                                  // process the command
-                {
-                    // Abort command
-                    case 'A':
-                        Process_A_Response();
-                        break;
-
-                    // Configuration file
-                    case 'C':
-                        Process_C_Response();
-                        break;
-
-                    // Dump (erase) ram
-                    case 'D':
-                        Process_D_Response();
-                        break;
-
-                    // Application Layer error
-                    case 'E':
-                        ProcessApplicationLayerError( m_szPayload [ 0 ]);
-                        break;
-
-                    // Link Control Layer error
-                    case 'F':
-                        //ContinueComms( false );             // count an error - could cause disconnect on later timeout
-						if (maxretranAcmd <= (MAXFAILCOUNTPERCALL - 1))
-						{
-						maxretranAcmd++;
-                        Retransmit();
-                        break;
-						}else
-						{
-							maxretranAcmd = 1;				// reinit counter
-	                        Process_A_Response();			// this should complete the call			
-						}
+                case CProtelEngine::SendFrame:
+                    Send ( request.Frame, request.FrameLength );
+                    m_nBytesDown += request.FrameLength;
+                    CMetrics::Instance().CountBytes ( 0, request.FrameLength );
+                    break;
 
-                    // Identify
-                    case 'I':
-                        Process_I_Response();
-                        break;
-
-                    // New Audit Device Numbers needing configuration
-                    case 'N':
-                        Process_N_Response( nPayloadLength );
-                        break;
-
-                    // Operating system download
-                    case 'O':
-                        Process_O_Response();
-                        break;
-
-                    // Read DEX Data
-                    case 'R':
-                        Process_R_Response();
-                        break;
-
-                    // Status
-                    case 'S':
-                        Process_S_Response();
-                        break;
-
-                    // Time and Date request
-                    case 'T':
-                        break;
-
-                    // Upload DEX files
-                    case 'U':
-                        Process_U_Response ( nPayloadLength );
-                        break;
-
-                    // Free Vend Configuration
-                    case 'V':
-                        Process_V_Response();
-//                            bug_buf[8] = (BYTE) 'V';                                                      //diagnostics!!!!
-//                            m_EventTrace.HexDump( CEventTrace::Details, bug_ptr, bug_len );
-                        break;
+                case CProtelEngine::LogFrame:
+                    Database_CommunicationsData (
+                        request.Transmit, request.Retransmit, request.Frame, request.FrameLength );
+                    break;
 
-                    // Remove remote
-                    case 'X':
-                        break;
+                case CProtelEngine::StartTimer:
+                    SetTimeoutTimer( m_hTimer, request.Milliseconds );
+                    break;
 
-                    // Ping
-                    case 'Z':
-                        Process_Z_Response( nPayloadLength );
-                        break;
-                }
-            }
-            else
-            {
-                /*
-                 * The response appeared to be complete but was invalid (bad checksum, too short or not matching the
-                 * command). We start looking for a new sync character (T).
-                 *
-                 * Note: if the response didn't match the command, it is ignored and we keep looking for a valid
-                 * response until timeout occurs. If more responses are received that don't match, they will be
-                 * ignored too but they get purged from the communications channel. If/when timeout occurs, the last
-                 * command is retransmitted and eventually the matching response should be seen.
-                 */
-                m_nMessageBufferOffset = 0;
+                case CProtelEngine::StopTimer:
+                    CancelTimer( m_hTimer );
+                    break;
+
+                case CProtelEngine::ResponseReceived:
+                    ZeroMemory ( m_szMessageBuffer, sizeof ( m_szMessageBuffer ));
+                    CopyMemory ( m_szMessageBuffer, request.Frame, request.FrameLength );
+                    ProcessResponse();
+                    break;
+
+                case CProtelEngine::AbortCall:
+                    Transmit_A_Command ( false );                                               // too many retransmits
+                    break;
+
+                case CProtelEngine::ResponseTimed:
+                    CMetrics::Instance().ObserveResponse ( request.Command, request.Milliseconds );
+                    break;
+
+                case CProtelEngine::RecoveryTimed:
+                    CMetrics::Instance().ObserveRecovery ( request.Command, request.Milliseconds );
+                    break;
             }
         }
+        m_bDispatching = false;
     }
 
-    bool IsValidChecksum ( BYTE* Buffer, int BufferLength )
+    void ProcessResponse ( void )
     {
         /**************************************************************************************************************
-         * This returns true if the checksum of a message in Buffer of Length bytes, including the sync character and *
-         * checksum position, is valid.                                                                               *
+         * This is called by DispatchRequests (above) once a complete response with a valid checksum that matches     *
+         * the last command transmitted is in m_szMessageBuffer (the engine has already stopped the timeout). It      *
+         * calls a function according to the command to process it - this normally transmits the next command.        *
          **************************************************************************************************************/
-        unsigned char Checksum = CalculateChecksum( Buffer, BufferLength );
-        if (Checksum == *( Buffer + BufferLength - 1 ))
+        //Database_Dialog ( false, m_szMessageBuffer, m_szMessageBuffer[1]+3 );  // doesn't appear to do anything
+        int nPayloadLength = m_szMessageBuffer[1] - 1;                                 // payload excludes command byte
+        ZeroMemory ( m_szPayload, sizeof ( m_szPayload ));
+        MoveMemory ( m_szPayload, m_szMessageBuffer + 3, nPayloadLength );
+        CountResponse ( m_szMessageBuffer[2] );
+        if ( m_szMessageBuffer[2] != 'F' )
         {
-            return true;
+            m_Timeline.Answered ( m_szMessageBuffer[2] );                     // an F response is retransmitted instead
         }
-        return false;
-    }
-
-    bool IsMatchingResponse ( BYTE* Response, BYTE* Command )
-    {
-        /**************************************************************************************************************
-         * This returns true if Response, including any address or packet number, matches the command in Command.     *
-         **************************************************************************************************************/
-        unsigned char Cmd = Response[2];                                       // the command character in the response
 
-        if ( Cmd == 'E' || Cmd == 'F' )
+        switch ( m_szMessageBuffer[2] )                                                          // process the command
         {
-            return true;                                                  // it was an error response - always accepted
-        }
+            // Abort command
+            case 'A':
+                Process_A_Response();
+                break;
 
-        if ( Cmd != Command[2] )
-        {
-            return false;                                                     // the command doesn't match what we sent
-        }
+            // Configuration file
+            case 'C':
+                Process_C_Response();
+                break;
 
-        if ( Cmd == 'R' || Cmd == 'T' )
-        {
-            return Response[3] == Command[3];      // DEX or Time from specific slave: OK if the 1 byte address matches
-        }
+            // Dump (erase) ram
+            case 'D':
+                Process_D_Response();
+                break;
 
-        else if ((Cmd == 'N' || Cmd == 'U') && Response[3] == 0xff && Response[4] == 0xff )
-        {
-            return true;                                                 // Slave list or DEX: Packet ffff is always OK
-        }
+            // Application Layer error
+            case 'E':
+                ProcessApplicationLayerError( m_szPayload [ 0 ]);
+                break;
 
-        else if ( Cmd == 'C' || Cmd == 'N' || Cmd == 'O' || Cmd == 'U' )
-        {
-            return Response[3] == Command[3] && Response[4] == Command[4];
-                                  // Configuration, slave list, firmware or DEX: OK if the 2 byte packet number matches
-        }
+            // Link Control Layer error
+            case 'F':
+                //ContinueComms( false );             // count an error - could cause disconnect on later timeout
+						if (maxretranAcmd <= (MAXFAILCOUNTPERCALL - 1))
+						{
+						maxretranAcmd++;
+                Retransmit();
+                break;
+						}else
+						{
+							maxretranAcmd = 1;				// reinit counter
+	                        Process_A_Response();			// this should complete the call			
+						}
 
-        return true;                              // Other commands: OK - command doesn't have address or packet number
-    }
+            // Identify
+            case 'I':
+                Process_I_Response();
+                break;
 
-    unsigned char CalculateChecksum ( BYTE* Buffer, int Length )
-    {
-        /**************************************************************************************************************
-         * This returns the valid/expected checksum for a message in Buffer of Length bytes, including the sync       *
-         * character and checksum position.                                                                           *
-         **************************************************************************************************************/
-        long BufferSum = 0;
-        for (int nOffset = 0; nOffset < (Length - 1); nOffset++)
-        {
-            BufferSum += *( Buffer + nOffset );
-        }
-        long bitwiseNOT = ~BufferSum;
-        return ((unsigned char)(bitwiseNOT & 0x000000ff));
-    }
+            // New Audit Device Numbers needing configuration
+            case 'N':
+                Process_N_Response( nPayloadLength );
+                break;
 
-    void ResetReceivedBuffer ( void )
-    {
-        /**************************************************************************************************************
-         * This is used when transmitting a message to clear the received message buffer in preparation for receiving *
-         * the response.                                                                                              *
-         **************************************************************************************************************/
-        ZeroMemory ( m_szMessageBuffer, sizeof ( m_szMessageBuffer ));
-        m_nMessageBufferOffset = 0;
+            // Operating system download
+            case 'O':
+                Process_O_Response();
+                break;
+
+            // Read DEX Data
+            case 'R':
+                Process_R_Response();
+                break;
+
+            // Status
+            case 'S':
+                Process_S_Response();
+                break;
+
+            // Time and Date request
+            case 'T':
+                break;
+
+            // Upload DEX files
+            case 'U':
+                Process_U_Response ( nPayloadLength );
+                break;
+
+            // Free Vend Configuration
+            case 'V':
+                Process_V_Response();
+//                            bug_buf[8] = (BYTE) 'V';                                                      //diagnostics!!!!
+//                            m_EventTrace.HexDump( CEventTrace::Details, bug_ptr, bug_len );
+                break;
+
+            // Remove remote
+            case 'X':
+                break;
+
+            // Ping
+            case 'Z':
+                Process_Z_Response( nPayloadLength );
+                break;
+        }
     }
 
     virtual void Initialize ( void )
@@ -475,17 +469,14 @@ protected:
          * This is called from the class constructor and again from ProtelSerial or ProtelSocket Initialize method    *
          * when a new connection is made.                                                                             *
          **************************************************************************************************************/
-        m_nMessageBufferOffset = 0;
+        m_ProtelEngine.Reset();
+        m_Timeline.Begin();
+        m_dwPhases = 0;
+        m_nBytesUp = 0;
+        m_nBytesDown = 0;
         ZeroMemory ( m_szMessageBuffer, sizeof ( m_szMessageBuffer ));
         ZeroMemory ( m_szPayload, sizeof ( m_szPayload ));
-        ZeroMemory ( m_transmitBuffer, sizeof ( m_transmitBuffer ));
-
-        m_nLastTransmission = 0;
-        ZeroMemory ( m_LastTransmission, sizeof ( m_LastTransmission ));
-        m_nCommsErrs = 0;
-		m_nReXmitFailCountPercall = 0;
-		m_nReXmitFailCountPercmd = 0;
-		m_nLastCmd = (BYTE)"";
+
 		FailThisCall = false;					
 
         ZeroMemory ( m_SerialNumber, sizeof ( m_SerialNumber ));
@@ -511,6 +502,15 @@ protected:
         ZeroMemory ( m_ActiveSerialNumber, sizeof ( m_ActiveSerialNumber ));
         m_NormalShutdown = true;
 		maxretranAcmd = 1;
+        if ( m_pDexCall != NULL )
+        {
+            m_pDexCall->Release();                                           // deleted once CDexWriter is done with it
+            m_pDexCall = NULL;
+        }
+        m_nDexRecords = 0;
+        CancelDevicePlans();                               // CDevicePrefetcher mustn't touch the devices deleted below
+        m_bDevicePlanKnown = false;
+        m_dwDevicePlanRequested = 0;
 
         protelCallFlag = ProtelCallFlag::ProcessNormally;
         Download2ndConfiguration = false;
@@ -518,42 +518,6 @@ protected:
         m_NormalShutdown = true;                                                                  // is this needed????
         protelCallFlag = ProtelCallFlag::ProcessNormally;                                         // is this needed????
 
-        /*
-         * We delete any existing database connection, then create and open a new one as specified by the connection
-         * string in the .INI file.
-         */
-        if ( m_padoConnection != NULL )
-        {
-            delete m_padoConnection;
-            m_padoConnection = NULL;
-        }
-        CProfileValues profileValues;
-        m_padoConnection = new CAdoConnection;
-
-        /*
-         * We open the connection to the database. If this fails (because the database is busy), we wait 1 second and
-         * retry. We make up to 10 tries, then delete the connection entirely.
-         */
-        int tries = 10;
-        do
-        {
-            if ( m_padoConnection->ConnectionStringOpen( profileValues.GetConnectionString()) == true )
-            {
-                break;                                                                          // connection opened OK
-            }
-            else if (--tries)
-            {
-                Sleep(1000);                                                    // failed - wait 1 second and try again
-            }
-            else
-            {
-                delete m_padoConnection;                                                                   // giving up
-                m_padoConnection = NULL;
-            }
-//		PKG_COMM_SERVER.addSysLogRecAutonomous ( pi_text varchar2 )
-        }
-        while ( m_padoConnection != NULL);
-
         //CancelWaitableTimer( m_hTimer );
         CancelTimer( m_hTimer );
 
@@ -571,10 +535,10 @@ protected:
         CleanupProtelDevices();                                                          // delete any existing devices
         for ( int nLoop = 0; nLoop < ( sizeof ( m_pProtelDevices ) / sizeof ( m_pProtelDevices[ 0 ] )); nLoop++ )
         {
-            m_pProtelDevices[ nLoop ] = new CProtelDevice ( m_padoConnection );
+            m_pProtelDevices[ nLoop ] = new CProtelDevice();
         }
 
-        bool frmDB =  m_padoConnection->WriteLogDB(m_padoConnection, "A system init has completed");
+        bool frmDB =  WriteLogDB("A system init has completed");
     }
 
     bool Transmit_A_Command ( bool NormalShutdown )                                      // Abort or end communications
@@ -588,7 +552,7 @@ protected:
 
     void Process_A_Response ( void )
     {
-        bool frmDB =  m_padoConnection->WriteLogDB(m_padoConnection, "End of a monitor call. A cmd recieved");
+        bool frmDB =  WriteLogDB("End of a monitor call. A cmd recieved");
 		if (m_NormalShutdown == true)
 			CloseDevice(1);		//call successfull disconnect
 		else
@@ -602,6 +566,7 @@ protected:
 
     bool Transmit_C_Command ( void )                                                              // Send configuration
     {
+        AwaitDevicePlan();                                         // no wait unless a device plan is still outstanding
         BYTE* pBuffer = NULL;
 
         long nLength = 0;
@@ -670,7 +635,7 @@ protected:
 		//m_pProtelDevices [ m_nCurrentAuditDevice ]->SetNewConfigurationLength(nLength - 4);
 		//m_pProtelDevices [ m_nCurrentAuditDevice ]->setNewConfig(m_pConfiguration + 4, nLength - 4);
             //m_EventTrace.Event( CEventTrace::Information, "void CProtelHost::3Transmit_C_Command [%d](%d)",1,1);
-        Transmit( 'C', pBuffer, nLength );
+        Transmit( 'C', pBuffer, nLength, m_pProtelDevices [ m_nCurrentAuditDevice ]->PacketSum );
             //m_EventTrace.Event( CEventTrace::Information, "void CProtelHost::4Transmit_C_Command [%d](%d)",1,1);
   //      if ( m_pConfiguration[ 3 ] == 0xff && m_pConfiguration[ 4 ] == 0xff )       // this was the last packet
 		//{
@@ -701,7 +666,8 @@ protected:
 		}
 		else
 		{
-        Transmit_O_Command();
+        m_Timeline.Await ( CCallTimeline::Waiting, "DevicePlanBarrier" );
+        DevicePlanBarrier();                                                          // once the devices are looked up
 		}
     }
 
@@ -808,6 +774,17 @@ protected:
 		{
 			GetUncorruptedSerial(m_SerialNumber);
 		}
+        m_Timeline.Identify ( CallNumber, m_SerialNumber, GetPort());                    // tags the spans of this call
+
+        /*
+         * Now we know which master auditor this is, we start timing responses from what was learned on its last call.
+         */
+        int nSmoothedRtt = 0;
+        int nRttVariance = 0;
+        if ( CRttHistory::Instance().Lookup ( m_SerialNumber, nSmoothedRtt, nRttVariance ) == true )
+        {
+            m_ProtelEngine.SeedRtt ( nSmoothedRtt, nRttVariance );
+        }
         /*
          * We set the central auditor serial number, call start time and call number for all devices controlled by
          * this central auditor.
@@ -818,7 +795,7 @@ protected:
             m_pProtelDevices[ nLoop ]->CallStartTime = dCallStartTime;
             m_pProtelDevices[ nLoop ]->CallNumber = CallNumber;
         }
-        bool frmDB =  m_padoConnection->WriteLogDB(m_padoConnection, "Recieved the I cmd from monitor");
+        bool frmDB =  WriteLogDB("Recieved the I cmd from monitor");
 
 		if ( protelCallFlag == ProtelCallFlag::HangupImmediately ) // PKG_COMM_SERVER.CENTRAL_AUDITOR presently never sets this
         {
@@ -845,6 +822,7 @@ protected:
 		bool a_corrupt_serial = false;					// looking for corrupt serial
 		char szSerialNumber11[64];
 		int serialLen = 8;	//char len of serial number
+        int nFirstDevice = m_nAuditDevices;                                          // the first device in this packet
 
         while ( Offset < nPayloadLength
             && m_nAuditDevices < ( sizeof ( m_pProtelDevices ) / sizeof ( m_pProtelDevices[ 0 ] )))  // check added!!!!
@@ -861,7 +839,7 @@ protected:
             dbstatus = m_pProtelDevices[ m_nAuditDevices ]->AuditDevice = ( m_szPayload + Offset );
 			MoveMemory ( szSerialNumber11, (m_szPayload + Offset), serialLen );	//get memory from payload
 
-			bool frmDB =  m_padoConnection->WriteLogDB(m_padoConnection, "monitors found: ");
+			bool frmDB =  WriteLogDB("monitors found: ");
 			
 			if (dbstatus == true)		// This is to catch any corrupted serial
 			{							// we have discovered several monitors with the serial corrupted
@@ -885,7 +863,7 @@ protected:
    //             m_nDexFileRemoteAddress = 0;            // DEX data will be from the host itself
 			//	FailThisCall = true;					// bad cardreader serial number
 			//	Transmit_U_Command( 1 );
-			//bool frmDB =  m_padoConnection->WriteLogDB(m_padoConnection, " Process_n_response dbstatus == false: ");
+			//bool frmDB =  WriteLogDB(" Process_n_response dbstatus == false: ");
 			//	//CloseDevice ( 0 );
 			//	return;
 			}	
@@ -893,87 +871,24 @@ protected:
             Offset += sizeof ( AuditDevice );
         }
 
-        int indxOfFBMonitor = -5;
+        /*
+         * We hand this packet's devices to CDevicePrefetcher to look up while we carry on (see DevicePrefetch.h).
+         */
+        PrefetchDevicePlan ( nFirstDevice );
+
         if ( m_szPayload[ 0 ] == 0xff && m_szPayload[ 1 ] == 0xff )                         // this was the last packet
         {
-            for ( int nAuditDevice = 0; nAuditDevice < m_nAuditDevices; nAuditDevice++ )
-            {
-                m_pProtelDevices[ nAuditDevice ]->GetConfiguration();
-                m_pProtelDevices[ nAuditDevice ]->GetFirmware();
-                indxOfFBMonitor = m_pProtelDevices[ nAuditDevice ]->GetFreeBee();
-                if (indxOfFBMonitor >= 0)
-                {                                                  // get index of freebee/audit in proteldevices array
-                    m_pProtelDevices[ nAuditDevice ]->FreeBeeAuditDeviceidx = nAuditDevice;
-                    indxOfFBMonitor = -1;                                                                      // reset
-                }
-            }
-
-            /*
-             * For each device, we check if there are any later ones that require an identical configuration. If so,
-             * we mark them as having a duplicate configuration and add them to the list of devices to be configured
-             * along with this one.
-             */
-            for ( int nAuditDevice = 0; nAuditDevice < m_nAuditDevices; nAuditDevice++ )
-            {
-                __int64 ConfigurationChecksum = m_pProtelDevices[ nAuditDevice ]->ConfigurationChecksum;
-                for ( int nAuditDevice2 = ( nAuditDevice + 1 ); nAuditDevice2 < m_nAuditDevices; nAuditDevice2++ )
-                {
-                    if ( m_pProtelDevices[ nAuditDevice ]->ConfigurationLength == m_pProtelDevices[ nAuditDevice2 ]->ConfigurationLength ) // Were both nAuditDevice!!!!
-                    {
-                        if ( m_pProtelDevices[ nAuditDevice2 ]->ConfigurationChecksum == ConfigurationChecksum )
-                        {
-                            m_pProtelDevices[ nAuditDevice2 ]->ConfigurationDuplicate = true;
-                            m_pProtelDevices[ nAuditDevice ]->AddConfigurationDuplicate( m_pProtelDevices[ nAuditDevice2 ]->Address );
-                        }
-                    }
-                }
-            }
-
             /*
-             * We find devices with a non-zero firmware length.
+             * We need to know which devices need configuration, firmware or a freebee download before the first O
+             * command. If they are being looked up by CDevicePrefetcher and there is DEX data to upload, we start the
+             * upload straight away and wait for them once it is done (see DevicePlanBarrier).
              */
-            bool firstDownload = true;
-            for ( int nAuditDevice = 0; nAuditDevice < m_nAuditDevices; nAuditDevice++ )
+            m_dwDevicePlanRequested = GetTickCount();
+            if ( m_nDevicePlans == 0 )
             {
-
-                if ( m_pProtelDevices[ nAuditDevice ]->FirmwareLength > 0 )
-                {
-                    if ( firstDownload == true )
-                    {
-                        /*
-                         * This is the first such device. we check if there are any later ones that require identical
-                         * firmware. If so, we mark them as having duplicate firmware and add them to the list of
-                         * devices to receive the firmware along with this one.
-                         */
-                        firstDownload = false;
-                        __int64 FirmwareCheckSum = m_pProtelDevices[ nAuditDevice ]->FirmwareChecksum;
-                        for ( int nAuditDevice2 = ( nAuditDevice + 1 ); nAuditDevice2 < m_nAuditDevices; nAuditDevice2++ )
-                        {
-                            if ( m_pProtelDevices[ nAuditDevice ]->FirmwareLength == m_pProtelDevices[ nAuditDevice2 ]->FirmwareLength ) // Were both nAuditDevice!!!!
-                            {
-                                if ( m_pProtelDevices[ nAuditDevice2 ]->FirmwareChecksum == FirmwareCheckSum )
-                                {
-                                    m_pProtelDevices[ nAuditDevice2 ]->FirmwareDuplicate = true;
-                                    m_pProtelDevices[ nAuditDevice ]->AddFirmwareDuplicate( m_pProtelDevices[ nAuditDevice2 ]->Address );
-                                }
-                            }
-                        }
-                    }
-                    else
-                    {
-                        /*
-                         * This is not the first device requiring firmware. Unless its firmware matches that of the
-                         * first device, we mark not to send it during this connection (only one firmware download is
-                         * allowed at a time).
-                         */
-                        if ( m_pProtelDevices[ nAuditDevice ]->FirmwareDuplicate == false )
-                        {
-                            m_pProtelDevices[ nAuditDevice ]->DontDownloadFirmware();
-                        }
-                    }
-                }
+                AwaitDevicePlan();
             }
-        bool frmDB =  m_padoConnection->WriteLogDB(m_padoConnection, "Processing N-command data. Found all monitors attached");
+        bool frmDB =  WriteLogDB("Processing N-command data. Found all monitors attached");
 
             if( RamFull == true || HaveDexFiles == true )
             {
@@ -990,7 +905,8 @@ protected:
             else
             {
 //              Transmit_A_Command(true); // !!!! This was the original sequence
-                Transmit_O_Command();
+                m_Timeline.Await ( CCallTimeline::Waiting, "DevicePlanBarrier" );
+                DevicePlanBarrier();
             }
         }
         else                                                                    // there is another packet - request it
@@ -1002,6 +918,7 @@ protected:
 
     bool Transmit_O_Command ( void )                                                                   // Send firmware
     {
+        AwaitDevicePlan();                                         // no wait unless a device plan is still outstanding
         BYTE* pBuffer = NULL;
         long nLength = 0;
         while ( pBuffer == NULL )
@@ -1035,6 +952,7 @@ protected:
                 Download2ndConfiguration = true;                                        // in case no firmware was sent
                 for ( int nAuditDevice = 0; nAuditDevice < m_nAuditDevices; nAuditDevice++ )
                 {
+                    CTimelineSpan timelineSpan ( m_Timeline, CCallTimeline::Devices, "GetFirmwareOrConfiguration" );
                     m_pProtelDevices[ nAuditDevice ]->GetSecondConfiguration();
                 }
 				//m_EventTrace.Event( CEventTrace::Information, "void CProtelHost::2transmit_O_command [%d](%d)",1,1);
@@ -1054,7 +972,7 @@ protected:
          */
         Download2ndConfiguration = true;
         m_nReasonPinging = ReasonPinging::FirmwareFile;
-        Transmit( 'O', pBuffer, nLength );
+        Transmit( 'O', pBuffer, nLength, m_pProtelDevices [ m_nCurrentAuditDevice ]->PacketSum );
         return true;
     }
 
@@ -1164,15 +1082,37 @@ protected:
     void Process_U_Response ( int nPayloadLength )
     {
         /*
-         * We save the received DEX record in the database. If this was the last record (ffff), we send the D
-         * command, otherwise we request the next record.
+         * We queue the received DEX record to be saved in the database by CDexWriter (see DexWriter.h) or, if it
+         * isn't running, save it ourselves. If this was the last record (ffff), we send the D command once every
+         * record is saved (see DexBarrier), otherwise we request the next record without waiting for the database.
+         * If an earlier record of the call couldn't be saved, there's no point going on, so the call fails.
          */
         int LastPacketNumber = ( m_szPayload[ 0 ] * 256 ) + m_szPayload[ 1 ];
-        Database_DexData ( m_ActiveSerialNumber, CallNumber, LastPacketNumber, m_szPayload + 2, nPayloadLength - 2 );
+        if ( m_nDexRecords++ == 0 )
+        {
+            m_dwDexStarted = GetTickCount();
+        }
+        if ( m_pDexCall != NULL && m_pDexCall->Failed == true )
+        {
+            m_EventTrace.Event ( CEventTrace::Warning, "%s\tDEX record not saved - call failed", GetPort() );
+            CloseDevice(0);                                                    // 0 => send failed call to the database
+            return;
+        }
+        if ( CDexWriter::Instance().Running == true && m_pDexCall == NULL )
+        {
+            m_pDexCall = new CDexCall();
+        }
+        if ( m_pDexCall == NULL || CDexWriter::Instance().Write ( m_pDexCall, CallNumber, dCallStartTime,
+            m_SerialNumber, m_ActiveSerialNumber, LastPacketNumber, m_szPayload + 2, nPayloadLength - 2 ) == false )
+        {
+            Database_DexData (
+                m_ActiveSerialNumber, CallNumber, LastPacketNumber, m_szPayload + 2, nPayloadLength - 2 );
+        }
         if ( LastPacketNumber == 0xffff )
         {
-            Transmit_D_Command();                                                     // done - dump records in auditor
-
+            m_dwDexLastRecord = GetTickCount();
+            m_Timeline.Await ( CCallTimeline::Database, "CDexWriter" );                  // until the D command is sent
+            DexBarrier();                                                  // done - dump records in auditor once saved
         }
         else
         {
@@ -1180,6 +1120,281 @@ protected:
         }
     }
 
+    bool IsDexSaved ( bool& Settled )
+    {
+        /**************************************************************************************************************
+         * This returns TRUE if every DEX record of the call queued with CDexWriter has been saved. Settled is set    *
+         * TRUE once there is no point waiting any longer: every record has been saved, one of them couldn't be, or   *
+         * DEXWRITER_BARRIERSECONDS have passed since the last record was received.                                   *
+         **************************************************************************************************************/
+        if ( m_pDexCall == NULL )
+        {
+            Settled = true;
+            return true;                                                                 // saved as they were received
+        }
+        Settled = m_pDexCall->Settled == true ||
+            GetTickCount() - m_dwDexLastRecord >= DEXWRITER_BARRIERSECONDS * 1000;
+        return m_pDexCall->Saved;
+    }
+
+    void FinishDexUpload ( void )
+    {
+        /**************************************************************************************************************
+         * This is used (by DexBarrier) once the last DEX record has been received and every record has been saved,   *
+         * or it is clear they won't be. If they were all saved, the D command is sent to dump them in the auditor;   *
+         * otherwise the call fails so the auditor keeps them for its next call. The time taken by the upload, and    *
+         * how much of it was spent waiting for the database after the last record, is recorded as an event so the    *
+         * two ways of saving records ("DEX Writers") can be compared.                                                *
+         **************************************************************************************************************/
+        bool bSettled = false;
+        bool bSaved = IsDexSaved ( bSettled );
+        DWORD dwNow = GetTickCount();
+        m_EventTrace.Event ( CEventTrace::Details,
+            "%s\tDEX upload: %d records in %lu ms, %lu ms waiting for the database (%s)", GetPort(), m_nDexRecords,
+            dwNow - m_dwDexStarted, dwNow - m_dwDexLastRecord,
+            m_pDexCall != NULL ? "saved behind" : "saved as received" );
+        m_nDexRecords = 0;
+        if ( bSaved == false )
+        {
+            m_EventTrace.Event ( CEventTrace::Warning, "%s\tDEX records not saved - call failed", GetPort() );
+            CloseDevice(0);                                                    // 0 => send failed call to the database
+            return;
+        }
+        Transmit_D_Command();                                                         // done - dump records in auditor
+    }
+
+    void PrefetchDevicePlan ( int First )
+    {
+        /**************************************************************************************************************
+         * This is used as each N response is parsed. Unless CDevicePrefetcher isn't running, it hands the devices    *
+         * from m_pProtelDevices [ First ] on (those in the response) to it to look up while the call carries on.     *
+         * Until AwaitDevicePlan has waited for it (or cancelled it), the plan's devices mustn't be touched.          *
+         **************************************************************************************************************/
+        if ( First >= m_nAuditDevices || CDevicePrefetcher::Instance().Running == false
+            || m_nDevicePlans >= ( sizeof ( m_pDevicePlans ) / sizeof ( m_pDevicePlans[ 0 ] )))
+        {
+            return;                                                            // the devices are looked up when needed
+        }
+        CDevicePlan* pPlan = new CDevicePlan ( m_pProtelDevices, First, m_nAuditDevices - First );
+        if ( CDevicePrefetcher::Instance().Prefetch ( pPlan ) == false )
+        {
+            pPlan->Release();
+            return;
+        }
+        m_pDevicePlans [ m_nDevicePlans++ ] = pPlan;
+    }
+
+    bool IsDevicePlanSettled ( void )
+    {
+        /**************************************************************************************************************
+         * This returns TRUE once there is no point waiting any longer for the devices being looked up by             *
+         * CDevicePrefetcher: every plan is settled, or DEVICEPREFETCH_WAITSECONDS have passed since the last N       *
+         * response.                                                                                                  *
+         **************************************************************************************************************/
+        if ( m_bDevicePlanKnown == true
+            || GetTickCount() - m_dwDevicePlanRequested >= DEVICEPREFETCH_WAITSECONDS * 1000 )
+        {
+            return true;
+        }
+        for ( int nPlan = 0; nPlan < m_nDevicePlans; nPlan++ )
+        {
+            if ( m_pDevicePlans [ nPlan ]->Settled == false )
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void AwaitDevicePlan ( void )
+    {
+        /**************************************************************************************************************
+         * This makes sure we know which devices need configuration, firmware or a freebee download, doing nothing    *
+         * once we do. It waits (up to DEVICEPREFETCH_WAITSECONDS after the last N response) for the devices being    *
+         * looked up by CDevicePrefetcher, cancelling any plan that isn't done by then, and looks up any devices      *
+         * that weren't prefetched itself (see PlanDevices). It then marks devices sharing a download as              *
+         * duplicates. How long the call waited, and how the devices were looked up, is recorded as an event.         *
+         **************************************************************************************************************/
+        if ( m_bDevicePlanKnown == true )
+        {
+            return;
+        }
+        m_bDevicePlanKnown = true;
+        DWORD dwStarted = GetTickCount();
+        __int64 nWaitStarted = m_Timeline.Now();
+
+        bool bPlanned [ sizeof ( m_pProtelDevices ) / sizeof ( m_pProtelDevices[ 0 ] ) ];
+        ZeroMemory ( bPlanned, sizeof ( bPlanned ));
+        int nPrefetched = 0;
+        for ( int nPlan = 0; nPlan < m_nDevicePlans; nPlan++ )
+        {
+            CDevicePlan* pPlan = m_pDevicePlans [ nPlan ];
+            DWORD dwElapsed = GetTickCount() - m_dwDevicePlanRequested;
+            if ( pPlan->Wait ( dwElapsed < DEVICEPREFETCH_WAITSECONDS * 1000 ?
+                DEVICEPREFETCH_WAITSECONDS * 1000 - dwElapsed : 0 ) == true )
+            {
+                for ( int nAuditDevice = pPlan->First; nAuditDevice < pPlan->First + pPlan->Count; nAuditDevice++ )
+                {
+                    bPlanned [ nAuditDevice ] = true;
+                }
+                nPrefetched += pPlan->Count;
+            }
+            else
+            {
+                pPlan->Cancel();                                                // the devices are ours again from here
+                m_EventTrace.Event ( CEventTrace::Warning, "%s\tdevices %d to %d not prefetched - looking them up",
+                    GetPort(), pPlan->First, pPlan->First + pPlan->Count - 1 );
+            }
+            pPlan->Release();
+            m_pDevicePlans [ nPlan ] = NULL;
+        }
+        if ( m_nDevicePlans > 0 )
+        {
+            m_Timeline.Add ( CCallTimeline::Waiting, "CDevicePrefetcher", nWaitStarted );
+        }
+        m_nDevicePlans = 0;
+
+        int nBatched = 0;
+        int nEach = 0;
+        int nDevice = 0;
+        while ( nDevice < m_nAuditDevices )
+        {
+            int nFirst = nDevice;
+            while ( nDevice < m_nAuditDevices && bPlanned [ nDevice ] == false )
+            {
+                nDevice++;
+            }
+            if ( nDevice > nFirst )
+            {
+                if ( PlanDevices ( nFirst, nDevice - nFirst ) == true )
+                {
+                    nBatched += nDevice - nFirst;
+                }
+                else
+                {
+                    nEach += nDevice - nFirst;
+                }
+            }
+            else
+            {
+                nDevice++;                                                                                // prefetched
+            }
+        }
+        DWORD dwNow = GetTickCount();
+        m_EventTrace.Event ( CEventTrace::Details,
+            "%s\tdevice plan: %d devices known %lu ms after the last N response, %lu ms waiting"
+            " (%d prefetched, %d in one round trip, %d per device)", GetPort(), m_nAuditDevices,
+            dwNow - m_dwDevicePlanRequested, dwNow - dwStarted, nPrefetched, nBatched, nEach );
+
+        /*
+         * For each device, we check if there are any later ones that require an identical configuration. If so,
+         * we mark them as having a duplicate configuration and add them to the list of devices to be configured
+         * along with this one.
+         */
+        for ( int nAuditDevice = 0; nAuditDevice < m_nAuditDevices; nAuditDevice++ )
+        {
+            __int64 ConfigurationChecksum = m_pProtelDevices[ nAuditDevice ]->ConfigurationChecksum;
+            for ( int nAuditDevice2 = ( nAuditDevice + 1 ); nAuditDevice2 < m_nAuditDevices; nAuditDevice2++ )
+            {
+                if ( m_pProtelDevices[ nAuditDevice ]->ConfigurationLength == m_pProtelDevices[ nAuditDevice2 ]->ConfigurationLength ) // Were both nAuditDevice!!!!
+                {
+                    if ( m_pProtelDevices[ nAuditDevice2 ]->ConfigurationChecksum == ConfigurationChecksum )
+                    {
+                        m_pProtelDevices[ nAuditDevice2 ]->ConfigurationDuplicate = true;
+                        m_pProtelDevices[ nAuditDevice ]->AddConfigurationDuplicate( m_pProtelDevices[ nAuditDevice2 ]->Address );
+                    }
+                }
+            }
+        }
+
+        /*
+         * We find devices with a non-zero firmware length.
+         */
+        bool firstDownload = true;
+        for ( int nAuditDevice = 0; nAuditDevice < m_nAuditDevices; nAuditDevice++ )
+        {
+
+            if ( m_pProtelDevices[ nAuditDevice ]->FirmwareLength > 0 )
+            {
+                if ( firstDownload == true )
+                {
+                    /*
+                     * This is the first such device. we check if there are any later ones that require identical
+                     * firmware. If so, we mark them as having duplicate firmware and add them to the list of
+                     * devices to receive the firmware along with this one.
+                     */
+                    firstDownload = false;
+                    __int64 FirmwareCheckSum = m_pProtelDevices[ nAuditDevice ]->FirmwareChecksum;
+                    for ( int nAuditDevice2 = ( nAuditDevice + 1 ); nAuditDevice2 < m_nAuditDevices; nAuditDevice2++ )
+                    {
+                        if ( m_pProtelDevices[ nAuditDevice ]->FirmwareLength == m_pProtelDevices[ nAuditDevice2 ]->FirmwareLength ) // Were both nAuditDevice!!!!
+                        {
+                            if ( m_pProtelDevices[ nAuditDevice2 ]->FirmwareChecksum == FirmwareCheckSum )
+                            {
+                                m_pProtelDevices[ nAuditDevice2 ]->FirmwareDuplicate = true;
+                                m_pProtelDevices[ nAuditDevice ]->AddFirmwareDuplicate( m_pProtelDevices[ nAuditDevice2 ]->Address );
+                            }
+                        }
+                    }
+                }
+                else
+                {
+                    /*
+                     * This is not the first device requiring firmware. Unless its firmware matches that of the
+                     * first device, we mark not to send it during this connection (only one firmware download is
+                     * allowed at a time).
+                     */
+                    if ( m_pProtelDevices[ nAuditDevice ]->FirmwareDuplicate == false )
+                    {
+                        m_pProtelDevices[ nAuditDevice ]->DontDownloadFirmware();
+                    }
+                }
+            }
+        }
+    }
+
+    bool PlanDevices ( int First, int Count )
+    {
+        /**************************************************************************************************************
+         * This looks up Count devices starting at m_pProtelDevices [ First ] now: in one round trip (see             *
+         * Database_DevicePlan) unless "Device Plan Batch" is 0 or that fails, in which case each device makes its    *
+         * own three calls. It returns TRUE if one round trip was used.                                               *
+         **************************************************************************************************************/
+        CProfileValues profileValues;
+        if ( profileValues.GetDevicePlanBatch() == true && Database_DevicePlan ( First, Count ) == true )
+        {
+            return true;
+        }
+        int indxOfFBMonitor = -5;
+        for ( int nAuditDevice = First; nAuditDevice < First + Count; nAuditDevice++ )
+        {
+            CTimelineSpan timelineSpan ( m_Timeline, CCallTimeline::Devices, "GetFirmwareOrConfiguration" );
+            m_pProtelDevices[ nAuditDevice ]->GetConfiguration();
+            m_pProtelDevices[ nAuditDevice ]->GetFirmware();
+            indxOfFBMonitor = m_pProtelDevices[ nAuditDevice ]->GetFreeBee();
+            if (indxOfFBMonitor >= 0)
+            {                                                      // get index of freebee/audit in proteldevices array
+                m_pProtelDevices[ nAuditDevice ]->FreeBeeAuditDeviceidx = nAuditDevice;
+                indxOfFBMonitor = -1;                                                                          // reset
+            }
+        }
+        return false;
+    }
+
+    void CancelDevicePlans ( void )
+    {
+        /**************************************************************************************************************
+         * This cancels and lets go of any plans still with CDevicePrefetcher, so their devices can be deleted.       *
+         **************************************************************************************************************/
+        for ( int nPlan = 0; nPlan < m_nDevicePlans; nPlan++ )
+        {
+            m_pDevicePlans [ nPlan ]->Cancel();
+            m_pDevicePlans [ nPlan ]->Release();                                 // deleted once the prefetcher is done
+            m_pDevicePlans [ nPlan ] = NULL;
+        }
+        m_nDevicePlans = 0;
+    }
+
     bool Transmit_V_Command ( void )                                     // Free Vend Configuration - trace through!!!!
     {
         BYTE disableFreeBee = 0xff;                                                          // sent to disable freebee
@@ -1194,7 +1409,7 @@ protected:
             // added by WJS as there was no functioning freebee config download code
             FreeBeeAuditDeviceIndx = m_pProtelDevices [ m_nCurrentAuditDevice ]->FreeBeeAuditDeviceidx;
         m_EventTrace.Event( CEventTrace::Information, "void CProtelHost::Transmit_V_Command(FreeBeeAuditDeviceIndx) [%d](%d)",1,FreeBeeAuditDeviceIndx);
-        bool frmDB =  m_padoConnection->WriteLogDB(m_padoConnection, "void CProtelHost::Transmit_V_Command(FreeBeeAuditDeviceIndx)");
+        bool frmDB =  WriteLogDB("void CProtelHost::Transmit_V_Command(FreeBeeAuditDeviceIndx)");
             if (FreeBeeAuditDeviceIndx >= 0)
             {                                                                                                  // found
                 m_temAuditDevice =  m_pProtelDevices [ m_nCurrentAuditDevice ]->AuditDevice;
@@ -1277,8 +1492,8 @@ protected:
 
         if ( m_szPayload [ 0 ] == 0x01 )                                                            // Task in progress
         {
-            SleepEx(1000,TRUE);                      // Pause for 1 second before continuing -- don't overwhelm remote!
-            Transmit_Z_Command();
+            m_Timeline.Await ( CCallTimeline::Waiting, "ping pause" );
+            PingAfter ( 1000 );                      // Pause for 1 second before continuing -- don't overwhelm remote!
             return;
         }
 
@@ -1327,107 +1542,105 @@ protected:
          *                                                                                                            *
          * It is called with r true to adjust the error count when a command response is successfully received.       *
          **************************************************************************************************************/
-
-        if ( r == true )
-        {
-            if ( m_nCommsErrs >= 1 )
-            {
-                m_nCommsErrs -= 1;                                        // response received and error count non-zero
-            }
-            return true;
-        }
-
-        m_nCommsErrs += 3;                                                                           // error (timeout)
-        return ( m_nCommsErrs < CommsErrsLimit( ) );                                         // true if too many errors
+        return m_ProtelEngine.ContinueComms ( r, CommsErrsLimit());
     }
 
     void Retransmit ( void )
     {
         /**************************************************************************************************************
          * This is used if a valid response to the last command transmitted is not received before timeout to         *
-         * retransmit the command.                                                                                    *
+         * retransmit the command. If it has been retransmitted too often, the call is aborted instead.               *
          **************************************************************************************************************/
-        if ( m_nLastTransmission > 0 )
-        {
-			if (m_nLastCmd != m_LastTransmission[2])
-			{
-				m_nReXmitFailCountPercmd = 1;
-				m_nReXmitFailCountPercall++;
-				m_nLastCmd = m_LastTransmission[2];
-            //m_EventTrace.Event( CEventTrace::Information, "void CProtelHost::Retransmit 1 percmd [%d] percall(%d)",m_nReXmitFailCountPercmd,m_nReXmitFailCountPercall);
-			}else if (m_nLastCmd == m_LastTransmission[2])
-						
-			{
-				if ((m_nReXmitFailCountPercmd < MAXFAILCOUNTPERCMD - 1) && (m_nReXmitFailCountPercall < MAXFAILCOUNTPERCALL - 1))
-				{
-				m_nReXmitFailCountPercmd++;
-				m_nReXmitFailCountPercall++;
-            //m_EventTrace.Event( CEventTrace::Information, "void CProtelHost::Retransmit 12 percmd [%d] percall(%d)",m_nReXmitFailCountPercmd,m_nReXmitFailCountPercall);
-				} else // one has failed 
-				{
-				Transmit_A_Command ( false );
-				m_nReXmitFailCountPercmd = 0;
-				m_nReXmitFailCountPercall = 0;
-				m_nLastCmd = (BYTE)"";
-            //m_EventTrace.Event( CEventTrace::Information, "void CProtelHost::Retransmit 5 percmd [%d] percall(%d)",m_nReXmitFailCountPercmd,m_nReXmitFailCountPercall);
-				return;
-
-				}
-			}
-
-
-            Database_CommunicationsData ( true, true, m_LastTransmission, m_nLastTransmission );
+        CMetrics::Instance().CountRetransmit();
+        m_Timeline.Retransmitted();
+        m_ProtelEngine.Retransmit ( GetWaitSeconds() * 1000 );
+        DispatchRequests();
+    }
 
-            ResetReceivedBuffer();                                                          // prepare for new response
+    bool ResyncResponse ( void )
+    {
+        /**************************************************************************************************************
+         * This is used when the response timeout expires, before counting the error and retransmitting. If the       *
+         * response was held up behind a stray sync character (see CProtelEngine::Resync) it is processed now and     *
+         * TRUE is returned; otherwise FALSE is returned and nothing is done.                                         *
+         **************************************************************************************************************/
+        if ( m_ProtelEngine.Resync() == false )
+        {
+            return false;
+        }
+        DispatchRequests();
+        return true;
+    }
 
-            Send ( m_LastTransmission, m_nLastTransmission );                                             // retransmit
-            //m_EventTrace.Event( CEventTrace::Information, "void CProtelHost::Retransmit 6 lastcmd [%c] percall(%d)",m_nLastCmd,m_nReXmitFailCountPercall);
+    void CountSession ( bool Active )
+    {
+        /**************************************************************************************************************
+         * This is used by the derived class with Active TRUE once a call has connected, and by CloseDevice (and the  *
+         * destructor) with Active FALSE when it ends, to count the connected sessions in CMetrics. Each call is      *
+         * counted in and out once however often these are called; when it is counted out, the bytes it moved are     *
+         * recorded.                                                                                                  *
+         **************************************************************************************************************/
+        if ( Active == m_bSessionCounted )
+        {
+            return;
+        }
+        m_bSessionCounted = Active;
+        CMetrics::Instance().AddSessions ( Active == true ? 1 : -1 );
+        if ( Active == false )
+        {
+            CMetrics::Instance().ObserveCall ( m_nBytesUp, m_nBytesDown );
+        }
+    }
 
-            //SetTimeoutTimer( m_hTimer, __WAIT_TIME__ );
-            SetTimeoutTimer( m_hTimer, GetWaitSeconds());
+    void CountResponse ( BYTE Command )
+    {
+        /**************************************************************************************************************
+         * This is used by ProcessResponse to count, in CMetrics, the call as having reached the phase of Command     *
+         * (the first time only) and F and E error responses (every time).                                            *
+         **************************************************************************************************************/
+        if ( Command == 'E' || Command == 'F' )
+        {
+            CMetrics::Instance().CountErrorResponse ( Command );
+        }
+        else if ( Command >= 'A' && Command <= 'Z' && ( m_dwPhases & ( 1 << ( Command - 'A' ))) == 0 )
+        {
+            m_dwPhases |= 1 << ( Command - 'A' );
+            CMetrics::Instance().CountPhase ( Command );
         }
     }
 
     void Transmit ( char command, BYTE* Payload, int PayloadLength)
     {
         /**************************************************************************************************************
-         * This assembles the specified command (e.g. command == 'I') including the sync character (T), length,       *
-         * payload and checksum, " uses the overridden Send method to send it to the remote master, then sets the     *
-         * response timeout. The payload of PayloadLength bytes is as specified in Payload.                           *
-         *                                                                                                            *
-         * The assembled command is saved in m_LastTransmission in case it needs to be retransmitted (preceding       *
-         * method).                                                                                                   *
+         * This transmits the specified command with a payload whose byte sum hasn't been calculated in advance.      *
          **************************************************************************************************************/
-        m_szCurrentCommand [ 0 ] = command;
-        m_szCurrentCommand [ 1 ] = '\0';
-        ResetReceivedBuffer();                                                              // prepare for new response
-        ZeroMemory ( m_transmitBuffer, sizeof ( m_transmitBuffer ));
-
-        if (Payload != NULL && PayloadLength > 0)
+        __int64 PayloadSum = 0;
+        if ( Payload != NULL && PayloadLength > 0 )
         {
-            MoveMemory ( m_transmitBuffer + 3, Payload, PayloadLength );
+            PayloadSum = CChecksum::Sum ( Payload, PayloadLength );
         }
+        Transmit ( command, Payload, PayloadLength, PayloadSum );
+    }
 
-        m_transmitBuffer[0] = (BYTE)'T';                                                              // sync character
-        m_transmitBuffer[1] = (BYTE)PayloadLength + 1;
-        m_transmitBuffer[2] = (BYTE)command;
-
-        BYTE Checksum = CalculateChecksum ( m_transmitBuffer, PayloadLength + 4 );
-        m_transmitBuffer [ PayloadLength + 3 ] = Checksum;
-
-
-        //Database_Dialog ( true, m_transmitBuffer, PayloadLength + 4 );                      // (currently does nothing)
-        m_nLastTransmission = PayloadLength + 4;
-        ZeroMemory ( m_LastTransmission, sizeof ( m_LastTransmission ));
-        CopyMemory ( m_LastTransmission, m_transmitBuffer, m_nLastTransmission );                     // for Retransmit
-        Database_CommunicationsData ( true, false, m_LastTransmission, m_nLastTransmission ); // record command in database
-
-        //m_EventTrace.Event( CEventTrace::Details, "void CProtelHost::Transmit ( '%c', BYTE*, %d )", command, PayloadLength );
-        //m_EventTrace.HexDump( CEventTrace::Information, m_transmitBuffer, PayloadLength + 4 );
-        Send ( m_transmitBuffer, PayloadLength + 4 );
-
-        //SetTimeoutTimer( m_hTimer, __WAIT_TIME__ );
-        SetTimeoutTimer( m_hTimer, GetWaitSeconds());
+    void Transmit ( char command, BYTE* Payload, int PayloadLength, __int64 PayloadSum )
+    {
+        /**************************************************************************************************************
+         * This has the engine assemble the specified command (e.g. command == 'I') with the PayloadLength byte       *
+         * payload in Payload, then records it in the database, uses the overridden Send method to send it to the     *
+         * remote master and sets the response timeout. The engine keeps the command in case it needs to be           *
+         * retransmitted (preceding method).                                                                          *
+         *                                                                                                            *
+         * PayloadSum is the sum of the payload bytes (e.g. CProtelDevice::PacketSum for a firmware or configuration  *
+         * packet), so the checksum is built from it and the three header bytes without summing the payload again.    *
+         *                                                                                                            *
+         * If this is called while a response is being processed, the command is sent as soon as that processing      *
+         * returns to DispatchRequests.                                                                               *
+         **************************************************************************************************************/
+        m_szCurrentCommand [ 0 ] = command;
+        m_szCurrentCommand [ 1 ] = '\0';
+        m_Timeline.Transmitted ( command );
+        m_ProtelEngine.Transmit ( command, Payload, PayloadLength, PayloadSum, GetWaitSeconds() * 1000 );
+        DispatchRequests();
     }
 
     virtual void CloseDevice ( int typeclose )
@@ -1440,6 +1653,7 @@ protected:
 		 * 2 => end call with no database call
          **************************************************************************************************************/
         CancelTimer( m_hTimer );
+        CountSession ( false );
 		switch ( typeclose )
 		{
 		case 0 : 
@@ -1452,11 +1666,38 @@ protected:
 			break;
 		}
 //        Database_FinishCall();
-        if ( m_padoConnection != NULL )
+        CCallTracer::Instance().Finish ( m_Timeline );                              // written out if the call was slow
+    }
+
+    bool ExecuteNonQuery ( CAdoStoredProcedure& adoStoredProcedure, bool bSupressMessages, bool OracleBlob = false )
+    {
+        /**************************************************************************************************************
+         * This executes adoStoredProcedure (see CAdoConnection::ExecuteNonQuery) on a connection borrowed from       *
+         * CAdoConnectionPool for just this call, so a call only holds a connection while it is using one. It returns *
+         * FALSE, having done nothing, if the pool couldn't provide one within "Connection Pool Wait".                *
+         **************************************************************************************************************/
+        CAdoConnectionLease adoConnection;                                          // borrowed from CAdoConnectionPool
+        if ( adoConnection.Connection == NULL )
+        {
+            m_EventTrace.Event ( CEventTrace::Warning, "%s\tno database connection for call %d", GetPort(),
+                CallNumber );
+            return false;
+        }
+        return adoConnection->ExecuteNonQuery ( adoStoredProcedure, bSupressMessages, OracleBlob );
+    }
+
+    bool WriteLogDB ( System::String ^Text )
+    {
+        /**************************************************************************************************************
+         * This adds Text to the database system log (see CAdoConnection::WriteLogDB) on a connection borrowed for    *
+         * just this call. It returns FALSE if the pool couldn't provide one.                                         *
+         **************************************************************************************************************/
+        CAdoConnectionLease adoConnection;                                          // borrowed from CAdoConnectionPool
+        if ( adoConnection.Connection == NULL )
         {
-            delete m_padoConnection;
-            m_padoConnection = NULL;
+            return false;
         }
+        return adoConnection->WriteLogDB ( adoConnection.Connection, Text );
     }
 
     bool Database_AddNewCall ( void )
@@ -1466,13 +1707,9 @@ protected:
          * procedure creates a new row in the COMM_SERVER_CALL table, obtaining the CALLNUMBER and setting the        *
          * CALLSTARTTIME, COMM_DEVICE_DESC and COMM_DEVICE_PORT.                                                      *
          **************************************************************************************************************/
+        CTimelineSpan timelineSpan ( m_Timeline, CCallTimeline::Database, "Database_AddNewCall" );
         bool bReturn = false;
 
-        if ( m_padoConnection == NULL )
-        {
-            return bReturn;                                                // the connection to the database isn't open
-        }
-
         try
         {
             CAdoStoredProcedure adoStoredProcedure ( "PKG_COMM_SERVER.ADDNEW" );
@@ -1516,7 +1753,10 @@ protected:
 
 
 
-            m_padoConnection->ExecuteNonQuery( adoStoredProcedure, false );                                   // do it!
+            if ( ExecuteNonQuery( adoStoredProcedure, false ) == false )                                      // do it!
+            {
+                return bReturn;                                          // no call number - the call isn't recorded
+            }
 // PKG_COMM_SERVER.addSysLogRecAutonomous ( pi_text varchar2 )            //m_EventTrace.Event ( CEventTrace::Details, "CProtelHost::Database_AddNewCall <--g_pAdoConnection->ExecuteNonQuery" );
 
             _variant_t vtReturnedCallNumber = adoStoredProcedure.GetParameter("po_call_number");
@@ -1525,6 +1765,7 @@ protected:
             _itoa_s( CallNumber, szCallNumber, sizeof ( szCallNumber ), 10 );
 			m_EventTrace.Event ( CEventTrace::Details, "CProtelHost::Database_AddNewCall -->g_pAdoConnection->ExecuteNonQuery : id %d", CallNumber);
             m_EventTrace.Identifier( szCallNumber, GetDevice(), GetPort());
+            m_Timeline.Identify ( CallNumber, m_SerialNumber, GetPort());
 			if (CallNumber <= 0 )
 			{
 				bReturn =  false;
@@ -1537,7 +1778,7 @@ protected:
         catch ( _com_error &comError )
         {
             m_EventTrace.Event ( CEventTrace::Information, "CProtelHost::Database_AddNewCall <--> ERROR: %s", CErrorMessage::ReturnComErrorMessage ( comError ));
-        bool frmDB =  m_padoConnection->WriteLogDB(m_padoConnection, "CProtelHost::Database_AddNewCall <--> ERROR: ");
+        bool frmDB =  WriteLogDB("CProtelHost::Database_AddNewCall <--> ERROR: ");
         }
 
         return bReturn;
@@ -1550,18 +1791,21 @@ protected:
          * the current time and success flag in the current call's record in the COMM_SERVER_CALL database table      *
          * record. This also cleans some things up.                                                                   *
          **************************************************************************************************************/
+        CTimelineSpan timelineSpan ( m_Timeline, CCallTimeline::Database, "Database_FinishCall" );
         if ( CallNumber == 0 && dCallStartTime == ( double ) 0 )
         {
             return;
         }
 
+        RecordResponseTimes();
+
         SYSTEMTIME CallStopTime;
         GetSystemTime ( &CallStopTime );
         double dCallStopTime;
         SystemTimeToVariantTime ( &CallStopTime, &dCallStopTime );
         try
         {
-            m_nCommsErrs = 0;
+            m_ProtelEngine.ResetCommsErrs();
             //CancelWaitableTimer( m_hTimer );
             CancelTimer( m_hTimer );
             //m_EventTrace.Event( CEventTrace::Details, "CAdoStoredProcedure adoStoredProcedure ( PKG_COMM_SERVER.FINISH );" );
@@ -1601,13 +1845,13 @@ protected:
             adoStoredProcedure.AddParameter( "pi_errormsg", vtErrorMessage, ADODB::DataTypeEnum::adBSTR, ADODB::ParameterDirectionEnum::adParamInput, bstrErrorMessage.length());
 
 			//m_EventTrace.Event ( CEventTrace::Details, "CProtelHost::Database_FinishCall -->g_pAdoConnection->ExecuteNonQuery : id %d", CallNumber );
-            m_padoConnection->ExecuteNonQuery( adoStoredProcedure, false );
+            ExecuteNonQuery( adoStoredProcedure, false );
 // PKG_COMM_SERVER.addSysLogRecAutonomous ( pi_text varchar2 )            //m_EventTrace.Event ( CEventTrace::Details, "CProtelHost::Database_FinishCall <--g_pAdoConnection->ExecuteNonQuery" );
         }
         catch ( _com_error &comError )
         {
             m_EventTrace.Event ( CEventTrace::Information, "CProtelHost::Database_FinishCall <--> ERROR: %s", CErrorMessage::ReturnComErrorMessage ( comError ));
-        bool frmDB =  m_padoConnection->WriteLogDB(m_padoConnection, "CProtelHost::Database_Database_FinishCall <--> ERROR:");
+        bool frmDB =  WriteLogDB("CProtelHost::Database_Database_FinishCall <--> ERROR:");
         }
         ZeroMemory ( m_SerialNumber, sizeof ( m_SerialNumber ));
         ZeroMemory ( m_CellModemSimmID, sizeof ( m_CellModemSimmID ));
@@ -1627,12 +1871,62 @@ protected:
     }
 
 
+    void RecordResponseTimes ( void )
+    {
+        /**************************************************************************************************************
+         * This is used by Database_FinishCall. It remembers the master auditor's response times for its next call,   *
+         * adds the call's retransmits and recoveries to the totals (see RttEstimator.h) and records them.            *
+         **************************************************************************************************************/
+        CRttHistory::Instance().Record ( m_SerialNumber, m_ProtelEngine.RttEstimator, m_ProtelEngine.Retransmits,
+            m_ProtelEngine.Recoveries, m_ProtelEngine.RecoverMilliseconds );
+
+        __int64 nCalls = 0;
+        __int64 nRetransmits = 0;
+        __int64 nRecoveries = 0;
+        __int64 nRecoverMilliseconds = 0;
+        CRttHistory::Instance().GetTotals ( nCalls, nRetransmits, nRecoveries, nRecoverMilliseconds );
+        m_EventTrace.Event ( CEventTrace::Details,
+            "%s\tresponse %d ms (+/- %d, %d timed), %d retransmits, %d recovered in %d ms"
+            " (all calls: %I64d, %I64d retransmits, %I64d recovered in %I64d ms)",
+            GetPort(), m_ProtelEngine.RttEstimator.Smoothed, m_ProtelEngine.RttEstimator.Variance,
+            m_ProtelEngine.RttEstimator.Samples, m_ProtelEngine.Retransmits, m_ProtelEngine.Recoveries,
+            m_ProtelEngine.RecoverMilliseconds, nCalls, nRetransmits, nRecoveries, nRecoverMilliseconds );
+    }
+
+    bool Database_DevicePlan ( int First, int Count )
+    {
+        /**************************************************************************************************************
+         * This looks up Count devices starting at m_pProtelDevices [ First ] in a single round trip on a borrowed    *
+         * connection (see CDevicePlan::Execute) and returns TRUE on success; otherwise nothing has been taken from   *
+         * the database and the caller asks device by device instead.                                                 *
+         **************************************************************************************************************/
+        CTimelineSpan timelineSpan ( m_Timeline, CCallTimeline::Database, "Database_DevicePlan" );
+        if ( Count <= 0 )
+        {
+            return true;
+        }
+        CAdoConnectionLease adoConnection;                                          // borrowed from CAdoConnectionPool
+        if ( adoConnection.Connection == NULL )
+        {
+            return false;
+        }
+        CDevicePlan* pPlan = new CDevicePlan ( m_pProtelDevices, First, Count );
+        bool bPlanned = pPlan->Execute ( *adoConnection.Connection );
+        pPlan->Release();
+        if ( bPlanned == false )
+        {
+            m_EventTrace.Event ( CEventTrace::Warning, "%s\tdevice plan failed - asking device by device", GetPort() );
+        }
+        return bPlanned;
+    }
+
     void Database_DexData ( char* pszSerialNumber, int nCallNumber, int nSequence, BYTE* pPayload, int nPayloadLength )
     {
         /**************************************************************************************************************
          * This is used to save DEX data received in a U command response as a new record in the COMM_SERVER_DEX      *
          * database table. It also cleans some things up.                                                             *
          **************************************************************************************************************/
+        CTimelineSpan timelineSpan ( m_Timeline, CCallTimeline::Database, "Database_DexData" );
         try
         {
             //CAdoStoredProcedure adoStoredProcedure ( "PKG_COMM_SERVER.DEX" );
@@ -1688,11 +1982,11 @@ protected:
 
             //m_EventTrace.Event ( CEventTrace::Details, "CProtelHost::Database_DexData -->g_pAdoConnection->ExecuteNonQuery" );
 			bool checkit = true; //execute failure
-            checkit = m_padoConnection->ExecuteNonQuery( adoStoredProcedure, false );                                   // do it!
+            checkit = ExecuteNonQuery( adoStoredProcedure, false );                                           // do it!
 			if (checkit == false)
 			{
 // PKG_COMM_SERVER.addSysLogRecAutonomous ( pi_text varchar2 )
-        bool frmDB =  m_padoConnection->WriteLogDB(m_padoConnection, "CProtelHost::Database_Database_DexData <--> ERROR: %s");
+        bool frmDB =  WriteLogDB("CProtelHost::Database_Database_DexData <--> ERROR: %s");
 				CloseDevice(0);	// 0 => send failed call to the database
 			}
 // begin code for PKG_COMM_SERVER.DEX2
@@ -1710,7 +2004,7 @@ protected:
         catch ( _com_error &comError )
         {
             m_EventTrace.Event ( CEventTrace::Information, "CProtelHost::Database_DexData <--> ERROR: %s", CErrorMessage::ReturnComErrorMessage ( comError ));
-        bool frmDB =  m_padoConnection->WriteLogDB(m_padoConnection, "CProtelHost::Database_DexData <--> FAILED: ");
+        bool frmDB =  WriteLogDB("CProtelHost::Database_DexData <--> FAILED: ");
 			CloseDevice(0);	// 0 => send failed call to the database
         }
     }
@@ -1721,6 +2015,7 @@ protected:
          * This is called from Process_S_Response. The called procedure updates the existing row in the               *
          * COMM_SERVER_CALL table where CALLNUMBER matches                                                            *
          **************************************************************************************************************/
+        CTimelineSpan timelineSpan ( m_Timeline, CCallTimeline::Database, "Database_UpdateCallStatus" );
         try
         {
             CAdoStoredProcedure adoStoredProcedure ( "PKG_COMM_SERVER.STATUS" );
@@ -1755,13 +2050,13 @@ protected:
             adoStoredProcedure.AddParameter( "pi_callreason", vtCallReason, ADODB::DataTypeEnum::adInteger, ADODB::ParameterDirectionEnum::adParamInput, sizeof ( short ));
 
             //m_EventTrace.Event ( CEventTrace::Details, "CProtelHost::Database_UpdateCallStatus -->g_pAdoConnection->ExecuteNonQuery" );
-            m_padoConnection->ExecuteNonQuery( adoStoredProcedure, false );
+            ExecuteNonQuery( adoStoredProcedure, false );
 // PKG_COMM_SERVER.addSysLogRecAutonomous ( pi_text varchar2 )            //m_EventTrace.Event ( CEventTrace::Details, "CProtelHost::Database_UpdateCallStatus <--g_pAdoConnection->ExecuteNonQuery" );
         }
         catch ( _com_error &comError )
         {
             m_EventTrace.Event ( CEventTrace::Information, "CProtelHost::Database_UpdateCallStatus <--> ERROR: %s", CErrorMessage::ReturnComErrorMessage ( comError ));
-        bool frmDB =  m_padoConnection->WriteLogDB(m_padoConnection, "CProtelHost::Database_UpdateCallStatus <--> ERROR: %s");
+        bool frmDB =  WriteLogDB("CProtelHost::Database_UpdateCallStatus <--> ERROR: %s");
         }
     }
 
@@ -1772,6 +2067,7 @@ protected:
          * (Transmit true) or received in the COMM_SERVER_LOG database table. The code in the database procedure that *
          * does this may be disabled.                                                                                 *
          **************************************************************************************************************/
+        CTimelineSpan timelineSpan ( m_Timeline, CCallTimeline::Database, "Database_Dialog" );
         try
         {
             char chTransmit = 0;
@@ -1830,24 +2126,28 @@ protected:
                 variantBlob vtPayload ( Transmission+3, PayloadLength );
                 adoStoredProcedure.AddParameter( "pi_PAYLOAD", vtPayload, ADODB::DataTypeEnum::adVarBinary, ADODB::ParameterDirectionEnum::adParamInput, PayloadLength );
 
-                _bstr_t bstrPayloadHex( CHexDump::GetHexString( Transmission+3, PayloadLength ));
+                char szPayloadHex [ CHEXDUMP_HEXLENGTH ( 255 ) ];                     // payloads are at most 255 bytes
+                CHexDump::EncodeHex ( Transmission+3, PayloadLength, szPayloadHex, sizeof ( szPayloadHex ));
+                _bstr_t bstrPayloadHex( szPayloadHex );
                 _variant_t vtPayloadHex ( bstrPayloadHex );
                 adoStoredProcedure.AddParameter( "pi_PAYLOAD_HEX", vtPayloadHex, ADODB::DataTypeEnum::adBSTR, ADODB::ParameterDirectionEnum::adParamInput, bstrPayloadHex.length());
 
-                _bstr_t bstrPayloadAscii( CHexDump::GetAsciiString( Transmission+3, PayloadLength ));
+                char szPayloadAscii [ CHEXDUMP_ASCIILENGTH ( 255 ) ];
+                CHexDump::EncodeAscii ( Transmission+3, PayloadLength, szPayloadAscii, sizeof ( szPayloadAscii ));
+                _bstr_t bstrPayloadAscii( szPayloadAscii );
                 _variant_t vtPayloadAscii ( bstrPayloadAscii );
                 adoStoredProcedure.AddParameter( "pi_PAYLOAD_ASCII", vtPayloadAscii, ADODB::DataTypeEnum::adBSTR, ADODB::ParameterDirectionEnum::adParamInput, bstrPayloadAscii.length());
             }
 
             //m_EventTrace.Event ( CEventTrace::Details, "CProtelHost::Database_Dialog -->g_pAdoConnection->ExecuteNonQuery" );
-            m_padoConnection->ExecuteNonQuery( adoStoredProcedure, false );                                    // do it
+            ExecuteNonQuery( adoStoredProcedure, false );                                                      // do it
 //		PKG_COMM_SERVER.addSysLogRecAutonomous ( pi_text varchar2 )
 			//m_EventTrace.Event ( CEventTrace::Details, "CProtelHost::Database_Dialog <--g_pAdoConnection->ExecuteNonQuery" );
             return true;
         }
         catch ( _com_error &comError )
         {
-        bool frmDB =  m_padoConnection->WriteLogDB(m_padoConnection, "CProtelHost::Database_CommunicationsData <--> ERROR:");
+        bool frmDB =  WriteLogDB("CProtelHost::Database_CommunicationsData <--> ERROR:");
             m_EventTrace.Event ( CEventTrace::Information, "CProtelHost::Database_CommunicationsData :--: ERROR: %s", CErrorMessage::ReturnComErrorMessage ( comError ));
         }
         return false;
@@ -1859,7 +2159,16 @@ protected:
          * This records the TransmissionLength bytes in Transmission that have been sent (Transmit true) or received  *
          * in the COMM_SERVER_DETAILS and COMM_SERVER_LOG database tables. Retransmit indicates if the command was    *
          * retransmitted.                                                                                             *
+         *                                                                                                            *
+         * Normally the frame is only queued here and the CFrameLogWriter thread writes it, with others, shortly      *
+         * afterwards (see FrameLogWriter.h). It is written here, before returning, if the writer isn't running.      *
          **************************************************************************************************************/
+        CTimelineSpan timelineSpan ( m_Timeline, CCallTimeline::Database, "Database_CommunicationsData" );
+        if ( CFrameLogWriter::Instance().Log ( CallNumber, dCallStartTime, m_SerialNumber, m_szCurrentCommand,
+            Transmit, Retransmit, Transmission, TransmissionLength ) == true )
+        {
+            return true;
+        }
         try
         {
             char chTransmit = 0;
@@ -1909,13 +2218,13 @@ protected:
             adoStoredProcedure.AddParameter( "pi_transmission_data", vtBuffer, ADODB::DataTypeEnum::adVarBinary, ADODB::ParameterDirectionEnum::adParamInput, TransmissionLength );
 
             //m_EventTrace.Event ( CEventTrace::Details, "CProtelHost::Database_CommunicationsData -->g_pAdoConnection->ExecuteNonQuery" );
-            m_padoConnection->ExecuteNonQuery( adoStoredProcedure, false );
+            ExecuteNonQuery( adoStoredProcedure, false );
             return true;
         }
         catch ( _com_error &comError )
         {
             m_EventTrace.Event ( CEventTrace::Information, "CProtelHost::Database_CommunicationsData <--> ERROR: %s");
-        bool frmDB =  m_padoConnection->WriteLogDB(m_padoConnection, "CProtelHost::Database_CommunicationsData <--> ERROR: ");
+        bool frmDB =  WriteLogDB("CProtelHost::Database_CommunicationsData <--> ERROR: ");
 //	PKG_COMM_SERVER.addSysLogRecAutonomous ( pi_text varchar2 )            //m_EventTrace.Event ( CEventTrace::Details, "CProtelHost::Database_CommunicationsData <--g_pAdoConnection->ExecuteNonQuery" );
         }
         return false;
@@ -1928,6 +2237,7 @@ protected:
          * COMM_SERVER_CALL table where CALLNUMBER matches. It also updates the CENTRALAUDITOR field in any existing  *
          * rows in the COMM_SERVER_DETAILS and COMM_SERVER_LOG tables where CALLNUMBER matches.                       *
          **************************************************************************************************************/
+        CTimelineSpan timelineSpan ( m_Timeline, CCallTimeline::Database, "Database_UpdateCentralAuditor" );
         try
         {
             //procedure central_auditor (
@@ -1984,9 +2294,9 @@ protected:
             adoStoredProcedure.AddParameter( "po_CALLFLAG", vtCallFlag, ADODB::DataTypeEnum::adInteger, ADODB::ParameterDirectionEnum::adParamOutput, sizeof ( short ));
 
             //m_EventTrace.Event ( CEventTrace::Details, "CProtelHost::Database_UpdateCentralAuditor -->g_pAdoConnection->ExecuteNonQuery" );
-            if (m_padoConnection->ExecuteNonQuery( adoStoredProcedure, false ) == false)
+            if (ExecuteNonQuery( adoStoredProcedure, false ) == false)
 			{
-        bool frmDB =  m_padoConnection->WriteLogDB(m_padoConnection, "CProtelHost::PKG_COMM_SERVER.CENTRAL_AUDITOR <--> ERROR: ");
+        bool frmDB =  WriteLogDB("CProtelHost::PKG_COMM_SERVER.CENTRAL_AUDITOR <--> ERROR: ");
 			// PKG_COMM_SERVER.addSysLogRecAutonomous ( pi_text varchar2 )
 			Transmit_A_Command(false);		// see bug 3010
 			}
@@ -1998,7 +2308,7 @@ protected:
         catch ( _com_error &comError )
         {
             m_EventTrace.Event ( CEventTrace::Information, "CProtelHost::Database_UpdateCentralAuditor <--> ERROR: %s");
-        bool frmDB =  m_padoConnection->WriteLogDB(m_padoConnection, "CProtelHost::PKG_COMM_SERVER.CENTRAL_AUDITOR <--> DB CALL FAILED: ");
+        bool frmDB =  WriteLogDB("CProtelHost::PKG_COMM_SERVER.CENTRAL_AUDITOR <--> DB CALL FAILED: ");
         }
     }
 //
@@ -2026,7 +2336,7 @@ protected:
 				if (lencorrupt >= (sizeof ( mcorrupt_SerialNumber )))
 				{
 					corrupt_serial = true;
-				bool frmDB =  m_padoConnection->WriteLogDB(m_padoConnection, "Found monitor with all zero's for serial number");
+				bool frmDB =  WriteLogDB("Found monitor with all zero's for serial number");
 				}//break;
 			}
 		}
@@ -2070,17 +2380,15 @@ protected:
 
 				try
 				{
-					if ( m_padoConnection == NULL )
+					CAdoConnectionLease adoConnection;                              // borrowed from CAdoConnectionPool
+					if ( adoConnection.Connection == NULL )
 					{
 						m_EventTrace.Event( CEventTrace::Information, "Error: DB CONNECTION IS NULL CProtelHost::GetUncorruptedSerial [%s](%d)",m_SerialNumber,0);
-//						m_padoConnection = new CAdoConnection;
-        bool frmDB =  m_padoConnection->WriteLogDB(m_padoConnection, "CProtelHost::MONITOR_RECOVERY_PKG.getSerialNumFromCorrupt <--> ERROR: ");
-
-
-					}		//end if m_padoConnection == null
+						return newSerial;
+					}		//end if adoConnection.Connection == null
 
 
-					int ret =   m_padoConnection->ExecuteNonQuery( adoStoredProcedure1, false );
+					int ret =   adoConnection->ExecuteNonQuery( adoStoredProcedure1, false );
 
 //	PKG_COMM_SERVER.addSysLogRecAutonomous ( pi_text varchar2 )
 					_variant_t vtCorrectedSerial = adoStoredProcedure1.GetParameter("po_ActualSerialNum");
@@ -2107,11 +2415,11 @@ protected:
 
 
 					//m_EventTrace.Event( CEventTrace::Information, "void 2 CProtelHost::GetUncorruptedSerial [%s](%d)",m_SerialNumber,ret);
-        bool frmDB =  m_padoConnection->WriteLogDB(m_padoConnection, "Tried to GetUncorruptedSerial");
+        bool frmDB =  adoConnection->WriteLogDB(adoConnection.Connection, "Tried to GetUncorruptedSerial");
 				}		//end try
 		        catch ( _com_error &comError )
 				{
-        bool frmDB =  m_padoConnection->WriteLogDB(m_padoConnection, "CProtelHost::MONITOR_RECOVERY_PKG.getSerialNumFromCorrupt <--> ERROR: ");
+        bool frmDB =  WriteLogDB("CProtelHost::MONITOR_RECOVERY_PKG.getSerialNumFromCorrupt <--> ERROR: ");
 					m_EventTrace.Event ( CEventTrace::Information, "MONITOR_RECOVERY_PKG.getSerialNumFromCorrupt <--> ERROR: %s", CErrorMessage::ReturnComErrorMessage ( comError ));
 		        }
 
@@ -2148,10 +2456,13 @@ protected:
     }
 
 protected:
-    void CancelTimer ( HANDLE& hTimer )
+    virtual void CancelTimer ( HANDLE& hTimer )
     {
         /**************************************************************************************************************
          * This sets timer *hTimer inactive (so it won't become signalled until after it is set again).               *
+         *                                                                                                            *
+         * ProtelSocket and ProtelSerial override this and SetTimeoutTimer (below) to use their reactor session timer *
+         * instead.                                                                                                   *
          **************************************************************************************************************/
 #if 1
         CancelWaitableTimer ( hTimer );
@@ -2164,21 +2475,21 @@ protected:
 #endif
     }
 
-    void SetTimeoutTimer ( HANDLE& hTimer, int Seconds )
+    virtual void SetTimeoutTimer ( HANDLE& hTimer, int Milliseconds )
     {
         /**************************************************************************************************************
-         * This sets timer *hTimer to become signalled in Seconds seconds from now (unless it is cancelled before     *
-         * then).                                                                                                     *
+         * This sets timer *hTimer to become signalled in Milliseconds milliseconds from now (unless it is cancelled  *
+         * before then).                                                                                              *
          **************************************************************************************************************/
 #if 1
         __int64 i64DueTime;
         LARGE_INTEGER liDueTime;
 
         // Create a negative 64-bit integer that will be used to
-        // signal the timer Seconds seconds from now.
+        // signal the timer Milliseconds milliseconds from now.
 
-        i64DueTime = Seconds * -1;
-        i64DueTime *= _SECOND;
+        i64DueTime = Milliseconds * -1;
+        i64DueTime *= _MILLISECOND;
 
         // Copy the relative time into a LARGE_INTEGER.
         liDueTime.LowPart  = (DWORD) ( i64DueTime & 0xFFFFFFFF );
@@ -2192,10 +2503,47 @@ protected:
             TRUE );                                           // [in] TRUE - restore suspended system when time expires
 #else
         LARGE_INTEGER li = { 0 };
-        SetWaitableTimer ( hTimer, &li, Seconds * 1000, NULL, NULL, FALSE);
+        SetWaitableTimer ( hTimer, &li, Milliseconds, NULL, NULL, FALSE);
 #endif
     }
 
+    virtual void PingAfter ( int Milliseconds )
+    {
+        /**************************************************************************************************************
+         * This sends a Z command after Milliseconds. The calling thread sleeps meanwhile; ProtelSocket and           *
+         * ProtelSerial override this to use a reactor session timer instead so other connections on the loop aren't  *
+         * held up.                                                                                                   *
+         **************************************************************************************************************/
+        SleepEx ( Milliseconds, TRUE );
+        Transmit_Z_Command();
+    }
+
+    virtual void DexBarrier ( void )
+    {
+        /**************************************************************************************************************
+         * This is used once the last DEX record has been received. It waits (up to DEXWRITER_BARRIERSECONDS) for     *
+         * every record to be saved, then calls FinishDexUpload. The calling thread is blocked meanwhile;             *
+         * ProtelSocket and ProtelSerial override this to poll using a reactor session timer instead.                 *
+         **************************************************************************************************************/
+        if ( m_pDexCall != NULL )
+        {
+            m_pDexCall->Wait ( DEXWRITER_BARRIERSECONDS * 1000 );
+        }
+        FinishDexUpload();
+    }
+
+    virtual void DevicePlanBarrier ( void )
+    {
+        /**************************************************************************************************************
+         * This is used when the first O command is due: after the DEX upload, or straight after the last N response  *
+         * if there is no DEX data. It waits for the devices to be looked up (see AwaitDevicePlan), then sends the O  *
+         * command. The calling thread is blocked meanwhile; ProtelSocket and ProtelSerial override this to poll      *
+         * using a reactor session timer instead.                                                                     *
+         **************************************************************************************************************/
+        AwaitDevicePlan();
+        Transmit_O_Command();
+    }
+
     virtual char* GetPort ( void )
     {
         /**************************************************************************************************************
@@ -2217,8 +2565,9 @@ protected:
     virtual int GetWaitSeconds ( void )
     {
         /**************************************************************************************************************
-         * This is overridden in ProtelSerial or ProtelSocket to return the timeout to use if a response to a command *
-         * isn't received: 10 and 90 seconds respectively.                                                            *
+         * This is overridden in ProtelSerial or ProtelSocket to return the longest timeout to use if a response to a *
+         * command isn't received: 10 and 90 seconds respectively. The engine normally chooses a shorter one from the *
+         * auditor's measured response times (see RttEstimator.h).                                                    *
          **************************************************************************************************************/
         return 1;
     }
@@ -2227,7 +2576,7 @@ protected:
     {
         /**************************************************************************************************************
          * This is overridden in ProtelSerial or ProtelSocket to return the error limit that causes the call to be    *
-         * aborted if a valid response isn't received (9 and 0 respectively).                                         *
+         * aborted if a valid response isn't received (9 for both).                                                   *
          **************************************************************************************************************/
         return 1;
     }
@@ -1,17 +1,27 @@
 /**********************************************************************************************************************
- *                                      This file contains the CProtelList class.                                     *
+ *                          This file contains the CProtelList and CProtelListCursor classes.                         *
  *                                                                                                                    *
- * This maintains a double-linked list of pointers to ProtelHost instances (each instance represents a remote device  *
- * that the server may be communicating with).                                                                        *
+ * This keeps every ProtelHost instance (each instance represents a remote device that the server may be              *
+ * communicating with) by session ID.                                                                                 *
  *                                                                                                                    *
  * Application.h constructs the ProtelList, adds a ProtelSerial (inheriting ProtelHost) to it for each modem in the   *
  * system, then sets up SocketListener, passing a pointer to the ProtelList to it. When a socket connection is        *
- * established, SocketListener adds a ProtelHost for it to the ProtelList. SocketListener removes its ProtelHosts     *
- * from the list as the connections are closed but the modem ProtelSerials remain in the list until the Application   *
- * ends.                                                                                                              *
+ * established, SocketListener adds a ProtelHost for it to the ProtelList. As each connection ends, its ProtelSocket  *
+ * queues itself as closed (QueueClosed) and SocketListener removes the queued hosts (RemoveClosed). The modem        *
+ * ProtelSerials remain in the list until the Application ends.                                                       *
  *                                                                                                                    *
- * NOTE: there is at least a potential risk that the Next or Previous method is used to obtain a pointer to a         *
- * ProtelHost which is then deleted by another thread using the Remove or RemoveAll methods. !!!!Is this a problem?   *
+ * The list used to be one linked list behind one critical section with a single shared MoveFirst/Next position, so   *
+ * two threads working through it at once (CApplication polling while SocketListener reclaimed closed hosts) moved    *
+ * each other's position, a host could be deleted while another thread was using it, and each closed host was found   *
+ * by searching from the start of the list again. Now:                                                                *
+ * - Add gives each host a session ID (CProtelHost::SessionId) which picks one of PROTELLIST_SHARDS shards, each      *
+ * with its own critical section, linked list and hash chains (by ID), so Add and Remove take O(1) and threads        *
+ * adding and removing hosts rarely wait for each other.                                                              *
+ * - Each thread works through the list with its own CProtelListCursor, which takes no lock. While a cursor is open   *
+ * its thread is counted in the current epoch; a removed host is only deleted once every cursor that might have       *
+ * seen it has been closed (two epochs later), so a host returned by a cursor stays valid until it is closed.         *
+ * - A closing ProtelSocket pushes its session ID onto a queue with one interlocked instruction and no lock, and      *
+ * RemoveClosed takes the whole queue at once.                                                                        *
  *                                                                                                                    *
  *                                         Copyright (c) Protel Inc. 2009-2010                                        *
  **********************************************************************************************************************/
@@ -19,201 +29,395 @@
 #pragma once
 #include "ProtelHost.h"
 
+#define PROTELLIST_SHARDS           16                                    // lists with a critical section of their own
+#define PROTELLIST_BUCKETS          256                                        // hash chains per shard (by session ID)
+
+class CProtelListCursor;
+
 class CProtelList
  {
+    friend class CProtelListCursor;                                                         // works through the shards
+
 public:
     CProtelList(void)
     {
         /**************************************************************************************************************
          * CONSTRUCTOR.                                                                                               *
          **************************************************************************************************************/
-        InitializeCriticalSection ( &criticalSection );
-        m_sProtelList = NULL;                                              // first entry in list (there isn't one yet)
-        m_sProtelListCurrent = NULL;                                                           // current entry in list
-        //m_hMutex = CreateMutex( NULL, TRUE, NULL );
+        for ( int nShard = 0; nShard < PROTELLIST_SHARDS; nShard++ )
+        {
+            InitializeCriticalSection ( &m_Shards [ nShard ].criticalSection );
+            m_Shards [ nShard ].first = NULL;
+            ZeroMemory ( m_Shards [ nShard ].buckets, sizeof ( m_Shards [ nShard ].buckets ));
+        }
+        InitializeCriticalSection ( &m_csRetired );
+        m_nSessions = 0;
+        m_nEpoch = 0;
+        m_nReaders [ 0 ] = 0;
+        m_nReaders [ 1 ] = 0;
+        m_pRetired = NULL;
+        m_pRetiredLast = NULL;
+        m_pClosed = NULL;
     }
 
-
     virtual ~CProtelList(void)
     {
         /**************************************************************************************************************
          * DESTRUCTOR.                                                                                                *
          **************************************************************************************************************/
-        //CloseHandle ( m_hMutex );
-        DeleteCriticalSection ( &criticalSection );
+        RemoveAll();
+        for ( int nShard = 0; nShard < PROTELLIST_SHARDS; nShard++ )
+        {
+            DeleteCriticalSection ( &m_Shards [ nShard ].criticalSection );
+        }
+        DeleteCriticalSection ( &m_csRetired );
     }
 
     void Add ( CProtelHost* client )
     {
         /**************************************************************************************************************
-         * This adds client to the list after the current position and sets the current list position to the new      *
-         * entry.                                                                                                     *
+         * This gives client the next session ID and adds it to the start of that ID's shard.                         *
          **************************************************************************************************************/
-        //LockMutex();
-        EnterCriticalSection ( &criticalSection );
-
-        /*
-         * We create and initalise the new list entry, setting it to point to client.
-         */
         SProtelList* sProtelList = new SProtelList;
-        sProtelList->next = NULL;
-        sProtelList->previous = NULL;
         sProtelList->protelHost = client;
+        sProtelList->sessionId = InterlockedIncrement ( &m_nSessions );
+        sProtelList->removed = false;
+        sProtelList->previous = NULL;
+        sProtelList->retired = NULL;
+        sProtelList->epoch = 0;
+        client->SessionId = sProtelList->sessionId;
 
-        if ( m_sProtelList == NULL )
+        SShard& shard = GetShard ( sProtelList->sessionId );
+        EnterCriticalSection ( &shard.criticalSection );
+        SProtelList*& bucket = shard.buckets [ GetBucket ( sProtelList->sessionId ) ];
+        sProtelList->bucketNext = bucket;
+        bucket = sProtelList;
+        sProtelList->next = shard.first;
+        if ( shard.first != NULL )
         {
-            /*
-             * This is the first entry added to the list.
-             */
-            m_sProtelList = sProtelList;
+            shard.first->previous = sProtelList;
         }
+        MemoryBarrier();                                               // a cursor reaching the entry sees it filled in
+        shard.first = sProtelList;
+        LeaveCriticalSection ( &shard.criticalSection );
+    }
 
-        if ( m_sProtelListCurrent != NULL )
+    void Remove ( CProtelHost* client )
+    {
+        /**************************************************************************************************************
+         * This removes client from the list and deletes it once no cursor can be using it. (If client is NULL or     *
+         * isn't in the list, it does nothing.)                                                                       *
+         **************************************************************************************************************/
+        if ( client != NULL )
         {
-            /*
-             * There is already an entry at the current list position. We set its forward link to point to the new
-             * entry and the new entry's backward link to point to the current list entry.
-             */
-            sProtelList->next = m_sProtelListCurrent->next;                                     // This was missing!!!!
-            if ( sProtelList->next != NULL )
-            {
-                sProtelList->next->previous = sProtelList;                                           // So was this!!!!
-            }
-            m_sProtelListCurrent->next = sProtelList;
-            sProtelList->previous = m_sProtelListCurrent;
+            Retire ( Unlink ( client->SessionId, client ));
+            Reclaim ( false );
         }
-
-        m_sProtelListCurrent = sProtelList;                               // new entry is now the current list position
-        //ReleaseMutex ( m_hMutex );
-        LeaveCriticalSection ( &criticalSection );
     }
 
-    void Remove ( CProtelHost* client )
+    void QueueClosed ( CProtelHost* client )
     {
         /**************************************************************************************************************
-         * This deletes client after removing it from the list. (If client isn't in the list, it does nothing.)       *
+         * This is used by a ProtelSocket once its connection has ended, on a database worker thread (or its reactor  *
+         * loop thread), to have RemoveClosed remove it. It pushes the session ID onto the closed queue without       *
+         * taking a lock.                                                                                             *
          **************************************************************************************************************/
-        //LockMutex();
-        EnterCriticalSection ( &criticalSection );
+        SClosed* pClosed = new SClosed;
+        pClosed->sessionId = client->SessionId;
+        SClosed* pFirst;
+        do
+        {
+            pFirst = m_pClosed;
+            pClosed->next = pFirst;
+        }
+        while ( InterlockedCompareExchangePointer (( PVOID volatile* ) &m_pClosed, pClosed, pFirst ) != pFirst );
+    }
 
-        SProtelList* sProtelList = m_sProtelList;                                                  // beginning of list
-        while ( sProtelList != NULL )                                                           // find entry to remove
+    int RemoveClosed ( void )
+    {
+        /**************************************************************************************************************
+         * This is used by SocketListener when a connection has ended. It takes every session ID on the closed queue  *
+         * at once and removes each host, returning how many were removed.                                            *
+         **************************************************************************************************************/
+        SClosed* pClosed = ( SClosed* ) InterlockedExchangePointer (( PVOID volatile* ) &m_pClosed, NULL );
+        int nRemoved = 0;
+        while ( pClosed != NULL )
         {
-            if ( sProtelList->protelHost == client )                                                      // this is it
+            SProtelList* sProtelList = Unlink ( pClosed->sessionId, NULL );
+            if ( sProtelList != NULL )
             {
-                if ( sProtelList->previous == NULL )                                           // it is the first entry
-                {
-                    m_sProtelList = sProtelList->next;                                            // adjust first entry
-                }
-                else                                                                        // it isn't the first entry
-                {
-                    sProtelList->previous->next = sProtelList->next;              // adjust previous entry forward link
-                }
-                if ( sProtelList->next != NULL )                                             // it isn't the last entry
-                {
-                    sProtelList->next->previous = sProtelList->previous;             // adjust next entry backward link
-                }
-                // This was missing!!!!
-                if ( m_sProtelListCurrent == sProtelList )                                   // it is the current entry
-                {
-                    m_sProtelListCurrent = ( sProtelList->previous != NULL )
-                        ? sProtelList->previous : sProtelList->next;                            // adjust current entry
-                }
-                delete sProtelList->protelHost;                                                    // delete the client
-                delete sProtelList;                                                               // and the list entry
-                break;                                                                                   // we are done
+                Retire ( sProtelList );
+                nRemoved++;
             }
-            sProtelList = sProtelList->next;                                                     // try next list entry
+            SClosed* pNext = pClosed->next;
+            delete pClosed;
+            pClosed = pNext;
         }
-        //ReleaseMutex ( m_hMutex );
-        LeaveCriticalSection ( &criticalSection );
+        Reclaim ( false );
+        return nRemoved;
     }
 
     void RemoveAll ( void )
     {
         /**************************************************************************************************************
-         * This removes all clients from the list and deletes them.                                                   *
+         * This removes all clients from the list and deletes them, waiting for any cursor still open.                *
          **************************************************************************************************************/
-        //LockMutex();
-        EnterCriticalSection ( &criticalSection );
-
-        SProtelList* protelList = m_sProtelList;                                                   // beginning of list
-        while ( protelList != NULL )                                                          // there is another entry
+        SClosed* pClosed = ( SClosed* ) InterlockedExchangePointer (( PVOID volatile* ) &m_pClosed, NULL );
+        while ( pClosed != NULL )
         {
-            SProtelList* protelCurrent = protelList;
-            protelList = protelList->next;                                                                // next entry
-            delete protelCurrent->protelHost;                                                      // delete the client
-            delete protelCurrent;                                                                 // and the list entry
+            SClosed* pNext = pClosed->next;
+            delete pClosed;
+            pClosed = pNext;
         }
-        m_sProtelList = NULL;                                                                      // list is now empty
-        m_sProtelListCurrent = NULL;
-        //ReleaseMutex ( m_hMutex );
-        LeaveCriticalSection ( &criticalSection );
+        for ( int nShard = 0; nShard < PROTELLIST_SHARDS; nShard++ )
+        {
+            while ( m_Shards [ nShard ].first != NULL )
+            {
+                SProtelList* sProtelList = m_Shards [ nShard ].first;
+                Retire ( Unlink ( sProtelList->sessionId, sProtelList->protelHost ));
+            }
+        }
+        Reclaim ( true );
     }
 
-    CProtelHost* MoveFirst ( void )
+private:
+    struct SProtelList                                                                                  // a list entry
+    {
+        CProtelHost* protelHost;                                                               // the listed ProtelHost
+        LONG sessionId;                                                                // also in protelHost->SessionId
+        volatile bool removed;                                                          // TRUE once unlinked by Unlink
+        SProtelList* previous;                                                        // backward link (under the lock)
+        SProtelList* volatile next;                                          // forward link (also followed by cursors)
+        SProtelList* bucketNext;                                        // next in the same hash chain (under the lock)
+        SProtelList* retired;                                                             // next waiting to be deleted
+        LONG epoch;                                                                              // when it was retired
+    };
+
+    struct SShard
+    {
+        CRITICAL_SECTION criticalSection;                                            // taken to add or remove an entry
+        SProtelList* volatile first;                                                                    // newest entry
+        SProtelList* buckets [ PROTELLIST_BUCKETS ];                                               // hash chains by ID
+    };
+
+    struct SClosed                                                                              // a closed queue entry
+    {
+        LONG sessionId;
+        SClosed* next;
+    };
+
+    SShard& GetShard ( LONG SessionId )
+    {
+        return m_Shards [ ( DWORD ) SessionId % PROTELLIST_SHARDS ];
+    }
+
+    static int GetBucket ( LONG SessionId )
+    {
+        return ( int )((( DWORD ) SessionId / PROTELLIST_SHARDS ) % PROTELLIST_BUCKETS );
+    }
+
+    SProtelList* Unlink ( LONG SessionId, CProtelHost* client )
     {
         /**************************************************************************************************************
-         * This moves the current list position to the first entry and returns its ProtelHost (NULL if there isn't    *
-         * one).                                                                                                      *
+         * This takes the entry for SessionId (and client, unless it is NULL) out of its shard and returns it, or     *
+         * returns NULL if there isn't one. Its forward link is left as it is, so a cursor on it can carry on.        *
          **************************************************************************************************************/
-        m_sProtelListCurrent = m_sProtelList;                                                      // beginning of list
-        if ( m_sProtelListCurrent != NULL )                                                         // list isn't empty
+        SShard& shard = GetShard ( SessionId );
+        EnterCriticalSection ( &shard.criticalSection );
+        SProtelList** pLink = &shard.buckets [ GetBucket ( SessionId ) ];
+        while ( *pLink != NULL && (( *pLink )->sessionId != SessionId
+            || ( client != NULL && ( *pLink )->protelHost != client )))
+        {
+            pLink = &( *pLink )->bucketNext;
+        }
+        SProtelList* sProtelList = *pLink;
+        if ( sProtelList != NULL )
+        {
+            *pLink = sProtelList->bucketNext;                                                  // out of its hash chain
+            if ( sProtelList->previous == NULL )                                               // it is the first entry
+            {
+                shard.first = sProtelList->next;
+            }
+            else
+            {
+                sProtelList->previous->next = sProtelList->next;
+            }
+            if ( sProtelList->next != NULL )
+            {
+                sProtelList->next->previous = sProtelList->previous;
+            }
+            sProtelList->removed = true;
+        }
+        LeaveCriticalSection ( &shard.criticalSection );
+        return sProtelList;
+    }
+
+    void Retire ( SProtelList* sProtelList )
+    {
+        if ( sProtelList == NULL )
+        {
+            return;
+        }
+        EnterCriticalSection ( &m_csRetired );
+        sProtelList->epoch = m_nEpoch;
+        sProtelList->retired = NULL;
+        if ( m_pRetiredLast != NULL )
+        {
+            m_pRetiredLast->retired = sProtelList;
+        }
+        else
         {
-            return m_sProtelListCurrent->protelHost;
+            m_pRetired = sProtelList;
         }
-        return NULL;                                                                                   // list is empty
+        m_pRetiredLast = sProtelList;
+        LeaveCriticalSection ( &m_csRetired );
     }
 
-    CProtelHost* Next ( void )
+    void Reclaim ( bool Wait )
     {
         /**************************************************************************************************************
-         * This moves the current list position to the next entry and returns its ProtelHost. If there isn't another  *
-         * entry, it leaves the postion unchanged and returns NULL.                                                   *
+         * This moves the epoch on if no cursor opened in the one before is still open, then deletes the hosts (and   *
+         * entries) retired two or more epochs ago - no cursor can still be on them - for as long as the epoch moves  *
+         * on. With Wait TRUE, it keeps going until every retired host is deleted.                                    *
          **************************************************************************************************************/
+        EnterCriticalSection ( &m_csRetired );
+        while ( m_pRetired != NULL )
+        {
+            LONG nEpoch = m_nEpoch;
+            if ( m_nReaders [ ( nEpoch + 1 ) & 1 ] == 0 )                      // the slot of the epoch before this one
+            {
+                InterlockedCompareExchange ( &m_nEpoch, nEpoch + 1, nEpoch );
+            }
+            while ( m_pRetired != NULL && m_nEpoch - m_pRetired->epoch >= 2 )
+            {
+                SProtelList* sProtelList = m_pRetired;
+                m_pRetired = sProtelList->retired;
+                delete sProtelList->protelHost;                                                    // delete the client
+                delete sProtelList;                                                               // and the list entry
+            }
+            if ( m_pRetired == NULL )
+            {
+                m_pRetiredLast = NULL;
+            }
+            else if ( m_nEpoch == nEpoch )                                                    // a cursor is still open
+            {
+                if ( Wait == false )
+                {
+                    break;                                                            // the next Remove will try again
+                }
+                Sleep ( 1 );
+            }
+        }
+        LeaveCriticalSection ( &m_csRetired );
+    }
 
-        if ( m_sProtelList && m_sProtelListCurrent->next != NULL ) // there is another entry Empty list check added!!!!
+    LONG Enter ( void )
+    {
+        /**************************************************************************************************************
+         * This counts a cursor being opened in the current epoch, which it returns (to be passed to Leave).          *
+         **************************************************************************************************************/
+        while ( true )
         {
-            m_sProtelListCurrent = m_sProtelListCurrent->next;
-            return m_sProtelListCurrent->protelHost;
+            LONG nEpoch = m_nEpoch;
+            InterlockedIncrement ( &m_nReaders [ nEpoch & 1 ] );
+            if ( m_nEpoch == nEpoch )
+            {
+                return nEpoch;
+            }
+            InterlockedDecrement ( &m_nReaders [ nEpoch & 1 ] );                             // it moved on - try again
         }
-        return NULL;
     }
 
-    CProtelHost* Previous ( void )
+    void Leave ( LONG Epoch )
+    {
+        InterlockedDecrement ( &m_nReaders [ Epoch & 1 ] );
+    }
+
+    SShard m_Shards [ PROTELLIST_SHARDS ];
+    volatile LONG m_nSessions;                                                                 // last session ID given
+    volatile LONG m_nEpoch;
+    volatile LONG m_nReaders [ 2 ];                                              // cursors open in even and odd epochs
+    CRITICAL_SECTION m_csRetired;                                                    // protects the retired list below
+    SProtelList* m_pRetired;                                                  // removed, oldest first, not deleted yet
+    SProtelList* m_pRetiredLast;
+    SClosed* volatile m_pClosed;                                                    // closed queue (last pushed first)
+ };
+
+class CProtelListCursor
+ {
+public:
+    CProtelListCursor ( CProtelList* protelList ) :
+        m_pProtelList ( protelList ),
+        m_sProtelListCurrent ( NULL ),
+        m_nShard ( 0 )
     {
         /**************************************************************************************************************
-         * This moves the current list position to the previous entry and returns its ProtelHost. If there isn't a    *
-         * previous entry, it leaves the postion unchanged and returns NULL.                                          *
+         * CONSTRUCTOR. This opens a cursor on protelList for the calling thread. Hosts it returns (by MoveFirst and  *
+         * Next) aren't deleted before it is destroyed.                                                               *
          **************************************************************************************************************/
+        m_nEpoch = m_pProtelList->Enter();
+    }
 
-        if ( m_sProtelList && m_sProtelListCurrent->previous != NULL ) // there is a previous entry Empty list check added!!!!
+    virtual ~CProtelListCursor(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+        m_pProtelList->Leave ( m_nEpoch );
+    }
+
+    CProtelHost* MoveFirst ( void )
+    {
+        /**************************************************************************************************************
+         * This moves the cursor to the first host and returns it (NULL if there isn't one).                          *
+         **************************************************************************************************************/
+        m_nShard = 0;
+        m_sProtelListCurrent = m_pProtelList->m_Shards [ 0 ].first;
+        return Skip();
+    }
+
+    CProtelHost* Next ( void )
+    {
+        /**************************************************************************************************************
+         * This moves the cursor to the next host and returns it. If there isn't another, it returns NULL. Hosts      *
+         * added or removed meanwhile may or may not be returned.                                                     *
+         **************************************************************************************************************/
+        if ( m_sProtelListCurrent == NULL )
         {
-            m_sProtelListCurrent = m_sProtelListCurrent->previous;
-            return m_sProtelListCurrent->protelHost;
+            return NULL;
         }
-        return NULL;
+        m_sProtelListCurrent = m_sProtelListCurrent->next;
+        return Skip();
     }
 
-
 private:
-    struct SProtelList                                                                                  // a list entry
+    CProtelHost* Skip ( void )
     {
-        CProtelHost* protelHost;                                                               // the listed ProtelHost
-        SProtelList* previous;                                                                         // backward link
-        SProtelList* next;                                                                              // forward link
-    };
-    SProtelList* m_sProtelList;                                                        // points to first entry in list
-    SProtelList* m_sProtelListCurrent;                                               // points to current entry in list
-    CRITICAL_SECTION criticalSection;
-    HANDLE m_hMutex;
-    void LockMutex ( void )                                                                       // not currently used
-    {
-        BOOL bWait = SetEvent ( m_hMutex );
-        while ( bWait == FALSE )
+        /**************************************************************************************************************
+         * This moves the cursor past removed entries and on through the following shards until it is on a host,      *
+         * which it returns, or there are none left (NULL).                                                           *
+         **************************************************************************************************************/
+        while ( true )
         {
-            WaitForSingleObject( m_hMutex, INFINITE );
-            bWait = SetEvent ( m_hMutex );
+            while ( m_sProtelListCurrent != NULL && m_sProtelListCurrent->removed == true )
+            {
+                m_sProtelListCurrent = m_sProtelListCurrent->next;
+            }
+            if ( m_sProtelListCurrent != NULL )
+            {
+                return m_sProtelListCurrent->protelHost;
+            }
+            if ( ++m_nShard >= PROTELLIST_SHARDS )
+            {
+                m_nShard = PROTELLIST_SHARDS;
+                return NULL;
+            }
+            m_sProtelListCurrent = m_pProtelList->m_Shards [ m_nShard ].first;
         }
     }
+
+    CProtelList* m_pProtelList;
+    LONG m_nEpoch;                                                                        // when the cursor was opened
+    CProtelList::SProtelList* m_sProtelListCurrent;                                       // current entry, NULL at end
+    int m_nShard;                                                                         // shard of the current entry
  };
@@ -1,21 +1,31 @@
 /**********************************************************************************************************************
  *                                     This file contains the CProtelSerial class.                                    *
  *                                                                                                                    *
- * The Start method of CApplication constructs an instance of this class for each modem in the system. It sets up the *
- * port, then spawns a CProtelSerial::SerialThreadProc thread which is responsible for setting up the modem and       *
- * answering and handling possibly multiple sequential connections until the system shuts down.                       *
+ * The Start method of CApplication constructs an instance of this class for each modem in the system and attaches it *
+ * to its CSerialReactor (see SerialReactor.h). The reactor's one event loop thread handles every modem, handing its  *
+ * database calls to CDatabaseWorkers: it has OnStart called, which sets up the port and the modem, then OnCommEvent, *
+ * OnReceive and OnTimer as things happen, answering and handling possibly multiple sequential connections until the  *
+ * system shuts down. No thread or waitable timer is created for the modem itself: its deadlines (the response        *
+ * timeout, the modem engine's steps, etc.) are reactor session timers, and nothing on the loop thread sleeps.        *
  *                                                                                                                    *
  * ProtelSerial inherits ProtelHost so its constructor also constructs a ProtelHost which it uses to send commands to *
  * any device connected via the modem and handle its responses.                                                       *
  *                                                                                                                    *
+ * The AT commands which reset the modem, dial and answer are sequenced by a CModemEngine (see ModemEngine.h). It     *
+ * goes by the modem's replies and by its own timer (ModemTimer) instead of sleeping for fixed guard times, so the    *
+ * loop is never blocked while the modem is told what to do.                                                          *
+ *                                                                                                                    *
  *                                        Copyright (c) Protel Inc. 2009-2011                                         *
  **********************************************************************************************************************/
 
 #pragma once
+#include "ModemEngine.h"
 #include "ProtelHost.h"
+#include "SerialReactor.h"
 #include <time.h>
 
 #define __TIMEOUT_VALUE__   500                                                           // check state every 500 msec
+#define PROTELSERIAL_DEXPOLLMS 10                  // how often DexBarrier and DevicePlanBarrier check whether to go on
 
 enum CommandTermination
 {
@@ -25,21 +35,43 @@ enum CommandTermination
 };
 
 class CProtelSerial :
-    public CProtelHost
+    public CProtelHost,
+    public CSerialSession
 {
 protected:
     char m_szDevice [ 1024 ];                                     // modem device name (e.g. "Standard 1200 bps Modem")
     char m_szPort [ 1024 ];                                                        // modem port name (e.g. "\\.\COM3")
-    char m_szModemCommandString [ 1024 ];
-    HANDLE m_hComPort;                                                             // serial port associated with modem
     OVERLAPPED m_overLapped;                                                          // allows non-blocking serial I/O
     CommandTermination m_commandTermination;                                      // enumeration above (CR, LF or CRLF)
+    CModemEngine m_ModemEngine;                                            // AT command sequencing - see ModemEngine.h
+    CRITICAL_SECTION m_csModem;                                        // taken to use the modem (polling thread dials)
+    bool m_bDispatchingModem;                                            // TRUE while DispatchModemRequests is running
+    char m_szDialString [ 1024 ];                          // set by Dial for OnPosted to dial ('\0' = nothing to dial)
+    long m_nDialCallNumber;                                                           // the call number Dial was given
+    bool m_bPolling;                                                // OnPosted dialed m_nDialCallNumber, not ended yet
+    long m_nPollEnded;                                                            // call number of the last poll ended
+    bool m_bPollSucceeded;                                                               // whether that poll succeeded
+    HANDLE m_hIdleEvent;                                                     // set when the modem is Idle, NULL = none
+
+    /*
+     * The reactor session timers used by the modem (see SetSessionTimer). Each is independent of the others.
+     */
+    enum SerialTimer
+    {
+        ResponseTimer,                                            // no valid response to last command (GetWaitSeconds)
+        ModemTimer,                                                            // m_ModemEngine's step deadline expired
+        StatusTimer,                                              // check carrier every __TIMEOUT_VALUE__ milliseconds
+        LingerTimer,                                                    // allow A command to be sent before hanging up
+        PingTimer,                                                              // send Z command again (see PingAfter)
+        DexTimer,                                               // check whether DEX records are saved (see DexBarrier)
+        DevicePlanTimer,                             // check whether the devices are looked up (see DevicePlanBarrier)
+    };
 
     enum                                                                                  // current state of the modem
     {
         Uninit,                                                                                       // not set up yet
         Idle,                                                                     // set up and ready to dial or answer
-        Command,                                                                                // (not currently used)
+        Command,                                                           // hanging up and sending the reset commands
         Answering,                                                                  // ATA sent, waiting for connection
         Dialing,                                                              // sending ATD and waiting for connection
         Connected,                                                                        // ready to send/receive data
@@ -53,57 +85,57 @@ protected:
 
 public:
     CProtelSerial(HANDLE hShutDown, LPCTSTR szDevice, LPCTSTR szPort, CommandTermination commandTermination )
-        : CProtelHost ( hShutDown ), m_commandTermination ( commandTermination ), lastActivity ( 0 )
+        : CProtelHost ( hShutDown ), CSerialSession ( true ), m_commandTermination ( commandTermination ),
+        m_ModemEngine ( m_TickClock ), lastActivity ( 0 )
     {
         /**************************************************************************************************************
-         * CONSTRUCTOR. This associates the class with modem szDevice. It initialises things, then spawns a           *
-         * CProtelSerial::ThreadProc which is responsible for originating, answering and handling calls via the       *
-         * modem.                                                                                                     *
+         * CONSTRUCTOR. This associates the class with modem szDevice and opens its port. CApplication then attaches  *
+         * it to the serial reactor, which calls OnStart to set up the modem and the other On... methods to           *
+         * originate, answer and handle calls via it.                                                                 *
          **************************************************************************************************************/
         CallNumber = 0;
         dCallStartTime = ( double ) 0;
         m_eModemState = Uninit;
-        char* pszPort = StrRChr ( szPort, NULL, '\\' );
-        if ( pszPort == NULL )
-        {
-            pszPort = ( char* ) szPort;
-        }
-        else
-        {
-            pszPort++;
-        }
-
-        char szTimerName [ 1024 ];
-        ZeroMemory ( szTimerName, sizeof ( szTimerName ));
-        StringCbCopy ( szTimerName, sizeof ( szTimerName ), szDevice );
-        StringCbCat ( szTimerName, sizeof ( szTimerName ), ":" );
-        StringCbCat ( szTimerName, sizeof ( szTimerName ), pszPort );
-
-        m_hTimer = CreateWaitableTimer (
-            NULL,                                      // lpTimerAttributes [in] - NULL = defaults, cannot be inherited
-            FALSE,                                                 // bManualReset [in] - FALSE = synchronisation timer
-            szTimerName );                                                 // lpTimerName [in] - device:port from above
-
         StringCbCopy ( m_szDevice, sizeof ( m_szDevice ), szDevice );                              // modem device name
         StringCbCopy ( m_szPort, sizeof ( m_szPort ), szPort );                                      // modem port name
         m_EventTrace.Identifier ( "", GetDevice(),GetPort());
-        //m_EventTrace.Event( CEventTrace::Details, "CProtelSerial::CProtelSerial -- m_hTimer = CreateWaitableTimer ( NULL, TRUE, %s );", szTimerName );
-        DWORD dwLastError = GetLastError();
-        if (( m_hTimer != NULL && dwLastError == ERROR_ALREADY_EXISTS ) || m_hTimer == NULL )
-        {
-            m_EventTrace.Event( CEventTrace::Error, "CreateWaitableTimer failed -- %s", CErrorMessage::ErrorMessageFromSystem ( dwLastError ));
-        }
 
         //m_EventTrace.Event( CEventTrace::Details, "CProtelSerial::CProtelSerial(char* szDevice, char* szPort)" );
 
+        InitializeCriticalSection ( &m_csModem );
+        m_bDispatchingModem = false;
+        ZeroMemory ( m_szDialString, sizeof ( m_szDialString ));
+        m_nDialCallNumber = 0;
+        m_bPolling = false;
+        m_nPollEnded = 0;
+        m_bPollSucceeded = false;
+        m_hIdleEvent = NULL;
+        switch ( m_commandTermination )
+        {
+            case CommandTermination::CR:
+                m_ModemEngine.SetTerminator ( "\r" );
+                break;
+            case CommandTermination::LF:
+                m_ModemEngine.SetTerminator ( "\n" );
+                break;
+            case CommandTermination::CRLF:
+                m_ModemEngine.SetTerminator ( "\r\n" );
+                break;
+        }
+
+        /*
+         * The port is associated with the reactor's completion port, so every overlapped operation on it would
+         * normally be queued there when it completes. Setting the low bit of the event handle stops this for the
+         * writes made by Send, which nothing waits for.
+         */
         ZeroMemory ( &m_overLapped, sizeof ( m_overLapped ));
-        m_overLapped.hEvent = CreateEvent(
+        m_overLapped.hEvent = ( HANDLE )(( DWORD_PTR ) CreateEvent(
             NULL,                                         // lpEventAttributes [in] - NULL = handle cannot be inherited
             TRUE,                                                 // bManualReset [in] - TRUE = ResetEvent must be used
             FALSE,                                                // bInitialState [in] - FALSE = initially unsignalled
-            NULL );                                                           // lpName [in] - NULL = object is unnamed
+            NULL ) | 1 );                                                     // lpName [in] - NULL = object is unnamed
 
-        m_hComPort = ::CreateFile (
+        m_hSerialPort = ::CreateFile (
             m_szPort,                                                       // lpFileName [in] - name of device to open
             GENERIC_READ|GENERIC_WRITE,                                        // dwDesiredAccess [in] - read and write
             0,                                                               // dwShareMode [in] - 0 = cannot be shared
@@ -112,12 +144,12 @@ public:
             FILE_FLAG_OVERLAPPED,                                       // dwFlagsAndAttributes [in] - non-blocking I/O
             NULL );                                                // hTemplateFile [in] - sets attributes, NULL = none
 
-        PurgeComm ( m_hComPort, PURGE_TXABORT | PURGE_RXABORT | PURGE_TXCLEAR | PURGE_RXCLEAR );
+        PurgeComm ( m_hSerialPort, PURGE_TXABORT | PURGE_RXABORT | PURGE_TXCLEAR | PURGE_RXCLEAR );
 
         DCB dcb;
         ZeroMemory ( &dcb, sizeof ( dcb ));
         dcb.DCBlength = sizeof ( dcb );
-        GetCommState( m_hComPort, &dcb );
+        GetCommState( m_hSerialPort, &dcb );
 
         dcb.BaudRate = CBR_115200;
 //        dcb.BaudRate = CBR_1200;
@@ -125,24 +157,7 @@ public:
         dcb.Parity = NOPARITY;
         dcb.StopBits = ONESTOPBIT;
  
-        SetCommState( m_hComPort, &dcb );
-
-        DWORD dwThreadId;                                                                             // not needed!!!!
-
-        /*
-         * We spawn a thread that handles connections. This returns a handle which we don't use: we close it
-         * immediately to avoid a handle leak. Note that this doesn't affect the thread - it continues to run to
-         * completion.
-         */
-        CloseHandle(CreateThread(
-                NULL,                                           // lpThreadAttributes [in] - NULL = cannot be inherited
-                0,                                           // dwStackSize [in] - initial stack size - 0 = use default
-                SerialThreadProc,                                                 // lpStartAddress [in] - in this file
-                this,                                        // lpParameter [in] - parameter passed to SerialThreadProc
-                0,                                         // dwCreationFlags [in] - 0 = run immediately after creation
-                &dwThreadId ));                                                // lpThreadId [out] - Can it be NULL????
-        //Reset();
-//        Shutdown();
+        SetCommState( m_hSerialPort, &dcb );
     }
 
     virtual ~CProtelSerial(void)
@@ -150,8 +165,9 @@ public:
         /**************************************************************************************************************
          * DESTRUCTOR.                                                                                                *
          **************************************************************************************************************/
-        CloseHandle ( m_overLapped.hEvent );
-        CloseHandle ( m_hComPort );
+        CloseHandle (( HANDLE )(( DWORD_PTR ) m_overLapped.hEvent & ~( DWORD_PTR ) 1 ));         // see the constructor
+        CloseHandle ( m_hSerialPort );
+        DeleteCriticalSection ( &m_csModem );
         //m_EventTrace.Event( CEventTrace::Details, "CProtelSerial::~CProtelSerial(void)" );
     }
 
@@ -161,23 +177,20 @@ public:
          * The polling thread spawned by CApplication calls this to see if the associated modem is available to make  *
          * a polling call. If so, it returns true.                                                                    *
          *                                                                                                            *
-         * Note: we check for a database connection, ringing in or carrier (RLSD) as well as checking that the modem  *
-         * is idle. There are conditions where the modem could be marked as idle but one of these conditions would be *
-         * just starting or not yet ended.                                                                            *
+         * Note: we check for ringing in or carrier (RLSD) as well as checking that the modem is idle. There are      *
+         * conditions where the modem could be marked as idle but one of these conditions would be just starting or   *
+         * not yet ended.                                                                                             *
          **************************************************************************************************************/
 #ifdef _DEBUG
         OutputDebugString ( "bool AvailableToDial(void)\n" );
 #endif
-        if ( m_padoConnection != NULL )                       // there is an active database connection - modem is busy
+        if ( IsSessionEnding() == true )                           // the serial reactor has stopped or the port failed
         {
-#ifdef _DEBUG
-            OutputDebugString ( "m_padoConnection is not NULL!\n" );
-#endif
             return false;
         }
 
         DWORD dwModemStatus;
-        GetCommModemStatus ( m_hComPort, &dwModemStatus );
+        GetCommModemStatus ( m_hSerialPort, &dwModemStatus );
         DisplayCommunicationsStatus();
         if( dwModemStatus & MS_RING_ON )                                       // the modem is ringing in so can't dial
         {
@@ -200,9 +213,11 @@ public:
     {
         /**************************************************************************************************************
          * The polling thread spawned by CApplication calls this to start a polling call to callNumber via the        *
-         * associated modem. If the modem is available to dial, the call is started and true is returned. This        *
-         * ProtelSerial continues handling the call and cleans up after. If the modem is not available, false is      *
-         * returned and the calling thread must do the cleanup.                                                       *
+         * associated modem. If the modem is available to dial, it is marked Dialing, the serial reactor is asked to  *
+         * start the call (see OnPosted) and true is returned. This ProtelSerial continues handling the call and      *
+         * cleans up after. If the modem is not available, false is returned and the calling thread must do the       *
+         * cleanup. The modem state is checked again under m_csModem, as a RING handled by the serial reactor between *
+         * AvailableToDial and the lock must not be overwritten with Dialing.                                         *
          **************************************************************************************************************/
 
         //m_EventTrace.BeginXML ( CEventTrace::Information );
@@ -215,38 +230,48 @@ public:
             return false;
         }
 
+        EnterCriticalSection ( &m_csModem );
+        if (( m_eModemState != Idle ) || ( IsSessionEnding() == true ))          // a RING or the end came in meanwhile
+        {
+            LeaveCriticalSection ( &m_csModem );
+            return false;
+        }
         m_eModemState = Dialing;
-        char szCallNumber [ 64 ];
-        _itoa_s( callNumber, szCallNumber, sizeof ( szCallNumber ), 10 );
-
-        Initialize();
-        CallNumber = callNumber;
-
-        _variant_t vtDate ( dCallStartTime, VT_DATE );
-        _bstr_t bstrDate = ( _bstr_t ) vtDate;
-
-        //m_EventTrace.Identifier( szCallNumber, GetDevice(), GetPort());
-        //m_EventTrace.BeginXML ( CEventTrace::Information );
-        //m_EventTrace.XML ( CEventTrace::Information, "Dial", ( char* ) pszNumber );
-        //m_EventTrace.XML ( CEventTrace::Information, "CallNumber", szCallNumber );
-        //m_EventTrace.XML ( CEventTrace::Information, "CallTime", ( char* )(( LPCTSTR ) bstrDate ));
-        //m_EventTrace.EndXML ( CEventTrace::Information );
-
-        DWORD dwBytesWritten = 0;
-        char szDialString [ 1024 ];
-        ZeroMemory ( szDialString, sizeof ( szDialString ));
+        m_nDialCallNumber = callNumber;
 #if 0
-        StringCbCopy ( szDialString, sizeof ( szDialString ), "AT M1 DT" );
+        StringCbCopy ( m_szDialString, sizeof ( m_szDialString ), "AT M1 DT" );
 #else
-        StringCbCopy ( szDialString, sizeof ( szDialString ), "AT M0 DT" );
+        StringCbCopy ( m_szDialString, sizeof ( m_szDialString ), "AT M0 DT" );
 #endif
-        StringCbCat ( szDialString, sizeof ( szDialString ), pszNumber );
-        SendCommandToModem ( szDialString );                                                                    // dial
-        SetTimeoutTimer( m_hTimer, 60);                                                 // 60 second timeout for answer
+        StringCbCat ( m_szDialString, sizeof ( m_szDialString ), pszNumber );
+        LeaveCriticalSection ( &m_csModem );
+        PostSession();                                                                      // OnPosted starts the call
 
         return true;
     }
 
+    void NotifyWhenIdle ( HANDLE hEvent )
+    {
+        /**************************************************************************************************************
+         * CApplication calls this (see CDialScheduler::AddPort) before the modem is attached to the serial reactor.  *
+         * From then on, hEvent is set each time the modem becomes Idle, i.e. ready to dial again after a call or a   *
+         * reset.                                                                                                     *
+         **************************************************************************************************************/
+        m_hIdleEvent = hEvent;
+    }
+
+    bool PollSucceeded ( long callNumber )
+    {
+        /**************************************************************************************************************
+         * The polling thread calls this once the modem is available to dial after being given callNumber by Dial. It *
+         * returns true if that call was placed and ended successfully.                                               *
+         **************************************************************************************************************/
+        EnterCriticalSection ( &m_csModem );
+        bool bSucceeded = m_nPollEnded == callNumber && m_bPollSucceeded == true;
+        LeaveCriticalSection ( &m_csModem );
+        return bSucceeded;
+    }
+
     virtual void Send(LPBYTE pszBuffer, int BufferLength)
     {
         /**************************************************************************************************************
@@ -255,152 +280,183 @@ public:
          **************************************************************************************************************/
         DWORD dwBytesWritten = 0;
         WriteFile (
-            m_hComPort,                                                               // hFile [in] - port to output to
+            m_hSerialPort,                                                            // hFile [in] - port to output to
             pszBuffer,                                                                // lpBuffer [in] - data to output
             BufferLength,                                                  // nNumberOfBytesToWrite [in] - size of data
             &dwBytesWritten,             // lpNumberOfBytesWritten [out] - bytes actually written. Can this be NULL????
             &m_overLapped );                                     // lpOverlapped [in, out] - allows non-blocking output
+        m_ModemEngine.Sent();                                                     // for the escape sequence guard time
     }
 
     virtual void Shutdown ( void )
     {
         /**************************************************************************************************************
-         * This overrides the Shutdown method of ProtelHost. It sends commands to disconnect and initialise the       *
-         * modem.                                                                                                     *
+         * This overrides the Shutdown method of ProtelHost. It starts m_ModemEngine disconnecting and initialising   *
+         * the modem. The modem is marked Idle once this is done (see DispatchModemRequests).                         *
          **************************************************************************************************************/
 
-        if ( m_eModemState == Idle )
-            return;                                             // already disconnected and initialised - nothing to do
+        if ( m_eModemState == Idle || IsSessionEnding() == true )
+            return;        // already disconnected and initialised, or the reactor has finished with us - nothing to do
 
         /*
          * We send an H0 to ensure the modem disconnects and an &F to reset it to factory defaults. (Using Z to reset
          * a modem is unwise: you never know what strange configuration someone might have previously stored in it.)
-         */
-        SendCommandToModem("AT H0 &F");
-        SendCommandToModem("AT E0");			// echo off WJS 4/14/2011
-
-        /*
-         * We send the following modem configuration options:
+         *
+         * We then send the following modem configuration options:
          *  M0 to silence the speaker
          *  &C1 to allow the DCD line to be used to detect far-end disconnection
          *  &D2 to allow the DTR line to be used to disconnect and return to command mode
          *  S10=14 to ensure industry-standard carrier loss detection (some UPMS1200s are odd)
          */
-        SendCommandToModem("AT M0 &C1 &D2 S10=14");			//WJS 4/12/2011
-        //SendCommandToModem("AT M0 &C1 &D2 S10=14 S0=3");
-        m_eModemState = Idle;                                                    // mark the modem initialised and idle
+        static const char* const pszResetCommands [] =
+        {
+            "AT H0 &F",
+            "AT E0",			// echo off WJS 4/14/2011
+            "AT M0 &C1 &D2 S10=14",			//WJS 4/12/2011
+            //"AT M0 &C1 &D2 S10=14 S0=3",
+        };
+
+        m_ProtelEngine.ResetCommsErrs();
+        m_ProtelEngine.ClearLastTransmission();
+        CancelTimer( m_hTimer );
+
+        EnterCriticalSection ( &m_csModem );
+        m_eModemState = Command;                                            // being reset - Ready marks the modem Idle
+        m_ModemEngine.Restart ( CarrierDetected(),
+            pszResetCommands, ( int )( sizeof ( pszResetCommands ) / sizeof ( pszResetCommands[ 0 ] )));
+        DispatchModemRequests();
+        LeaveCriticalSection ( &m_csModem );
     }
 
 
 protected:
-    bool SendCommandToModem(LPCTSTR pszModemString)
+    void DispatchModemRequests ( void )
     {
         /**************************************************************************************************************
-         * This ensures the modem is in command mode, then sends command string pszModemString (which should include  *
-         * the "AT" but not any end-of-line). It always returns true.                                                 *
+         * This carries out each request queued by m_ModemEngine until there are none left. It is called in the       *
+         * serial reactor's rounds (on a database worker thread), with m_csModem held, whenever something has been    *
+         * passed to the engine.                                                                                      *
          *                                                                                                            *
-         * Note that, if the modem initialisation includes &D2 or &D3 and the modem responds correctly to a DTR wink, *
-         * it will disconnect before the command is sent. If you don't want this, use &D0 or &D1. However, this may   *
-         * cause an extra delay since +++ will be sent with guard timings if the DCD/RLSD line is active.             *
+         * A request may pass something else to the engine (e.g. NotConnected closes the device, which restarts the   *
+         * engine to reset the modem). The nested call just returns and the loop below carries out what it queued.    *
          **************************************************************************************************************/
-        m_nCommsErrs = 0;
-        m_nLastTransmission = 0;
-        ZeroMemory ( m_LastTransmission, sizeof ( m_LastTransmission ));
-        CancelTimer( m_hTimer );
-
-        char szTimeNow [ 64 ];
-        SYSTEMTIME TimeNow;
-        GetLocalTime ( &TimeNow );
-        StringCbPrintf ( szTimeNow, sizeof ( szTimeNow ), "%02d:%02d:%02d.%03d", TimeNow.wHour, TimeNow.wMinute, TimeNow.wSecond, TimeNow.wMilliseconds );
+        if ( m_bDispatchingModem == true )
+        {
+            return;                                                      // an outer call is already draining the queue
+        }
+        m_bDispatchingModem = true;
 
+        CModemEngine::Request request;
+        while ( m_ModemEngine.NextRequest ( request ))
+        {
+            switch ( request.Type )
+            {
+                case CModemEngine::WriteModem:
 #ifdef _DEBUG
-        OutputDebugString ( "SendCommandToModem ( \"" );
-        OutputDebugString ( pszModemString );
-        OutputDebugString ( "\" ) " );
-        OutputDebugString ( szTimeNow );
-        OutputDebugString ( "\n" );
+                    OutputDebugString ( "WriteModem ( \"" );
+                    OutputDebugString ( request.Text );
+                    OutputDebugString ( "\" )\n" );
 #endif
-        DWORD dwBytesWritten = 0;
-        //m_EventTrace.BeginXML ( CEventTrace::Information );
-        //m_EventTrace.XML ( CEventTrace::Information, "SendCommandToModem", ( char* ) pszModemString );
-        //m_EventTrace.XML ( CEventTrace::Information, "LocalTime", szTimeNow );
-        //m_EventTrace.EndXML ( CEventTrace::Information );
+                    Send (( LPBYTE ) request.Text, request.Length );
+                    break;
 
-        ZeroMemory ( m_szModemCommandString, sizeof ( m_szModemCommandString ));
+                case CModemEngine::SetDtr:
+                    EscapeCommFunction( m_hSerialPort, SETDTR );
+                    break;
 
-        DWORD dwModemStatus;
+                case CModemEngine::ClearDtr:
+                    EscapeCommFunction( m_hSerialPort, CLRDTR );
+                    break;
 
-        if ( m_eModemState == Answering || m_eModemState == Dialing )
-        {
-            /*
-             * We were waiting for the modem to connect. We send a single space which normally aborts the operation.
-             */
-            WriteFile (
-                m_hComPort,                                                           // hFile [in] - port to output to
-                " ",                                                                  // lpBuffer [in] - data to output
-                1,                                                         // nNumberOfBytesToWrite [in] - size of data
-                &dwBytesWritten,         // lpNumberOfBytesWritten [out] - bytes actually written. Can this be NULL????
-                &m_overLapped );                                 // lpOverlapped [in, out] - allows non-blocking output
-        }
+                case CModemEngine::StartTimer:
+                    SetSessionTimer ( ModemTimer, request.Milliseconds );
+                    break;
 
-        Sleep(500);                                                             // minimum delay before command is sent
-        if ( m_eModemState != Idle && m_eModemState != Disconnected )
-        {
-            /*
-             * We check if the modem DCD/RLSD (Carrier Detect) signal is on. If it is, the modem may be currently
-             * connected and we momentarily drop DTR to try to disconnect it and return it to command mode.
-             */
-            GetCommModemStatus ( m_hComPort, &dwModemStatus );
-            if ( dwModemStatus & MS_RLSD_ON )
-            {
-                EscapeCommFunction( m_hComPort, CLRDTR );
-                Sleep(500);
-                EscapeCommFunction( m_hComPort, SETDTR );
-                Sleep(500);
-                GetCommModemStatus ( m_hComPort, &dwModemStatus );
+                case CModemEngine::StopTimer:
+                    CancelSessionTimer ( ModemTimer );
+                    break;
 
-                if ( dwModemStatus & MS_RLSD_ON )
-                {
+                case CModemEngine::Ready:
+                    m_eModemState = Idle;                                                 // modem initialised and idle
+                    if ( m_hIdleEvent != NULL )
+                    {
+                        SetEvent ( m_hIdleEvent );                               // the dial scheduler can use it again
+                    }
+                    if ( IsSessionStopping() == true )
+                    {
+                        EndSession();                            // reset for shutdown - the reactor can close the port
+                    }
+                    break;
+
+                case CModemEngine::Connected:
                     /*
-                     * DCD/RLSD is still on (e.g. the modem was set up with &D0 or &D1). We send the escape sequence
-                     * (+++) to the modem with guard timings. This should return it to command mode.
-                     *
-                     * The guard delay is set by the modem's S12 register and is normally 50 (1 second). It's already
-                     * at least 1.5 seconds since we sent anything.
+                     * The modem is now in data mode. We throw away anything received so far and send the first
+                     * command (I) to the auditor.
                      */
-                    WriteFile (
-                        m_hComPort,                                                   // hFile [in] - port to output to
-                        "+++",                                                        // lpBuffer [in] - data to output
-                        3,                                                 // nNumberOfBytesToWrite [in] - size of data
-                        &dwBytesWritten, // lpNumberOfBytesWritten [out] - bytes actually written. Can this be NULL????
-                        &m_overLapped );                         // lpOverlapped [in, out] - allows non-blocking output
-                    Sleep(1500);                                              // guard delay again with 500 msec safety
+                    m_EventTrace.Event( CEventTrace::Details, "%s\t%s", m_szDevice, request.Text );
+                    m_eModemState = Connected;
+                    CountSession ( true );
+                    CancelTimer( m_hTimer );
+                    PurgeComm(
+                        this->m_hSerialPort,                                              // hFile [in] - the comm port
+                        PURGE_RXCLEAR | PURGE_RXABORT ); // dwFlags [in] - end read operations, clear buffer and return immediately
+                    Transmit_I_Command();
+                    break;
 
-                }
+                case CModemEngine::NotConnected:
+                    m_EventTrace.BeginXML ( CEventTrace::Information );
+                    m_EventTrace.XML ( CEventTrace::Information, "NotConnected",
+                        ( char* )( request.Length > 0 ? request.Text : "Timeout" ));
+                    m_EventTrace.XML ( CEventTrace::Information, "Port", GetPort());
+                    m_EventTrace.EndXML ( CEventTrace::Information );
+                    CloseDevice(0);                                                                 // resets the modem
+                    break;
+
+                case CModemEngine::Ring:
+                    if ( m_eModemState == Idle )                                      // not while resetting or dialing
+                    {
+                        m_EventTrace.Event( CEventTrace::Details, "%s\tRING %s", m_szDevice, request.Text );
+                        Initialize();
+                        if ( Database_AddNewCall() == true )
+                        {
+                            m_eModemState = Answering;                   // the call is recorded, tell modem to answer
+                            m_ModemEngine.Connect ( "ATA", true );                 // Connected or NotConnected follows
+                        }
+                        else
+                        {
+                            Transmit_A_Command(false);       // bug 3010 sez bail out gracefully when this is the case
+                        }
+                    }
+                    break;
+
+                case CModemEngine::ResetTimed:
+                    CMetrics::Instance().ObserveModem ( CMetrics::ModemReset, request.Milliseconds );
+                    break;
+
+                case CModemEngine::DialTimed:
+                    CMetrics::Instance().ObserveModem ( CMetrics::ModemDial, request.Milliseconds );
+                    break;
+
+                case CModemEngine::AnswerTimed:
+                    CMetrics::Instance().ObserveModem ( CMetrics::ModemAnswer, request.Milliseconds );
+                    break;
+
+                case CModemEngine::DeadlineMissed:
+                    CMetrics::Instance().CountModemTimeout();
+                    break;
             }
         }
+        m_bDispatchingModem = false;
+    }
 
-        StringCbCat ( m_szModemCommandString, sizeof ( m_szModemCommandString ), pszModemString );
-        switch ( m_commandTermination )
-        {
-            case CommandTermination::CR:
-                StringCbCat ( m_szModemCommandString, sizeof ( m_szModemCommandString ), "\r" );
-                break;
-            case CommandTermination::LF:
-                StringCbCat ( m_szModemCommandString, sizeof ( m_szModemCommandString ), "\n" );
-                break;
-            case CommandTermination::CRLF:
-                StringCbCat ( m_szModemCommandString, sizeof ( m_szModemCommandString ), "\r\n" );
-                break;
-        }
-//printf("PROTELSERIAL P800 #%s#\n", m_szModemCommandString);
-        WriteFile (
-            m_hComPort,                                                               // hFile [in] - port to output to
-            m_szModemCommandString,                                                   // lpBuffer [in] - data to output
-            lstrlen ( m_szModemCommandString ),                            // nNumberOfBytesToWrite [in] - size of data
-            &dwBytesWritten,             // lpNumberOfBytesWritten [out] - bytes actually written. Can this be NULL????
-            &m_overLapped );                                     // lpOverlapped [in, out] - allows non-blocking output
-        return true;
+    bool CarrierDetected ( void )
+    {
+        /**************************************************************************************************************
+         * This returns true if the modem's DCD/RLSD (Carrier Detect) signal is on.                                   *
+         **************************************************************************************************************/
+        DWORD dwModemStatus;
+        GetCommModemStatus ( m_hSerialPort, &dwModemStatus );
+        return ( dwModemStatus & MS_RLSD_ON ) == MS_RLSD_ON;
     }
 
     void DisplayCommunicationsStatus( void )
@@ -409,7 +465,7 @@ protected:
          * Not currently used.                                                                                        *
          **************************************************************************************************************/
         DWORD dwModemStatus;
-        GetCommModemStatus ( m_hComPort, &dwModemStatus );
+        GetCommModemStatus ( m_hSerialPort, &dwModemStatus );
         //m_EventTrace.BeginXML ( CEventTrace::Information );
         //m_EventTrace.XML ( CEventTrace::Information, "CTS", ( dwModemStatus & MS_CTS_ON ) ? "ON" : "OFF" );
         //m_EventTrace.XML ( CEventTrace::Information, "DSR", ( dwModemStatus & MS_DSR_ON ) ? "ON" : "OFF" );
@@ -418,38 +474,15 @@ protected:
         //m_EventTrace.EndXML ( CEventTrace::Information );
     }
 
-    static DWORD WINAPI SerialThreadProc( LPVOID lpParam )
+    virtual void OnStart ( void )
     {
         /**************************************************************************************************************
-         * This is the thread that is spawned for each CProtelSerial constructed (i.e. each modem in the system). It  *
-         * calls ThreadProc below which is responsible for originating, answering and handling calls via that modem.  *
-         * The thread continues running until shutdown occurs.                                                        *
+         * This is called on a database worker thread (see SerialReactor.h) once the modem has been attached to it.   *
+         * We reset the modem, say which comm events we want and make reads return at once. The reactor then keeps a  *
+         * WaitCommEvent outstanding on the port, and we check carrier every __TIMEOUT_VALUE__ msec as well.          *
          **************************************************************************************************************/
-        CoInitialize(NULL);                                               // initialise the COM library for this thread
-        CProtelSerial* protelSerial = (CProtelSerial*)lpParam;
-        protelSerial->ThreadProc();
-        CoUninitialize();                                        // close the COM library and clean up thread resources
-        return 0;
-    }
-
-    void ThreadProc(void)                                                                          // called from above
-    {
-        m_EventTrace.Event( CEventTrace::Details, "%s\tSTART -- void CProtelSerial::ThreadProc(void)", m_szDevice );
-
-        OVERLAPPED ov;
-        ZeroMemory ( &ov, sizeof ( ov ));
-        ov.hEvent = CreateEvent(
-            NULL,                                         // lpEventAttributes [in] - NULL = handle cannot be inherited
-            TRUE,                                                 // bManualReset [in] - TRUE = ResetEvent must be used
-            FALSE,                                                // bInitialState [in] - FALSE = initially unsignalled
-            NULL );                                                           // lpName [in] - NULL = object is unnamed
-
-
-        //HANDLE hWaitObjects [ 4 ];
-        HANDLE hWaitObjects [ 3 ];
-        hWaitObjects[ 0 ] = m_hShutDown;
-        hWaitObjects[ 1 ] = ov.hEvent;
-        hWaitObjects[ 2 ] = m_hTimer;
+        m_EventTrace.Event( CEventTrace::Details, "%s\tSTART -- void CProtelSerial::OnStart(void)", m_szDevice );
+        EnterCriticalSection ( &m_csModem );
 
         CloseDevice(3);
 
@@ -465,7 +498,7 @@ protected:
            EV_TXEMPTY  // The last character in the output buffer was sent.
          */
         DWORD dwMask = EV_BREAK | EV_CTS | EV_DSR | EV_ERR | EV_RING | EV_RLSD | EV_RXCHAR | EV_RXFLAG | EV_TXEMPTY;
-        SetCommMask ( m_hComPort, dwMask );
+        SetCommMask ( m_hSerialPort, dwMask );
 
         COMMTIMEOUTS CommTimeouts;
         CommTimeouts.ReadIntervalTimeout         = MAXDWORD;              //These values ensure that the read operation
@@ -473,255 +506,204 @@ protected:
         CommTimeouts.ReadTotalTimeoutConstant    = 0;                //already been received, even if none are received
         CommTimeouts.WriteTotalTimeoutMultiplier = 0;                                              //Time-outs not used
         CommTimeouts.WriteTotalTimeoutConstant   = 0;                                             //for write operation
-        SetCommTimeouts ( m_hComPort, &CommTimeouts );
+        SetCommTimeouts ( m_hSerialPort, &CommTimeouts );
 
         DisplayCommunicationsStatus();
+        SetSessionTimer ( StatusTimer, __TIMEOUT_VALUE__ );
+        LeaveCriticalSection ( &m_csModem );
+    }
 
-        bool bShutdown = false;
-        DWORD dwEvent = 0;                                                                             // just starting
-		char tembuf[256]; 
-		unsigned char n = 0;			// WJS 4/14/2011 
-        while ( bShutdown == false )
-        {
-            DWORD dwEventReceived = 0;
-            if (dwEvent < WAIT_OBJECT_0 + 3)
-                /*
-                 * Either we are just starting or something other than serial timeout occurred last time. We wait for
-                 * a comm event (this avoids excessive CPU loading).
-                 */
-                WaitCommEvent (
-                    m_hComPort,                                                         // hFile [in] - port to monitor
-                    &dwEventReceived,                              // lpEvtMask [out] - indicates which events occurred
-                    &ov );                                               // lpOverlapped [in] - allows non-blocking I/O
-            else
-                dwEventReceived = 0;                                                  // was serial timeout - no events
-            dwEvent = WaitForMultipleObjects(
-                sizeof ( hWaitObjects ) / sizeof ( hWaitObjects[ 0 ] ), // nCount [in] - number of objects in *lpHandles
-                hWaitObjects,                                                   // lpHandles [in] - objects to wait for
-                FALSE,                                   // bWaitAll [in] - FALSE - return when any object is signalled
-                __TIMEOUT_VALUE__ );                                                   // dwMilliseconds [in] - timeout
+    virtual void OnCommEvent ( DWORD Events )
+    {
+        /**************************************************************************************************************
+         * This is called on a database worker thread (see SerialReactor.h) when the WaitCommEvent on our port        *
+         * completes. Any change of DCD causes EV_RLSD, so we check carrier straight away. (Characters received are   *
+         * passed to OnReceive next.)                                                                                 *
+         **************************************************************************************************************/
+        EnterCriticalSection ( &m_csModem );                                // Dial may be called by the polling thread
+        CheckCarrier();
+        LeaveCriticalSection ( &m_csModem );
+    }
 
+    virtual void OnReceive ( BYTE* pBuffer, int BufferLength )
+    {
+        /**************************************************************************************************************
+         * This is called on a database worker thread (see SerialReactor.h) with what has been read from the port.    *
+         **************************************************************************************************************/
+        EnterCriticalSection ( &m_csModem );
+        if ( m_eModemState == Connected )
+        {
             /*
-             * We check the modem's DCD (Carrier Detect) line. (Note that any change causes EV_RLSD so we will get
-             * here immediately.) Consider checking DSR also!!!!
-             *
-             * If DCD is active and we were dialing or answering a call, we mark that the modem is connected, wait
-             * briefly for things to stabilise, purge the receive buffer and send the first command (I) to the
-             * auditor.
-             *
-             * If DCD is inactive and we were connected, we mark far-end disconnection and clean up.
+             * We received something via the connected modem. We pass it to ProtelHost::MessageReceived() via our
+             * MessageReceived().
              */
-            DWORD dwModemStatus;
-            GetCommModemStatus ( m_hComPort, &dwModemStatus );
-            if ( ( dwModemStatus & MS_RLSD_ON ) == MS_RLSD_ON )                                      // DCD/RLSD active
-            {
-                if ( m_eModemState == Dialing || m_eModemState == Answering )
-                {
-                    m_eModemState = Connected;
-                    CancelTimer( m_hTimer );
-                    Sleep(2000);
-                    PurgeComm(
-                        this->m_hComPort,                                                 // hFile [in] - the comm port
-                        PURGE_RXCLEAR | PURGE_RXABORT ); // dwFlags [in] - end read operations, clear buffer and return immediately
-                    Transmit_I_Command();
-                }
-            }
-            else if ( m_eModemState == Connected )                                             // far-end disconnection
-	        {
-		        m_eModemState = Disconnected;
-			    CloseDevice(0);
-			}
-
-            time ( &lastActivity );
+            MessageReceived ( pBuffer, BufferLength );
+        }
+        else
+        {
+            /*
+             * What the modem sent in command mode (the echo of a command, a result code or caller ID) is for
+             * m_ModemEngine. A RING while the modem is idle comes back as a Ring request (see DispatchModemRequests).
+             */
+            m_ModemEngine.Receive (( const char* ) pBuffer, BufferLength );
+            DispatchModemRequests();
+        }
+        LeaveCriticalSection ( &m_csModem );
+    }
 
-            switch (dwEvent)
-            {
-                case WAIT_OBJECT_0:                                                     // system shutdown is signaled.
+    virtual void OnTimer ( int Timer )
+    {
+        /**************************************************************************************************************
+         * This is called on a database worker thread (see SerialReactor.h) when one of the modem's timers (a         *
+         * SerialTimer) is due.                                                                                       *
+         **************************************************************************************************************/
+        EnterCriticalSection ( &m_csModem );
+        switch ( Timer )
+        {
+            case StatusTimer:
+                CheckCarrier();
+                SetSessionTimer ( StatusTimer, __TIMEOUT_VALUE__ );
+                break;
 
+            case ResponseTimer:                                                           // time expired while waiting
+                if ( m_eModemState == Connected )
+                {
+                    /*
+                     * Timeout while we were processing commands. Note that the timer was set by ProtelHost::Transmit
+                     * or ProtelHost::Retransmit.
+                     */
 #ifdef _DEBUG
-                    OutputDebugString ( "WAIT_OBJECT_0:// shutdown was signaled.\n" );
+                    OutputDebugString ( "ResponseTimer:// Timer (time expired while waiting) was signaled.\n" );
 #endif
-                    // Perform tasks required by this event.
-                    bShutdown = true;
-					CloseDevice(0);
-                    break;
-
-                case WAIT_OBJECT_0 + 1:                                                     // modem event is signaled.
+                    if ( ResyncResponse() == true )
                     {
-                        //if ( dwEventReceived == EV_RING) //wjs 4/13/2011                           // ring-in
-                        //if ( dwEventReceived == EV_RING && m_eModemState == Idle ) //wjs 4/13/2011                           // ring-in
-       //                 if ( (( dwEventReceived & EV_RXCHAR ) == EV_RXCHAR)  && m_eModemState == Idle ) //wjs 4/13/2011                           // ring-in
-       //                 {
-							//
-							////if (m_eModemState == Idle ) {
-       //                     //pszFlag[ Offset ] = "EV_RING";
-       //                     //Offset++;
-       //                     Initialize();
-       //                     if ( Database_AddNewCall() == true )
-       //                     {
-       //                         m_eModemState = Answering;         // Database connection is open, tell modem to answer
-       //                         SendCommandToModem ( "ATA" );
-       //                         SetTimeoutTimer( m_hTimer, 60);                          // timeout if connection fails
-       //                     }
-							////}
-       //                 }
-
-                        if (( dwEventReceived & EV_RXCHAR ) == EV_RXCHAR )                     // character(s) received
-                        {
-                            DWORD dwBytesRead = 0;
-                            char szReadBuffer [ 1024 ];
-                            ZeroMemory ( szReadBuffer, sizeof ( szReadBuffer ));
-                            BOOL bOK = ReadFile (
-                                m_hComPort,                                               // hFile [in] - the comm port
-                                szReadBuffer,                                         // lpBuffer [out] - data received
-                                sizeof ( szReadBuffer ),           // nNumberOfBytesToRead [in] - maximum bytes to read
-                                &dwBytesRead,                // lpNumberOfBytesRead [out] - actual number of bytes read
-                                &ov );                              // lpOverlapped [in, out] - allows non-blocking I/O
-                            if ( bOK == FALSE )
-                            {
-                                DWORD dwError = GetLastError();
-                                if ( dwError == ERROR_IO_PENDING )
-                                {
-                                    GetOverlappedResult(
-                                       m_hComPort,                                        // hFile [in] - the comm port
-                                       &ov,                         // lpOverlapped [in, out] - allows non-blocking I/O
-                                       &dwBytesRead,         // lpNumberOfBytesRead [out] - actual number of bytes read
-                                       TRUE );                      // bWait - TRUE = wait until operation is completed
-                                }
-							}
-
-							if( dwBytesRead > 0 && m_eModemState == Idle )
-							{
-								DWORD nLoop = 0;
-								while (nLoop++ < dwBytesRead)
-								{
-				
-								   tembuf[n] = szReadBuffer [ nLoop ] ;                                    // show on screen
-								   if (tembuf[n++] == 0x0a)
-								   { 
-										tembuf[n] = 0;
-										//int tst = strstr(tembuf, "RING");
-										if (strstr(tembuf, "RING") != NULL) 
-										{
-											Initialize();
-											if ( Database_AddNewCall() == true )
-											{
-												m_eModemState = Answering;         // Database connection is open, tell modem to answer
-												SendCommandToModem ( "ATA" );
-												SetTimeoutTimer( m_hTimer, 60);                          // timeout if connection fails
-											}
-											else
-											{
-												Transmit_A_Command(false);   // bug 3010 sez bail out gracefully when this is the case
-											}
-											memset(tembuf, 0, sizeof(tembuf));
-											n = 0;
-											break;
-										}
-										memset(tembuf, 0, sizeof(tembuf));
-										n = 0;
-								   }
-								}
-							}
-
-
-							if ( dwBytesRead > 0 && m_eModemState == Connected )
-                            {
-                                /*
-                                 * We received something via the connected modem and saved it in szReadBuffer. We
-                                 * pass it to ProtelHost::MessageReceived() via our MessageReceived().
-                                 */
-                                MessageReceived(( BYTE* ) szReadBuffer, dwBytesRead );
-                            }
-						}
-
-
-//#endif
-       //                     if( dwBytesRead > 0 && m_eModemState == Idle )
-							//{
-							//	tembuff = szReadBuffer.substring(0, bn) bn = atart position for CR
-							//		if (instr(tembuf, "RING")) > 0 then continue processing
-							//		else
-							//			read until Ring found
-
-
-							//
-       //                     Initialize();
-       //                     if ( Database_AddNewCall() == true )
-       //                     {
-       //                         m_eModemState = Answering;         // Database connection is open, tell modem to answer
-       //                         SendCommandToModem ( "ATA" );
-       //                         SetTimeoutTimer( m_hTimer, 60);                          // timeout if connection fails
-       //                     }
-							//}
-                           
-                        //}
+                        break;                                             // the response was held up behind a stray T
                     }
-                    break;
-
-                case WAIT_OBJECT_0 + 2:                                                                              //
+                    if ( ContinueComms(false) == false )
                     {
-                        /*
-                         * Timer (time expired while waiting) was signaled.
-                         */
-                        CancelTimer( m_hTimer );
-                        if ( m_eModemState == Connected )
-                        {
-                            /*
-                             * Timeout while we were processing commands. Note that the timer was set by
-                             * ProtelHost::Transmit or ProtelHost::Retransmit.
-                             */
-#ifdef _DEBUG
-                            OutputDebugString ( "WAIT_OBJECT_0 + 2:// Timer (time expired while waiting) was signaled.\n" );
-#endif
-                            if ( ContinueComms(false) == false )
-                            {
-#ifdef _DEBUG
-                                OutputDebugString ( "Too many retries -- stopping call\n" );
-#endif
-                            m_EventTrace.BeginXML ( CEventTrace::Information );
-                            m_EventTrace.XML ( CEventTrace::Information, "Timeout", "Waiting for response from cellular" );
-                            //m_EventTrace.XML ( CEventTrace::Information, "Modem", GetDevice() );
-                            m_EventTrace.XML ( CEventTrace::Information, "Port", GetPort());
-                            m_EventTrace.EndXML ( CEventTrace::Information );
-                                Transmit_A_Command(false);                     // abort connection, signalling to retry
-                                Sleep(2000);                                                // allow command to be sent
-                                CloseDevice(0);
-                            }
-                            else
-                            {
 #ifdef _DEBUG
-                                OutputDebugString ( "Retransmit();\n" );
+                        OutputDebugString ( "Too many retries -- stopping call\n" );
 #endif
-                                Retransmit();                             // resend last command - method of ProtelHost
-                            }
-                        }
-
-                        else if ( m_eModemState == Dialing || m_eModemState == Answering )         // connection failed
-                        {
+                        m_EventTrace.BeginXML ( CEventTrace::Information );
+                        m_EventTrace.XML ( CEventTrace::Information, "Timeout", "Waiting for response from cellular" );
+                        m_EventTrace.XML ( CEventTrace::Information, "Port", GetPort());
+                        m_EventTrace.EndXML ( CEventTrace::Information );
+                        Transmit_A_Command(false);                             // abort connection, signalling to retry
+                        SetSessionTimer ( LingerTimer, 2000 );                              // allow command to be sent
+                    }
+                    else
+                    {
 #ifdef _DEBUG
-                            OutputDebugString ( "Timeout while waiting for a response from the Modem -- stopping call\n" );
+                        OutputDebugString ( "Retransmit();\n" );
 #endif
-                            CloseDevice(0);
-                            //m_EventTrace.BeginXML ( CEventTrace::Information );
-                            //m_EventTrace.XML ( CEventTrace::Information, "Timeout", "Waiting for response" );
-                            //m_EventTrace.XML ( CEventTrace::Information, "Modem", GetDevice() );
-                            //m_EventTrace.XML ( CEventTrace::Information, "Port", GetPort());
-                            //m_EventTrace.EndXML ( CEventTrace::Information );
-                        }
+                        Retransmit();                                     // resend last command - method of ProtelHost
                     }
-                    break;
+                }
+                break;
 
-            }
+            case LingerTimer:
+                if ( m_eModemState == Connected )
+                {
+                    CloseDevice(0);
+                }
+                break;
+
+            case ModemTimer:
+                /*
+                 * A dial or answer that fails to connect in time is reported as NotConnected and ended by
+                 * DispatchModemRequests.
+                 */
+                m_ModemEngine.TimerExpired();
+                DispatchModemRequests();
+                break;
+
+            case PingTimer:
+                Transmit_Z_Command();
+                break;
+
+            case DexTimer:
+                DexBarrier();
+                break;
+
+            case DevicePlanTimer:
+                DevicePlanBarrier();
+                break;
         }
+        LeaveCriticalSection ( &m_csModem );
+    }
 
-        /*
-         * The system itself is shutting down. We tidy everything up.
-         */
+    virtual void OnPosted ( void )
+    {
+        /**************************************************************************************************************
+         * This is called on a database worker thread (see SerialReactor.h) after Dial has marked the modem Dialing.  *
+         * We start the call, unless the modem has been reset meanwhile or the system is shutting down.               *
+         **************************************************************************************************************/
+        EnterCriticalSection ( &m_csModem );
+        if ( m_eModemState == Dialing && m_szDialString [ 0 ] != '\0' && IsSessionStopping() == false )
+        {
+            Initialize();
+            CallNumber = m_nDialCallNumber;
+            m_bPolling = true;                                                        // CloseDevice records the result
+            m_ModemEngine.Connect ( m_szDialString, false );                // dial - Connected or NotConnected follows
+            DispatchModemRequests();
+        }
+        else if ( m_szDialString [ 0 ] != '\0' )
+        {
+            m_nPollEnded = m_nDialCallNumber;                                                           // never placed
+            m_bPollSucceeded = false;
+        }
+        m_szDialString [ 0 ] = '\0';
+        LeaveCriticalSection ( &m_csModem );
+    }
+
+    virtual void OnStop ( void )
+    {
+        /**************************************************************************************************************
+         * This is called on a database worker thread (see SerialReactor.h) when the system is shutting down. Any     *
+         * call is ended and the modem reset; once it is (see DispatchModemRequests), or at once if it is already     *
+         * idle, the session ends.                                                                                    *
+         **************************************************************************************************************/
+        EnterCriticalSection ( &m_csModem );
+        CloseDevice(0);
+        if ( m_ModemEngine.IsResetting() == false )
+        {
+            EndSession();
+        }
+        LeaveCriticalSection ( &m_csModem );
+    }
+
+    virtual void OnClosed ( void )
+    {
+        /**************************************************************************************************************
+         * This is called on a database worker thread (see SerialReactor.h) once the session has ended and its I/O    *
+         * has been cancelled. The reactor has finished with us, so we tidy everything up.                            *
+         **************************************************************************************************************/
+        EnterCriticalSection ( &m_csModem );
         CloseDevice(2);
-        CancelIo ( m_hComPort );
-        CloseHandle ( ov.hEvent );
-        m_EventTrace.Event( CEventTrace::Details, "%s\tSTOP --- void CProtelSerial::ThreadProc(void)", m_szDevice );
+        LeaveCriticalSection ( &m_csModem );
+        m_EventTrace.Event( CEventTrace::Details, "%s\tSTOP --- void CProtelSerial::OnClosed(void)", m_szDevice );
+    }
+
+    void CheckCarrier ( void )
+    {
+        /**************************************************************************************************************
+         * This checks the modem's DCD (Carrier Detect) line. Consider checking DSR also!!!!                          *
+         *                                                                                                            *
+         * m_ModemEngine is told of every change. If DCD becomes active while we are dialing or answering a call, it  *
+         * waits briefly for the CONNECT result and then has us mark that the modem is connected, purge the receive   *
+         * buffer and send the first command (I) to the auditor (see DispatchModemRequests).                          *
+         *                                                                                                            *
+         * If DCD is inactive and we were connected, we mark far-end disconnection and clean up.                      *
+         **************************************************************************************************************/
+        bool bCarrier = CarrierDetected();
+        m_ModemEngine.CarrierChanged ( bCarrier );
+        DispatchModemRequests();
+        if ( bCarrier == false && m_eModemState == Connected )                                 // far-end disconnection
+        {
+            m_eModemState = Disconnected;
+            CloseDevice(0);
+        }
+        time ( &lastActivity );
     }
 
     virtual void CloseDevice ( int typeclose )
@@ -738,6 +720,16 @@ protected:
 #ifdef _DEBUG
         OutputDebugString ( "virtual void CloseDevice ( int typeclose )\n" );
 #endif
+        CancelSessionTimer ( LingerTimer );                                                // the call's timers, if set
+        CancelSessionTimer ( PingTimer );
+        CancelSessionTimer ( DexTimer );
+        CancelSessionTimer ( DevicePlanTimer );
+        if ( m_bPolling == true )                                                        // the call Dial was asked for
+        {
+            m_bPolling = false;
+            m_nPollEnded = m_nDialCallNumber;
+            m_bPollSucceeded = typeclose == 1;
+        }
         Shutdown();                                                                                // commands to modem
         CProtelHost::CloseDevice( typeclose );
         m_EventTrace.Identifier ( "", GetDevice(),GetPort());
@@ -795,8 +787,8 @@ protected:
     virtual int GetWaitSeconds ( void )
     {
         /**************************************************************************************************************
-         * This overrides the GetWaitSeconds method of ProtelHost. It returns the timeout in seconds to use if a      *
-         * valid response to a command isn't received.                                                                *
+         * This overrides the GetWaitSeconds method of ProtelHost. It returns the longest timeout in seconds to use   *
+         * if a valid response to a command isn't received.                                                           *
          **************************************************************************************************************/
         return 10;
     }
@@ -809,4 +801,62 @@ protected:
          **************************************************************************************************************/
         return 9;                                           // e.g. 9 - disconnect after three transmissions of command
     }
+
+    virtual void CancelTimer ( HANDLE& hTimer )
+    {
+        /**************************************************************************************************************
+         * This overrides the CancelTimer method of ProtelHost to cancel the response timeout (hTimer is unused).     *
+         **************************************************************************************************************/
+        CancelSessionTimer ( ResponseTimer );
+    }
+
+    virtual void SetTimeoutTimer ( HANDLE& hTimer, int Milliseconds )
+    {
+        /**************************************************************************************************************
+         * This overrides the SetTimeoutTimer method of ProtelHost to start the response timeout using the reactor    *
+         * session timer (hTimer is unused).                                                                          *
+         **************************************************************************************************************/
+        SetSessionTimer ( ResponseTimer, Milliseconds );
+    }
+
+    virtual void PingAfter ( int Milliseconds )
+    {
+        /**************************************************************************************************************
+         * This overrides the PingAfter method of ProtelHost so the Z command is sent by OnTimer rather than after    *
+         * sleeping on the database worker thread.                                                                    *
+         **************************************************************************************************************/
+        SetSessionTimer ( PingTimer, Milliseconds );
+    }
+
+    virtual void DexBarrier ( void )
+    {
+        /**************************************************************************************************************
+         * This overrides the DexBarrier method of ProtelHost as ProtelSocket does: until the DEX records are saved   *
+         * (or it is clear they won't be), OnTimer calls it again every PROTELSERIAL_DEXPOLLMS, and the other modems  *
+         * carry on meanwhile.                                                                                        *
+         **************************************************************************************************************/
+        bool bSettled = false;
+        IsDexSaved ( bSettled );
+        if ( bSettled == false )
+        {
+            SetSessionTimer ( DexTimer, PROTELSERIAL_DEXPOLLMS );
+            return;
+        }
+        FinishDexUpload();
+    }
+
+    virtual void DevicePlanBarrier ( void )
+    {
+        /**************************************************************************************************************
+         * This overrides the DevicePlanBarrier method of ProtelHost in the same way as DexBarrier: until             *
+         * CDevicePrefetcher has looked the devices up (or it is clear it won't), OnTimer calls it again every        *
+         * PROTELSERIAL_DEXPOLLMS, and only then is the O command sent.                                               *
+         **************************************************************************************************************/
+        if ( IsDevicePlanSettled() == false )
+        {
+            SetSessionTimer ( DevicePlanTimer, PROTELSERIAL_DEXPOLLMS );
+            return;
+        }
+        CProtelHost::DevicePlanBarrier();
+    }
 };
@@ -3,8 +3,10 @@
  *                                                                                                                    *
  * SocketListener::ListenThreadProc constructs an instance of this class for each incoming socket connection.         *
  *                                                                                                                    *
- * The class constructor spawns a new CprotelSocket::SocketThreadProc thread which is responsible for handling the    *
- * connection and is destroyed once the connection ends.                                                              *
+ * SocketListener then attaches it to its CSocketReactor (see SocketReactor.h). One of the reactor's event loop       *
+ * threads handles the connection until it ends, calling OnStart, OnReceive and OnTimer below, then OnClosed once     *
+ * the connection has ended. No thread or waitable timer is created for the connection itself: its deadlines (the     *
+ * response timeout, the delay between pings, the call duration limit etc.) are reactor session timers.               *
  *                                                                                                                    *
  * ProtelSocket inherits ProtelHost so its constructor also constructs a ProtelHost which it uses to send commands to *
  * the connected device and handle its responses.                                                                     *
@@ -14,13 +16,20 @@
 
 #pragma once
 #include "ProtelHost.h"
+#include "ProtelList.h"
+#include "SocketReactor.h"
+
+#define PROTELSOCKET_MAXCALLSECONDS 3600                          // a call still running after this long is aborted
+#define PROTELSOCKET_DEXPOLLMS 10                  // how often DexBarrier and DevicePlanBarrier check whether to go on
 
 class CProtelSocket :
-    public CProtelHost
+    public CProtelHost,
+    public CReactorSession
  {
 public:
-    CProtelSocket(SOCKET hSocket, HANDLE hShutDown, HANDLE hSocketClosed )
-        : CProtelHost ( hShutDown ), m_hSocket ( hSocket ), m_hSocketClosed ( hSocketClosed )
+    CProtelSocket(SOCKET hSocket, HANDLE hShutDown, CProtelList* protelList, HANDLE hSocketClosed )
+        : CProtelHost ( hShutDown ), CReactorSession ( hSocket, true ), m_pProtelList ( protelList ),
+        m_hSocketClosed ( hSocketClosed )
     {
         /**************************************************************************************************************
          * CONSTRUCTOR.                                                                                               *
@@ -32,7 +41,7 @@ public:
         SOCKADDR_IN m_Sockaddr;
         int nSockaddr = sizeof ( m_Sockaddr );
         getpeername(
-            m_hSocket,                                                                           // s [in] - the socket
+            m_hReactorSocket,                                                                    // s [in] - the socket
             ( sockaddr* ) &m_Sockaddr,                                 // name [out] - receives the address of the peer
             &nSockaddr );                                                  // namelen [in, out] - size in bytes of name
         ZeroMemory ( m_szDevice, sizeof ( m_szDevice ));
@@ -44,51 +53,17 @@ public:
             m_szDevice,            // lpszAddressString [in, out] - buffer to receive the human-readable address string
             &dwDeviceLength );                              // lpdwAddressStringLength [in, out] - length of the string
 
-        //char szTimerName [ 1024 ];
-        //ZeroMemory ( szTimerName, sizeof ( szTimerName ));
-        //StringCbCopy ( m_szDevice, sizeof ( m_szDevice ), szDevice );
-        //StringCbCat ( m_szDevice, sizeof ( m_szDevice ), ":" );
-        //StringCbCat ( m_szDevice, sizeof ( m_szDevice ), szPort );
-
-        m_hTimer = CreateWaitableTimer (
-            NULL,                                      // lpTimerAttributes [in] - NULL = defaults, cannot be inherited
-            FALSE,                                                 // bManualReset [in] - FALSE = synchronisation timer
-            m_szDevice );                                               // lpTimerName [in] - address string from above
-        //m_EventTrace.Event( CEventTrace::Details, "CProtelSocket::CProtelSocket -- m_hTimer = CreateWaitableTimer ( NULL, TRUE, %s );", m_szDevice );
-
-        DWORD dwLastError = GetLastError();
-        if (( m_hTimer != NULL && dwLastError == ERROR_ALREADY_EXISTS ) || m_hTimer == NULL )
-        {
-            m_EventTrace.Event( CEventTrace::Error, "CreateWaitableTimer failed -- <%s>", CErrorMessage::ErrorMessageFromSystem ( dwLastError ));
-            //OutputDebugString ( "Stopping . . .\n" );
-        }
-
-        //m_EventTrace.Event( CEventTrace::Details, "CProtelSocket::CProtelSocket(SOCKET hSocket, HANDLE hShutDown)" );
 
         /*
-         * We associate event types FD_ACCEPT and FD_CLOSE with the listening socket and a new event. This event will
-         * be used to trigger actions in the spawned thread.
+         * The accepted socket inherits the listening socket's event association, which also makes it non-blocking.
+         * We cancel this and make it blocking again: the reactor receives via its completion port and Send expects
+         * to send the whole command at once.
          */
-        m_protelEvent = WSACreateEvent();
-        WSAEventSelect(
-            m_hSocket,                                                                     // hSocket [in] - the socket
-            m_protelEvent,                                          // hEventObject [in] - event object to be signalled
-            FD_READ | FD_CLOSE );                               // lNetworkEvents [in] - data received or socket closed
-
-        DWORD dwThreadId;
+        u_long ulNonBlocking = 0;
+        WSAEventSelect ( m_hReactorSocket, NULL, 0 );                            // cancel association with listenEvent
+        ioctlsocket ( m_hReactorSocket, FIONBIO, &ulNonBlocking );                              // FIONBIO 0 = blocking
 
-        /*
-         * We spawn a thread to handle the connection. This returns a handle which we don't use: we close it
-         * immediately to avoid a handle leak. Note that this doesn't affect the thread - it continues to run to
-         * completion.
-         */
-        CloseHandle(CreateThread(
-                NULL,
-                0,
-                SocketThreadProc,
-                this,
-                0,
-                &dwThreadId ));
+        //m_EventTrace.Event( CEventTrace::Details, "CProtelSocket::CProtelSocket(SOCKET hSocket, HANDLE hShutDown)" );
     }
 
     virtual ~CProtelSocket(void)
@@ -97,10 +72,8 @@ public:
          * DESTRUCTOR.                                                                                                *
          **************************************************************************************************************/
         //m_EventTrace.Event( CEventTrace::Details, "CProtelSocket::~CProtelSocket(void)" );
-        WSACloseEvent ( m_protelEvent );
-        closesocket ( m_hSocket );
-        m_hSocket = NULL;
-        m_protelEvent = NULL;
+        closesocket ( m_hReactorSocket );
+        m_hReactorSocket = NULL;
     }
 
     virtual void Send(LPBYTE pszBuffer, int BufferLength)
@@ -109,7 +82,7 @@ public:
          * This overrides the Send method of ProtelHost. It sends BufferLength bytes from pszBuffer via the socket.   *
          **************************************************************************************************************/
         send (
-            m_hSocket,                                                              // hSocket [in] - socket to send on
+            m_hReactorSocket,                                                       // hSocket [in] - socket to send on
             ( LPCTSTR )pszBuffer,                                                        // pBuffer [in] - data to send
             BufferLength,                                                     // nLength [in] - number of bytes to send
             0 );                                                                        // nFlags [in] - none specified
@@ -118,156 +91,206 @@ public:
     virtual void Shutdown ( void )
     {
         /**************************************************************************************************************
-         * This overrides the Shutdown method of ProtelHost. It closes the socket connection and signals              *
-         * m_hSocketClosed.                                                                                           *
+         * This overrides the Shutdown method of ProtelHost. It closes the socket connection; once the reactor has    *
+         * finished with it, OnClosed (below) signals m_hSocketClosed.                                                *
          **************************************************************************************************************/
-        shutdown (
-            m_hSocket,                                                                     // hSocket [in] - the socket
-            SD_RECEIVE | SD_SEND );                                       // nHow [in] - shutdown both receive and send
-        SetEvent ( m_hSocketClosed );                                       // signals SocketListener::ListenThreadProc
+        EndSession();
     }
 
 protected:
-    SOCKET m_hSocket;                                                     // the socket associated with this connection
+    /*
+     * The reactor session timers used by the connection (see SetSessionTimer). Each is independent of the others.
+     */
+    enum SocketTimer
+    {
+        StartCallTimer,                                                      // send I command shortly after connecting
+        ResponseTimer,                                            // no valid response to last command (GetWaitSeconds)
+        PingTimer,                                                              // send Z command again (see PingAfter)
+        LingerTimer,                                                 // allow A command to be sent before shutting down
+        CallLimitTimer,                                                  // call has lasted PROTELSOCKET_MAXCALLSECONDS
+        DexTimer,                                               // check whether DEX records are saved (see DexBarrier)
+        DevicePlanTimer,                             // check whether the devices are looked up (see DevicePlanBarrier)
+    };
+
+    CProtelList* m_pProtelList;                                         // we are queued on it as closed (see OnClosed)
     HANDLE m_hSocketClosed;                    // used to signal SocketListener::ListenThreadProc when socket is closed
-    WSAEVENT m_protelEvent;                                             // signalled when connection accepted or closed
     char m_szDevice [ 1024 ];           // human readable address of connected device (CProtelHost gets it via GetPort)
 
-    static DWORD WINAPI SocketThreadProc( LPVOID lpParam )
+    virtual void OnStart ( void )
     {
         /**************************************************************************************************************
-         * This is the thread that is spawned for each CProtelSocket constructed (i.e. each incoming socket           *
-         * connection to the system). It calls ThreadProc below which is responsible for handling the connection. The *
-         * thread continues running until the connection ends.                                                        *
+         * This is called on a database worker thread (see SocketReactor.h) once the connection has been attached to  *
+         * its reactor loop.                                                                                          *
          **************************************************************************************************************/
-        CoInitialize(NULL);                                               // initialise the COM library for this thread
-        CProtelSocket* protelSocket = (CProtelSocket*)lpParam;
-        protelSocket->ThreadProc();
-        CoUninitialize();                                        // close the COM library and clean up thread resources
-        return 0;
-    }
-
-    void ThreadProc(void)                                                                          // called from above
-    {
 
-        //m_EventTrace.Event( CEventTrace::Details, "%s\tSTART -- void CProtelSocket::ThreadProc(void)", m_szDevice );
+        //m_EventTrace.Event( CEventTrace::Details, "%s\tSTART -- void CProtelSocket::OnStart(void)", m_szDevice );
 
         /*
          * We create a new row in the COMM_SERVER_CALL database table (getting the callnumber) then, providing this
-         * succeeds, we start ProtelHost off by having it send an I command to the connected device. ProtelHost
-         * handles the response when we call its MessageReceived and sends additional commands as required.
+         * succeeds, we start ProtelHost off by having it send an I command to the connected device (after a short
+         * delay, using a timer rather than sleeping so other connections on this loop aren't held up). ProtelHost
+         * handles the response when OnReceive calls its MessageReceived and sends additional commands as required.
+         * The call is aborted if it is still running after PROTELSOCKET_MAXCALLSECONDS.
          *
          * If the database operation fails (perhaps there wasn't a database connection), we abort the connection.
          */
-        bool bContinue = Database_AddNewCall();
-        if ( bContinue == true )
+        CountSession ( true );
+        if ( Database_AddNewCall() == true )
         {
-			Sleep(100);
-            Transmit_I_Command();
+            SetSessionTimer ( StartCallTimer, 100 );
+            SetSessionTimer ( CallLimitTimer, PROTELSOCKET_MAXCALLSECONDS * 1000 );
         }
         else
         {
-            Transmit_A_Command(false);                                         // abort connection, signalling to retry
-            Sleep(2000);                                                                    // allow command to be sent
-            Shutdown();
+            AbortCall();
         }
+    }
 
-        int bytesRead;
-        char szBuffer [ 4096 ];
-        ZeroMemory ( szBuffer, sizeof ( szBuffer ));
+    virtual void OnReceive ( BYTE* pBuffer, int BufferLength )
+    {
+        /**************************************************************************************************************
+         * This is called on a database worker thread when data has been received via the socket. We pass it to       *
+         * ProtelHost using its MessageReceived().                                                                    *
+         **************************************************************************************************************/
+        MessageReceived ( pBuffer, BufferLength );
+    }
 
-        WSANETWORKEVENTS wsaNetworkEvents;
-        DWORD dwEventMask = 0;
+    virtual void OnTimer ( int Timer )
+    {
+        /**************************************************************************************************************
+         * This is called on a database worker thread when one of the connection's timers (a SocketTimer) is due.     *
+         **************************************************************************************************************/
+        switch ( Timer )
+        {
+            case StartCallTimer:
+                Transmit_I_Command();
+                break;
+
+            case ResponseTimer:                                                           // time expired while waiting
+                if ( ResyncResponse() == true )
+                {
+                    break;                                                 // the response was held up behind a stray T
+                }
+                if ( ContinueComms( false ) == false )
+                {
+                    AbortCall();
+                }
+                else
+                {
+                    Retransmit();                                         // resend last command - method of ProtelHost
+                }
+                break;
+
+            case PingTimer:
+                Transmit_Z_Command();
+                break;
+
+            case LingerTimer:
+                Shutdown();
+                break;
+
+            case CallLimitTimer:
+                m_EventTrace.Event( CEventTrace::Warning, "%s\tcall exceeded %d seconds - aborting", m_szDevice,
+                    PROTELSOCKET_MAXCALLSECONDS );
+                AbortCall();
+                break;
+
+            case DexTimer:
+                DexBarrier();
+                break;
+
+            case DevicePlanTimer:
+                DevicePlanBarrier();
+                break;
+        }
+    }
 
-        HANDLE hWaitObjects [ 3 ];
-        hWaitObjects[ 0 ] = m_hShutDown;
-        hWaitObjects[ 1 ] = m_protelEvent;
-        hWaitObjects[ 2 ] = m_hTimer;
+    virtual void OnClosed ( void )
+    {
+        /**************************************************************************************************************
+         * This is called on a database worker thread once the connection has ended (including normal completion of   *
+         * the ProtelHost command sequence and system shutdown). The reactor has finished with us, so we queue        *
+         * ourselves as closed for CSocketListener::ListenThreadProc to remove us from ProtelList. It may delete us   *
+         * as soon as we are queued, so we don't touch any member after that.                                         *
+         **************************************************************************************************************/
+        m_EventTrace.Event( CEventTrace::Details, "%s\tSTOP -- void CProtelSocket::OnClosed(void)", m_szDevice );
+        bool frmDB =  WriteLogDB("STOP -- void CProtelSocket::OnClosed(void)");
+        CloseDevice(3);
+        HANDLE hSocketClosed = m_hSocketClosed;
+        Closed = true;                          // Allow CSocketListener::ListenThreadProc to remove us from ProtelList
+        m_pProtelList->QueueClosed ( this );
+        SetEvent ( hSocketClosed );                                         // signals SocketListener::ListenThreadProc
+    }
 
-        //-ResetEvent ( m_hTimer );
+    void AbortCall ( void )
+    {
+        /**************************************************************************************************************
+         * This sends an A command signalling the device to retry, then shuts the connection down 2 seconds later     *
+         * (allowing the command to be sent).                                                                         *
+         **************************************************************************************************************/
+        Transmit_A_Command(false);                                             // abort connection, signalling to retry
+        CancelSessionTimer ( PingTimer );
+        CancelSessionTimer ( DexTimer );
+        CancelSessionTimer ( DevicePlanTimer );
+        SetSessionTimer ( LingerTimer, 2000 );
+    }
+
+    virtual void CancelTimer ( HANDLE& hTimer )
+    {
+        /**************************************************************************************************************
+         * This overrides the CancelTimer method of ProtelHost to cancel the response timeout (hTimer is unused).     *
+         **************************************************************************************************************/
+        CancelSessionTimer ( ResponseTimer );
+    }
+
+    virtual void SetTimeoutTimer ( HANDLE& hTimer, int Milliseconds )
+    {
+        /**************************************************************************************************************
+         * This overrides the SetTimeoutTimer method of ProtelHost to start the response timeout using the reactor    *
+         * session timer (hTimer is unused).                                                                          *
+         **************************************************************************************************************/
+        SetSessionTimer ( ResponseTimer, Milliseconds );
+    }
 
-        while ( bContinue == true )
+    virtual void PingAfter ( int Milliseconds )
+    {
+        /**************************************************************************************************************
+         * This overrides the PingAfter method of ProtelHost so the Z command is sent by OnTimer rather than after    *
+         * sleeping on the database worker thread.                                                                    *
+         **************************************************************************************************************/
+        SetSessionTimer ( PingTimer, Milliseconds );
+    }
+
+    virtual void DexBarrier ( void )
+    {
+        /**************************************************************************************************************
+         * This overrides the DexBarrier method of ProtelHost so the database worker thread isn't held up while the   *
+         * DEX records are saved: until they are (or it is clear they won't be), OnTimer calls it again every         *
+         * PROTELSOCKET_DEXPOLLMS, and other connections carry on meanwhile.                                          *
+         **************************************************************************************************************/
+        bool bSettled = false;
+        IsDexSaved ( bSettled );
+        if ( bSettled == false )
         {
-            DWORD dwEvent = WaitForMultipleObjects(
-                sizeof ( hWaitObjects ) / sizeof ( hWaitObjects[0] ),  // nCount [in] - number of objects in *lpHandles
-                hWaitObjects,                                                   // lpHandles [in] - objects to wait for
-                FALSE,                                   // bWaitAll [in] - FALSE - return when any object is signalled
-                INFINITE );                                       // dwMilliseconds [in] - INFINITE = wait indefinitely
-            //OutputDebugString ( "DWORD dwEvent = WaitForMultipleObjects( sizeof ( hWaitObjects ) / sizeof ( hWaitObjects[0] ), hWaitObjects, FALSE, INFINITE );\n" );
-            switch( dwEvent )
-            {
-                case WAIT_OBJECT_0:                                                     // system shutdown is signaled.
-
-                    //OutputDebugString ( m_szDevice );
-                    //OutputDebugString ( "\tWAIT_OBJECT_0\n" );
-                    bContinue = false;
-                    break;
-
-                case WAIT_OBJECT_0 + 1:                                                // connection accepted or closed
-                    ZeroMemory ( &wsaNetworkEvents, sizeof ( wsaNetworkEvents ));
-                    WSAEnumNetworkEvents (
-                        m_hSocket,                                                         // hSocket [in] - the socket
-                        m_protelEvent,                               // hEventObject [in] - an optional object to reset
-                        &wsaNetworkEvents );                           // lpNetworkEvents [out] - the events and errors
-                    if ( wsaNetworkEvents.lNetworkEvents == FD_READ )
-                    {
-                        /*
-                         * We received something via the socket. We save it in szBuffer, then pass it to ProtelHost
-                         * using its MessageReceived().
-                         */
-                        //OutputDebugString ( m_szDevice );
-                        //OutputDebugString ( "\tWAIT_OBJECT_1\tFD_READ\n" );
-                        ZeroMemory ( szBuffer, sizeof ( szBuffer ));
-                        bytesRead = recv (
-                            m_hSocket,                                           // hSocket [in] - socket to receive on
-                            szBuffer,                                                // pBuffer [out] - buffer for data
-                            sizeof ( szBuffer ),                             // nLength [in] - size of pBuffer in bytes
-                            0 );                                                        // nFlags [in] - none specified
-                        MessageReceived(( BYTE* ) szBuffer, bytesRead );
-                    }
-                    else if ( wsaNetworkEvents.lNetworkEvents == FD_CLOSE )
-                    {
-                        /*
-                         * The connection has closed (including normal completion of the ProtelHost command
-                         * sequence). We will exit.
-                         */
-                        //OutputDebugString ( m_szDevice );
-                        //OutputDebugString ( "\tWAIT_OBJECT_1\tFD_CLOSE\n" );
-                        bContinue = false;
-                    }
-                    break;
-
-                case WAIT_OBJECT_0 + 2:                             // Timer (time expired while waiting) was signaled.
-                    {
-                        //OutputDebugString ( m_szDevice );
-                        //OutputDebugString ( "\tWAIT_OBJECT_2\n" );
-                        //CancelWaitableTimer( m_hTimer );
-                        CancelTimer( m_hTimer );
-                        if ( ContinueComms( false ) == false )
-                        {
-                            Transmit_A_Command(false);                         // abort connection, signalling to retry
-                            Sleep(2000);                                                    // allow command to be sent
-                            Shutdown();
-                            bContinue = false;
-                        }
-                        else
-                        {
-                            Retransmit();                                 // resend last command - method of ProtelHost
-                        }
-                    }
-                    break;
-            }
+            SetSessionTimer ( DexTimer, PROTELSOCKET_DEXPOLLMS );
+            return;
         }
-        m_EventTrace.Event( CEventTrace::Details, "%s\tSTOP -- void CProtelSocket::ThreadProc(void)", m_szDevice );
-            CAdoStoredProcedure szOracleProcedureName (  "PKG_COMM_SERVER.addSysLogRecAutonomous" );
-            _bstr_t bstrOutText( "STOP -- void CProtelSocket::ThreadProc(void)" );
-            _variant_t vtszOutput ( bstrOutText );
-           szOracleProcedureName.AddParameter( "pi_TEXT", vtszOutput, ADODB::DataTypeEnum::adBSTR, ADODB::ParameterDirectionEnum::adParamInput, bstrOutText.length());
-		   m_padoConnection->ExecuteNonQuery( szOracleProcedureName, false, true );
-        //OutputDebugString ( m_szDevice );
-        //OutputDebugString ( "\tSTOP --- void CProtelSocket::ThreadProc(void)\n" );
-        CloseDevice(3);
-        Closed = true;                          // Allow CSocketListener::ListenThreadProc to remove us from ProtelList
+        FinishDexUpload();
+    }
+
+    virtual void DevicePlanBarrier ( void )
+    {
+        /**************************************************************************************************************
+         * This overrides the DevicePlanBarrier method of ProtelHost in the same way as DexBarrier: until             *
+         * CDevicePrefetcher has looked the devices up (or it is clear it won't), OnTimer calls it again every        *
+         * PROTELSOCKET_DEXPOLLMS, and only then is the O command sent.                                               *
+         **************************************************************************************************************/
+        if ( IsDevicePlanSettled() == false )
+        {
+            SetSessionTimer ( DevicePlanTimer, PROTELSOCKET_DEXPOLLMS );
+            return;
+        }
+        CProtelHost::DevicePlanBarrier();
     }
 
     virtual void CloseDevice ( int typeclose )
@@ -313,8 +336,8 @@ protected:
     virtual int GetWaitSeconds ( void )
     {
         /**************************************************************************************************************
-         * This overrides the GetWaitSeconds method of ProtelHost. It returns the timeout in seconds to use if a      *
-         * valid response to a command isn't received.                                                                *
+         * This overrides the GetWaitSeconds method of ProtelHost. It returns the longest timeout in seconds to use   *
+         * if a valid response to a command isn't received.                                                           *
          **************************************************************************************************************/
         return 90;
     }
@@ -325,6 +348,6 @@ protected:
          * This overrides the CommsErrsLimit method of ProtelHost. It returns the error limit that causes the call to *
          * be aborted if a valid response isn't received (see ProtelHost::ContinueComms).                             *
          **************************************************************************************************************/
-        return 0;                                                                 // e.g. 0 - disconnect on any timeout
+        return 9;                                           // e.g. 9 - disconnect after three transmissions of command
     }
  };
@@ -0,0 +1,354 @@
+/**********************************************************************************************************************
+ *                            This file contains the CRttEstimator and CRttHistory classes.                           *
+ *                                                                                                                    *
+ * CProtelEngine uses a CRttEstimator to choose the response timeout for each command instead of always waiting the   *
+ * derived class GetWaitSeconds. It measures the time from sending a command to receiving its response and keeps a    *
+ * smoothed round trip time and its mean deviation in the same way as TCP (RFC 6298): the timeout is the smoothed     *
+ * time plus four deviations, so a responsive auditor gets a short timeout and a lost frame is retransmitted after a  *
+ * few seconds rather than a minute and a half. Each retransmit doubles the timeout (a few times at most) and a       *
+ * response to a retransmitted command isn't measured, since it can't be told which transmission it answers.          *
+ *                                                                                                                    *
+ * Commands carrying a payload (C and O packets) take longer to transmit, so every measurement has an allowance per   *
+ * byte of the command removed and every timeout has it added back. GetWaitSeconds remains the upper limit.           *
+ *                                                                                                                    *
+ * The estimate is shared by all the commands of a call, but some keep the auditor busy before it answers (D erases   *
+ * its RAM, C and O write its flash), so each command also has a minimum timeout of its own: RTTESTIMATOR_SLOWMS for  *
+ * those, RTTESTIMATOR_MINMS for the rest, raised to the longest response measured for the command during the call.   *
+ * Quick I and N responses therefore can't shrink the timeout of a slow command until it is retransmitted needlessly, *
+ * using up the call's error limit (see CommsErrsLimit).                                                              *
+ *                                                                                                                    *
+ * CRttHistory remembers each master auditor's smoothed time and deviation between calls (keyed by serial number) so  *
+ * a call can start from what was learned last time, and totals the retransmit and recovery counts of all calls.      *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+#define RTTESTIMATOR_INITIALMS      10000                            // timeout until a response time has been measured
+#define RTTESTIMATOR_MINMS          2000                                          // shortest timeout for most commands
+#define RTTESTIMATOR_SLOWMS         10000                                   // shortest timeout for D, C and O commands
+#define RTTESTIMATOR_COMMANDS       26                                                        // command letters A to Z
+#define RTTESTIMATOR_BYTEMS         10                      // transmission allowance per command byte (1200 bps modem)
+#define RTTESTIMATOR_MAXBACKOFF     3                                 // retransmits double the timeout at most 3 times
+#define RTTHISTORY_SIZE             4096                                          // master auditors remembered at once
+#define RTTHISTORY_PROBES           8                                 // entries searched for a serial number (hashing)
+
+class CRttEstimator
+ {
+public:
+    CRttEstimator(void)
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+        Reset();
+    }
+
+    virtual ~CRttEstimator(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+    }
+
+    void Reset ( void )
+    {
+        /**************************************************************************************************************
+         * This forgets everything measured, returning to RTTESTIMATOR_INITIALMS with no backoff.                     *
+         **************************************************************************************************************/
+        m_nSmoothed = 0;
+        m_nVariance = 0;
+        m_nSamples = 0;
+        m_nLastSample = 0;
+        m_nBackoff = 0;
+        ZeroMemory ( m_nLongest, sizeof ( m_nLongest ));
+    }
+
+    void Seed ( int Smoothed, int Variance )
+    {
+        /**************************************************************************************************************
+         * This starts the estimate from a previous call's Smoothed time and Variance (see CRttHistory). It is ignored*
+         * once more than one response has been measured; a single measurement already made is applied on top.        *
+         **************************************************************************************************************/
+        if ( m_nSamples > 1 || Smoothed <= 0 )
+        {
+            return;
+        }
+        bool bHaveSample = m_nSamples == 1;
+        m_nSmoothed = Smoothed;
+        m_nVariance = Variance > 0 ? Variance : 0;
+        m_nSamples = 1;
+        if ( bHaveSample == true )
+        {
+            Smooth ( m_nLastSample );                                              // m_nLastSample is already adjusted
+        }
+    }
+
+    void AddSample ( BYTE Command, int Milliseconds, int CommandLength )
+    {
+        /**************************************************************************************************************
+         * This records that a response to Command arrived Milliseconds after a CommandLength byte command was sent   *
+         * (only the first transmission - never after a retransmit). A good measurement also cancels any backoff.     *
+         **************************************************************************************************************/
+        int nSample = Milliseconds - CommandLength * RTTESTIMATOR_BYTEMS;
+        if ( nSample < 0 )
+        {
+            nSample = 0;
+        }
+        int nCommand = GetCommand ( Command );
+        if ( nCommand >= 0 && nSample > m_nLongest [ nCommand ] )
+        {
+            m_nLongest [ nCommand ] = nSample;
+        }
+        Smooth ( nSample );
+        m_nBackoff = 0;
+    }
+
+    void Backoff ( void )
+    {
+        /**************************************************************************************************************
+         * This is used when the command is retransmitted, doubling the timeout (up to RTTESTIMATOR_MAXBACKOFF times).*
+         **************************************************************************************************************/
+        if ( m_nBackoff < RTTESTIMATOR_MAXBACKOFF )
+        {
+            m_nBackoff++;
+        }
+    }
+
+    int GetTimeout ( BYTE Command, int CommandLength, int MaxMilliseconds )
+    {
+        /**************************************************************************************************************
+         * This returns the milliseconds to wait for a response to Command, CommandLength bytes long, never less than *
+         * its minimum (see GetMinimum) nor more than MaxMilliseconds (the derived class GetWaitSeconds).             *
+         **************************************************************************************************************/
+        int nTimeout = RTTESTIMATOR_INITIALMS;
+        if ( m_nSamples > 0 )
+        {
+            nTimeout = m_nSmoothed + 4 * m_nVariance;
+        }
+        int nMinimum = GetMinimum ( Command );
+        if ( nTimeout < nMinimum )
+        {
+            nTimeout = nMinimum;
+        }
+        nTimeout = ( nTimeout << m_nBackoff ) + CommandLength * RTTESTIMATOR_BYTEMS;
+        return nTimeout < MaxMilliseconds ? nTimeout : MaxMilliseconds;
+    }
+
+    int GetMinimum ( BYTE Command )
+    {
+        /**************************************************************************************************************
+         * This returns the shortest timeout (before backoff and the allowance for its length) for Command:           *
+         * RTTESTIMATOR_SLOWMS for the commands the auditor takes a while to carry out, otherwise RTTESTIMATOR_MINMS, *
+         * or the longest response to it measured since Reset if that is more.                                        *
+         **************************************************************************************************************/
+        int nMinimum = RTTESTIMATOR_MINMS;
+        if ( Command == 'C' || Command == 'D' || Command == 'O' )
+        {
+            nMinimum = RTTESTIMATOR_SLOWMS;                                         // writes flash or erases RAM first
+        }
+        int nCommand = GetCommand ( Command );
+        if ( nCommand >= 0 && m_nLongest [ nCommand ] > nMinimum )
+        {
+            nMinimum = m_nLongest [ nCommand ];
+        }
+        return nMinimum;
+    }
+
+    int GetSmoothed ( void )
+    {
+        return m_nSmoothed;
+    }
+    __declspec(property(get = GetSmoothed)) int Smoothed;
+
+    int GetVariance ( void )
+    {
+        return m_nVariance;
+    }
+    __declspec(property(get = GetVariance)) int Variance;
+
+    int GetSamples ( void )
+    {
+        return m_nSamples;
+    }
+    __declspec(property(get = GetSamples)) int Samples;
+
+private:
+    static int GetCommand ( BYTE Command )                                    // index of command letter, -1 if not one
+    {
+        return Command >= 'A' && Command <= 'Z' ? Command - 'A' : -1;
+    }
+
+    void Smooth ( int nSample )
+    {
+        /**************************************************************************************************************
+         * This adds nSample (milliseconds, allowance removed) to the smoothed response time and its deviation.       *
+         **************************************************************************************************************/
+        if ( m_nSamples == 0 )
+        {
+            m_nSmoothed = nSample;                                                                      // first sample
+            m_nVariance = nSample / 2;
+        }
+        else
+        {
+            int nDeviation = m_nSmoothed > nSample ? m_nSmoothed - nSample : nSample - m_nSmoothed;
+            m_nVariance = ( 3 * m_nVariance + nDeviation ) / 4;                                           // beta = 1/4
+            m_nSmoothed = ( 7 * m_nSmoothed + nSample ) / 8;                                             // alpha = 1/8
+        }
+        m_nLastSample = nSample;
+        m_nSamples++;
+    }
+
+    int m_nSmoothed;                                                  // smoothed response time (ms, allowance removed)
+    int m_nVariance;                                                        // mean deviation of the response time (ms)
+    int m_nSamples;                                                                     // number of responses measured
+    int m_nLastSample;                                                                  // most recent measurement (ms)
+    int m_nBackoff;                                                               // timeout is doubled this many times
+    int m_nLongest [ RTTESTIMATOR_COMMANDS ];                                  // longest response to each command (ms)
+ };
+
+class CRttHistory
+ {
+public:
+    static CRttHistory& Instance ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the single history shared by every connection. CApplication::Start calls it before any        *
+         * connection threads are started, so it is constructed then.                                                 *
+         **************************************************************************************************************/
+        static CRttHistory rttHistory;
+        return rttHistory;
+    }
+
+    bool Lookup ( const char* SerialNumber, int& Smoothed, int& Variance )
+    {
+        /**************************************************************************************************************
+         * This returns true, with the Smoothed time and Variance recorded at the end of its last call, if the master *
+         * auditor with SerialNumber is remembered.                                                                   *
+         **************************************************************************************************************/
+        bool bFound = false;
+        EnterCriticalSection ( &m_criticalSection );
+        SEntry* pEntry = Find ( SerialNumber, false );
+        if ( pEntry != NULL )
+        {
+            Smoothed = pEntry->Smoothed;
+            Variance = pEntry->Variance;
+            bFound = true;
+        }
+        LeaveCriticalSection ( &m_criticalSection );
+        return bFound;
+    }
+
+    void Record ( const char* SerialNumber, CRttEstimator& rttEstimator, int Retransmits, int Recoveries,
+        int RecoverMilliseconds )
+    {
+        /**************************************************************************************************************
+         * This is used at the end of a call to remember the master auditor's response time (if any was measured)     *
+         * and add the call's retransmits, recoveries (responses finally received after a retransmit) and the time    *
+         * those took to the totals.                                                                                  *
+         **************************************************************************************************************/
+        EnterCriticalSection ( &m_criticalSection );
+        if ( rttEstimator.Samples > 0 )
+        {
+            SEntry* pEntry = Find ( SerialNumber, true );
+            if ( pEntry != NULL )
+            {
+                pEntry->Smoothed = rttEstimator.Smoothed;
+                pEntry->Variance = rttEstimator.Variance;
+            }
+        }
+        m_nCalls++;
+        m_nRetransmits += Retransmits;
+        m_nRecoveries += Recoveries;
+        m_nRecoverMilliseconds += RecoverMilliseconds;
+        LeaveCriticalSection ( &m_criticalSection );
+    }
+
+    void GetTotals ( __int64& Calls, __int64& Retransmits, __int64& Recoveries, __int64& RecoverMilliseconds )
+    {
+        /**************************************************************************************************************
+         * This returns the totals for all calls recorded since startup.                                              *
+         **************************************************************************************************************/
+        EnterCriticalSection ( &m_criticalSection );
+        Calls = m_nCalls;
+        Retransmits = m_nRetransmits;
+        Recoveries = m_nRecoveries;
+        RecoverMilliseconds = m_nRecoverMilliseconds;
+        LeaveCriticalSection ( &m_criticalSection );
+    }
+
+private:
+    struct SEntry
+    {
+        char SerialNumber [ 64 ];                                                       // empty if the entry is unused
+        int Smoothed;
+        int Variance;
+    };
+
+    CRttHistory(void) :
+        m_nCalls ( 0 ),
+        m_nRetransmits ( 0 ),
+        m_nRecoveries ( 0 ),
+        m_nRecoverMilliseconds ( 0 )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+        InitializeCriticalSection ( &m_criticalSection );
+        ZeroMemory ( m_Entries, sizeof ( m_Entries ));
+    }
+
+    virtual ~CRttHistory(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+        DeleteCriticalSection ( &m_criticalSection );
+    }
+
+    SEntry* Find ( const char* SerialNumber, bool Add )
+    {
+        /**************************************************************************************************************
+         * This returns the entry for SerialNumber, or NULL if there isn't one and Add is false. If Add is true, an   *
+         * unused entry is taken for it or, if the RTTHISTORY_PROBES entries it may use are all taken, the last of    *
+         * these is reused. The caller holds m_criticalSection.                                                       *
+         **************************************************************************************************************/
+        if ( SerialNumber == NULL || SerialNumber [ 0 ] == '\0' )
+        {
+            return NULL;
+        }
+        DWORD dwHash = 2166136261;                                                                       // FNV-1a hash
+        for ( const char* psz = SerialNumber; *psz != '\0'; psz++ )
+        {
+            dwHash = ( dwHash ^ ( BYTE ) *psz ) * 16777619;
+        }
+
+        SEntry* pEntry = NULL;
+        for ( int nProbe = 0; nProbe < RTTHISTORY_PROBES; nProbe++ )
+        {
+            pEntry = &m_Entries [ ( dwHash + nProbe ) % RTTHISTORY_SIZE ];
+            if ( lstrcmp ( pEntry->SerialNumber, SerialNumber ) == 0 )
+            {
+                return pEntry;
+            }
+            if ( pEntry->SerialNumber [ 0 ] == '\0' )
+            {
+                break;                                                     // not remembered - use this entry if adding
+            }
+        }
+        if ( Add == false )
+        {
+            return NULL;
+        }
+        StringCbCopy ( pEntry->SerialNumber, sizeof ( pEntry->SerialNumber ), SerialNumber );
+        return pEntry;
+    }
+
+    CRITICAL_SECTION m_criticalSection;                                                    // protects everything below
+    SEntry m_Entries [ RTTHISTORY_SIZE ];                                       // open addressed by serial number hash
+    __int64 m_nCalls;                                                                   // calls recorded since startup
+    __int64 m_nRetransmits;                                                           // commands retransmitted in them
+    __int64 m_nRecoveries;                                                     // responses received after a retransmit
+    __int64 m_nRecoverMilliseconds;                                    // time from first timeout to response, in total
+ };
@@ -0,0 +1,870 @@
+/**********************************************************************************************************************
+ *                          This file contains the CSerialReactor and CSerialSession classes.                         *
+ *                                                                                                                    *
+ * CApplication::Start starts a CSerialReactor and attaches every modem's CProtelSerial to it. The reactor runs a     *
+ * single event loop thread which handles all the serial ports, however many modems the system has, instead of a      *
+ * thread (blocked in WaitForMultipleObjects) and two waitable timers per modem.                                      *
+ *                                                                                                                    *
+ * Each port is opened for overlapped I/O and associated with the loop's I/O completion port. A WaitCommEvent is kept *
+ * outstanding on every port; when it completes the events are passed to the session and, if characters have arrived, *
+ * a ReadFile is started (it returns at once with whatever has been received) whose data is passed to the session     *
+ * before the next WaitCommEvent. Each session also has a few timers, identified by number, which are kept in the     *
+ * loop's timer wheel (see TimerWheel.h) exactly as CSocketReactor keeps its sessions' timers: the response timeout,  *
+ * the modem engine's deadlines, etc. of every modem share the one wheel, and its next deadline is used as the        *
+ * completion port wait timeout.                                                                                      *
+ *                                                                                                                    *
+ * A modem is represented by a class inheriting CSerialSession (i.e. CProtelSerial) which overrides OnStart,          *
+ * OnCommEvent, OnReceive, OnTimer, OnPosted, OnStop and OnClosed. Another thread (e.g. the polling thread asking for *
+ * a call to be dialed) hands work to the loop with PostSession, which has OnPosted called. When the reactor is       *
+ * stopped each session's OnStop is called, and the session calls EndSession once it has finished (e.g. once its      *
+ * modem has been reset), or is ended anyway after SERIALREACTOR_STOPMS. Once its outstanding I/O has completed, the  *
+ * loop calls OnClosed and never touches the session again, so it can then be deleted by another thread.              *
+ *                                                                                                                    *
+ * The On... methods are called in rounds, as CSocketReactor calls its sessions' (see SocketReactor.h): the loop      *
+ * gathers what is due for a session (its start, the events, the data read, a post, the stop, its timers) and hands   *
+ * it over as one round. A session constructed with Offload TRUE (i.e. CProtelSerial, which answers a RING and ends a *
+ * call with database calls) has each round run by a CDatabaseWorkers thread, so one modem's database calls don't     *
+ * hold up the others. A session never has more than one round at a time, and what a round asks for (SetSessionTimer, *
+ * CancelSessionTimer, EndSession) is carried out by the loop once it is complete. The next WaitCommEvent or ReadFile *
+ * is only started once the events or data already received have been handed over. OnClosed is a round of its own.    *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+#include "DatabaseWorkers.h"
+#include "TimerWheel.h"
+
+#define SERIALREACTOR_READSIZE      1024                                                          // bytes read at once
+#define SERIALREACTOR_STOPMS        10000                           // time allowed for sessions to finish when stopped
+#define SERIALREACTOR_CANCELMS      2000                       // then time allowed for their cancelled I/O to complete
+#define SERIALREACTOR_POLLMS        10                       // how often a stopping loop checks for OnClosed to return
+#define SERIALSESSION_TIMERS        8                                                        // most timers per session
+
+class CSerialSession :
+    public CDatabaseWork
+ {
+    friend class CSerialReactor;
+
+public:
+    CSerialSession( bool Offload = false ) :
+        m_hSerialPort ( INVALID_HANDLE_VALUE ),
+        m_bOffload ( Offload ),
+        m_hLoopPort ( NULL ),
+        m_pNextSession ( NULL ),
+        m_pPreviousSession ( NULL ),
+        m_dwEvents ( 0 ),
+        m_bWaitPending ( false ),
+        m_bReadPending ( false ),
+        m_bReadWanted ( false ),
+        m_lPosted ( 0 ),
+        m_bStopping ( false ),
+        m_bEnding ( false ),
+        m_pTimerWheel ( NULL ),
+        m_plLoopClosing ( NULL ),
+        m_bWorking ( false ),
+        m_bStartDue ( false ),
+        m_bEventsDue ( false ),
+        m_dwEventsDue ( 0 ),
+        m_nReadDue ( 0 ),
+        m_bPostedDue ( false ),
+        m_bStopDue ( false ),
+        m_dwTimersDue ( 0 ),
+        m_bEndDue ( false ),
+        m_bRoundStart ( false ),
+        m_bRoundEvents ( false ),
+        m_dwRoundEvents ( 0 ),
+        m_nRoundRead ( 0 ),
+        m_bRoundPosted ( false ),
+        m_bRoundStop ( false ),
+        m_dwRoundTimers ( 0 ),
+        m_bRoundClose ( false ),
+        m_dwTimersArmed ( 0 ),
+        m_dwTimersSet ( 0 ),
+        m_dwTimersCancelled ( 0 ),
+        m_bEndRequested ( false )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+        ZeroMemory ( &m_WaitOverlapped, sizeof ( m_WaitOverlapped ));
+        ZeroMemory ( &m_ReadOverlapped, sizeof ( m_ReadOverlapped ));
+        ZeroMemory ( &m_PostOverlapped, sizeof ( m_PostOverlapped ));
+        ZeroMemory ( &m_WorkOverlapped, sizeof ( m_WorkOverlapped ));
+        ZeroMemory ( m_ReadBuffer, sizeof ( m_ReadBuffer ));
+        ZeroMemory ( m_dwTimerMilliseconds, sizeof ( m_dwTimerMilliseconds ));
+        for ( int nTimer = 0; nTimer < SERIALSESSION_TIMERS; nTimer++ )
+        {
+            m_SessionTimers [ nTimer ].Context = this;
+            m_SessionTimers [ nTimer ].Id = nTimer;
+        }
+    }
+
+    virtual ~CSerialSession(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+    }
+
+    void PostSession ( void )
+    {
+        /**************************************************************************************************************
+         * This may be called by any thread to have OnPosted called in the session's next round. Calls made before    *
+         * OnPosted has been called for an earlier one are combined.                                                  *
+         **************************************************************************************************************/
+        if ( m_hLoopPort != NULL && InterlockedExchange ( &m_lPosted, 1 ) == 0 )
+        {
+            PostQueuedCompletionStatus ( m_hLoopPort, 0, ( ULONG_PTR ) this, &m_PostOverlapped );
+        }
+    }
+
+    bool IsSessionEnding ( void )
+    {
+        return m_bEnding == true || m_bEndRequested == true;
+    }
+
+protected:
+    /*
+     * The following are called one at a time, in rounds (see above), by the reactor's loop thread or, if the session
+     * was constructed with Offload TRUE, by a database worker thread.
+     */
+    virtual void OnStart ( void ) = 0;                                     // the session has been attached to the loop
+    virtual void OnCommEvent ( DWORD Events ) = 0;                            // WaitCommEvent completed (e.g. EV_RLSD)
+    virtual void OnReceive ( BYTE* pBuffer, int BufferLength ) = 0;                           // data has been received
+    virtual void OnTimer ( int Timer ) = 0;                         // timer number Timer set by SetSessionTimer is due
+    virtual void OnPosted ( void ) = 0;                                                  // PostSession has been called
+    virtual void OnStop ( void ) = 0;                            // the reactor is stopping - call EndSession when done
+    virtual void OnClosed ( void ) = 0;                     // the session has ended - the reactor has finished with it
+
+    /*
+     * The following must only be called from the On... methods above.
+     */
+    void SetSessionTimer ( int Timer, DWORD Milliseconds )
+    {
+        /**************************************************************************************************************
+         * This sets timer number Timer (0 to SERIALSESSION_TIMERS - 1) so OnTimer is called with it after            *
+         * Milliseconds, replacing any deadline it already had. The loop arms it once the round is complete. Timers   *
+         * are ignored once the session is ending.                                                                    *
+         **************************************************************************************************************/
+        if ( IsSessionEnding() == true )
+        {
+            return;
+        }
+        m_dwTimersSet |= 1 << Timer;
+        m_dwTimersCancelled &= ~( 1 << Timer );
+        m_dwTimerMilliseconds [ Timer ] = Milliseconds;
+    }
+
+    void CancelSessionTimer ( int Timer )
+    {
+        /**************************************************************************************************************
+         * This cancels timer number Timer. If it is due later in this round, OnTimer isn't called with it.           *
+         **************************************************************************************************************/
+        m_dwTimersCancelled |= 1 << Timer;
+        m_dwTimersSet &= ~( 1 << Timer );
+    }
+
+    bool IsSessionTimerSet ( int Timer )
+    {
+        /**************************************************************************************************************
+         * This returns TRUE if timer number Timer is set, counting what this round has asked for so far.             *
+         **************************************************************************************************************/
+        if (( m_dwTimersSet & ( 1 << Timer )) != 0 )
+        {
+            return true;
+        }
+        if (( m_dwTimersCancelled & ( 1 << Timer )) != 0 )
+        {
+            return false;
+        }
+        return ( m_dwTimersArmed & ( 1 << Timer )) != 0;
+    }
+
+    void EndSession ( void )
+    {
+        /**************************************************************************************************************
+         * This ends the session. Once the round is complete, the loop cancels its timers and any outstanding         *
+         * WaitCommEvent or ReadFile (on the loop thread, since CancelIo only cancels I/O started by the calling      *
+         * thread), then calls OnClosed once they have completed (immediately if none is outstanding). The port       *
+         * itself is left open for the session to close.                                                              *
+         **************************************************************************************************************/
+        m_bEndRequested = true;
+        m_dwTimersSet = 0;
+    }
+
+    bool IsSessionStopping ( void )
+    {
+        return m_bStopping;                                                 // TRUE once the round calling OnStop began
+    }
+
+    HANDLE m_hSerialPort;                                             // the modem's port - opened by the derived class
+
+private:
+    /*
+     * The following are only used by the loop thread, except m_ReadBuffer and the round and request members
+     * (m_bRoundStart to m_bEndRequested), which the loop leaves alone while a round is running (m_bWorking).
+     */
+    bool m_bOffload;                                                     // TRUE if rounds are run by a database worker
+    HANDLE m_hLoopPort;                                             // the loop's completion port (NULL until attached)
+    CSerialSession* m_pNextSession;                                             // links in the loop's list of sessions
+    CSerialSession* m_pPreviousSession;
+    OVERLAPPED m_WaitOverlapped;                                               // used by the outstanding WaitCommEvent
+    OVERLAPPED m_ReadOverlapped;                                                    // used by the outstanding ReadFile
+    OVERLAPPED m_PostOverlapped;                                        // identifies completions queued by PostSession
+    OVERLAPPED m_WorkOverlapped;                                       // used to post a round's completion to the loop
+    DWORD m_dwEvents;                                                           // events reported by the WaitCommEvent
+    BYTE m_ReadBuffer [ SERIALREACTOR_READSIZE ];                                        // receives data from the port
+    bool m_bWaitPending;                                                   // TRUE while a WaitCommEvent is outstanding
+    bool m_bReadPending;                                                        // TRUE while a ReadFile is outstanding
+    bool m_bReadWanted;                                              // the next I/O is a ReadFile, not a WaitCommEvent
+    volatile LONG m_lPosted;                                                         // 1 while a PostSession is queued
+    bool m_bStopping;                                                       // TRUE once the round calling OnStop began
+    bool m_bEnding;                                                         // TRUE once the loop has ended the session
+    CTimerWheel* m_pTimerWheel;                                         // the loop's timer wheel (NULL until attached)
+    CWheelTimer m_SessionTimers [ SERIALSESSION_TIMERS ];                                     // set by SetSessionTimer
+    volatile LONG* m_plLoopClosing;                              // the loop's count of OnClosed rounds running (ditto)
+    bool m_bWorking;                                                             // TRUE while a round hasn't completed
+    bool m_bStartDue;                                                                                 // OnStart is due
+    bool m_bEventsDue;                                                                   // OnCommEvent is due with ...
+    DWORD m_dwEventsDue;                                                                            // ... these events
+    int m_nReadDue;                                                        // bytes in m_ReadBuffer not yet handed over
+    bool m_bPostedDue;                                                                               // OnPosted is due
+    bool m_bStopDue;                                                                                   // OnStop is due
+    DWORD m_dwTimersDue;                                                                           // bit per timer due
+    bool m_bEndDue;                                                        // the loop ended the session during a round
+    bool m_bRoundStart;                                                                      // the round calls OnStart
+    bool m_bRoundEvents;                                            // the round calls OnCommEvent with m_dwRoundEvents
+    DWORD m_dwRoundEvents;
+    int m_nRoundRead;                                                  // the round passes this many bytes to OnReceive
+    bool m_bRoundPosted;                                                                    // the round calls OnPosted
+    bool m_bRoundStop;                                                                        // the round calls OnStop
+    DWORD m_dwRoundTimers;                                                 // bit per timer the round calls OnTimer for
+    bool m_bRoundClose;                                                    // the round calls OnClosed and nothing else
+    DWORD m_dwTimersArmed;                                                  // bit per timer armed when the round began
+    DWORD m_dwTimersSet;                                                              // bit per timer set by the round
+    DWORD m_dwTimerMilliseconds [ SERIALSESSION_TIMERS ];                                            // their deadlines
+    DWORD m_dwTimersCancelled;                                                  // bit per timer cancelled by the round
+    bool m_bEndRequested;                                                                // the round called EndSession
+
+    virtual void DoDatabaseWork ( void )
+    {
+        /**************************************************************************************************************
+         * This runs the round the loop handed over (see CSerialReactor::Dispatch) on a database worker thread, or on *
+         * the loop thread itself if the workers aren't running, and posts its completion back to the loop. After     *
+         * OnClosed the session may already have been deleted, so only the loop's count of OnClosed rounds is touched *
+         * then.                                                                                                      *
+         **************************************************************************************************************/
+        if ( m_bRoundClose == true )
+        {
+            volatile LONG* plLoopClosing = m_plLoopClosing;
+            OnClosed();
+            InterlockedDecrement ( plLoopClosing );
+            return;
+        }
+        RunRound();
+        PostQueuedCompletionStatus ( m_hLoopPort, 0, ( ULONG_PTR ) this, &m_WorkOverlapped );
+    }
+
+    void RunRound ( void )
+    {
+        /**************************************************************************************************************
+         * This calls OnStart, OnCommEvent, OnReceive, OnPosted, OnStop, then OnTimer for each timer due, as the      *
+         * round says. Nothing more is called once the session is ending, and a timer that an earlier call in the     *
+         * round set or cancelled isn't called.                                                                       *
+         **************************************************************************************************************/
+        if ( m_bRoundStart == true )
+        {
+            OnStart();
+        }
+        if ( m_bRoundEvents == true && IsSessionEnding() == false )
+        {
+            OnCommEvent ( m_dwRoundEvents );
+        }
+        if ( m_nRoundRead > 0 && IsSessionEnding() == false )
+        {
+            OnReceive ( m_ReadBuffer, m_nRoundRead );
+        }
+        if ( m_bRoundPosted == true && IsSessionEnding() == false )
+        {
+            OnPosted();
+        }
+        if ( m_bRoundStop == true && IsSessionEnding() == false )
+        {
+            OnStop();
+        }
+        for ( int nTimer = 0; nTimer < SERIALSESSION_TIMERS; nTimer++ )
+        {
+            DWORD dwTimer = 1 << nTimer;
+            if (( m_dwRoundTimers & dwTimer ) == 0 || (( m_dwTimersSet | m_dwTimersCancelled ) & dwTimer ) != 0 )
+            {
+                continue;
+            }
+            if ( IsSessionEnding() == true )
+            {
+                break;
+            }
+            OnTimer ( nTimer );
+        }
+    }
+ };
+
+class CSerialReactor
+ {
+public:
+    CSerialReactor(void) :
+        m_hPort ( NULL ),
+        m_hThread ( NULL ),
+        m_pSessions ( NULL ),
+        m_nSessions ( 0 ),
+        m_pWheel ( NULL ),
+        m_nWorking ( 0 ),
+        m_lClosing ( 0 )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+    }
+
+    virtual ~CSerialReactor(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+        Stop();
+    }
+
+    bool Start ( void )
+    {
+        /**************************************************************************************************************
+         * This starts the event loop thread and its completion port. It returns TRUE if the loop is running.         *
+         **************************************************************************************************************/
+        if ( m_hThread != NULL )
+        {
+            return true;                                                                             // already running
+        }
+        m_pWheel = new CTimerWheel;                                     // allocated - too large for the caller's stack
+        m_hPort = CreateIoCompletionPort(
+            INVALID_HANDLE_VALUE,                         // FileHandle [in] - INVALID_HANDLE_VALUE = create a new port
+            NULL,                                                          // ExistingCompletionPort [in] - NULL = none
+            0,                                                           // CompletionKey [in] - not used when creating
+            1 );                                             // NumberOfConcurrentThreads [in] - the loop's thread only
+        if ( m_hPort == NULL )
+        {
+            delete m_pWheel;
+            m_pWheel = NULL;
+            return false;
+        }
+        m_hThread = CreateThread(
+            NULL,                                               // lpThreadAttributes [in] - NULL = cannot be inherited
+            0,                                               // dwStackSize [in] - initial stack size - 0 = use default
+            LoopThreadProc,                                                       // lpStartAddress [in] - in this file
+            this,                                                                     // lpParameter [in] - the reactor
+            0,                                             // dwCreationFlags [in] - 0 = run immediately after creation
+            NULL );                                                           // lpThreadId [out] - NULL = not returned
+        if ( m_hThread == NULL )
+        {
+            CloseHandle ( m_hPort );
+            m_hPort = NULL;
+            delete m_pWheel;
+            m_pWheel = NULL;
+            return false;
+        }
+        return true;
+    }
+
+    void Stop ( void )
+    {
+        /**************************************************************************************************************
+         * This asks the loop to stop, which calls every session's OnStop, then waits for the loop thread to exit.    *
+         * Each session's OnClosed is called before the loop exits unless its I/O couldn't be cancelled. The loop     *
+         * gives up on its sessions SERIALREACTOR_STOPMS + SERIALREACTOR_CANCELMS after the request, but not while a  *
+         * database worker is still running one of their rounds, so the wait has no timeout: the port and the timer   *
+         * wheel are only freed once no thread uses them.                                                             *
+         **************************************************************************************************************/
+        if ( m_hThread == NULL )
+        {
+            return;
+        }
+        PostQueuedCompletionStatus ( m_hPort, 0, 0, NULL );                                             // key 0 = stop
+        WaitForSingleObject (
+            m_hThread,                                                              // hHandle [in] - the loop's thread
+            INFINITE );                                                    // dwMilliseconds [in] - until it has exited
+        CloseHandle ( m_hThread );
+        m_hThread = NULL;
+        CloseHandle ( m_hPort );
+        m_hPort = NULL;
+        delete m_pWheel;
+        m_pWheel = NULL;
+    }
+
+    bool Attach ( CSerialSession* pSession )
+    {
+        /**************************************************************************************************************
+         * This hands pSession to the loop, which calls its OnStart, then starts waiting for events on its port. It   *
+         * returns FALSE if the reactor isn't running, in which case the session is left alone.                       *
+         **************************************************************************************************************/
+        if ( m_hThread == NULL )
+        {
+            return false;
+        }
+        pSession->m_hLoopPort = m_hPort;                                            // so PostSession works from now on
+        return PostQueuedCompletionStatus ( m_hPort, 0, ( ULONG_PTR ) pSession, NULL ) != FALSE;
+    }
+
+private:
+    HANDLE m_hPort;                                                                       // the loop's completion port
+    HANDLE m_hThread;                                                                              // the loop's thread
+    CSerialSession* m_pSessions;                             // sessions attached to the loop (only used by its thread)
+    int m_nSessions;                                                               // number of sessions in m_pSessions
+    CTimerWheel* m_pWheel;                                     // the sessions' timers (only used by the loop's thread)
+    int m_nWorking;                                                     // rounds being run by database workers (ditto)
+    volatile LONG m_lClosing;                                          // OnClosed rounds still running (on any thread)
+
+    static DWORD WINAPI LoopThreadProc ( LPVOID lpParam )
+    {
+        /**************************************************************************************************************
+         * This is the thread that runs the event loop. Sessions make database calls, which it makes itself when the  *
+         * database workers aren't running, so the COM library is initialised for it.                                 *
+         **************************************************************************************************************/
+        CoInitialize(NULL);                                               // initialise the COM library for this thread
+        (( CSerialReactor* ) lpParam )->RunLoop();
+        CoUninitialize();                                        // close the COM library and clean up thread resources
+        return 0;
+    }
+
+    void RunLoop ( void )
+    {
+        /**************************************************************************************************************
+         * This waits for a completion (a WaitCommEvent, ReadFile or round completed, a session attached or posted,   *
+         * or a stop request) or for the nearest session timer, handles it, then hands over the timers that are due.  *
+         * Once stopped, it continues until every session has ended and had OnClosed called: sessions still running   *
+         * after SERIALREACTOR_STOPMS are ended, and any whose I/O hasn't completed SERIALREACTOR_CANCELMS later are  *
+         * given up on. It never exits while a database worker is running one of its sessions' rounds, since the      *
+         * worker uses the loop's port and counts.                                                                    *
+         **************************************************************************************************************/
+        bool bStopping = false;
+        bool bCancelling = false;
+        DWORD dwStopDue = 0;
+        while ( bStopping == false || m_nSessions > 0 || m_nWorking > 0 || m_lClosing > 0 )
+        {
+            DWORD dwWait = m_pWheel->GetNextTimeout();
+            if ( bStopping == true )
+            {
+                long nStopRemaining = ( long )( dwStopDue - GetTickCount());
+                if ( nStopRemaining <= 0 && bCancelling == true && m_nWorking == 0 && m_lClosing == 0 )
+                {
+                    break;                                                   // give up on sessions whose I/O won't end
+                }
+                if ( nStopRemaining <= 0 && bCancelling == false )
+                {
+                    bCancelling = true;                                               // end the sessions still running
+                    dwStopDue = GetTickCount() + SERIALREACTOR_CANCELMS;
+                    CSerialSession* pNext = NULL;
+                    for ( CSerialSession* pSession = m_pSessions; pSession != NULL; pSession = pNext )
+                    {
+                        pNext = pSession->m_pNextSession;
+                        End ( pSession );
+                        Schedule ( pSession );
+                    }
+                    continue;
+                }
+                if ( nStopRemaining > 0 )
+                {
+                    dwWait = min ( dwWait, ( DWORD ) nStopRemaining );
+                }
+                if ( m_lClosing > 0 )
+                {
+                    dwWait = min ( dwWait, ( DWORD ) SERIALREACTOR_POLLMS );             // OnClosed doesn't post to us
+                }
+            }
+
+            DWORD dwBytes = 0;
+            ULONG_PTR ulKey = 0;
+            OVERLAPPED* pOverlapped = NULL;
+            BOOL bSuccess = GetQueuedCompletionStatus (
+                m_hPort,                                                       // CompletionPort [in] - the loop's port
+                &dwBytes,                                                         // lpNumberOfBytes [out] - bytes read
+                &ulKey,                                               // lpCompletionKey [out] - the session (0 = stop)
+                &pOverlapped,                              // lpOverlapped [out] - NULL unless I/O or a round completed
+                dwWait );                                              // dwMilliseconds [in] - until the nearest timer
+            bool bAborted = bSuccess == FALSE && GetLastError() == ERROR_OPERATION_ABORTED;
+            CSerialSession* pSession = ( CSerialSession* ) ulKey;
+            m_pWheel->Advance ( GetTickCount());                       // first, so timers set below are timed from now
+
+            if ( pSession != NULL && pOverlapped == &pSession->m_WorkOverlapped )
+            {
+                /*
+                 * A database worker has run one of the session's rounds. We carry out what the round asked for.
+                 */
+                m_nWorking--;
+                Complete ( pSession );
+            }
+            else if ( pSession != NULL && pOverlapped == &pSession->m_WaitOverlapped )
+            {
+                /*
+                 * A WaitCommEvent completed. We hand over the events, then read whatever has arrived or wait again. A
+                 * failure ends the session (e.g. the port doesn't exist), unless it was aborted by a purge.
+                 */
+                pSession->m_bWaitPending = false;
+                if ( bSuccess == TRUE && pSession->m_bEnding == false )
+                {
+                    pSession->m_bEventsDue = true;
+                    pSession->m_dwEventsDue |= pSession->m_dwEvents;
+                    pSession->m_bReadWanted = ( pSession->m_dwEvents & EV_RXCHAR ) == EV_RXCHAR;
+                }
+                else if ( bAborted == true && pSession->m_bEnding == false )
+                {
+                    pSession->m_bReadWanted = false;
+                }
+                else
+                {
+                    End ( pSession );
+                }
+                Schedule ( pSession );
+            }
+            else if ( pSession != NULL && pOverlapped == &pSession->m_ReadOverlapped )
+            {
+                /*
+                 * A ReadFile completed. We hand over the data and, if the buffer was filled, read again; otherwise we
+                 * wait for the next event. PurgeComm with PURGE_RXABORT aborts the read without ending the session.
+                 */
+                pSession->m_bReadPending = false;
+                if (( bSuccess == TRUE || bAborted == true ) && pSession->m_bEnding == false )
+                {
+                    if ( bSuccess == TRUE && dwBytes > 0 )
+                    {
+                        pSession->m_nReadDue = ( int ) dwBytes;
+                    }
+                    pSession->m_bReadWanted = bSuccess == TRUE && dwBytes == sizeof ( pSession->m_ReadBuffer );
+                }
+                else
+                {
+                    End ( pSession );
+                }
+                Schedule ( pSession );
+            }
+            else if ( pSession != NULL && pOverlapped == &pSession->m_PostOverlapped )
+            {
+                /*
+                 * PostSession was called. Further calls post again from now on.
+                 */
+                InterlockedExchange ( &pSession->m_lPosted, 0 );
+                if ( pSession->m_bEnding == false )
+                {
+                    pSession->m_bPostedDue = true;
+                }
+                Schedule ( pSession );
+            }
+            else if ( pSession != NULL && pOverlapped == NULL )
+            {
+                /*
+                 * A new session was attached. We add it to our list and associate its port with our completion port,
+                 * then start it (waiting for events once it has started).
+                 */
+                LinkSession ( pSession );
+                pSession->m_pTimerWheel = m_pWheel;
+                pSession->m_plLoopClosing = &m_lClosing;
+                CreateIoCompletionPort (
+                    pSession->m_hSerialPort,                                    // FileHandle [in] - the session's port
+                    m_hPort,                                                  // ExistingCompletionPort [in] - our port
+                    ( ULONG_PTR ) pSession,                              // CompletionKey [in] - identifies the session
+                    0 );                               // NumberOfConcurrentThreads [in] - ignored for an existing port
+                if ( bStopping == true )
+                {
+                    pSession->m_bStopping = true;
+                    End ( pSession );
+                }
+                else
+                {
+                    pSession->m_bStartDue = true;
+                }
+                Schedule ( pSession );
+            }
+            else if ( pSession == NULL && bSuccess == TRUE && bStopping == false )
+            {
+                /*
+                 * We have been asked to stop. Each session is told, and is finished once it calls EndSession and its
+                 * I/O completes.
+                 */
+                bStopping = true;
+                dwStopDue = GetTickCount() + SERIALREACTOR_STOPMS;
+                CSerialSession* pNext = NULL;
+                for ( pSession = m_pSessions; pSession != NULL; pSession = pNext )
+                {
+                    pNext = pSession->m_pNextSession;
+                    if ( pSession->m_bEnding == false )
+                    {
+                        pSession->m_bStopDue = true;
+                    }
+                    Schedule ( pSession );
+                }
+            }
+
+            RunTimers();
+        }
+    }
+
+    void Resume ( CSerialSession* pSession )
+    {
+        /**************************************************************************************************************
+         * Once pSession has no I/O outstanding and what it last received has been handed over, this starts the next  *
+         * ReadFile or WaitCommEvent.                                                                                 *
+         **************************************************************************************************************/
+        if ( pSession->m_bWaitPending == true || pSession->m_bReadPending == true || pSession->m_bEventsDue == true ||
+            pSession->m_nReadDue > 0 )
+        {
+            return;
+        }
+        if ( pSession->m_bReadWanted == true )
+        {
+            Read ( pSession );
+        }
+        else
+        {
+            Wait ( pSession );
+        }
+    }
+
+    void Wait ( CSerialSession* pSession )
+    {
+        /**************************************************************************************************************
+         * This starts a WaitCommEvent on pSession's port unless the session is ending. Its completion is queued to   *
+         * the loop's port even if it completes immediately. If it can't be started, the session is ended.            *
+         **************************************************************************************************************/
+        if ( pSession->m_bEnding == true || pSession->m_bWaitPending == true )
+        {
+            return;
+        }
+        ZeroMemory ( &pSession->m_WaitOverlapped, sizeof ( pSession->m_WaitOverlapped ));
+        pSession->m_dwEvents = 0;
+        pSession->m_bWaitPending = true;
+        if ( WaitCommEvent (
+                pSession->m_hSerialPort,                                                // hFile [in] - port to monitor
+                &pSession->m_dwEvents,                                 // lpEvtMask [out] - set when the wait completes
+                &pSession->m_WaitOverlapped )                    // lpOverlapped [in] - the wait completes via the port
+            == FALSE && GetLastError() != ERROR_IO_PENDING )
+        {
+            pSession->m_bWaitPending = false;
+            End ( pSession );
+        }
+    }
+
+    void Read ( CSerialSession* pSession )
+    {
+        /**************************************************************************************************************
+         * This starts a ReadFile on pSession's port unless the session is ending. The port's timeouts make it return *
+         * at once with the characters already received (see CProtelSerial::OnStart); its completion is queued to the *
+         * loop's port like the wait's. If it can't be started, the session is ended.                                 *
+         **************************************************************************************************************/
+        if ( pSession->m_bEnding == true || pSession->m_bReadPending == true )
+        {
+            return;
+        }
+        ZeroMemory ( &pSession->m_ReadOverlapped, sizeof ( pSession->m_ReadOverlapped ));
+        pSession->m_bReadPending = true;
+        if ( ReadFile (
+                pSession->m_hSerialPort,                                                  // hFile [in] - the comm port
+                pSession->m_ReadBuffer,                                               // lpBuffer [out] - data received
+                sizeof ( pSession->m_ReadBuffer ),                 // nNumberOfBytesToRead [in] - maximum bytes to read
+                NULL,                                          // lpNumberOfBytesRead [out] - NULL = see the completion
+                &pSession->m_ReadOverlapped )                    // lpOverlapped [in] - the read completes via the port
+            == FALSE && GetLastError() != ERROR_IO_PENDING )
+        {
+            pSession->m_bReadPending = false;
+            End ( pSession );
+        }
+    }
+
+    void End ( CSerialSession* pSession )
+    {
+        /**************************************************************************************************************
+         * This ends pSession on the loop thread: its timers and anything still due for it are dropped, and any       *
+         * outstanding WaitCommEvent or ReadFile is cancelled. If a round is running, this is done once it is         *
+         * complete (see Complete).                                                                                   *
+         **************************************************************************************************************/
+        if ( pSession->m_bWorking == true )
+        {
+            pSession->m_bEndDue = true;
+            return;
+        }
+        if ( pSession->m_bEnding == true )
+        {
+            return;
+        }
+        pSession->m_bEnding = true;
+        pSession->m_bStartDue = false;
+        pSession->m_bEventsDue = false;
+        pSession->m_dwEventsDue = 0;
+        pSession->m_nReadDue = 0;
+        pSession->m_bPostedDue = false;
+        pSession->m_bStopDue = false;
+        pSession->m_dwTimersDue = 0;
+        for ( int nTimer = 0; nTimer < SERIALSESSION_TIMERS; nTimer++ )
+        {
+            m_pWheel->Cancel ( &pSession->m_SessionTimers [ nTimer ] );
+        }
+        if ( pSession->m_bWaitPending == true || pSession->m_bReadPending == true )
+        {
+            CancelIo ( pSession->m_hSerialPort );
+        }
+    }
+
+    void Schedule ( CSerialSession* pSession )
+    {
+        /**************************************************************************************************************
+         * This hands pSession its next round unless one is running: OnClosed once it has ended and has no I/O        *
+         * outstanding, otherwise whatever is due (see Dispatch). If nothing is due, its next I/O is started (see     *
+         * Resume). Once OnClosed has been handed over, the session is out of the loop's list and the loop doesn't    *
+         * refer to it again.                                                                                         *
+         **************************************************************************************************************/
+        if ( pSession->m_bWorking == true || pSession->m_bRoundClose == true )
+        {
+            return;
+        }
+        if ( pSession->m_bEnding == true )
+        {
+            if ( pSession->m_bWaitPending == false && pSession->m_bReadPending == false )
+            {
+                UnlinkSession ( pSession );
+                pSession->m_pTimerWheel = NULL;
+                pSession->m_bRoundClose = true;
+                InterlockedIncrement ( &m_lClosing );
+                if ( pSession->m_bOffload == false || CDatabaseWorkers::Instance().Queue ( pSession ) == false )
+                {
+                    pSession->DoDatabaseWork();                                                       // OnClosed, here
+                }
+            }
+            return;
+        }
+        if ( pSession->m_bStartDue == false && pSession->m_bEventsDue == false && pSession->m_nReadDue == 0 &&
+            pSession->m_bPostedDue == false && pSession->m_bStopDue == false && pSession->m_dwTimersDue == 0 )
+        {
+            Resume ( pSession );
+            return;
+        }
+        Dispatch ( pSession );
+    }
+
+    void Dispatch ( CSerialSession* pSession )
+    {
+        /**************************************************************************************************************
+         * This moves what is due for pSession into a round and hands it to a database worker if the session was      *
+         * constructed with Offload TRUE and the workers are running, otherwise runs it here and now. Either way      *
+         * Complete is called on this thread once the round has run. A round calling OnStop marks the session         *
+         * stopping first.                                                                                            *
+         **************************************************************************************************************/
+        pSession->m_bRoundStart = pSession->m_bStartDue;
+        pSession->m_bRoundEvents = pSession->m_bEventsDue;
+        pSession->m_dwRoundEvents = pSession->m_dwEventsDue;
+        pSession->m_nRoundRead = pSession->m_nReadDue;
+        pSession->m_bRoundPosted = pSession->m_bPostedDue;
+        pSession->m_bRoundStop = pSession->m_bStopDue;
+        pSession->m_dwRoundTimers = pSession->m_dwTimersDue;
+        pSession->m_bStartDue = false;
+        pSession->m_bEventsDue = false;
+        pSession->m_dwEventsDue = 0;
+        pSession->m_nReadDue = 0;
+        pSession->m_bPostedDue = false;
+        pSession->m_bStopDue = false;
+        pSession->m_dwTimersDue = 0;
+        if ( pSession->m_bRoundStop == true )
+        {
+            pSession->m_bStopping = true;
+        }
+        pSession->m_dwTimersArmed = 0;
+        for ( int nTimer = 0; nTimer < SERIALSESSION_TIMERS; nTimer++ )
+        {
+            if ( pSession->m_SessionTimers [ nTimer ].IsArmed() == true )
+            {
+                pSession->m_dwTimersArmed |= 1 << nTimer;
+            }
+        }
+        pSession->m_bWorking = true;
+        if ( pSession->m_bOffload == true && CDatabaseWorkers::Instance().Queue ( pSession ) == true )
+        {
+            m_nWorking++;                                                // the worker posts m_WorkOverlapped when done
+            return;
+        }
+        pSession->RunRound();
+        Complete ( pSession );
+    }
+
+    void Complete ( CSerialSession* pSession )
+    {
+        /**************************************************************************************************************
+         * This is called once pSession's round has run. It sets and cancels the timers the round asked for (dropping *
+         * any of them that became due meanwhile) and ends the session if the round or the loop asked for that. Then  *
+         * it hands over the next round, or starts the next I/O.                                                      *
+         **************************************************************************************************************/
+        pSession->m_bWorking = false;
+        for ( int nTimer = 0; nTimer < SERIALSESSION_TIMERS; nTimer++ )
+        {
+            DWORD dwTimer = 1 << nTimer;
+            if (( pSession->m_dwTimersCancelled & dwTimer ) != 0 )
+            {
+                m_pWheel->Cancel ( &pSession->m_SessionTimers [ nTimer ] );
+                pSession->m_dwTimersDue &= ~dwTimer;
+            }
+            else if (( pSession->m_dwTimersSet & dwTimer ) != 0 )
+            {
+                m_pWheel->Arm ( &pSession->m_SessionTimers [ nTimer ], pSession->m_dwTimerMilliseconds [ nTimer ] );
+                pSession->m_dwTimersDue &= ~dwTimer;
+            }
+        }
+        pSession->m_dwTimersSet = 0;
+        pSession->m_dwTimersCancelled = 0;
+        if ( pSession->m_bEndRequested == true || pSession->m_bEndDue == true )
+        {
+            End ( pSession );
+        }
+        Schedule ( pSession );
+    }
+
+    void RunTimers ( void )
+    {
+        /**************************************************************************************************************
+         * This hands over each session timer that the wheel found due at the last Advance, so OnTimer is called with *
+         * it in the session's next round. A timer fires once: OnTimer may set it again. Timers cancelled meanwhile   *
+         * (e.g. by an earlier round) are not returned.                                                               *
+         **************************************************************************************************************/
+        CWheelTimer* pTimer = NULL;
+        while (( pTimer = m_pWheel->NextExpired()) != NULL )
+        {
+            CSerialSession* pSession = ( CSerialSession* ) pTimer->Context;
+            pSession->m_dwTimersDue |= 1 << pTimer->Id;
+            Schedule ( pSession );
+        }
+    }
+
+    void LinkSession ( CSerialSession* pSession )
+    {
+        pSession->m_pPreviousSession = NULL;
+        pSession->m_pNextSession = m_pSessions;
+        if ( m_pSessions != NULL )
+        {
+            m_pSessions->m_pPreviousSession = pSession;
+        }
+        m_pSessions = pSession;
+        m_nSessions++;
+    }
+
+    void UnlinkSession ( CSerialSession* pSession )
+    {
+        if ( pSession->m_pPreviousSession == NULL )
+        {
+            m_pSessions = pSession->m_pNextSession;                                            // it is the first entry
+        }
+        else
+        {
+            pSession->m_pPreviousSession->m_pNextSession = pSession->m_pNextSession;
+        }
+        if ( pSession->m_pNextSession != NULL )
+        {
+            pSession->m_pNextSession->m_pPreviousSession = pSession->m_pPreviousSession;
+        }
+        pSession->m_pNextSession = NULL;
+        pSession->m_pPreviousSession = NULL;
+        m_nSessions--;
+    }
+ };
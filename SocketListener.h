@@ -5,6 +5,9 @@
  * is responsible for constructing a CProtelSocket instance for each incoming socket connection and destroying these  *
  * when the connection ends.                                                                                          *
  *                                                                                                                    *
+ * The connections themselves are handled by a CSocketReactor (see SocketReactor.h) owned by ListenThreadProc: a      *
+ * fixed number of event loop threads rather than a thread per connection.                                            *
+ *                                                                                                                    *
  *                                         Copyright (c) Protel Inc. 2009-2010                                        *
  **********************************************************************************************************************/
 
@@ -12,6 +15,7 @@
 #include "StdAfx.h"
 #include "ProtelList.h"
 #include "ProtelSocket.h"
+#include "SocketReactor.h"
 #include "EventTrace.h"
 
 #include <stdio.h>
@@ -47,14 +51,16 @@ private:
     };
 
 public:
-    static bool InitializeListener(CProtelList* protelList, HANDLE* phShutdown)
+    static HANDLE InitializeListener(CProtelList* protelList, HANDLE* phShutdown)
     {
         /**************************************************************************************************************
          * This is called by CApplication on startup. protelList points to the ProtelList (ProtelHosts associated     *
          * with modems and socket connections) created by CApplication. CApplication signals the event pointed to by  *
          * phShutdown when the system is shutting down.                                                               *
          *                                                                                                            *
-         * It spawns a ListenThreadProc and returns TRUE on success.                                                  *
+         * It spawns a ListenThreadProc and returns its handle, or NULL if it couldn't be started. CApplication waits *
+         * on the handle once it has signalled shutdown: the thread has then ended every connection and destroyed its *
+         * CProtelSockets, so nothing else uses protelList.                                                           *
          **************************************************************************************************************/
         InitializeStructure* pInitializeStructure = new InitializeStructure;         // save the data to pass to thread
         pInitializeStructure->protelList = protelList;
@@ -69,10 +75,9 @@ public:
             NULL );                                                           // lpThreadId [out] - NULL = not returned
         if ( hListenThread == NULL )
         {
-            return false;
+            delete pInitializeStructure;
         }
-        CloseHandle( hListenThread );                             // we won't use this handle - thread continues anyway
-        return true;
+        return hListenThread;
     }
 
 private:
@@ -81,9 +86,9 @@ private:
         /**************************************************************************************************************
          * This is the thread that is spawned by InitializeListener at startup. It binds to the port specified in the *
          * profile and continues running until shutdown occurs, waiting for incoming socket connections. For each     *
-         * that is opened, it constructs a CProtelSocket. This in turn spawns a CprotelSocket::SocketThreadProc which *
-         * is responsible for handling the connection. CProtelSockets marked as closed are destroyed by this thread   *
-         * when a connection ends.                                                                                    *
+         * that is opened, it constructs a CProtelSocket and attaches it to the socket reactor, one of whose event    *
+         * loop threads is then responsible for handling the connection. CProtelSockets marked as closed are          *
+         * destroyed by this thread when a connection ends.                                                           *
          **************************************************************************************************************/
         InitializeStructure* pInitializeStructure = ( InitializeStructure* ) lpParameter;
 
@@ -134,10 +139,23 @@ private:
             eventTrace.Event( CEventTrace::SevereError, "Error (%ld) listening on socket.", nError );
         }
         eventTrace.Event( CEventTrace::Details, "Listening on socket...");
+
+        /*
+         * We start the event loop threads that will handle the connections.
+         */
+        CSocketReactor socketReactor;
+        {
+            CProfileValues profileValues;
+            if ( socketReactor.Start ( profileValues.GetReactorThreads()) == false )
+            {
+                eventTrace.Event( CEventTrace::SevereError, "Error (%ld) starting socket reactor.", GetLastError());
+            }
+            eventTrace.Event( CEventTrace::Details, "Socket reactor running %d event loops", socketReactor.LoopCount );
+        }
         HANDLE hEvents [ 3 ];
         hEvents [ 0 ] = *( pInitializeStructure->phShutdown );                               // system is shutting down
         hEvents [ 1 ] = listenEvent;                                              // new connection request (FD_ACCEPT)
-        hEvents [ 2 ] = CreateEvent( NULL, TRUE, FALSE, NULL );  // a connection ended (set by CProtelSocket::Shutdown)
+        hEvents [ 2 ] = CreateEvent( NULL, TRUE, FALSE, NULL );  // a connection ended (set by CProtelSocket::OnClosed)
 
 //  _CrtMemState memstate;
 //  _CrtMemCheckpoint(&memstate);
@@ -173,9 +191,9 @@ private:
                         {
                             /*
                              * The connection was accepted OK. We set up the socket, construct an associated
-                             * CProtelSocket and add it to the ProtelList. (The CProtelSocket constructor spawns a
-                             * new thread to handle the connection - this will signal hEvents[2] when it is
-                             * finished).
+                             * CProtelSocket, add it to the ProtelList and attach it to the reactor, which handles the
+                             * connection on one of its event loops (this will signal hEvents[2] when it is finished).
+                             * If the reactor isn't running, the connection is simply closed.
                              */
                             sockaddr_in acceptedAddress; // does this do anything???? (optional in accept, otherwise unused)
                             int acceptedAddressLength = sizeof ( acceptedAddress );
@@ -185,46 +203,28 @@ private:
                                 ( sockaddr* )&acceptedAddress,                 // addr [out] - address of remote device
                                 &acceptedAddressLength );                  // addrlen [in, out] - length of addr struct
                             CProtelSocket* p = new CProtelSocket( dataSocket, *( pInitializeStructure->phShutdown ),
-                                hEvents [ 2 ] );
+                                pInitializeStructure->protelList, hEvents [ 2 ] );
 #ifdef __DEBUG_MEMORY_CHECK_UTILITIES__
                             _ASSERT ( _CrtIsValidPointer ( p, sizeof ( CProtelSocket ), FALSE ));
 #endif  //  __DEBUG_MEMORY_CHECK_UTILITIES__
                             pInitializeStructure->protelList->Add( p );
+                            if ( socketReactor.Attach ( p ) == false )
+                            {
+                                pInitializeStructure->protelList->Remove ( p );        // deletes p, closing the socket
+                            }
                             eventTrace.Event( CEventTrace::Information, "connected (%ld)", GetTickCount());
                         }
                     }
                     break;
 
                 case 2:                                                           // a CProtelSocket::Shutdown occurred
-                    while ( true )
-                    {
-                        CProtelHost* protelHost = pInitializeStructure->protelList->MoveFirst();
-                        CProtelHost* protelClosedHost = NULL;
-                        while ( protelHost != NULL )
-                        {
-                            /*
-                             * We work through the list of ProtelHosts. When we find one that is marked as closed
-                             * (only socket connections do this), we record it and stop.
-                             */
-                            if ( protelHost->Closed == true )
-                            {
-                                protelClosedHost = protelHost;
-                                break;
-                            }
-                            protelHost = pInitializeStructure->protelList->Next();
-                        }
-                        /*
-                         * Either we found a closed ProtelHost or reached the end of the list (protelClosedHost
-                         * NULL). We remove the ProtelHost and destroy it (does nothing if protelClosedHost NULL).
-                         * Unless we reached the end of the list without finding a closed host, we will return to the
-                         * start of the list.
-                         */
-                        pInitializeStructure->protelList->Remove ( protelClosedHost );
-                        if ( protelClosedHost == NULL )
-                        {
-                            break;
-                        }
-                    }
+                    /*
+                     * We reset the event first, so a connection that ends while we are removing the others signals
+                     * it again. Each closed CProtelSocket has queued itself on the ProtelList (see
+                     * CProtelSocket::OnClosed); we remove and destroy those (once no other thread can be using them).
+                     */
+                    ResetEvent ( hEvents [ 2 ] );
+                    pInitializeStructure->protelList->RemoveClosed();
 //    _CrtDumpMemoryLeaks();
 //  _CrtMemState memstate;
 //  _CrtMemCheckpoint(&memstate);
@@ -236,15 +236,18 @@ private:
 //  _CrtMemDumpAllObjectsSince(&memstate);
 //  delete[] s;
 
-                    ResetEvent ( hEvents [ 2 ] );
                     break;
 
             }
         }
 
         /*
-         * The system is shutting down.
+         * The system is shutting down. We stop the reactor, which ends any connections still open, then destroy the
+         * closed CProtelSockets.
          */
+        socketReactor.Stop();
+        pInitializeStructure->protelList->RemoveClosed();
+        CloseHandle ( hEvents [ 2 ] );
         delete pInitializeStructure;
         eventTrace.Event( CEventTrace::Details, "Exiting ListenProcedure");
         CoUninitialize();                                        // close the COM library and clean up thread resources
@@ -0,0 +1,731 @@
+/**********************************************************************************************************************
+ *                         This file contains the CSocketReactor and CReactorSession classes.                         *
+ *                                                                                                                    *
+ * CSocketListener constructs a CSocketReactor which runs a small, fixed number of event loop threads (by default     *
+ * one per processor, each pinned to its own processor). Every accepted socket connection is attached to one of the   *
+ * loops and stays on it until it ends, so all of a connection's work happens on a single thread without locking.     *
+ *                                                                                                                    *
+ * Each loop waits on its own I/O completion port. A receive is kept outstanding on every socket attached to the      *
+ * loop; when it completes the received data is passed to the session and another receive is started. Each session    *
+ * also has a few timers (e.g. its response timeout and ping interval), identified by number, which are kept in the   *
+ * loop's timer wheel (see TimerWheel.h): setting or cancelling one is a list operation with no system call, and the  *
+ * wheel's next deadline is used as the completion port wait timeout. Thousands of simultaneous connections therefore *
+ * need only a handful of threads instead of one thread and a waitable timer each.                                    *
+ *                                                                                                                    *
+ * A connection is represented by a class inheriting CReactorSession (e.g. CProtelSocket) which overrides OnStart,    *
+ * OnReceive, OnTimer and OnClosed. A session ends by calling EndSession: once any outstanding receive has completed, *
+ * the loop calls OnClosed and never touches the session again, so it can then be deleted by another thread.          *
+ *                                                                                                                    *
+ * The loop gathers what is due for a session (its start, the data received, its timers) and hands it over as one     *
+ * round, which calls the On... methods in that order. A session constructed with Offload TRUE (e.g. CProtelSocket,   *
+ * whose On... methods make database calls) has each round run by a CDatabaseWorkers thread (see DatabaseWorkers.h),  *
+ * so a slow database call doesn't hold up the other sessions on the loop; the worker posts the round's completion    *
+ * back to the loop's port. A session never has more than one round at a time, so its On... methods are still called  *
+ * one at a time, in order, and need no locking. What a round asks for (SetSessionTimer, CancelSessionTimer,          *
+ * EndSession) is recorded in the session and carried out by the loop once the round is complete, since the wheel and *
+ * the socket's receive belong to the loop thread. Another receive is only started once the data received has been    *
+ * handed over. OnClosed is a round of its own.                                                                       *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+#include "DatabaseWorkers.h"
+#include "TimerWheel.h"
+
+#define SOCKETREACTOR_MAXLOOPS      64                                         // most event loop threads (one per CPU)
+#define SOCKETREACTOR_RECEIVESIZE   4096                                                      // bytes received at once
+#define SOCKETREACTOR_STOPSECONDS   10                // time allowed for sessions to close when the reactor is stopped
+#define SOCKETREACTOR_POLLMS        10                       // how often a stopping loop checks for OnClosed to return
+#define REACTORSESSION_TIMERS       8                                                        // most timers per session
+
+class CReactorSession :
+    public CDatabaseWork
+ {
+    friend class CSocketReactor;
+
+public:
+    CReactorSession( SOCKET hSocket, bool Offload = false ) :
+        m_hReactorSocket ( hSocket ),
+        m_bOffload ( Offload ),
+        m_pNextSession ( NULL ),
+        m_pPreviousSession ( NULL ),
+        m_bReceivePending ( false ),
+        m_bEnding ( false ),
+        m_pTimerWheel ( NULL ),
+        m_hLoopPort ( NULL ),
+        m_plLoopClosing ( NULL ),
+        m_bWorking ( false ),
+        m_bStartDue ( false ),
+        m_nReceivedDue ( 0 ),
+        m_dwTimersDue ( 0 ),
+        m_bEndDue ( false ),
+        m_bRoundStart ( false ),
+        m_nRoundReceived ( 0 ),
+        m_dwRoundTimers ( 0 ),
+        m_bRoundClose ( false ),
+        m_dwTimersArmed ( 0 ),
+        m_dwTimersSet ( 0 ),
+        m_dwTimersCancelled ( 0 ),
+        m_bEndRequested ( false )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+        ZeroMemory ( &m_Overlapped, sizeof ( m_Overlapped ));
+        ZeroMemory ( &m_WorkOverlapped, sizeof ( m_WorkOverlapped ));
+        ZeroMemory ( m_ReceiveBuffer, sizeof ( m_ReceiveBuffer ));
+        ZeroMemory ( m_dwTimerMilliseconds, sizeof ( m_dwTimerMilliseconds ));
+        for ( int nTimer = 0; nTimer < REACTORSESSION_TIMERS; nTimer++ )
+        {
+            m_SessionTimers [ nTimer ].Context = this;
+            m_SessionTimers [ nTimer ].Id = nTimer;
+        }
+    }
+
+    virtual ~CReactorSession(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+    }
+
+protected:
+    /*
+     * The following are called one at a time, in rounds (see above), by the session's event loop thread or, if the
+     * session was constructed with Offload TRUE, by a database worker thread.
+     */
+    virtual void OnStart ( void ) = 0;                                     // the session has been attached to its loop
+    virtual void OnReceive ( BYTE* pBuffer, int BufferLength ) = 0;                           // data has been received
+    virtual void OnTimer ( int Timer ) = 0;                         // timer number Timer set by SetSessionTimer is due
+    virtual void OnClosed ( void ) = 0;                     // the session has ended - the reactor has finished with it
+
+    /*
+     * The following must only be called from the On... methods above.
+     */
+    void SetSessionTimer ( int Timer, DWORD Milliseconds )
+    {
+        /**************************************************************************************************************
+         * This sets timer number Timer (0 to REACTORSESSION_TIMERS - 1) so OnTimer is called with it after           *
+         * Milliseconds, replacing any deadline it already had. The loop arms it once the round is complete. Timers   *
+         * are ignored once the session is ending.                                                                    *
+         **************************************************************************************************************/
+        if ( IsSessionEnding() == true )
+        {
+            return;
+        }
+        m_dwTimersSet |= 1 << Timer;
+        m_dwTimersCancelled &= ~( 1 << Timer );
+        m_dwTimerMilliseconds [ Timer ] = Milliseconds;
+    }
+
+    void CancelSessionTimer ( int Timer )
+    {
+        /**************************************************************************************************************
+         * This cancels timer number Timer. If it is due later in this round, OnTimer isn't called with it.           *
+         **************************************************************************************************************/
+        m_dwTimersCancelled |= 1 << Timer;
+        m_dwTimersSet &= ~( 1 << Timer );
+    }
+
+    bool IsSessionTimerSet ( int Timer )
+    {
+        /**************************************************************************************************************
+         * This returns TRUE if timer number Timer is set, counting what this round has asked for so far.             *
+         **************************************************************************************************************/
+        if (( m_dwTimersSet & ( 1 << Timer )) != 0 )
+        {
+            return true;
+        }
+        if (( m_dwTimersCancelled & ( 1 << Timer )) != 0 )
+        {
+            return false;
+        }
+        return ( m_dwTimersArmed & ( 1 << Timer )) != 0;
+    }
+
+    void EndSession ( void )
+    {
+        /**************************************************************************************************************
+         * This ends the session. Once the round is complete, the loop shuts the socket down and cancels any          *
+         * outstanding receive (on the loop thread, since CancelIo only cancels I/O started by the calling thread),   *
+         * then calls OnClosed once the receive has completed (immediately if none is outstanding). Timers set        *
+         * meanwhile are ignored.                                                                                     *
+         **************************************************************************************************************/
+        m_bEndRequested = true;
+        m_dwTimersSet = 0;
+    }
+
+    bool IsSessionEnding ( void )
+    {
+        return m_bEnding == true || m_bEndRequested == true;
+    }
+
+    SOCKET m_hReactorSocket;                                                                 // the connection's socket
+
+private:
+    /*
+     * The following are only used by the loop thread, except m_ReceiveBuffer and the round and request members
+     * (m_bRoundStart to m_bEndRequested), which the loop leaves alone while a round is running (m_bWorking).
+     */
+    bool m_bOffload;                                                     // TRUE if rounds are run by a database worker
+    CReactorSession* m_pNextSession;                                            // links in the loop's list of sessions
+    CReactorSession* m_pPreviousSession;
+    OVERLAPPED m_Overlapped;                                                         // used by the outstanding receive
+    OVERLAPPED m_WorkOverlapped;                                       // used to post a round's completion to the loop
+    BYTE m_ReceiveBuffer [ SOCKETREACTOR_RECEIVESIZE ];                                // receives data from the socket
+    bool m_bReceivePending;                                                      // TRUE while a receive is outstanding
+    bool m_bEnding;                                                         // TRUE once the loop has ended the session
+    CTimerWheel* m_pTimerWheel;                                         // the loop's timer wheel (NULL until attached)
+    CWheelTimer m_SessionTimers [ REACTORSESSION_TIMERS ];                                    // set by SetSessionTimer
+    HANDLE m_hLoopPort;                                                          // the loop's port (set when attached)
+    volatile LONG* m_plLoopClosing;                              // the loop's count of OnClosed rounds running (ditto)
+    bool m_bWorking;                                                             // TRUE while a round hasn't completed
+    bool m_bStartDue;                                                                                 // OnStart is due
+    int m_nReceivedDue;                                                 // bytes in m_ReceiveBuffer not yet handed over
+    DWORD m_dwTimersDue;                                                                           // bit per timer due
+    bool m_bEndDue;                                                        // the loop ended the session during a round
+    bool m_bRoundStart;                                                                      // the round calls OnStart
+    int m_nRoundReceived;                                              // the round passes this many bytes to OnReceive
+    DWORD m_dwRoundTimers;                                                 // bit per timer the round calls OnTimer for
+    bool m_bRoundClose;                                                    // the round calls OnClosed and nothing else
+    DWORD m_dwTimersArmed;                                                  // bit per timer armed when the round began
+    DWORD m_dwTimersSet;                                                              // bit per timer set by the round
+    DWORD m_dwTimerMilliseconds [ REACTORSESSION_TIMERS ];                                           // their deadlines
+    DWORD m_dwTimersCancelled;                                                  // bit per timer cancelled by the round
+    bool m_bEndRequested;                                                                // the round called EndSession
+
+    virtual void DoDatabaseWork ( void )
+    {
+        /**************************************************************************************************************
+         * This runs the round the loop handed over (see CSocketReactor::Dispatch) on a database worker thread, or on *
+         * the loop thread itself if the workers aren't running, and posts its completion back to the loop. After     *
+         * OnClosed the session may already have been deleted, so only the loop's count of OnClosed rounds is touched *
+         * then.                                                                                                      *
+         **************************************************************************************************************/
+        if ( m_bRoundClose == true )
+        {
+            volatile LONG* plLoopClosing = m_plLoopClosing;
+            OnClosed();
+            InterlockedDecrement ( plLoopClosing );
+            return;
+        }
+        RunRound();
+        PostQueuedCompletionStatus ( m_hLoopPort, 0, ( ULONG_PTR ) this, &m_WorkOverlapped );
+    }
+
+    void RunRound ( void )
+    {
+        /**************************************************************************************************************
+         * This calls OnStart, OnReceive, then OnTimer for each timer due, as the round says. Nothing more is called  *
+         * once the session is ending, and a timer that an earlier call in the round set or cancelled isn't called    *
+         * (as if the wheel had been told at once).                                                                   *
+         **************************************************************************************************************/
+        if ( m_bRoundStart == true )
+        {
+            OnStart();
+        }
+        if ( m_nRoundReceived > 0 && IsSessionEnding() == false )
+        {
+            OnReceive ( m_ReceiveBuffer, m_nRoundReceived );
+        }
+        for ( int nTimer = 0; nTimer < REACTORSESSION_TIMERS; nTimer++ )
+        {
+            DWORD dwTimer = 1 << nTimer;
+            if (( m_dwRoundTimers & dwTimer ) == 0 || (( m_dwTimersSet | m_dwTimersCancelled ) & dwTimer ) != 0 )
+            {
+                continue;
+            }
+            if ( IsSessionEnding() == true )
+            {
+                break;
+            }
+            OnTimer ( nTimer );
+        }
+    }
+ };
+
+class CSocketReactor
+ {
+public:
+    CSocketReactor(void) :
+        m_nLoops ( 0 ),
+        m_nNextLoop ( 0 )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+        ZeroMemory ( m_Loops, sizeof ( m_Loops ));
+    }
+
+    virtual ~CSocketReactor(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+        Stop();
+    }
+
+    bool Start ( int LoopThreads )
+    {
+        /**************************************************************************************************************
+         * This starts LoopThreads event loop threads (or one per processor if LoopThreads is 0 or less), each with   *
+         * its own completion port and pinned to a processor. It returns TRUE if at least one loop is running.        *
+         **************************************************************************************************************/
+        SYSTEM_INFO systemInfo;
+        GetSystemInfo ( &systemInfo );
+        int nProcessors = ( int ) systemInfo.dwNumberOfProcessors;
+        if ( LoopThreads <= 0 )
+        {
+            LoopThreads = nProcessors;
+        }
+        if ( LoopThreads > SOCKETREACTOR_MAXLOOPS )
+        {
+            LoopThreads = SOCKETREACTOR_MAXLOOPS;
+        }
+
+        for ( int nLoop = 0; nLoop < LoopThreads; nLoop++ )
+        {
+            SReactorLoop* pLoop = &m_Loops [ m_nLoops ];
+            ZeroMemory ( pLoop, sizeof ( *pLoop ));
+            pLoop->pWheel = new CTimerWheel;                          // allocated - too large for the listener's stack
+            pLoop->hPort = CreateIoCompletionPort(
+                INVALID_HANDLE_VALUE,                     // FileHandle [in] - INVALID_HANDLE_VALUE = create a new port
+                NULL,                                                      // ExistingCompletionPort [in] - NULL = none
+                0,                                                       // CompletionKey [in] - not used when creating
+                1 );                                        // NumberOfConcurrentThreads [in] - this loop's thread only
+            if ( pLoop->hPort == NULL )
+            {
+                delete pLoop->pWheel;
+                pLoop->pWheel = NULL;
+                break;
+            }
+            pLoop->hThread = CreateThread(
+                NULL,                                           // lpThreadAttributes [in] - NULL = cannot be inherited
+                0,                                           // dwStackSize [in] - initial stack size - 0 = use default
+                LoopThreadProc,                                                   // lpStartAddress [in] - in this file
+                pLoop,                                                            // lpParameter [in] - the loop to run
+                CREATE_SUSPENDED,                                   // dwCreationFlags [in] - started once pinned below
+                NULL );                                                       // lpThreadId [out] - NULL = not returned
+            if ( pLoop->hThread == NULL )
+            {
+                CloseHandle ( pLoop->hPort );
+                pLoop->hPort = NULL;
+                delete pLoop->pWheel;
+                pLoop->pWheel = NULL;
+                break;
+            }
+            SetThreadAffinityMask ( pLoop->hThread, ( DWORD_PTR ) 1 << ( nLoop % nProcessors ));
+            ResumeThread ( pLoop->hThread );
+            m_nLoops++;
+        }
+        return m_nLoops > 0;
+    }
+
+    void Stop ( void )
+    {
+        /**************************************************************************************************************
+         * This asks each loop to end all its sessions, then waits for the loop threads to exit. Each session's       *
+         * OnClosed is called before its loop exits unless its receive couldn't be cancelled. A loop gives up on its  *
+         * sessions SOCKETREACTOR_STOPSECONDS after the request, but not while a database worker is still running one *
+         * of their rounds, so the wait has no timeout: the ports and the timer wheels are only freed once no thread  *
+         * uses them.                                                                                                 *
+         **************************************************************************************************************/
+        HANDLE hThreads [ SOCKETREACTOR_MAXLOOPS ];
+        for ( int nLoop = 0; nLoop < m_nLoops; nLoop++ )
+        {
+            PostQueuedCompletionStatus ( m_Loops [ nLoop ].hPort, 0, 0, NULL );                         // key 0 = stop
+            hThreads [ nLoop ] = m_Loops [ nLoop ].hThread;
+        }
+        if ( m_nLoops > 0 )
+        {
+            WaitForMultipleObjects (
+                m_nLoops,                                              // nCount [in] - number of objects in *lpHandles
+                hThreads,                                                       // lpHandles [in] - objects to wait for
+                TRUE,                                     // bWaitAll [in] - TRUE - return when all threads have exited
+                INFINITE );                                                    // dwMilliseconds [in] - until they have
+        }
+        for ( int nLoop = 0; nLoop < m_nLoops; nLoop++ )
+        {
+            CloseHandle ( m_Loops [ nLoop ].hThread );
+            CloseHandle ( m_Loops [ nLoop ].hPort );
+            delete m_Loops [ nLoop ].pWheel;
+            m_Loops [ nLoop ].pWheel = NULL;
+        }
+        m_nLoops = 0;
+    }
+
+    bool Attach ( CReactorSession* pSession )
+    {
+        /**************************************************************************************************************
+         * This hands pSession to the next loop (round robin). The loop calls its OnStart, then starts receiving.     *
+         * It returns FALSE if the reactor isn't running, in which case the caller still owns the session.            *
+         **************************************************************************************************************/
+        if ( m_nLoops == 0 )
+        {
+            return false;
+        }
+        SReactorLoop* pLoop = &m_Loops [ m_nNextLoop ];
+        m_nNextLoop = ( m_nNextLoop + 1 ) % m_nLoops;
+        return PostQueuedCompletionStatus ( pLoop->hPort, 0, ( ULONG_PTR ) pSession, NULL ) != FALSE;
+    }
+
+    int GetLoopCount ( void )
+    {
+        return m_nLoops;
+    }
+    __declspec(property(get = GetLoopCount)) int LoopCount;
+
+private:
+    struct SReactorLoop                                                                         // an event loop thread
+    {
+        HANDLE hPort;                                                                     // the loop's completion port
+        HANDLE hThread;                                                                            // the loop's thread
+        CReactorSession* pSessions;                          // sessions attached to the loop (only used by its thread)
+        int nSessions;                                                               // number of sessions in pSessions
+        CTimerWheel* pWheel;                                   // the sessions' timers (only used by the loop's thread)
+        int nWorking;                                                   // rounds being run by database workers (ditto)
+        volatile LONG lClosing;                                        // OnClosed rounds still running (on any thread)
+    };
+
+    SReactorLoop m_Loops [ SOCKETREACTOR_MAXLOOPS ];
+    int m_nLoops;                                                                            // number of loops running
+    int m_nNextLoop;                                                       // loop that the next session is attached to
+
+    static DWORD WINAPI LoopThreadProc ( LPVOID lpParam )
+    {
+        /**************************************************************************************************************
+         * This is the thread that runs each event loop. Sessions make database calls, which it makes itself when the *
+         * database workers aren't running, so the COM library is initialised for it.                                 *
+         **************************************************************************************************************/
+        CoInitialize(NULL);                                               // initialise the COM library for this thread
+        RunLoop (( SReactorLoop* ) lpParam );
+        CoUninitialize();                                        // close the COM library and clean up thread resources
+        return 0;
+    }
+
+    static void RunLoop ( SReactorLoop* pLoop )
+    {
+        /**************************************************************************************************************
+         * This waits for a completion (a receive or round completed, a session attached or a stop request) or for    *
+         * the nearest session timer, handles it, then hands over the timers that are due. It continues until         *
+         * stopped, then ends every session and waits (up to SOCKETREACTOR_STOPSECONDS) for their receives to         *
+         * complete. It never exits while a database worker is running one of its sessions' rounds, since the worker  *
+         * uses the loop's port and counts.                                                                           *
+         **************************************************************************************************************/
+        bool bStopping = false;
+        DWORD dwStopDue = 0;
+        while ( bStopping == false || pLoop->nSessions > 0 || pLoop->nWorking > 0 || pLoop->lClosing > 0 )
+        {
+            DWORD dwWait = pLoop->pWheel->GetNextTimeout();
+            if ( bStopping == true )
+            {
+                long nStopRemaining = ( long )( dwStopDue - GetTickCount());
+                if ( nStopRemaining <= 0 && pLoop->nWorking == 0 && pLoop->lClosing == 0 )
+                {
+                    break;                                                      // give up on sessions that won't close
+                }
+                if ( nStopRemaining > 0 )
+                {
+                    dwWait = min ( dwWait, ( DWORD ) nStopRemaining );
+                }
+                if ( pLoop->lClosing > 0 )
+                {
+                    dwWait = min ( dwWait, ( DWORD ) SOCKETREACTOR_POLLMS );             // OnClosed doesn't post to us
+                }
+            }
+
+            DWORD dwBytes = 0;
+            ULONG_PTR ulKey = 0;
+            OVERLAPPED* pOverlapped = NULL;
+            BOOL bSuccess = GetQueuedCompletionStatus (
+                pLoop->hPort,                                                  // CompletionPort [in] - the loop's port
+                &dwBytes,                                                     // lpNumberOfBytes [out] - bytes received
+                &ulKey,                                               // lpCompletionKey [out] - the session (0 = stop)
+                &pOverlapped,                          // lpOverlapped [out] - NULL unless a receive or round completed
+                dwWait );                                              // dwMilliseconds [in] - until the nearest timer
+            CReactorSession* pSession = ( CReactorSession* ) ulKey;
+            pLoop->pWheel->Advance ( GetTickCount());                  // first, so timers set below are timed from now
+
+            if ( pOverlapped != NULL && pOverlapped == &pSession->m_WorkOverlapped )
+            {
+                /*
+                 * A database worker has run one of the session's rounds. We carry out what the round asked for.
+                 */
+                pLoop->nWorking--;
+                Complete ( pLoop, pSession );
+            }
+            else if ( pOverlapped != NULL )
+            {
+                /*
+                 * A receive completed. If data arrived we hand it over to the session (another receive is started
+                 * once it has been), otherwise the connection has closed (or End cancelled the receive).
+                 */
+                pSession->m_bReceivePending = false;
+                if ( bSuccess == TRUE && dwBytes > 0 && pSession->m_bEnding == false )
+                {
+                    pSession->m_nReceivedDue = ( int ) dwBytes;
+                }
+                else
+                {
+                    End ( pSession );
+                }
+                Schedule ( pLoop, pSession );
+            }
+            else if ( pSession != NULL )
+            {
+                /*
+                 * A new session was attached. We add it to our list and associate its socket with our port, then
+                 * start it (receiving once it has started).
+                 */
+                LinkSession ( pLoop, pSession );
+                pSession->m_pTimerWheel = pLoop->pWheel;
+                pSession->m_hLoopPort = pLoop->hPort;
+                pSession->m_plLoopClosing = &pLoop->lClosing;
+                CreateIoCompletionPort (
+                    ( HANDLE ) pSession->m_hReactorSocket,                    // FileHandle [in] - the session's socket
+                    pLoop->hPort,                                             // ExistingCompletionPort [in] - our port
+                    ( ULONG_PTR ) pSession,                              // CompletionKey [in] - identifies the session
+                    0 );                               // NumberOfConcurrentThreads [in] - ignored for an existing port
+                if ( bStopping == true )
+                {
+                    End ( pSession );
+                }
+                else
+                {
+                    pSession->m_bStartDue = true;
+                }
+                Schedule ( pLoop, pSession );
+            }
+            else if ( bSuccess == TRUE && bStopping == false )
+            {
+                /*
+                 * We have been asked to stop. We end every session; each is finished as its receive completes (and
+                 * once any round it has running is complete).
+                 */
+                bStopping = true;
+                dwStopDue = GetTickCount() + SOCKETREACTOR_STOPSECONDS * 1000;
+                CReactorSession* pNext = NULL;
+                for ( pSession = pLoop->pSessions; pSession != NULL; pSession = pNext )
+                {
+                    pNext = pSession->m_pNextSession;
+                    End ( pSession );
+                    Schedule ( pLoop, pSession );
+                }
+            }
+
+            RunTimers ( pLoop );
+        }
+    }
+
+    static void Receive ( CReactorSession* pSession )
+    {
+        /**************************************************************************************************************
+         * This starts a receive on pSession's socket unless the session is ending. Its completion is queued to the   *
+         * loop's port even if it completes immediately. If the receive can't be started, the session is ended.       *
+         **************************************************************************************************************/
+        if ( pSession->m_bEnding == true || pSession->m_bReceivePending == true )
+        {
+            return;
+        }
+        ZeroMemory ( &pSession->m_Overlapped, sizeof ( pSession->m_Overlapped ));
+        WSABUF wsaBuffer;
+        wsaBuffer.buf = ( char* ) pSession->m_ReceiveBuffer;
+        wsaBuffer.len = sizeof ( pSession->m_ReceiveBuffer );
+        DWORD dwFlags = 0;
+        pSession->m_bReceivePending = true;
+        if ( WSARecv (
+                pSession->m_hReactorSocket,                                                      // s [in] - the socket
+                &wsaBuffer,                                                    // lpBuffers [in, out] - buffer for data
+                1,                                                                   // dwBufferCount [in] - one buffer
+                NULL,                                             // lpNumberOfBytesRecvd [out] - NULL = see completion
+                &dwFlags,                                                         // lpFlags [in, out] - none specified
+                &pSession->m_Overlapped,                          // lpOverlapped [in] - receive completes via the port
+                NULL )                                                        // lpCompletionRoutine [in] - NULL = none
+            == SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING )
+        {
+            pSession->m_bReceivePending = false;
+            End ( pSession );
+        }
+    }
+
+    static void End ( CReactorSession* pSession )
+    {
+        /**************************************************************************************************************
+         * This ends pSession on the loop thread: the socket is shut down, any outstanding receive is cancelled, and  *
+         * its timers and anything still due for it are dropped. If a round is running, this is done once it is       *
+         * complete (see Complete).                                                                                   *
+         **************************************************************************************************************/
+        if ( pSession->m_bWorking == true )
+        {
+            pSession->m_bEndDue = true;
+            return;
+        }
+        if ( pSession->m_bEnding == true )
+        {
+            return;
+        }
+        pSession->m_bEnding = true;
+        pSession->m_bStartDue = false;
+        pSession->m_nReceivedDue = 0;
+        pSession->m_dwTimersDue = 0;
+        for ( int nTimer = 0; nTimer < REACTORSESSION_TIMERS; nTimer++ )
+        {
+            pSession->m_pTimerWheel->Cancel ( &pSession->m_SessionTimers [ nTimer ] );
+        }
+        shutdown (
+            pSession->m_hReactorSocket,                                                    // hSocket [in] - the socket
+            SD_RECEIVE | SD_SEND );                                       // nHow [in] - shutdown both receive and send
+        if ( pSession->m_bReceivePending == true )
+        {
+            CancelIo (( HANDLE ) pSession->m_hReactorSocket );
+        }
+    }
+
+    static void Schedule ( SReactorLoop* pLoop, CReactorSession* pSession )
+    {
+        /**************************************************************************************************************
+         * This hands pSession its next round unless one is running: OnClosed once it has ended and has no receive    *
+         * outstanding, otherwise whatever is due (see Dispatch). Once OnClosed has been handed over, the session is  *
+         * out of the loop's list and the loop doesn't refer to it again.                                             *
+         **************************************************************************************************************/
+        if ( pSession->m_bWorking == true )
+        {
+            return;
+        }
+        if ( pSession->m_bEnding == true )
+        {
+            if ( pSession->m_bReceivePending == false )
+            {
+                UnlinkSession ( pLoop, pSession );
+                pSession->m_bRoundClose = true;
+                InterlockedIncrement ( &pLoop->lClosing );
+                if ( pSession->m_bOffload == false || CDatabaseWorkers::Instance().Queue ( pSession ) == false )
+                {
+                    pSession->DoDatabaseWork();                                                       // OnClosed, here
+                }
+            }
+            return;
+        }
+        if ( pSession->m_bStartDue == false && pSession->m_nReceivedDue == 0 && pSession->m_dwTimersDue == 0 )
+        {
+            return;
+        }
+        Dispatch ( pLoop, pSession );
+    }
+
+    static void Dispatch ( SReactorLoop* pLoop, CReactorSession* pSession )
+    {
+        /**************************************************************************************************************
+         * This moves what is due for pSession into a round and hands it to a database worker if the session was      *
+         * constructed with Offload TRUE and the workers are running, otherwise runs it here and now. Either way      *
+         * Complete is called on this thread once the round has run.                                                  *
+         **************************************************************************************************************/
+        pSession->m_bRoundStart = pSession->m_bStartDue;
+        pSession->m_nRoundReceived = pSession->m_nReceivedDue;
+        pSession->m_dwRoundTimers = pSession->m_dwTimersDue;
+        pSession->m_bStartDue = false;
+        pSession->m_nReceivedDue = 0;
+        pSession->m_dwTimersDue = 0;
+        pSession->m_dwTimersArmed = 0;
+        for ( int nTimer = 0; nTimer < REACTORSESSION_TIMERS; nTimer++ )
+        {
+            if ( pSession->m_SessionTimers [ nTimer ].IsArmed() == true )
+            {
+                pSession->m_dwTimersArmed |= 1 << nTimer;
+            }
+        }
+        pSession->m_bWorking = true;
+        if ( pSession->m_bOffload == true && CDatabaseWorkers::Instance().Queue ( pSession ) == true )
+        {
+            pLoop->nWorking++;                                           // the worker posts m_WorkOverlapped when done
+            return;
+        }
+        pSession->RunRound();
+        Complete ( pLoop, pSession );
+    }
+
+    static void Complete ( SReactorLoop* pLoop, CReactorSession* pSession )
+    {
+        /**************************************************************************************************************
+         * This is called once pSession's round has run. It sets and cancels the timers the round asked for (dropping *
+         * any of them that became due meanwhile) and ends the session if the round or the loop asked for that;       *
+         * otherwise it starts another receive if the data received has all been handed over. Then it hands over the  *
+         * next round.                                                                                                *
+         **************************************************************************************************************/
+        pSession->m_bWorking = false;
+        for ( int nTimer = 0; nTimer < REACTORSESSION_TIMERS; nTimer++ )
+        {
+            DWORD dwTimer = 1 << nTimer;
+            if (( pSession->m_dwTimersCancelled & dwTimer ) != 0 )
+            {
+                pLoop->pWheel->Cancel ( &pSession->m_SessionTimers [ nTimer ] );
+                pSession->m_dwTimersDue &= ~dwTimer;
+            }
+            else if (( pSession->m_dwTimersSet & dwTimer ) != 0 )
+            {
+                pLoop->pWheel->Arm ( &pSession->m_SessionTimers [ nTimer ],
+                    pSession->m_dwTimerMilliseconds [ nTimer ] );
+                pSession->m_dwTimersDue &= ~dwTimer;
+            }
+        }
+        pSession->m_dwTimersSet = 0;
+        pSession->m_dwTimersCancelled = 0;
+        if ( pSession->m_bEndRequested == true || pSession->m_bEndDue == true )
+        {
+            End ( pSession );
+        }
+        else if ( pSession->m_nReceivedDue == 0 )
+        {
+            Receive ( pSession );
+        }
+        Schedule ( pLoop, pSession );
+    }
+
+    static void RunTimers ( SReactorLoop* pLoop )
+    {
+        /**************************************************************************************************************
+         * This hands over each session timer that the wheel found due at the last Advance, so OnTimer is called with *
+         * it in the session's next round. A timer fires once: OnTimer may set it again. Timers cancelled meanwhile   *
+         * (e.g. by an earlier round) are not returned.                                                               *
+         **************************************************************************************************************/
+        CWheelTimer* pTimer = NULL;
+        while (( pTimer = pLoop->pWheel->NextExpired()) != NULL )
+        {
+            CReactorSession* pSession = ( CReactorSession* ) pTimer->Context;
+            pSession->m_dwTimersDue |= 1 << pTimer->Id;
+            Schedule ( pLoop, pSession );
+        }
+    }
+
+    static void LinkSession ( SReactorLoop* pLoop, CReactorSession* pSession )
+    {
+        pSession->m_pPreviousSession = NULL;
+        pSession->m_pNextSession = pLoop->pSessions;
+        if ( pLoop->pSessions != NULL )
+        {
+            pLoop->pSessions->m_pPreviousSession = pSession;
+        }
+        pLoop->pSessions = pSession;
+        pLoop->nSessions++;
+    }
+
+    static void UnlinkSession ( SReactorLoop* pLoop, CReactorSession* pSession )
+    {
+        if ( pSession->m_pPreviousSession == NULL )
+        {
+            pLoop->pSessions = pSession->m_pNextSession;                                       // it is the first entry
+        }
+        else
+        {
+            pSession->m_pPreviousSession->m_pNextSession = pSession->m_pNextSession;
+        }
+        if ( pSession->m_pNextSession != NULL )
+        {
+            pSession->m_pNextSession->m_pPreviousSession = pSession->m_pPreviousSession;
+        }
+        pSession->m_pNextSession = NULL;
+        pSession->m_pPreviousSession = NULL;
+        pLoop->nSessions--;
+    }
+ };
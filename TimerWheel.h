@@ -0,0 +1,306 @@
+/**********************************************************************************************************************
+ *                             This file contains the CTimerWheel and CWheelTimer classes.                            *
+ *                                                                                                                    *
+ * A CTimerWheel holds any number of deadlines (CWheelTimers) in user memory, so arming or cancelling one is a few    *
+ * pointer operations rather than a kernel call. Each CSocketReactor loop, and the CSerialReactor loop which handles  *
+ * the modems, uses one for all the timers of the sessions attached to it (response timeouts, ping intervals, call    *
+ * limits, modem engine deadlines, etc.).                                                                             *
+ *                                                                                                                    *
+ * Time is divided into ticks of TIMERWHEEL_TICKMS milliseconds. The wheel has TIMERWHEEL_LEVELS levels of            *
+ * TIMERWHEEL_SLOTS slots, each slot being a list of timers. Level 0 has a slot per tick for the next 256 ticks,      *
+ * level 1 a slot per 256 ticks for the next 65536 ticks and so on, so a timer is armed by linking it into the slot   *
+ * for its due tick at the finest level that reaches that far. Whenever level 0 wraps, the timers in the next slot of *
+ * level 1 (and, when that wraps, level 2, etc.) are moved down to the finer level they now belong in. Arming and     *
+ * cancelling are O(1) and each timer is moved at most once per level, however many timers are pending.               *
+ *                                                                                                                    *
+ * The owner calls Advance with the current time (GetTickCount), then NextExpired until it returns NULL to get each   *
+ * timer that has become due. GetNextTimeout returns how long the owner may wait before calling Advance again.        *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+#define TIMERWHEEL_TICKMS       10                                                        // milliseconds per tick
+#define TIMERWHEEL_LEVELS       4                                  // 4 levels of 256 slots cover 2^32 ticks (497 days)
+#define TIMERWHEEL_SLOTBITS     8
+#define TIMERWHEEL_SLOTS        ( 1 << TIMERWHEEL_SLOTBITS )
+#define TIMERWHEEL_SLOTMASK     ( TIMERWHEEL_SLOTS - 1 )
+
+struct SWheelLink                                                               // a link in a circular timer list
+{
+    SWheelLink* pNext;
+    SWheelLink* pPrevious;
+};
+
+class CTimerWheel;
+
+class CWheelTimer :
+    public SWheelLink
+ {
+    friend class CTimerWheel;
+
+public:
+    CWheelTimer(void) :
+        Context ( NULL ),
+        Id ( 0 ),
+        m_nDue ( 0 ),
+        m_pWheel ( NULL )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+        pNext = NULL;
+        pPrevious = NULL;
+    }
+
+    bool IsArmed ( void )
+    {
+        return m_pWheel != NULL;                            // TRUE from Arm until cancelled or returned by NextExpired
+    }
+
+    LPVOID Context;                                           // set by the owner to identify the timer when it expires
+    int Id;                                                                                                  // (ditto)
+
+private:
+    unsigned __int64 m_nDue;                                                              // tick when the timer is due
+    CTimerWheel* m_pWheel;                                           // wheel the timer is armed in (NULL if not armed)
+ };
+
+class CTimerWheel
+ {
+public:
+    CTimerWheel(void)
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+        for ( int nLevel = 0; nLevel < TIMERWHEEL_LEVELS; nLevel++ )
+        {
+            for ( int nSlot = 0; nSlot < TIMERWHEEL_SLOTS; nSlot++ )
+            {
+                Empty ( &m_Slots [ nLevel ][ nSlot ] );
+            }
+        }
+        Empty ( &m_Expired );
+        m_nCount = 0;
+        Reset ( GetTickCount());
+    }
+
+    virtual ~CTimerWheel(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+    }
+
+    void Reset ( DWORD NowMilliseconds )
+    {
+        /**************************************************************************************************************
+         * This sets the wheel's clock to NowMilliseconds (a GetTickCount value). It should only be used while no     *
+         * timers are armed.                                                                                          *
+         **************************************************************************************************************/
+        m_dwLastMilliseconds = NowMilliseconds;
+        m_nClock = 0;
+        m_nNextTick = 0;
+    }
+
+    void Arm ( CWheelTimer* pTimer, DWORD Milliseconds )
+    {
+        /**************************************************************************************************************
+         * This arms pTimer to become due Milliseconds from the last Advance (replacing any previous deadline).       *
+         **************************************************************************************************************/
+        Cancel ( pTimer );
+        unsigned __int64 nDue = ( m_nClock + Milliseconds + TIMERWHEEL_TICKMS - 1 ) / TIMERWHEEL_TICKMS;
+        if ( nDue < m_nNextTick )
+        {
+            nDue = m_nNextTick;                                                // due now - expires at the next Advance
+        }
+        pTimer->m_nDue = nDue;
+        pTimer->m_pWheel = this;
+        Insert ( pTimer );
+        m_nCount++;
+    }
+
+    void Cancel ( CWheelTimer* pTimer )
+    {
+        /**************************************************************************************************************
+         * This disarms pTimer. It does nothing if pTimer isn't armed.                                                *
+         **************************************************************************************************************/
+        if ( pTimer->m_pWheel != this )
+        {
+            return;
+        }
+        Unlink ( pTimer );
+        pTimer->m_pWheel = NULL;
+        m_nCount--;
+    }
+
+    void Advance ( DWORD NowMilliseconds )
+    {
+        /**************************************************************************************************************
+         * This moves the wheel's clock forward to NowMilliseconds (a GetTickCount value - wrapping is handled) and   *
+         * moves every timer that is now due to the expired list, to be collected with NextExpired.                   *
+         **************************************************************************************************************/
+        m_nClock += ( DWORD )( NowMilliseconds - m_dwLastMilliseconds );
+        m_dwLastMilliseconds = NowMilliseconds;
+        unsigned __int64 nTick = m_nClock / TIMERWHEEL_TICKMS;
+
+        if ( m_nCount == 0 )
+        {
+            m_nNextTick = nTick + 1;                               // nothing armed - no need to step through the ticks
+            return;
+        }
+
+        while ( m_nNextTick <= nTick )
+        {
+            /*
+             * We process the next tick. If level 0 is about to wrap, we first move the timers in the next slot of
+             * level 1 down (and so on up the levels), then we move the timers in the tick's level 0 slot to the
+             * expired list.
+             */
+            int nSlot = ( int )( m_nNextTick & TIMERWHEEL_SLOTMASK );
+            for ( int nLevel = 1; nLevel < TIMERWHEEL_LEVELS && nSlot == 0; nLevel++ )
+            {
+                nSlot = ( int )(( m_nNextTick >> ( TIMERWHEEL_SLOTBITS * nLevel )) & TIMERWHEEL_SLOTMASK );
+                Cascade ( &m_Slots [ nLevel ][ nSlot ] );
+            }
+            MoveAll ( &m_Slots [ 0 ][ m_nNextTick & TIMERWHEEL_SLOTMASK ], &m_Expired );
+            m_nNextTick++;
+        }
+    }
+
+    CWheelTimer* NextExpired ( void )
+    {
+        /**************************************************************************************************************
+         * This removes and returns the next timer that Advance found to be due, or NULL if there are no more. The    *
+         * timer is no longer armed when returned.                                                                    *
+         **************************************************************************************************************/
+        if ( m_Expired.pNext == &m_Expired )
+        {
+            return NULL;
+        }
+        CWheelTimer* pTimer = ( CWheelTimer* ) m_Expired.pNext;
+        Unlink ( pTimer );
+        pTimer->m_pWheel = NULL;
+        m_nCount--;
+        return pTimer;
+    }
+
+    DWORD GetNextTimeout ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the number of milliseconds until Advance next needs to be called: 0 if timers are waiting     *
+         * to be collected, the time until the first occupied level 0 slot (or until level 0 wraps, when timers at    *
+         * higher levels need to move down) or INFINITE if no timers are armed.                                       *
+         **************************************************************************************************************/
+        if ( m_Expired.pNext != &m_Expired )
+        {
+            return 0;
+        }
+        if ( m_nCount == 0 )
+        {
+            return INFINITE;
+        }
+
+        unsigned __int64 nTick = m_nNextTick;
+        for ( int nLoop = 0; nLoop < TIMERWHEEL_SLOTS; nLoop++, nTick++ )
+        {
+            if (( nTick & TIMERWHEEL_SLOTMASK ) == 0                                  // cascade due - may fill level 0
+                || m_Slots [ 0 ][ nTick & TIMERWHEEL_SLOTMASK ].pNext != &m_Slots [ 0 ][ nTick & TIMERWHEEL_SLOTMASK ] )
+            {
+                break;
+            }
+        }
+        unsigned __int64 nDueClock = nTick * TIMERWHEEL_TICKMS;
+        return nDueClock > m_nClock ? ( DWORD )( nDueClock - m_nClock ) : 0;
+    }
+
+    int GetCount ( void )
+    {
+        return m_nCount;
+    }
+    __declspec(property(get = GetCount)) int Count;
+
+private:
+    static void Empty ( SWheelLink* pList )
+    {
+        pList->pNext = pList;
+        pList->pPrevious = pList;
+    }
+
+    static void Unlink ( SWheelLink* pLink )
+    {
+        pLink->pPrevious->pNext = pLink->pNext;
+        pLink->pNext->pPrevious = pLink->pPrevious;
+        pLink->pNext = NULL;
+        pLink->pPrevious = NULL;
+    }
+
+    static void Append ( SWheelLink* pList, SWheelLink* pLink )
+    {
+        pLink->pNext = pList;
+        pLink->pPrevious = pList->pPrevious;
+        pList->pPrevious->pNext = pLink;
+        pList->pPrevious = pLink;
+    }
+
+    static void MoveAll ( SWheelLink* pFrom, SWheelLink* pTo )
+    {
+        /**************************************************************************************************************
+         * This moves every timer in list pFrom to the end of list pTo.                                               *
+         **************************************************************************************************************/
+        if ( pFrom->pNext == pFrom )
+        {
+            return;
+        }
+        pFrom->pNext->pPrevious = pTo->pPrevious;
+        pTo->pPrevious->pNext = pFrom->pNext;
+        pFrom->pPrevious->pNext = pTo;
+        pTo->pPrevious = pFrom->pPrevious;
+        Empty ( pFrom );
+    }
+
+    void Insert ( CWheelTimer* pTimer )
+    {
+        /**************************************************************************************************************
+         * This links pTimer into the slot for its due tick at the finest level that reaches that far ahead.          *
+         **************************************************************************************************************/
+        unsigned __int64 nDelta = pTimer->m_nDue - m_nNextTick;
+        int nLevel = 0;
+        while ( nLevel < TIMERWHEEL_LEVELS - 1
+            && nDelta >= (( unsigned __int64 ) 1 << ( TIMERWHEEL_SLOTBITS * ( nLevel + 1 ))))
+        {
+            nLevel++;
+        }
+        if ( nDelta >= (( unsigned __int64 ) 1 << ( TIMERWHEEL_SLOTBITS * TIMERWHEEL_LEVELS )))
+        {
+            pTimer->m_nDue = m_nNextTick + (( unsigned __int64 ) 1 << ( TIMERWHEEL_SLOTBITS * TIMERWHEEL_LEVELS )) - 1;
+        }
+        int nSlot = ( int )(( pTimer->m_nDue >> ( TIMERWHEEL_SLOTBITS * nLevel )) & TIMERWHEEL_SLOTMASK );
+        Append ( &m_Slots [ nLevel ][ nSlot ], pTimer );
+    }
+
+    void Cascade ( SWheelLink* pSlot )
+    {
+        /**************************************************************************************************************
+         * This re-inserts every timer in pSlot (a slot of a higher level whose time has come) at a finer level.      *
+         **************************************************************************************************************/
+        SWheelLink List;
+        Empty ( &List );
+        MoveAll ( pSlot, &List );
+        while ( List.pNext != &List )
+        {
+            CWheelTimer* pTimer = ( CWheelTimer* ) List.pNext;
+            Unlink ( pTimer );
+            Insert ( pTimer );
+        }
+    }
+
+    SWheelLink m_Slots [ TIMERWHEEL_LEVELS ][ TIMERWHEEL_SLOTS ];                    // lists of timers by due tick
+    SWheelLink m_Expired;                                                   // timers due, waiting for NextExpired
+    int m_nCount;                                                       // number of timers armed (including expired)
+    DWORD m_dwLastMilliseconds;                                               // GetTickCount value at last Advance
+    unsigned __int64 m_nClock;                                        // milliseconds since Reset (doesn't wrap)
+    unsigned __int64 m_nNextTick;                                                      // next tick to be processed
+ };
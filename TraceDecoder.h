@@ -0,0 +1,727 @@
+/**********************************************************************************************************************
+ *                                     This file contains the CTraceDecoder class.                                    *
+ *                                                                                                                    *
+ * This renders a binary trace (see TraceFormat.h) as the XML CEventTrace used to write, as JSON (one object per      *
+ * line) or as tab-separated text. It is built as the tracedecoder tool (TraceDecoder\TraceDecoder.vcxproj), whose    *
+ * main simply returns CTraceDecoder::Main ( argc, argv ), and run as:                                                *
+ *                                                                                                                    *
+ * tracedecoder <trace file> [xml | json | text]                                                                      *
+ *                                                                                                                    *
+ * which writes the rendered trace to standard output. The trace may still be being written: a record cut short at    *
+ * its end is left for the next time.                                                                                 *
+ *                                                                                                                    *
+ * Each run in the trace is read in two passes: the first finds the formats and identifiers it defines, the second    *
+ * renders its events in the order they were written. Event times are shown in local time, as before.                 *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+#include <windows.h>
+#include <strsafe.h>
+#include "TraceFormat.h"
+#include "HexDump.h"
+
+#define TRACEDECODER_OUTPUTBYTES    65536                                     // rendered output gathered for one write
+#define TRACEDECODER_MAXFORMATS     65536                                          // formats a run can define (a WORD)
+
+class CTraceDecoder
+ {
+public:
+    enum OutputFormat
+    {
+        XmlOutput,                                                                    // as CEventTrace wrote it before
+        JsonOutput,                                                                            // one object per record
+        TextOutput,                                                                // one tab-separated line per record
+    };
+
+    CTraceDecoder ( OutputFormat Format, HANDLE hOutput ) :
+        m_Format ( Format ),
+        m_hOutput ( hOutput ),
+        m_nOutput ( 0 ),
+        m_pContexts ( NULL ),
+        m_nContexts ( 0 ),
+        m_nRecords ( 0 ),
+        m_nUndefined ( 0 )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR. Rendered records are written to hOutput as Format.                                            *
+         **************************************************************************************************************/
+        m_pFormats = new const STraceRecord* [ TRACEDECODER_MAXFORMATS ];
+    }
+
+    virtual ~CTraceDecoder(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+        Flush();
+        delete [] m_pFormats;
+        if ( m_pContexts != NULL )
+        {
+            delete [] m_pContexts;
+        }
+    }
+
+    bool Decode ( LPCTSTR pszTraceFile )
+    {
+        /**************************************************************************************************************
+         * This renders every run in pszTraceFile. It returns FALSE if the file can't be read.                        *
+         **************************************************************************************************************/
+        HANDLE hFile = CreateFile(
+            pszTraceFile,                                                     // lpFileName [in] - name of file to open
+            GENERIC_READ,                                                           // dwDesiredAccess [in] - read only
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,       // dwShareMode [in] - it may be being written
+            NULL,                                             // lpSecurityAttributes [in] - NULL = cannot be inherited
+            OPEN_EXISTING,                                                // dwCreationDisposition [in] - it must exist
+            FILE_ATTRIBUTE_NORMAL,                             // dwFlagsAndAttributes [in] - no special attributes set
+            NULL );                                                // hTemplateFile [in] - sets attributes, NULL = none
+        if ( hFile == INVALID_HANDLE_VALUE )
+        {
+            return false;
+        }
+        DWORD dwSize = GetFileSize ( hFile, NULL );
+        BYTE* pData = new BYTE [ dwSize + 1 ];
+        DWORD dwRead = 0;
+        BOOL bRead = ReadFile ( hFile, pData, dwSize, &dwRead, NULL );
+        CloseHandle ( hFile );
+        if ( bRead == FALSE )
+        {
+            delete [] pData;
+            return false;
+        }
+
+        /*
+         * We render each run, from one RunRecord up to the next, stopping at the end or at a record cut short.
+         */
+        const BYTE* pEnd = pData + dwRead;
+        const BYTE* pRun = pData;
+        while ( IsRecord ( pRun, pEnd ))
+        {
+            const BYTE* pNext = pRun + (( STraceRecord* ) pRun )->Length;
+            while ( IsRecord ( pNext, pEnd ) && (( STraceRecord* ) pNext )->Kind != CTraceFormat::RunRecord )
+            {
+                pNext += (( STraceRecord* ) pNext )->Length;
+            }
+            DecodeRun ( pRun, pNext );
+            pRun = pNext;
+        }
+        Flush();
+        delete [] pData;
+        return true;
+    }
+
+    static int Main ( int argc, char* argv[] )
+    {
+        /**************************************************************************************************************
+         * This is the decoder's command line (see above). It returns 0 once the trace has been rendered, 1 if it     *
+         * couldn't be read and 2 if the command line is wrong.                                                       *
+         **************************************************************************************************************/
+        OutputFormat Format = XmlOutput;
+        if ( argc == 3 && lstrcmpi ( argv [ 2 ], "json" ) == 0 )
+        {
+            Format = JsonOutput;
+        }
+        else if ( argc == 3 && lstrcmpi ( argv [ 2 ], "text" ) == 0 )
+        {
+            Format = TextOutput;
+        }
+        else if ( argc != 2 && ( argc != 3 || lstrcmpi ( argv [ 2 ], "xml" ) != 0 ))
+        {
+            CTraceDecoder usage ( TextOutput, GetStdHandle ( STD_ERROR_HANDLE ));
+            usage.Append ( "usage: tracedecoder <trace file> [xml | json | text]\r\n" );
+            return 2;
+        }
+        CTraceDecoder decoder ( Format, GetStdHandle ( STD_OUTPUT_HANDLE ));
+        if ( decoder.Decode ( argv [ 1 ] ) == false )
+        {
+            CTraceDecoder error ( TextOutput, GetStdHandle ( STD_ERROR_HANDLE ));
+            error.Append ( "tracedecoder: can't read " );
+            error.Append ( argv [ 1 ] );
+            error.Append ( "\r\n" );
+            return 1;
+        }
+        return 0;
+    }
+
+    int GetRecords ( void )                                                                   // events rendered so far
+    {
+        return m_nRecords;
+    }
+    __declspec(property(get = GetRecords)) int Records;
+
+    int GetUndefined ( void )                                                // events whose format wasn't in the trace
+    {
+        return m_nUndefined;
+    }
+    __declspec(property(get = GetUndefined)) int Undefined;
+
+private:
+    static bool IsRecord ( const BYTE* pRecord, const BYTE* pEnd )
+    {
+        return pRecord + sizeof ( STraceRecord ) <= pEnd
+            && (( STraceRecord* ) pRecord )->Length >= sizeof ( STraceRecord )
+            && pRecord + (( STraceRecord* ) pRecord )->Length <= pEnd;
+    }
+
+    void DecodeRun ( const BYTE* pRun, const BYTE* pEnd )
+    {
+        /**************************************************************************************************************
+         * This renders the records from pRun up to pEnd, once it has found the formats and identifiers they use.     *
+         **************************************************************************************************************/
+        ZeroMemory ( m_pFormats, TRACEDECODER_MAXFORMATS * sizeof ( const STraceRecord* ));
+        if ( m_pContexts != NULL )
+        {
+            ZeroMemory ( m_pContexts, m_nContexts * sizeof ( const STraceRecord* ));
+        }
+        for ( const BYTE* pRecord = pRun; pRecord < pEnd; pRecord += (( STraceRecord* ) pRecord )->Length )
+        {
+            const STraceRecord* pHeader = ( const STraceRecord* ) pRecord;
+            if ( pHeader->Kind == CTraceFormat::FormatRecord )
+            {
+                m_pFormats [ pHeader->Format ] = pHeader;
+            }
+            else if ( pHeader->Kind == CTraceFormat::ContextRecord )
+            {
+                if ( pHeader->Context >= m_nContexts )
+                {
+                    DWORD nContexts = m_nContexts == 0 ? 256 : m_nContexts;
+                    while ( nContexts <= pHeader->Context )
+                    {
+                        nContexts *= 2;
+                    }
+                    const STraceRecord** pContexts = new const STraceRecord* [ nContexts ];
+                    ZeroMemory ( pContexts, nContexts * sizeof ( const STraceRecord* ));
+                    if ( m_pContexts != NULL )
+                    {
+                        CopyMemory ( pContexts, m_pContexts, m_nContexts * sizeof ( const STraceRecord* ));
+                        delete [] m_pContexts;
+                    }
+                    m_pContexts = pContexts;
+                    m_nContexts = nContexts;
+                }
+                m_pContexts [ pHeader->Context ] = pHeader;
+            }
+        }
+        for ( const BYTE* pRecord = pRun; pRecord < pEnd; pRecord += (( STraceRecord* ) pRecord )->Length )
+        {
+            Render (( const STraceRecord* ) pRecord );
+        }
+    }
+
+    void Render ( const STraceRecord* pHeader )
+    {
+        /**************************************************************************************************************
+         * This renders the record at pHeader, unless it only defines something.                                      *
+         **************************************************************************************************************/
+        const BYTE* pData = ( const BYTE* ) pHeader + sizeof ( STraceRecord );
+        const BYTE* pEnd = ( const BYTE* ) pHeader + pHeader->Length;
+        char szText [ 4096 ];
+        char szName [ 256 ];
+
+        switch ( pHeader->Kind )
+        {
+        case CTraceFormat::EventRecord:
+            FormatEvent ( pHeader, pData, pEnd, szText, sizeof ( szText ));
+            RenderStart ( pHeader, "event" );
+            RenderTrace ( szText );
+            RenderFinish ( NULL );
+            break;
+        case CTraceFormat::TextRecord:
+            ReadString ( pData, pEnd, szText, sizeof ( szText ));
+            RenderStart ( pHeader, "event" );
+            RenderTrace ( szText );
+            RenderFinish ( NULL );
+            break;
+        case CTraceFormat::HexDumpRecord:
+            {
+                /*
+                 * As CEventTrace::HexDump, only as much of the dump as fitted in 4096 chars is shown.
+                 */
+                char szHex [ 4096 ];
+                char szAscii [ 4096 ];
+                CHexDump::EncodeHex ( pData, ( int ) ( pEnd - pData ), szHex, sizeof ( szHex ));
+                CHexDump::EncodeAscii ( pData, ( int ) ( pEnd - pData ), szAscii, sizeof ( szAscii ));
+                RenderStart ( pHeader, "hexdump" );
+                if ( m_Format == XmlOutput )
+                {
+                    Append ( ">\r\n\t<hex>" );
+                    Append ( szHex );
+                    Append ( "</hex>\r\n\t<ascii>" );
+                    Append ( szAscii );
+                    Append ( "</ascii>\r\n</event>\r\n" );
+                }
+                else
+                {
+                    RenderField ( "hex", szHex, -1 );
+                    RenderField ( "ascii", szAscii, -1 );
+                    RenderFinish ( NULL );
+                }
+            }
+            break;
+        case CTraceFormat::BeginRecord:
+            RenderStart ( pHeader, "begin" );
+            RenderFinish ( ">" );
+            break;
+        case CTraceFormat::XmlRecord:
+            if ( pHeader->Format == 0 )
+            {
+                ReadString ( pData, pEnd, szName, sizeof ( szName ));          // recorded when it couldn't be numbered
+            }
+            else
+            {
+                GetFormatText ( pHeader->Format, szName, sizeof ( szName ));
+            }
+            ReadString ( pData, pEnd, szText, sizeof ( szText ));
+            if ( m_Format == XmlOutput )
+            {
+                char szOutput [ 4096 ];
+                StringCbPrintf ( szOutput, sizeof ( szOutput ), "\t<%s>%s</%s>\r\n", szName, szText, szName );
+                Append ( szOutput );
+            }
+            else
+            {
+                RenderStart ( pHeader, "xml" );
+                RenderField ( "name", szName, -1 );
+                RenderField ( "value", szText, -1 );
+                RenderFinish ( NULL );
+            }
+            break;
+        case CTraceFormat::EndRecord:
+            if ( m_Format == XmlOutput )
+            {
+                Append ( "</event>\r\n" );
+            }
+            else
+            {
+                RenderStart ( pHeader, "end" );
+                RenderFinish ( NULL );
+            }
+            break;
+        default:
+            return;                                                              // a run, format or context definition
+        }
+        m_nRecords++;
+    }
+
+    void RenderStart ( const STraceRecord* pHeader, const char* pszKind )
+    {
+        /**************************************************************************************************************
+         * This renders what every event starts with: the identifiers it was recorded with and its local time (and,   *
+         * except in XML, its kind and level).                                                                        *
+         **************************************************************************************************************/
+        char szIdentity [ 256 ];
+        char szPort [ 256 ];
+        char szDevice [ 256 ];
+        const char* pszIdentity = NULL;
+        const char* pszPort = NULL;
+        const char* pszDevice = NULL;
+        if ( pHeader->Context < m_nContexts && m_pContexts [ pHeader->Context ] != NULL )
+        {
+            const STraceRecord* pContext = m_pContexts [ pHeader->Context ];
+            const BYTE* pData = ( const BYTE* ) pContext + sizeof ( STraceRecord );
+            const BYTE* pEnd = ( const BYTE* ) pContext + pContext->Length;
+            pszIdentity = ReadString ( pData, pEnd, szIdentity, sizeof ( szIdentity ));
+            pszPort = ReadString ( pData, pEnd, szPort, sizeof ( szPort ));
+            pszDevice = ReadString ( pData, pEnd, szDevice, sizeof ( szDevice ));
+        }
+
+        FILETIME fileTime;
+        FILETIME localTime;
+        SYSTEMTIME SystemTime;
+        fileTime.dwLowDateTime = ( DWORD ) pHeader->Time;
+        fileTime.dwHighDateTime = ( DWORD ) ( pHeader->Time >> 32 );
+        FileTimeToLocalFileTime ( &fileTime, &localTime );
+        FileTimeToSystemTime ( &localTime, &SystemTime );
+        char szDate [ 32 ];
+        char szTime [ 32 ];
+        StringCbPrintf ( szDate, sizeof ( szDate ), "%d/%d/%d", SystemTime.wYear, SystemTime.wMonth, SystemTime.wDay );
+        StringCbPrintf ( szTime, sizeof ( szTime ), "%02d:%02d:%02d.%03d",
+            SystemTime.wHour, SystemTime.wMinute, SystemTime.wSecond, SystemTime.wMilliseconds );
+
+        char szLevel [ 16 ];
+        StringCbPrintf ( szLevel, sizeof ( szLevel ), "%d", pHeader->Level );
+        m_bFirstField = true;
+        switch ( m_Format )
+        {
+        case XmlOutput:
+            Append ( "<event " );                                                      // as CEventTrace::BuildXmlStart
+            RenderField ( "identity", pszIdentity, -1 );
+            RenderField ( "port", pszPort, -1 );
+            RenderField ( "device", pszDevice, -1 );
+            RenderField ( "date", szDate, -1 );
+            RenderField ( "time", szTime, -1 );
+            break;
+        case JsonOutput:
+            Append ( "{" );
+            RenderField ( "date", szDate, -1 );
+            RenderField ( "time", szTime, -1 );
+            Append ( ",\"level\":" );                                                                       // a number
+            Append ( szLevel );
+            RenderField ( "kind", pszKind, -1 );
+            RenderField ( "identity", pszIdentity, -1 );
+            RenderField ( "port", pszPort, -1 );
+            RenderField ( "device", pszDevice, -1 );
+            break;
+        case TextOutput:
+            Append ( szDate );
+            Append ( " " );
+            Append ( szTime );
+            RenderField ( "level", szLevel, -1 );
+            RenderField ( "kind", pszKind, -1 );
+            RenderField ( "identity", pszIdentity != NULL ? pszIdentity : "", -1 );
+            RenderField ( "port", pszPort != NULL ? pszPort : "", -1 );
+            RenderField ( "device", pszDevice != NULL ? pszDevice : "", -1 );
+            break;
+        }
+    }
+
+    void RenderField ( const char* pszName, const char* pszValue, int Length )
+    {
+        /**************************************************************************************************************
+         * This renders a field of an event (nothing if pszValue is NULL), escaping Length chars of pszValue (all of  *
+         * it if -1) as the output requires.                                                                          *
+         **************************************************************************************************************/
+        if ( pszValue == NULL )
+        {
+            return;
+        }
+        switch ( m_Format )
+        {
+        case XmlOutput:
+            Append ( pszName );
+            Append ( "=\"" );
+            AppendEscaped ( pszValue, Length );
+            Append ( "\" " );
+            break;
+        case JsonOutput:
+            Append ( m_bFirstField == true ? "\"" : ",\"" );
+            Append ( pszName );
+            Append ( "\":\"" );
+            AppendEscaped ( pszValue, Length );
+            Append ( "\"" );
+            break;
+        case TextOutput:
+            Append ( "\t" );
+            AppendEscaped ( pszValue, Length );
+            break;
+        }
+        m_bFirstField = false;
+    }
+
+    void RenderTrace ( const char* pszText )
+    {
+        /**************************************************************************************************************
+         * This renders the formatted text of an event (in XML, as CEventTrace::Event did).                           *
+         **************************************************************************************************************/
+        if ( m_Format == XmlOutput )
+        {
+            Append ( " trace=\"" );
+            AppendEscaped ( pszText, -1 );
+            Append ( "\" />" );
+        }
+        else
+        {
+            RenderField ( "trace", pszText, -1 );
+        }
+    }
+
+    void RenderFinish ( const char* pszXml )
+    {
+        /**************************************************************************************************************
+         * This ends an event, with pszXml (if any) in XML.                                                           *
+         **************************************************************************************************************/
+        switch ( m_Format )
+        {
+        case XmlOutput:
+            if ( pszXml != NULL )
+            {
+                Append ( pszXml );
+            }
+            break;
+        case JsonOutput:
+            Append ( "}" );
+            break;
+        case TextOutput:
+            break;
+        }
+        Append ( "\r\n" );
+    }
+
+    void FormatEvent (
+        const STraceRecord* pHeader, const BYTE* pData, const BYTE* pEnd, char* pszOutput, size_t nSize )
+    {
+        /**************************************************************************************************************
+         * This formats the arguments recorded from pData up to pEnd per the event's format string, as StringCchPrintf*
+         * would have formatted them when the event was recorded.                                                     *
+         **************************************************************************************************************/
+        char szFormat [ 4096 ];
+        char szSignature [ TRACEFORMAT_MAXARGS + 1 ];
+        if ( GetFormatText ( pHeader->Format, szFormat, sizeof ( szFormat )) == false
+            || CTraceFormat::ParseSignature ( szFormat, szSignature, sizeof ( szSignature )) < 0 )
+        {
+            m_nUndefined++;
+            StringCbPrintf ( pszOutput, nSize, "(format %d isn't in the trace)", pHeader->Format );
+            return;
+        }
+
+        size_t nOutput = 0;
+        int nArgument = 0;
+        pszOutput [ 0 ] = '\0';
+        for ( const char* pszScan = szFormat; *pszScan != '\0' && nOutput + 1 < nSize; )
+        {
+            if ( *pszScan != '%' )
+            {
+                pszOutput [ nOutput++ ] = *pszScan++;
+                pszOutput [ nOutput ] = '\0';
+                continue;
+            }
+            if ( pszScan [ 1 ] == '%' )
+            {
+                pszOutput [ nOutput++ ] = '%';
+                pszOutput [ nOutput ] = '\0';
+                pszScan += 2;
+                continue;
+            }
+
+            /*
+             * We copy the conversion's flags, width and precision (with any * filled in from the arguments), skip
+             * its length, then format the next argument with a length that suits how it was recorded.
+             */
+            char szSpec [ 64 ];
+            size_t nSpec = 0;
+            szSpec [ nSpec++ ] = *pszScan++;
+            while ( *pszScan != '\0' && strchr ( "-+ #0123456789.*", *pszScan ) != NULL && nSpec < 32 )
+            {
+                if ( *pszScan == '*' )
+                {
+                    int Value = ( int ) ReadNumber ( pData, pEnd, sizeof ( int ));
+                    nArgument++;
+                    StringCbPrintf ( szSpec + nSpec, sizeof ( szSpec ) - nSpec, "%d", Value );
+                    nSpec += lstrlen ( szSpec + nSpec );
+                }
+                else
+                {
+                    szSpec [ nSpec++ ] = *pszScan;
+                }
+                pszScan++;
+            }
+            while ( *pszScan != '\0' && strchr ( "hlLIzj0123456789", *pszScan ) != NULL )
+            {
+                pszScan++;                                                                           // e.g. l, I64, ll
+            }
+            char Conversion = *pszScan != '\0' ? *pszScan++ : 'd';
+            char Type = ( char ) CTraceFormat::IntArgument;                             // if it took too few arguments
+            if ( szSignature [ nArgument ] != '\0' )
+            {
+                Type = szSignature [ nArgument++ ];
+            }
+            switch ( Type )
+            {
+            case CTraceFormat::LongLongArgument:
+            case CTraceFormat::SizeArgument:
+            case CTraceFormat::PointerArgument:
+                {
+                    LONGLONG Value = ( LONGLONG ) ReadNumber ( pData, pEnd, sizeof ( LONGLONG ));
+                    if ( Conversion == 'p' )
+                    {
+                        Conversion = 'X';
+                    }
+                    StringCbPrintf ( szSpec + nSpec, sizeof ( szSpec ) - nSpec, "I64%c", Conversion );
+                    StringCbPrintf ( pszOutput + nOutput, nSize - nOutput, szSpec, Value );
+                }
+                break;
+            case CTraceFormat::DoubleArgument:
+                {
+                    double Value = 0;
+                    if ( pData + sizeof ( Value ) <= pEnd )
+                    {
+                        CopyMemory ( &Value, pData, sizeof ( Value ));
+                        pData += sizeof ( Value );
+                    }
+                    szSpec [ nSpec++ ] = Conversion;
+                    szSpec [ nSpec ] = '\0';
+                    StringCbPrintf ( pszOutput + nOutput, nSize - nOutput, szSpec, Value );
+                }
+                break;
+            case CTraceFormat::StringArgument:
+                {
+                    char szValue [ 4096 ];
+                    const char* pszValue = ReadString ( pData, pEnd, szValue, sizeof ( szValue ));
+                    szSpec [ nSpec++ ] = 's';
+                    szSpec [ nSpec ] = '\0';
+                    StringCbPrintf (
+                        pszOutput + nOutput, nSize - nOutput, szSpec, pszValue != NULL ? pszValue : "(null)" );
+                }
+                break;
+            default:
+                {
+                    int Value = ( int ) ReadNumber ( pData, pEnd, sizeof ( int ));
+                    szSpec [ nSpec++ ] = Conversion;
+                    szSpec [ nSpec ] = '\0';
+                    StringCbPrintf ( pszOutput + nOutput, nSize - nOutput, szSpec, Value );
+                }
+                break;
+            }
+            nOutput += lstrlen ( pszOutput + nOutput );
+        }
+    }
+
+    bool GetFormatText ( WORD Format, char* pszText, size_t nSize )
+    {
+        /**************************************************************************************************************
+         * This copies the text of format (or XML name) Format to pszText. It returns FALSE if the run didn't define  *
+         * it.                                                                                                        *
+         **************************************************************************************************************/
+        const STraceRecord* pHeader = m_pFormats [ Format ];
+        if ( pHeader == NULL )
+        {
+            StringCbPrintf ( pszText, nSize, "format%d", Format );
+            return false;
+        }
+        size_t nLength = pHeader->Length - sizeof ( STraceRecord );
+        if ( nLength >= nSize )
+        {
+            nLength = nSize - 1;
+        }
+        CopyMemory ( pszText, ( const BYTE* ) pHeader + sizeof ( STraceRecord ), nLength );
+        pszText [ nLength ] = '\0';
+        return true;
+    }
+
+    static ULONGLONG ReadNumber ( const BYTE*& pData, const BYTE* pEnd, size_t nBytes )
+    {
+        ULONGLONG Value = 0;
+        if ( pData + nBytes > pEnd )
+        {
+            return Value;                                                                  // it took too few arguments
+        }
+        if ( nBytes == sizeof ( int ))
+        {
+            int nValue = 0;
+            CopyMemory ( &nValue, pData, sizeof ( nValue ));
+            Value = ( ULONGLONG ) ( LONGLONG ) nValue;                                                 // keep the sign
+        }
+        else
+        {
+            CopyMemory ( &Value, pData, sizeof ( Value ));
+        }
+        pData += nBytes;
+        return Value;
+    }
+
+    static const char* ReadString ( const BYTE*& pData, const BYTE* pEnd, char* pszValue, size_t nSize )
+    {
+        /**************************************************************************************************************
+         * This reads a string recorded by CTraceRecord::AddString into pszValue. It returns NULL if a NULL pointer   *
+         * was recorded.                                                                                              *
+         **************************************************************************************************************/
+        pszValue [ 0 ] = '\0';
+        if ( pData + sizeof ( WORD ) > pEnd )
+        {
+            return pszValue;
+        }
+        WORD Length = 0;
+        CopyMemory ( &Length, pData, sizeof ( Length ));                                      // records aren't aligned
+        pData += sizeof ( WORD );
+        if ( Length == TRACEFORMAT_NULLSTRING )
+        {
+            return NULL;
+        }
+        size_t nLength = Length;
+        if ( nLength > ( size_t ) ( pEnd - pData ))
+        {
+            nLength = pEnd - pData;
+        }
+        size_t nCopy = nLength < nSize ? nLength : nSize - 1;
+        CopyMemory ( pszValue, pData, nCopy );
+        pszValue [ nCopy ] = '\0';
+        pData += nLength;
+        return pszValue;
+    }
+
+    void AppendEscaped ( const char* pszValue, int Length )
+    {
+        /**************************************************************************************************************
+         * This appends Length chars of pszValue (all of it if -1), escaping what the output can't hold as it is: the *
+         * XML chars CEventTrace::XmlEncode escapes, or quotes, backslashes and control chars in JSON and tabs and    *
+         * line ends in text.                                                                                         *
+         **************************************************************************************************************/
+        char szEscape [ 8 ];
+        for ( int nOffset = 0; Length < 0 ? pszValue [ nOffset ] != '\0' : nOffset < Length; nOffset++ )
+        {
+            char Value = pszValue [ nOffset ];
+            const char* pszEscape = NULL;
+            switch ( m_Format )
+            {
+            case XmlOutput:
+                pszEscape = Value == '<' ? "&lt;" : Value == '>' ? "&gt;" : Value == '&' ? "&amp;"
+                    : Value == '\'' ? "&apos;" : Value == '"' ? "&quot;" : NULL;
+                break;
+            case JsonOutput:
+                if ( Value == '"' || Value == '\\' )
+                {
+                    szEscape [ 0 ] = '\\';
+                    szEscape [ 1 ] = Value;
+                    szEscape [ 2 ] = '\0';
+                    pszEscape = szEscape;
+                }
+                else if (( BYTE ) Value < 0x20 )
+                {
+                    StringCbPrintf ( szEscape, sizeof ( szEscape ), "\\u%04x", ( BYTE ) Value );
+                    pszEscape = szEscape;
+                }
+                break;
+            case TextOutput:
+                pszEscape = Value == '\t' ? "\\t" : Value == '\r' ? "\\r" : Value == '\n' ? "\\n" : NULL;
+                break;
+            }
+            if ( pszEscape != NULL )
+            {
+                Append ( pszEscape );
+            }
+            else
+            {
+                if ( m_nOutput == TRACEDECODER_OUTPUTBYTES )
+                {
+                    Flush();
+                }
+                m_Output [ m_nOutput++ ] = Value;
+            }
+        }
+    }
+
+    void Append ( const char* pszText )
+    {
+        for ( const char* pszScan = pszText; *pszScan != '\0'; pszScan++ )
+        {
+            if ( m_nOutput == TRACEDECODER_OUTPUTBYTES )
+            {
+                Flush();
+            }
+            m_Output [ m_nOutput++ ] = *pszScan;
+        }
+    }
+
+    void Flush ( void )
+    {
+        if ( m_nOutput > 0 )
+        {
+            DWORD dwBytesWritten = 0;
+            WriteFile ( m_hOutput, m_Output, m_nOutput, &dwBytesWritten, NULL );
+            m_nOutput = 0;
+        }
+    }
+
+    OutputFormat m_Format;
+    HANDLE m_hOutput;                                                                       // rendered records go here
+    char m_Output [ TRACEDECODER_OUTPUTBYTES ];                                               // gathered for one write
+    DWORD m_nOutput;                                                                          // bytes used in m_Output
+    const STraceRecord** m_pFormats;                                              // the run's FormatRecords, by number
+    const STraceRecord** m_pContexts;                                            // the run's ContextRecords, by number
+    DWORD m_nContexts;                                                                          // slots in m_pContexts
+    bool m_bFirstField;                                                             // no field rendered for this event
+    int m_nRecords;
+    int m_nUndefined;
+ };
@@ -0,0 +1,10 @@
+// TraceDecoder.cpp : the tracedecoder tool
+// Everything it does is in CTraceDecoder (see TraceDecoder.h)
+
+#include "stdafx.h"
+#include "TraceDecoder.h"
+
+int main ( int argc, char* argv[] )
+{
+    return CTraceDecoder::Main ( argc, argv );
+}
@@ -0,0 +1,441 @@
+/**********************************************************************************************************************
+ *                            This file contains the CTraceFormat and CTraceRecord classes.                           *
+ *                                                                                                                    *
+ * These define the binary trace written instead of XML when "Binary Trace" is set in the profile. Rendering an event *
+ * as XML cost more than the work it described: the arguments were formatted, the result escaped a character at a     *
+ * time and the local time converted and appended, all before the event was written. A binary event is recorded as a  *
+ * fixed header (STraceRecord) holding the time as a FILETIME, the level and a number standing for the event's format *
+ * string, followed by the raw arguments; a hex dump is followed by the raw bytes. CTraceDecoder (TraceDecoder.h)     *
+ * turns the trace back into XML, JSON or text afterwards.                                                            *
+ *                                                                                                                    *
+ * Each format string is interned by CTraceFormat the first time it is used, and a FormatRecord giving its number and *
+ * text is written to the trace then. The identifiers set with CEventTrace::Identifier are written once as a          *
+ * ContextRecord, and each event refers to them by number. Every run of the application starts the trace with a       *
+ * RunRecord, after which its numbers start again. Records from different threads may be written up to a flush apart  *
+ * (see EventSink.h), so an event may come before the definitions it refers to; the decoder reads a whole run before  *
+ * rendering it.                                                                                                      *
+ *                                                                                                                    *
+ * The arguments an event's format string takes are worked out once, when it is interned, as a signature with one     *
+ * character per argument (see ArgumentType). Formats with conversions this can't record (wide strings, %n), or more  *
+ * than TRACEFORMAT_MAXFORMATS / 2 formats, are recorded as a TextRecord holding the formatted event instead.         *
+ *                                                                                                                    *
+ *                                         Copyright (c) Protel Inc. 2009-2011                                        *
+ **********************************************************************************************************************/
+
+#pragma once
+
+#include <windows.h>
+#include <stdarg.h>
+
+#define TRACEFORMAT_MAXRECORD   4096                        // longest record (as the XML, longer events are truncated)
+#define TRACEFORMAT_MAXFORMATS  4096                               // slots for interned formats (must be a power of 2)
+#define TRACEFORMAT_MAXARGS     32                                           // most arguments a format string can take
+#define TRACEFORMAT_MAGIC       0x43525450                                                     // "PTRC" in a RunRecord
+#define TRACEFORMAT_VERSION     1                                                                     // in a RunRecord
+#define TRACEFORMAT_NULLSTRING  0xffff                                     // string length recorded for a NULL pointer
+
+#pragma pack ( push, 1 )
+struct STraceRecord
+{
+    WORD Length;                                                                  // bytes in the record, this included
+    BYTE Kind;                                                                              // CTraceFormat::RecordKind
+    BYTE Level;                                                                              // CEventTrace::TraceLevel
+    ULONGLONG Time;                                                                 // when recorded, as a UTC FILETIME
+    DWORD Context;                                                         // identifiers (see ContextRecord), 0 = none
+    WORD Format;                                                     // format or XML name (see FormatRecord), 0 = none
+};
+#pragma pack ( pop )
+
+class CTraceFormat
+ {
+public:
+    enum RecordKind
+    {
+        RunRecord = 1,                                               // Time = start of the run, then magic and version
+        FormatRecord,                                                    // Format = the number, then the format string
+        ContextRecord,                                  // Context = the number, then identity, port and device strings
+        EventRecord,                                                      // CEventTrace::Event, then the raw arguments
+        TextRecord,                                                     // CEventTrace::Event, then the formatted event
+        BeginRecord,                                                                           // CEventTrace::BeginXML
+        XmlRecord,                                                   // CEventTrace::XML, Format = name, then the value
+        EndRecord,                                                                               // CEventTrace::EndXML
+        HexDumpRecord,                                                      // CEventTrace::HexDump, then the raw bytes
+    };
+
+    enum ArgumentType                                                             // characters in a format's signature
+    {
+        IntArgument = 'i',                                                   // %d, %u, %x, %c, %ld, * widths - 4 bytes
+        LongLongArgument = 'q',                                                                // %I64d, %lld - 8 bytes
+        SizeArgument = 'z',                                                           // %Iu, %zu - recorded as 8 bytes
+        PointerArgument = 'p',                                                              // %p - recorded as 8 bytes
+        DoubleArgument = 'f',                                                                   // %f, %g, %e - 8 bytes
+        StringArgument = 's',                                                         // %s - length (WORD), then chars
+    };
+
+    struct SFormat                                                                                // an interned format
+    {
+        DWORD dwHash;
+        WORD nFormat;                                                               // its number in the trace (from 1)
+        bool bRecordable;                                                        // FALSE = events are recorded as text
+        char* pszText;                                                                                      // our copy
+        char szSignature [ TRACEFORMAT_MAXARGS + 1 ];                                  // one ArgumentType per argument
+    };
+
+    static CTraceFormat& Instance ( void )
+    {
+        /**************************************************************************************************************
+         * This returns the table of formats shared by every CEventTrace.                                             *
+         **************************************************************************************************************/
+        static CTraceFormat traceFormat;
+        return traceFormat;
+    }
+
+    const SFormat* Intern ( const char* pszFormat, bool& bNew )
+    {
+        /**************************************************************************************************************
+         * This returns the interned pszFormat, interning it first if this is the first time it has been used (bNew is*
+         * then TRUE and the caller writes its FormatRecord). It returns NULL if the table is full. Formats are looked*
+         * up without a lock; only adding one takes it.                                                               *
+         **************************************************************************************************************/
+        bNew = false;
+        DWORD dwHash = Hash ( pszFormat );
+        DWORD dwSlot = dwHash & ( TRACEFORMAT_MAXFORMATS - 1 );
+        for ( ;; )
+        {
+            SFormat* pFormat = m_pSlots [ dwSlot ];
+            if ( pFormat == NULL )
+            {
+                break;                                                                            // not interned (yet)
+            }
+            if ( pFormat->dwHash == dwHash && lstrcmp ( pFormat->pszText, pszFormat ) == 0 )
+            {
+                return pFormat;
+            }
+            dwSlot = ( dwSlot + 1 ) & ( TRACEFORMAT_MAXFORMATS - 1 );
+        }
+
+        EnterCriticalSection ( &m_csFormats );
+        SFormat* pFormat = NULL;
+        for ( ;; )                                                       // from where we stopped - it may be taken now
+        {
+            pFormat = m_pSlots [ dwSlot ];
+            if ( pFormat == NULL || ( pFormat->dwHash == dwHash && lstrcmp ( pFormat->pszText, pszFormat ) == 0 ))
+            {
+                break;
+            }
+            dwSlot = ( dwSlot + 1 ) & ( TRACEFORMAT_MAXFORMATS - 1 );
+        }
+        if ( pFormat == NULL && m_nFormats < TRACEFORMAT_MAXFORMATS / 2 )                      // keep the probes short
+        {
+            int Length = lstrlen ( pszFormat ) + 1;
+            pFormat = new SFormat;
+            pFormat->dwHash = dwHash;
+            pFormat->nFormat = ( WORD ) ++m_nFormats;
+            pFormat->pszText = new char [ Length ];
+            CopyMemory ( pFormat->pszText, pszFormat, Length );
+            pFormat->bRecordable = ParseSignature (
+                pszFormat, pFormat->szSignature, sizeof ( pFormat->szSignature )) >= 0;
+            MemoryBarrier();                                               // complete before other threads can find it
+            m_pSlots [ dwSlot ] = pFormat;
+            bNew = true;
+        }
+        LeaveCriticalSection ( &m_csFormats );
+        return pFormat;
+    }
+
+    static DWORD NewContext ( void )
+    {
+        /**************************************************************************************************************
+         * This returns a number for a new set of identifiers (see ContextRecord).                                    *
+         **************************************************************************************************************/
+        static volatile LONG nContexts = 0;
+        return ( DWORD ) InterlockedIncrement ( &nContexts );
+    }
+
+    static int ParseSignature ( const char* pszFormat, char* pszSignature, int nSize )
+    {
+        /**************************************************************************************************************
+         * This works out the arguments pszFormat takes, placing one ArgumentType for each in pszSignature (which     *
+         * holds nSize chars). It returns the number of arguments, or -1 if pszFormat has a conversion that can't be  *
+         * recorded or takes too many arguments. CTraceDecoder uses this to read the arguments back.                  *
+         **************************************************************************************************************/
+        int nArguments = 0;
+        for ( const char* pszScan = pszFormat; *pszScan != '\0'; pszScan++ )
+        {
+            if ( *pszScan != '%' )
+            {
+                continue;
+            }
+            pszScan++;
+            if ( *pszScan == '%' )
+            {
+                continue;                                                                          // a literal percent
+            }
+            while ( *pszScan != '\0' && strchr ( "-+ #0", *pszScan ) != NULL )                                 // flags
+            {
+                pszScan++;
+            }
+            for ( int nPart = 0; nPart < 2; nPart++ )                                          // width, then precision
+            {
+                if ( nPart == 1 )
+                {
+                    if ( *pszScan != '.' )
+                    {
+                        break;
+                    }
+                    pszScan++;
+                }
+                if ( *pszScan == '*' )
+                {
+                    if ( nArguments >= nSize - 1 )
+                    {
+                        return -1;
+                    }
+                    pszSignature [ nArguments++ ] = ( char ) IntArgument;
+                    pszScan++;
+                }
+                while ( *pszScan >= '0' && *pszScan <= '9' )
+                {
+                    pszScan++;
+                }
+            }
+
+            char Type = ( char ) IntArgument;                                                        // from the length
+            if ( strncmp ( pszScan, "I64", 3 ) == 0 )
+            {
+                Type = ( char ) LongLongArgument;
+                pszScan += 3;
+            }
+            else if ( strncmp ( pszScan, "I32", 3 ) == 0 )
+            {
+                pszScan += 3;
+            }
+            else if ( strncmp ( pszScan, "ll", 2 ) == 0 )
+            {
+                Type = ( char ) LongLongArgument;
+                pszScan += 2;
+            }
+            else if ( *pszScan == 'I' || *pszScan == 'z' )
+            {
+                Type = ( char ) SizeArgument;
+                pszScan++;
+            }
+            else if ( *pszScan == 'l' )
+            {
+                if ( pszScan [ 1 ] == 'c' || pszScan [ 1 ] == 's' )
+                {
+                    return -1;                                                                       // wide characters
+                }
+                pszScan++;                                                                 // long is an int on Windows
+            }
+            else if ( *pszScan == 'h' )
+            {
+                pszScan += pszScan [ 1 ] == 'h' ? 2 : 1;
+            }
+            else if ( *pszScan == 'L' )
+            {
+                pszScan++;                                                        // long double is a double on Windows
+            }
+
+            switch ( *pszScan )
+            {
+            case 'd':
+            case 'i':
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+            case 'c':
+                break;
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                Type = ( char ) DoubleArgument;
+                break;
+            case 's':
+                Type = ( char ) StringArgument;
+                break;
+            case 'p':
+                Type = ( char ) PointerArgument;
+                break;
+            default:
+                return -1;                                                            // %n, %S, %C or not a conversion
+            }
+            if ( nArguments >= nSize - 1 )
+            {
+                return -1;
+            }
+            pszSignature [ nArguments++ ] = Type;
+        }
+        pszSignature [ nArguments ] = '\0';
+        return nArguments;
+    }
+
+private:
+    CTraceFormat(void) :
+        m_nFormats ( 0 )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR.                                                                                               *
+         **************************************************************************************************************/
+        InitializeCriticalSection ( &m_csFormats );
+        ZeroMemory ( ( void* ) m_pSlots, sizeof ( m_pSlots ));
+    }
+
+    virtual ~CTraceFormat(void)
+    {
+        /**************************************************************************************************************
+         * DESTRUCTOR.                                                                                                *
+         **************************************************************************************************************/
+        for ( int nSlot = 0; nSlot < TRACEFORMAT_MAXFORMATS; nSlot++ )
+        {
+            if ( m_pSlots [ nSlot ] != NULL )
+            {
+                delete [] m_pSlots [ nSlot ]->pszText;
+                delete m_pSlots [ nSlot ];
+            }
+        }
+        DeleteCriticalSection ( &m_csFormats );
+    }
+
+    static DWORD Hash ( const char* pszFormat )
+    {
+        DWORD dwHash = 2166136261;                                                                            // FNV-1a
+        for ( const char* pszScan = pszFormat; *pszScan != '\0'; pszScan++ )
+        {
+            dwHash = ( dwHash ^ ( BYTE ) *pszScan ) * 16777619;
+        }
+        return dwHash;
+    }
+
+    SFormat* volatile m_pSlots [ TRACEFORMAT_MAXFORMATS ];                                           // open addressing
+    CRITICAL_SECTION m_csFormats;                                                              // taken to add a format
+    int m_nFormats;                                                                                  // interned so far
+ };
+
+class CTraceRecord
+ {
+public:
+    CTraceRecord ( CTraceFormat::RecordKind Kind, int Level, DWORD Context, WORD Format )
+    {
+        /**************************************************************************************************************
+         * CONSTRUCTOR. This starts a record of Kind, stamped with the current time.                                  *
+         **************************************************************************************************************/
+        STraceRecord* pHeader = ( STraceRecord* ) m_Data;
+        FILETIME fileTime;
+        GetSystemTimeAsFileTime ( &fileTime );
+        pHeader->Kind = ( BYTE ) Kind;
+        pHeader->Level = ( BYTE ) Level;
+        pHeader->Time = (( ULONGLONG ) fileTime.dwHighDateTime << 32 ) | fileTime.dwLowDateTime;
+        pHeader->Context = Context;
+        pHeader->Format = Format;
+        m_nLength = sizeof ( STraceRecord );
+        pHeader->Length = ( WORD ) m_nLength;
+    }
+
+    void AddBytes ( const void* pData, int Length )
+    {
+        /**************************************************************************************************************
+         * This appends Length bytes of pData, as many as fit.                                                        *
+         **************************************************************************************************************/
+        if ( Length > TRACEFORMAT_MAXRECORD - m_nLength )
+        {
+            Length = TRACEFORMAT_MAXRECORD - m_nLength;
+        }
+        if ( Length > 0 )
+        {
+            CopyMemory ( m_Data + m_nLength, pData, Length );
+            m_nLength += Length;
+            (( STraceRecord* ) m_Data )->Length = ( WORD ) m_nLength;
+        }
+    }
+
+    void AddString ( const char* pszString )
+    {
+        /**************************************************************************************************************
+         * This appends pszString as its length (a WORD, TRACEFORMAT_NULLSTRING if it is NULL) followed by its chars, *
+         * shortened to fit.                                                                                          *
+         **************************************************************************************************************/
+        WORD Length = TRACEFORMAT_NULLSTRING;
+        if ( pszString != NULL )
+        {
+            int nRoom = TRACEFORMAT_MAXRECORD - m_nLength - ( int ) sizeof ( WORD );
+            int nLength = lstrlen ( pszString );
+            Length = ( WORD ) ( nLength < nRoom ? nLength : ( nRoom > 0 ? nRoom : 0 ));
+        }
+        if ( m_nLength + ( int ) sizeof ( WORD ) <= TRACEFORMAT_MAXRECORD )
+        {
+            AddBytes ( &Length, sizeof ( Length ));
+            if ( pszString != NULL )
+            {
+                AddBytes ( pszString, Length );
+            }
+        }
+    }
+
+    void AddArguments ( const char* pszSignature, va_list args )
+    {
+        /**************************************************************************************************************
+         * This appends each argument in args as pszSignature (see CTraceFormat::ParseSignature) says it was passed.  *
+         **************************************************************************************************************/
+        for ( const char* pszType = pszSignature; *pszType != '\0'; pszType++ )
+        {
+            switch ( *pszType )
+            {
+            case CTraceFormat::IntArgument:
+                {
+                    int Value = va_arg ( args, int );
+                    AddBytes ( &Value, sizeof ( Value ));
+                }
+                break;
+            case CTraceFormat::LongLongArgument:
+                {
+                    LONGLONG Value = va_arg ( args, LONGLONG );
+                    AddBytes ( &Value, sizeof ( Value ));
+                }
+                break;
+            case CTraceFormat::SizeArgument:
+                {
+                    ULONGLONG Value = va_arg ( args, size_t );
+                    AddBytes ( &Value, sizeof ( Value ));
+                }
+                break;
+            case CTraceFormat::PointerArgument:
+                {
+                    ULONGLONG Value = ( ULONGLONG ) ( ULONG_PTR ) va_arg ( args, void* );
+                    AddBytes ( &Value, sizeof ( Value ));
+                }
+                break;
+            case CTraceFormat::DoubleArgument:
+                {
+                    double Value = va_arg ( args, double );
+                    AddBytes ( &Value, sizeof ( Value ));
+                }
+                break;
+            case CTraceFormat::StringArgument:
+                AddString ( va_arg ( args, const char* ));
+                break;
+            }
+        }
+    }
+
+    const char* GetData ( void )
+    {
+        return ( const char* ) m_Data;
+    }
+    __declspec(property(get = GetData)) const char* Data;
+
+    int GetLength ( void )
+    {
+        return m_nLength;
+    }
+    __declspec(property(get = GetLength)) int Length;
+
+private:
+    BYTE m_Data [ TRACEFORMAT_MAXRECORD ];
+    int m_nLength;                                                                                      // bytes so far
+ };